@@ -13,19 +13,224 @@
 // limitations under the License.
 
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "api/wenet_api.h"
 
 namespace py = pybind11;
 
 
+// The samples of a buffer, numpy int16/float32 arrays or the bytes of
+// 16 bits PCM, which are read in place without copying
+struct Samples {
+  const void* data = nullptr;
+  int num_samples = 0;
+  bool is_float = false;
+};
+
+
+static Samples GetSamples(const py::buffer_info& info) {
+  if (info.ndim != 1 || info.strides[0] != info.itemsize) {
+    throw std::invalid_argument("Expect a contiguous 1-D buffer of samples");
+  }
+  Samples samples;
+  samples.data = info.ptr;
+  if (info.format == py::format_descriptor<float>::format()) {
+    samples.is_float = true;
+    samples.num_samples = info.size;
+  } else if (info.format == py::format_descriptor<int16_t>::format()) {
+    samples.num_samples = info.size;
+  } else if (info.itemsize == 1) {  // bytes, uint8 or int8
+    if (info.size % 2 != 0) {
+      throw std::invalid_argument("Expect bytes of 16 bits PCM");
+    }
+    samples.num_samples = info.size / 2;
+  } else {
+    throw std::invalid_argument("Expect int16, float32 or bytes, got " +
+                                info.format);
+  }
+  return samples;
+}
+
+
+static void DecodeSamples(void* decoder, const Samples& samples, int last) {
+  if (samples.is_float) {
+    wenet_decode_float(decoder, static_cast<const float*>(samples.data),
+                       samples.num_samples, last);
+  } else {
+    wenet_decode(decoder, static_cast<const char*>(samples.data),
+                 samples.num_samples * 2, last);
+  }
+}
+
+
+static void Decode(void* decoder, py::buffer pcm, int last) {
+  py::buffer_info info = pcm.request();
+  Samples samples = GetSamples(info);
+  py::gil_scoped_release release;
+  DecodeSamples(decoder, samples, last);
+}
+
+
+static void* LoadModel(const std::string& model_dir, int use_onnx,
+                       int quantized, int intra_op_threads,
+                       int inter_op_threads, int chunk_size) {
+  wenet_model_options opts;
+  wenet_model_options_default(&opts);
+  opts.use_onnx = use_onnx;
+  opts.quantized = quantized;
+  opts.intra_op_threads = intra_op_threads;
+  opts.inter_op_threads = inter_op_threads;
+  opts.chunk_size = chunk_size;
+  py::gil_scoped_release release;
+  return wenet_model_load_with_options(model_dir.c_str(), &opts);
+}
+
+
+// The Python callbacks of the decoders, they are only changed with the GIL
+static std::map<void*, std::unique_ptr<py::function>> callbacks;
+
+
+// Called on the threads of the library, the result is passed as bytes
+static void CallPython(void* user_data, const char* result, int len,
+                       int final) {
+  py::gil_scoped_acquire acquire;
+  try {
+    (*static_cast<py::function*>(user_data))(py::bytes(result, len),
+                                             final != 0);
+  } catch (py::error_already_set& e) {
+    e.discard_as_unraisable(__func__);
+  }
+}
+
+
+static void SetResultCallback(void* decoder, py::function callback) {
+  auto& holder = callbacks[decoder];
+  // The old one may be running, it's replaced after the stream is done
+  {
+    py::gil_scoped_release release;
+    wenet_wait(decoder);
+  }
+  holder.reset(new py::function(std::move(callback)));
+  wenet_set_result_callback(decoder, &CallPython, holder.get());
+}
+
+
+static void DecodeAsync(void* decoder, py::buffer pcm, int last) {
+  py::buffer_info info = pcm.request();
+  Samples samples = GetSamples(info);
+  if (samples.is_float) {
+    throw std::invalid_argument("Expect int16 samples or bytes");
+  }
+  py::gil_scoped_release release;
+  wenet_decode_async(decoder, static_cast<const char*>(samples.data),
+                     samples.num_samples * 2, last);
+}
+
+
+// The calls which may wait for the asynchronous decoding release the GIL,
+// the callbacks need it
+static void Reset(void* decoder) {
+  py::gil_scoped_release release;
+  wenet_reset(decoder);
+}
+
+
+static void Wait(void* decoder) {
+  py::gil_scoped_release release;
+  wenet_wait(decoder);
+}
+
+
+static void Free(void* decoder) {
+  {
+    py::gil_scoped_release release;
+    wenet_free(decoder);
+  }
+  callbacks.erase(decoder);
+}
+
+
+// Decode the waves by num_threads decoders of the model, each takes the next
+// wave in turn, and return the final results in the order of the waves
+static std::vector<std::string> DecodeBatch(
+    void* model, const std::vector<py::buffer>& waves, int num_threads,
+    int nbest, int timestamp, const std::vector<std::string>& contexts,
+    float context_score) {
+  std::vector<py::buffer_info> infos;
+  std::vector<Samples> samples;
+  infos.reserve(waves.size());
+  for (const auto& wave : waves) {
+    infos.push_back(wave.request());
+    samples.push_back(GetSamples(infos.back()));
+  }
+  std::vector<std::string> results(waves.size());
+  py::gil_scoped_release release;
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    void* decoder = wenet_decoder_create(model);
+    wenet_set_nbest(decoder, nbest);
+    wenet_set_timestamp(decoder, timestamp);
+    if (!contexts.empty()) {
+      for (const auto& context : contexts) {
+        wenet_add_context(decoder, context.c_str());
+      }
+      wenet_set_context_score(decoder, context_score);
+    }
+    for (size_t i = next++; i < samples.size(); i = next++) {
+      DecodeSamples(decoder, samples[i], 1);
+      results[i] = wenet_get_result(decoder);
+      wenet_reset(decoder);
+    }
+    wenet_free(decoder);
+  };
+  num_threads = std::max(1, std::min(num_threads,
+                                     static_cast<int>(samples.size())));
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : threads) {
+    t.join();
+  }
+  return results;
+}
+
+
 PYBIND11_MODULE(_wenet, m) {
   m.doc() = "wenet pybind11 plugin";  // optional module docstring
   m.def("wenet_init", &wenet_init, py::return_value_policy::reference,
         "wenet init");
-  m.def("wenet_free", &wenet_free, "wenet free");
-  m.def("wenet_reset", &wenet_reset, "wenet reset");
-  m.def("wenet_decode", &wenet_decode, "wenet decode");
+  m.def("wenet_model_load", &LoadModel, py::return_value_policy::reference,
+        "load the shared model");
+  m.def("wenet_model_free", &wenet_model_free, "free the shared model");
+  m.def("wenet_decoder_create", &wenet_decoder_create,
+        py::return_value_policy::reference,
+        "create a decoder of the shared model");
+  m.def("wenet_free", &Free, "wenet free");
+  m.def("wenet_reset", &Reset, "wenet reset");
+  m.def("wenet_decode", &Decode,
+        "wenet decode, pcm is a buffer of int16/float32 samples or bytes");
+  m.def("wenet_decode_batch", &DecodeBatch,
+        "decode the waves by a pool of native threads");
+  m.def("wenet_set_result_callback", &SetResultCallback,
+        "set the callback(result: bytes, final: bool) of the asynchronous "
+        "decoding");
+  m.def("wenet_set_async_threads", &wenet_set_async_threads,
+        "set the threads of the asynchronous decoding");
+  m.def("wenet_decode_async", &DecodeAsync,
+        "push the pcm and return at once, the results come by the callback");
+  m.def("wenet_wait", &Wait, "wait for the asynchronous decoding");
   m.def("wenet_get_result", &wenet_get_result, py::return_value_policy::copy,
         "wenet get result");
   m.def("wenet_set_log_level", &wenet_set_log_level, "set log level");
@@ -12,17 +12,43 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
-from typing import List
+from typing import Callable, List, Union
 
 import _wenet
 
 
 class Decoder:
-    def __init__(self, model_dir: str):
-        self.d = _wenet.wenet_init(model_dir)
+    def __init__(self,
+                 model_dir: str,
+                 use_onnx: bool = False,
+                 quantized: bool = False,
+                 intra_op_threads: int = 1,
+                 inter_op_threads: int = 1,
+                 chunk_size: int = 16):
+        """ Load the model of model_dir
+
+        Args:
+            use_onnx: the ONNX model instead of final.zip, if the library
+                      is built with ONNX
+            quantized: the int8 quantized ONNX model, *.quant.onnx
+            intra_op_threads/inter_op_threads: threads of the engine, they
+                      are set by the first decoder of the process
+            chunk_size: decoding chunk size, -1 means the full context
+        """
+        # The model is shared by the decoders of decode_batch
+        self.model = _wenet.wenet_model_load(model_dir, int(use_onnx),
+                                             int(quantized),
+                                             intra_op_threads,
+                                             inter_op_threads, chunk_size)
+        self.d = _wenet.wenet_decoder_create(self.model)
+        self.nbest = 1
+        self.timestamp = 0
+        self.contexts = []
+        self.context_score = 3.0
 
     def __del__(self):
         _wenet.wenet_free(self.d)
+        _wenet.wenet_model_free(self.model)
 
     def reset(self):
         """ Reset status for next decoding """
@@ -31,33 +57,82 @@ class Decoder:
     def set_nbest(self, n: int):
         assert n >= 1
         assert n <= 10
+        self.nbest = n
         _wenet.wenet_set_nbest(self.d, n)
 
     def enable_timestamp(self, flag: bool):
         tag = 1 if flag else 0
+        self.timestamp = tag
         _wenet.wenet_set_timestamp(self.d, tag)
 
     def add_context(self, contexts: List[str]):
         for c in contexts:
             assert isinstance(c, str)
+            self.contexts.append(c)
             _wenet.wenet_add_context(self.d, c)
 
     def set_context_score(self, score: float):
+        self.context_score = score
         _wenet.wenet_set_context_score(self.d, score)
 
-    def decode(self, pcm: bytes, last: bool = True) -> str:
-        """ Decode the input data
+    def decode(self, pcm: Union[bytes, 'numpy.ndarray'],
+               last: bool = True) -> str:
+        """ Decode the input data, the GIL is released while decoding
 
         Args:
-            pcm: wav pcm
+            pcm: wav pcm, bytes of 16 bits PCM, or a contiguous 1-D int16 or
+                 float32(in the range of int16) numpy array, which is read
+                 in place without copying
             last: if it is the last package of the data
         """
-        assert isinstance(pcm, bytes)
         finish = 1 if last else 0
-        _wenet.wenet_decode(self.d, pcm, len(pcm), finish)
+        _wenet.wenet_decode(self.d, pcm, finish)
         result = _wenet.wenet_get_result(self.d)
         return result
 
+    def set_result_callback(self, callback: Callable[[str, bool], None]):
+        """ Set the callback(result, final) of decode_async, it's called on
+            the threads of the library with the JSON result of
+            decode(), final is True for the final result of the stream
+        """
+        _wenet.wenet_set_result_callback(
+            self.d, lambda result, final: callback(result.decode('utf-8'),
+                                                   final))
+
+    def decode_async(self, pcm: Union[bytes, 'numpy.ndarray'],
+                     last: bool = True):
+        """ Push the input data and return at once, the decoding runs on the
+            threads of the library, and the results are delivered by the
+            callback of set_result_callback. Call reset() before the next
+            stream, it waits for the final result of this one.
+
+        Args:
+            pcm: wav pcm, bytes of 16 bits PCM or an int16 numpy array
+            last: if it is the last package of the data
+        """
+        finish = 1 if last else 0
+        _wenet.wenet_decode_async(self.d, pcm, finish)
+
+    def wait(self):
+        """ Wait for the final result of decode_async """
+        _wenet.wenet_wait(self.d)
+
+    def decode_batch(self, wavs: List[Union[bytes, 'numpy.ndarray']],
+                     num_threads: int = 4) -> List[str]:
+        """ Decode the whole waves by num_threads native threads, each with
+            its own decoder of the shared model and the same options as
+            this one, without holding the GIL
+
+        Args:
+            wavs: waves in the formats of decode()
+            num_threads: number of decoding threads
+        Returns:
+            the final results in the order of wavs
+        """
+        return _wenet.wenet_decode_batch(self.model, wavs, num_threads,
+                                         self.nbest, self.timestamp,
+                                         self.contexts, self.context_score)
+
     def decode_wav(self, wav_file: str) -> str:
         """ Decode wav file, we only support:
             1. 16k sample rate
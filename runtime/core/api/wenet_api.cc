@@ -14,89 +14,247 @@
 
 #include "api/wenet_api.h"
 
+#include <algorithm>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "decoder/asr_decoder.h"
+#include "decoder/decode_scheduler.h"
+#include "decoder/result_encoder.h"
 #include "decoder/torch_asr_model.h"
+#ifdef USE_ONNX
+#include "decoder/onnx_asr_model.h"
+#endif
 #include "utils/json.h"
 #include "utils/string.h"
 
 
+// The model and the resources loaded from the model dir, which are read
+// only and shared by the decoders
+struct SharedModel {
+  std::shared_ptr<wenet::FeaturePipelineConfig> feature_config = nullptr;
+  std::shared_ptr<wenet::DecodeResource> resource = nullptr;
+  // The defaults of the decoders
+  std::shared_ptr<wenet::DecodeOptions> decode_options = nullptr;
+};
+
+
+static std::shared_ptr<wenet::AsrModel> ReadAsrModel(
+    const std::string& model_dir, const wenet_model_options& opts) {
+  // The engine threads could be set only once in the process, by the first
+  // model of each backend
+  if (opts.use_onnx) {
+#ifdef USE_ONNX
+    static std::once_flag init_onnx_threads;
+    std::call_once(init_onnx_threads, [&opts]() {
+      wenet::OnnxAsrModel::InitEngineThreads(opts.intra_op_threads,
+                                             opts.inter_op_threads);
+    });
+    wenet::OnnxSessionOptions onnx_opts;
+    onnx_opts.quantized = opts.quantized != 0;
+    auto model = std::make_shared<wenet::OnnxAsrModel>();
+    model->Read(model_dir, onnx_opts);
+    return model;
+#else
+    LOG(FATAL) << "The library is built without ONNX";
+#endif
+  }
+  static std::once_flag init_torch_threads;
+  std::call_once(init_torch_threads, [&opts]() {
+    wenet::TorchAsrModel::InitEngineThreads(opts.intra_op_threads,
+                                            opts.inter_op_threads);
+  });
+  auto model = std::make_shared<wenet::TorchAsrModel>();
+  model->Read(wenet::JoinPath(model_dir, "final.zip"));
+  return model;
+}
+
+
+static std::shared_ptr<SharedModel> LoadModel(
+    const std::string& model_dir, const wenet_model_options& opts) {
+  auto shared = std::make_shared<SharedModel>();
+  shared->feature_config = std::make_shared<wenet::FeaturePipelineConfig>(
+      opts.num_bins, opts.sample_rate);
+  shared->decode_options = std::make_shared<wenet::DecodeOptions>();
+  shared->decode_options->chunk_size = opts.chunk_size;
+  shared->resource = std::make_shared<wenet::DecodeResource>();
+  shared->resource->model = ReadAsrModel(model_dir, opts);
+  auto symbol_table = std::shared_ptr<fst::SymbolTable>(
+      fst::SymbolTable::ReadText(wenet::JoinPath(model_dir, "words.txt")));
+  shared->resource->symbol_table = symbol_table;
+  shared->resource->unit_table = symbol_table;
+  // Built once for all the decoders of the model
+  shared->resource->symbol_strings = std::make_shared<wenet::SymbolStrings>(
+      *symbol_table, std::vector<std::string>{wenet::kContextStartTag,
+                                              wenet::kContextEndTag});
+  shared->resource->unit_strings = shared->resource->symbol_strings;
+  return shared;
+}
+
+
 class Recognizer {
  public:
-  explicit Recognizer(const std::string& model_dir) {
+  explicit Recognizer(std::shared_ptr<const SharedModel> model)
+      : model_(std::move(model)) {
     // FeaturePipeline init
-    feature_config_ = std::make_shared<wenet::FeaturePipelineConfig>(80, 16000);
+    feature_config_ = model_->feature_config;
     feature_pipeline_ =
         std::make_shared<wenet::FeaturePipeline>(*feature_config_);
-    // Resource init
-    resource_ = std::make_shared<wenet::DecodeResource>();
-    wenet::TorchAsrModel::InitEngineThreads();
-
-    auto model = std::make_shared<wenet::TorchAsrModel>();
-    model->Read(wenet::JoinPath(model_dir, "final.zip"));
-    resource_->model = model;
-    auto symbol_table = std::shared_ptr<fst::SymbolTable>(
-        fst::SymbolTable::ReadText(wenet::JoinPath(model_dir, "words.txt")));
-    resource_->symbol_table = symbol_table;
-    resource_->unit_table = symbol_table;
+    // A shallow copy of the shared resource, the context graph is set per
+    // decoder, and the AsrDecoder makes its own copy of the model states
+    resource_ = std::make_shared<wenet::DecodeResource>(*model_->resource);
     // Context config init
     context_config_ = std::make_shared<wenet::ContextConfig>();
-    decode_options_ = std::make_shared<wenet::DecodeOptions>();
+    decode_options_ =
+        std::make_shared<wenet::DecodeOptions>(*model_->decode_options);
   }
 
+  ~Recognizer() { Wait(); }
+
   void Reset() {
+    Wait();
+    decode_session_ = nullptr;
     feature_pipeline_->Reset();
-    decoder_->Reset();
+    if (decoder_ != nullptr) decoder_->Reset();
     result_.clear();
+    PublishResult();
   }
 
   void Decode(const char* data, int len, int last) {
-    using wenet::DecodeState;
+    // 16 bits PCM data, converted to float while framing
+    CHECK_EQ(len % 2, 0);
+    Decode(reinterpret_cast<const int16_t*>(data), len / 2, last);
+  }
+
+  // Samples of int16_t or float
+  template <typename T>
+  void Decode(const T* samples, int num_samples, int last) {
+    PrepareDecoder();
+    feature_pipeline_->AcceptWaveform(samples, num_samples);
+    if (last > 0) {
+      feature_pipeline_->set_input_finished();
+    }
+    DecodeAvailable();
+  }
+
+  // Only the features are computed on the caller thread, the decoding runs
+  // on the workers of the scheduler and the results are delivered by the
+  // callback there
+  void DecodeAsync(const char* data, int len, int last) {
+    CHECK_EQ(len % 2, 0);
+    if (decode_session_ == nullptr) {
+      PrepareDecoder();
+      {
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        async_running_ = true;
+      }
+      decode_session_ = AsyncScheduler()->NewSession([this]() {
+        if (DecodeAvailable()) return true;
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        async_running_ = false;
+        async_cond_.notify_all();
+        return false;
+      });
+      std::weak_ptr<wenet::DecodeScheduler::Session> session =
+          decode_session_;
+      feature_pipeline_->set_ready_callback([session]() {
+        if (auto s = session.lock()) s->Notify();
+      });
+      decode_session_->Notify();
+    }
+    feature_pipeline_->AcceptWaveform(reinterpret_cast<const int16_t*>(data),
+                                      len / 2);
+    if (last > 0) {
+      feature_pipeline_->set_input_finished();
+    }
+  }
+
+  // Block until the asynchronous decoding of the stream is finished
+  void Wait() {
+    std::unique_lock<std::mutex> lock(async_mutex_);
+    async_cond_.wait(lock, [this]() { return !async_running_; });
+  }
+
+  void set_result_callback(wenet_result_callback callback, void* user_data) {
+    result_callback_ = callback;
+    callback_user_data_ = user_data;
+  }
+
+  // The process wide scheduler of the asynchronous decoding
+  static std::shared_ptr<wenet::DecodeScheduler> AsyncScheduler(
+      int num_threads = -1) {
+    static std::mutex mutex;
+    static std::shared_ptr<wenet::DecodeScheduler> scheduler;
+    static int scheduler_threads = 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (num_threads >= 0) {
+      // Take effect on the first asynchronous decoding
+      scheduler_threads = num_threads;
+    } else if (scheduler == nullptr) {
+      scheduler = std::make_shared<wenet::DecodeScheduler>(scheduler_threads);
+    }
+    return scheduler;
+  }
+
+  void PrepareDecoder() {
     // Init decoder when it is called first time
     if (decoder_ == nullptr) {
       // Optional init context graph
       if (context_.size() > 0) {
-        context_config_->context_score = context_score_;
-        auto context_graph =
-            std::make_shared<wenet::ContextGraph>(*context_config_);
-        context_graph->BuildContextGraph(context_, resource_->symbol_table);
-        resource_->context_graph = context_graph;
+        resource_->context_graph = GetContextGraph().get();
       }
       decoder_ = std::make_shared<wenet::AsrDecoder>(feature_pipeline_,
           resource_, *decode_options_);
+      context_changed_ = false;
+    } else if (context_changed_) {
+      // Built in background, the decoder uses it from the next sentence on
+      decoder_->SetContextGraph(GetContextGraph());
+      context_changed_ = false;
     }
-    // Convert to 16 bits PCM data to float
-    CHECK_EQ(len % 2, 0);
-    std::vector<float> wav(len / 2, 0);
-    for (int i = 0; i < wav.size(); i++) {
-      wav[i] = *reinterpret_cast<const int16_t*>(data + i * 2);
-    }
-    feature_pipeline_->AcceptWaveform(wav);
-    if (last > 0) {
-      feature_pipeline_->set_input_finished();
-    }
+  }
 
+  // Decode the available features, return false once the input is finished
+  // and the final result is ready
+  bool DecodeAvailable() {
+    using wenet::DecodeState;
     while (true) {
-      // TODO(Binbin Zhang): Process streaming call
       DecodeState state = decoder_->Decode(false);
       if (state == DecodeState::kWaitFeats) {
-         break;
+        return true;
       } else if (state == DecodeState::kEndFeats) {
         UpdateResult(true);
         decoder_->Rescoring();
         UpdateResult(true);
-        break;
+        DeliverResult(true);
+        return false;
       } else {
         // kEndBatch or kEndpoint(ignore it now)
         UpdateResult(false);
+        DeliverResult(false);
       }
     }
   }
 
+  void DeliverResult(bool final_result) {
+    if (result_callback_ != nullptr) {
+      result_callback_(callback_user_data_, result_.data(), result_.size(),
+                       final_result ? 1 : 0);
+    }
+  }
+
   void UpdateResult(bool final_result) {
+    if (binary_result_) {
+      wenet::ResultType type = final_result ?
+          wenet::ResultType::kFinalResult : wenet::ResultType::kPartialResult;
+      wenet::EncodeResult(type, decoder_->result(), final_result ? nbest_ : 1,
+                          final_result && enable_timestamp_, &result_);
+      PublishResult();
+      return;
+    }
     json::JSON obj;
     obj["type"] = final_result ? "final_result" : "partial_result";
     int nbest = final_result ? nbest_ : 1;
@@ -111,6 +269,11 @@ class Recognizer {
           piece["word"] = word_piece.word;
           piece["start"] = word_piece.start;
           piece["end"] = word_piece.end;
+          if (word_piece.confidence.max > 0) {
+            piece["confidence"]["max"] = word_piece.confidence.max;
+            piece["confidence"]["mean"] = word_piece.confidence.mean;
+            piece["confidence"]["min"] = word_piece.confidence.min;
+          }
           one["word_pieces"].append(piece);
         }
       }
@@ -118,20 +281,63 @@ class Recognizer {
       obj["nbest"].append(one);
     }
     result_ = obj.dump();
+    PublishResult();
   }
 
+  // The results are read from the published snapshots, so they could be
+  // got while decoding on another thread, without waiting for it
   const char* GetResult() {
-    return result_.c_str();
+    if (binary_result_) return "";
+    read_result_ = std::atomic_load(&published_result_);
+    return read_result_->c_str();
+  }
+
+  const char* GetBinaryResult(int* len) {
+    if (!binary_result_) {
+      *len = 0;
+      return "";
+    }
+    read_result_ = std::atomic_load(&published_result_);
+    *len = read_result_->size();
+    return read_result_->data();
   }
 
   void set_nbest(int n) { nbest_ = n; }
   void set_enable_timestamp(bool flag) { enable_timestamp_ = flag; }
+  void set_binary_result(bool flag) {
+    binary_result_ = flag;
+    result_.clear();
+    PublishResult();
+  }
   void AddContext(const char* word) {
     context_.push_back(word);
+    context_changed_ = true;
+  }
+  void set_context_score(float score) {
+    context_score_ = score;
+    context_changed_ = true;
+  }
+
+  wenet::ContextGraphCache::GraphFuture GetContextGraph() {
+    if (context_cache_ == nullptr ||
+        context_config_->context_score != context_score_) {
+      context_config_->context_score = context_score_;
+      context_cache_ = std::make_shared<wenet::ContextGraphCache>(
+          *context_config_, resource_->symbol_strings, kContextCacheSize);
+    }
+    return context_cache_->Get(context_);
   }
-  void set_context_score(float score) { context_score_ = score; }
 
  private:
+  // Publish a copy of result_ for GetResult()
+  void PublishResult() {
+    std::shared_ptr<const std::string> snapshot =
+        std::make_shared<std::string>(result_);
+    std::atomic_store(&published_result_, snapshot);
+  }
+
+  // Keeps the shared model alive
+  std::shared_ptr<const SharedModel> model_ = nullptr;
   // NOTE(Binbin Zhang): All use shared_ptr for clone in the future
   std::shared_ptr<wenet::FeaturePipelineConfig> feature_config_ = nullptr;
   std::shared_ptr<wenet::FeaturePipeline> feature_pipeline_ = nullptr;
@@ -139,17 +345,85 @@ class Recognizer {
   std::shared_ptr<wenet::DecodeOptions> decode_options_ = nullptr;
   std::shared_ptr<wenet::AsrDecoder> decoder_ = nullptr;
   std::shared_ptr<wenet::ContextConfig> context_config_ = nullptr;
+  // The graphs of the recent context lists, so switching back is cheap
+  static const int kContextCacheSize = 4;
+  std::shared_ptr<wenet::ContextGraphCache> context_cache_ = nullptr;
+  bool context_changed_ = false;
 
   int nbest_ = 1;
+  // Built by the decoding thread
   std::string result_;
+  // The last result_ published, accessed by std::atomic_load/store only
+  std::shared_ptr<const std::string> published_result_ =
+      std::make_shared<const std::string>();
+  // The snapshot returned by GetResult(), kept until its next call
+  std::shared_ptr<const std::string> read_result_ = nullptr;
   bool enable_timestamp_ = false;
+  // result_ is the binary Response of wenet.proto instead of JSON
+  bool binary_result_ = false;
   std::vector<std::string> context_;
-  float context_score_;
+  float context_score_ = 3.0;
+
+  wenet_result_callback result_callback_ = nullptr;
+  void* callback_user_data_ = nullptr;
+  // Of the current stream of DecodeAsync()
+  std::shared_ptr<wenet::DecodeScheduler::Session> decode_session_ = nullptr;
+  std::mutex async_mutex_;
+  std::condition_variable async_cond_;
+  bool async_running_ = false;
 };
 
 
+void wenet_model_options_default(wenet_model_options* opts) {
+  opts->use_onnx = 0;
+  opts->quantized = 0;
+  opts->intra_op_threads = 1;
+  opts->inter_op_threads = 1;
+  opts->chunk_size = 16;
+  opts->num_bins = 80;
+  opts->sample_rate = 16000;
+}
+
+
 void* wenet_init(const char* model_dir) {
-  Recognizer* decoder = new Recognizer(model_dir);
+  return wenet_init_with_options(model_dir, nullptr);
+}
+
+
+void* wenet_init_with_options(const char* model_dir,
+                              const wenet_model_options* opts) {
+  void* model = wenet_model_load_with_options(model_dir, opts);
+  void* decoder = wenet_decoder_create(model);
+  // The decoder holds the model
+  wenet_model_free(model);
+  return decoder;
+}
+
+
+void* wenet_model_load(const char* model_dir) {
+  return wenet_model_load_with_options(model_dir, nullptr);
+}
+
+
+void* wenet_model_load_with_options(const char* model_dir,
+                                    const wenet_model_options* opts) {
+  wenet_model_options defaults;
+  wenet_model_options_default(&defaults);
+  auto* model = new std::shared_ptr<const SharedModel>(
+      LoadModel(model_dir, opts != nullptr ? *opts : defaults));
+  return reinterpret_cast<void*>(model);
+}
+
+
+void wenet_model_free(void* model) {
+  delete reinterpret_cast<std::shared_ptr<const SharedModel>*>(model);
+}
+
+
+void* wenet_decoder_create(void* model) {
+  const auto& shared =
+      *reinterpret_cast<std::shared_ptr<const SharedModel>*>(model);
+  Recognizer* decoder = new Recognizer(shared);
   return reinterpret_cast<void*>(decoder);
 }
 
@@ -174,12 +448,62 @@ void wenet_decode(void* decoder,
 }
 
 
+void wenet_decode_float(void* decoder,
+                        const float* data,
+                        int len,
+                        int last) {
+  Recognizer *recognizer = reinterpret_cast<Recognizer *>(decoder);
+  recognizer->Decode(data, len, last);
+}
+
+
+void wenet_set_result_callback(void* decoder,
+                               wenet_result_callback callback,
+                               void* user_data) {
+  Recognizer *recognizer = reinterpret_cast<Recognizer *>(decoder);
+  recognizer->set_result_callback(callback, user_data);
+}
+
+
+void wenet_set_async_threads(int num_threads) {
+  Recognizer::AsyncScheduler(std::max(num_threads, 0));
+}
+
+
+void wenet_decode_async(void* decoder,
+                        const char* data,
+                        int len,
+                        int last) {
+  Recognizer *recognizer = reinterpret_cast<Recognizer *>(decoder);
+  recognizer->DecodeAsync(data, len, last);
+}
+
+
+void wenet_wait(void* decoder) {
+  Recognizer *recognizer = reinterpret_cast<Recognizer *>(decoder);
+  recognizer->Wait();
+}
+
+
 const char* wenet_get_result(void* decoder) {
   Recognizer *recognizer = reinterpret_cast<Recognizer *>(decoder);
   return recognizer->GetResult();
 }
 
 
+const char* wenet_get_binary_result(void* decoder, int* len) {
+  Recognizer *recognizer = reinterpret_cast<Recognizer *>(decoder);
+  return recognizer->GetBinaryResult(len);
+}
+
+
+void wenet_set_binary_result(void* decoder, int flag) {
+  Recognizer *recognizer = reinterpret_cast<Recognizer *>(decoder);
+  bool enable = flag > 0 ? true : false;
+  recognizer->set_binary_result(enable);
+}
+
+
 void wenet_set_log_level(int level) {
   FLAGS_logtostderr = true;
   FLAGS_v = level;
@@ -19,6 +19,34 @@
 extern "C" {
 #endif
 
+/** Options of loading the model, get the defaults by
+ *  wenet_model_options_default and then change some of them
+ */
+typedef struct {
+  /** 0: the TorchScript model, final.zip of the model dir
+   *  1: the ONNX model, encoder.onnx, ctc.onnx and decoder.onnx of the model
+   *     dir, if the library is built with ONNX
+   */
+  int use_onnx;
+  /** Read the int8 quantized ONNX model, *.quant.onnx, of the model dir */
+  int quantized;
+  /** The intra-op and inter-op threads of the engine, they are set by the
+   *  first model of each engine in the process, default 1 and 1
+   */
+  int intra_op_threads;
+  int inter_op_threads;
+  /** Decoding chunk size, -1 means the full context, default 16 */
+  int chunk_size;
+  /** Fbank feature dims and the sample rate, default 80 and 16000 */
+  int num_bins;
+  int sample_rate;
+} wenet_model_options;
+
+
+/** Fill opts with the default options */
+void wenet_model_options_default(wenet_model_options* opts);
+
+
 /** Init decoder from the file and returns the object
  *
  * @param model_dir: the model dir
@@ -27,6 +55,41 @@ extern "C" {
 void* wenet_init(const char* model_dir);
 
 
+/** Same as wenet_init, opts is NULL for the defaults */
+void* wenet_init_with_options(const char* model_dir,
+                              const wenet_model_options* opts);
+
+
+/** Load the model and the resources of the model dir once, which are
+ *  shared by all the decoders created by wenet_decoder_create, e.g. one
+ *  decoder per channel, so they are not loaded for each of them.
+ *
+ * @param model_dir: the model dir
+ * @returns model object or NULL if problem occured
+ */
+void* wenet_model_load(const char* model_dir);
+
+
+/** Same as wenet_model_load, opts is NULL for the defaults */
+void* wenet_model_load_with_options(const char* model_dir,
+                                    const wenet_model_options* opts);
+
+
+/** Release the model handle. The model is reference counted, it's freed
+ *  after the decoders created from it are freed as well.
+ */
+void wenet_model_free(void* model);
+
+
+/** Create a decoder of the loaded model, it only holds the states of one
+ *  stream, free it by wenet_free. The decoders of one model could run in
+ *  different threads.
+ *
+ * @returns decoder object
+ */
+void* wenet_decoder_create(void* model);
+
+
 /** Free wenet decoder and corresponding resource
  */
 void wenet_free(void* decoder);
@@ -47,6 +110,68 @@ void wenet_decode(void* decoder,
                   int last = 1);
 
 
+/** Decode the input wav data of float samples, which are in the range of
+ *  int16, e.g. a float32 numpy array, without converting them first
+ * @param data: pcm samples
+ * @param len: number of samples
+ * @param last: if it is the last package
+ */
+void wenet_decode_float(void* decoder,
+                        const float* data,
+                        int len,
+                        int last = 1);
+
+
+/** Callback of the results of the asynchronous decoding
+ * @param user_data: the user_data of wenet_set_result_callback
+ * @param result: the same as wenet_get_result, or wenet_get_binary_result
+ *                if it's enabled, which is borrowed and only valid during
+ *                the call
+ * @param len: the length of the result in bytes
+ * @param final: 1 for the final result of the stream, 0 for partial ones
+ */
+typedef void (*wenet_result_callback)(void* user_data,
+                                      const char* result,
+                                      int len,
+                                      int final);
+
+
+/** Set the callback of the results of wenet_decode_async, it's called on
+ *  the threads of the library, so it should return quickly
+ */
+void wenet_set_result_callback(void* decoder,
+                               wenet_result_callback callback,
+                               void* user_data);
+
+
+/** Set the number of the threads which decode the streams of
+ *  wenet_decode_async, for all the decoders of the process. 0 means one per
+ *  cpu, which is the default. It must be called before the first
+ *  wenet_decode_async.
+ */
+void wenet_set_async_threads(int num_threads);
+
+
+/** Push the input wav data and return at once, the features are computed
+ *  in the caller thread, the decoding runs on the threads of the library,
+ *  and the results are delivered by the result callback. Call wenet_reset
+ *  before the next stream, it waits for the final result of this one.
+ * @param data: pcm data, encoded as int16_t(16 bits)
+ * @param len: data length
+ * @param last: if it is the last package
+ */
+void wenet_decode_async(void* decoder,
+                        const char* data,
+                        int len,
+                        int last = 1);
+
+
+/** Block until the final result of the stream of wenet_decode_async is
+ *  delivered, wenet_get_result is valid then
+ */
+void wenet_wait(void* decoder);
+
+
 /** Get decode result in json format
  *  It returns partial result when last is 0
  *  It returns final result when last is 1
@@ -74,10 +199,33 @@ void wenet_decode(void* decoder,
     "nbest": nbest is enabled when n > 1 in final_result
         "sentence": the ASR result
         "word_pieces": optional, output timestamp when enabled
+            "confidence": optional, the max, mean and min CTC posteriors of
+                          the piece, if the search tracks them
+
+    It could be called from another thread while the decoder decodes, it
+    returns the last result published without blocking the decoding. The
+    string is valid until the next call of it or of wenet_get_binary_result
+    on the decoder, which should be from one thread at a time.
  */
 const char* wenet_get_result(void* decoder);
 
 
+/** Get decode result in the compact binary format, which is the Response
+ *  message of grpc/wenet.proto in the protobuf wire format, decode it by
+ *  the generated code of wenet.proto. It's only available when
+ *  wenet_set_binary_result is enabled, wenet_get_result is empty then.
+ *
+ * @param len: the length of the result in bytes
+ */
+const char* wenet_get_binary_result(void* decoder, int* len);
+
+
+/** Whether to output the results in the binary format
+    disable it when flag = 0, otherwise enable
+ */
+void wenet_set_binary_result(void* decoder, int flag);
+
+
 /** Set n-best, range 1~10
  *  wenet_get_result will return top-n best results
  */
@@ -0,0 +1,77 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "decoder/context_graph.h"
+
+namespace wenet {
+
+// Random phrases of 2 to 6 letters
+static std::vector<std::string> RandomPhrases(int n) {
+  std::default_random_engine g(0);
+  std::uniform_int_distribution<int> length(2, 6);
+  std::uniform_int_distribution<int> letter(0, 25);
+  std::vector<std::string> phrases(n);
+  for (auto& phrase : phrases) {
+    int len = length(g);
+    for (int i = 0; i < len; ++i) {
+      phrase.push_back('a' + letter(g));
+    }
+  }
+  return phrases;
+}
+
+// GetNextState on a random word sequence, the graph of range(0) phrases is
+// the determinized fst if range(1) is 0, the Aho-Corasick automaton if 1
+static void BM_ContextGraphGetNextState(benchmark::State& state) {
+  fst::SymbolTable symbol_table;
+  symbol_table.AddSymbol("<blank>", 0);
+  for (int i = 0; i < 26; ++i) {
+    symbol_table.AddSymbol(std::string(1, 'a' + i), i + 1);
+  }
+  auto symbols = std::make_shared<SymbolStrings>(
+      symbol_table,
+      std::vector<std::string>{kContextStartTag, kContextEndTag});
+  ContextConfig config;
+  config.max_contexts = state.range(0);
+  config.use_aho_corasick = state.range(1) != 0;
+  ContextGraph graph(config);
+  graph.BuildContextGraph(RandomPhrases(state.range(0)), symbols);
+
+  std::default_random_engine g(1);
+  std::uniform_int_distribution<int> word(1, 26);
+  std::vector<int> words(4096);
+  for (auto& w : words) w = word(g);
+  int cur_state = 0;
+  size_t i = 0;
+  for (auto _ : state) {
+    float score = 0;
+    bool is_start_boundary = false;
+    bool is_end_boundary = false;
+    cur_state = graph.GetNextState(cur_state, words[i], &score,
+                                   &is_start_boundary, &is_end_boundary);
+    benchmark::DoNotOptimize(score);
+    i = (i + 1) % words.size();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ContextGraphGetNextState)
+    ->ArgsProduct({{100, 1000, 10000, 100000}, {0, 1}});
+
+}  // namespace wenet
@@ -0,0 +1,93 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <random>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "frontend/fbank.h"
+#include "frontend/fft.h"
+#include "frontend/fixed_fbank.h"
+
+namespace wenet {
+
+static std::vector<float> RandomWave(int n) {
+  std::default_random_engine g(0);
+  std::uniform_real_distribution<float> dist(-32768, 32767);
+  std::vector<float> wave(n);
+  for (auto& x : wave) x = dist(g);
+  return wave;
+}
+
+// Fbank of 80 bins on 16k Hz packets of range(0) ms
+static void BM_FbankCompute(benchmark::State& state) {
+  const int num_samples = state.range(0) * 16;
+  Fbank fbank(80, 16000, 400, 160);
+  std::vector<float> wave = RandomWave(num_samples);
+  std::vector<float> feat(fbank.NumFrames(num_samples) * 80);
+  for (auto _ : state) {
+    fbank.Compute(wave.data(), num_samples, 80, feat.data());
+    benchmark::DoNotOptimize(feat.data());
+  }
+  state.SetItemsProcessed(state.iterations() * num_samples);
+}
+BENCHMARK(BM_FbankCompute)->Arg(100)->Arg(500)->Arg(1000)->Arg(10000);
+
+// Same as above, by the fixed point fbank on 16 bits PCM
+static void BM_FixedFbankCompute(benchmark::State& state) {
+  const int num_samples = state.range(0) * 16;
+  FixedFbank fbank(80, 16000, 400, 160);
+  std::vector<float> wave = RandomWave(num_samples);
+  std::vector<int16_t> pcm(wave.begin(), wave.end());
+  std::vector<float> feat(fbank.NumFrames(num_samples) * 80);
+  for (auto _ : state) {
+    fbank.Compute(pcm.data(), num_samples, 80, feat.data());
+    benchmark::DoNotOptimize(feat.data());
+  }
+  state.SetItemsProcessed(state.iterations() * num_samples);
+}
+BENCHMARK(BM_FixedFbankCompute)->Arg(100)->Arg(1000);
+
+static void BM_Fft(benchmark::State& state) {
+  const int n = state.range(0);
+  std::vector<int> bitrev(n);
+  std::vector<float> sintbl(n + n / 4);
+  make_sintbl(n, sintbl.data());
+  make_bitrev(n, bitrev.data());
+  std::vector<float> input = RandomWave(n);
+  std::vector<float> x(n), y(n);
+  for (auto _ : state) {
+    x = input;
+    std::fill(y.begin(), y.end(), 0);
+    fft(bitrev.data(), sintbl.data(), x.data(), y.data(), n);
+    benchmark::DoNotOptimize(x.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Fft)->Arg(512)->Arg(1024);
+
+static void BM_RealFft(benchmark::State& state) {
+  const int n = state.range(0);
+  auto real_fft = RealFft::Get(n);
+  std::vector<float> x = RandomWave(n);
+  std::vector<float> real(n / 2), img(n / 2);
+  for (auto _ : state) {
+    real_fft->Compute(x.data(), real.data(), img.data());
+    benchmark::DoNotOptimize(real.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RealFft)->Arg(512)->Arg(1024);
+
+}  // namespace wenet
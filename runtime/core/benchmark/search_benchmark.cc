@@ -0,0 +1,174 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "decoder/ctc_prefix_beam_search.h"
+#include "decoder/ctc_wfst_beam_search.h"
+#include "fst/arcsort.h"
+#include "util/hash-list.h"
+#include "util/token-hash.h"
+#include "utils/matrix.h"
+
+namespace wenet {
+
+// Peaky CTC output like a trained model: 70% of the frames are blank, the
+// peak takes 0.9 of the probability and the other tokens share the rest
+static LogProbMatrix PeakyLogProbs(int num_frames, int vocab_size) {
+  std::default_random_engine g(0);
+  std::uniform_real_distribution<float> uniform(0, 1);
+  std::uniform_int_distribution<int> token(1, vocab_size - 1);
+  std::vector<std::vector<float>> data(num_frames,
+                                       std::vector<float>(vocab_size));
+  const float rest = std::log(0.1f / (vocab_size - 1));
+  for (auto& frame : data) {
+    int peak = uniform(g) < 0.7 ? 0 : token(g);
+    for (int i = 0; i < vocab_size; ++i) {
+      frame[i] = i == peak ? std::log(0.9f) : rest;
+    }
+  }
+  return LogProbMatrix(data);
+}
+
+// The search of the decoding without the context biasing and the timestamps
+using PlainCtcPrefixBeamSearch = CtcPrefixBeamSearchT<false, false>;
+
+// 10 seconds of 40ms frames, searched by chunks of 16 frames with beam
+// range(0) on a vocab of range(1) tokens
+template <typename Search>
+static void BM_CtcPrefixBeamSearch(benchmark::State& state) {
+  const int num_frames = 250;
+  const int chunk_frames = 16;
+  CtcPrefixBeamSearchOptions opts;
+  opts.first_beam_size = state.range(0);
+  opts.second_beam_size = state.range(0);
+  LogProbMatrix logp = PeakyLogProbs(num_frames, state.range(1));
+  std::vector<LogProbMatrix> chunks;
+  for (int t = 0; t < num_frames; t += chunk_frames) {
+    std::vector<std::vector<float>> chunk;
+    for (int i = t; i < std::min(t + chunk_frames, num_frames); ++i) {
+      chunk.emplace_back(logp.Row(i), logp.Row(i) + logp.cols());
+    }
+    chunks.emplace_back(chunk);
+  }
+  Search search(opts);
+  for (auto _ : state) {
+    search.Reset();
+    for (const auto& chunk : chunks) {
+      search.Search(chunk);
+    }
+    search.FinalizeSearch();
+    benchmark::DoNotOptimize(search.Outputs().data());
+  }
+  state.SetItemsProcessed(state.iterations() * num_frames);
+}
+BENCHMARK_TEMPLATE(BM_CtcPrefixBeamSearch, CtcPrefixBeamSearch)
+    ->ArgsProduct({{4, 10, 20}, {5000, 11008}})
+    ->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_CtcPrefixBeamSearch, PlainCtcPrefixBeamSearch)
+    ->ArgsProduct({{4, 10, 20}, {5000, 11008}})
+    ->Unit(benchmark::kMicrosecond);
+
+// A small TLG of a vocab of vocab_size tokens, each token is a word. The
+// input labels are the token ids plus 1, 1 is the blank. State 0 is the
+// start, state t is after token t, and the repeats of t stay in state t.
+static fst::StdVectorFst* SmallTlg(int vocab_size) {
+  auto* graph = new fst::StdVectorFst();
+  for (int s = 0; s < vocab_size; ++s) {
+    graph->AddState();
+    graph->SetFinal(s, fst::TropicalWeight::One());
+  }
+  graph->SetStart(0);
+  for (int s = 0; s < vocab_size; ++s) {
+    graph->AddArc(s, fst::StdArc(1, 0, 0.0, 0));
+    for (int t = 1; t < vocab_size; ++t) {
+      if (s == t) {
+        graph->AddArc(s, fst::StdArc(t + 1, 0, 0.0, t));
+      } else {
+        graph->AddArc(s, fst::StdArc(t + 1, t, 1.0, t));
+      }
+    }
+  }
+  fst::ArcSort(graph, fst::StdILabelCompare());
+  return graph;
+}
+
+// The same utterance as above through the TLG, range(0) is the nbest, 1
+// means the single best path by the Viterbi decoder
+static void BM_CtcWfstBeamSearch(benchmark::State& state) {
+  const int num_frames = 250;
+  const int vocab_size = 500;
+  std::unique_ptr<fst::StdVectorFst> graph(SmallTlg(vocab_size));
+  CtcWfstBeamSearchOptions opts;
+  opts.nbest = state.range(0);
+  LogProbMatrix logp = PeakyLogProbs(num_frames, vocab_size);
+  CtcWfstBeamSearch search(*graph, opts, nullptr);
+  for (auto _ : state) {
+    search.Reset();
+    search.Search(logp);
+    search.FinalizeSearch();
+    benchmark::DoNotOptimize(search.Outputs().data());
+  }
+  state.SetItemsProcessed(state.iterations() * num_frames);
+}
+BENCHMARK(BM_CtcWfstBeamSearch)->Arg(1)->Arg(10)
+    ->Unit(benchmark::kMicrosecond);
+
+// The token map of the lattice decoder, range(0) active tokens of each
+// frame expand to 4 arcs each, whose next states are scattered over a large
+// graph, as the emitting pass of ProcessEmitting()
+template <class TokenMap>
+static void BM_TokenMap(benchmark::State& state) {
+  const int num_active = state.range(0);
+  const int num_arcs = 4;
+  const int num_states = 4000000;
+  const int num_frames = 16;
+  std::default_random_engine g(0);
+  std::uniform_int_distribution<int> next_state(0, num_states - 1);
+  std::vector<int> next_states(num_frames * num_active * num_arcs);
+  for (auto& s : next_states) s = next_state(g);
+  TokenMap toks;
+  toks.SetSize(num_active * num_arcs * 2);
+  int token = 0;
+  for (auto _ : state) {
+    for (int f = 0; f < num_frames; ++f) {
+      for (auto* e = toks.Clear(), *tail = e; e != nullptr; e = tail) {
+        tail = e->tail;
+        toks.Delete(e);
+      }
+      const int* arcs = next_states.data() + f * num_active * num_arcs;
+      for (int i = 0; i < num_active * num_arcs; ++i) {
+        auto* e = toks.Insert(arcs[i], token);
+        e->val = ++token;
+      }
+    }
+  }
+  for (auto* e = toks.Clear(), *tail = e; e != nullptr; e = tail) {
+    tail = e->tail;
+    toks.Delete(e);
+  }
+  state.SetItemsProcessed(state.iterations() * num_frames * num_active *
+                          num_arcs);
+}
+BENCHMARK_TEMPLATE(BM_TokenMap, kaldi::HashList<int, int>)
+    ->Arg(2000)->Arg(7000)->Unit(benchmark::kMicrosecond);
+BENCHMARK_TEMPLATE(BM_TokenMap, kaldi::TokenHash<int, int>)
+    ->Arg(2000)->Arg(7000)->Unit(benchmark::kMicrosecond);
+
+}  // namespace wenet
@@ -0,0 +1,115 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "utils/blocking_queue.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// Log probabilities of a vocab of range(0) tokens
+static std::vector<float> RandomLogProbs(int n) {
+  std::default_random_engine g(0);
+  std::uniform_real_distribution<float> dist(-20, 0);
+  std::vector<float> v(n);
+  for (auto& x : v) x = dist(g);
+  return v;
+}
+
+static void BM_TopK(benchmark::State& state) {
+  std::vector<float> data = RandomLogProbs(state.range(0));
+  std::vector<float> values;
+  std::vector<int> indices;
+  for (auto _ : state) {
+    TopK(data.data(), data.size(), state.range(1), &values, &indices);
+    benchmark::DoNotOptimize(values.data());
+  }
+  state.SetItemsProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_TopK)->ArgsProduct({{5000, 11008}, {10, 40}});
+
+static void BM_ScalarTopK(benchmark::State& state) {
+  std::vector<float> data = RandomLogProbs(state.range(0));
+  std::vector<float> values;
+  std::vector<int> indices;
+  for (auto _ : state) {
+    ScalarTopK(data.data(), data.size(), state.range(1), &values, &indices);
+    benchmark::DoNotOptimize(values.data());
+  }
+  state.SetItemsProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ScalarTopK)->ArgsProduct({{5000, 11008}, {10, 40}});
+
+static void BM_LogAdd(benchmark::State& state) {
+  std::vector<float> data = RandomLogProbs(1024);
+  for (auto _ : state) {
+    float sum = -kFloatMax;
+    for (float x : data) {
+      sum = LogAdd(sum, x);
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_LogAdd);
+
+static void BM_ExactLogAdd(benchmark::State& state) {
+  std::vector<float> data = RandomLogProbs(1024);
+  for (auto _ : state) {
+    float sum = -kFloatMax;
+    for (float x : data) {
+      sum = ExactLogAdd(sum, x);
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ExactLogAdd);
+
+// The scores of a beam, as the ctc prefix beam search sums them each frame
+static void BM_LogAddBatch(benchmark::State& state) {
+  const int n = state.range(0);
+  // x and y are the two halves
+  std::vector<float> data = RandomLogProbs(2 * n);
+  std::vector<float> z(n);
+  for (auto _ : state) {
+    LogAdd(data.data(), data.data() + n, n, z.data());
+    benchmark::DoNotOptimize(z.data());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_LogAddBatch)->Arg(10)->Arg(100)->Arg(1000);
+
+// Each of the threads pushes and pops a shared queue of capacity 64
+static void BM_BlockingQueue(benchmark::State& state) {
+  static BlockingQueue<int>* queue = nullptr;
+  if (state.thread_index() == 0) {
+    queue = new BlockingQueue<int>(64);
+  }
+  for (auto _ : state) {
+    queue->Push(1);
+    benchmark::DoNotOptimize(queue->Pop());
+  }
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index() == 0) {
+    delete queue;
+  }
+}
+BENCHMARK(BM_BlockingQueue)->ThreadRange(1, 8)->UseRealTime();
+
+}  // namespace wenet
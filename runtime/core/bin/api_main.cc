@@ -12,6 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "api/wenet_api.h"
 #include "frontend/wav.h"
 #include "utils/flags.h"
@@ -20,6 +25,18 @@
 DEFINE_string(model_dir, "", "model dir path");
 DEFINE_string(wav_path, "", "single wave path");
 DEFINE_bool(enable_timestamp, false, "enable timestamps");
+DEFINE_int32(num_decoders, 1,
+             "decoders of the shared model, each decodes the wave in its "
+             "own thread");
+DEFINE_bool(async_decode, false,
+            "push the wave by packets of 100ms with wenet_decode_async, the "
+            "results are logged by the callback");
+
+static void LogResult(void* user_data, const char* result, int len,
+                      int final) {
+  LOG(INFO) << "decoder " << *static_cast<int*>(user_data)
+            << (final ? " final " : " partial ") << std::string(result, len);
+}
 
 int main(int argc, char *argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, false);
@@ -27,21 +44,47 @@ int main(int argc, char *argv[]) {
 
   wenet_set_log_level(2);
 
-  void* decoder = wenet_init(FLAGS_model_dir.c_str());
-  wenet_set_timestamp(decoder, FLAGS_enable_timestamp == true ? 1 : 0);
   wenet::WavReader wav_reader(FLAGS_wav_path);
   std::vector<int16_t> data(wav_reader.num_sample());
   for  (int i = 0; i < wav_reader.num_sample(); i++) {
     data[i] = static_cast<int16_t>(*(wav_reader.data() + i));
   }
 
-  for (int i = 0; i < 10; i++) {
-    wenet_decode(decoder, reinterpret_cast<const char *>(data.data()),
-                 data.size() * 2);
-    const char* result = wenet_get_result(decoder);
-    LOG(INFO) << i << " " << result;
-    wenet_reset(decoder);
+  // The model is loaded once for all the decoders
+  void* model = wenet_model_load(FLAGS_model_dir.c_str());
+  auto run = [&](int id) {
+    void* decoder = wenet_decoder_create(model);
+    wenet_set_timestamp(decoder, FLAGS_enable_timestamp == true ? 1 : 0);
+    if (FLAGS_async_decode) {
+      wenet_set_result_callback(decoder, &LogResult, &id);
+      const int packet = 1600;
+      for (size_t start = 0; start < data.size(); start += packet) {
+        int len = std::min<size_t>(packet, data.size() - start);
+        wenet_decode_async(decoder,
+                           reinterpret_cast<const char *>(&data[start]),
+                           len * 2, start + len >= data.size() ? 1 : 0);
+      }
+      wenet_wait(decoder);
+      wenet_free(decoder);
+      return;
+    }
+    for (int i = 0; i < 10; i++) {
+      wenet_decode(decoder, reinterpret_cast<const char *>(data.data()),
+                   data.size() * 2);
+      const char* result = wenet_get_result(decoder);
+      LOG(INFO) << "decoder " << id << " " << i << " " << result;
+      wenet_reset(decoder);
+    }
+    wenet_free(decoder);
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < FLAGS_num_decoders; i++) {
+    threads.emplace_back(run, i);
+  }
+  run(0);
+  for (auto& t : threads) {
+    t.join();
   }
-  wenet_free(decoder);
+  wenet_model_free(model);
   return 0;
 }
@@ -0,0 +1,49 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "decoder/context_graph.h"
+#include "utils/flags.h"
+#include "utils/log.h"
+#include "utils/string.h"
+
+DEFINE_string(text_path, "", "text symbol table, e.g. words.txt");
+DEFINE_string(binary_path, "",
+              "output binary symbol table, for dict_path or unit_path of the "
+              "servers and the decoders");
+
+// Compile the text symbol table into the binary one, which the runtime
+// maps into memory instead of parsing it. The context tags are reserved.
+int main(int argc, char* argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, false);
+  google::InitGoogleLogging(argv[0]);
+  CHECK(!FLAGS_text_path.empty() && !FLAGS_binary_path.empty())
+      << "Usage: compile_symbol_table_main --text_path words.txt "
+         "--binary_path words.bin";
+
+  std::unique_ptr<fst::SymbolTable> table(
+      fst::SymbolTable::ReadText(FLAGS_text_path));
+  CHECK(table != nullptr) << "Can't read " << FLAGS_text_path;
+  wenet::SymbolStrings symbols(
+      *table, std::vector<std::string>{wenet::kContextStartTag,
+                                       wenet::kContextEndTag});
+  CHECK(symbols.Write(FLAGS_binary_path))
+      << "Can't write " << FLAGS_binary_path;
+  LOG(INFO) << "Compiled " << symbols.num_ids() << " symbols of "
+            << FLAGS_text_path << " into " << FLAGS_binary_path;
+  return 0;
+}
@@ -2,41 +2,1033 @@
 // Author: binbinzhang@mobvoi.com (Binbin Zhang)
 //         di.wu@mobvoi.com (Di Wu)
 
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
 #include <iomanip>
+#include <map>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 
 #include "torch/script.h"
 
+#include "decoder/batch_transcriber.h"
+#include "decoder/ctc_cache.h"
 #include "decoder/params.h"
+#include "frontend/feature_io.h"
 #include "frontend/wav.h"
+#include "frontend/wav_archive.h"
+#include "utils/async_log.h"
 #include "utils/flags.h"
+#include "utils/huge_pages.h"
+#include "utils/json.h"
 #include "utils/log.h"
 #include "utils/string.h"
+#include "utils/thread_pool.h"
 #include "utils/timer.h"
+#include "utils/trace.h"
 #include "utils/utils.h"
 
 DEFINE_bool(simulate_streaming, false, "simulate streaming input");
 DEFINE_bool(output_nbest, false, "output n-best of decode result");
 DEFINE_string(wav_path, "", "single wave path");
 DEFINE_string(wav_scp, "", "input wav scp");
+DEFINE_string(wav_shards, "",
+              "list of the tar shards of the waves, one path per line, the "
+              "members key.wav of the shards are decoded, instead of "
+              "--wav_scp");
+DEFINE_int32(wav_prefetch, 0,
+             "read the waves of --wav_scp or --wav_shards on a background "
+             "thread up to this many waves ahead of the workers, 0 means "
+             "the workers read them, or 16 with --wav_shards");
 DEFINE_string(result, "", "result output file");
 DEFINE_bool(continuous_decoding, false, "continuous decoding mode");
+DEFINE_int32(num_workers, 1,
+             "threads decoding the waves in parallel, each with its own "
+             "copy of the model, better with --num_threads 1");
+DEFINE_bool(ordered_output, true,
+            "write the results in the order of the waves, otherwise as soon "
+            "as they are decoded");
+DEFINE_string(latency_report, "",
+              "write the latency percentiles of the chunk by chunk decoding "
+              "to this file in JSON, with the RTF, the peak RSS, the "
+              "allocations and the error rate against --ref_text, run with "
+              "--simulate_streaming for the latencies of real time input");
+DEFINE_string(feat_rspecifier, "",
+              "decode the precomputed features of a Kaldi archive or script, "
+              "e.g. ark:feats.ark or scp:feats.scp, instead of the waves");
+DEFINE_string(dump_feats, "",
+              "write the features of the waves to a Kaldi archive, e.g. "
+              "ark,scp:feats.ark,feats.scp, and exit without decoding");
+DEFINE_string(dump_ctc_cache, "",
+              "write the ctc log probs and the encoder outputs of the "
+              "decoding to a Kaldi archive, e.g. ark,scp:ctc.ark,ctc.scp, "
+              "for the search only sweeps of --ctc_cache");
+DEFINE_int32(ctc_cache_topk, 0,
+             "keep only the topk ctc log probs of each frame in "
+             "--dump_ctc_cache, 0 means all");
+DEFINE_string(ctc_cache, "",
+              "replay the archive of --dump_ctc_cache through the search and "
+              "the rescoring without the encoder, e.g. ark:ctc.ark, to tune "
+              "the search options");
+DEFINE_string(lattice_wspecifier, "",
+              "write the word lattices of the ctc wfst search to the Kaldi "
+              "archive, e.g. \"ark:lat.ark\", keyed by the wave, or by "
+              "wave-N for the Nth sentence of --continuous_decoding");
+DEFINE_string(trace_path, "",
+              "write the scoped traces of the hot paths, compiled in by "
+              "cmake -DTRACE=ON, in the Chrome trace format");
+DEFINE_int32(batch_size, 0,
+             "decode the waves offline with full context, up to batch_size "
+             "waves of close lengths in one encoder forward, 0 means the "
+             "chunk by chunk decoding");
+DEFINE_int32(long_form_segment_s, 0,
+             "cut each wave into segments of at least long_form_segment_s "
+             "seconds at the silences of the energy VAD, and decode the "
+             "segments in parallel by --num_workers, 0 means each wave is "
+             "decoded left to right by one worker");
+DEFINE_int32(long_form_max_segment_s, 60,
+             "a segment is cut at this length even without a silence");
+DEFINE_bool(multi_channel, false,
+            "decode the channels of each wave, e.g. the agent and the "
+            "customer of a call, as the streams of one session, their chunks "
+            "are forwarded by the encoder in one batch, and their sentences "
+            "are merged by their start times");
+DEFINE_bool(compare_quantized, false,
+            "decode each wave by the float model and by its int8 one, of "
+            "--torch_quantized or --onnx_quantized, and report the RTF of "
+            "both and the error rate of the int8 results against the float "
+            "ones, the int8 results are written to --result");
+DEFINE_string(ref_text, "",
+              "the references of the waves, one \"key text\" per line, the "
+              "error rates of --compare_quantized and of --latency_report "
+              "are against them");
+DEFINE_bool(tlb_misses, false,
+            "count the data TLB misses of the decoding by the perf events, "
+            "e.g. to compare the runs with and without --huge_pages");
+
+// Latency samples of the streaming decoding in milliseconds
+struct LatencyStats {
+  // Of each chunk
+  std::vector<double> encoder_ms;
+  std::vector<double> search_ms;
+  // Of each stream, from its start to its first partial result
+  std::vector<double> first_partial_ms;
+  // Of each stream, from the end of its input to its final result
+  std::vector<double> final_ms;
+  // Of each rescoring
+  std::vector<double> rescoring_ms;
+
+  void Merge(const LatencyStats &other) {
+    auto append = [](const std::vector<double> &src,
+                     std::vector<double> *dst) {
+      dst->insert(dst->end(), src.begin(), src.end());
+    };
+    append(other.encoder_ms, &encoder_ms);
+    append(other.search_ms, &search_ms);
+    append(other.first_partial_ms, &first_partial_ms);
+    append(other.final_ms, &final_ms);
+    append(other.rescoring_ms, &rescoring_ms);
+  }
+};
+
+// The result of one wave and its timing
+struct WavResult {
+  std::string text;
+  // The 1-best of the wave
+  std::string sentence;
+  // The keys and the lattices of the sentences, with --lattice_wspecifier
+  std::vector<std::pair<std::string, std::string>> lattices;
+  int wave_dur = 0;
+  int decode_time = 0;
+  LatencyStats latency;
+};
+
+// Count, mean, max and the nearest rank percentiles of the samples
+static json::JSON Summarize(std::vector<double> samples) {
+  json::JSON obj;
+  obj["count"] = static_cast<int>(samples.size());
+  if (samples.empty()) return obj;
+  std::sort(samples.begin(), samples.end());
+  auto percentile = [&samples](double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p / 100 * samples.size()));
+    return samples[std::max<size_t>(rank, 1) - 1];
+  };
+  double sum = 0;
+  for (double x : samples) sum += x;
+  obj["mean"] = sum / samples.size();
+  obj["p50"] = percentile(50);
+  obj["p90"] = percentile(90);
+  obj["p99"] = percentile(99);
+  obj["max"] = samples.back();
+  return obj;
+}
+
+// The errors and the units of the references of the error rate
+struct ErrorCount {
+  int64_t errors = 0;
+  int64_t units = 0;
+
+  void Add(const std::string &ref, const std::string &hyp) {
+    std::vector<std::string> ref_units, hyp_units;
+    wenet::SplitToScoringUnits(ref, &ref_units);
+    wenet::SplitToScoringUnits(hyp, &hyp_units);
+    errors += wenet::EditDistance(ref_units, hyp_units);
+    units += ref_units.size();
+  }
+  float Rate() const {
+    return 100.0f * errors / std::max<int64_t>(units, 1);
+  }
+};
+
+// The references of --ref_text by the keys of the waves
+static std::unordered_map<std::string, std::string> ReadRefs() {
+  std::unordered_map<std::string, std::string> refs;
+  if (FLAGS_ref_text.empty()) return refs;
+  std::ifstream is(FLAGS_ref_text);
+  CHECK(is.good()) << "Can't open " << FLAGS_ref_text;
+  std::string line;
+  while (getline(is, line)) {
+    size_t pos = line.find_first_of(" \t");
+    if (pos == std::string::npos) {
+      refs[line] = "";
+    } else {
+      refs[line.substr(0, pos)] = line.substr(pos + 1);
+    }
+  }
+  return refs;
+}
+
+// The C++ allocations of the process, by the global operator new below,
+// sharded by thread so the counting doesn't contend. The allocations of the
+// model runtimes by their own allocators, e.g. of the tensors, are not
+// counted.
+struct alignas(64) AllocationShard {
+  std::atomic<int64_t> count{0};
+};
+static const int kAllocationShards = 64;
+static AllocationShard g_allocations[kAllocationShards];
+
+void *operator new(size_t size) {
+  static std::atomic<int> next_shard{0};
+  thread_local int shard =
+      next_shard.fetch_add(1, std::memory_order_relaxed) % kAllocationShards;
+  g_allocations[shard].count.fetch_add(1, std::memory_order_relaxed);
+  void *p = malloc(size == 0 ? 1 : size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static int64_t NumAllocations() {
+  int64_t count = 0;
+  for (const auto &shard : g_allocations) {
+    count += shard.count.load(std::memory_order_relaxed);
+  }
+  return count;
+}
+
+// The peak resident memory of the process in MB
+static double PeakRssMb() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+  // In KB on Linux
+  return usage.ru_maxrss / 1024.0;
+}
+
+static void WriteLatencyReport(
+    const std::string &path, const LatencyStats &stats, int num_waves,
+    int64_t waves_dur, int64_t decode_time, int wall_time,
+    const std::unordered_map<std::string, std::string> *hyps) {
+  json::JSON report;
+  report["num_waves"] = num_waves;
+  report["audio_ms"] = static_cast<double>(waves_dur);
+  report["rtf"] = static_cast<double>(decode_time) /
+                  std::max<int64_t>(waves_dur, 1);
+  report["wall_ms"] = wall_time;
+  report["chunk_size"] = FLAGS_chunk_size;
+  report["simulate_streaming"] = FLAGS_simulate_streaming;
+  report["model"] = FLAGS_onnx_dir.empty() ? "torch" : "onnx";
+  report["search"] = FLAGS_fst_path.empty() ? "prefix" : "wfst";
+  report["num_threads"] =
+      FLAGS_onnx_dir.empty() ? FLAGS_num_threads : FLAGS_num_onnx_threads;
+  report["num_workers"] = FLAGS_num_workers;
+  report["rescoring_weight"] = FLAGS_rescoring_weight;
+  report["encoder_ms"] = Summarize(stats.encoder_ms);
+  report["search_ms"] = Summarize(stats.search_ms);
+  report["first_partial_ms"] = Summarize(stats.first_partial_ms);
+  report["final_ms"] = Summarize(stats.final_ms);
+  report["rescoring_ms"] = Summarize(stats.rescoring_ms);
+  report["peak_rss_mb"] = PeakRssMb();
+  report["allocations"] = static_cast<double>(NumAllocations());
+  // The error rate of the 1-best of the waves against --ref_text
+  std::unordered_map<std::string, std::string> refs = ReadRefs();
+  if (hyps != nullptr && !refs.empty()) {
+    ErrorCount errors;
+    int num_refs = 0;
+    for (const auto &hyp : *hyps) {
+      auto ref = refs.find(hyp.first);
+      if (ref == refs.end()) continue;
+      errors.Add(ref->second, hyp.second);
+      num_refs++;
+    }
+    report["num_refs"] = num_refs;
+    report["errors"] = static_cast<double>(errors.errors);
+    report["ref_units"] = static_cast<double>(errors.units);
+    report["error_rate"] = errors.Rate();
+  }
+  std::ofstream os(path);
+  os << report.dump() << std::endl;
+  LOG(INFO) << "Latency report written to " << path;
+}
+
+// Write the results of the workers, in the order of the waves if ordered,
+// it is thread safe
+class ResultWriter {
+ public:
+  ResultWriter(std::ostream* os, bool ordered) : os_(os), ordered_(ordered) {}
+
+  void Write(int index, std::string text) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!ordered_) {
+      *os_ << text << std::flush;
+      return;
+    }
+    if (index >= done_.size()) {
+      pending_.resize(index + 1);
+      done_.resize(index + 1, false);
+    }
+    pending_[index] = std::move(text);
+    done_[index] = true;
+    // Flush the results before the first one not yet decoded
+    while (next_ < done_.size() && done_[next_]) {
+      *os_ << pending_[next_];
+      std::string().swap(pending_[next_]);
+      next_++;
+    }
+    os_->flush();
+  }
+
+ private:
+  std::ostream* os_;
+  bool ordered_;
+  std::mutex mutex_;
+  std::vector<std::string> pending_;
+  std::vector<bool> done_;
+  size_t next_ = 0;
+};
+
+static std::string FormatResult(
+    const std::string &key, const std::string &final_result,
+    const std::vector<wenet::DecodeResult> &nbest) {
+  std::ostringstream buffer;
+  if (!FLAGS_output_nbest) {
+    buffer << key << " " << final_result << std::endl;
+  } else {
+    buffer << "wav " << key << std::endl;
+    for (auto &r : nbest) {
+      if (r.sentence.empty())
+        continue;
+      buffer << "candidate " << r.score << " " << r.sentence << std::endl;
+    }
+  }
+  return buffer.str();
+}
+
+// Decode the wav of wav_path, or the wave read ahead if wav is not nullptr,
+// or the precomputed feats if it's not nullptr.
+// The model outputs are recorded to ctc_record if it's not nullptr. Only
+// the samples [begin_sample, end_sample) of the wav are decoded if
+// end_sample >= 0, and the timestamps are of the whole wav.
+static WavResult DecodeWav(
+    const std::string& key, const std::string& wav_path,
+    const wenet::FeatureMatrix* feats, const wenet::WavData* wav,
+    std::shared_ptr<wenet::FeaturePipelineConfig> feature_config,
+    std::shared_ptr<wenet::DecodeOptions> decode_config,
+    std::shared_ptr<wenet::DecodeResource> decode_resource,
+    wenet::CtcCacheEntry* ctc_record = nullptr, int begin_sample = 0,
+    int end_sample = -1) {
+  wenet::WavStreamReader wav_reader;
+  auto feature_pipeline =
+      std::make_shared<wenet::FeaturePipeline>(*feature_config);
+  int sample_rate = 0;
+  if (wav != nullptr) {
+    sample_rate = wav->sample_rate;
+    feature_pipeline->set_input_sample_rate(sample_rate);
+    if (end_sample < 0) end_sample = wav->samples.size();
+  } else if (feats == nullptr) {
+    wav_reader.Open(wav_path);
+    sample_rate = wav_reader.sample_rate();
+    feature_pipeline->set_input_sample_rate(sample_rate);
+    if (end_sample < 0) end_sample = wav_reader.num_sample();
+    wav_reader.Seek(begin_sample);
+  }
+  int num_samples_read = begin_sample;
+  // The wav is fed by chunks of one second whenever the decoder waits for
+  // features, so long wavs are decoded with bounded memory.
+  std::vector<float> samples;
+  // The end of the input, from which the final result latency is counted
+  wenet::Timer input_end_timer;
+  auto feed_wav = [&]() {
+    if (feats != nullptr) {
+      feature_pipeline->AcceptFeatures(*feats);
+      feature_pipeline->set_input_finished();
+      input_end_timer.Reset();
+    } else if (wav != nullptr && num_samples_read < end_sample) {
+      int num_samples = std::min(sample_rate, end_sample - num_samples_read);
+      samples.assign(wav->samples.begin() + num_samples_read,
+                     wav->samples.begin() + num_samples_read + num_samples);
+      num_samples_read += num_samples;
+      feature_pipeline->AcceptWaveform(samples);
+    } else if (wav == nullptr &&
+               wav_reader.Read(std::min(sample_rate,
+                                        end_sample - num_samples_read),
+                               &samples) > 0) {
+      num_samples_read += samples.size();
+      feature_pipeline->AcceptWaveform(samples);
+    } else {
+      feature_pipeline->set_input_finished();
+      input_end_timer.Reset();
+    }
+  };
+  feed_wav();
+
+  wenet::AsrDecoder decoder(feature_pipeline, decode_resource,
+                            *decode_config);
+  if (begin_sample > 0) {
+    decoder.set_base_frame_offset(
+        static_cast<int64_t>(begin_sample) * feature_config->sample_rate /
+        sample_rate / feature_config->frame_shift);
+  }
+  wenet::Timer stream_timer;
+  WavResult wav_result;
+  LatencyStats &latency = wav_result.latency;
+  auto add_rescoring_latency = [&]() {
+    latency.rescoring_ms.push_back(decoder.last_rescoring_us() / 1000.0);
+  };
+
+  if (feats != nullptr) {
+    wav_result.wave_dur = feats->rows() * decoder.feature_frame_shift_in_ms();
+  } else {
+    wav_result.wave_dur =
+        static_cast<int>(static_cast<float>(end_sample - begin_sample) /
+                         sample_rate * 1000);
+  }
+  int decode_time = 0;
+  std::string final_result;
+  auto add_lattice = [&]() {
+    if (!FLAGS_lattice_wspecifier.empty()) {
+      wav_result.lattices.emplace_back(key, decoder.lattice());
+    }
+  };
+  while (true) {
+    wenet::Timer timer;
+    wenet::DecodeState state = decoder.Decode(false);
+    if (state == wenet::DecodeState::kWaitFeats) {
+      decode_time += timer.Elapsed();
+      feed_wav();
+      continue;
+    }
+    if (decoder.last_forward_us() >= 0) {
+      latency.encoder_ms.push_back(decoder.last_forward_us() / 1000.0);
+      latency.search_ms.push_back(decoder.last_search_us() / 1000.0);
+      if (ctc_record != nullptr && !decoder.last_ctc_log_probs().empty()) {
+        ctc_record->chunks.push_back(decoder.last_ctc_log_probs());
+      }
+    }
+    if (latency.first_partial_ms.empty() && decoder.DecodedSomething()) {
+      latency.first_partial_ms.push_back(stream_timer.ElapsedUs() / 1000.0);
+    }
+    if (state == wenet::DecodeState::kEndFeats) {
+      decoder.Rescoring();
+      add_rescoring_latency();
+      latency.final_ms.push_back(input_end_timer.ElapsedUs() / 1000.0);
+    }
+    int chunk_decode_time = timer.Elapsed();
+    decode_time += chunk_decode_time;
+    if (decoder.DecodedSomething()) {
+      LOG_EVERY_MS(INFO, 1000) << "Partial result: "
+                                << decoder.result()[0].sentence;
+    }
+
+    if (FLAGS_continuous_decoding &&
+        state == wenet::DecodeState::kEndpoint) {
+      if (decoder.DecodedSomething()) {
+        decoder.Rescoring();
+        add_rescoring_latency();
+        final_result.append(decoder.result()[0].sentence);
+        add_lattice();
+      }
+      decoder.ResetContinuousDecoding();
+    }
+
+    if (state == wenet::DecodeState::kEndFeats) {
+      break;
+    } else if (FLAGS_chunk_size > 0 && FLAGS_simulate_streaming) {
+      float frame_shift_in_ms =
+          static_cast<float>(feature_config->frame_shift) /
+          feature_config->sample_rate * 1000;
+      auto wait_time =
+          decoder.num_frames_in_current_chunk() * frame_shift_in_ms -
+          chunk_decode_time;
+      if (wait_time > 0) {
+        LOG(INFO) << "Simulate streaming, waiting for " << wait_time << "ms";
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(static_cast<int>(wait_time)));
+      }
+    }
+  }
+  LOG(INFO) << "num frames " << feature_pipeline->num_frames();
+  if (ctc_record != nullptr) {
+    ctc_record->chunk_size = decode_config->chunk_size;
+    ctc_record->num_feature_frames = feature_pipeline->num_frames();
+    if (!decoder.GetEncoderOut(&ctc_record->encoder_out)) {
+      LOG(WARNING) << "The model doesn't support caching the encoder "
+                   << "outputs, the replay of " << key << " can't be "
+                   << "rescored";
+    }
+  }
+  if (decoder.DecodedSomething()) {
+    final_result.append(decoder.result()[0].sentence);
+    add_lattice();
+  }
+  if (FLAGS_continuous_decoding) {
+    for (size_t i = 0; i < wav_result.lattices.size(); ++i) {
+      wav_result.lattices[i].first += "-" + std::to_string(i);
+    }
+  }
+  LOG(INFO) << key << " Final result: " << final_result << std::endl;
+  LOG(INFO) << "Decoded " << wav_result.wave_dur << "ms audio taken "
+            << decode_time << "ms.";
+
+  wav_result.text = FormatResult(key, final_result, decoder.result());
+  wav_result.sentence = std::move(final_result);
+  wav_result.decode_time = decode_time;
+  return wav_result;
+}
+
+// Decode the waves with full context, the utterances of close lengths are
+// padded and forwarded by the encoder in one batch. Return the duration(ms)
+// of the audio.
+static int64_t BatchDecode(
+    const std::vector<std::pair<std::string, std::string>>& waves,
+    std::shared_ptr<wenet::FeaturePipelineConfig> feature_config,
+    std::shared_ptr<wenet::DecodeOptions> decode_config,
+    std::shared_ptr<wenet::DecodeResource> decode_resource,
+    ResultWriter* writer) {
+  wenet::BatchTranscribeOptions opts;
+  opts.max_batch_size = FLAGS_batch_size;
+  wenet::BatchTranscriber transcriber(feature_config, decode_config,
+                                      decode_resource, opts);
+  // Sort the waves longest first by their headers, so the waves of a batch
+  // have close lengths and little padding
+  std::vector<int64_t> durations(waves.size());
+  int64_t total_duration = 0;
+  for (size_t i = 0; i < waves.size(); ++i) {
+    wenet::WavStreamReader wav_reader(waves[i].second);
+    durations[i] = static_cast<int64_t>(wav_reader.num_sample()) * 1000 /
+                   std::max(wav_reader.sample_rate(), 1);
+    total_duration += durations[i];
+  }
+  std::vector<int> order(waves.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&durations](int a, int b) {
+    return durations[a] > durations[b];
+  });
+
+  // The waves are read and decoded by blocks of some batches, so the memory
+  // is bounded
+  const size_t block_size = FLAGS_batch_size * 16;
+  for (size_t begin = 0; begin < order.size(); begin += block_size) {
+    size_t end = std::min(begin + block_size, order.size());
+    std::vector<wenet::TranscribeAudio> audios(end - begin);
+    std::vector<float> samples;
+    for (size_t i = begin; i < end; ++i) {
+      wenet::WavStreamReader wav_reader(waves[order[i]].second);
+      wav_reader.Read(wav_reader.num_sample(), &samples);
+      auto &audio = audios[i - begin];
+      audio.sample_rate = wav_reader.sample_rate();
+      audio.pcm.resize(samples.size());
+      for (size_t j = 0; j < samples.size(); ++j) {
+        audio.pcm[j] = static_cast<int16_t>(
+            std::max(-32768.0f, std::min(32767.0f, samples[j])));
+      }
+    }
+    std::vector<std::vector<wenet::DecodeResult>> results;
+    transcriber.Transcribe(audios, &results);
+    for (size_t i = begin; i < end; ++i) {
+      const auto &nbest = results[i - begin];
+      const std::string &key = waves[order[i]].first;
+      std::string one_best = nbest.empty() ? "" : nbest[0].sentence;
+      LOG(INFO) << key << " Final result: " << one_best;
+      writer->Write(order[i], FormatResult(key, one_best, nbest));
+    }
+  }
+
+  wenet::BatchEncoderStats stats = transcriber.encoder_stats();
+  if (stats.num_batches > 0) {
+    LOG(INFO) << "Encoder: " << stats.num_batches << " batches, "
+              << std::setprecision(4)
+              << static_cast<float>(stats.num_items) / stats.num_batches
+              << " waves per batch, "
+              << 100.0f * (stats.padded_frames - stats.valid_frames) /
+                     std::max<int64_t>(stats.padded_frames, 1)
+              << "% padding frames";
+  }
+  return total_duration;
+}
+
+// Cut the wav into the segments [begin, end) of samples at the silences of
+// the energy VAD on its features. A segment is cut at its first silent frame
+// after min_segment_s, or at max_segment_s without a silence. The features
+// are computed chunk by chunk and dropped, only the cuts are kept.
+static std::vector<std::pair<int, int>> SegmentWav(
+    const std::string& wav_path,
+    const wenet::FeaturePipelineConfig& feature_config, int min_segment_s,
+    int max_segment_s) {
+  std::vector<std::pair<int, int>> segments;
+  wenet::WavStreamReader wav_reader;
+  if (!wav_reader.Open(wav_path)) return segments;
+  wenet::FeaturePipeline feature_pipeline(feature_config);
+  feature_pipeline.set_input_sample_rate(wav_reader.sample_rate());
+  wenet::EnergyVad vad(feature_config.vad_opts);
+  const int frames_per_second =
+      feature_config.sample_rate / feature_config.frame_shift;
+  const int min_frames = min_segment_s * frames_per_second;
+  const int max_frames = std::max(max_segment_s * frames_per_second,
+                                  min_frames);
+  // The segments in frames first
+  int begin = 0;
+  int frame = 0;
+  wenet::FeatureMatrix feats;
+  auto cut = [&]() {
+    int num_frames = feature_pipeline.NumQueuedFrames();
+    if (num_frames == 0) return;
+    feature_pipeline.Read(num_frames, &feats);
+    for (int i = 0; i < feats.rows(); ++i, ++frame) {
+      bool speech = vad.IsSpeech(feats.Row(i), feats.cols());
+      int length = frame - begin;
+      if ((length >= min_frames && !speech) || length >= max_frames) {
+        segments.emplace_back(begin, frame);
+        begin = frame;
+      }
+    }
+  };
+  std::vector<float> samples;
+  while (wav_reader.Read(wav_reader.sample_rate(), &samples) > 0) {
+    feature_pipeline.AcceptWaveform(samples);
+    cut();
+  }
+  feature_pipeline.set_input_finished();
+  cut();
+  if (frame > begin || segments.empty()) segments.emplace_back(begin, frame);
+  // The frames to the samples of the wav, the last segment runs to its end
+  const double samples_per_frame =
+      static_cast<double>(feature_config.frame_shift) *
+      wav_reader.sample_rate() / feature_config.sample_rate;
+  for (auto& segment : segments) {
+    segment.first = static_cast<int>(segment.first * samples_per_frame);
+    segment.second = static_cast<int>(segment.second * samples_per_frame);
+  }
+  segments.back().second = wav_reader.num_sample();
+  return segments;
+}
+
+// Decode the waves one by one, each one is cut into segments which are
+// decoded in parallel by num_workers, the results of the segments are
+// joined in order. Return the duration(ms) of the audio and the decode
+// time(ms) of the workers.
+static std::pair<int64_t, int64_t> LongFormDecode(
+    const std::vector<std::pair<std::string, std::string>>& waves,
+    std::shared_ptr<wenet::FeaturePipelineConfig> feature_config,
+    std::shared_ptr<wenet::DecodeOptions> decode_config,
+    std::shared_ptr<wenet::DecodeResource> decode_resource, int num_workers,
+    ResultWriter* writer, LatencyStats* latency) {
+  int64_t total_waves_dur = 0;
+  int64_t total_decode_time = 0;
+  wenet::ThreadPool pool(num_workers);
+  for (size_t i = 0; i < waves.size(); ++i) {
+    const std::string& key = waves[i].first;
+    const std::string& wav_path = waves[i].second;
+    wenet::Timer timer;
+    std::vector<std::pair<int, int>> segments =
+        SegmentWav(wav_path, *feature_config, FLAGS_long_form_segment_s,
+                   FLAGS_long_form_max_segment_s);
+    LOG(INFO) << key << " is cut into " << segments.size()
+              << " segments in " << timer.Elapsed() << "ms";
+    std::vector<WavResult> results(segments.size());
+    for (size_t j = 0; j < segments.size(); ++j) {
+      pool.Post([&, j]() {
+        results[j] = DecodeWav(key, wav_path, nullptr, nullptr,
+                               feature_config, decode_config, decode_resource,
+                               nullptr, segments[j].first, segments[j].second);
+      });
+    }
+    pool.Drain();
+    std::string final_result;
+    for (auto& result : results) {
+      final_result.append(result.sentence);
+      total_waves_dur += result.wave_dur;
+      total_decode_time += result.decode_time;
+      latency->Merge(result.latency);
+    }
+    LOG(INFO) << key << " Final result: " << final_result;
+    // The n-best of the segments are not joined, only their 1-best
+    wenet::DecodeResult one_best;
+    one_best.score = 0.0;
+    one_best.sentence = final_result;
+    writer->Write(i, FormatResult(key, final_result, {one_best}));
+  }
+  return {total_waves_dur, total_decode_time};
+}
+
+// A sentence of a channel of a multi-channel wave
+struct ChannelSentence {
+  int channel = 0;
+  int start_ms = 0;
+  int end_ms = 0;
+  std::string text;
+};
+
+// Decode a channel of the wave, the decoders of the channels share the
+// encoder batches of decode_resource. Return the decode time(ms).
+static int DecodeChannel(
+    const wenet::WavReader& wav_reader, int channel,
+    std::shared_ptr<wenet::FeaturePipelineConfig> feature_config,
+    std::shared_ptr<wenet::DecodeOptions> decode_config,
+    std::shared_ptr<wenet::DecodeResource> decode_resource,
+    std::vector<ChannelSentence>* sentences) {
+  auto feature_pipeline =
+      std::make_shared<wenet::FeaturePipeline>(*feature_config);
+  feature_pipeline->set_input_sample_rate(wav_reader.sample_rate());
+  // The samples of the channel are fed in place by chunks of one second
+  const float* samples = wav_reader.channel_data(channel);
+  const int num_samples = wav_reader.num_sample();
+  int num_samples_read = 0;
+  auto feed_wav = [&]() {
+    if (num_samples_read < num_samples) {
+      int n = std::min(wav_reader.sample_rate(),
+                       num_samples - num_samples_read);
+      feature_pipeline->AcceptWaveform(samples + num_samples_read, n);
+      num_samples_read += n;
+    } else {
+      feature_pipeline->set_input_finished();
+    }
+  };
+  feed_wav();
+
+  wenet::AsrDecoder decoder(feature_pipeline, decode_resource,
+                            *decode_config);
+  // The sentences without the timestamps of the units start at the end of
+  // the previous one
+  int64_t sentence_start_ms = 0;
+  auto add_sentence = [&]() {
+    if (!decoder.DecodedSomething()) return;
+    const wenet::DecodeResult& best = decoder.result()[0];
+    ChannelSentence sentence;
+    sentence.channel = channel;
+    sentence.start_ms = best.word_pieces.empty()
+                            ? static_cast<int>(sentence_start_ms)
+                            : best.word_pieces.front().start;
+    sentence.end_ms = best.word_pieces.empty()
+                          ? static_cast<int>(decoder.decoded_audio_ms())
+                          : best.word_pieces.back().end;
+    sentence.text = best.sentence;
+    sentences->push_back(std::move(sentence));
+  };
+  int decode_time = 0;
+  while (true) {
+    wenet::Timer timer;
+    wenet::DecodeState state = decoder.Decode(false);
+    if (state == wenet::DecodeState::kWaitFeats) {
+      decode_time += timer.Elapsed();
+      feed_wav();
+      continue;
+    }
+    if (state == wenet::DecodeState::kEndFeats) {
+      decoder.Rescoring();
+      decode_time += timer.Elapsed();
+      add_sentence();
+      break;
+    }
+    if (FLAGS_continuous_decoding &&
+        state == wenet::DecodeState::kEndpoint) {
+      if (decoder.DecodedSomething()) {
+        decoder.Rescoring();
+        add_sentence();
+      }
+      sentence_start_ms = decoder.decoded_audio_ms();
+      decoder.ResetContinuousDecoding();
+    }
+    decode_time += timer.Elapsed();
+  }
+  return decode_time;
+}
+
+// Decode the channels of each wave in parallel, one decoder per channel,
+// the encoder forwards the chunks of the channels in one batch. The
+// sentences of the channels are written in the order of their start
+// times, one per line, as "key-channel start_ms end_ms text". Return the
+// duration(ms) of the audio of the channels and the decode time(ms) of
+// them.
+static std::pair<int64_t, int64_t> MultiChannelDecode(
+    const std::vector<std::pair<std::string, std::string>>& waves,
+    std::shared_ptr<wenet::FeaturePipelineConfig> feature_config,
+    std::shared_ptr<wenet::DecodeOptions> decode_config,
+    std::shared_ptr<wenet::DecodeResource> decode_resource,
+    ResultWriter* writer) {
+  int64_t total_waves_dur = 0;
+  int64_t total_decode_time = 0;
+  // The resources by the number of channels, their encoder batches are
+  // of the channels of a wave
+  std::map<int, std::shared_ptr<wenet::DecodeResource>> resources;
+  for (size_t i = 0; i < waves.size(); ++i) {
+    const std::string& key = waves[i].first;
+    wenet::WavReader wav_reader;
+    if (!wav_reader.Open(waves[i].second)) {
+      LOG(WARNING) << "Error in reading " << waves[i].second;
+      continue;
+    }
+    const int num_channels = wav_reader.num_channel();
+    auto& resource = resources[num_channels];
+    if (resource == nullptr) {
+      resource = std::make_shared<wenet::DecodeResource>(*decode_resource);
+      resource->replicas = nullptr;
+      if (num_channels > 1) {
+        wenet::BatchEncoderOptions encoder_opts;
+        encoder_opts.max_batch_size = num_channels;
+        encoder_opts.max_wait_us = FLAGS_max_batch_wait_us;
+        resource->encoder_scheduler =
+            std::make_shared<wenet::BatchEncoderScheduler>(encoder_opts);
+      }
+    }
+    std::vector<std::vector<ChannelSentence>> channel_sentences(
+        num_channels);
+    std::vector<int> decode_times(num_channels, 0);
+    std::vector<std::thread> threads;
+    for (int c = 0; c < num_channels; ++c) {
+      threads.emplace_back([&, c]() {
+        decode_times[c] =
+            DecodeChannel(wav_reader, c, feature_config, decode_config,
+                          resource, &channel_sentences[c]);
+      });
+    }
+    for (auto& thread : threads) thread.join();
+
+    std::vector<ChannelSentence> sentences;
+    for (int c = 0; c < num_channels; ++c) {
+      total_decode_time += decode_times[c];
+      for (auto& sentence : channel_sentences[c]) {
+        sentences.push_back(std::move(sentence));
+      }
+    }
+    std::stable_sort(sentences.begin(), sentences.end(),
+                     [](const ChannelSentence& a, const ChannelSentence& b) {
+                       return a.start_ms < b.start_ms;
+                     });
+    std::ostringstream buffer;
+    for (const auto& sentence : sentences) {
+      buffer << key << "-" << sentence.channel << " " << sentence.start_ms
+             << " " << sentence.end_ms << " " << sentence.text << std::endl;
+    }
+    LOG(INFO) << key << " Final result of " << num_channels
+              << " channels:\n" << buffer.str();
+    writer->Write(i, buffer.str());
+    total_waves_dur += static_cast<int64_t>(wav_reader.num_sample()) *
+                       num_channels * 1000 /
+                       std::max(wav_reader.sample_rate(), 1);
+  }
+  for (const auto& resource : resources) {
+    if (resource.second->encoder_scheduler == nullptr) continue;
+    wenet::BatchEncoderStats stats =
+        resource.second->encoder_scheduler->stats();
+    LOG(INFO) << "Encoder of the " << resource.first << " channel waves: "
+              << stats.num_batches << " batches, " << std::setprecision(4)
+              << static_cast<float>(stats.num_items) /
+                     std::max<int64_t>(stats.num_batches, 1)
+              << " chunks per batch";
+  }
+  return {total_waves_dur, total_decode_time};
+}
+
+// The resource to replay the cached model outputs of one utterance, the
+// real model only rescores, so it's not pooled or batched
+static std::shared_ptr<wenet::DecodeResource> ReplayResource(
+    const wenet::DecodeResource& resource,
+    std::shared_ptr<const wenet::CtcCacheEntry> entry) {
+  auto replay = std::make_shared<wenet::DecodeResource>(resource);
+  replay->model = std::make_shared<wenet::ReplayAsrModel>(resource.model,
+                                                          std::move(entry));
+  replay->model_pool = nullptr;
+  replay->encoder_scheduler = nullptr;
+  replay->rescoring_scheduler = nullptr;
+  replay->chunk_policy = nullptr;
+  replay->replicas = nullptr;
+  return replay;
+}
+
+// Compute the features of the waves and write them to the wspecifier
+static void DumpFeats(
+    const std::vector<std::pair<std::string, std::string>>& waves,
+    const wenet::FeaturePipelineConfig& feature_config,
+    const std::string& wspecifier) {
+  wenet::FeatureWriter writer;
+  CHECK(writer.Open(wspecifier));
+  wenet::FeatureMatrix feats;
+  for (const auto &wav : waves) {
+    wenet::WavReader wav_reader;
+    if (!wav_reader.Open(wav.second)) {
+      LOG(WARNING) << "Error in reading " << wav.second;
+      continue;
+    }
+    wenet::FeaturePipeline feature_pipeline(feature_config);
+    feature_pipeline.set_input_sample_rate(wav_reader.sample_rate());
+    feature_pipeline.AcceptWaveform(wav_reader.data(),
+                                     wav_reader.num_sample());
+    feature_pipeline.set_input_finished();
+    feature_pipeline.Read(feature_pipeline.num_frames(), &feats);
+    writer.Write(wav.first, feats);
+  }
+  writer.Close();
+  LOG(INFO) << "Features of " << waves.size() << " waves written to "
+            << wspecifier;
+}
+
+// Decode the waves one by one by the float model and by the int8 one, the
+// two decodings of a wave are back to back so they share the warm caches,
+// and compare their speed and their results
+static void CompareQuantized(
+    const std::vector<std::pair<std::string, std::string>>& waves,
+    std::shared_ptr<wenet::FeaturePipelineConfig> feature_config,
+    std::shared_ptr<wenet::DecodeOptions> decode_config,
+    std::shared_ptr<wenet::DecodeResource> float_resource,
+    std::shared_ptr<wenet::DecodeResource> quant_resource,
+    ResultWriter* writer) {
+  std::unordered_map<std::string, std::string> refs = ReadRefs();
+  int64_t waves_dur = 0;
+  int64_t float_time = 0;
+  int64_t quant_time = 0;
+  ErrorCount float_errors, quant_errors, diff;
+  int num_changed = 0;
+  int num_refs = 0;
+  for (size_t i = 0; i < waves.size(); ++i) {
+    const std::string &key = waves[i].first;
+    const std::string &wav_path = waves[i].second;
+    WavResult float_result =
+        DecodeWav(key, wav_path, nullptr, nullptr, feature_config,
+                  decode_config, float_resource);
+    WavResult quant_result =
+        DecodeWav(key, wav_path, nullptr, nullptr, feature_config,
+                  decode_config, quant_resource);
+    waves_dur += float_result.wave_dur;
+    float_time += float_result.decode_time;
+    quant_time += quant_result.decode_time;
+    diff.Add(float_result.sentence, quant_result.sentence);
+    if (float_result.sentence != quant_result.sentence) {
+      num_changed++;
+      LOG(INFO) << key << " float: " << float_result.sentence
+                << " int8: " << quant_result.sentence;
+    }
+    auto ref = refs.find(key);
+    if (ref != refs.end()) {
+      float_errors.Add(ref->second, float_result.sentence);
+      quant_errors.Add(ref->second, quant_result.sentence);
+      num_refs++;
+    }
+    writer->Write(i, std::move(quant_result.text));
+  }
+  float float_rtf =
+      static_cast<float>(float_time) / std::max<int64_t>(waves_dur, 1);
+  float quant_rtf =
+      static_cast<float>(quant_time) / std::max<int64_t>(waves_dur, 1);
+  LOG(INFO) << "Total: decoded " << waves_dur << "ms audio of "
+            << waves.size() << " waves by each model.";
+  LOG(INFO) << "RTF: float " << std::setprecision(4) << float_rtf
+            << ", int8 " << quant_rtf << ", int8 speedup "
+            << float_rtf / std::max(quant_rtf, 1e-6f) << "x";
+  LOG(INFO) << "int8 vs float: " << num_changed << " of " << waves.size()
+            << " results changed, " << diff.errors << " errors of "
+            << diff.units << " units, " << diff.Rate() << "%";
+  if (num_refs > 0) {
+    LOG(INFO) << "Error rate of the " << num_refs << " waves of "
+              << FLAGS_ref_text << ": float " << float_errors.Rate()
+              << "%, int8 " << quant_errors.Rate() << "%";
+  }
+}
+
+// The memory and the TLB misses of the decoding of waves_dur ms audio
+static void LogMemoryStats(const wenet::TlbMissCounter &tlb_counter,
+                           int64_t waves_dur) {
+  wenet::MemoryStats memory_stats;
+  if (wenet::ReadMemoryStats(&memory_stats)) {
+    LOG(INFO) << "Memory: " << wenet::MemoryStatsString(memory_stats);
+  }
+  int64_t tlb_misses = tlb_counter.Read();
+  if (tlb_misses >= 0) {
+    LOG(INFO) << "Data TLB load misses: " << tlb_misses << ", "
+              << tlb_misses * 1000 / std::max<int64_t>(waves_dur, 1)
+              << " per second of audio";
+  }
+}
 
 int main(int argc, char *argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, false);
   google::InitGoogleLogging(argv[0]);
+  wenet::InitAsyncLoggingFromFlags();
 
+  if (!FLAGS_trace_path.empty()) {
+    wenet::Tracer::Get()->set_enabled(true);
+  }
   auto decode_config = wenet::InitDecodeOptionsFromFlags();
   auto feature_config = wenet::InitFeaturePipelineConfigFromFlags();
   auto decode_resource = wenet::InitDecodeResourceFromFlags();
+  // Of the threads of the decoding, which are created after it
+  wenet::TlbMissCounter tlb_counter;
+  if (FLAGS_tlb_misses) tlb_counter.Start();
 
-  if (FLAGS_wav_path.empty() && FLAGS_wav_scp.empty()) {
-    LOG(FATAL) << "Please provide the wave path or the wav scp.";
+  const bool use_feats = !FLAGS_feat_rspecifier.empty();
+  const bool use_ctc_cache = !FLAGS_ctc_cache.empty();
+  const bool dump_ctc_cache = !FLAGS_dump_ctc_cache.empty();
+  const bool use_shards = !FLAGS_wav_shards.empty();
+  if (FLAGS_wav_path.empty() && FLAGS_wav_scp.empty() && !use_shards &&
+      !use_feats && !use_ctc_cache) {
+    LOG(FATAL) << "Please provide the wave path, the wav scp, the wav "
+               << "shards, the feature rspecifier or the ctc cache.";
+  }
+  // The waves of the shards are known only by reading them
+  const int wav_prefetch =
+      use_shards ? (FLAGS_wav_prefetch > 0 ? FLAGS_wav_prefetch : 16)
+                 : FLAGS_wav_prefetch;
+  const bool use_prefetch = !use_feats && !use_ctc_cache &&
+                            FLAGS_wav_path.empty() && wav_prefetch > 0;
+  if (use_prefetch) {
+    CHECK(FLAGS_batch_size == 0 && FLAGS_long_form_segment_s == 0 &&
+          FLAGS_dump_feats.empty())
+        << "The waves read ahead are decoded chunk by chunk only";
+  }
+  if (use_ctc_cache || dump_ctc_cache) {
+    // The cached chunks are replayed by the same reads of the features
+    CHECK(!FLAGS_continuous_decoding && !feature_config->use_vad &&
+          decode_resource->chunk_policy == nullptr)
+        << "The ctc cache requires one sentence of fixed chunks per wave";
+    CHECK(!use_ctc_cache || !dump_ctc_cache);
   }
   std::vector<std::pair<std::string, std::string>> waves;
   if (!FLAGS_wav_path.empty()) {
     waves.emplace_back(make_pair("test", FLAGS_wav_path));
-  } else {
+  } else if (!use_prefetch) {
     std::ifstream wav_scp(FLAGS_wav_scp);
     std::string line;
     while (getline(wav_scp, line)) {
@@ -47,95 +1039,274 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if (!FLAGS_lattice_wspecifier.empty()) {
+    CHECK(decode_resource->fst != nullptr && FLAGS_batch_size == 0)
+        << "The lattices are of the streaming ctc wfst search, --fst_path "
+        << "is required";
+    decode_config->ctc_wfst_search_opts.output_lattice = true;
+  }
+
+  if (!FLAGS_dump_feats.empty()) {
+    DumpFeats(waves, *feature_config, FLAGS_dump_feats);
+    return 0;
+  }
+
   std::ofstream result;
   if (!FLAGS_result.empty()) {
     result.open(FLAGS_result, std::ios::out);
   }
   std::ostream &buffer = FLAGS_result.empty() ? std::cout : result;
+  ResultWriter writer(&buffer, FLAGS_ordered_output);
 
-  int total_waves_dur = 0;
-  int total_decode_time = 0;
-  for (auto &wav : waves) {
-    wenet::WavReader wav_reader(wav.second);
-    CHECK_EQ(wav_reader.sample_rate(), FLAGS_sample_rate);
-
-    auto feature_pipeline =
-        std::make_shared<wenet::FeaturePipeline>(*feature_config);
-    feature_pipeline->AcceptWaveform(std::vector<float>(
-        wav_reader.data(), wav_reader.data() + wav_reader.num_sample()));
-    feature_pipeline->set_input_finished();
-    LOG(INFO) << "num frames " << feature_pipeline->num_frames();
-
-    wenet::AsrDecoder decoder(feature_pipeline, decode_resource,
-                              *decode_config);
-
-    int wave_dur =
-        static_cast<int>(static_cast<float>(wav_reader.num_sample()) /
-                         wav_reader.sample_rate() * 1000);
-    int decode_time = 0;
-    std::string final_result;
+  if (FLAGS_batch_size > 0) {
+    CHECK(!use_feats && !use_ctc_cache && !dump_ctc_cache)
+        << "The batch mode decodes waves only";
+    wenet::Timer wall_timer;
+    int64_t waves_dur = BatchDecode(waves, feature_config, decode_config,
+                                    decode_resource, &writer);
+    int wall_time = std::max(wall_timer.Elapsed(), 1);
+    LOG(INFO) << "Total: decoded " << waves_dur << "ms audio taken "
+              << wall_time << "ms wall time in batches of "
+              << FLAGS_batch_size << ".";
+    LOG(INFO) << "RTF: " << std::setprecision(4)
+              << static_cast<float>(wall_time) /
+                     std::max<int64_t>(waves_dur, 1);
+    LOG(INFO) << "Throughput: " << std::setprecision(4)
+              << static_cast<float>(waves_dur) / wall_time
+              << "x real time, "
+              << static_cast<float>(waves.size()) * 1000 / wall_time
+              << " waves/s";
+    LogMemoryStats(tlb_counter, waves_dur);
+    if (!FLAGS_trace_path.empty()) {
+      wenet::Tracer::Get()->WriteChromeTrace(FLAGS_trace_path);
+    }
+    return 0;
+  }
+
+  if (FLAGS_long_form_segment_s > 0) {
+    CHECK(!use_feats && !use_ctc_cache && !dump_ctc_cache &&
+          FLAGS_lattice_wspecifier.empty())
+        << "The long form mode decodes waves only";
+    int num_workers = std::max(1, FLAGS_num_workers);
+    LatencyStats latency;
+    wenet::Timer wall_timer;
+    std::pair<int64_t, int64_t> times =
+        LongFormDecode(waves, feature_config, decode_config, decode_resource,
+                       num_workers, &writer, &latency);
+    int wall_time = std::max(wall_timer.Elapsed(), 1);
+    int64_t waves_dur = times.first;
+    int64_t decode_time = times.second;
+    LOG(INFO) << "Total: decoded " << waves_dur << "ms audio taken "
+              << decode_time << "ms by " << num_workers << " workers, "
+              << wall_time << "ms wall time in segments.";
+    LOG(INFO) << "RTF: " << std::setprecision(4)
+              << static_cast<float>(decode_time) /
+                     std::max<int64_t>(waves_dur, 1);
+    LOG(INFO) << "Throughput: " << std::setprecision(4)
+              << static_cast<float>(waves_dur) / wall_time << "x real time";
+    LogMemoryStats(tlb_counter, waves_dur);
+    if (!FLAGS_latency_report.empty()) {
+      WriteLatencyReport(FLAGS_latency_report, latency, waves.size(),
+                         waves_dur, decode_time, wall_time, nullptr);
+    }
+    if (!FLAGS_trace_path.empty()) {
+      wenet::Tracer::Get()->WriteChromeTrace(FLAGS_trace_path);
+    }
+    return 0;
+  }
+
+  if (FLAGS_multi_channel) {
+    CHECK(!use_feats && !use_ctc_cache && !dump_ctc_cache && !use_prefetch &&
+          FLAGS_lattice_wspecifier.empty())
+        << "The multi-channel mode decodes the waves of --wav_scp or "
+        << "--wav_path only";
+    CHECK(decode_resource->encoder_scheduler == nullptr)
+        << "The encoder batches of the multi-channel mode are of the "
+        << "channels, --max_batch_size is not used";
+    wenet::Timer wall_timer;
+    std::pair<int64_t, int64_t> times = MultiChannelDecode(
+        waves, feature_config, decode_config, decode_resource, &writer);
+    int wall_time = std::max(wall_timer.Elapsed(), 1);
+    LOG(INFO) << "Total: decoded " << times.first << "ms audio of the "
+              << "channels taken " << times.second << "ms, " << wall_time
+              << "ms wall time.";
+    LOG(INFO) << "RTF: " << std::setprecision(4)
+              << static_cast<float>(times.second) /
+                     std::max<int64_t>(times.first, 1)
+              << ", throughput: "
+              << static_cast<float>(times.first) / wall_time
+              << "x real time";
+    LogMemoryStats(tlb_counter, times.first);
+    if (!FLAGS_trace_path.empty()) {
+      wenet::Tracer::Get()->WriteChromeTrace(FLAGS_trace_path);
+    }
+    return 0;
+  }
+
+  if (FLAGS_compare_quantized) {
+    CHECK(!use_feats && !use_ctc_cache && !dump_ctc_cache && !use_prefetch &&
+          FLAGS_lattice_wspecifier.empty())
+        << "The quantized model comparison decodes the waves of --wav_scp "
+        << "or --wav_path only";
+    CHECK(!FLAGS_torch_quantized && !FLAGS_onnx_quantized)
+        << "The model of --compare_quantized is the float one";
+    // The same resources but the int8 model
+    if (FLAGS_onnx_dir.empty()) {
+      FLAGS_torch_quantized = true;
+    } else {
+      FLAGS_onnx_quantized = true;
+    }
+    auto quant_resource = wenet::InitDecodeResourceFromFlags();
+    CompareQuantized(waves, feature_config, decode_config, decode_resource,
+                     quant_resource, &writer);
+    return 0;
+  }
+
+  // The precomputed features are streamed from the archive, instead of the
+  // waves
+  wenet::FeatureReader feats_reader;
+  if (use_feats) {
+    CHECK(feats_reader.Open(FLAGS_feat_rspecifier));
+  }
+  // Or the cached model outputs, of which only the number of features is
+  // needed, the features are zeros
+  wenet::CtcCacheReader ctc_reader;
+  if (use_ctc_cache) {
+    CHECK(ctc_reader.Open(FLAGS_ctc_cache));
+  }
+  wenet::CtcCacheWriter ctc_writer;
+  std::mutex ctc_writer_mutex;
+  if (dump_ctc_cache) {
+    CHECK(ctc_writer.Open(FLAGS_dump_ctc_cache, FLAGS_ctc_cache_topk));
+  }
+  wenet::FeatureWriter lattice_writer;
+  std::mutex lattice_writer_mutex;
+  if (!FLAGS_lattice_wspecifier.empty()) {
+    CHECK(lattice_writer.Open(FLAGS_lattice_wspecifier));
+  }
+
+  // The workers take the next utterance one by one, so the long ones don't
+  // hold up a share of the list
+  std::atomic<int64_t> total_waves_dur{0};
+  std::atomic<int64_t> total_decode_time{0};
+  std::mutex input_mutex;
+  size_t num_utts = 0;
+  std::mutex latency_mutex;
+  LatencyStats latency;
+  // The 1-best of the waves by their keys, for the error rate of the report
+  std::unordered_map<std::string, std::string> hyps;
+  wenet::WavArchiveReader wav_archive(wav_prefetch);
+  if (use_prefetch) {
+    CHECK(wav_archive.Open(use_shards ? "shards:" + FLAGS_wav_shards
+                                      : "scp:" + FLAGS_wav_scp));
+  }
+  auto worker = [&]() {
+    wenet::FeatureMatrix feats;
+    wenet::WavData wav;
     while (true) {
-      wenet::Timer timer;
-      wenet::DecodeState state = decoder.Decode();
-      if (state == wenet::DecodeState::kEndFeats) {
-        decoder.Rescoring();
+      size_t i = 0;
+      std::string key, wav_path;
+      std::shared_ptr<const wenet::CtcCacheEntry> cached;
+      {
+        std::lock_guard<std::mutex> lock(input_mutex);
+        if (use_prefetch) {
+          // The lock keeps the indexes in the order of the waves
+          if (!wav_archive.Read(&wav)) break;
+          key = wav.key;
+        } else if (use_ctc_cache) {
+          if (ctc_reader.Done()) break;
+          key = ctc_reader.Key();
+          cached = ctc_reader.Value();
+          ctc_reader.Next();
+        } else if (use_feats) {
+          if (feats_reader.Done()) break;
+          key = feats_reader.Key();
+          feats = feats_reader.Value();
+          feats_reader.Next();
+        } else {
+          if (num_utts >= waves.size()) break;
+          key = waves[num_utts].first;
+          wav_path = waves[num_utts].second;
+        }
+        i = num_utts++;
       }
-      int chunk_decode_time = timer.Elapsed();
-      decode_time += chunk_decode_time;
-      if (decoder.DecodedSomething()) {
-        LOG(INFO) << "Partial result: " << decoder.result()[0].sentence;
+      auto resource = decode_resource;
+      auto config = decode_config;
+      if (cached != nullptr) {
+        feats.Resize(cached->num_feature_frames, feature_config->num_bins);
+        feats.SetZero();
+        resource = ReplayResource(*decode_resource, cached);
+        config = std::make_shared<wenet::DecodeOptions>(*decode_config);
+        config->chunk_size = cached->chunk_size;
       }
-
-      if (FLAGS_continuous_decoding &&
-          state == wenet::DecodeState::kEndpoint) {
-        if (decoder.DecodedSomething()) {
-          decoder.Rescoring();
-          final_result.append(decoder.result()[0].sentence);
-        }
-        decoder.ResetContinuousDecoding();
+      wenet::CtcCacheEntry ctc_record;
+      WavResult wav_result = DecodeWav(
+          key, wav_path, use_feats || use_ctc_cache ? &feats : nullptr,
+          use_prefetch ? &wav : nullptr, feature_config, config, resource,
+          dump_ctc_cache ? &ctc_record : nullptr);
+      if (dump_ctc_cache) {
+        std::lock_guard<std::mutex> lock(ctc_writer_mutex);
+        ctc_writer.Write(key, ctc_record);
       }
-
-      if (state == wenet::DecodeState::kEndFeats) {
-        break;
-      } else if (FLAGS_chunk_size > 0 && FLAGS_simulate_streaming) {
-        float frame_shift_in_ms =
-            static_cast<float>(feature_config->frame_shift) /
-            wav_reader.sample_rate() * 1000;
-        auto wait_time =
-            decoder.num_frames_in_current_chunk() * frame_shift_in_ms -
-            chunk_decode_time;
-        if (wait_time > 0) {
-          LOG(INFO) << "Simulate streaming, waiting for " << wait_time << "ms";
-          std::this_thread::sleep_for(
-              std::chrono::milliseconds(static_cast<int>(wait_time)));
+      if (!wav_result.lattices.empty()) {
+        std::lock_guard<std::mutex> lock(lattice_writer_mutex);
+        for (const auto &lattice : wav_result.lattices) {
+          lattice_writer.WriteBinary(lattice.first, lattice.second);
         }
       }
-    }
-    if (decoder.DecodedSomething()) {
-      final_result.append(decoder.result()[0].sentence);
-    }
-    LOG(INFO) << wav.first << " Final result: " << final_result << std::endl;
-    LOG(INFO) << "Decoded " << wave_dur << "ms audio taken " << decode_time
-              << "ms.";
-
-    if (!FLAGS_output_nbest) {
-      buffer << wav.first << " " << final_result << std::endl;
-    } else {
-      buffer << "wav " << wav.first << std::endl;
-      auto &results = decoder.result();
-      for (auto &r : results) {
-        if (r.sentence.empty())
-          continue;
-        buffer << "candidate " << r.score << " " << r.sentence << std::endl;
+      writer.Write(i, std::move(wav_result.text));
+      total_waves_dur += wav_result.wave_dur;
+      total_decode_time += wav_result.decode_time;
+      std::lock_guard<std::mutex> lock(latency_mutex);
+      latency.Merge(wav_result.latency);
+      if (!FLAGS_latency_report.empty()) {
+        hyps[key] = std::move(wav_result.sentence);
       }
     }
-
-    total_waves_dur += wave_dur;
-    total_decode_time += decode_time;
+  };
+  wenet::Timer wall_timer;
+  int num_workers = std::max(1, FLAGS_num_workers);
+  if (!use_feats && !use_ctc_cache && !use_prefetch) {
+    num_workers = std::min(num_workers, static_cast<int>(waves.size()));
+  }
+  {
+    // Each worker decodes the waves until there are none left
+    wenet::ThreadPool pool(num_workers);
+    for (int i = 0; i < num_workers; ++i) {
+      pool.Post(worker);
+    }
+    pool.Drain();
   }
-  LOG(INFO) << "Total: decoded " << total_waves_dur << "ms audio taken "
-            << total_decode_time << "ms.";
+  if (dump_ctc_cache) {
+    ctc_writer.Close();
+    LOG(INFO) << "Model outputs of " << num_utts << " waves written to "
+              << FLAGS_dump_ctc_cache;
+  }
+  if (!FLAGS_lattice_wspecifier.empty()) {
+    lattice_writer.Close();
+  }
+  int wall_time = std::max(wall_timer.Elapsed(), 1);
+  int64_t waves_dur = total_waves_dur;
+  int64_t decode_time = total_decode_time;
+
+  LOG(INFO) << "Total: decoded " << waves_dur << "ms audio taken "
+            << decode_time << "ms by " << num_workers << " workers, "
+            << wall_time << "ms wall time.";
   LOG(INFO) << "RTF: " << std::setprecision(4)
-            << static_cast<float>(total_decode_time) / total_waves_dur;
+            << static_cast<float>(decode_time) /
+                   std::max<int64_t>(waves_dur, 1);
+  LOG(INFO) << "Throughput: " << std::setprecision(4)
+            << static_cast<float>(waves_dur) / wall_time
+            << "x real time, "
+            << static_cast<float>(num_utts) * 1000 / wall_time
+            << " waves/s";
+  LogMemoryStats(tlb_counter, waves_dur);
+  if (!FLAGS_latency_report.empty()) {
+    WriteLatencyReport(FLAGS_latency_report, latency, num_utts,
+                       waves_dur, decode_time, wall_time, &hyps);
+  }
+  if (!FLAGS_trace_path.empty()) {
+    wenet::Tracer::Get()->WriteChromeTrace(FLAGS_trace_path);
+  }
   return 0;
 }
@@ -0,0 +1,181 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "utils/flags.h"
+#include "utils/json.h"
+#include "utils/log.h"
+
+DEFINE_string(decoder_main, "",
+              "path of decoder_main, the one next to this binary by default");
+DEFINE_string(model_path, "",
+              "torch model, the torch configurations are skipped without it");
+DEFINE_string(onnx_dir, "",
+              "onnx model, the onnx configurations are skipped without it");
+DEFINE_string(fst_path, "",
+              "TLG fst, the wfst configurations are skipped without it");
+DEFINE_string(wav_scp, "", "the reference test set");
+DEFINE_string(ref_text, "",
+              "the references of the test set, one \"key text\" per line");
+DEFINE_string(common_flags, "",
+              "flags of every decoder_main run, e.g. \"--unit_path=units.txt "
+              "--dict_path=words.txt\"");
+DEFINE_string(output_dir, "",
+              "the reports, the results and the logs of the configurations");
+
+// The pinned matrix, the reports are comparable only between the runs of
+// the same matrix
+static const int kChunkSizes[] = {8, 16};
+static const int kNumThreads[] = {1, 4};
+
+// A configuration of the matrix, and the decoder_main flags of it
+struct BenchmarkConfig {
+  std::string name;
+  std::string flags;
+};
+
+static std::vector<BenchmarkConfig> BenchmarkMatrix() {
+  std::vector<std::pair<std::string, std::string>> models;
+  if (!FLAGS_model_path.empty()) {
+    models.emplace_back("torch", "--model_path=" + FLAGS_model_path);
+  }
+  if (!FLAGS_onnx_dir.empty()) {
+    models.emplace_back("onnx", "--onnx_dir=" + FLAGS_onnx_dir);
+  }
+  std::vector<std::pair<std::string, std::string>> searches = {
+      {"prefix", ""}};
+  if (!FLAGS_fst_path.empty()) {
+    searches.emplace_back("wfst", "--fst_path=" + FLAGS_fst_path);
+  }
+  std::vector<BenchmarkConfig> matrix;
+  for (const auto& model : models) {
+    const std::string threads_flag =
+        model.first == "torch" ? "--num_threads=" : "--num_onnx_threads=";
+    for (const auto& search : searches) {
+      for (int chunk_size : kChunkSizes) {
+        for (int num_threads : kNumThreads) {
+          for (bool rescoring : {true, false}) {
+            BenchmarkConfig config;
+            config.name = model.first + "_" + search.first + "_chunk" +
+                          std::to_string(chunk_size) + "_threads" +
+                          std::to_string(num_threads) +
+                          (rescoring ? "_rescoring" : "_ctc");
+            config.flags = model.second + " " + search.second +
+                           " --chunk_size=" + std::to_string(chunk_size) +
+                           " " + threads_flag + std::to_string(num_threads) +
+                           " --rescoring_weight=" + (rescoring ? "1.0" : "0.0");
+            matrix.push_back(config);
+          }
+        }
+      }
+    }
+  }
+  return matrix;
+}
+
+static std::string ShellQuote(const std::string& s) {
+  std::string quoted = "'";
+  for (char c : s) {
+    if (c == '\'') {
+      quoted += "'\\''";
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "'";
+}
+
+static bool ReadReport(const std::string& path, json::JSON* report) {
+  std::ifstream is(path);
+  if (!is.good()) return false;
+  std::stringstream ss;
+  ss << is.rdbuf();
+  *report = json::JSON::Load(ss.str());
+  return report->hasKey("rtf");
+}
+
+// The end to end benchmark of the runtime. Each configuration of the pinned
+// matrix, torch vs onnx, prefix vs wfst search, the chunk sizes, the GEMM
+// threads and the rescoring on or off, decodes the reference test set by
+// its own decoder_main process, so the peak RSS and the allocations are of
+// it alone. The waves are decoded one by one and not in real time, so the
+// RTF and the latencies are of the computation. Each configuration writes
+// its JSON report, of --latency_report of decoder_main, with the error rate,
+// the RTF, the latency percentiles, the peak RSS and the allocations, to
+// <output_dir>/<config>.json, and all of them are collected in the array
+// of <output_dir>/summary.json.
+int main(int argc, char* argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, false);
+  google::InitGoogleLogging(argv[0]);
+  CHECK(!FLAGS_wav_scp.empty() && !FLAGS_ref_text.empty() &&
+        !FLAGS_output_dir.empty())
+      << "Usage: e2e_benchmark_main --wav_scp wav.scp --ref_text text "
+         "--output_dir dir --model_path final.zip [--onnx_dir onnx] "
+         "[--fst_path TLG.fst] --common_flags \"--unit_path units.txt\"";
+  std::string decoder_main = FLAGS_decoder_main;
+  if (decoder_main.empty()) {
+    std::string self = argv[0];
+    size_t pos = self.rfind('/');
+    decoder_main = (pos == std::string::npos ? std::string(".")
+                                             : self.substr(0, pos)) +
+                   "/decoder_main";
+  }
+  std::vector<BenchmarkConfig> matrix = BenchmarkMatrix();
+  CHECK(!matrix.empty()) << "Please provide --model_path or --onnx_dir";
+  CHECK_EQ(std::system(("mkdir -p " + ShellQuote(FLAGS_output_dir)).c_str()),
+           0);
+
+  json::JSON summary = json::JSON::Make(json::JSON::Class::Array);
+  int num_failed = 0;
+  for (size_t i = 0; i < matrix.size(); ++i) {
+    const BenchmarkConfig& config = matrix[i];
+    const std::string prefix = FLAGS_output_dir + "/" + config.name;
+    std::string command =
+        ShellQuote(decoder_main) + " " + config.flags + " " +
+        FLAGS_common_flags + " --wav_scp=" + ShellQuote(FLAGS_wav_scp) +
+        " --ref_text=" + ShellQuote(FLAGS_ref_text) +
+        " --num_workers=1 --simulate_streaming=false" +
+        " --latency_report=" + ShellQuote(prefix + ".json") +
+        " --result=" + ShellQuote(prefix + ".text") + " > " +
+        ShellQuote(prefix + ".log") + " 2>&1";
+    LOG(INFO) << "[" << i + 1 << "/" << matrix.size() << "] " << config.name;
+    int status = std::system(command.c_str());
+    json::JSON report;
+    if (status != 0 || !ReadReport(prefix + ".json", &report)) {
+      LOG(WARNING) << config.name << " failed, see " << prefix << ".log";
+      num_failed++;
+      continue;
+    }
+    report["config"] = config.name;
+    summary.append(report);
+    LOG(INFO) << config.name << ": error rate "
+              << report["error_rate"].ToFloat() << "%, RTF "
+              << report["rtf"].ToFloat() << ", final p90 "
+              << report["final_ms"]["p90"].ToFloat() << "ms, peak RSS "
+              << report["peak_rss_mb"].ToFloat() << "MB, allocations "
+              << report["allocations"].ToFloat();
+  }
+  std::ofstream os(FLAGS_output_dir + "/summary.json");
+  os << summary.dump() << std::endl;
+  LOG(INFO) << "Summary of " << matrix.size() - num_failed << " of "
+            << matrix.size() << " configurations written to "
+            << FLAGS_output_dir << "/summary.json";
+  return num_failed == 0 ? 0 : 1;
+}
@@ -14,7 +14,9 @@
 
 #include "frontend/wav.h"
 #include "grpc/grpc_client.h"
+#include "grpc/grpc_load_generator.h"
 #include "utils/flags.h"
+#include "utils/load_test_params.h"
 #include "utils/log.h"
 #include "utils/timer.h"
 
@@ -27,6 +29,14 @@ DEFINE_bool(continuous_decoding, false, "continuous decoding mode");
 int main(int argc, char *argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, false);
   google::InitGoogleLogging(argv[0]);
+  if (!FLAGS_wav_scp.empty()) {
+    wenet::LoadTestOptions opts;
+    opts.hostname = FLAGS_hostname;
+    opts.port = FLAGS_port;
+    opts.nbest = FLAGS_nbest;
+    opts.continuous_decoding = FLAGS_continuous_decoding;
+    return wenet::RunLoadTestFromFlags<wenet::GrpcLoadGenerator>(opts);
+  }
   wenet::GrpcClient client(FLAGS_hostname, FLAGS_port, FLAGS_nbest,
                            FLAGS_continuous_decoding);
 
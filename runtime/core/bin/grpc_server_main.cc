@@ -19,33 +19,68 @@
 #include "decoder/params.h"
 #include "grpc/grpc_server.h"
 #include "utils/log.h"
+#include "utils/trace.h"
+#include "websocket/metrics_server.h"
 
 DEFINE_int32(port, 10086, "grpc listening port");
-DEFINE_int32(workers, 4, "grpc num workers");
+DEFINE_int32(workers, 4, "grpc completion queues, one thread each");
+DEFINE_int32(num_decode_threads, 0,
+             "threads for the decoding of all calls, 0 means one per cpu");
+DEFINE_int32(metrics_port, 0,
+             "port of the HTTP /metrics endpoint, 0 means no endpoint");
+DEFINE_bool(trace, false,
+            "record the scoped traces of the hot paths, compiled in by cmake "
+            "-DTRACE=ON, served in the Chrome trace format at /trace of "
+            "--metrics_port");
+DEFINE_int32(offline_batch_size, 8,
+             "max utterances of the Transcribe calls in one full context "
+             "encoder forward, 0 means no Transcribe calls");
+DEFINE_int32(offline_batch_wait_us, 5000,
+             "max time(us) an offline utterance waits for others to batch "
+             "with");
 
-using grpc::Server;
 using grpc::ServerBuilder;
 
 int main(int argc, char *argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, false);
   google::InitGoogleLogging(argv[0]);
+  wenet::InitAsyncLoggingFromFlags();
+
+  if (FLAGS_trace) {
+    wenet::Tracer::Get()->set_enabled(true);
+  }
+  // /ready of the metrics server is 503 while the models are loaded
+  std::unique_ptr<wenet::MetricsServer> metrics_server;
+  if (FLAGS_metrics_port > 0) {
+    metrics_server.reset(new wenet::MetricsServer(
+        FLAGS_metrics_port, wenet::MetricsRegistry::Global()));
+    metrics_server->Start();
+  }
 
   auto decode_config = wenet::InitDecodeOptionsFromFlags();
   auto feature_config = wenet::InitFeaturePipelineConfigFromFlags();
-  auto decode_resource = wenet::InitDecodeResourceFromFlags();
+  // The default model of the manifest, or the model of the flags
+  auto model_registry = wenet::InitModelRegistryFromFlags();
+  auto decode_resource = model_registry != nullptr ?
+                         model_registry->Get() :
+                         wenet::InitDecodeResourceFromFlags();
+  auto decoder_pool = wenet::InitDecoderPoolFromFlags(
+      feature_config, decode_config, decode_resource);
 
-  wenet::GrpcServer service(feature_config, decode_config, decode_resource);
+  wenet::BatchTranscribeOptions transcribe_opts;
+  transcribe_opts.max_batch_size = FLAGS_offline_batch_size;
+  transcribe_opts.max_wait_us = FLAGS_offline_batch_wait_us;
+  wenet::GrpcServer service(feature_config, decode_config, decode_resource,
+                            FLAGS_workers, FLAGS_num_decode_threads,
+                            transcribe_opts, decoder_pool, model_registry);
   grpc::EnableDefaultHealthCheckService(true);
   grpc::reflection::InitProtoReflectionServerBuilderPlugin();
   ServerBuilder builder;
   std::string address("0.0.0.0:" + std::to_string(FLAGS_port));
   builder.AddListeningPort(address, grpc::InsecureServerCredentials());
-  builder.RegisterService(&service);
-  builder.SetSyncServerOption(ServerBuilder::SyncServerOption::NUM_CQS,
-                              FLAGS_workers);
-  std::unique_ptr<Server> server(builder.BuildAndStart());
   LOG(INFO) << "Listening at port " << FLAGS_port;
-  server->Wait();
+  if (metrics_server != nullptr) metrics_server->set_ready(true);
+  service.Run(&builder);
   google::ShutdownGoogleLogging();
   return 0;
 }
@@ -1,16 +1,23 @@
 // Copyright 2021 Mobvoi Inc. All Rights Reserved.
 // Author: binbinzhang@mobvoi.com (Binbin Zhang)
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "decoder/ctc_forced_aligner.h"
 #include "decoder/params.h"
 #include "frontend/wav.h"
 #include "utils/flags.h"
 #include "utils/log.h"
 #include "utils/string.h"
+#include "utils/thread_pool.h"
 
 DEFINE_string(text, "", "kaldi style text input file");
 DEFINE_string(wav_scp, "", "kaldi style wav scp");
@@ -19,6 +26,14 @@ DEFINE_double(is_penalty, 1.0,
 DEFINE_double(del_penalty, 1.0, "deletion penalty for align insertion");
 DEFINE_string(result, "", "result output file");
 DEFINE_string(timestamp, "", "timestamp output file");
+DEFINE_int32(num_workers, 1,
+             "threads checking the utterances in parallel, each writes its "
+             "own shard of the outputs, <result>.<i> and <timestamp>.<i>");
+DEFINE_bool(ctc_align, false,
+            "align the texts to the audios by the CTC forced alignment "
+            "instead of checking them by the WFST decoding, it's much faster "
+            "but the texts must be right, the timestamps are followed by "
+            "the confidences of the tokens");
 
 namespace wenet {
 
@@ -83,14 +98,11 @@ void CompileCtcFst(std::shared_ptr<fst::SymbolTable> symbol_table,
   fst::ArcSort(ofst, fst::StdOLabelCompare());
 }
 
-void CompileAlignFst(std::vector<int> labels,
-                     std::shared_ptr<fst::SymbolTable> symbol_table,
-                     fst::StdVectorFst *ofst) {
+// The part of the align FST shared by all the labels, the start state and
+// the filler states of the insertions and substitutions
+void CompileAlignBaseFst(std::shared_ptr<fst::SymbolTable> symbol_table,
+                         fst::StdVectorFst *ofst) {
   ofst->DeleteStates();
-  int deletion = symbol_table->Find(kDeletion);
-  int insertion_start = symbol_table->Find(kIsStart);
-  int insertion_end = symbol_table->Find(kIsEnd);
-
   int start = ofst->AddState();
   ofst->SetStart(start);
   // Filler State
@@ -100,7 +112,19 @@ void CompileAlignFst(std::vector<int> labels,
     ofst->AddArc(filler_start, fst::StdArc(i, i, FLAGS_is_penalty, filler_end));
   }
   ofst->AddArc(filler_end, fst::StdArc(0, 0, 0.0, filler_start));
+}
 
+// The base FST is copied and extended by the alignment path of the labels
+void CompileAlignFst(const std::vector<int> &labels,
+                     std::shared_ptr<fst::SymbolTable> symbol_table,
+                     const fst::StdVectorFst &base_fst,
+                     fst::StdVectorFst *ofst) {
+  *ofst = base_fst;
+  int deletion = symbol_table->Find(kDeletion);
+  int insertion_start = symbol_table->Find(kIsStart);
+  int insertion_end = symbol_table->Find(kIsEnd);
+
+  const int start = 0, filler_start = 1, filler_end = 2;
   int prev = start;
   // Alignment path and optional filler
   for (size_t i = 0; i < labels.size(); i++) {
@@ -122,6 +146,29 @@ void CompileAlignFst(std::vector<int> labels,
   fst::ArcSort(ofst, fst::StdILabelCompare());
 }
 
+// Align the labels of the text to the CTC posteriors of the whole audio,
+// the result is the tokens of the labels, and the timestamps are
+// " token start end confidence" of each token, empty if they can't be
+// aligned
+void CtcAlign(const std::vector<int> &labels,
+              const LogProbMatrix &ctc_log_probs,
+              const fst::SymbolTable &unit_table, int frame_shift_ms,
+              CtcForcedAligner *aligner, std::string *result,
+              std::string *timestamp) {
+  result->clear();
+  timestamp->clear();
+  std::vector<CtcAlignedToken> alignment;
+  if (!aligner->Align(ctc_log_probs, labels, &alignment)) return;
+  std::stringstream ss;
+  for (const auto &token : alignment) {
+    std::string symbol = unit_table.Find(token.token);
+    result->append(symbol);
+    ss << " " << symbol << " " << token.start * frame_shift_ms << " "
+       << token.end * frame_shift_ms << " " << token.confidence;
+  }
+  *timestamp = ss.str();
+}
+
 }  // namespace wenet
 
 int main(int argc, char *argv[]) {
@@ -133,16 +180,26 @@ int main(int argc, char *argv[]) {
   auto decode_resource = wenet::InitDecodeResourceFromFlags();
   CHECK(decode_resource->unit_table != nullptr);
 
-  auto wfst_symbol_table =
-      wenet::MakeSymbolTableForFst(decode_resource->unit_table);
-  // wfst_symbol_table->WriteText("fst.txt");
-  // Reset symbol_table to on-the-fly generated wfst_symbol_table
-  decode_resource->symbol_table = wfst_symbol_table;
-
-  // Compile ctc FST
+  // The forced alignment maps the texts by the units, the checking by the
+  // symbols of its FSTs
+  std::shared_ptr<fst::SymbolTable> wfst_symbol_table =
+      decode_resource->unit_table;
   fst::StdVectorFst ctc_fst;
-  wenet::CompileCtcFst(wfst_symbol_table, &ctc_fst);
-  // ctc_fst.Write("ctc.fst");
+  fst::StdVectorFst align_base_fst;
+  if (!FLAGS_ctc_align) {
+    wfst_symbol_table =
+        wenet::MakeSymbolTableForFst(decode_resource->unit_table);
+    // wfst_symbol_table->WriteText("fst.txt");
+    // Reset symbol_table to on-the-fly generated wfst_symbol_table
+    decode_resource->symbol_table = wfst_symbol_table;
+    decode_resource->symbol_strings =
+        std::make_shared<wenet::SymbolStrings>(*wfst_symbol_table);
+
+    // Compile ctc FST, it's sorted by olabel, and only read by the workers
+    wenet::CompileCtcFst(wfst_symbol_table, &ctc_fst);
+    // ctc_fst.Write("ctc.fst");
+    wenet::CompileAlignBaseFst(wfst_symbol_table, &align_base_fst);
+  }
 
   std::unordered_map<std::string, std::string> wav_table;
   std::ifstream wav_is(FLAGS_wav_scp);
@@ -154,49 +211,109 @@ int main(int argc, char *argv[]) {
     wav_table[strs[0]] = strs[1];
   }
 
+  // The key and the text of each utterance
+  std::vector<std::pair<std::string, std::string>> utts;
   std::ifstream text_is(FLAGS_text);
-  std::ofstream result_os(FLAGS_result, std::ios::out);
-  std::ofstream timestamp_out;
-  if (!FLAGS_timestamp.empty()) {
-    timestamp_out.open(FLAGS_timestamp, std::ios::out);
-  }
-  std::ostream &timestamp_os =
-      FLAGS_timestamp.empty() ? std::cout : timestamp_out;
-
   while (std::getline(text_is, line)) {
     std::vector<std::string> strs;
     wenet::SplitString(line, &strs);
     if (strs.size() < 2) continue;
     std::string key = strs[0];
-    LOG(INFO) << "Processing " << key;
-    if (wav_table.find(key) != wav_table.end()) {
-      strs.erase(strs.begin());
-      std::string text = wenet::JoinString(" ", strs);
+    if (wav_table.find(key) == wav_table.end()) {
+      LOG(WARNING) << "No wav file for " << key;
+      continue;
+    }
+    strs.erase(strs.begin());
+    utts.emplace_back(key, wenet::JoinString(" ", strs));
+  }
+
+  // Each worker writes its own shard of the outputs, <result>.<i> and
+  // <timestamp>.<i>, or the single files if there is one worker
+  int num_workers = std::max(
+      1, std::min(FLAGS_num_workers, static_cast<int>(utts.size())));
+  auto shard_path = [num_workers](const std::string &path, int i) {
+    return num_workers > 1 ? path + "." + std::to_string(i) : path;
+  };
+  std::mutex stdout_mutex;
+
+  std::atomic<size_t> next_utt{0};
+  auto worker = [&](int worker_id) {
+    std::ofstream result_os(shard_path(FLAGS_result, worker_id),
+                            std::ios::out);
+    std::ofstream timestamp_os;
+    if (!FLAGS_timestamp.empty()) {
+      timestamp_os.open(shard_path(FLAGS_timestamp, worker_id),
+                        std::ios::out);
+    }
+    // The workers share the models, each decoder has its own copy of them
+    auto resource = std::make_shared<wenet::DecodeResource>(*decode_resource);
+    // The forced alignment forwards the whole audio by its own copy
+    std::shared_ptr<wenet::AsrModel> model;
+    wenet::CtcForcedAligner aligner(wenet::CtcForcedAlignerOptions{});
+    if (FLAGS_ctc_align) {
+      model = decode_resource->model->Copy();
+      model->set_chunk_size(-1);
+    }
+    for (size_t i = next_utt++; i < utts.size(); i = next_utt++) {
+      const std::string &key = utts[i].first;
+      const std::string &text = utts[i].second;
+      LOG(INFO) << "Processing " << key;
       std::vector<int> labels;
       wenet::MapToLabel(text, wfst_symbol_table, &labels);
-      // Prepare FST for alignment decoding
-      fst::StdVectorFst align_fst;
-      wenet::CompileAlignFst(labels, wfst_symbol_table, &align_fst);
-      // align_fst.Write("align.fst");
-      auto decoding_fst = std::make_shared<fst::StdVectorFst>();
-      fst::Compose(ctc_fst, align_fst, decoding_fst.get());
-      // decoding_fst->Write("decoding.fst");
       // Preapre feature pipeline
+      const std::string &wav_path = wav_table.at(key);
       wenet::WavReader wav_reader;
-      if (!wav_reader.Open(wav_table[key])) {
-        LOG(WARNING) << "Error in reading " << wav_table[key];
+      if (!wav_reader.Open(wav_path)) {
+        LOG(WARNING) << "Error in reading " << wav_path;
         continue;
       }
       CHECK_EQ(wav_reader.sample_rate(), FLAGS_sample_rate);
       auto feature_pipeline =
           std::make_shared<wenet::FeaturePipeline>(*feature_config);
-      feature_pipeline->AcceptWaveform(std::vector<float>(
-          wav_reader.data(), wav_reader.data() + wav_reader.num_sample()));
+      feature_pipeline->AcceptWaveform(wav_reader.data(),
+                                       wav_reader.num_sample());
       feature_pipeline->set_input_finished();
-      decode_resource->fst = decoding_fst;
       LOG(INFO) << "num frames " << feature_pipeline->num_frames();
-      wenet::AsrDecoder decoder(feature_pipeline, decode_resource,
-                                *decode_config);
+      std::string final_result;
+      std::string timestamp_str;
+      if (FLAGS_ctc_align) {
+        wenet::FeatureMatrix feats;
+        feature_pipeline->Read(feature_pipeline->num_frames(), &feats);
+        wenet::LogProbMatrix ctc_log_probs;
+        model->Reset();
+        model->ForwardEncoder(feats, &ctc_log_probs);
+        int frame_shift_ms = model->subsampling_rate() *
+                             feature_config->frame_shift * 1000 /
+                             feature_config->sample_rate;
+        wenet::CtcAlign(labels, ctc_log_probs, *decode_resource->unit_table,
+                        frame_shift_ms, &aligner, &final_result,
+                        &timestamp_str);
+        if (final_result.empty() && !labels.empty()) {
+          LOG(WARNING) << "Can't align " << key << ", the audio is shorter "
+                       << "than the text";
+        }
+        result_os << key << " " << final_result << std::endl;
+        if (!FLAGS_timestamp.empty()) {
+          timestamp_os << key << timestamp_str << std::endl;
+        } else {
+          std::lock_guard<std::mutex> lock(stdout_mutex);
+          std::cout << key << timestamp_str << std::endl;
+        }
+        continue;
+      }
+      // Prepare FST for alignment decoding
+      fst::StdVectorFst align_fst;
+      wenet::CompileAlignFst(labels, wfst_symbol_table, align_base_fst,
+                             &align_fst);
+      // align_fst.Write("align.fst");
+      // The composition is expanded lazily, only the states visited by the
+      // search are built
+      std::shared_ptr<fst::Fst<fst::StdArc>> decoding_fst(
+          wenet::ComposeDecodingGraph(
+              ctc_fst, align_fst,
+              static_cast<size_t>(FLAGS_fst_cache_size) << 20));
+      resource->fst = decoding_fst;
+      wenet::AsrDecoder decoder(feature_pipeline, resource, *decode_config);
       while (true) {
         wenet::DecodeState state = decoder.Decode();
         if (state == wenet::DecodeState::kEndFeats) {
@@ -204,8 +321,6 @@ int main(int argc, char *argv[]) {
           break;
         }
       }
-      std::string final_result;
-      std::string timestamp_str;
       if (decoder.DecodedSomething()) {
         const wenet::DecodeResult &result = decoder.result()[0];
         final_result = result.sentence;
@@ -216,11 +331,20 @@ int main(int argc, char *argv[]) {
         timestamp_str = ss.str();
       }
       result_os << key << " " << final_result << std::endl;
-      timestamp_os << key << " " << timestamp_str << std::endl;
+      if (!FLAGS_timestamp.empty()) {
+        timestamp_os << key << " " << timestamp_str << std::endl;
+      } else {
+        std::lock_guard<std::mutex> lock(stdout_mutex);
+        std::cout << key << " " << timestamp_str << std::endl;
+      }
       LOG(INFO) << key << " " << final_result;
-    } else {
-      LOG(WARNING) << "No wav file for " << key;
     }
+  };
+
+  wenet::ThreadPool pool(num_workers);
+  for (int i = 0; i < num_workers; ++i) {
+    pool.Post([&worker, i]() { worker(i); });
   }
+  pool.Drain();
   return 0;
 }
@@ -0,0 +1,432 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Replay the session logs captured by websocket_server_main
+// --session_log_dir through an in-process AsrDecoder, with the packets and
+// the timing of the clients, and report the latencies and the cpu time, so
+// two builds are compared on the same traffic.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <utility>
+
+#include "decoder/params.h"
+#include "decoder/result_encoder.h"
+#include "frontend/audio_decoder.h"
+#include "utils/flags.h"
+#include "utils/json.h"
+#include "utils/log.h"
+#include "utils/session_log.h"
+#include "utils/string.h"
+#include "utils/thread_pool.h"
+#include "utils/timer.h"
+
+DEFINE_string(session_log, "", "session log to replay");
+DEFINE_string(session_log_list, "",
+              "file of the session logs to replay, one path per line");
+DEFINE_double(speed, 1.0,
+              "pace of the replay, 1 is the timing of the clients, 2 is "
+              "twice as fast, 0 feeds the packets as fast as possible");
+DEFINE_int32(num_workers, 1, "sessions replayed at the same time");
+DEFINE_string(report, "",
+              "write the latencies and the cpu time of the replay to this "
+              "file in JSON");
+DEFINE_string(baseline_report, "",
+              "the --report of another build on the same logs, the deltas "
+              "to it are printed");
+
+static int64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// The options of the start signal which change the decoding
+struct SessionOptions {
+  int nbest = 1;
+  bool continuous_decoding = false;
+  // 0 means the sample rate of the feature config
+  int sample_rate = 0;
+  std::string codec = "pcm";
+  std::vector<std::string> contexts;
+};
+
+// The signal of a text message of the client, and its options
+static std::string ParseSignal(const std::string& message,
+                               SessionOptions* opts) {
+  json::JSON obj = json::JSON::Load(message);
+  if (!obj.hasKey("signal")) return "";
+  std::string signal = obj["signal"].ToString();
+  if (obj.hasKey("nbest")) opts->nbest = obj["nbest"].ToInt();
+  if (obj.hasKey("continuous_decoding")) {
+    opts->continuous_decoding = obj["continuous_decoding"].ToBool();
+  }
+  if (obj.hasKey("sample_rate")) {
+    opts->sample_rate = obj["sample_rate"].ToInt();
+  }
+  if (obj.hasKey("codec")) opts->codec = obj["codec"].ToString();
+  if (obj.hasKey("contexts")) {
+    opts->contexts.clear();
+    for (const auto& context : obj["contexts"].ArrayRange()) {
+      opts->contexts.push_back(context.ToString());
+    }
+  }
+  return signal;
+}
+
+// The samples of the replay in milliseconds
+struct ReplayStats {
+  int num_sessions = 0;
+  double audio_ms = 0;
+  // Of each session, from its first packet to its first partial result
+  std::vector<double> first_partial_ms;
+  // Of each session ended by the client, from the end signal to the final
+  // result
+  std::vector<double> final_ms;
+  // The encoder and the search of each chunk
+  std::vector<double> chunk_ms;
+  // The final results of the replay which differ from the recorded ones
+  int num_finals = 0;
+  int num_mismatches = 0;
+
+  void Merge(const ReplayStats& other) {
+    auto append = [](const std::vector<double>& src,
+                     std::vector<double>* dst) {
+      dst->insert(dst->end(), src.begin(), src.end());
+    };
+    num_sessions += other.num_sessions;
+    audio_ms += other.audio_ms;
+    append(other.first_partial_ms, &first_partial_ms);
+    append(other.final_ms, &final_ms);
+    append(other.chunk_ms, &chunk_ms);
+    num_finals += other.num_finals;
+    num_mismatches += other.num_mismatches;
+  }
+};
+
+static ReplayStats ReplaySession(
+    const std::string& path,
+    std::shared_ptr<wenet::FeaturePipelineConfig> feature_config,
+    std::shared_ptr<wenet::DecodeOptions> decode_config,
+    std::shared_ptr<wenet::DecodeResource> decode_resource) {
+  ReplayStats stats;
+  wenet::SessionLogReader reader;
+  if (!reader.Open(path)) return stats;
+  std::vector<wenet::SessionRecord> records;
+  wenet::SessionRecord record;
+  while (reader.Read(&record)) {
+    records.push_back(std::move(record));
+  }
+  // The packets are replayed from the start signal on
+  SessionOptions opts;
+  size_t begin = 0;
+  while (begin < records.size() &&
+         (records[begin].event != wenet::SessionEvent::kText ||
+          ParseSignal(records[begin].data, &opts) != "start")) {
+    ++begin;
+  }
+  if (begin == records.size()) {
+    LOG(WARNING) << path << " has no start signal";
+    return stats;
+  }
+  std::vector<std::string> recorded_finals;
+  for (const auto& r : records) {
+    if (r.event == wenet::SessionEvent::kResult && !r.data.empty() &&
+        r.data[0] == static_cast<char>(wenet::ResultType::kFinalResult)) {
+      recorded_finals.push_back(r.data.substr(1));
+    }
+  }
+
+  auto feature_pipeline =
+      std::make_shared<wenet::FeaturePipeline>(*feature_config);
+  std::unique_ptr<wenet::AudioDecoder> audio_decoder;
+  int sample_rate = feature_config->sample_rate;
+  if (opts.codec != "pcm") {
+    audio_decoder =
+        wenet::CreateAudioDecoder(opts.codec, feature_config->sample_rate);
+    if (audio_decoder == nullptr) {
+      LOG(WARNING) << path << " has the unsupported codec " << opts.codec;
+      return stats;
+    }
+  } else if (opts.sample_rate > 0) {
+    sample_rate = opts.sample_rate;
+    feature_pipeline->set_input_sample_rate(sample_rate);
+  }
+  wenet::AsrDecoder decoder(feature_pipeline, decode_resource,
+                            *decode_config);
+  decoder.set_partial_nbest(opts.nbest);
+  auto set_contexts = [&](const std::vector<std::string>& contexts) {
+    if (decode_resource->context_graph_cache == nullptr) {
+      LOG(WARNING) << path << " has contexts, see --context_cache_size";
+      return;
+    }
+    decoder.SetContextGraph(
+        decode_resource->context_graph_cache->Get(contexts));
+  };
+  if (!opts.contexts.empty()) {
+    set_contexts(opts.contexts);
+  }
+  stats.num_sessions = 1;
+
+  // The packets are fed on their own thread at their recorded times, as
+  // the clients send them, and the decoding runs on this thread
+  std::mutex mutex;
+  std::condition_variable stop_cond;
+  bool stopped = false;
+  std::atomic<int64_t> first_audio_us{-1};
+  std::atomic<int64_t> end_us{-1};
+  int64_t num_samples = 0;
+  std::thread feeder([&]() {
+    const int64_t start_us = NowUs();
+    const int64_t base_us = records[begin].time_us;
+    std::vector<int16_t> pcm;
+    for (size_t i = begin + 1; i < records.size(); ++i) {
+      const wenet::SessionRecord& r = records[i];
+      if (r.event == wenet::SessionEvent::kResult) continue;
+      std::unique_lock<std::mutex> lock(mutex);
+      if (FLAGS_speed > 0) {
+        auto due = std::chrono::steady_clock::time_point(
+            std::chrono::microseconds(
+                start_us + static_cast<int64_t>((r.time_us - base_us) /
+                                                FLAGS_speed)));
+        stop_cond.wait_until(lock, due, [&]() { return stopped; });
+      }
+      if (stopped) break;
+      lock.unlock();
+      if (r.event == wenet::SessionEvent::kAudio) {
+        const int16_t* data =
+            reinterpret_cast<const int16_t*>(r.data.data());
+        size_t size = r.data.size() / sizeof(int16_t);
+        if (audio_decoder != nullptr) {
+          pcm.clear();
+          if (!audio_decoder->Decode(r.data.data(), r.data.size(), &pcm)) {
+            LOG(WARNING) << path << " has a bad " << opts.codec
+                         << " packet";
+            break;
+          }
+          data = pcm.data();
+          size = pcm.size();
+        }
+        int64_t none = -1;
+        first_audio_us.compare_exchange_strong(none, NowUs());
+        feature_pipeline->AcceptWaveform(data, size);
+        num_samples += size;
+      } else {
+        SessionOptions signal_opts;
+        std::string signal = ParseSignal(r.data, &signal_opts);
+        if (signal == "end") break;
+        if (signal == "contexts") set_contexts(signal_opts.contexts);
+      }
+    }
+    // The sessions closed without the end signal end with the log
+    end_us = NowUs();
+    feature_pipeline->set_input_finished();
+  });
+
+  std::vector<std::string> finals;
+  auto add_final = [&]() {
+    decoder.Rescoring();
+    const auto& result = decoder.result();
+    finals.push_back(result.empty() ? "" : result[0].sentence);
+  };
+  while (true) {
+    wenet::DecodeState state = decoder.Decode(true);
+    if (decoder.last_forward_us() >= 0) {
+      stats.chunk_ms.push_back(
+          (decoder.last_forward_us() + decoder.last_search_us()) / 1000.0);
+    }
+    if (stats.first_partial_ms.empty() && decoder.DecodedSomething() &&
+        first_audio_us >= 0) {
+      stats.first_partial_ms.push_back((NowUs() - first_audio_us) / 1000.0);
+    }
+    if (state == wenet::DecodeState::kEndFeats) {
+      add_final();
+      stats.final_ms.push_back((NowUs() - end_us) / 1000.0);
+      break;
+    } else if (state == wenet::DecodeState::kEndpoint) {
+      add_final();
+      if (!opts.continuous_decoding) break;
+      decoder.ResetContinuousDecoding();
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopped = true;
+  }
+  stop_cond.notify_all();
+  feeder.join();
+  stats.audio_ms = num_samples * 1000.0 / sample_rate;
+
+  const size_t num_finals = std::max(finals.size(), recorded_finals.size());
+  stats.num_finals = num_finals;
+  for (size_t i = 0; i < num_finals; ++i) {
+    if (i >= finals.size() || i >= recorded_finals.size() ||
+        finals[i] != recorded_finals[i]) {
+      ++stats.num_mismatches;
+    }
+  }
+  VLOG(1) << path << ": " << finals.size() << " finals, "
+          << recorded_finals.size() << " recorded";
+  return stats;
+}
+
+// Count, mean, max and the nearest rank percentiles of the samples
+static json::JSON Summarize(std::vector<double> samples) {
+  json::JSON obj;
+  obj["count"] = static_cast<int>(samples.size());
+  if (samples.empty()) return obj;
+  std::sort(samples.begin(), samples.end());
+  auto percentile = [&samples](double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p / 100 * samples.size()));
+    return samples[std::max<size_t>(rank, 1) - 1];
+  };
+  double sum = 0;
+  for (double x : samples) sum += x;
+  obj["mean"] = sum / samples.size();
+  obj["p50"] = percentile(50);
+  obj["p90"] = percentile(90);
+  obj["p99"] = percentile(99);
+  obj["max"] = samples.back();
+  return obj;
+}
+
+static double ToNumber(const json::JSON& value) {
+  bool ok = false;
+  double number = value.ToFloat(&ok);
+  return ok ? number : value.ToInt();
+}
+
+// Print the metrics of report next to the ones of baseline
+static void PrintDeltas(const json::JSON& baseline, const json::JSON& report) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(2);
+  auto print = [&](const std::string& name, double old_value,
+                   double new_value) {
+    out << std::left << std::setw(22) << name << std::right << std::setw(12)
+        << old_value << std::setw(12) << new_value;
+    if (old_value != 0) {
+      out << std::setw(9) << std::showpos
+          << (new_value - old_value) / old_value * 100 << "%"
+          << std::noshowpos;
+    }
+    out << "\n";
+  };
+  out << std::left << std::setw(22) << "metric" << std::right
+      << std::setw(12) << "baseline" << std::setw(12) << "current" << "\n";
+  for (const char* name : {"cpu_ms", "cpu_rtf", "wall_ms"}) {
+    if (baseline.hasKey(name) && report.hasKey(name)) {
+      print(name, ToNumber(baseline.at(name)), ToNumber(report.at(name)));
+    }
+  }
+  for (const char* latency : {"first_partial_ms", "final_ms", "chunk_ms"}) {
+    if (!baseline.hasKey(latency) || !report.hasKey(latency)) continue;
+    const json::JSON& old_stats = baseline.at(latency);
+    const json::JSON& new_stats = report.at(latency);
+    for (const char* p : {"p50", "p90", "p99"}) {
+      if (old_stats.hasKey(p) && new_stats.hasKey(p)) {
+        print(std::string(latency) + "." + p, ToNumber(old_stats.at(p)),
+              ToNumber(new_stats.at(p)));
+      }
+    }
+  }
+  std::cout << out.str();
+}
+
+int main(int argc, char* argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, false);
+  google::InitGoogleLogging(argv[0]);
+
+  std::vector<std::string> paths;
+  if (!FLAGS_session_log.empty()) {
+    paths.push_back(FLAGS_session_log);
+  } else {
+    std::ifstream list(FLAGS_session_log_list);
+    std::string line;
+    while (getline(list, line)) {
+      line = wenet::Trim(line);
+      if (!line.empty()) paths.push_back(line);
+    }
+  }
+  if (paths.empty()) {
+    LOG(FATAL) << "Please provide the session log or the session log list.";
+  }
+
+  auto decode_config = wenet::InitDecodeOptionsFromFlags();
+  auto feature_config = wenet::InitFeaturePipelineConfigFromFlags();
+  auto decode_resource = wenet::InitDecodeResourceFromFlags();
+
+  std::mutex stats_mutex;
+  ReplayStats stats;
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    for (size_t i = next++; i < paths.size(); i = next++) {
+      ReplayStats session = ReplaySession(paths[i], feature_config,
+                                          decode_config, decode_resource);
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      stats.Merge(session);
+    }
+  };
+  const int num_workers = std::max(
+      1, std::min(FLAGS_num_workers, static_cast<int>(paths.size())));
+  wenet::Timer wall_timer;
+  // The cpu time of the process, of all the threads of the decoding
+  std::clock_t cpu_start = std::clock();
+  {
+    wenet::ThreadPool pool(num_workers);
+    for (int i = 0; i < num_workers; ++i) {
+      pool.Post(worker);
+    }
+    pool.Drain();
+  }
+  double cpu_ms = (std::clock() - cpu_start) * 1000.0 / CLOCKS_PER_SEC;
+  int wall_ms = std::max(wall_timer.Elapsed(), 1);
+
+  json::JSON report;
+  report["num_sessions"] = stats.num_sessions;
+  report["audio_ms"] = stats.audio_ms;
+  report["speed"] = FLAGS_speed;
+  report["wall_ms"] = wall_ms;
+  report["cpu_ms"] = cpu_ms;
+  report["cpu_rtf"] = cpu_ms / std::max(stats.audio_ms, 1.0);
+  report["num_finals"] = stats.num_finals;
+  report["num_mismatches"] = stats.num_mismatches;
+  report["first_partial_ms"] = Summarize(stats.first_partial_ms);
+  report["final_ms"] = Summarize(stats.final_ms);
+  report["chunk_ms"] = Summarize(stats.chunk_ms);
+  LOG(INFO) << "Replayed " << stats.num_sessions << " sessions of "
+            << stats.audio_ms << "ms audio, " << cpu_ms << "ms cpu, "
+            << wall_ms << "ms wall time, " << stats.num_mismatches << " of "
+            << stats.num_finals << " final results differ from the recorded";
+  if (!FLAGS_report.empty()) {
+    std::ofstream os(FLAGS_report);
+    os << report.dump() << std::endl;
+    LOG(INFO) << "Replay report written to " << FLAGS_report;
+  }
+  if (!FLAGS_baseline_report.empty()) {
+    std::ifstream is(FLAGS_baseline_report);
+    std::stringstream buffer;
+    buffer << is.rdbuf();
+    PrintDeltas(json::JSON::Load(buffer.str()), report);
+  }
+  return 0;
+}
@@ -14,9 +14,11 @@
 
 #include "frontend/wav.h"
 #include "utils/flags.h"
+#include "utils/load_test_params.h"
 #include "utils/log.h"
 #include "utils/timer.h"
 #include "websocket/websocket_client.h"
+#include "websocket/websocket_load_generator.h"
 
 DEFINE_string(hostname, "127.0.0.1", "hostname of websocket server");
 DEFINE_int32(port, 10086, "port of websocket server");
@@ -27,6 +29,14 @@ DEFINE_bool(continuous_decoding, false, "continuous decoding mode");
 int main(int argc, char *argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, false);
   google::InitGoogleLogging(argv[0]);
+  if (!FLAGS_wav_scp.empty()) {
+    wenet::LoadTestOptions opts;
+    opts.hostname = FLAGS_hostname;
+    opts.port = FLAGS_port;
+    opts.nbest = FLAGS_nbest;
+    opts.continuous_decoding = FLAGS_continuous_decoding;
+    return wenet::RunLoadTestFromFlags<wenet::WebSocketLoadGenerator>(opts);
+  }
   wenet::WebSocketClient client(FLAGS_hostname, FLAGS_port);
   client.set_nbest(FLAGS_nbest);
   client.set_continuous_decoding(FLAGS_continuous_decoding);
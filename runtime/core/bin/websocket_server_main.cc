@@ -14,21 +14,106 @@
 
 #include "decoder/params.h"
 #include "utils/log.h"
+#include "utils/session_log.h"
+#include "utils/trace.h"
+#include "utils/thread_placement.h"
+#include "websocket/metrics_server.h"
 #include "websocket/websocket_server.h"
 
 DEFINE_int32(port, 10086, "websocket listening port");
+DEFINE_int32(num_io_threads, 1, "threads for the I/O of all connections");
+DEFINE_int32(num_acceptors, 1,
+             "acceptors on the port with SO_REUSEPORT, each with its own "
+             "num_io_threads io threads");
+DEFINE_string(io_cpus, "",
+              "cpus to pin the io threads to, e.g. 0-3, split evenly over "
+              "the acceptors, empty means no pinning");
+DEFINE_int32(num_decode_threads, 0,
+             "threads for the decoding of all connections, "
+             "0 means one per cpu");
+DEFINE_int32(metrics_port, 0,
+             "port of the HTTP /metrics endpoint, 0 means no endpoint");
+DEFINE_bool(trace, false,
+            "record the scoped traces of the hot paths, compiled in by cmake "
+            "-DTRACE=ON, served in the Chrome trace format at /trace of "
+            "--metrics_port");
+DEFINE_int32(offline_batch_size, 8,
+             "max utterances of the offline requests in one full context "
+             "encoder forward, 0 means no offline requests");
+DEFINE_int32(offline_batch_wait_us, 5000,
+             "max time(us) an offline utterance waits for others to batch "
+             "with");
+
+DEFINE_string(session_log_dir, "",
+              "capture the packets, their timing, the start options and the "
+              "results of the websocket sessions to a log per session in "
+              "this directory, for session_replay_main, empty means no "
+              "capture");
+DEFINE_int32(session_log_every_n, 1, "capture one in every n sessions");
+DEFINE_string(shm_socket, "",
+              "Unix socket path, by which the processes on this host get the "
+              "shared memory audio rings of their sessions of the "
+              "\"audio_transport\": \"shm\" option, empty means disabled");
+DEFINE_int32(shm_ring_seconds, 10, "seconds of audio of a shared memory ring");
+DEFINE_bool(fair_scheduling, false,
+            "schedule the decoding by the \"priority\" and the \"tenant\" "
+            "start options of the sessions, the interactive ones first and "
+            "the tenants by their weights");
+DEFINE_string(tenant_weights, "",
+              "weights of the tenants for --fair_scheduling, e.g. a:4,b:1, "
+              "the others weigh 1");
 
 int main(int argc, char *argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, false);
   google::InitGoogleLogging(argv[0]);
+  wenet::InitAsyncLoggingFromFlags();
+
+  if (FLAGS_trace) {
+    wenet::Tracer::Get()->set_enabled(true);
+  }
+  // /ready of the metrics server is 503 while the models are loaded
+  std::unique_ptr<wenet::MetricsServer> metrics_server;
+  if (FLAGS_metrics_port > 0) {
+    metrics_server.reset(new wenet::MetricsServer(
+        FLAGS_metrics_port, wenet::MetricsRegistry::Global()));
+    metrics_server->Start();
+  }
 
   auto decode_config = wenet::InitDecodeOptionsFromFlags();
   auto feature_config = wenet::InitFeaturePipelineConfigFromFlags();
-  auto decode_resource = wenet::InitDecodeResourceFromFlags();
+  // The default model of the manifest, or the model of the flags
+  auto model_registry = wenet::InitModelRegistryFromFlags();
+  auto decode_resource = model_registry != nullptr ?
+                         model_registry->Get() :
+                         wenet::InitDecodeResourceFromFlags();
+  auto decoder_pool = wenet::InitDecoderPoolFromFlags(
+      feature_config, decode_config, decode_resource);
 
+  wenet::BatchTranscribeOptions transcribe_opts;
+  transcribe_opts.max_batch_size = FLAGS_offline_batch_size;
+  transcribe_opts.max_wait_us = FLAGS_offline_batch_wait_us;
+  wenet::AcceptorOptions acceptor_opts;
+  acceptor_opts.num_acceptors = FLAGS_num_acceptors;
+  acceptor_opts.cpus = wenet::ParseCpuList(FLAGS_io_cpus);
   wenet::WebSocketServer server(FLAGS_port, feature_config, decode_config,
-                                decode_resource);
+                                decode_resource, FLAGS_num_io_threads,
+                                FLAGS_num_decode_threads, transcribe_opts,
+                                decoder_pool, model_registry, acceptor_opts);
+  if (!FLAGS_session_log_dir.empty()) {
+    server.set_session_recorder(std::make_shared<wenet::SessionRecorder>(
+        FLAGS_session_log_dir, FLAGS_session_log_every_n));
+  }
+  if (!FLAGS_shm_socket.empty()) {
+    server.set_shm_socket(FLAGS_shm_socket, FLAGS_shm_ring_seconds);
+  }
+  if (FLAGS_fair_scheduling) {
+    std::unordered_map<std::string, float> weights;
+    CHECK(wenet::ParseTenantWeights(FLAGS_tenant_weights, &weights))
+        << "Bad --tenant_weights " << FLAGS_tenant_weights;
+    server.set_fair_scheduling(std::move(weights));
+  }
   LOG(INFO) << "Listening at port " << FLAGS_port;
+  if (metrics_server != nullptr) metrics_server->set_ready(true);
   server.Start();
   return 0;
 }
@@ -0,0 +1,7 @@
+FetchContent_Declare(benchmark
+  GIT_REPOSITORY https://github.com/google/benchmark
+  GIT_TAG        v1.6.1
+)
+set(BENCHMARK_ENABLE_TESTING OFF CACHE BOOL "" FORCE)
+set(BENCHMARK_ENABLE_GTEST_TESTS OFF CACHE BOOL "" FORCE)
+FetchContent_MakeAvailable(benchmark)
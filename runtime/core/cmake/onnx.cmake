@@ -19,3 +19,4 @@ FetchContent_Declare(onnxruntime
 FetchContent_MakeAvailable(onnxruntime)
 include_directories("${onnxruntime_SOURCE_DIR}/include")
 link_directories("${onnxruntime_SOURCE_DIR}/lib")
+add_definitions(-DUSE_ONNX)
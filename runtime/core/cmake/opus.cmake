@@ -0,0 +1,5 @@
+FetchContent_Declare(opus
+  URL      https://github.com/xiph/opus/archive/refs/tags/v1.3.1.tar.gz
+)
+FetchContent_MakeAvailable(opus)
+add_definitions(-DUSE_OPUS)
@@ -0,0 +1,71 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/adaptive_beam_policy.h"
+
+#include <algorithm>
+#include <functional>
+
+#include "decoder/decode_metrics.h"
+#include "utils/log.h"
+
+namespace wenet {
+
+AdaptiveBeamPolicy::AdaptiveBeamPolicy(const AdaptiveBeamOptions& opts)
+    : opts_(opts), last_move_(std::chrono::steady_clock::now()) {
+  CHECK(!opts_.beam_scales.empty());
+  CHECK(std::is_sorted(opts_.beam_scales.begin(), opts_.beam_scales.end(),
+                       std::greater<float>()));
+  CHECK_GT(opts_.beam_scales.back(), 0.0);
+  CHECK_LE(opts_.low_rtf, opts_.high_rtf);
+}
+
+float AdaptiveBeamPolicy::BeamScale(float chunk_rtf, float session_rtf) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  rtf_ += opts_.rtf_momentum * (chunk_rtf - rtf_);
+  auto now = std::chrono::steady_clock::now();
+  int max_level = static_cast<int>(opts_.beam_scales.size()) - 1;
+  if (now - last_move_ >= std::chrono::milliseconds(opts_.interval_ms)) {
+    if (rtf_ > opts_.high_rtf && level_ < max_level) {
+      ++level_;
+      last_move_ = now;
+      VLOG(1) << "RTF " << rtf_ << ", tighten the beams to "
+              << opts_.beam_scales[level_];
+    } else if (rtf_ < opts_.low_rtf && level_ > 0) {
+      --level_;
+      last_move_ = now;
+      VLOG(1) << "RTF " << rtf_ << ", relax the beams to "
+              << opts_.beam_scales[level_];
+    }
+    DecodeMetrics::Get()->beam_level->Set(level_);
+  }
+  int level = level_;
+  if (session_rtf > opts_.high_rtf) {
+    level = std::min(level + 1, max_level);
+  }
+  return opts_.beam_scales[level];
+}
+
+float AdaptiveBeamPolicy::rtf() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return rtf_;
+}
+
+int AdaptiveBeamPolicy::level() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return level_;
+}
+
+}  // namespace wenet
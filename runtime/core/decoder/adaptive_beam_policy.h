@@ -0,0 +1,77 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef DECODER_ADAPTIVE_BEAM_POLICY_H_
+#define DECODER_ADAPTIVE_BEAM_POLICY_H_
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct AdaptiveBeamOptions {
+  // Scales of the beams, see SearchInterface::set_beam_scale(), from the
+  // full beams to the tightest ones, e.g. {1.0, 0.75, 0.5}
+  std::vector<float> beam_scales = {1.0};
+  // The load is the moving average of the RTF of the chunks of all the
+  // sessions, i.e. the forward and search time over the audio time, which
+  // grows when the cores are oversubscribed. Move to the next tighter
+  // scale when it is above high_rtf, and back to the next looser one when
+  // it is below low_rtf.
+  float high_rtf = 0.5;
+  float low_rtf = 0.2;
+  // Weight of a chunk in the moving average
+  float rtf_momentum = 0.05;
+  // The level moves one step per interval at most, so it doesn't follow
+  // short bursts
+  int interval_ms = 1000;
+};
+
+// AdaptiveBeamPolicy picks the beams of the decoding sessions by the load of
+// the host, the full beams under light load, and tighter ones when the
+// decoding falls behind the audio, so the accuracy degrades gradually at
+// the peaks instead of the latency. The level is shared by all the sessions,
+// and a session whose own RTF is over high_rtf, e.g. of a noisy audio with
+// many active paths, is one step tighter than the others.
+// It is thread safe.
+class AdaptiveBeamPolicy {
+ public:
+  explicit AdaptiveBeamPolicy(const AdaptiveBeamOptions& opts);
+
+  // Report a decoded chunk of chunk_rtf, of a session whose sentences so far
+  // are of session_rtf, and return the beam scale of its next chunk
+  float BeamScale(float chunk_rtf, float session_rtf);
+  // The moving average of the chunk RTF
+  float rtf() const;
+  // Index of the current scale of beam_scales
+  int level() const;
+
+ private:
+  const AdaptiveBeamOptions opts_;
+  mutable std::mutex mutex_;
+  float rtf_ = 0.0;
+  int level_ = 0;
+  std::chrono::steady_clock::time_point last_move_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(AdaptiveBeamPolicy);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_ADAPTIVE_BEAM_POLICY_H_
@@ -0,0 +1,47 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/adaptive_chunk_policy.h"
+
+#include <algorithm>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+AdaptiveChunkPolicy::AdaptiveChunkPolicy(const AdaptiveChunkOptions& opts)
+    : opts_(opts) {
+  CHECK(!opts_.chunk_sizes.empty());
+  CHECK(std::is_sorted(opts_.chunk_sizes.begin(), opts_.chunk_sizes.end()));
+  CHECK_GT(opts_.chunk_sizes[0], 0);
+  CHECK_LE(opts_.low_load, opts_.high_load);
+}
+
+int AdaptiveChunkPolicy::ChunkSize(float load) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  int max_level = static_cast<int>(opts_.chunk_sizes.size()) - 1;
+  if (load > opts_.high_load && level_ < max_level) {
+    ++level_;
+    VLOG(1) << "Load " << load << ", increase chunk size to "
+            << opts_.chunk_sizes[level_];
+  } else if (load < opts_.low_load && level_ > 0) {
+    --level_;
+    VLOG(1) << "Load " << load << ", decrease chunk size to "
+            << opts_.chunk_sizes[level_];
+  }
+  return opts_.chunk_sizes[level_];
+}
+
+}  // namespace wenet
@@ -0,0 +1,62 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef DECODER_ADAPTIVE_CHUNK_POLICY_H_
+#define DECODER_ADAPTIVE_CHUNK_POLICY_H_
+
+#include <mutex>
+#include <vector>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct AdaptiveChunkOptions {
+  // Chunk sizes the model supports, from the smallest(lowest latency) to
+  // the largest, e.g. U2 models trained with dynamic chunk support any size
+  std::vector<int> chunk_sizes;
+  // Move to the next larger chunk size when the load is above high_load,
+  // and back to the next smaller one when it is below low_load
+  float high_load = 1.0;
+  float low_load = 0.5;
+};
+
+// AdaptiveChunkPolicy picks the chunk size of the decoding sessions by the
+// server load, small chunks for the lowest latency under light load, and
+// larger chunks to amortize the per-call overhead when the encoder queue
+// backs up. The level is shared by all the sessions and moves one step per
+// call, so it doesn't jump between the sizes on short bursts.
+// It is thread safe.
+class AdaptiveChunkPolicy {
+ public:
+  explicit AdaptiveChunkPolicy(const AdaptiveChunkOptions& opts);
+
+  // Chunk size for a session which starts(or restarts) a sentence, `load`
+  // is the feedback of the encoder scheduler, see
+  // BatchEncoderScheduler::load()
+  int ChunkSize(float load);
+
+ private:
+  const AdaptiveChunkOptions opts_;
+  std::mutex mutex_;
+  int level_ = 0;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(AdaptiveChunkPolicy);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_ADAPTIVE_CHUNK_POLICY_H_
@@ -0,0 +1,72 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/admission_controller.h"
+
+#include "utils/log.h"
+
+namespace wenet {
+
+AdmissionController::AdmissionController(const AdmissionOptions& opts)
+    : opts_(opts),
+      full_rtf_(opts.initial_rtf),
+      degraded_rtf_(opts.initial_degraded_rtf) {
+  CHECK_GT(opts_.max_load, 0);
+  CHECK_GT(opts_.initial_rtf, 0);
+  CHECK_GT(opts_.initial_degraded_rtf, 0);
+  CHECK_GT(opts_.rtf_momentum, 0);
+  CHECK_LE(opts_.rtf_momentum, 1);
+}
+
+float AdmissionController::LoadLocked() const {
+  return num_full_ * full_rtf_ + num_degraded_ * degraded_rtf_;
+}
+
+float AdmissionController::load() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return LoadLocked();
+}
+
+Admission AdmissionController::Enter() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  float load = LoadLocked();
+  if (load + full_rtf_ <= opts_.max_load) {
+    num_full_++;
+    return Admission::kFull;
+  }
+  if (load + degraded_rtf_ <= opts_.max_degraded_load) {
+    num_degraded_++;
+    return Admission::kDegraded;
+  }
+  VLOG(1) << "Reject the stream, load " << load << ", " << num_full_
+          << " full and " << num_degraded_ << " degraded streams";
+  return Admission::kRejected;
+}
+
+void AdmissionController::Leave(Admission admission, int64_t audio_ms,
+                                int64_t decode_ms) {
+  if (admission == Admission::kRejected) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  bool full = admission == Admission::kFull;
+  int& num_active = full ? num_full_ : num_degraded_;
+  CHECK_GT(num_active, 0);
+  num_active--;
+  if (audio_ms > 0) {
+    float& rtf = full ? full_rtf_ : degraded_rtf_;
+    float current = static_cast<float>(decode_ms) / audio_ms;
+    rtf += opts_.rtf_momentum * (current - rtf);
+  }
+}
+
+}  // namespace wenet
@@ -0,0 +1,79 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_ADMISSION_CONTROLLER_H_
+#define DECODER_ADMISSION_CONTROLLER_H_
+
+#include <cstdint>
+#include <mutex>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct AdmissionOptions {
+  // Cores the streams may use. The load of a stream is its RTF, a stream is
+  // admitted with the full profile if the load stays within max_load.
+  float max_load = 1.0;
+  // The streams over max_load but within max_degraded_load are admitted
+  // with the degraded profile, see DegradeDecodeOptions(), the others are
+  // rejected. It's max_load if it's less, which means no degraded profile.
+  float max_degraded_load = 0;
+  // RTF of the streams of each profile before any is measured
+  float initial_rtf = 0.1;
+  float initial_degraded_rtf = 0.05;
+  // Weight of the RTF of a finished stream in the moving averages
+  float rtf_momentum = 0.1;
+};
+
+enum class Admission {
+  kFull = 0,
+  kDegraded = 1,
+  kRejected = 2,
+};
+
+// AdmissionController keeps the estimated load of the active streams of a
+// server within the cores, instead of letting the RTF of every stream
+// degrade together under overload. The cost of a stream is the moving
+// average of the RTF of the finished streams of its profile.
+// It is thread safe.
+class AdmissionController {
+ public:
+  explicit AdmissionController(const AdmissionOptions& opts);
+
+  // On the start of a stream
+  Admission Enter();
+  // The stream admitted as `admission` by Enter() is done, it decoded
+  // audio_ms audio in decode_ms
+  void Leave(Admission admission, int64_t audio_ms, int64_t decode_ms);
+  // Estimated cores used by the active streams
+  float load() const;
+
+ private:
+  float LoadLocked() const;
+
+  const AdmissionOptions opts_;
+  mutable std::mutex mutex_;
+  int num_full_ = 0;
+  int num_degraded_ = 0;
+  float full_rtf_;
+  float degraded_rtf_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(AdmissionController);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_ADMISSION_CONTROLLER_H_
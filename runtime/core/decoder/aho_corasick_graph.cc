@@ -0,0 +1,241 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/aho_corasick_graph.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+static const char kMagic[4] = {'W', 'N', 'A', 'C'};
+static const int32_t kVersion = 1;
+
+// Byte size of the buffer of num_states states and num_arcs arcs
+static size_t BufferSize(int32_t num_states, int32_t num_arcs) {
+  return 16 + sizeof(int32_t) * (num_states + 1) +
+         sizeof(int32_t) * num_arcs + sizeof(int32_t) * num_states * 2 +
+         sizeof(float) * num_states * 2;
+}
+
+std::unique_ptr<AhoCorasickGraph> AhoCorasickGraph::Build(
+    const std::vector<Phrase>& phrases) {
+  // 1. The trie, (parent << 32 | word id) => child
+  struct Node {
+    int parent;
+    int label;
+    int depth;
+    float potential;
+    bool terminal;
+  };
+  std::vector<Node> nodes = {{-1, -1, 0, 0, false}};
+  std::unordered_map<uint64_t, int> children;
+  for (const Phrase& phrase : phrases) {
+    if (phrase.empty()) continue;
+    int state = 0;
+    for (const auto& word : phrase) {
+      uint64_t key = static_cast<uint64_t>(state) << 32 |
+                     static_cast<uint32_t>(word.first);
+      auto it = children.find(key);
+      if (it == children.end()) {
+        nodes.push_back({state, word.first, nodes[state].depth + 1,
+                         nodes[state].potential + word.second, false});
+        it = children.emplace(key, nodes.size() - 1).first;
+      }
+      state = it->second;
+    }
+    nodes[state].terminal = true;
+  }
+  children.clear();
+
+  // 2. Renumber the states in BFS order, level by level, sorted by the new
+  // id of the parent and then the label
+  int num_states = nodes.size();
+  std::vector<int> order(num_states);
+  for (int i = 0; i < num_states; ++i) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&nodes](int a, int b) {
+    return nodes[a].depth < nodes[b].depth;
+  });
+  std::vector<int> new_ids(num_states, 0);
+  for (int begin = 1; begin < num_states;) {
+    int end = begin;
+    while (end < num_states &&
+           nodes[order[end]].depth == nodes[order[begin]].depth) {
+      ++end;
+    }
+    std::sort(order.begin() + begin, order.begin() + end,
+              [&nodes, &new_ids](int a, int b) {
+                int pa = new_ids[nodes[a].parent];
+                int pb = new_ids[nodes[b].parent];
+                return pa < pb || (pa == pb && nodes[a].label < nodes[b].label);
+              });
+    for (int i = begin; i < end; ++i) new_ids[order[i]] = i;
+    begin = end;
+  }
+
+  // 3. Fill the arrays in the buffer
+  int num_arcs = num_states - 1;
+  std::unique_ptr<AhoCorasickGraph> graph(new AhoCorasickGraph());
+  graph->buffer_.resize(BufferSize(num_states, num_arcs));
+  Header* header = reinterpret_cast<Header*>(graph->buffer_.data());
+  memcpy(header->magic, kMagic, sizeof(kMagic));
+  header->version = kVersion;
+  header->num_states = num_states;
+  header->num_arcs = num_arcs;
+  CHECK(graph->Attach(graph->buffer_.data(), graph->buffer_.size()));
+  int32_t* offsets = const_cast<int32_t*>(graph->offsets_);
+  int32_t* labels = const_cast<int32_t*>(graph->labels_);
+  int32_t* fail = const_cast<int32_t*>(graph->fail_);
+  int32_t* output = const_cast<int32_t*>(graph->output_);
+  float* potential = const_cast<float*>(graph->potential_);
+  float* matched = const_cast<float*>(graph->matched_);
+  std::vector<int> num_children(num_states, 0);
+  for (int i = 1; i < num_states; ++i) {
+    const Node& node = nodes[order[i]];
+    ++num_children[new_ids[node.parent]];
+    labels[i - 1] = node.label;
+  }
+  offsets[0] = 0;
+  for (int s = 0; s < num_states; ++s) {
+    offsets[s + 1] = offsets[s] + num_children[s];
+  }
+
+  // 4. The failure links, in BFS order, the failure state of a state is
+  // always on an upper level
+  fail[0] = 0;
+  output[0] = -1;
+  potential[0] = 0;
+  matched[0] = 0;
+  for (int i = 1; i < num_states; ++i) {
+    const Node& node = nodes[order[i]];
+    int parent = new_ids[node.parent];
+    int f = 0;
+    if (parent != 0) {
+      for (int s = fail[parent];; s = fail[s]) {
+        f = graph->Child(s, node.label);
+        if (f >= 0 || s == 0) break;
+      }
+      f = std::max(f, 0);
+    }
+    fail[i] = f;
+    output[i] = node.terminal ? i : output[f];
+    potential[i] = node.potential;
+    matched[i] = node.terminal ? node.potential : matched[parent];
+  }
+  VLOG(1) << "Aho-Corasick graph of " << phrases.size() << " phrases, "
+          << num_states << " states";
+  return graph;
+}
+
+bool AhoCorasickGraph::Attach(const char* data, size_t size) {
+  if (size < sizeof(Header)) return false;
+  header_ = reinterpret_cast<const Header*>(data);
+  if (memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header_->version != kVersion || header_->num_states <= 0 ||
+      header_->num_arcs != header_->num_states - 1 ||
+      size != BufferSize(header_->num_states, header_->num_arcs)) {
+    return false;
+  }
+  int32_t n = header_->num_states;
+  const char* p = data + sizeof(Header);
+  offsets_ = reinterpret_cast<const int32_t*>(p);
+  p += sizeof(int32_t) * (n + 1);
+  labels_ = reinterpret_cast<const int32_t*>(p);
+  p += sizeof(int32_t) * header_->num_arcs;
+  fail_ = reinterpret_cast<const int32_t*>(p);
+  p += sizeof(int32_t) * n;
+  output_ = reinterpret_cast<const int32_t*>(p);
+  p += sizeof(int32_t) * n;
+  potential_ = reinterpret_cast<const float*>(p);
+  p += sizeof(float) * n;
+  matched_ = reinterpret_cast<const float*>(p);
+  return true;
+}
+
+std::unique_ptr<AhoCorasickGraph> AhoCorasickGraph::Read(
+    const std::string& path) {
+  std::unique_ptr<AhoCorasickGraph> graph(new AhoCorasickGraph());
+  graph->file_ = MappedFile::Open(path);
+  if (graph->file_ == nullptr ||
+      !graph->Attach(graph->file_->data(), graph->file_->size())) {
+    LOG(WARNING) << path << " is not a valid Aho-Corasick graph";
+    return nullptr;
+  }
+  return graph;
+}
+
+bool AhoCorasickGraph::Write(const std::string& path) const {
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (fp == nullptr) return false;
+  size_t size = BufferSize(header_->num_states, header_->num_arcs);
+  bool ok = fwrite(header_, 1, size, fp) == size;
+  return fclose(fp) == 0 && ok;
+}
+
+int AhoCorasickGraph::Child(int state, int word_id) const {
+  const int32_t* begin = labels_ + offsets_[state];
+  const int32_t* end = labels_ + offsets_[state + 1];
+  const int32_t* it = std::lower_bound(begin, end, word_id);
+  if (it == end || *it != word_id) return -1;
+  return it - labels_ + 1;
+}
+
+int AhoCorasickGraph::GetNextState(int cur_state, int word_id, float* score,
+                                   bool* is_start_boundary,
+                                   bool* is_end_boundary) const {
+  // The context score of a hypothesis in state s is the score of the
+  // phrases matched before, plus potential_[s], of which matched_[s] is the
+  // score of the matched phrases on the path of s and the rest is the
+  // partial match, which is taken back when it fails.
+  float partial = potential_[cur_state] - matched_[cur_state];
+  int next = Child(cur_state, word_id);
+  float base = potential_[cur_state];
+  if (next < 0) {
+    for (int s = cur_state; s != 0 && next < 0;) {
+      s = fail_[s];
+      next = Child(s, word_id);
+    }
+    if (next < 0) {
+      *score = -partial;
+      return 0;
+    }
+    // The overlapping match has started on the previous words, the tag is
+    // put at the current word then
+    base = partial;
+    *is_start_boundary = true;
+  } else if (cur_state == 0) {
+    *is_start_boundary = true;
+  }
+  int phrase = output_[next];
+  if (phrase >= 0 && phrase != next) {
+    // A shorter phrase is matched as a suffix, take it and start over
+    *score = potential_[phrase] - partial;
+    *is_end_boundary = true;
+    return 0;
+  }
+  *score = potential_[next] - base;
+  if (phrase == next) {
+    *is_end_boundary = true;
+    // Go on only if a longer phrase could follow
+    if (offsets_[next] == offsets_[next + 1]) return 0;
+  }
+  return next;
+}
+
+}  // namespace wenet
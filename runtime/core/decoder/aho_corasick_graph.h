@@ -0,0 +1,97 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef DECODER_AHO_CORASICK_GRAPH_H_
+#define DECODER_AHO_CORASICK_GRAPH_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "utils/mapped_file.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// Aho-Corasick automaton of the context phrases, the backend of
+// ContextGraph for the very large phrase lists. A state is a node of the
+// trie of the phrases, the failure link of a state is the longest suffix of
+// its words which is a prefix of some phrase, so a failed partial match
+// falls back to the overlapping one instead of the start state.
+//
+// It's built in O(number of words) hash map operations, and stored in one
+// flat buffer, which is also its serialized form, so Read() just maps the
+// file into memory.
+class AhoCorasickGraph {
+ public:
+  // A phrase is the (word id, score) of its words
+  using Phrase = std::vector<std::pair<int, float>>;
+
+  static std::unique_ptr<AhoCorasickGraph> Build(
+      const std::vector<Phrase>& phrases);
+  // Return nullptr if the file is not a valid automaton
+  static std::unique_ptr<AhoCorasickGraph> Read(const std::string& path);
+  bool Write(const std::string& path) const;
+
+  // The same contract as ContextGraph::GetNextState, the score is the
+  // change of the context score. The score of the words of a partial match
+  // is taken back when it fails, the one of a matched phrase is kept, and
+  // it goes back to the start state 0 if no longer phrase could follow.
+  int GetNextState(int cur_state, int word_id, float* score,
+                   bool* is_start_boundary, bool* is_end_boundary) const;
+
+  int num_states() const { return header_->num_states; }
+
+ private:
+  struct Header {
+    char magic[4];
+    int32_t version;
+    int32_t num_states;
+    int32_t num_arcs;
+  };
+
+  AhoCorasickGraph() = default;
+  // Point the arrays below to the buffer of size bytes
+  bool Attach(const char* data, size_t size);
+  // Return the child of state by word_id, or -1
+  int Child(int state, int word_id) const;
+
+  std::vector<char> buffer_;
+  // The mapped file, buffer_ is not used then
+  std::unique_ptr<MappedFile> file_;
+
+  const Header* header_ = nullptr;
+  // The states are numbered in BFS order, so the children of a state are
+  // consecutive and sorted by label. The arcs of state s are [offsets_[s],
+  // offsets_[s + 1]), and the target of arc a is state a + 1.
+  const int32_t* offsets_ = nullptr;
+  const int32_t* labels_ = nullptr;
+  const int32_t* fail_ = nullptr;
+  // The longest phrase which is a suffix of the state, or -1
+  const int32_t* output_ = nullptr;
+  // Sum of the scores of the words from the start state
+  const float* potential_ = nullptr;
+  // Potential of the longest phrase which is a prefix of the state, or 0
+  const float* matched_ = nullptr;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(AhoCorasickGraph);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_AHO_CORASICK_GRAPH_H_
@@ -7,60 +7,277 @@
 #include <ctype.h>
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <limits>
 #include <utility>
 
+#include "decoder/decode_metrics.h"
+#include "decoder/device_replicas.h"
+#include "utils/state_io.h"
 #include "utils/timer.h"
+#include "utils/trace.h"
 
 namespace wenet {
 
 AsrDecoder::AsrDecoder(
     std::shared_ptr<FeaturePipeline> feature_pipeline,
     std::shared_ptr<DecodeResource> resource, const DecodeOptions& opts)
-    : feature_pipeline_(std::move(feature_pipeline)),
+    : device_resource_(resource->replicas != nullptr ?
+                       resource->replicas->Acquire() : resource),
+      feature_pipeline_(std::move(feature_pipeline)),
       // Make a copy of the model ASR model since we will change the inner
-      // status of the model
-      model_(resource->model->Copy()),
+      // status of the model, or reuse one from the pool
+      model_(device_resource_->model_pool != nullptr ?
+             device_resource_->model_pool->Acquire() :
+             device_resource_->model->Copy()),
+      model_pool_(device_resource_->model_pool),
       post_processor_(resource->post_processor),
-      symbol_table_(resource->symbol_table),
+      encoder_scheduler_(device_resource_->encoder_scheduler),
+      rescoring_scheduler_(device_resource_->rescoring_scheduler),
+      cascade_model_(resource->cascade_model),
+      cascade_rescoring_scheduler_(resource->cascade_rescoring_scheduler),
+      chunk_policy_(resource->chunk_policy),
+      beam_policy_(resource->beam_policy),
       fst_(resource->fst),
-      unit_table_(resource->unit_table),
+      ngram_lm_(resource->ngram_lm),
       opts_(opts),
       ctc_endpointer_(new CtcEndpoint(opts.ctc_endpoint_config)) {
   if (opts_.reverse_weight > 0) {
     // Check if model has a right to left decoder
     CHECK(model_->is_bidirectional_decoder());
   }
-  if (nullptr == fst_) {
-    searcher_.reset(new CtcPrefixBeamSearch(opts.ctc_prefix_search_opts,
-                                            resource->context_graph));
+  symbol_strings_ = resource->symbol_strings;
+  if (symbol_strings_ == nullptr && resource->symbol_table != nullptr) {
+    symbol_strings_ = std::make_shared<SymbolStrings>(
+        *resource->symbol_table,
+        std::vector<std::string>{kContextStartTag, kContextEndTag});
+  }
+  unit_strings_ = resource->unit_strings;
+  if (unit_strings_ == nullptr && resource->unit_table != nullptr) {
+    unit_strings_ = resource->unit_table == resource->symbol_table ?
+                    symbol_strings_ :
+                    std::make_shared<SymbolStrings>(*resource->unit_table);
+  }
+  // The searchers keep references to the options, which must outlive them
+  if (resource->keywords != nullptr) {
+    // The detections are emitted as they're found, never rescored
+    opts_.rescoring_weight = 0.0;
+    searcher_.reset(new CtcKeywordSpotting(opts_.ctc_keyword_opts,
+                                           resource->keywords));
+  } else if (nullptr == fst_) {
+    NewPrefixSearcher(resource->context_graph);
   } else {
-    searcher_.reset(new CtcWfstBeamSearch(*fst_, opts.ctc_wfst_search_opts,
-                                         resource->context_graph));
+    searcher_.reset(new CtcWfstBeamSearch(
+        *fst_, opts_.ctc_wfst_search_opts, resource->context_graph,
+        resource->rescore_lm, resource->rescore_old_lm));
   }
   ctc_endpointer_->frame_shift_in_ms(frame_shift_in_ms());
+  if (chunk_policy_ != nullptr) {
+    CHECK(encoder_scheduler_ != nullptr);
+  }
+  pipeline_pool_ = resource->pipeline_pool;
+  // The batched forward of the scheduler is of the dense log probs
+  sparse_ctc_ = model_->ctc_topk() > 0 && encoder_scheduler_ == nullptr;
+  AdaptChunkSize();
+}
+
+AsrDecoder::~AsrDecoder() {
+  DropSpeculativeRescoring();
+  DropPrefetch();
+  ReportMemory(DecoderMemory());
+  set_memory_degraded(false);
+}
+
+void DegradeDecodeOptions(DecodeOptions* opts) {
+  opts->rescoring_weight = 0.0;
+  CtcPrefixBeamSearchOptions& prefix_opts = opts->ctc_prefix_search_opts;
+  prefix_opts.first_beam_size = std::max(prefix_opts.first_beam_size / 2, 1);
+  prefix_opts.second_beam_size =
+      std::max(prefix_opts.second_beam_size / 2, 1);
+  // The Viterbi-only decoder is used for the 1-best
+  CtcWfstBeamSearchOptions& wfst_opts = opts->ctc_wfst_search_opts;
+  wfst_opts.nbest = 1;
+  wfst_opts.max_active = std::max(wfst_opts.max_active / 2,
+                                  wfst_opts.min_active);
+  wfst_opts.beam *= 0.75;
+}
+
+void AsrDecoder::AdaptChunkSize() {
+  if (chunk_policy_ == nullptr) {
+    return;
+  }
+  // The size only changes between sentences, the caches of the model are
+  // reset then
+  opts_.chunk_size = chunk_policy_->ChunkSize(encoder_scheduler_->load());
+  model_->set_chunk_size(opts_.chunk_size);
+  VLOG(2) << "Decode with chunk size " << opts_.chunk_size;
 }
 
 void AsrDecoder::Reset() {
+  DropSpeculativeRescoring();
+  DropPrefetch();
+  AdaptChunkSize();
   start_ = false;
   result_.clear();
+  PublishResult();
+  for (auto& text : result_texts_) text.Clear();
   num_frames_ = 0;
   global_frame_offset_ = 0;
+  base_frame_offset_ = 0;
+  num_prefix_chunks_ = 0;
+  decoding_time_ms_ = 0;
+  sentence_feats_.clear();
   model_->Reset();
   searcher_->Reset();
   feature_pipeline_->Reset();
   ctc_endpointer_->Reset();
+  set_memory_degraded(false);
+  sentence_start_bytes_ = memory_.total();
+  over_budget_ = false;
 }
 
 void AsrDecoder::ResetContinuousDecoding() {
+  DropSpeculativeRescoring();
+  DropPrefetch();
+  AdaptChunkSize();
   global_frame_offset_ = num_frames_;
+  num_prefix_chunks_ = 0;
   start_ = false;
   result_.clear();
+  PublishResult();
+  for (auto& text : result_texts_) text.Clear();
+  sentence_feats_.clear();
   model_->Reset();
   searcher_->Reset();
   ctc_endpointer_->Reset();
+  sentence_start_bytes_ = memory_.total();
+  over_budget_ = false;
+}
+
+static const uint32_t kStateMagic = 0x74737761;  // "awst"
+static const uint32_t kStateVersion = 3;
+
+bool AsrDecoder::SaveState(std::string* state) const {
+  state->clear();
+  StateWriter writer(state);
+  writer.Write(kStateMagic);
+  writer.Write(kStateVersion);
+  writer.Write<int32_t>(opts_.chunk_size);
+  writer.Write<uint8_t>(start_);
+  writer.Write<int32_t>(num_frames_);
+  writer.Write<int32_t>(global_frame_offset_);
+  writer.Write<int32_t>(base_frame_offset_);
+  writer.Write<int32_t>(num_prefix_chunks_);
+  writer.Write(decoding_time_ms_);
+  writer.Write<int32_t>(feature_dim_);
+  writer.WriteVector(sentence_feats_);
+  feature_pipeline_->SaveState(&writer);
+  // The model has forwarded the chunk ahead, if any, so it's kept with its
+  // outputs, and it's searched by the next Decode() after RestoreState()
+  const bool prefetched = prefetch_.done.valid();
+  if (prefetched) prefetch_.done.wait();
+  // The speculative rescoring is not kept
+  if (speculative_done_.valid()) speculative_done_.wait();
+  if (!model_->SaveState(&writer) || !searcher_->SaveState(&writer)) {
+    state->clear();
+    return false;
+  }
+  ctc_endpointer_->SaveState(&writer);
+  writer.Write<uint8_t>(prefetched);
+  if (prefetched) {
+    writer.WriteMatrix(prefetch_.feats);
+    writer.WriteMatrix(prefetch_.ctc_log_probs);
+    prefetch_.sparse_ctc_log_probs.SaveState(&writer);
+    writer.Write(prefetch_.forward_us);
+  }
+  return true;
+}
+
+bool AsrDecoder::RestoreState(const std::string& state) {
+  Reset();
+  StateReader reader(state);
+  uint32_t magic = 0;
+  uint32_t version = 0;
+  int32_t chunk_size = 0;
+  uint8_t start = 0;
+  uint8_t prefetched = 0;
+  if (!reader.Read(&magic) || magic != kStateMagic ||
+      !reader.Read(&version) || version != kStateVersion) {
+    LOG(WARNING) << "Not a decoder state of version " << kStateVersion;
+    return false;
+  }
+  bool ok = reader.Read(&chunk_size) && reader.Read(&start) &&
+            reader.Read(&num_frames_) && reader.Read(&global_frame_offset_) &&
+            reader.Read(&base_frame_offset_) &&
+            reader.Read(&num_prefix_chunks_) &&
+            reader.Read(&decoding_time_ms_) && reader.Read(&feature_dim_) &&
+            reader.ReadVector(&sentence_feats_) &&
+            feature_pipeline_->RestoreState(&reader);
+  if (ok) {
+    opts_.chunk_size = chunk_size;
+    model_->set_max_encoder_frames(opts_.max_encoder_frames);
+    model_->set_rescoring_blank_threshold(opts_.rescoring_blank_threshold);
+    model_->set_encoder_out_dtype(opts_.encoder_out_dtype);
+    // The searcher of the context graph set before, it's not attached at the
+    // start of the sentence again
+    AttachContextGraph();
+    ok = model_->RestoreState(&reader) && searcher_->RestoreState(&reader) &&
+         ctc_endpointer_->RestoreState(&reader) && reader.Read(&prefetched);
+  }
+  if (ok && prefetched) {
+    ok = reader.ReadMatrix(&prefetch_.feats) &&
+         reader.ReadMatrix(&prefetch_.ctc_log_probs) &&
+         prefetch_.sparse_ctc_log_probs.RestoreState(&reader) &&
+         reader.Read(&prefetch_.forward_us);
+    if (ok) {
+      std::promise<void> done;
+      done.set_value();
+      prefetch_.done = done.get_future();
+    }
+  }
+  if (!ok || reader.remaining() > 0) {
+    LOG(WARNING) << "Failed to restore the decoder state";
+    Reset();
+    return false;
+  }
+  start_ = start != 0;
+  UpdateResult();
+  return true;
 }
 
+void AsrDecoder::SetContextGraph(
+    std::shared_future<std::shared_ptr<ContextGraph>> context_graph) {
+  std::lock_guard<std::mutex> lock(context_mutex_);
+  pending_context_graph_ = std::move(context_graph);
+}
+
+void AsrDecoder::AttachContextGraph() {
+  std::lock_guard<std::mutex> lock(context_mutex_);
+  if (!pending_context_graph_.valid() ||
+      pending_context_graph_.wait_for(std::chrono::seconds(0)) !=
+          std::future_status::ready) {
+    return;
+  }
+  VLOG(1) << "Attach the context graph";
+  if (searcher_->Type() == kPrefixBeamSearch) {
+    // The context biasing is compiled in or out of the search
+    NewPrefixSearcher(pending_context_graph_.get());
+    UpdateBeamScale();
+  } else {
+    searcher_->set_context_graph(pending_context_graph_.get());
+  }
+  pending_context_graph_ = {};
+}
+
+void AsrDecoder::NewPrefixSearcher(
+    const std::shared_ptr<ContextGraph>& context_graph) {
+  // The times are only read for the timestamps of the units
+  searcher_ = NewCtcPrefixBeamSearch(opts_.ctc_prefix_search_opts,
+                                     context_graph, ngram_lm_,
+                                     unit_strings_ != nullptr);
+}
 
 DecodeState AsrDecoder::Decode(bool block) {
   return this->AdvanceDecoding(block);
@@ -68,91 +285,380 @@ DecodeState AsrDecoder::Decode(bool block) {
 
 
 void AsrDecoder::Rescoring() {
+  WENET_TRACE_SCOPE("rescoring");
   // Do attention rescoring
   Timer timer;
   AttentionRescoring();
-  VLOG(2) << "Rescoring cost latency: " << timer.Elapsed() << "ms.";
+  int64_t rescoring_us = timer.ElapsedUs();
+  last_rescoring_us_ = rescoring_us;
+  DecodeMetrics::Get()->rescoring_ms->Observe(rescoring_us / 1000.0);
+  int rescoring_time = rescoring_us / 1000;
+  decoding_time_ms_ += rescoring_time;
+  VLOG(2) << "Rescoring cost latency: " << rescoring_time << "ms.";
 }
 
 
 DecodeState AsrDecoder::AdvanceDecoding(bool block) {
   DecodeState state = DecodeState::kEndBatch;
+  last_forward_us_ = -1;
+  last_search_us_ = -1;
+  // The searcher is reset and has no context state before a sentence starts
+  if (!start_) {
+    AttachContextGraph();
+  }
+  // The encoder may be running ahead on this chunk, or the decoder may be
+  // rescoring speculatively, the model is not touched until it's done
+  WaitSpeculativeRescoring();
+  const bool prefetched = prefetch_.done.valid();
+  if (prefetched) {
+    prefetch_.done.get();
+  }
   model_->set_chunk_size(opts_.chunk_size);
   model_->set_num_left_chunks(opts_.num_left_chunks);
-  int num_requried_frames = model_->num_frames_for_chunk(start_);
-  std::vector<std::vector<float>> chunk_feats;
-  // Return immediately if we do not want to block
-  if (!block && !feature_pipeline_->input_finished() &&
-      feature_pipeline_->NumQueuedFrames() < num_requried_frames) {
-    return DecodeState::kWaitFeats;
+  model_->set_max_encoder_frames(opts_.max_encoder_frames);
+  model_->set_rescoring_blank_threshold(opts_.rescoring_blank_threshold);
+  model_->set_encoder_out_dtype(opts_.encoder_out_dtype);
+  int64_t forward_us = 0;
+  if (prefetched) {
+    std::swap(chunk_feats_, prefetch_.feats);
+    std::swap(ctc_log_probs_, prefetch_.ctc_log_probs);
+    std::swap(sparse_ctc_log_probs_, prefetch_.sparse_ctc_log_probs);
+    forward_us = prefetch_.forward_us;
+    num_frames_ += chunk_feats_.rows();
+  } else {
+    int num_requried_frames = model_->num_frames_for_chunk(start_);
+    // Return immediately if we do not want to block, the ready callback of
+    // the pipeline is called when the frames come
+    if (!block && !feature_pipeline_->PollFrames(num_requried_frames)) {
+      return DecodeState::kWaitFeats;
+    }
+    // If not okay, that means we reach the end of the input
+    if (!feature_pipeline_->Read(num_requried_frames, &chunk_feats_)) {
+      state = DecodeState::kEndFeats;
+    }
+
+    num_frames_ += chunk_feats_.rows();
+    VLOG(2) << "Required " << num_requried_frames << " get "
+            << chunk_feats_.rows();
+    // Skip the model on the leading silence of a sentence, the model has
+    // seen nothing of the sentence then, so its caches are not affected
+    if (feature_pipeline_->vad_enabled() && !start_ &&
+        state != DecodeState::kEndFeats &&
+        feature_pipeline_->num_speech_frames_read() == 0) {
+      return SkipSilence(chunk_feats_.rows());
+    }
+    Timer timer;
+    ForwardEncoder(chunk_feats_, &ctc_log_probs_, &sparse_ctc_log_probs_);
+    forward_us = timer.ElapsedUs();
   }
-  // If not okay, that means we reach the end of the input
-  if (!feature_pipeline_->Read(num_requried_frames, &chunk_feats)) {
-    state = DecodeState::kEndFeats;
+  if (cascade_model_ != nullptr) {
+    feature_dim_ = chunk_feats_.cols();
+    for (int i = 0; i < chunk_feats_.rows(); ++i) {
+      sentence_feats_.insert(sentence_feats_.end(), chunk_feats_.Row(i),
+                             chunk_feats_.Row(i) + feature_dim_);
+    }
+  }
+  if (state != DecodeState::kEndFeats) {
+    // By the N-best of the previous chunk, before the encoder of the next
+    // chunk may run ahead on the model
+    MaybeCacheRescoringPrefixes();
+  }
+  // Measured before the encoder of the next chunk may run ahead
+  const size_t model_bytes = model_->MemoryBytes();
+  if (state != DecodeState::kEndFeats) {
+    MaybePrefetch();
   }
-
-  num_frames_ += chunk_feats.size();
-  VLOG(2) << "Required " << num_requried_frames << " get "
-          << chunk_feats.size();
   Timer timer;
-  std::vector<std::vector<float>> ctc_log_probs;
-  model_->ForwardEncoder(chunk_feats, &ctc_log_probs);
-  int forward_time = timer.Elapsed();
-  timer.Reset();
-  searcher_->Search(ctc_log_probs);
-  int search_time = timer.Elapsed();
+  {
+    WENET_TRACE_SCOPE("search");
+    if (sparse_ctc_) {
+      searcher_->Search(sparse_ctc_log_probs_);
+    } else {
+      searcher_->Search(ctc_log_probs_);
+    }
+  }
+  int64_t search_us = timer.ElapsedUs();
+  last_forward_us_ = forward_us;
+  last_search_us_ = search_us;
+  DecodeMetrics* metrics = DecodeMetrics::Get();
+  metrics->encoder_forward_ms->Observe(forward_us / 1000.0);
+  metrics->search_ms->Observe(search_us / 1000.0);
+  int forward_time = forward_us / 1000;
+  int search_time = search_us / 1000;
+  decoding_time_ms_ += forward_time + search_time;
   VLOG(3) << "forward takes " << forward_time << " ms, search takes "
           << search_time << " ms";
+  AdaptBeams(forward_us + search_us, chunk_feats_.rows());
   UpdateResult();
+  over_budget_ = UpdateMemory(model_bytes);
 
   if (state != DecodeState::kEndFeats) {
-    if (ctc_endpointer_->IsEndpoint(ctc_log_probs, DecodedSomething())) {
+    bool endpoint = sparse_ctc_ ?
+        ctc_endpointer_->IsEndpoint(sparse_ctc_log_probs_,
+                                    DecodedSomething()) :
+        ctc_endpointer_->IsEndpoint(ctc_log_probs_, DecodedSomething());
+    if (endpoint) {
       VLOG(1) << "Endpoint is detected at " << num_frames_;
       state = DecodeState::kEndpoint;
+    } else if (over_budget_ && !prefetch_.done.valid()) {
+      // The chunk ahead, if any, is of this sentence, it's ended after it
+      LOG(WARNING) << "End the sentence at " << num_frames_ << ", "
+                   << memory_.total() << " bytes is over the memory budget";
+      state = DecodeState::kEndpoint;
     }
   }
+  if (state == DecodeState::kEndBatch) {
+    MaybeRescoreSpeculatively();
+  }
 
   start_ = true;
   return state;
 }
 
 
+void AsrDecoder::ForwardEncoder(const FeatureMatrix& chunk_feats,
+                                LogProbMatrix* ctc_log_probs,
+                                SparseLogProbMatrix* sparse_ctc_log_probs) {
+  WENET_TRACE_SCOPE("encoder");
+  if (sparse_ctc_) {
+    model_->ForwardEncoder(chunk_feats, sparse_ctc_log_probs);
+  } else if (encoder_scheduler_ != nullptr) {
+    encoder_scheduler_->ForwardEncoder(model_.get(), chunk_feats,
+                                       ctc_log_probs);
+  } else {
+    model_->ForwardEncoder(chunk_feats, ctc_log_probs);
+  }
+}
+
+const LogProbMatrix& AsrDecoder::last_ctc_log_probs() {
+  if (sparse_ctc_) sparse_ctc_log_probs_.ToDense(&ctc_log_probs_);
+  return ctc_log_probs_;
+}
+
+void AsrDecoder::MaybePrefetch() {
+  if (pipeline_pool_ == nullptr) return;
+  int num_required_frames = model_->num_frames_for_chunk(true);
+  if (feature_pipeline_->NumQueuedFrames() < num_required_frames ||
+      over_budget_ ||
+      (sparse_ctc_ ? ctc_endpointer_->MayBeEndpoint(sparse_ctc_log_probs_) :
+                     ctc_endpointer_->MayBeEndpoint(ctc_log_probs_))) {
+    return;
+  }
+  CHECK(feature_pipeline_->Read(num_required_frames, &prefetch_.feats));
+  prefetch_.done = pipeline_pool_->Submit(
+      [this]() {
+        Timer timer;
+        ForwardEncoder(prefetch_.feats, &prefetch_.ctc_log_probs,
+                       &prefetch_.sparse_ctc_log_probs);
+        prefetch_.forward_us = timer.ElapsedUs();
+      },
+      TaskPriority::kHigh);
+}
+
+void AsrDecoder::MaybeRescoreSpeculatively() {
+  if (opts_.speculative_rescoring_silence_ms <= 0 ||
+      opts_.rescoring_weight == 0.0) {
+    return;
+  }
+  if (ctc_endpointer_->trailing_silence_ms() <
+      opts_.speculative_rescoring_silence_ms) {
+    // The speech resumed, the N-best rescored is stale
+    if (speculative_ != nullptr) DropSpeculativeRescoring();
+    return;
+  }
+  const std::vector<std::vector<int>>& hypotheses = searcher_->Inputs();
+  // The model is busy with the chunk ahead, if any
+  if (!DecodedSomething() || hypotheses.empty() || prefetch_.done.valid() ||
+      (speculative_ != nullptr && speculative_->hypotheses == hypotheses)) {
+    return;
+  }
+  DropSpeculativeRescoring();
+  auto speculative = std::make_shared<SpeculativeRescoring>();
+  speculative->hypotheses = hypotheses;
+  speculative_ = speculative;
+  DecodeMetrics::Get()->speculative_rescorings->Add(1);
+  auto rescore = [this, speculative]() {
+    WENET_TRACE_SCOPE("speculative_rescoring");
+    std::vector<float> scores;
+    ComputeRescoringScores(model_.get(), rescoring_scheduler_.get(),
+                           speculative->hypotheses, &scores);
+    speculative->scores = std::move(scores);
+  };
+  if (pipeline_pool_ != nullptr) {
+    speculative_done_ = pipeline_pool_->Submit(rescore, TaskPriority::kNormal);
+  } else {
+    Timer timer;
+    rescore();
+    decoding_time_ms_ += timer.Elapsed();
+  }
+  VLOG(2) << "Rescore the N-best speculatively after "
+          << ctc_endpointer_->trailing_silence_ms() << "ms trailing silence";
+}
+
+void AsrDecoder::WaitSpeculativeRescoring() {
+  if (!speculative_done_.valid()) return;
+  speculative_done_.get();
+}
+
+void AsrDecoder::DropSpeculativeRescoring() {
+  if (speculative_done_.valid()) {
+    // Its exception, if any, is of the dropped N-best
+    speculative_done_.wait();
+    speculative_done_ = std::future<void>();
+  }
+  speculative_ = nullptr;
+}
+
+void AsrDecoder::DropPrefetch() {
+  if (!prefetch_.done.valid()) return;
+  // Its exception, if any, is of the dropped chunk
+  prefetch_.done.wait();
+  prefetch_.done = std::future<void>();
+  VLOG(2) << "Drop the chunk forwarded ahead";
+}
+
+bool AsrDecoder::UpdateMemory(size_t model_bytes) {
+  DecoderMemory memory;
+  memory.model = model_bytes;
+  memory.search = searcher_->MemoryBytes();
+  // The ctc log probs of the chunk ahead may be being written, its feats
+  // are only read
+  memory.features = feature_pipeline_->MemoryBytes() +
+                    chunk_feats_.AllocatedBytes() +
+                    ctc_log_probs_.AllocatedBytes() +
+                    sparse_ctc_log_probs_.AllocatedBytes() +
+                    prefetch_.feats.AllocatedBytes() +
+                    VectorBytes(sentence_feats_);
+  ReportMemory(memory);
+  if (opts_.max_session_memory_mb <= 0) return false;
+  const size_t budget = static_cast<size_t>(opts_.max_session_memory_mb)
+                        << 20;
+  if (memory.total() <= budget) return false;
+  if (!memory_degraded_) {
+    LOG(WARNING) << memory.total() << " bytes is over the memory budget, "
+                 << "halve the beams, model " << memory.model << " search "
+                 << memory.search << " features " << memory.features;
+    set_memory_degraded(true);
+    return false;
+  }
+  return memory.total() > sentence_start_bytes_;
+}
+
+void AsrDecoder::ReportMemory(const DecoderMemory& memory) {
+  DecodeMetrics* metrics = DecodeMetrics::Get();
+  metrics->model_state_bytes->Add(static_cast<int64_t>(memory.model) -
+                                  static_cast<int64_t>(memory_.model));
+  metrics->search_state_bytes->Add(static_cast<int64_t>(memory.search) -
+                                   static_cast<int64_t>(memory_.search));
+  metrics->feature_bytes->Add(static_cast<int64_t>(memory.features) -
+                              static_cast<int64_t>(memory_.features));
+  memory_ = memory;
+}
+
+void AsrDecoder::set_memory_degraded(bool degraded) {
+  if (degraded == memory_degraded_) return;
+  memory_degraded_ = degraded;
+  UpdateBeamScale();
+  DecodeMetrics::Get()->memory_degraded_sessions->Add(degraded ? 1 : -1);
+}
+
+void AsrDecoder::AdaptBeams(int64_t decode_us, int num_frames) {
+  if (beam_policy_ == nullptr || num_frames <= 0) return;
+  int frame_shift_ms = feature_frame_shift_in_ms();
+  float chunk_rtf = decode_us / 1000.0 / (num_frames * frame_shift_ms);
+  float session_rtf = num_frames_ > 0 ?
+      static_cast<float>(decoding_time_ms_) / (num_frames_ * frame_shift_ms) :
+      chunk_rtf;
+  float scale = beam_policy_->BeamScale(chunk_rtf, session_rtf);
+  if (scale != load_beam_scale_) {
+    VLOG(2) << "Decode with beam scale " << scale;
+    load_beam_scale_ = scale;
+    UpdateBeamScale();
+  }
+}
+
+void AsrDecoder::UpdateBeamScale() {
+  searcher_->set_beam_scale((memory_degraded_ ? 0.5 : 1.0) * load_beam_scale_);
+}
+
+DecodeState AsrDecoder::SkipSilence(int num_frames) {
+  VLOG(2) << "Skip " << num_frames << " frames of silence";
+  // The timestamps of the sentence start after the skipped frames
+  global_frame_offset_ += num_frames;
+  ctc_endpointer_->AddSilence(num_frames / model_->subsampling_rate());
+  if (ctc_endpointer_->IsEndpoint(LogProbMatrix(), DecodedSomething())) {
+    VLOG(1) << "Endpoint is detected at " << num_frames_;
+    return DecodeState::kEndpoint;
+  }
+  return DecodeState::kEndBatch;
+}
+
+bool AsrDecoder::UpdateText(const std::vector<int>& hypothesis,
+                            ResultText* text) const {
+  size_t common = 0;
+  while (common < hypothesis.size() && common < text->tokens.size() &&
+         hypothesis[common] == text->tokens[common]) {
+    ++common;
+  }
+  if (common == hypothesis.size() && common == text->tokens.size()) {
+    return false;
+  }
+  text->tokens.resize(common);
+  text->token_ends.resize(common);
+  text->raw.resize(common > 0 ? text->token_ends.back() : 0);
+  // A detailed explanation of the space between the words can be found in
+  // https://github.com/wenet-e2e/wenet/issues/583#issuecomment-907994058
+  const bool space = searcher_->Type() == kWfstBeamSearch;
+  for (size_t i = common; i < hypothesis.size(); ++i) {
+    if (space) text->raw += ' ';
+    symbol_strings_->Append(hypothesis[i], &text->raw);
+    text->tokens.push_back(hypothesis[i]);
+    text->token_ends.push_back(text->raw.size());
+  }
+  return true;
+}
+
 void AsrDecoder::UpdateResult(bool finish) {
   const auto& hypotheses = searcher_->Outputs();
   const auto& inputs = searcher_->Inputs();
   const auto& likelihood = searcher_->Likelihood();
   const auto& times = searcher_->Times();
-  result_.clear();
+  const auto& confidences = searcher_->Confidences();
 
   CHECK_EQ(hypotheses.size(), likelihood.size());
-  for (size_t i = 0; i < hypotheses.size(); i++) {
+  // Most of a hypothesis is the same as the one of its rank in the last
+  // chunk, so the texts are updated from their common prefix, and the post
+  // processing is skipped if nothing changed. The results of the last chunk
+  // are overwritten in place, so are the buffers of their strings.
+  const size_t num_results =
+      finish ? hypotheses.size()
+             : std::min<size_t>(hypotheses.size(), partial_nbest_);
+  result_.resize(num_results);
+  if (result_texts_.size() < num_results) {
+    result_texts_.resize(num_results);
+  }
+  for (size_t i = 0; i < num_results; i++) {
     const std::vector<int>& hypothesis = hypotheses[i];
 
-    DecodeResult path;
+    DecodeResult& path = result_[i];
     path.score = likelihood[i];
-    int offset = global_frame_offset_ * feature_frame_shift_in_ms();
-    for (size_t j = 0; j < hypothesis.size(); j++) {
-      std::string word = symbol_table_->Find(hypothesis[j]);
-      // A detailed explanation of this if-else branch can be found in
-      // https://github.com/wenet-e2e/wenet/issues/583#issuecomment-907994058
-      if (searcher_->Type() == kWfstBeamSearch) {
-        path.sentence += (' ' + word);
-      } else {
-        path.sentence += (word);
-      }
-    }
+    path.word_pieces.clear();
+    int offset = (base_frame_offset_ + global_frame_offset_) *
+                 feature_frame_shift_in_ms();
+    ResultText& text = result_texts_[i];
+    bool changed = UpdateText(hypothesis, &text);
 
     // TimeStamp is only supported in final result
     // TimeStamp of the output of CtcWfstBeamSearch may be inaccurate due to
     // various FST operations when building the decoding graph. So here we use
     // time stamp of the input(e2e model unit), which is more accurate, and it
     // requires the symbol table of the e2e model used in training.
-    if (unit_table_ != nullptr && finish) {
+    if (unit_strings_ != nullptr && finish) {
       const std::vector<int>& input = inputs[i];
       const std::vector<int>& time_stamp = times[i];
       CHECK_EQ(input.size(), time_stamp.size());
       for (size_t j = 0; j < input.size(); j++) {
-        std::string word = unit_table_->Find(input[j]);
+        std::string word = unit_strings_->Find(input[j]);
         int start = time_stamp[j] * frame_shift_in_ms() - time_stamp_gap_ > 0 ?
             time_stamp[j] * frame_shift_in_ms() - time_stamp_gap_ : 0;
         if (j > 0) {
@@ -169,46 +675,237 @@ void AsrDecoder::UpdateResult(bool finish) {
                               : end;
         }
         WordPiece word_piece(word, offset + start, offset + end);
+        if (i < confidences.size() && confidences[i].size() == input.size()) {
+          word_piece.confidence = confidences[i][j];
+        }
         path.word_pieces.emplace_back(word_piece);
       }
     }
 
-    if (post_processor_ != nullptr) {
-      path.sentence = post_processor_->Process(path.sentence, finish);
+    if (post_processor_ == nullptr) {
+      path.sentence = text.raw;
+      continue;
     }
-    result_.emplace_back(path);
+    if (changed || !text.processed || text.finish != finish) {
+      text.sentence = post_processor_->Process(text.raw, finish);
+      text.processed = true;
+      text.finish = finish;
+    }
+    path.sentence = text.sentence;
   }
 
   if (DecodedSomething()) {
     VLOG(1) << "Partial CTC result " << result_[0].sentence;
   }
+  PublishResult();
 }
 
-void AsrDecoder::AttentionRescoring() {
+void AsrDecoder::PublishResult() {
+  std::shared_ptr<const std::vector<DecodeResult>> snapshot =
+      std::make_shared<std::vector<DecodeResult>>(result_);
+  std::atomic_store(&result_snapshot_, snapshot);
+}
+
+void AsrDecoder::FinalizeFirstPass() {
+  DropPrefetch();
+  WENET_TRACE_SCOPE("finalize_search");
   searcher_->FinalizeSearch();
   UpdateResult(true);
+}
+
+std::shared_ptr<PendingRescoring> AsrDecoder::DetachRescoring() {
+  WaitSpeculativeRescoring();
+  auto pending = std::make_shared<PendingRescoring>();
+  pending->model = model_;
+  pending->hypotheses = searcher_->Inputs();
+  pending->result = result_;
+  pending->lattice = searcher_->Lattice();
+  pending->feats = std::move(sentence_feats_);
+  sentence_feats_.clear();
+  pending->speculative = std::move(speculative_);
+  speculative_ = nullptr;
+  // A fresh model for the next sentence, the detached one keeps the encoder
+  // outputs of this sentence for rescoring
+  model_ = model_pool_ != nullptr ? model_pool_->Acquire() : model_->Copy();
+  return pending;
+}
+
+void AsrDecoder::Rescoring(PendingRescoring* pending) const {
+  WENET_TRACE_SCOPE("rescoring");
+  Timer timer;
+  RescoreHypotheses(pending->model.get(), pending->hypotheses, pending->feats,
+                    pending->speculative.get(), &pending->result);
+  int64_t rescoring_us = timer.ElapsedUs();
+  DecodeMetrics::Get()->rescoring_ms->Observe(rescoring_us / 1000.0);
+  VLOG(2) << "Rescoring cost latency: " << rescoring_us / 1000 << "ms.";
+}
+
+void AsrDecoder::AttentionRescoring() {
+  WaitSpeculativeRescoring();
+  FinalizeFirstPass();
+  // Inputs() returns N-best input ids, which is the basic unit for rescoring
+  // In CtcPrefixBeamSearch, inputs are the same to outputs
+  RescoreHypotheses(model_.get(), searcher_->Inputs(), sentence_feats_,
+                    speculative_.get(), &result_);
+  PublishResult();
+}
+
+void AsrDecoder::MaybeCacheRescoringPrefixes() {
+  if (opts_.prefix_rescoring_interval <= 0 || opts_.rescoring_weight == 0.0 ||
+      opts_.reverse_weight > 0.0) {
+    return;
+  }
+  if (++num_prefix_chunks_ < opts_.prefix_rescoring_interval) return;
+  num_prefix_chunks_ = 0;
+  WENET_TRACE_SCOPE("prefix_rescoring");
+  std::vector<std::vector<int>> prefixes;
+  for (const auto& hypothesis : searcher_->Inputs()) {
+    int length = static_cast<int>(hypothesis.size()) -
+                 opts_.prefix_rescoring_margin;
+    if (length > 0) {
+      prefixes.emplace_back(hypothesis.begin(), hypothesis.begin() + length);
+    }
+  }
+  if (prefixes.empty()) return;
+  Timer timer;
+  if (model_->CacheRescoringPrefixes(prefixes)) {
+    decoding_time_ms_ += timer.Elapsed();
+    VLOG(2) << "Cached " << prefixes.size() << " rescoring prefixes in "
+            << timer.Elapsed() << "ms.";
+  }
+}
+
+// The log likelihood margin of the top hypothesis of the N-best over the
+// second one, and its posterior among the N-best
+static void NbestConfidence(const std::vector<DecodeResult>& result,
+                            float* margin, float* posterior) {
+  // The N-best may not be sorted
+  float best = -std::numeric_limits<float>::infinity();
+  float second = best;
+  for (const DecodeResult& path : result) {
+    if (path.score > best) {
+      second = best;
+      best = path.score;
+    } else if (path.score > second) {
+      second = path.score;
+    }
+  }
+  double sum = 0.0;
+  for (const DecodeResult& path : result) {
+    sum += std::exp(path.score - best);
+  }
+  *margin = best - second;
+  *posterior = 1.0 / sum;
+}
+
+bool AsrDecoder::SkipRescoring(float margin, float posterior) const {
+  return (opts_.rescoring_skip_margin > 0.0 &&
+          margin >= opts_.rescoring_skip_margin) ||
+         (opts_.rescoring_skip_posterior > 0.0 &&
+          posterior >= opts_.rescoring_skip_posterior);
+}
+
+std::shared_ptr<AsrModel> AsrDecoder::ForwardCascade(
+    const std::vector<float>& feats) const {
+  WENET_TRACE_SCOPE("cascade_encoder");
+  std::shared_ptr<AsrModel> model = cascade_model_->Copy();
+  // The whole sentence at once
+  model->set_chunk_size(-1);
+  model->set_num_left_chunks(-1);
+  model->set_encoder_out_dtype(opts_.encoder_out_dtype);
+  const int num_frames = feats.size() / feature_dim_;
+  FeatureMatrix matrix(num_frames, feature_dim_);
+  for (int i = 0; i < num_frames; ++i) {
+    memcpy(matrix.Row(i), feats.data() + static_cast<size_t>(i) * feature_dim_,
+           sizeof(float) * feature_dim_);
+  }
+  LogProbMatrix ctc_log_probs;
+  model->ForwardEncoder(matrix, &ctc_log_probs);
+  return model;
+}
+
+// The scores of the hypotheses of the speculative rescoring, return false
+// if it's not done or any of them is not among its ones
+static bool SpeculativeScores(const SpeculativeRescoring& speculative,
+                              const std::vector<std::vector<int>>& hypotheses,
+                              std::vector<float>* scores) {
+  if (speculative.scores.size() != speculative.hypotheses.size()) {
+    return false;
+  }
+  scores->clear();
+  for (const auto& hypothesis : hypotheses) {
+    auto it = std::find(speculative.hypotheses.begin(),
+                        speculative.hypotheses.end(), hypothesis);
+    if (it == speculative.hypotheses.end()) return false;
+    scores->push_back(
+        speculative.scores[it - speculative.hypotheses.begin()]);
+  }
+  return true;
+}
+
+void AsrDecoder::ComputeRescoringScores(
+    AsrModel* model, BatchRescoringScheduler* scheduler,
+    const std::vector<std::vector<int>>& hypotheses,
+    std::vector<float>* rescoring_score) const {
+  if (scheduler != nullptr) {
+    scheduler->AttentionRescoring(model, hypotheses, opts_.reverse_weight,
+                                  rescoring_score).get();
+  } else {
+    model->AttentionRescoring(hypotheses, opts_.reverse_weight,
+                              rescoring_score);
+  }
+}
+
+void AsrDecoder::RescoreHypotheses(
+    AsrModel* model, const std::vector<std::vector<int>>& hypotheses,
+    const std::vector<float>& feats, const SpeculativeRescoring* speculative,
+    std::vector<DecodeResult>* result) const {
   // No need to do rescoring
   if (0.0 == opts_.rescoring_weight) {
     return;
   }
-  // Inputs() returns N-best input ids, which is the basic unit for rescoring
-  // In CtcPrefixBeamSearch, inputs are the same to outputs
-  const auto& hypotheses = searcher_->Inputs();
   int num_hyps = hypotheses.size();
   if (num_hyps <= 0) {
     return;
   }
+  DecodeMetrics* metrics = DecodeMetrics::Get();
+  metrics->rescoring_sentences->Add(1);
+  float margin = 0.0f;
+  float posterior = 0.0f;
+  NbestConfidence(*result, &margin, &posterior);
+  std::shared_ptr<AsrModel> cascade_model;
+  BatchRescoringScheduler* scheduler = rescoring_scheduler_.get();
+  if (cascade_model_ != nullptr && !feats.empty() &&
+      posterior < opts_.cascade_posterior) {
+    VLOG(2) << "Rescore the N-best of posterior " << posterior
+            << " by the cascade model";
+    metrics->cascade_sentences->Add(1);
+    cascade_model = ForwardCascade(feats);
+    model = cascade_model.get();
+    scheduler = cascade_rescoring_scheduler_.get();
+  } else if (SkipRescoring(margin, posterior)) {
+    metrics->rescoring_skipped->Add(1);
+    VLOG(2) << "Skip the rescoring of a confident N-best";
+    return;
+  }
 
   std::vector<float> rescoring_score;
-  model_->AttentionRescoring(hypotheses, opts_.reverse_weight,
-                             &rescoring_score);
+  // The encoder outputs of the silence after the speculative rescoring
+  // hardly change the scores
+  if (cascade_model == nullptr && speculative != nullptr &&
+      SpeculativeScores(*speculative, hypotheses, &rescoring_score)) {
+    metrics->speculative_rescoring_hits->Add(1);
+    VLOG(2) << "Reuse the speculative rescoring of the N-best";
+  } else {
+    ComputeRescoringScores(model, scheduler, hypotheses, &rescoring_score);
+  }
 
   // Combine ctc score and rescoring score
   for (size_t i = 0; i < num_hyps; ++i) {
-    result_[i].score = opts_.rescoring_weight * rescoring_score[i] +
-                       opts_.ctc_weight * result_[i].score;
+    (*result)[i].score = opts_.rescoring_weight * rescoring_score[i] +
+                         opts_.ctc_weight * (*result)[i].score;
   }
-  std::sort(result_.begin(), result_.end(), DecodeResult::CompareFunc);
+  std::sort(result->begin(), result->end(), DecodeResult::CompareFunc);
 }
 
 }  // namespace wenet
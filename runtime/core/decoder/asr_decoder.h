@@ -5,7 +5,10 @@
 #ifndef DECODER_ASR_DECODER_H_
 #define DECODER_ASR_DECODER_H_
 
+#include <algorithm>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
@@ -13,14 +16,26 @@
 #include "fst/fstlib.h"
 #include "fst/symbol-table.h"
 
+#include "decoder/adaptive_beam_policy.h"
+#include "decoder/adaptive_chunk_policy.h"
+#include "decoder/admission_controller.h"
 #include "decoder/asr_model.h"
+#include "decoder/asr_model_pool.h"
+#include "decoder/batch_encoder_scheduler.h"
+#include "decoder/batch_rescoring_scheduler.h"
 #include "decoder/context_graph.h"
+#include "decoder/context_graph_cache.h"
 #include "decoder/ctc_endpoint.h"
+#include "decoder/ctc_keyword_spotting.h"
 #include "decoder/ctc_prefix_beam_search.h"
 #include "decoder/ctc_wfst_beam_search.h"
 #include "decoder/search_interface.h"
 #include "frontend/feature_pipeline.h"
 #include "post_processor/post_processor.h"
+#include "utils/ngram_lm.h"
+#include "utils/string.h"
+#include "utils/thread_placement.h"
+#include "utils/thread_pool.h"
 #include "utils/utils.h"
 
 namespace wenet {
@@ -31,6 +46,22 @@ struct DecodeOptions {
   // one chunk are 64 = 16*4
   int chunk_size = 16;
   int num_left_chunks = -1;
+  // Max encoder outputs (after subsampling) kept for the rescoring of a
+  // sentence, the rescoring attends to the last ones of a longer sentence.
+  // 0 means no limit.
+  int max_encoder_frames = 0;
+  // Keep only the encoder outputs whose ctc blank posterior is below it for
+  // the rescoring, see AsrModel::set_rescoring_blank_threshold(). 1 means
+  // all of them.
+  float rescoring_blank_threshold = 1.0f;
+  // The dtype of the encoder outputs kept for the rescoring, float16 or int8
+  // of a scale per frame take 1/2 or about 1/4 of the memory of float32.
+  // Only the ONNX models support it.
+  FrameDtype encoder_out_dtype = FrameDtype::kFloat32;
+  // Budget of the memory of the session, see AsrDecoder::memory(). Over it,
+  // the beams are halved, and if the sentence still grows over it, it's
+  // ended at the next chunk. 0 means no limit.
+  int max_session_memory_mb = 0;
 
   // final_score = rescoring_weight * rescoring_score + ctc_weight * ctc_score;
   // rescoring_score = left_to_right_score * (1 - reverse_weight) +
@@ -43,15 +74,52 @@ struct DecodeOptions {
   float ctc_weight = 0.5;
   float rescoring_weight = 1.0;
   float reverse_weight = 0.0;
+  // Every prefix_rescoring_interval chunks, the N-best without their last
+  // prefix_rescoring_margin tokens are forwarded by the decoder and cached,
+  // see AsrModel::CacheRescoringPrefixes(), so the rescoring at the end of
+  // a long sentence only forwards the tokens after them. 0 means the whole
+  // N-best is rescored at the end. Not used with reverse_weight > 0.
+  int prefix_rescoring_interval = 0;
+  int prefix_rescoring_margin = 2;
+  // Skip the rescoring of a sentence whose CTC N-best has a dominant top
+  // hypothesis: when the log likelihood of the top one is over the second
+  // one by rescoring_skip_margin, or its posterior among the N-best, the
+  // softmax of their log likelihoods, reaches rescoring_skip_posterior. The
+  // scores of a skipped sentence are the CTC ones. 0 disables either.
+  float rescoring_skip_margin = 0.0;
+  float rescoring_skip_posterior = 0.0;
+  // With DecodeResource::cascade_model, the sentences whose top hypothesis
+  // has a posterior among the N-best below cascade_posterior are rescored by
+  // the cascade model instead, the model of the session only makes the
+  // partial results and the N-best. The cascade model forwards its encoder
+  // over the whole features of the sentence, and is combined with the CTC
+  // scores of the session model by ctc_weight and rescoring_weight.
+  float cascade_posterior = 0.9;
+  // Once the trailing silence of a sentence reaches it, the N-best is
+  // rescored ahead of the endpoint, on DecodeResource::pipeline_pool if it's
+  // set, while the decoder waits for more audio. The rescoring at the
+  // endpoint reuses the scores if its N-best is among the ones rescored,
+  // otherwise, e.g. the speech resumed, they're dropped. It should be below
+  // the min_trailing_silence of the endpoint rules. 0 disables it.
+  int speculative_rescoring_silence_ms = 0;
   CtcEndpointConfig ctc_endpoint_config;
   CtcPrefixBeamSearchOptions ctc_prefix_search_opts;
   CtcWfstBeamSearchOptions ctc_wfst_search_opts;
+  CtcKeywordSpottingOptions ctc_keyword_opts;
 };
 
+// The degraded profile of the streams admitted over the load budget, see
+// AdmissionController, 1-best search with smaller beams and no attention
+// rescoring
+void DegradeDecodeOptions(DecodeOptions* opts);
+
 struct WordPiece {
   std::string word;
   int start = -1;
   int end = -1;
+  // The max, mean and min CTC posteriors of the token on the best path, all
+  // 0 if the search doesn't track them, see SearchInterface::Confidences()
+  TokenConfidence confidence;
 
   WordPiece(std::string word, int start, int end)
       : word(std::move(word)), start(start), end(end) {}
@@ -67,6 +135,18 @@ struct DecodeResult {
   }
 };
 
+// Bytes held by the states of a decoder
+struct DecoderMemory {
+  // The caches and the encoder outputs of the model copy
+  size_t model = 0;
+  // The prefixes or the tokens of the searcher
+  size_t search = 0;
+  // The feature queue of the pipeline and the chunks being decoded
+  size_t features = 0;
+
+  size_t total() const { return model + search + features; }
+};
+
 enum DecodeState {
   kEndBatch = 0x00,  // End of current decoding batch, normal case
   kEndpoint = 0x01,  // Endpoint is detected
@@ -74,15 +154,94 @@ enum DecodeState {
   kWaitFeats = 0x03  // Feat is not enough for one chunk inference, wait
 };
 
+// The attention rescoring scores of the N-best of a sentence, computed in
+// its trailing silence ahead of its endpoint, see
+// DecodeOptions::speculative_rescoring_silence_ms
+struct SpeculativeRescoring {
+  std::vector<std::vector<int>> hypotheses;
+  // Of the hypotheses, empty until the rescoring is done
+  std::vector<float> scores;
+};
+
+// The first pass result of a finished sentence and the model states which
+// the attention rescoring needs, so the rescoring could be done later while
+// the decoder goes on with the next sentence.
+struct PendingRescoring {
+  std::shared_ptr<AsrModel> model = nullptr;
+  std::vector<std::vector<int>> hypotheses;
+  std::vector<DecodeResult> result;
+  // The word lattice of the first pass, see AsrDecoder::lattice()
+  std::string lattice;
+  // The features of the sentence for the cascade model, (T, dim) row major,
+  // empty without one
+  std::vector<float> feats;
+  // The speculative rescoring of the sentence, nullptr if none
+  std::shared_ptr<const SpeculativeRescoring> speculative = nullptr;
+};
+
+class DeviceReplicas;
+class ResultCache;
+
 // DecodeResource is thread safe, which can be shared for multiple
 // decoding threads
 struct DecodeResource {
   std::shared_ptr<AsrModel> model = nullptr;
+  // Optional, reusable copies of model for the decoders
+  std::shared_ptr<AsrModelPool> model_pool = nullptr;
   std::shared_ptr<fst::SymbolTable> symbol_table = nullptr;
   std::shared_ptr<fst::Fst<fst::StdArc>> fst = nullptr;
   std::shared_ptr<fst::SymbolTable> unit_table = nullptr;
+  // Optional, the strings of symbol_table and unit_table for the results,
+  // the decoders build their own ones if they're nullptr. The tables are
+  // nullptr if the strings are mapped from the binary tables.
+  std::shared_ptr<SymbolStrings> symbol_strings = nullptr;
+  std::shared_ptr<SymbolStrings> unit_strings = nullptr;
   std::shared_ptr<ContextGraph> context_graph = nullptr;
+  // Optional, the context graphs of the per-session phrase lists
+  std::shared_ptr<ContextGraphCache> context_graph_cache = nullptr;
+  // Optional, the n-gram LM of the shallow fusion in CtcPrefixBeamSearch
+  std::shared_ptr<NgramLm> ngram_lm = nullptr;
+  // Optional, the n-gram LMs of the words which rescore the lattices of
+  // CtcWfstBeamSearch, see RescoreLattice()
+  std::shared_ptr<NgramLm> rescore_lm = nullptr;
+  std::shared_ptr<NgramLm> rescore_old_lm = nullptr;
+  // Optional, spot the keywords instead of the recognition, the results
+  // are the keywords detected, see CtcKeywordSpotting
+  std::shared_ptr<KeywordSet> keywords = nullptr;
   std::shared_ptr<PostProcessor> post_processor = nullptr;
+  // Optional, batch the encoder forward of all the decoders which share
+  // this resource
+  std::shared_ptr<BatchEncoderScheduler> encoder_scheduler = nullptr;
+  // Optional, batch the attention rescoring of all the decoders which share
+  // this resource
+  std::shared_ptr<BatchRescoringScheduler> rescoring_scheduler = nullptr;
+  // Optional, a larger model of the same units which rescores the N-best of
+  // the sentences model is not confident of, see
+  // DecodeOptions::cascade_posterior
+  std::shared_ptr<AsrModel> cascade_model = nullptr;
+  // Optional, batch the rescoring of cascade_model, which can't be batched
+  // with the one of model
+  std::shared_ptr<BatchRescoringScheduler> cascade_rescoring_scheduler =
+      nullptr;
+  // Optional, pick the chunk size of each sentence by the load of
+  // encoder_scheduler, which is required then
+  std::shared_ptr<AdaptiveChunkPolicy> chunk_policy = nullptr;
+  // Optional, scale the beams of each chunk by the load of the host
+  std::shared_ptr<AdaptiveBeamPolicy> beam_policy = nullptr;
+  // Optional, the servers pin each session to a NUMA node by it
+  std::shared_ptr<ThreadPlacement> thread_placement = nullptr;
+  // Optional, the decoders forward the encoder of their next chunk on it
+  // while they search the current one, see AsrDecoder::MaybePrefetch()
+  std::shared_ptr<ThreadPool> pipeline_pool = nullptr;
+  // Optional, the servers admit, degrade or reject the new streams by it
+  std::shared_ptr<AdmissionController> admission_controller = nullptr;
+  // Optional, the final results of the offline requests of the recent
+  // audios, see BatchTranscriber
+  std::shared_ptr<ResultCache> result_cache = nullptr;
+  // Optional, the replicas of the model on several devices, each decoder
+  // is pinned to one of them, whose model, model pool and batch schedulers
+  // it uses instead of the ones above
+  std::shared_ptr<DeviceReplicas> replicas = nullptr;
 };
 
 // Torch ASR decoder
@@ -91,12 +250,43 @@ class AsrDecoder {
   AsrDecoder(std::shared_ptr<FeaturePipeline> feature_pipeline,
              std::shared_ptr<DecodeResource> resource,
              const DecodeOptions& opts);
+  // Wait for the encoder of the chunk ahead
+  ~AsrDecoder();
   // @param block: if true, block when feature is not enough for one chunk
   //               inference. Otherwise, return kWaitFeats.
   DecodeState Decode(bool block = true);
   void Rescoring();
+  // Asynchronous two-pass decoding: FinalizeFirstPass() finalizes the search,
+  // then result() is the final CTC result. DetachRescoring() moves the states
+  // for rescoring out of the decoder, so the decoder could be reset for the
+  // next sentence at once, and Rescoring(pending) could run in another thread.
+  void FinalizeFirstPass();
+  std::shared_ptr<PendingRescoring> DetachRescoring();
+  void Rescoring(PendingRescoring* pending) const;
   void Reset();
   void ResetContinuousDecoding();
+  // The timestamps of the results start at num_frames feature frames, e.g.
+  // for a segment of a longer audio. Reset() clears it.
+  void set_base_frame_offset(int num_frames) {
+    base_frame_offset_ = num_frames;
+  }
+  // Checkpoint the stream so far, e.g. to move a live stream to another
+  // node: the states of the model, the hypotheses of the searcher, the
+  // endpoint counters, the pipeline with its residual samples and queued
+  // frames, and the chunk forwarded ahead. RestoreState() continues it on a
+  // decoder of the same resource, options and context graph, whose
+  // pipeline gets no audio before. Call them between the Decode() calls.
+  // Return false if the searcher or the model doesn't support it, e.g. the
+  // WFST search or the keyword spotting, or if state is broken, then the
+  // decoder is reset.
+  bool SaveState(std::string* state) const;
+  bool RestoreState(const std::string& state);
+  // Bias to the context graph which may still be being built, e.g. by
+  // ContextGraphCache. It's attached at the start of the next sentence
+  // once it's ready, and replaces the current one, so it could be called
+  // mid-stream from another thread.
+  void SetContextGraph(
+      std::shared_future<std::shared_ptr<ContextGraph>> context_graph);
   bool DecodedSomething() const {
     return !result_.empty() && !result_[0].sentence.empty();
   }
@@ -114,36 +304,222 @@ class AsrDecoder {
     return feature_pipeline_->config().frame_shift * 1000 /
            feature_pipeline_->config().sample_rate;
   }
+  // Only valid on the thread which decodes, see result_snapshot()
   const std::vector<DecodeResult>& result() const { return result_; }
+  // An immutable copy of result(), published when it changes, so it could
+  // be read from any thread while another one decodes. Publishing and
+  // reading are atomic swaps of the pointer, neither side waits for the
+  // other, and a snapshot stays valid as long as it's held.
+  std::shared_ptr<const std::vector<DecodeResult>> result_snapshot() const {
+    return std::atomic_load(&result_snapshot_);
+  }
+  // The partial results have only the top n of the N-best, 1 by default,
+  // the final ones have all of them
+  void set_partial_nbest(int n) { partial_nbest_ = std::max(n, 1); }
+  // The word lattice of the final result with --output_lattice, a Kaldi
+  // binary CompactLattice of the word ids, empty otherwise. It's kept until
+  // the next sentence starts.
+  const std::string& lattice() const { return searcher_->Lattice(); }
+  // Time spent in the forward, the search and the synchronous rescoring,
+  // and the audio decoded so far, for RTF statistics
+  int64_t decoding_time_ms() const { return decoding_time_ms_; }
+  int64_t decoded_audio_ms() const {
+    return static_cast<int64_t>(num_frames_) * feature_frame_shift_in_ms();
+  }
+  // The costs of the chunk of the last Decode(), -1 if it forwarded no
+  // chunk, e.g. it waited for the features, and of the last Rescoring()
+  int64_t last_forward_us() const { return last_forward_us_; }
+  int64_t last_search_us() const { return last_search_us_; }
+  int64_t last_rescoring_us() const { return last_rescoring_us_; }
+  // The ctc log probs of the chunk of the last Decode(), valid only if
+  // last_forward_us() >= 0, and the encoder outputs of the sentence, e.g.
+  // for CtcCacheWriter. The ones pruned by the model are scattered here.
+  const LogProbMatrix& last_ctc_log_probs();
+  bool GetEncoderOut(FeatureMatrix* encoder_out) const {
+    return model_->GetEncoderOut(encoder_out);
+  }
+  // The memory after the last decoded chunk, it's reported to DecodeMetrics
+  // as well
+  const DecoderMemory& memory() const { return memory_; }
 
  private:
   DecodeState AdvanceDecoding(bool block = true);
+  // To sparse_ctc_log_probs if sparse_ctc_, otherwise to ctc_log_probs
+  void ForwardEncoder(const FeatureMatrix& chunk_feats,
+                      LogProbMatrix* ctc_log_probs,
+                      SparseLogProbMatrix* sparse_ctc_log_probs);
+  // Read the next chunk and forward its encoder on pipeline_pool_, while the
+  // current chunk is searched. Only a whole chunk of the same sentence is
+  // forwarded ahead, i.e. if the current chunk can't be an endpoint and the
+  // session is not over its memory budget, so the model never sees the
+  // audio of the next sentence.
+  void MaybePrefetch();
+  // Wait for the chunk ahead and drop it, e.g. when the model is reset
+  void DropPrefetch();
+  // Skip num_frames frames of silence found by the VAD of the pipeline
+  DecodeState SkipSilence(int num_frames);
   void AttentionRescoring();
+  // Cache the stable prefixes of the N-best in the model every
+  // opts_.prefix_rescoring_interval chunks
+  void MaybeCacheRescoringPrefixes();
+  // Rescore the N-best ahead of the endpoint in the trailing silence, see
+  // DecodeOptions::speculative_rescoring_silence_ms, or drop the one of an
+  // older N-best if the speech resumed
+  void MaybeRescoreSpeculatively();
+  // Wait for the speculative rescoring, the model is not touched until it's
+  // done
+  void WaitSpeculativeRescoring();
+  // Wait for it and drop it, e.g. when the model is reset
+  void DropSpeculativeRescoring();
+  // feats are the features of the sentence for the cascade model, the
+  // scores of speculative are reused if it has rescored the hypotheses
+  void RescoreHypotheses(AsrModel* model,
+                         const std::vector<std::vector<int>>& hypotheses,
+                         const std::vector<float>& feats,
+                         const SpeculativeRescoring* speculative,
+                         std::vector<DecodeResult>* result) const;
+  // The attention rescoring scores of the hypotheses by model, through
+  // scheduler if it's not nullptr
+  void ComputeRescoringScores(
+      AsrModel* model, BatchRescoringScheduler* scheduler,
+      const std::vector<std::vector<int>>& hypotheses,
+      std::vector<float>* rescoring_score) const;
+  // Whether the N-best is confident enough to skip the rescoring, see
+  // DecodeOptions::rescoring_skip_margin
+  bool SkipRescoring(float margin, float posterior) const;
+  // A copy of the cascade model which has forwarded its encoder over feats
+  std::shared_ptr<AsrModel> ForwardCascade(
+      const std::vector<float>& feats) const;
 
   void UpdateResult(bool finish = false);
+  // Publish a copy of result_ as result_snapshot_
+  void PublishResult();
+  // The text of a result before the post processing, kept across the
+  // chunks, the next hypothesis of its rank only appends the tokens after
+  // their common prefix
+  struct ResultText {
+    std::vector<int> tokens;
+    // The end of each token in raw
+    std::vector<size_t> token_ends;
+    std::string raw;
+    // The post processed raw, valid if processed
+    std::string sentence;
+    bool processed = false;
+    bool finish = false;
+    void Clear() {
+      tokens.clear();
+      token_ends.clear();
+      raw.clear();
+      processed = false;
+    }
+  };
+  // Return false if the hypothesis is the same as the tokens of text
+  bool UpdateText(const std::vector<int>& hypothesis, ResultText* text) const;
+  // Pick the chunk size of the next sentence by chunk_policy_
+  void AdaptChunkSize();
+  // Attach pending_context_graph_ to the searcher if it's ready
+  void AttachContextGraph();
+  // The CtcPrefixBeamSearch of the features of the decoding, see
+  // NewCtcPrefixBeamSearch()
+  void NewPrefixSearcher(const std::shared_ptr<ContextGraph>& context_graph);
+  // Update memory_ with model_bytes, measured when the model was idle, and
+  // apply opts_.max_session_memory_mb. Return true if the sentence should
+  // be ended.
+  bool UpdateMemory(size_t model_bytes);
+  // Report memory to DecodeMetrics in place of memory_
+  void ReportMemory(const DecoderMemory& memory);
+  void set_memory_degraded(bool degraded);
+  // Report the chunk decoded in decode_us to beam_policy_, and scale the
+  // beams of the next chunk by it
+  void AdaptBeams(int64_t decode_us, int num_frames);
+  // The scale of the load and the one of the memory budget
+  void UpdateBeamScale();
 
+  // The resource of the device replica the decoder is pinned to, or the
+  // one it's created by without the replicas. It's initialized first.
+  std::shared_ptr<DecodeResource> device_resource_;
   std::shared_ptr<FeaturePipeline> feature_pipeline_;
   std::shared_ptr<AsrModel> model_;
+  std::shared_ptr<AsrModelPool> model_pool_ = nullptr;
   std::shared_ptr<PostProcessor> post_processor_;
+  std::shared_ptr<BatchEncoderScheduler> encoder_scheduler_ = nullptr;
+  std::shared_ptr<BatchRescoringScheduler> rescoring_scheduler_ = nullptr;
+  std::shared_ptr<AsrModel> cascade_model_ = nullptr;
+  std::shared_ptr<BatchRescoringScheduler> cascade_rescoring_scheduler_ =
+      nullptr;
+  std::shared_ptr<AdaptiveChunkPolicy> chunk_policy_ = nullptr;
+  std::shared_ptr<AdaptiveBeamPolicy> beam_policy_ = nullptr;
 
   std::shared_ptr<fst::Fst<fst::StdArc>> fst_ = nullptr;
-  // output symbol table
-  std::shared_ptr<fst::SymbolTable> symbol_table_;
-  // e2e unit symbol table
-  std::shared_ptr<fst::SymbolTable> unit_table_ = nullptr;
-  const DecodeOptions& opts_;
+  std::shared_ptr<NgramLm> ngram_lm_ = nullptr;
+  // Strings of the output symbol table
+  std::shared_ptr<SymbolStrings> symbol_strings_;
+  // Strings of the e2e unit symbol table
+  std::shared_ptr<SymbolStrings> unit_strings_ = nullptr;
+  // A copy for each session, the chunk size could be changed by chunk_policy_
+  DecodeOptions opts_;
   // cache feature
   bool start_ = false;
   // For continuous decoding
   int num_frames_ = 0;
   int global_frame_offset_ = 0;
+  int base_frame_offset_ = 0;
+  // Chunks since the prefixes are cached
+  int num_prefix_chunks_ = 0;
   const int time_stamp_gap_ = 100;  // timestamp gap between words in a sentence
 
   std::unique_ptr<SearchInterface> searcher_;
   std::unique_ptr<CtcEndpoint> ctc_endpointer_;
+  std::mutex context_mutex_;
+  std::shared_future<std::shared_ptr<ContextGraph>> pending_context_graph_;
 
   int num_frames_in_current_chunk_ = 0;
+  // Reused by the chunks
+  FeatureMatrix chunk_feats_;
+  LogProbMatrix ctc_log_probs_;
+  // The log probs pruned by the model are passed to the search and the
+  // endpoint as they are, see AsrModel::ctc_topk()
+  bool sparse_ctc_ = false;
+  SparseLogProbMatrix sparse_ctc_log_probs_;
+  // The features of the sentence so far, (T, feature_dim_) row major, only
+  // kept for the cascade model
+  std::vector<float> sentence_feats_;
+  int feature_dim_ = 0;
+  // The chunk whose encoder runs ahead on pipeline_pool_, it's pending if
+  // done is valid
+  struct PrefetchedChunk {
+    FeatureMatrix feats;
+    LogProbMatrix ctc_log_probs;
+    SparseLogProbMatrix sparse_ctc_log_probs;
+    int64_t forward_us = 0;
+    std::future<void> done;
+  };
+  std::shared_ptr<ThreadPool> pipeline_pool_ = nullptr;
+  PrefetchedChunk prefetch_;
+  // The speculative rescoring of the sentence, it's pending if
+  // speculative_done_ is valid
+  std::shared_ptr<SpeculativeRescoring> speculative_ = nullptr;
+  std::future<void> speculative_done_;
   std::vector<DecodeResult> result_;
+  // Accessed by std::atomic_load/std::atomic_store only
+  std::shared_ptr<const std::vector<DecodeResult>> result_snapshot_ =
+      std::make_shared<const std::vector<DecodeResult>>();
+  std::vector<ResultText> result_texts_;
+  int partial_nbest_ = 1;
+  int64_t decoding_time_ms_ = 0;
+  int64_t last_forward_us_ = -1;
+  int64_t last_search_us_ = -1;
+  int64_t last_rescoring_us_ = -1;
+  DecoderMemory memory_;
+  // The memory when the sentence started, the pools of the searcher and the
+  // buffers of the model are kept across the sentences, so only the growth
+  // of a sentence over the budget ends it
+  size_t sentence_start_bytes_ = 0;
+  bool memory_degraded_ = false;
+  // By beam_policy_
+  float load_beam_scale_ = 1.0;
+  // The sentence is ended at the next chunk which has no chunk ahead
+  bool over_budget_ = false;
 
  public:
   WENET_DISALLOW_COPY_AND_ASSIGN(AsrDecoder);
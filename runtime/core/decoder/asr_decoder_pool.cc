@@ -0,0 +1,103 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/asr_decoder_pool.h"
+
+#include <future>
+#include <utility>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+AsrDecoderPool::AsrDecoderPool(
+    std::shared_ptr<FeaturePipelineConfig> feature_config,
+    std::shared_ptr<DecodeOptions> decode_config,
+    std::shared_ptr<DecodeResource> resource,
+    const AsrDecoderPoolOptions& opts)
+    : feature_config_(std::move(feature_config)),
+      decode_config_(std::move(decode_config)),
+      resource_(std::move(resource)),
+      opts_(opts) {
+  CHECK_GE(opts_.initial_size, 0);
+  CHECK_GE(opts_.max_idle, opts_.initial_size);
+  idle_.reserve(opts_.max_idle);
+  for (int i = 0; i < opts_.initial_size; ++i) {
+    idle_.push_back(NewDecoder());
+  }
+}
+
+PooledDecoder AsrDecoderPool::NewDecoder() const {
+  PooledDecoder decoder;
+  decoder.feature_pipeline =
+      std::make_shared<FeaturePipeline>(*feature_config_);
+  decoder.decoder = std::make_shared<AsrDecoder>(
+      decoder.feature_pipeline, resource_, *decode_config_);
+  return decoder;
+}
+
+PooledDecoder AsrDecoderPool::Acquire() {
+  PooledDecoder decoder;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!idle_.empty()) {
+      decoder = std::move(idle_.back());
+      idle_.pop_back();
+    }
+  }
+  if (decoder.decoder == nullptr) {
+    VLOG(2) << "No idle decoder in the pool, make a new one";
+    decoder = NewDecoder();
+  }
+  // The returned decoder owns the pair by its deleter, which gives it back
+  // to the pool, or frees it if the pool is gone. The returned pipeline
+  // shares its reference count.
+  std::weak_ptr<AsrDecoderPool> weak_pool = shared_from_this();
+  PooledDecoder handle;
+  handle.decoder = std::shared_ptr<AsrDecoder>(
+      decoder.decoder.get(), [weak_pool, decoder](AsrDecoder*) mutable {
+        std::shared_ptr<AsrDecoderPool> pool = weak_pool.lock();
+        if (pool != nullptr) {
+          pool->Release(std::move(decoder));
+        }
+      });
+  handle.feature_pipeline = std::shared_ptr<FeaturePipeline>(
+      handle.decoder, decoder.feature_pipeline.get());
+  return handle;
+}
+
+void AsrDecoderPool::Release(PooledDecoder decoder) {
+  // Restore the settings which the stream may have changed, and reset the
+  // states here instead of on acquisition
+  FeaturePipeline* feature_pipeline = decoder.feature_pipeline.get();
+  feature_pipeline->set_ready_callback(nullptr);
+  feature_pipeline->set_space_callback(nullptr);
+  feature_pipeline->set_input_sample_rate(feature_config_->sample_rate);
+  std::promise<std::shared_ptr<ContextGraph>> context_graph;
+  context_graph.set_value(resource_->context_graph);
+  decoder.decoder->SetContextGraph(context_graph.get_future().share());
+  // The pipeline is reset with the decoder
+  decoder.decoder->Reset();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (static_cast<int>(idle_.size()) < opts_.max_idle) {
+    idle_.push_back(std::move(decoder));
+  }
+}
+
+int AsrDecoderPool::num_idle() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return idle_.size();
+}
+
+}  // namespace wenet
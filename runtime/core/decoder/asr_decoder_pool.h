@@ -0,0 +1,79 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_ASR_DECODER_POOL_H_
+#define DECODER_ASR_DECODER_POOL_H_
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "decoder/asr_decoder.h"
+#include "frontend/feature_pipeline.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct AsrDecoderPoolOptions {
+  // Decoders created at construction
+  int initial_size = 16;
+  // Max idle decoders kept in the pool, the others are freed when they are
+  // released
+  int max_idle = 64;
+};
+
+// A decoder and the feature pipeline it reads
+struct PooledDecoder {
+  std::shared_ptr<FeaturePipeline> feature_pipeline;
+  std::shared_ptr<AsrDecoder> decoder;
+};
+
+// AsrDecoderPool keeps reset FeaturePipeline and AsrDecoder pairs of the
+// default decode options, so a new stream doesn't build the fbank tables,
+// copy the model, or create the searcher and the endpointer. Acquire()
+// hands out an idle pair if there is any, and it goes back to the pool when
+// the last shared_ptr to both of them is released, the per-stream settings
+// are restored then: the input sample rate, the callbacks of the pipeline
+// and the context graph. It is thread safe, and it must be created by
+// std::make_shared.
+class AsrDecoderPool : public std::enable_shared_from_this<AsrDecoderPool> {
+ public:
+  AsrDecoderPool(std::shared_ptr<FeaturePipelineConfig> feature_config,
+                 std::shared_ptr<DecodeOptions> decode_config,
+                 std::shared_ptr<DecodeResource> resource,
+                 const AsrDecoderPoolOptions& opts);
+
+  PooledDecoder Acquire();
+
+  int num_idle();
+  const std::shared_ptr<DecodeResource>& resource() const { return resource_; }
+
+ private:
+  void Release(PooledDecoder decoder);
+  PooledDecoder NewDecoder() const;
+
+  std::shared_ptr<FeaturePipelineConfig> feature_config_;
+  std::shared_ptr<DecodeOptions> decode_config_;
+  std::shared_ptr<DecodeResource> resource_;
+  const AsrDecoderPoolOptions opts_;
+  std::mutex mutex_;
+  std::vector<PooledDecoder> idle_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(AsrDecoderPool);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_ASR_DECODER_POOL_H_
@@ -3,9 +3,13 @@
 
 #include "decoder/asr_model.h"
 
+#include <algorithm>
+#include <cmath>
 #include <memory>
 #include <utility>
 
+#include "utils/state_io.h"
+
 namespace wenet {
 
 int AsrModel::num_frames_for_chunk(bool start) const {
@@ -24,35 +28,221 @@ int AsrModel::num_frames_for_chunk(bool start) const {
 }
 
 
-void AsrModel::CacheFeature(
-    const std::vector<std::vector<float>>& chunk_feats) {
+void AsrModel::CacheFeature(const FeatureMatrix& chunk_feats) {
   // Cache feature for next chunk
   const int cached_feature_size = 1 + right_context_ - subsampling_rate_;
-  if (chunk_feats.size() >= cached_feature_size) {
+  if (chunk_feats.rows() >= cached_feature_size) {
     // TODO(Binbin Zhang): Only deal the case when
     // chunk_feats.size() > cached_feature_size here, and it's consistent
     // with our current model, refine it later if we have new model or
     // new requirements
-    cached_feature_.resize(cached_feature_size);
-    for (int i = 0; i < cached_feature_size; ++i) {
-      cached_feature_[i] =
-        chunk_feats[chunk_feats.size() - cached_feature_size + i];
-    }
+    cached_feature_.Resize(cached_feature_size, chunk_feats.cols());
+    cached_feature_.CopyRows(chunk_feats,
+                             chunk_feats.rows() - cached_feature_size,
+                             cached_feature_size, 0);
   }
 }
 
 
-void AsrModel::ForwardEncoder(
-    const std::vector<std::vector<float>>& chunk_feats,
-    std::vector<std::vector<float>> *ctc_prob) {
-  ctc_prob->clear();
-  int num_frames = cached_feature_.size() + chunk_feats.size();
+void AsrModel::SpliceFeature(const FeatureMatrix& chunk_feats,
+                             FeatureMatrix* feats) const {
+  int num_frames = cached_feature_.rows() + chunk_feats.rows();
+  int feature_dim = chunk_feats.empty() ? cached_feature_.cols() :
+                                          chunk_feats.cols();
+  feats->Resize(num_frames, feature_dim);
+  if (!cached_feature_.empty()) {
+    feats->CopyRows(cached_feature_, 0, cached_feature_.rows(), 0);
+  }
+  if (!chunk_feats.empty()) {
+    feats->CopyRows(chunk_feats, 0, chunk_feats.rows(),
+                    cached_feature_.rows());
+  }
+}
+
+
+bool AsrModel::SaveState(StateWriter* writer) const {
+  FeatureMatrix encoder_out;
+  if (!GetEncoderOut(&encoder_out)) return false;
+  writer->Write<int32_t>(chunk_size_);
+  writer->Write<int32_t>(num_left_chunks_);
+  writer->Write<int32_t>(offset_);
+  writer->WriteMatrix(cached_feature_);
+  writer->WriteMatrix(encoder_out);
+  return SaveCaches(writer);
+}
+
+bool AsrModel::RestoreState(StateReader* reader) {
+  int32_t chunk_size = 0;
+  int32_t num_left_chunks = 0;
+  int32_t offset = 0;
+  FeatureMatrix cached_feature;
+  FeatureMatrix encoder_out;
+  if (!reader->Read(&chunk_size) || !reader->Read(&num_left_chunks) ||
+      !reader->Read(&offset) || !reader->ReadMatrix(&cached_feature) ||
+      !reader->ReadMatrix(&encoder_out)) {
+    return false;
+  }
+  // The caches of the backends are shaped by the chunk config
+  set_chunk_size(chunk_size);
+  set_num_left_chunks(num_left_chunks);
+  Reset();
+  offset_ = offset;
+  cached_feature_ = std::move(cached_feature);
+  if (!SetEncoderOut(encoder_out) || !RestoreCaches(reader)) {
+    Reset();
+    return false;
+  }
+  return true;
+}
+
+void AsrModel::ForwardEncoder(const FeatureMatrix& chunk_feats,
+                              LogProbMatrix* ctc_prob) {
+  ctc_prob->Resize(0, 0);
+  int num_frames = cached_feature_.rows() + chunk_feats.rows();
+  if (num_frames > right_context_ + 1) {
+    this->ForwardEncoderFunc(chunk_feats, ctc_prob);
+    this->CacheFeature(chunk_feats);
+  }
+}
+
+
+void AsrModel::ForwardEncoder(const FeatureMatrix& chunk_feats,
+                              SparseLogProbMatrix* ctc_prob) {
+  ctc_prob->Resize(0, 0, 0);
+  int num_frames = cached_feature_.rows() + chunk_feats.rows();
   if (num_frames > right_context_ + 1) {
     this->ForwardEncoderFunc(chunk_feats, ctc_prob);
     this->CacheFeature(chunk_feats);
   }
 }
 
+
+void AsrModel::ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                                  SparseLogProbMatrix* ctc_prob) {
+  LogProbMatrix dense;
+  this->ForwardEncoderFunc(chunk_feats, &dense);
+  ctc_prob->FromDense(dense, ctc_topk());
+}
+
+
+void AsrModel::ForwardEncoder(
+    const std::vector<std::vector<float>>& chunk_feats,
+    std::vector<std::vector<float>>* ctc_prob) {
+  FeatureMatrix feats(chunk_feats);
+  LogProbMatrix prob;
+  ForwardEncoder(feats, &prob);
+  prob.CopyTo(ctc_prob);
+}
+
+
+void AsrModel::ForwardEncoderBatch(const std::vector<EncoderBatchItem>& items) {
+  for (const auto& item : items) {
+    item.model->ForwardEncoder(*item.chunk_feats, item.ctc_prob);
+  }
+}
+
+
+void AsrModel::set_rescoring_buckets(const std::vector<int>& hyp_buckets,
+                                     const std::vector<int>& frame_buckets) {
+  rescoring_hyp_buckets_ = hyp_buckets;
+  rescoring_frame_buckets_ = frame_buckets;
+  std::sort(rescoring_hyp_buckets_.begin(), rescoring_hyp_buckets_.end());
+  std::sort(rescoring_frame_buckets_.begin(), rescoring_frame_buckets_.end());
+  CHECK(hyp_buckets.empty() || rescoring_hyp_buckets_[0] > 0);
+  CHECK(frame_buckets.empty() || rescoring_frame_buckets_[0] > 0);
+}
+
+
+int AsrModel::BucketSize(int size, const std::vector<int>& buckets) {
+  if (buckets.empty()) return size;
+  auto it = std::lower_bound(buckets.begin(), buckets.end(), size);
+  if (it != buckets.end()) return *it;
+  int largest = buckets.back();
+  return (size + largest - 1) / largest * largest;
+}
+
+
+void AsrModel::SelectRescoringFrames(const float* blank_log_probs,
+                                     int num_frames, int stride,
+                                     float threshold,
+                                     std::vector<int>* frames) {
+  frames->clear();
+  if (threshold >= 1.0f) {
+    for (int i = 0; i < num_frames; ++i) frames->push_back(i);
+    return;
+  }
+  const float log_threshold = std::log(threshold);
+  int least_blank = 0;
+  for (int i = 0; i < num_frames; ++i) {
+    float blank = blank_log_probs[static_cast<size_t>(i) * stride];
+    if (blank < log_threshold) frames->push_back(i);
+    if (blank < blank_log_probs[static_cast<size_t>(least_blank) * stride]) {
+      least_blank = i;
+    }
+  }
+  if (frames->empty() && num_frames > 0) frames->push_back(least_blank);
+}
+
+
+void AsrModel::AttentionRescoringBatch(
+    const std::vector<RescoringBatchItem>& items) {
+  for (const auto& item : items) {
+    item.model->AttentionRescoring(*item.hyps, item.reverse_weight,
+                                   item.rescoring_score);
+  }
+}
+
+
+void AsrModel::Warmup(const WarmupOptions& opts) const {
+  Timer timer;
+  std::shared_ptr<AsrModel> model = Copy();
+  for (int chunk_size : opts.chunk_sizes) {
+    CHECK_GT(chunk_size, 0) << "Only streaming chunk sizes could be warmed up";
+    for (int num_left_chunks : opts.num_left_chunks) {
+      model->set_chunk_size(chunk_size);
+      model->set_num_left_chunks(num_left_chunks);
+      model->Reset();
+      int num_chunks = std::max(opts.num_chunks, num_left_chunks + 2);
+      LogProbMatrix ctc_prob;
+      for (int i = 0; i < num_chunks; ++i) {
+        FeatureMatrix feats(model->num_frames_for_chunk(i == 0),
+                            opts.feature_dim);
+        feats.SetZero();
+        model->ForwardEncoder(feats, &ctc_prob);
+      }
+      VLOG(1) << "Warmup encoder, chunk_size " << chunk_size
+              << " num_left_chunks " << num_left_chunks;
+      // Rescoring attends to the encoder outputs of this setting. With the
+      // hyp buckets, the longest hyp of each bucket is rescored, so every
+      // padded shape is compiled.
+      std::vector<int> hyp_lengths = {opts.hyp_length};
+      if (!rescoring_hyp_buckets_.empty()) {
+        hyp_lengths.clear();
+        for (int bucket : rescoring_hyp_buckets_) {
+          hyp_lengths.push_back(std::max(1, bucket - 1));
+        }
+      }
+      for (int nbest : opts.nbest_sizes) {
+        for (int hyp_length : hyp_lengths) {
+          std::vector<std::vector<int>> hyps(nbest);
+          for (int i = 0; i < nbest; ++i) {
+            // Hypotheses of different lengths, with tokens other than
+            // sos/eos
+            int length = std::max(1, hyp_length - i % 3);
+            for (int j = 0; j < length; ++j) {
+              hyps[i].push_back(1 + (i + j) % std::max(1, model->eos() - 1));
+            }
+          }
+          std::vector<float> rescoring_score;
+          model->AttentionRescoring(hyps, opts.reverse_weight,
+                                    &rescoring_score);
+        }
+      }
+    }
+  }
+  LOG(INFO) << "Model warmup done, cost " << timer.Elapsed() << "ms.";
+}
+
 }  // namespace wenet
 
 
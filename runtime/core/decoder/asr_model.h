@@ -9,11 +9,50 @@
 #include <string>
 #include <vector>
 
+#include "utils/matrix.h"
+#include "utils/quantized_frames.h"
+#include "utils/sparse_log_prob_matrix.h"
 #include "utils/timer.h"
 #include "utils/utils.h"
 
 namespace wenet {
 
+class AsrModel;
+class StateReader;
+class StateWriter;
+
+// One chunk of one decoding session in a batched encoder forward
+struct EncoderBatchItem {
+  AsrModel* model = nullptr;
+  const FeatureMatrix* chunk_feats = nullptr;
+  LogProbMatrix* ctc_prob = nullptr;
+};
+
+// N-best of one decoding session in a batched attention rescoring
+struct RescoringBatchItem {
+  AsrModel* model = nullptr;
+  const std::vector<std::vector<int>>* hyps = nullptr;
+  float reverse_weight = 0.0;
+  std::vector<float>* rescoring_score = nullptr;
+};
+
+// Synthetic inputs to run through the model once it's loaded, so the first
+// requests don't pay for the TorchScript profiling/recompilation and the lazy
+// memory allocations of the engines. Every combination of chunk_sizes and
+// num_left_chunks is forwarded with num_chunks zero chunks, then every
+// nbest_sizes of hypotheses with hyp_length tokens, or of the longest length
+// of each rescoring hyp bucket, is rescored.
+struct WarmupOptions {
+  int feature_dim = 80;
+  std::vector<int> chunk_sizes;
+  std::vector<int> num_left_chunks = {-1};
+  // At least num_left_chunks + 2 chunks are forwarded, so the cache reaches
+  // its steady size
+  int num_chunks = 3;
+  std::vector<int> nbest_sizes;
+  int hyp_length = 10;
+  float reverse_weight = 0.0;
+};
 
 class AsrModel {
  public:
@@ -25,6 +64,8 @@ class AsrModel {
     return is_bidirectional_decoder_;
   }
   virtual int offset() const { return offset_; }
+  virtual int chunk_size() const { return chunk_size_; }
+  virtual int num_left_chunks() const { return num_left_chunks_; }
 
   // If chunk_size > 0, streaming case. Otherwise, none streaming case
   virtual void set_chunk_size(int chunk_size) {
@@ -33,28 +74,139 @@ class AsrModel {
   virtual void set_num_left_chunks(int num_left_chunks) {
     num_left_chunks_ = num_left_chunks;
   }
+  // Keep only the last max_encoder_frames encoder outputs of the sentence
+  // for the rescoring, so the memory of a stream is bounded even if it never
+  // reaches an endpoint. 0 means all of them.
+  virtual void set_max_encoder_frames(int max_encoder_frames) {
+    max_encoder_frames_ = max_encoder_frames;
+  }
+  // Keep only the encoder outputs whose ctc blank posterior is below
+  // threshold for the rescoring, and at least the least blank one of each
+  // chunk, the others hardly change the cross attention of the decoder, and
+  // the memory of a stream and the cost of the rescoring shrink with them.
+  // 1 or more means all of them.
+  virtual void set_rescoring_blank_threshold(float threshold) {
+    rescoring_blank_threshold_ = threshold;
+  }
+  // Store the encoder outputs kept for the rescoring in dtype, they're
+  // dequantized only by AttentionRescoring(). It takes effect from the next
+  // sentence, the backends which don't support it keep float32.
+  virtual void set_encoder_out_dtype(FrameDtype dtype) {
+    encoder_out_dtype_ = dtype;
+  }
+  // Pad the rescoring inputs to the smallest bucket no less than their
+  // sizes, so the engines which compile per input shape, e.g. TorchScript
+  // on GPU or TensorRT, reuse a few compiled graphs instead of one per
+  // call. hyp_buckets are of the hyp length with sos, frame_buckets of the
+  // encoder time, which is only padded by the backends whose decoder masks
+  // it by the encoder lengths. Empty means the exact sizes.
+  virtual void set_rescoring_buckets(const std::vector<int>& hyp_buckets,
+                                     const std::vector<int>& frame_buckets);
   // start: if it is the start chunk of one sentence
   virtual int num_frames_for_chunk(bool start) const;
 
   virtual void Reset() = 0;
 
-  virtual void ForwardEncoder(
-      const std::vector<std::vector<float>>& chunk_feats,
-      std::vector<std::vector<float>> *ctc_prob);
+  virtual void ForwardEncoder(const FeatureMatrix& chunk_feats,
+                              LogProbMatrix* ctc_prob);
+  // Convenient wrapper of the above for the callers which use nested vectors
+  void ForwardEncoder(const std::vector<std::vector<float>>& chunk_feats,
+                      std::vector<std::vector<float>>* ctc_prob);
+  // The same as above, the log probs are pruned to the blank and the top
+  // ctc_topk() tokens of each frame, so the dense ones are never copied to
+  // the searches. The backends which prune them ahead of the host override
+  // ForwardEncoderFunc() of it.
+  void ForwardEncoder(const FeatureMatrix& chunk_feats,
+                      SparseLogProbMatrix* ctc_prob);
+  // The top k tokens of a frame of the pruned log probs, 0 means the model
+  // doesn't prune them
+  virtual int ctc_topk() const { return 0; }
+
+  // Forward chunks of several decoding sessions in one call, each item
+  // holds its own model copy(states). The default implementation just runs
+  // the items one by one, backends that could batch them should override it.
+  virtual void ForwardEncoderBatch(const std::vector<EncoderBatchItem>& items);
 
   virtual void AttentionRescoring(
       const std::vector<std::vector<int>>& hyps,
       float reverse_weight,
       std::vector<float>* rescoring_score) = 0;
 
+  // Forward the decoder over the stable prefixes of the N-best so far, and
+  // cache the states and the scores of them, so the AttentionRescoring() at
+  // the end of a long sentence only forwards the tokens after them. The
+  // cached states attend to the encoder outputs so far, the scores are close
+  // to but not the same as the ones of the whole rescoring. Left to right
+  // only, the prefixes are not used with reverse_weight > 0. The prefixes
+  // of the last call are replaced, Reset() drops them. Return false if the
+  // backend doesn't support it.
+  virtual bool CacheRescoringPrefixes(
+      const std::vector<std::vector<int>>& prefixes) {
+    return false;
+  }
+
+  // Rescore the N-best of several decoding sessions in one call, the default
+  // implementation just runs the items one by one.
+  virtual void AttentionRescoringBatch(
+      const std::vector<RescoringBatchItem>& items);
+
   virtual std::shared_ptr<AsrModel> Copy() const = 0;
 
+  // The encoder outputs of the sentence so far, (T, dim) on the host, which
+  // AttentionRescoring() attends to. SetEncoderOut() replaces them, e.g. by
+  // the cached ones of CtcCacheReader. Return false if the backend doesn't
+  // support it.
+  virtual bool GetEncoderOut(FeatureMatrix* encoder_out) const {
+    return false;
+  }
+  virtual bool SetEncoderOut(const FeatureMatrix& encoder_out) {
+    return false;
+  }
+
+  // The states of the stream so far, i.e. the chunk config, the offset, the
+  // cached features, the encoder outputs and the caches of the backend, so
+  // a copy of the same model continues the stream after RestoreState(), see
+  // AsrDecoder::SaveState(). The rescoring prefixes are not kept. Return
+  // false if the backend doesn't support it.
+  bool SaveState(StateWriter* writer) const;
+  bool RestoreState(StateReader* reader);
+
+  // Bytes held by the states of this copy, e.g. the caches and the encoder
+  // outputs, the weights shared by the copies are not counted
+  virtual size_t MemoryBytes() const {
+    return cached_feature_.AllocatedBytes();
+  }
+
+  // Run the synthetic inputs of opts through a copy of this model, the
+  // copies share the underlying engine, so they are warmed up as well
+  void Warmup(const WarmupOptions& opts) const;
+
+  // The smallest of the ascending buckets which is no less than size, and
+  // over the largest one, size rounded up to a multiple of it
+  static int BucketSize(int size, const std::vector<int>& buckets);
+
+  // The frames kept by set_rescoring_blank_threshold(threshold) of the num
+  // frames of the ctc log probs, whose blank ones are of blank_log_probs by
+  // stride, in ascending order, all of them if threshold >= 1
+  static void SelectRescoringFrames(const float* blank_log_probs,
+                                    int num_frames, int stride,
+                                    float threshold, std::vector<int>* frames);
+
  protected:
-  virtual void ForwardEncoderFunc(
-      const std::vector<std::vector<float>>& chunk_feats,
-      std::vector<std::vector<float>> *ctc_prob) = 0;
-  virtual void CacheFeature(
-      const std::vector<std::vector<float>>& chunk_feats);
+  virtual void ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                                  LogProbMatrix* ctc_prob) = 0;
+  // By default the dense log probs are pruned on the host
+  virtual void ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                                  SparseLogProbMatrix* ctc_prob);
+  virtual void CacheFeature(const FeatureMatrix& chunk_feats);
+  // The caches of the backend in SaveState(), RestoreState() calls
+  // RestoreCaches() after Reset(), with the offset and the encoder outputs
+  // restored
+  virtual bool SaveCaches(StateWriter* writer) const { return false; }
+  virtual bool RestoreCaches(StateReader* reader) { return false; }
+  // Splice cached_feature_ and chunk_feats into one contiguous matrix
+  void SpliceFeature(const FeatureMatrix& chunk_feats,
+                     FeatureMatrix* feats) const;
 
   int right_context_ = 1;
   int subsampling_rate_ = 1;
@@ -63,9 +215,15 @@ class AsrModel {
   bool is_bidirectional_decoder_ = false;
   int chunk_size_ = 16;
   int num_left_chunks_ = -1;  // -1 means all left chunks
+  int max_encoder_frames_ = 0;  // 0 means all frames
+  float rescoring_blank_threshold_ = 1.0f;  // 1 means all frames
+  FrameDtype encoder_out_dtype_ = FrameDtype::kFloat32;
   int offset_ = 0;
+  // Ascending, empty means no padding
+  std::vector<int> rescoring_hyp_buckets_;
+  std::vector<int> rescoring_frame_buckets_;
 
-  std::vector<std::vector<float>> cached_feature_;
+  FeatureMatrix cached_feature_;
 };
 
 
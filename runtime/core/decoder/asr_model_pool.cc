@@ -0,0 +1,79 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/asr_model_pool.h"
+
+#include <utility>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+AsrModelPool::AsrModelPool(std::shared_ptr<AsrModel> prototype,
+                           const AsrModelPoolOptions& opts)
+    : prototype_(std::move(prototype)), opts_(opts) {
+  CHECK(prototype_ != nullptr);
+  CHECK_GE(opts_.initial_size, 0);
+  CHECK_GE(opts_.max_idle, opts_.initial_size);
+  idle_.reserve(opts_.max_idle);
+  for (int i = 0; i < opts_.initial_size; ++i) {
+    idle_.push_back(prototype_->Copy());
+  }
+}
+
+std::shared_ptr<AsrModel> AsrModelPool::Acquire() {
+  std::shared_ptr<AsrModel> model = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!idle_.empty()) {
+      model = std::move(idle_.back());
+      idle_.pop_back();
+    }
+  }
+  if (model == nullptr) {
+    VLOG(2) << "No idle model state in the pool, make a new copy";
+    model = prototype_->Copy();
+  }
+  // The returned pointer owns `model` by its deleter, which gives it back to
+  // the pool, or frees it if the pool is gone
+  std::weak_ptr<AsrModelPool> weak_pool = shared_from_this();
+  AsrModel* ptr = model.get();
+  return std::shared_ptr<AsrModel>(
+      ptr, [weak_pool, model](AsrModel*) mutable {
+        std::shared_ptr<AsrModelPool> pool = weak_pool.lock();
+        if (pool != nullptr) {
+          pool->Release(std::move(model));
+        }
+      });
+}
+
+void AsrModelPool::Release(std::shared_ptr<AsrModel> model) {
+  // Restore the settings which the stream may have changed, and reset the
+  // states here instead of on acquisition
+  model->set_chunk_size(prototype_->chunk_size());
+  model->set_num_left_chunks(prototype_->num_left_chunks());
+  model->Reset();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (static_cast<int>(idle_.size()) < opts_.max_idle) {
+    idle_.push_back(std::move(model));
+  }
+}
+
+int AsrModelPool::num_idle() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return idle_.size();
+}
+
+}  // namespace wenet
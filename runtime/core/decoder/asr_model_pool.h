@@ -0,0 +1,66 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef DECODER_ASR_MODEL_POOL_H_
+#define DECODER_ASR_MODEL_POOL_H_
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "decoder/asr_model.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct AsrModelPoolOptions {
+  // Model states created at construction
+  int initial_size = 16;
+  // Max idle model states kept in the pool, the others are freed when they
+  // are released
+  int max_idle = 64;
+};
+
+// AsrModelPool keeps reusable per-stream model states, i.e. the copies of
+// the prototype model. Acquire() hands out an idle one if there is any, and
+// it goes back to the pool when the last shared_ptr to it is released. The
+// states are reset when they are released, and the backends keep their
+// buffers on Reset(), so a new stream does no model state allocation.
+// It is thread safe, and it must be created by std::make_shared.
+class AsrModelPool : public std::enable_shared_from_this<AsrModelPool> {
+ public:
+  AsrModelPool(std::shared_ptr<AsrModel> prototype,
+               const AsrModelPoolOptions& opts);
+
+  // Same semantic as prototype->Copy()
+  std::shared_ptr<AsrModel> Acquire();
+
+  int num_idle();
+
+ private:
+  void Release(std::shared_ptr<AsrModel> model);
+
+  std::shared_ptr<AsrModel> prototype_;
+  const AsrModelPoolOptions opts_;
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<AsrModel>> idle_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(AsrModelPool);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_ASR_MODEL_POOL_H_
@@ -0,0 +1,115 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/batch_encoder_scheduler.h"
+
+#include <algorithm>
+
+#include "utils/log.h"
+#include "utils/trace.h"
+
+namespace wenet {
+
+BatchEncoderScheduler::BatchEncoderScheduler(const BatchEncoderOptions& opts)
+    : opts_(opts) {
+  CHECK_GT(opts_.max_batch_size, 0);
+  CHECK_GE(opts_.max_wait_us, 0);
+  worker_ = std::thread(&BatchEncoderScheduler::SchedulerLoop, this);
+}
+
+BatchEncoderScheduler::~BatchEncoderScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  task_cond_.notify_one();
+  worker_.join();
+}
+
+void BatchEncoderScheduler::ForwardEncoder(AsrModel* model,
+                                           const FeatureMatrix& chunk_feats,
+                                           LogProbMatrix* ctc_prob) {
+  Task task;
+  task.item.model = model;
+  task.item.chunk_feats = &chunk_feats;
+  task.item.ctc_prob = ctc_prob;
+  task.arrival = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(mutex_);
+  tasks_.push_back(&task);
+  task_cond_.notify_one();
+  done_cond_.wait(lock, [&task] { return task.done; });
+}
+
+BatchEncoderStats BatchEncoderScheduler::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void BatchEncoderScheduler::SchedulerLoop() {
+  while (true) {
+    std::vector<Task*> batch;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_cond_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+      if (tasks_.empty()) return;  // stop_ is set and all tasks are done
+      // Wait for more sessions until the batch is full or the oldest chunk
+      // has waited long enough
+      auto deadline = tasks_.front()->arrival +
+                      std::chrono::microseconds(opts_.max_wait_us);
+      task_cond_.wait_until(lock, deadline, [this] {
+        return stop_ || static_cast<int>(tasks_.size()) >= opts_.max_batch_size;
+      });
+      int num_tasks = tasks_.size();
+      const float alpha = 0.1;
+      load_ = (1 - alpha) * load_ +
+              alpha * num_tasks / static_cast<float>(opts_.max_batch_size);
+      int batch_size = std::min(num_tasks, opts_.max_batch_size);
+      for (int i = 0; i < batch_size; ++i) {
+        batch.push_back(tasks_.front());
+        tasks_.pop_front();
+      }
+    }
+
+    std::vector<EncoderBatchItem> items;
+    for (Task* task : batch) {
+      items.push_back(task->item);
+    }
+    VLOG(3) << "Forward encoder batch of " << items.size() << " sessions";
+    {
+      WENET_TRACE_SCOPE("encoder_batch");
+      items[0].model->ForwardEncoderBatch(items);
+    }
+
+    int max_frames = 0;
+    int64_t valid_frames = 0;
+    for (const auto& item : items) {
+      max_frames = std::max(max_frames, item.chunk_feats->rows());
+      valid_frames += item.chunk_feats->rows();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (Task* task : batch) {
+        task->done = true;
+      }
+      stats_.num_batches++;
+      stats_.num_items += items.size();
+      stats_.valid_frames += valid_frames;
+      stats_.padded_frames += static_cast<int64_t>(max_frames) * items.size();
+    }
+    done_cond_.notify_all();
+  }
+}
+
+}  // namespace wenet
@@ -0,0 +1,96 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_BATCH_ENCODER_SCHEDULER_H_
+#define DECODER_BATCH_ENCODER_SCHEDULER_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "decoder/asr_model.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct BatchEncoderOptions {
+  // Max number of sessions forwarded in one batch
+  int max_batch_size = 8;
+  // Max time(us) the first queued chunk waits for other sessions
+  int max_wait_us = 2000;
+};
+
+// Counters of the forwarded batches, a batch is counted as if it is padded
+// to its longest input, which is exact for the full context utterances
+struct BatchEncoderStats {
+  int64_t num_batches = 0;
+  int64_t num_items = 0;
+  // Frames of the inputs
+  int64_t valid_frames = 0;
+  // Frames of the padded batches, batch size times the longest input
+  int64_t padded_frames = 0;
+};
+
+// BatchEncoderScheduler gathers the ready chunks from many decoding sessions
+// and forwards them with one AsrModel::ForwardEncoderBatch call, so the
+// encoder runs on a batch instead of many small (1, T, D) inputs.
+// It is thread safe and can be shared by all the decoders of a server.
+class BatchEncoderScheduler {
+ public:
+  explicit BatchEncoderScheduler(const BatchEncoderOptions& opts);
+  ~BatchEncoderScheduler();
+
+  // Same semantic as model->ForwardEncoder, block until the chunk is
+  // forwarded in some batch.
+  void ForwardEncoder(AsrModel* model, const FeatureMatrix& chunk_feats,
+                      LogProbMatrix* ctc_prob);
+
+  // Moving average of the queued chunks when a batch is picked, in units of
+  // max_batch_size. Above 1 means the encoder can't keep up with the
+  // sessions and chunks wait for more than one batch.
+  float load() const { return load_.load(); }
+
+  BatchEncoderStats stats() const;
+
+ private:
+  struct Task {
+    EncoderBatchItem item;
+    std::chrono::steady_clock::time_point arrival;
+    bool done = false;
+  };
+
+  void SchedulerLoop();
+
+  const BatchEncoderOptions opts_;
+  mutable std::mutex mutex_;
+  std::condition_variable task_cond_;
+  std::condition_variable done_cond_;
+  std::deque<Task*> tasks_;
+  bool stop_ = false;
+  std::atomic<float> load_{0.0};
+  BatchEncoderStats stats_;
+  std::thread worker_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(BatchEncoderScheduler);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_BATCH_ENCODER_SCHEDULER_H_
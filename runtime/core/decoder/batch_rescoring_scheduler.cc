@@ -0,0 +1,105 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/batch_rescoring_scheduler.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "utils/log.h"
+#include "utils/trace.h"
+
+namespace wenet {
+
+BatchRescoringScheduler::BatchRescoringScheduler(
+    const BatchRescoringOptions& opts)
+    : opts_(opts) {
+  CHECK_GT(opts_.num_workers, 0);
+  CHECK_GT(opts_.max_batch_size, 0);
+  CHECK_GE(opts_.max_wait_us, 0);
+  for (int i = 0; i < opts_.num_workers; ++i) {
+    workers_.emplace_back(&BatchRescoringScheduler::WorkerLoop, this);
+  }
+}
+
+BatchRescoringScheduler::~BatchRescoringScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  task_cond_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+std::future<void> BatchRescoringScheduler::AttentionRescoring(
+    AsrModel* model, const std::vector<std::vector<int>>& hyps,
+    float reverse_weight, std::vector<float>* rescoring_score) {
+  Task task;
+  task.item.model = model;
+  task.item.hyps = &hyps;
+  task.item.reverse_weight = reverse_weight;
+  task.item.rescoring_score = rescoring_score;
+  task.arrival = std::chrono::steady_clock::now();
+  std::future<void> future = task.done.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  task_cond_.notify_one();
+  return future;
+}
+
+void BatchRescoringScheduler::WorkerLoop() {
+  while (true) {
+    std::vector<Task> batch;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_cond_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+      if (tasks_.empty()) return;  // stop_ is set and all tasks are done
+      // Wait for more sessions until the batch is full or the oldest N-best
+      // has waited long enough
+      auto deadline = tasks_.front().arrival +
+                      std::chrono::microseconds(opts_.max_wait_us);
+      task_cond_.wait_until(lock, deadline, [this] {
+        return stop_ || tasks_.empty() ||
+               static_cast<int>(tasks_.size()) >= opts_.max_batch_size;
+      });
+      // Another worker may have taken the tasks
+      if (tasks_.empty()) continue;
+      int batch_size =
+          std::min(static_cast<int>(tasks_.size()), opts_.max_batch_size);
+      for (int i = 0; i < batch_size; ++i) {
+        batch.push_back(std::move(tasks_.front()));
+        tasks_.pop_front();
+      }
+    }
+
+    std::vector<RescoringBatchItem> items;
+    for (const auto& task : batch) {
+      items.push_back(task.item);
+    }
+    VLOG(3) << "Attention rescoring batch of " << items.size() << " sessions";
+    {
+      WENET_TRACE_SCOPE("rescoring_batch");
+      items[0].model->AttentionRescoringBatch(items);
+    }
+    for (auto& task : batch) {
+      task.done.set_value();
+    }
+  }
+}
+
+}  // namespace wenet
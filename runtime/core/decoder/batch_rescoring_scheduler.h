@@ -0,0 +1,77 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_BATCH_RESCORING_SCHEDULER_H_
+#define DECODER_BATCH_RESCORING_SCHEDULER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "decoder/asr_model.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct BatchRescoringOptions {
+  // Number of rescoring worker threads
+  int num_workers = 1;
+  // Max number of sessions rescored in one batch
+  int max_batch_size = 8;
+  // Max time(us) the first queued N-best waits for other sessions
+  int max_wait_us = 5000;
+};
+
+// BatchRescoringScheduler coalesces the N-best lists of several sessions
+// which reach the endpoint at the same time, and rescores them with one
+// AsrModel::AttentionRescoringBatch call in a worker pool.
+// It is thread safe and can be shared by all the decoders of a server.
+class BatchRescoringScheduler {
+ public:
+  explicit BatchRescoringScheduler(const BatchRescoringOptions& opts);
+  ~BatchRescoringScheduler();
+
+  // Queue the N-best of `model`, the future is ready when rescoring_score
+  // is filled. hyps and rescoring_score must be valid until then.
+  std::future<void> AttentionRescoring(
+      AsrModel* model, const std::vector<std::vector<int>>& hyps,
+      float reverse_weight, std::vector<float>* rescoring_score);
+
+ private:
+  struct Task {
+    RescoringBatchItem item;
+    std::chrono::steady_clock::time_point arrival;
+    std::promise<void> done;
+  };
+
+  void WorkerLoop();
+
+  const BatchRescoringOptions opts_;
+  std::mutex mutex_;
+  std::condition_variable task_cond_;
+  std::deque<Task> tasks_;
+  bool stop_ = false;
+  std::vector<std::thread> workers_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(BatchRescoringScheduler);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_BATCH_RESCORING_SCHEDULER_H_
@@ -0,0 +1,193 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/batch_transcriber.h"
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <string>
+#include <utility>
+
+#include "decoder/result_cache.h"
+#include "utils/log.h"
+#include "utils/state_io.h"
+
+namespace wenet {
+
+BatchTranscriber::BatchTranscriber(
+    std::shared_ptr<FeaturePipelineConfig> feature_config,
+    std::shared_ptr<DecodeOptions> decode_config,
+    std::shared_ptr<DecodeResource> resource,
+    const BatchTranscribeOptions& opts)
+    : feature_config_(std::move(feature_config)),
+      decode_config_(*decode_config),
+      resource_(std::make_shared<DecodeResource>(*resource)) {
+  CHECK_GT(opts.max_batch_size, 0);
+  // Full context, the whole utterance is one chunk
+  decode_config_.chunk_size = -1;
+  decode_config_.num_left_chunks = -1;
+  // The offline requests have their own encoder batches, the streaming
+  // chunks don't wait for the long utterances
+  BatchEncoderOptions encoder_opts;
+  encoder_opts.max_batch_size = opts.max_batch_size;
+  encoder_opts.max_wait_us = opts.max_wait_us;
+  resource_->encoder_scheduler =
+      std::make_shared<BatchEncoderScheduler>(encoder_opts);
+  resource_->chunk_policy = nullptr;
+  // The offline batches are of the model of the first device, the replicas
+  // would batch them with the streaming chunks
+  resource_->replicas = nullptr;
+  pool_.reset(new ThreadPool(opts.max_batch_size));
+  result_fingerprint_ =
+      ResultFingerprint(*feature_config_, decode_config_, *resource_);
+}
+
+// The options which change the results of an audio, and the identities of
+// the model and the graphs of the resource, which are of this process only
+static uint64_t ResultFingerprint(const FeaturePipelineConfig& feature_config,
+                                  const DecodeOptions& opts,
+                                  const DecodeResource& resource) {
+  std::string fingerprint;
+  StateWriter writer(&fingerprint);
+  writer.Write(feature_config.num_bins);
+  writer.Write(feature_config.sample_rate);
+  writer.Write(feature_config.frame_length);
+  writer.Write(feature_config.frame_shift);
+  writer.Write(feature_config.use_vad);
+  writer.Write(feature_config.fixed_point);
+  writer.Write(opts.max_encoder_frames);
+  writer.Write(opts.rescoring_blank_threshold);
+  writer.Write(static_cast<int>(opts.encoder_out_dtype));
+  writer.Write(opts.ctc_weight);
+  writer.Write(opts.rescoring_weight);
+  writer.Write(opts.reverse_weight);
+  writer.Write(opts.rescoring_skip_margin);
+  writer.Write(opts.rescoring_skip_posterior);
+  writer.Write(opts.cascade_posterior);
+  const auto& prefix_opts = opts.ctc_prefix_search_opts;
+  writer.Write(prefix_opts.first_beam_size);
+  writer.Write(prefix_opts.second_beam_size);
+  writer.Write(prefix_opts.blank_skip_thresh);
+  writer.Write(prefix_opts.lm_weight);
+  writer.Write(prefix_opts.lm_bonus);
+  const auto& wfst_opts = opts.ctc_wfst_search_opts;
+  writer.Write(wfst_opts.beam);
+  writer.Write(wfst_opts.lattice_beam);
+  writer.Write(wfst_opts.max_active);
+  writer.Write(wfst_opts.acoustic_scale);
+  writer.Write(wfst_opts.nbest);
+  writer.Write(wfst_opts.blank_skip_thresh);
+  writer.Write(wfst_opts.rescore_lm_scale);
+  for (const void* p : {static_cast<const void*>(resource.model.get()),
+                        static_cast<const void*>(resource.fst.get()),
+                        static_cast<const void*>(resource.context_graph.get()),
+                        static_cast<const void*>(resource.ngram_lm.get()),
+                        static_cast<const void*>(resource.rescore_lm.get()),
+                        static_cast<const void*>(resource.keywords.get()),
+                        static_cast<const void*>(
+                            resource.post_processor.get())}) {
+    writer.Write(reinterpret_cast<uintptr_t>(p));
+  }
+  return ResultCache::Hash(fingerprint.data(), fingerprint.size());
+}
+
+// The requests in the pool are done before the resource is released
+BatchTranscriber::~BatchTranscriber() { pool_.reset(); }
+
+void BatchTranscriber::Transcribe(const std::vector<TranscribeAudio>& audios,
+                                  Results* results) {
+  // The audios are not copied, they outlive the wait
+  std::shared_ptr<const std::vector<TranscribeAudio>> shared(
+      &audios, [](const std::vector<TranscribeAudio>*) {});
+  std::promise<void> done;
+  TranscribeAsync(shared, [&done, results](const Results& r) {
+    *results = r;
+    done.set_value();
+  });
+  done.get_future().wait();
+}
+
+void BatchTranscriber::TranscribeAsync(
+    std::shared_ptr<const std::vector<TranscribeAudio>> audios,
+    DoneCallback done) {
+  struct Request {
+    std::shared_ptr<const std::vector<TranscribeAudio>> audios;
+    Results results;
+    std::atomic<int> num_pending{0};
+    DoneCallback done;
+  };
+  auto request = std::make_shared<Request>();
+  request->audios = audios;
+  request->results.resize(audios->size());
+  request->num_pending = audios->size();
+  request->done = std::move(done);
+  if (audios->empty()) {
+    pool_->Post([request]() { request->done(request->results); },
+                TaskPriority::kLow);
+    return;
+  }
+  std::vector<int> order(audios->size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  // In seconds, the audios may have different sample rates
+  auto duration = [&audios, this](int i) {
+    const TranscribeAudio& audio = (*audios)[i];
+    int sample_rate = audio.sample_rate > 0 ? audio.sample_rate :
+                                              feature_config_->sample_rate;
+    return static_cast<float>(audio.pcm.size()) / sample_rate;
+  };
+  std::sort(order.begin(), order.end(), [&duration](int a, int b) {
+    return duration(a) > duration(b);
+  });
+
+  // The last decoded audio posts `done` at the low priority, so the
+  // decodings queued meanwhile go first
+  for (int i : order) {
+    pool_->Post([this, request, i]() {
+      Decode((*request->audios)[i], &request->results[i]);
+      if (request->num_pending.fetch_sub(1) == 1) {
+        pool_->Post([request]() { request->done(request->results); },
+                    TaskPriority::kLow);
+      }
+    });
+  }
+}
+
+void BatchTranscriber::Decode(const TranscribeAudio& audio,
+                              std::vector<DecodeResult>* result) {
+  ResultCache* cache = resource_->result_cache.get();
+  uint64_t key = 0;
+  if (cache != nullptr) {
+    key = ResultCache::Key(audio.pcm.data(), audio.pcm.size(),
+                           audio.sample_rate, result_fingerprint_);
+    if (cache->Lookup(key, result)) return;
+  }
+  auto feature_pipeline = std::make_shared<FeaturePipeline>(*feature_config_);
+  if (audio.sample_rate > 0 &&
+      audio.sample_rate != feature_config_->sample_rate) {
+    feature_pipeline->set_input_sample_rate(audio.sample_rate);
+  }
+  feature_pipeline->AcceptWaveform(audio.pcm.data(), audio.pcm.size());
+  feature_pipeline->set_input_finished();
+  AsrDecoder decoder(feature_pipeline, resource_, decode_config_);
+  while (decoder.Decode() != DecodeState::kEndFeats) {
+  }
+  decoder.Rescoring();
+  *result = decoder.result();
+  if (cache != nullptr) cache->Insert(key, *result);
+}
+
+}  // namespace wenet
@@ -0,0 +1,98 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_BATCH_TRANSCRIBER_H_
+#define DECODER_BATCH_TRANSCRIBER_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "decoder/asr_decoder.h"
+#include "decoder/batch_encoder_scheduler.h"
+#include "frontend/feature_pipeline.h"
+#include "utils/thread_pool.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct BatchTranscribeOptions {
+  // Max number of utterances forwarded in one batch, it's also the number
+  // of the decoding threads
+  int max_batch_size = 8;
+  // Max time(us) the first utterance waits for the others of a batch
+  int max_wait_us = 5000;
+};
+
+// One audio file of an offline request, 16 bits PCM
+struct TranscribeAudio {
+  std::vector<int16_t> pcm;
+  // 0 means the sample rate of the feature config, resampled otherwise
+  int sample_rate = 0;
+};
+
+// BatchTranscriber decodes whole audio files with full context attention,
+// chunk_size = -1, so the encoder runs once on each utterance. The files of
+// a request are queued longest first and decoded by a ThreadPool of
+// max_batch_size threads, whose encoder forwards are gathered by a
+// BatchEncoderScheduler, so the utterances of close lengths are padded and
+// forwarded together. The results are looked up in and added to the
+// ResultCache of the resource, if any, so the identical audios are decoded
+// once. It is thread safe and can be shared by all the offline requests of
+// a server.
+class BatchTranscriber {
+ public:
+  BatchTranscriber(std::shared_ptr<FeaturePipelineConfig> feature_config,
+                   std::shared_ptr<DecodeOptions> decode_config,
+                   std::shared_ptr<DecodeResource> resource,
+                   const BatchTranscribeOptions& opts);
+  ~BatchTranscriber();
+
+  using Results = std::vector<std::vector<DecodeResult>>;
+  using DoneCallback = std::function<void(const Results& results)>;
+
+  // Block until all the audios are decoded, (*results)[i] is the nbest of
+  // audios[i], after the attention rescoring
+  void Transcribe(const std::vector<TranscribeAudio>& audios,
+                  Results* results);
+  // Return at once, `done` is called with the results on the pool when all
+  // the audios are decoded, e.g. to serialize and send them, so no thread
+  // waits for the batch
+  void TranscribeAsync(
+      std::shared_ptr<const std::vector<TranscribeAudio>> audios,
+      DoneCallback done);
+
+  // Counters of the encoder batches of all the requests so far
+  BatchEncoderStats encoder_stats() const {
+    return resource_->encoder_scheduler->stats();
+  }
+
+ private:
+  void Decode(const TranscribeAudio& audio, std::vector<DecodeResult>* result);
+
+  std::shared_ptr<FeaturePipelineConfig> feature_config_;
+  DecodeOptions decode_config_;
+  std::shared_ptr<DecodeResource> resource_;
+  std::unique_ptr<ThreadPool> pool_;
+  // Of the keys of resource_->result_cache, if any
+  uint64_t result_fingerprint_ = 0;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(BatchTranscriber);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_BATCH_TRANSCRIBER_H_
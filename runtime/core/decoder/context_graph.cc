@@ -3,6 +3,7 @@
 
 #include "decoder/context_graph.h"
 
+#include <algorithm>
 #include <utility>
 
 #include "fst/determinize.h"
@@ -13,17 +14,36 @@ namespace wenet {
 
 ContextGraph::ContextGraph(ContextConfig config) : config_(config) {}
 
+void ContextGraph::SetSymbols(std::shared_ptr<const SymbolStrings> symbols) {
+  CHECK(symbols != nullptr) << "Symbols table should not be nullptr!";
+  start_tag_id_ = symbols->Find(kContextStartTag);
+  end_tag_id_ = symbols->Find(kContextEndTag);
+  CHECK(start_tag_id_ != -1 && end_tag_id_ != -1)
+      << "The context tags are not reserved in the symbol table";
+  symbols_ = std::move(symbols);
+  state_offsets_.clear();
+  arcs_.clear();
+  escape_scores_.clear();
+  has_escape_.clear();
+  aho_corasick_.reset();
+}
+
+bool ContextGraph::ReadAhoCorasick(
+    const std::string& path, std::shared_ptr<const SymbolStrings> symbols) {
+  SetSymbols(std::move(symbols));
+  aho_corasick_ = AhoCorasickGraph::Read(path);
+  return aho_corasick_ != nullptr;
+}
+
+bool ContextGraph::WriteAhoCorasick(const std::string& path) const {
+  return aho_corasick_ != nullptr && aho_corasick_->Write(path);
+}
+
 void ContextGraph::BuildContextGraph(
     const std::vector<std::string>& query_contexts,
-    const std::shared_ptr<fst::SymbolTable>& symbol_table) {
-  CHECK(symbol_table != nullptr) << "Symbols table should not be nullptr!";
-  start_tag_id_ = symbol_table->AddSymbol("<context>");
-  end_tag_id_ = symbol_table->AddSymbol("</context>");
-  symbol_table_ = symbol_table;
-  if (query_contexts.empty()) {
-    if (graph_ != nullptr) graph_.reset();
-    return;
-  }
+    std::shared_ptr<const SymbolStrings> symbols) {
+  SetSymbols(std::move(symbols));
+  if (query_contexts.empty()) return;
 
   std::unique_ptr<fst::StdVectorFst> ofst(new fst::StdVectorFst());
   // State 0 is the start state and the final state.
@@ -32,27 +52,37 @@ void ContextGraph::BuildContextGraph(
   ofst->SetFinal(start_state, fst::StdArc::Weight::One());
 
   LOG(INFO) << "Contexts count size: " << query_contexts.size();
+  std::vector<AhoCorasickGraph::Phrase> phrases;
   int count = 0;
   for (const auto& context : query_contexts) {
     if (context.size() > config_.max_context_length) {
       LOG(INFO) << "Skip long context: " << context;
       continue;
     }
-    if (++count > config_.max_contexts) break;
+    if (++count > config_.max_contexts && !config_.use_aho_corasick) break;
 
     std::vector<std::string> words;
     // Split context to words by symbol table, and build the context graph.
-    bool no_oov = SplitUTF8StringToWords(Trim(context), symbol_table, &words);
+    bool no_oov = SplitUTF8StringToWords(Trim(context), *symbols_, &words);
     if (!no_oov) {
       LOG(WARNING) << "Ignore unknown word found during compilation.";
       continue;
     }
+    if (config_.use_aho_corasick) {
+      phrases.emplace_back();
+      for (const auto& word : words) {
+        phrases.back().emplace_back(
+            symbols_->Find(word),
+            config_.context_score * UTF8StringLength(word));
+      }
+      continue;
+    }
 
     int prev_state = start_state;
     int next_state = start_state;
     float escape_score = 0;
     for (size_t i = 0; i < words.size(); ++i) {
-      int word_id = symbol_table_->Find(words[i]);
+      int word_id = symbols_->Find(words[i]);
       float score = config_.context_score * UTF8StringLength(words[i]);
       next_state = (i < words.size() - 1) ? ofst->AddState() : start_state;
       ofst->AddArc(prev_state,
@@ -66,33 +96,69 @@ void ContextGraph::BuildContextGraph(
       escape_score += score;
     }
   }
+  if (config_.use_aho_corasick) {
+    aho_corasick_ = AhoCorasickGraph::Build(phrases);
+    return;
+  }
   std::unique_ptr<fst::StdVectorFst> det_fst(new fst::StdVectorFst());
   fst::Determinize(*ofst, det_fst.get());
-  graph_ = std::move(det_fst);
+  Compile(*det_fst);
 }
 
-int ContextGraph::GetNextState(int cur_state, int word_id, float* score,
-                               bool* is_start_boundary, bool* is_end_boundary) {
-  int next_state = 0;
-  for (fst::ArcIterator<fst::StdFst> aiter(*graph_, cur_state); !aiter.Done();
-       aiter.Next()) {
-    const fst::StdArc& arc = aiter.Value();
-    if (arc.ilabel == 0) {
-      // escape score, will be overwritten when ilabel equals to word id.
-      *score = arc.weight.Value();
-    } else if (arc.ilabel == word_id) {
-      next_state = arc.nextstate;
-      *score = arc.weight.Value();
-      if (cur_state == 0) {
-        *is_start_boundary = true;
+void ContextGraph::Compile(const fst::StdVectorFst& graph) {
+  int num_states = graph.NumStates();
+  state_offsets_.resize(num_states + 1);
+  escape_scores_.assign(num_states, 0);
+  has_escape_.assign(num_states, false);
+  for (int s = 0; s < num_states; ++s) {
+    state_offsets_[s] = arcs_.size();
+    for (fst::ArcIterator<fst::StdFst> aiter(graph, s); !aiter.Done();
+         aiter.Next()) {
+      const fst::StdArc& arc = aiter.Value();
+      if (arc.ilabel == 0) {
+        escape_scores_[s] = arc.weight.Value();
+        has_escape_[s] = true;
+      } else {
+        bool is_final =
+            graph.Final(arc.nextstate) == fst::StdArc::Weight::One();
+        arcs_.push_back({arc.ilabel, arc.nextstate, arc.weight.Value(),
+                         is_final});
       }
-      if (graph_->Final(arc.nextstate) == fst::StdArc::Weight::One()) {
-        *is_end_boundary = true;
-      }
-      break;
     }
+    // Stable, so the first arc of a label is matched as the fst order
+    std::stable_sort(arcs_.begin() + state_offsets_[s], arcs_.end(),
+                     [](const ContextArc& a, const ContextArc& b) {
+                       return a.label < b.label;
+                     });
+  }
+  state_offsets_[num_states] = arcs_.size();
+}
+
+int ContextGraph::GetNextState(int cur_state, int word_id, float* score,
+                               bool* is_start_boundary, bool* is_end_boundary) {
+  if (aho_corasick_ != nullptr) {
+    return aho_corasick_->GetNextState(cur_state, word_id, score,
+                                       is_start_boundary, is_end_boundary);
+  }
+  if (cur_state + 1 >= static_cast<int>(state_offsets_.size())) return 0;
+  auto begin = arcs_.begin() + state_offsets_[cur_state];
+  auto end = arcs_.begin() + state_offsets_[cur_state + 1];
+  auto it = std::lower_bound(
+      begin, end, word_id,
+      [](const ContextArc& arc, int label) { return arc.label < label; });
+  if (it == end || it->label != word_id) {
+    // escape score, clean the context score of the unmatched context
+    if (has_escape_[cur_state]) *score = escape_scores_[cur_state];
+    return 0;
+  }
+  *score = it->score;
+  if (cur_state == 0) {
+    *is_start_boundary = true;
+  }
+  if (it->is_end_boundary) {
+    *is_end_boundary = true;
   }
-  return next_state;
+  return it->next_state;
 }
 
 }  // namespace wenet
@@ -12,21 +12,40 @@
 #include "fst/fst.h"
 #include "fst/vector-fst.h"
 
+#include "decoder/aho_corasick_graph.h"
+#include "utils/string.h"
+
 namespace wenet {
 
 using StateId = fst::StdArc::StateId;
 
+// The tags around the matched contexts in the results. They are reserved
+// in the symbol tables when they're loaded, so the shared tables are never
+// changed by the graphs.
+const char kContextStartTag[] = "<context>";
+const char kContextEndTag[] = "</context>";
+
 struct ContextConfig {
   int max_contexts = 5000;
   int max_context_length = 100;
   float context_score = 3.0;
+  // Build the Aho-Corasick automaton instead of the determinized fst, for
+  // the very large lists, max_contexts doesn't apply then
+  bool use_aho_corasick = false;
 };
 
 class ContextGraph {
  public:
   explicit ContextGraph(ContextConfig config);
+  // symbols must have the context tags reserved
   void BuildContextGraph(const std::vector<std::string>& query_context,
-                         const std::shared_ptr<fst::SymbolTable>& symbol_table);
+                         std::shared_ptr<const SymbolStrings> symbols);
+  // Read the automaton written by WriteAhoCorasick(), it's mapped into
+  // memory, so the graph of a huge list is loaded at once
+  bool ReadAhoCorasick(const std::string& path,
+                       std::shared_ptr<const SymbolStrings> symbols);
+  bool WriteAhoCorasick(const std::string& path) const;
+  // Each lookup is a binary search in the arcs of cur_state
   int GetNextState(int cur_state, int word_id, float* score,
                    bool* is_start_boundary, bool* is_end_boundary);
 
@@ -34,11 +53,31 @@ class ContextGraph {
   int end_tag_id() { return end_tag_id_; }
 
  private:
+  struct ContextArc {
+    int label;
+    int next_state;
+    float score;
+    bool is_end_boundary;  // next_state is final
+  };
+
+  // Compile the determinized graph into the arrays below
+  void Compile(const fst::StdVectorFst& graph);
+  void SetSymbols(std::shared_ptr<const SymbolStrings> symbols);
+
   int start_tag_id_ = -1;
   int end_tag_id_ = -1;
   ContextConfig config_;
-  std::shared_ptr<fst::SymbolTable> symbol_table_ = nullptr;
-  std::unique_ptr<fst::StdVectorFst> graph_ = nullptr;
+  std::shared_ptr<const SymbolStrings> symbols_ = nullptr;
+  // The arcs of state s are arcs_[state_offsets_[s], state_offsets_[s + 1]),
+  // sorted by label, without the escape arcs
+  std::vector<int> state_offsets_;
+  std::vector<ContextArc> arcs_;
+  // Score of the escape arc of each state, which cleans the context score
+  // when the word doesn't match any arc
+  std::vector<float> escape_scores_;
+  std::vector<bool> has_escape_;
+  // Used instead of the arrays above if it's not nullptr
+  std::unique_ptr<AhoCorasickGraph> aho_corasick_ = nullptr;
   DISALLOW_COPY_AND_ASSIGN(ContextGraph);
 };
 
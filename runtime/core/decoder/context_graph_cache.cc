@@ -0,0 +1,66 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/context_graph_cache.h"
+
+#include "utils/log.h"
+
+namespace wenet {
+
+ContextGraphCache::ContextGraphCache(
+    const ContextConfig& config,
+    std::shared_ptr<const SymbolStrings> symbols, int capacity)
+    : config_(config), symbols_(std::move(symbols)), capacity_(capacity) {
+  CHECK(symbols_ != nullptr);
+  CHECK_GT(capacity_, 0);
+}
+
+ContextGraphCache::GraphFuture ContextGraphCache::Get(
+    const std::vector<std::string>& contexts) {
+  std::string key;
+  for (const auto& context : contexts) {
+    key += context;
+    key += '\n';
+  }
+  // Destroyed after the lock is released, it waits for the build if it's
+  // still running
+  GraphFuture evicted;
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->second;
+  }
+  VLOG(1) << "Build context graph of " << contexts.size() << " contexts";
+  ContextConfig config = config_;
+  std::shared_ptr<const SymbolStrings> symbols = symbols_;
+  GraphFuture graph =
+      std::async(std::launch::async, [config, symbols, contexts]() {
+        auto context_graph = std::make_shared<ContextGraph>(config);
+        context_graph->BuildContextGraph(contexts, symbols);
+        return context_graph;
+      }).share();
+  lru_.emplace_front(key, graph);
+  entries_[key] = lru_.begin();
+  if (lru_.size() > capacity_) {
+    // The sessions which use the evicted graph keep it alive
+    evicted = std::move(lru_.back().second);
+    entries_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+  return graph;
+}
+
+}  // namespace wenet
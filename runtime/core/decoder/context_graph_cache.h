@@ -0,0 +1,71 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef DECODER_CONTEXT_GRAPH_CACHE_H_
+#define DECODER_CONTEXT_GRAPH_CACHE_H_
+
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "decoder/context_graph.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// ContextGraphCache keeps the compiled context graphs of the most recently
+// used phrase lists, so the sessions which bias to the same contacts or
+// product names share one graph. A missed list is built on a background
+// thread. It is thread safe and can be shared by all the sessions of a
+// server.
+class ContextGraphCache {
+ public:
+  ContextGraphCache(const ContextConfig& config,
+                    std::shared_ptr<const SymbolStrings> symbols,
+                    int capacity);
+
+  using GraphFuture = std::shared_future<std::shared_ptr<ContextGraph>>;
+  // Return the graph of contexts, the future is ready when it's built
+  GraphFuture Get(const std::vector<std::string>& contexts);
+
+  int size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+  }
+
+ private:
+  // The most recently used one is at the front
+  using LruList = std::list<std::pair<std::string, GraphFuture>>;
+
+  ContextConfig config_;
+  std::shared_ptr<const SymbolStrings> symbols_;
+  int capacity_;
+  mutable std::mutex mutex_;
+  LruList lru_;
+  // The contexts joined by '\n' => the entry in lru_
+  std::unordered_map<std::string, LruList::iterator> entries_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(ContextGraphCache);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_CONTEXT_GRAPH_CACHE_H_
@@ -0,0 +1,194 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/ctc_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <utility>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+static const char kInfoSuffix[] = "/info";
+
+bool CtcCacheWriter::Open(const std::string& wspecifier, int topk) {
+  topk_ = topk;
+  return writer_.Open(wspecifier);
+}
+
+void CtcCacheWriter::Write(const std::string& key,
+                           const CtcCacheEntry& entry) {
+  int vocab_size = 0;
+  int num_frames = 0;
+  for (const auto& chunk : entry.chunks) {
+    if (!chunk.empty()) vocab_size = chunk.cols();
+    num_frames += chunk.rows();
+  }
+  int topk = topk_ > 0 && topk_ < vocab_size ? topk_ : 0;
+
+  FeatureMatrix info(1, 4 + entry.chunks.size());
+  info(0, 0) = vocab_size;
+  info(0, 1) = topk;
+  info(0, 2) = entry.chunk_size;
+  info(0, 3) = entry.num_feature_frames;
+  for (size_t i = 0; i < entry.chunks.size(); ++i) {
+    info(0, 4 + i) = entry.chunks[i].rows();
+  }
+  writer_.Write(key + kInfoSuffix, info);
+
+  ctc_.Resize(num_frames, topk > 0 ? 2 * topk : vocab_size);
+  std::vector<int> ids(vocab_size);
+  int row = 0;
+  for (const auto& chunk : entry.chunks) {
+    for (int r = 0; r < chunk.rows(); ++r, ++row) {
+      const float* probs = chunk.Row(r);
+      float* out = ctc_.Row(row);
+      if (topk == 0) {
+        memcpy(out, probs, sizeof(float) * vocab_size);
+        continue;
+      }
+      std::iota(ids.begin(), ids.end(), 0);
+      std::partial_sort(ids.begin(), ids.begin() + topk, ids.end(),
+                        [probs](int a, int b) { return probs[a] > probs[b]; });
+      // The ids are exact in float up to 2^24
+      for (int j = 0; j < topk; ++j) {
+        out[j] = probs[ids[j]];
+        out[topk + j] = ids[j];
+      }
+    }
+  }
+  writer_.Write(key + "/ctc", ctc_);
+  if (!entry.encoder_out.empty()) {
+    writer_.Write(key + "/encoder", entry.encoder_out);
+  }
+}
+
+bool CtcCacheReader::Open(const std::string& rspecifier) {
+  if (!reader_.Open(rspecifier)) return false;
+  Next();
+  return true;
+}
+
+void CtcCacheReader::Next() {
+  done_ = reader_.Done();
+  if (done_) return;
+  const std::string& info_key = reader_.Key();
+  const size_t suffix_size = sizeof(kInfoSuffix) - 1;
+  CHECK(info_key.size() > suffix_size &&
+        info_key.compare(info_key.size() - suffix_size, suffix_size,
+                         kInfoSuffix) == 0)
+      << "Not an entry of CtcCacheWriter: " << info_key;
+  key_ = info_key.substr(0, info_key.size() - suffix_size);
+  const FeatureMatrix& info = reader_.Value();
+  CHECK_EQ(info.rows(), 1);
+  CHECK_GE(info.cols(), 4);
+  int vocab_size = info(0, 0);
+  int topk = info(0, 1);
+  auto entry = std::make_shared<CtcCacheEntry>();
+  entry->chunk_size = info(0, 2);
+  entry->num_feature_frames = info(0, 3);
+  std::vector<int> chunk_sizes;
+  for (int i = 4; i < info.cols(); ++i) {
+    chunk_sizes.push_back(info(0, i));
+  }
+
+  reader_.Next();
+  CHECK(!reader_.Done() && reader_.Key() == key_ + "/ctc")
+      << "No ctc log probs of " << key_;
+  const LogProbMatrix& ctc = reader_.Value();
+  CHECK_EQ(ctc.rows(),
+           std::accumulate(chunk_sizes.begin(), chunk_sizes.end(), 0));
+  CHECK_EQ(ctc.cols(), topk > 0 ? 2 * topk : vocab_size);
+  const float kNegInf = -std::numeric_limits<float>::infinity();
+  entry->chunks.resize(chunk_sizes.size());
+  int row = 0;
+  for (size_t i = 0; i < chunk_sizes.size(); ++i) {
+    LogProbMatrix& chunk = entry->chunks[i];
+    chunk.Resize(chunk_sizes[i], vocab_size);
+    for (int r = 0; r < chunk.rows(); ++r, ++row) {
+      const float* in = ctc.Row(row);
+      float* probs = chunk.Row(r);
+      if (topk == 0) {
+        memcpy(probs, in, sizeof(float) * vocab_size);
+        continue;
+      }
+      std::fill(probs, probs + vocab_size, kNegInf);
+      for (int j = 0; j < topk; ++j) {
+        int id = in[topk + j];
+        CHECK(id >= 0 && id < vocab_size);
+        probs[id] = in[j];
+      }
+    }
+  }
+
+  reader_.Next();
+  if (!reader_.Done() && reader_.Key() == key_ + "/encoder") {
+    entry->encoder_out = reader_.Value();
+    reader_.Next();
+  }
+  value_ = std::move(entry);
+}
+
+ReplayAsrModel::ReplayAsrModel(std::shared_ptr<AsrModel> model,
+                               std::shared_ptr<const CtcCacheEntry> entry)
+    : model_(std::move(model)), entry_(std::move(entry)) {
+  right_context_ = model_->right_context();
+  subsampling_rate_ = model_->subsampling_rate();
+  sos_ = model_->sos();
+  eos_ = model_->eos();
+  is_bidirectional_decoder_ = model_->is_bidirectional_decoder();
+  chunk_size_ = model_->chunk_size();
+  num_left_chunks_ = model_->num_left_chunks();
+}
+
+void ReplayAsrModel::Reset() {
+  offset_ = 0;
+  next_chunk_ = 0;
+  encoder_out_restored_ = false;
+  cached_feature_.Resize(0, 0);
+  model_->Reset();
+}
+
+void ReplayAsrModel::ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                                        LogProbMatrix* ctc_prob) {
+  if (next_chunk_ < entry_->chunks.size()) {
+    *ctc_prob = entry_->chunks[next_chunk_++];
+  } else {
+    ctc_prob->Resize(0, 0);
+  }
+  offset_ += ctc_prob->rows();
+}
+
+void ReplayAsrModel::AttentionRescoring(
+    const std::vector<std::vector<int>>& hyps, float reverse_weight,
+    std::vector<float>* rescoring_score) {
+  if (!encoder_out_restored_) {
+    CHECK(!entry_->encoder_out.empty())
+        << "No encoder outputs are cached for the rescoring";
+    CHECK(model_->SetEncoderOut(entry_->encoder_out));
+    encoder_out_restored_ = true;
+  }
+  model_->AttentionRescoring(hyps, reverse_weight, rescoring_score);
+}
+
+std::shared_ptr<AsrModel> ReplayAsrModel::Copy() const {
+  return std::make_shared<ReplayAsrModel>(model_->Copy(), entry_);
+}
+
+}  // namespace wenet
@@ -0,0 +1,118 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef DECODER_CTC_CACHE_H_
+#define DECODER_CTC_CACHE_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "decoder/asr_model.h"
+#include "frontend/feature_io.h"
+#include "utils/matrix.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// The model outputs of one utterance, which are all the search and the
+// rescoring need, so the search options, e.g. the beams, blank_skip_thresh,
+// context_score or the LM weights, could be swept without the encoder.
+struct CtcCacheEntry {
+  // The chunks are replayed by the same reads of the feature pipeline
+  int chunk_size = 16;
+  int num_feature_frames = 0;
+  // The ctc log probs of each forwarded chunk, (T_i, vocab_size)
+  std::vector<LogProbMatrix> chunks;
+  // (T, dim), empty if the model doesn't support GetEncoderOut()
+  FeatureMatrix encoder_out;
+};
+
+// Writer of the entries to a Kaldi archive, e.g. "ark,scp:ctc.ark,ctc.scp".
+// An entry is written as 3 matrices, "key/info" of [vocab_size, topk,
+// chunk_size, num_feature_frames, T_0, T_1, ...], "key/ctc" of all the
+// chunks and the optional "key/encoder". With topk > 0 only the topk log
+// probs of each frame are kept, (T, 2 * topk) of the values and the ids,
+// it's lossless for the prefix beam search with first_beam_size <= topk,
+// and for a model pruned by --ctc_topk if topk > ctc_topk.
+class CtcCacheWriter {
+ public:
+  bool Open(const std::string& wspecifier, int topk = 0);
+  void Write(const std::string& key, const CtcCacheEntry& entry);
+  void Close() { writer_.Close(); }
+
+ private:
+  FeatureWriter writer_;
+  int topk_ = 0;
+  LogProbMatrix ctc_;
+};
+
+// Sequential reader of the archive of CtcCacheWriter, the archive is mapped
+// into memory and the pruned log probs are scattered back to the full
+// vocabulary, the others are -inf.
+class CtcCacheReader {
+ public:
+  bool Open(const std::string& rspecifier);
+  bool Done() const { return done_; }
+  const std::string& Key() const { return key_; }
+  std::shared_ptr<const CtcCacheEntry> Value() const { return value_; }
+  void Next();
+
+ private:
+  FeatureReader reader_;
+  bool done_ = true;
+  std::string key_;
+  std::shared_ptr<CtcCacheEntry> value_;
+};
+
+// A model which replays the cached outputs of one utterance instead of
+// running the encoder, each ForwardEncoder() returns the next chunk. The
+// chunks have the same number of features as they were forwarded, so the
+// decoder must be fed num_feature_frames (zero) frames with the same
+// chunk_size, and the sentence can't be split by the endpoints. The
+// attention rescoring is done by the real model against the cached encoder
+// outputs.
+class ReplayAsrModel : public AsrModel {
+ public:
+  ReplayAsrModel(std::shared_ptr<AsrModel> model,
+                 std::shared_ptr<const CtcCacheEntry> entry);
+
+  void Reset() override;
+  void AttentionRescoring(const std::vector<std::vector<int>>& hyps,
+                          float reverse_weight,
+                          std::vector<float>* rescoring_score) override;
+  std::shared_ptr<AsrModel> Copy() const override;
+  bool GetEncoderOut(FeatureMatrix* encoder_out) const override {
+    *encoder_out = entry_->encoder_out;
+    return true;
+  }
+
+ protected:
+  void ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                          LogProbMatrix* ctc_prob) override;
+
+ private:
+  std::shared_ptr<AsrModel> model_;
+  std::shared_ptr<const CtcCacheEntry> entry_;
+  size_t next_chunk_ = 0;
+  bool encoder_out_restored_ = false;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(ReplayAsrModel);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_CTC_CACHE_H_
@@ -9,6 +9,7 @@
 #include <vector>
 
 #include "utils/log.h"
+#include "utils/state_io.h"
 
 namespace wenet {
 
@@ -35,20 +36,80 @@ static bool RuleActivated(const CtcEndpointRule& rule,
   return ans;
 }
 
-bool CtcEndpoint::IsEndpoint(
-    const std::vector<std::vector<float>>& ctc_log_probs,
-    bool decoded_something) {
-  for (int t = 0; t < ctc_log_probs.size(); ++t) {
-    const auto& logp_t = ctc_log_probs[t];
-    float blank_prob = expf(logp_t[config_.blank]);
+void CtcEndpoint::CountFrames(const float* blank_logp, int num_frames,
+                              int stride, int* num_frames_decoded,
+                              int* num_frames_trailing_blank) const {
+  for (int t = 0; t < num_frames; ++t) {
+    float blank_prob = expf(blank_logp[static_cast<size_t>(t) * stride]);
 
-    num_frames_decoded_++;
+    (*num_frames_decoded)++;
     if (blank_prob > config_.blank_threshold) {
-      num_frames_trailing_blank_++;
+      (*num_frames_trailing_blank)++;
     } else {
-      num_frames_trailing_blank_ = 0;
+      *num_frames_trailing_blank = 0;
     }
   }
+}
+
+bool CtcEndpoint::MayBeEndpoint(const LogProbMatrix& ctc_log_probs) const {
+  int num_frames_decoded = num_frames_decoded_;
+  int num_frames_trailing_blank = num_frames_trailing_blank_;
+  if (!ctc_log_probs.empty()) {
+    CountFrames(ctc_log_probs.Row(0) + config_.blank, ctc_log_probs.rows(),
+                ctc_log_probs.stride(), &num_frames_decoded,
+                &num_frames_trailing_blank);
+  }
+  return MayBeActivated(num_frames_decoded, num_frames_trailing_blank);
+}
+
+bool CtcEndpoint::MayBeEndpoint(
+    const SparseLogProbMatrix& ctc_log_probs) const {
+  int num_frames_decoded = num_frames_decoded_;
+  int num_frames_trailing_blank = num_frames_trailing_blank_;
+  if (!ctc_log_probs.empty()) {
+    CountFrames(ctc_log_probs.Values(0), ctc_log_probs.rows(),
+                ctc_log_probs.values().stride(), &num_frames_decoded,
+                &num_frames_trailing_blank);
+  }
+  return MayBeActivated(num_frames_decoded, num_frames_trailing_blank);
+}
+
+bool CtcEndpoint::MayBeActivated(int num_frames_decoded,
+                                 int num_frames_trailing_blank) const {
+  CHECK_GT(frame_shift_in_ms_, 0);
+  int utterance_length = num_frames_decoded * frame_shift_in_ms_;
+  int trailing_silence = num_frames_trailing_blank * frame_shift_in_ms_;
+  for (const CtcEndpointRule* rule :
+       {&config_.rule1, &config_.rule2, &config_.rule3}) {
+    if (trailing_silence >= rule->min_trailing_silence &&
+        utterance_length >= rule->min_utterance_length) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CtcEndpoint::IsEndpoint(const LogProbMatrix& ctc_log_probs,
+                             bool decoded_something) {
+  if (!ctc_log_probs.empty()) {
+    CountFrames(ctc_log_probs.Row(0) + config_.blank, ctc_log_probs.rows(),
+                ctc_log_probs.stride(), &num_frames_decoded_,
+                &num_frames_trailing_blank_);
+  }
+  return RulesActivated(decoded_something);
+}
+
+bool CtcEndpoint::IsEndpoint(const SparseLogProbMatrix& ctc_log_probs,
+                             bool decoded_something) {
+  if (!ctc_log_probs.empty()) {
+    CountFrames(ctc_log_probs.Values(0), ctc_log_probs.rows(),
+                ctc_log_probs.values().stride(), &num_frames_decoded_,
+                &num_frames_trailing_blank_);
+  }
+  return RulesActivated(decoded_something);
+}
+
+bool CtcEndpoint::RulesActivated(bool decoded_something) const {
   CHECK_GE(num_frames_decoded_, num_frames_trailing_blank_);
   CHECK_GT(frame_shift_in_ms_, 0);
   int utterance_length = num_frames_decoded_ * frame_shift_in_ms_;
@@ -65,4 +126,14 @@ bool CtcEndpoint::IsEndpoint(
   return false;
 }
 
+void CtcEndpoint::SaveState(StateWriter* writer) const {
+  writer->Write<int32_t>(num_frames_decoded_);
+  writer->Write<int32_t>(num_frames_trailing_blank_);
+}
+
+bool CtcEndpoint::RestoreState(StateReader* reader) {
+  return reader->Read(&num_frames_decoded_) &&
+         reader->Read(&num_frames_trailing_blank_);
+}
+
 }  // namespace wenet
@@ -6,8 +6,14 @@
 
 #include <vector>
 
+#include "utils/matrix.h"
+#include "utils/sparse_log_prob_matrix.h"
+
 namespace wenet {
 
+class StateReader;
+class StateWriter;
+
 struct CtcEndpointRule {
   bool must_decoded_sth;
   int min_trailing_silence;
@@ -48,14 +54,46 @@ class CtcEndpoint {
   void Reset();
   /// This function returns true if this set of endpointing rules thinks we
   /// should terminate decoding.
-  bool IsEndpoint(const std::vector<std::vector<float>>& ctc_log_probs,
+  bool IsEndpoint(const LogProbMatrix& ctc_log_probs,
                   bool decoded_something);
+  /// The same as above, for the log probs pruned by the model
+  bool IsEndpoint(const SparseLogProbMatrix& ctc_log_probs,
+                  bool decoded_something);
+  /// Whether IsEndpoint() of the next ctc_log_probs could return true,
+  /// whatever is decoded by then. The frames are not counted.
+  bool MayBeEndpoint(const LogProbMatrix& ctc_log_probs) const;
+  bool MayBeEndpoint(const SparseLogProbMatrix& ctc_log_probs) const;
+  /// Count num_frames frames as silence without the ctc posteriors, e.g.
+  /// the frames the VAD skipped.
+  void AddSilence(int num_frames) {
+    num_frames_decoded_ += num_frames;
+    num_frames_trailing_blank_ += num_frames;
+  }
+
+  /// The frames counted so far, see AsrDecoder::SaveState()
+  void SaveState(StateWriter* writer) const;
+  bool RestoreState(StateReader* reader);
+
+  /// The trailing silence counted so far
+  int trailing_silence_ms() const {
+    return num_frames_trailing_blank_ * frame_shift_in_ms_;
+  }
 
   void frame_shift_in_ms(int frame_shift_in_ms) {
     frame_shift_in_ms_ = frame_shift_in_ms;
   }
 
  private:
+  /// Count the frames of the blank log probs blank_logp[t * stride]
+  void CountFrames(const float* blank_logp, int num_frames, int stride,
+                   int* num_frames_decoded,
+                   int* num_frames_trailing_blank) const;
+  /// Whether a rule may be activated by the frames counted
+  bool MayBeActivated(int num_frames_decoded,
+                      int num_frames_trailing_blank) const;
+  /// Whether a rule is activated by the frames counted so far
+  bool RulesActivated(bool decoded_something) const;
+
   CtcEndpointConfig config_;
   int frame_shift_in_ms_ = -1;
   int num_frames_decoded_ = 0;
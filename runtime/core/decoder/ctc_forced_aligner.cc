@@ -0,0 +1,112 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/ctc_forced_aligner.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+bool CtcForcedAligner::Align(const LogProbMatrix& logp,
+                             const std::vector<int>& tokens,
+                             std::vector<CtcAlignedToken>* alignment) {
+  alignment->clear();
+  const int num_frames = logp.rows();
+  const int num_tokens = tokens.size();
+  // The frames of the tokens and of the blanks between the repeats
+  int min_frames = num_tokens;
+  for (int i = 1; i < num_tokens; ++i) {
+    if (tokens[i] == tokens[i - 1]) min_frames++;
+  }
+  if (num_frames == 0 || num_frames < min_frames) return false;
+
+  const int num_states = 2 * num_tokens + 1;
+  states_.assign(num_states, opts_.blank);
+  skip_.assign(num_states, -kFloatMax);
+  for (int i = 0; i < num_tokens; ++i) {
+    CHECK(tokens[i] >= 0 && tokens[i] < logp.cols() &&
+          tokens[i] != opts_.blank);
+    states_[2 * i + 1] = tokens[i];
+    if (i > 0 && tokens[i] != tokens[i - 1]) skip_[2 * i + 1] = 0;
+  }
+  emit_.resize(num_states);
+  prev_.assign(num_states + 2, -kFloatMax);
+  cur_.assign(num_states + 2, -kFloatMax);
+  back_.assign(static_cast<size_t>(num_frames) * num_states, 0);
+
+  // Start by the first blank or the first token
+  const float* row = logp.Row(0);
+  cur_[2] = row[states_[0]];
+  if (num_states > 1) cur_[3] = row[states_[1]];
+  for (int t = 1; t < num_frames; ++t) {
+    std::swap(prev_, cur_);
+    // The states reachable in t + 1 frames which can still reach the last
+    // two states in the frames left, the band only moves forward, so the
+    // scores out of it are still -kFloatMax
+    const int lo = std::max(0, num_states - 2 - 2 * (num_frames - 1 - t));
+    const int hi = std::min(num_states - 1, 2 * t + 1);
+    row = logp.Row(t);
+    for (int s = lo; s <= hi; ++s) emit_[s] = row[states_[s]];
+    const float* prev = prev_.data() + 2;
+    float* cur = cur_.data() + 2;
+    const float* emit = emit_.data();
+    const float* skips = skip_.data();
+    uint8_t* back = back_.data() + static_cast<size_t>(t) * num_states;
+    for (int s = lo; s <= hi; ++s) {
+      const float stay = prev[s];
+      const float next = prev[s - 1];
+      const float skip = prev[s - 2] + skips[s];
+      const bool take_next = next > stay;
+      const float best = take_next ? next : stay;
+      const bool take_skip = skip > best;
+      cur[s] = (take_skip ? skip : best) + emit[s];
+      back[s] = take_skip ? 2 : static_cast<uint8_t>(take_next);
+    }
+  }
+
+  // End by the last token or the last blank
+  const float* last = cur_.data() + 2;
+  int s = num_states - 1;
+  if (num_states > 1 && last[num_states - 2] > last[s]) s = num_states - 2;
+  score_ = last[s];
+  if (score_ <= -kFloatMax / 2) return false;
+  path_.resize(num_frames);
+  for (int t = num_frames - 1; t >= 0; --t) {
+    path_[t] = s;
+    s -= back_[static_cast<size_t>(t) * num_states + s];
+  }
+
+  for (int t = 0; t < num_frames; ++t) {
+    s = path_[t];
+    if (s % 2 == 0) continue;
+    if (t == 0 || path_[t - 1] != s) {
+      alignment->push_back({states_[s], t, t + 1, 0});
+    }
+    CtcAlignedToken& token = alignment->back();
+    token.end = t + 1;
+    // The sum of the log posteriors for now
+    token.confidence += logp(t, states_[s]);
+  }
+  CHECK_EQ(alignment->size(), num_tokens);
+  for (auto& token : *alignment) {
+    token.confidence = std::exp(token.confidence / (token.end - token.start));
+  }
+  return true;
+}
+
+}  // namespace wenet
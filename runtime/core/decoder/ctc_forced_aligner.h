@@ -0,0 +1,89 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef DECODER_CTC_FORCED_ALIGNER_H_
+#define DECODER_CTC_FORCED_ALIGNER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "utils/matrix.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct CtcForcedAlignerOptions {
+  int blank = 0;  // blank id
+};
+
+// A token of the transcript and its frames, after subsampling
+struct CtcAlignedToken {
+  int token;
+  // The frames [start, end) are of the token, at least one
+  int start;
+  int end;
+  // The geometric mean of the posteriors of the token over its frames
+  float confidence;
+};
+
+// CTC forced alignment of a known transcript, the Viterbi search over the
+// tokens of the transcript interleaved with the blanks, on the CTC log
+// posteriors of the whole utterance. A state of the search is a token or a
+// blank of the transcript, so it's O(T * L) for T frames and L tokens,
+// without building the graph of the transcript. At frame t only the states
+// which are reachable from the start and can still reach the end are
+// searched, the band of the transcript over the frames, and the states of
+// a frame are updated by one loop without branches, which vectorizes. Not
+// thread safe, each thread has its own, the buffers are reused between the
+// calls.
+class CtcForcedAligner {
+ public:
+  explicit CtcForcedAligner(const CtcForcedAlignerOptions& opts)
+      : opts_(opts) {}
+
+  // Align the tokens of the transcript, without blanks, to logp of
+  // (T, vocab). Return false if they don't fit in the frames, e.g. a
+  // repeated token needs a blank between them.
+  bool Align(const LogProbMatrix& logp, const std::vector<int>& tokens,
+             std::vector<CtcAlignedToken>* alignment);
+
+  // The log likelihood of the best path of the last Align()
+  float score() const { return score_; }
+
+ private:
+  const CtcForcedAlignerOptions opts_;
+  float score_ = 0;
+  // The tokens interleaved with the blanks, blank t1 blank t2 ... blank
+  std::vector<int> states_;
+  // 0 if the state may be entered from the one before the last, i.e. it's
+  // a token which is not a repeat of the last one, -kFloatMax otherwise
+  std::vector<float> skip_;
+  std::vector<float> emit_;
+  // The scores of the last frame and of the current one, offset by two so
+  // the predecessors of the first states are -kFloatMax
+  std::vector<float> prev_;
+  std::vector<float> cur_;
+  // How many states back the best predecessor of each state of each frame
+  // is, 0, 1 or 2
+  std::vector<uint8_t> back_;
+  std::vector<int> path_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(CtcForcedAligner);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_CTC_FORCED_ALIGNER_H_
@@ -0,0 +1,186 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/ctc_keyword_spotting.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <utility>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+std::shared_ptr<KeywordSet> KeywordSet::Build(
+    const std::vector<std::string>& lines, const SymbolStrings& symbols,
+    float default_threshold) {
+  auto keyword_set = std::make_shared<KeywordSet>();
+  for (const std::string& line : lines) {
+    Keyword keyword;
+    keyword.threshold = default_threshold;
+    size_t tab = line.find('\t');
+    keyword.phrase = Trim(line.substr(0, tab));
+    if (tab != std::string::npos) {
+      keyword.threshold = std::stof(line.substr(tab + 1));
+    }
+    if (keyword.phrase.empty()) continue;
+    std::vector<std::string> words;
+    if (!SplitUTF8StringToWords(keyword.phrase, symbols, &words)) {
+      LOG(WARNING) << "Skip the keyword of unknown words: " << keyword.phrase;
+      continue;
+    }
+    for (const std::string& word : words) {
+      keyword.tokens.push_back(symbols.Find(word));
+    }
+    keyword_set->num_states_ += keyword.tokens.size();
+    keyword_set->keywords_.emplace_back(std::move(keyword));
+  }
+  LOG(INFO) << "Keywords count size: " << keyword_set->keywords_.size();
+  return keyword_set;
+}
+
+std::shared_ptr<KeywordSet> KeywordSet::Read(const std::string& path,
+                                             const SymbolStrings& symbols,
+                                             float default_threshold) {
+  std::ifstream is(path);
+  if (!is) return nullptr;
+  std::vector<std::string> lines;
+  std::string line;
+  while (getline(is, line)) {
+    lines.emplace_back(std::move(line));
+  }
+  return Build(lines, symbols, default_threshold);
+}
+
+CtcKeywordSpotting::CtcKeywordSpotting(
+    const CtcKeywordSpottingOptions& opts,
+    std::shared_ptr<const KeywordSet> keywords)
+    : opts_(opts), keywords_(std::move(keywords)) {
+  CHECK(keywords_ != nullptr);
+  log_min_token_prob_ = std::log(opts_.min_token_prob);
+  offsets_.push_back(0);
+  for (const auto& keyword : keywords_->keywords()) {
+    for (size_t j = 0; j < keyword.tokens.size(); ++j) {
+      peaks_.emplace_back(j + 1);
+    }
+    offsets_.push_back(offsets_.back() + keyword.tokens.size());
+  }
+  states_.resize(offsets_.back());
+  Reset();
+}
+
+void CtcKeywordSpotting::Reset() {
+  abs_time_step_ = 0;
+  num_active_ = 0;
+  std::fill(states_.begin(), states_.end(), State());
+  detections_.clear();
+  hypotheses_.resize(1);
+  hypotheses_[0].clear();
+  times_.resize(1);
+  times_[0].clear();
+  likelihood_.assign(1, 0.0);
+}
+
+void CtcKeywordSpotting::Search(const LogProbMatrix& logp) {
+  const auto& keywords = keywords_->keywords();
+  for (int t = 0; t < logp.rows(); ++t, ++abs_time_step_) {
+    const float* logp_t = logp.Row(t);
+    for (size_t k = 0; k < keywords.size(); ++k) {
+      const std::vector<int>& tokens = keywords[k].tokens;
+      const int num_tokens = tokens.size();
+      const int offset = offsets_[k];
+      // From the last token backwards, so a state is extended by the one
+      // before it as of the last frame
+      for (int j = num_tokens - 1; j >= 0; --j) {
+        State& state = states_[offset + j];
+        if (state.peak >= 0 &&
+            abs_time_step_ - state.peak > opts_.max_token_gap) {
+          state = State();
+          num_active_--;
+        }
+        float token_logp = logp_t[tokens[j]];
+        if (token_logp < log_min_token_prob_) {
+          state.blank_after = true;
+          continue;
+        }
+        float score = token_logp;
+        int start = abs_time_step_;
+        if (j > 0) {
+          const State& prev = states_[offset + j - 1];
+          if (prev.peak < 0 ||
+              abs_time_step_ - prev.peak > opts_.max_token_gap) {
+            continue;
+          }
+          // The repeated token needs a blank in between, as in CTC
+          if (tokens[j] == tokens[j - 1] && !prev.blank_after) continue;
+          score += prev.score;
+          start = prev.start;
+        }
+        if (score <= state.score) continue;
+        // A higher peak of the same token or a better match
+        if (state.peak < 0) num_active_++;
+        state.score = score;
+        state.start = start;
+        state.peak = abs_time_step_;
+        state.blank_after = false;
+        std::vector<int>& peaks = peaks_[offset + j];
+        if (j > 0) {
+          const std::vector<int>& prev_peaks = peaks_[offset + j - 1];
+          std::copy(prev_peaks.begin(), prev_peaks.end(), peaks.begin());
+        }
+        peaks[j] = abs_time_step_;
+        if (j == num_tokens - 1 &&
+            std::exp(score / num_tokens) >= keywords[k].threshold) {
+          Detect(k, state);
+          ResetKeyword(k);
+          break;
+        }
+      }
+    }
+  }
+}
+
+void CtcKeywordSpotting::Detect(int keyword, const State& state) {
+  const KeywordSet::Keyword& kw = keywords_->keywords()[keyword];
+  const int num_tokens = kw.tokens.size();
+  Detection detection;
+  detection.keyword = keyword;
+  detection.start = state.start;
+  detection.end = state.peak;
+  detection.confidence = std::exp(state.score / num_tokens);
+  detections_.push_back(detection);
+  VLOG(1) << "Keyword " << kw.phrase << " is detected at " << state.peak
+          << ", confidence " << detection.confidence;
+  hypotheses_[0].insert(hypotheses_[0].end(), kw.tokens.begin(),
+                        kw.tokens.end());
+  const std::vector<int>& peaks = peaks_[offsets_[keyword] + num_tokens - 1];
+  times_[0].insert(times_[0].end(), peaks.begin(), peaks.end());
+  likelihood_[0] += state.score;
+}
+
+void CtcKeywordSpotting::ResetKeyword(int keyword) {
+  for (int s = offsets_[keyword]; s < offsets_[keyword + 1]; ++s) {
+    if (states_[s].peak >= 0) num_active_--;
+    states_[s] = State();
+  }
+}
+
+size_t CtcKeywordSpotting::MemoryBytes() const {
+  return VectorBytes(offsets_) + VectorBytes(states_) + VectorBytes(peaks_) +
+         VectorBytes(detections_) + VectorBytes(hypotheses_) +
+         VectorBytes(likelihood_) + VectorBytes(times_);
+}
+
+}  // namespace wenet
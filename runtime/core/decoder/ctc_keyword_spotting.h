@@ -0,0 +1,151 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef DECODER_CTC_KEYWORD_SPOTTING_H_
+#define DECODER_CTC_KEYWORD_SPOTTING_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "decoder/search_interface.h"
+#include "utils/string.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct CtcKeywordSpottingOptions {
+  int blank = 0;  // blank id
+  // Default threshold of the confidence of the keywords, the geometric mean
+  // of the peak posteriors of their tokens
+  float threshold = 0.5;
+  // The frames of a token below this posterior are not its peaks, they're
+  // the blanks between the repeated tokens
+  float min_token_prob = 0.05;
+  // A partial match is dropped when its next token doesn't come in this
+  // many frames, after subsampling
+  int max_token_gap = 50;
+};
+
+// The keywords split into the model units, they're split by the symbol
+// table like the phrases of ContextGraph. Shared by the searches of all the
+// sessions, it isn't changed after it's built.
+class KeywordSet {
+ public:
+  struct Keyword {
+    std::string phrase;
+    std::vector<int> tokens;
+    float threshold;
+  };
+
+  // Each line is a keyword, optionally followed by a tab and its threshold,
+  // default_threshold is used otherwise. The keywords with unknown words are
+  // skipped.
+  static std::shared_ptr<KeywordSet> Build(
+      const std::vector<std::string>& lines, const SymbolStrings& symbols,
+      float default_threshold);
+  static std::shared_ptr<KeywordSet> Read(const std::string& path,
+                                          const SymbolStrings& symbols,
+                                          float default_threshold);
+
+  const std::vector<Keyword>& keywords() const { return keywords_; }
+  // Total tokens of the keywords, the states of a search
+  int num_states() const { return num_states_; }
+
+ private:
+  std::vector<Keyword> keywords_;
+  int num_states_ = 0;
+};
+
+// Keyword spotting on the CTC posteriors. Each keyword is a chain of its
+// tokens, a state of the chain is the best partial match which ends with
+// the peak of the token, so the search is a fixed set of states, the tokens
+// of the keywords, whatever the audio. A keyword is detected on the frame
+// its confidence reaches its threshold, and the match starts over. There's
+// no rescoring, the detections of the sentence are the only hypothesis.
+class CtcKeywordSpotting : public SearchInterface {
+ public:
+  struct Detection {
+    int keyword;  // index in KeywordSet::keywords()
+    int start;    // peak frame of the first token
+    int end;      // peak frame of the last token
+    float confidence;
+  };
+
+  CtcKeywordSpotting(const CtcKeywordSpottingOptions& opts,
+                     std::shared_ptr<const KeywordSet> keywords);
+
+  using SearchInterface::Search;
+  void Search(const LogProbMatrix& logp) override;
+  void Reset() override;
+  void FinalizeSearch() override {}
+  // The keywords are not biased
+  void set_context_graph(
+      const std::shared_ptr<ContextGraph>& context_graph) override {}
+  SearchType Type() const override { return SearchType::kKeywordSpotting; }
+  const std::vector<std::vector<int>>& Inputs() const override {
+    return hypotheses_;
+  }
+  const std::vector<std::vector<int>>& Outputs() const override {
+    return hypotheses_;
+  }
+  const std::vector<float>& Likelihood() const override { return likelihood_; }
+  const std::vector<std::vector<int>>& Times() const override {
+    return times_;
+  }
+  size_t MemoryBytes() const override;
+  int NumHypotheses() const override { return num_active_; }
+
+  // The detections since Reset(), the frames are counted from Reset() too
+  const std::vector<Detection>& detections() const { return detections_; }
+
+ private:
+  struct State {
+    float score = -kFloatMax;  // sum of the log peaks of the tokens so far
+    int start = -1;
+    int peak = -1;
+    // Whether the token fell below min_token_prob after its peak, a repeat
+    // of the token only starts the next state then
+    bool blank_after = false;
+  };
+
+  void Detect(int keyword, const State& state);
+  // Drop the partial matches of keyword
+  void ResetKeyword(int keyword);
+
+  const CtcKeywordSpottingOptions& opts_;
+  std::shared_ptr<const KeywordSet> keywords_;
+  float log_min_token_prob_;
+  int abs_time_step_ = 0;
+  int num_active_ = 0;
+  // The states of keyword k are states_[offsets_[k], offsets_[k + 1]), one
+  // for each of its tokens
+  std::vector<int> offsets_;
+  std::vector<State> states_;
+  // The peak frames of the tokens of each state, for the times of the
+  // detections, they're of the same layout as the states
+  std::vector<std::vector<int>> peaks_;
+  std::vector<Detection> detections_;
+  std::vector<std::vector<int>> hypotheses_;
+  std::vector<float> likelihood_;
+  std::vector<std::vector<int>> times_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(CtcKeywordSpotting);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_CTC_KEYWORD_SPOTTING_H_
@@ -4,220 +4,749 @@
 #include "decoder/ctc_prefix_beam_search.h"
 
 #include <algorithm>
+#include <cmath>
 #include <tuple>
-#include <unordered_map>
 #include <utility>
 
 #include "utils/log.h"
+#include "utils/state_io.h"
 #include "utils/utils.h"
 
 namespace wenet {
 
-CtcPrefixBeamSearch::CtcPrefixBeamSearch(
+// Don't compact the prefix tree before it has this many nodes
+static const size_t kMinCompactNodes = 4096;
+
+static inline uint64_t ChildKey(int parent, int token) {
+  return static_cast<uint64_t>(parent) << 32 | static_cast<uint32_t>(token);
+}
+
+// The key of the empty slots of the children table, the parent of a child
+// is never -1
+static const uint64_t kNoChild = ~static_cast<uint64_t>(0);
+static const size_t kMinChildSlots = 1024;
+
+static inline size_t ChildSlot(uint64_t key, size_t mask) {
+  return (key * 0x9E3779B97F4A7C15ULL >> 32) & mask;
+}
+
+// The steps of the viterbi scores which don't touch the lists, the ones of
+// NoPrefixViterbi are empty
+static void ResetViterbi(PrefixViterbi* score) {
+  score->v_s = 0.0;
+  score->v_ns = 0.0;
+}
+static void ResetViterbi(NoPrefixViterbi*) {}
+
+static void AddViterbiLikelihood(const PrefixViterbi& score,
+                                 std::vector<float>* likelihood) {
+  likelihood->emplace_back(score.viterbi_score());
+}
+static void AddViterbiLikelihood(const NoPrefixViterbi&,
+                                 std::vector<float>*) {}
+
+// The viterbi path of a hypothesis of SkipBlankFrame()
+static void SkipBlankViterbi(float prob, PrefixViterbi* score) {
+  score->times_s = score->times();
+  score->v_s = score->viterbi_score() + prob;
+  score->v_ns = -kFloatMax;
+  score->cur_token_prob = -kFloatMax;
+}
+static void SkipBlankViterbi(float, NoPrefixViterbi*) {}
+
+static int TimesList(const PrefixViterbi& score) { return score.times(); }
+static int TimesList(const NoPrefixViterbi&) { return -1; }
+
+// Whether the lists a restored score refers to are in the num_lists lists
+static bool ValidList(int list, size_t num_lists) {
+  return list >= -1 && list < static_cast<int64_t>(num_lists);
+}
+static bool ValidTimes(const PrefixViterbi& score, size_t num_lists) {
+  return ValidList(score.times_s, num_lists) &&
+         ValidList(score.times_ns, num_lists);
+}
+static bool ValidTimes(const NoPrefixViterbi&, size_t) { return true; }
+static bool ValidBoundaries(const PrefixContext& score, size_t num_lists) {
+  return ValidList(score.start_boundaries, num_lists) &&
+         ValidList(score.end_boundaries, num_lists);
+}
+static bool ValidBoundaries(const NoPrefixContext&, size_t) { return true; }
+
+// Whether the parents of nodes come before them and the lengths follow
+// them, i.e. they are a forest of the lists
+static bool ValidLists(const std::vector<ListNode>& nodes) {
+  for (int i = 0; i < nodes.size(); ++i) {
+    const ListNode& node = nodes[i];
+    if (node.parent < -1 || node.parent >= i ||
+        node.length != (node.parent < 0 ? 1 : nodes[node.parent].length + 1)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <bool kContext, bool kTimes>
+CtcPrefixBeamSearchT<kContext, kTimes>::CtcPrefixBeamSearchT(
     const CtcPrefixBeamSearchOptions& opts,
-    const std::shared_ptr<ContextGraph>& context_graph)
-    : opts_(opts), context_graph_(context_graph) {
+    const std::shared_ptr<ContextGraph>& context_graph,
+    const std::shared_ptr<NgramLm>& lm)
+    : lm_(lm), opts_(opts) {
+  set_context_graph(context_graph);
   Reset();
 }
 
-void CtcPrefixBeamSearch::Reset() {
-  hypotheses_.clear();
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::set_context_graph(
+    const std::shared_ptr<ContextGraph>& context_graph) {
+  CHECK(kContext || context_graph == nullptr)
+      << "The context biasing is compiled out of the search";
+  context_graph_ = context_graph;
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::Reset() {
   likelihood_.clear();
   cur_hyps_.clear();
   viterbi_likelihood_.clear();
-  times_.clear();
-  outputs_.clear();
+  nodes_.clear();
+  ClearChildren();
+  lists_.clear();
+  list_posteriors_.clear();
+  compact_threshold_ = kMinCompactNodes;
   abs_time_step_ = 0;
-  PrefixScore prefix_score;
+  nodes_.push_back({-1, -1, 0});
+  node_lms_.clear();
+  if (lm_ != nullptr) node_lms_.push_back({lm_->BeginState(), 0});
+  Score prefix_score;
   prefix_score.s = 0.0;
   prefix_score.ns = -kFloatMax;
-  prefix_score.v_s = 0.0;
-  prefix_score.v_ns = 0.0;
-  std::vector<int> empty;
-  cur_hyps_[empty] = prefix_score;
-  outputs_.emplace_back(empty);
-  hypotheses_.emplace_back(empty);
+  ResetViterbi(&prefix_score);
+  cur_hyps_.emplace_back(0, prefix_score);
   likelihood_.emplace_back(prefix_score.total_score());
-  times_.emplace_back(empty);
+  AddViterbiLikelihood(prefix_score, &viterbi_likelihood_);
+  prefixes_updated_ = false;
 }
 
-static bool PrefixScoreCompare(
-    const std::pair<std::vector<int>, PrefixScore>& a,
-    const std::pair<std::vector<int>, PrefixScore>& b) {
+template <typename Score>
+static bool PrefixScoreCompare(const std::pair<int, Score>& a,
+                               const std::pair<int, Score>& b) {
   return a.second.total_score() > b.second.total_score();
 }
 
-void CtcPrefixBeamSearch::UpdateOutputs(
-    const std::pair<std::vector<int>, PrefixScore>& prefix) {
-  const std::vector<int>& input = prefix.first;
-  const std::vector<int>& start_boundaries = prefix.second.start_boundaries;
-  const std::vector<int>& end_boundaries = prefix.second.end_boundaries;
+// Get the values of list `list` of nodes
+static void GetList(const std::vector<ListNode>& nodes, int list,
+                    std::vector<int>* values) {
+  values->resize(list < 0 ? 0 : nodes[list].length);
+  for (int i = values->size() - 1; i >= 0; --i) {
+    (*values)[i] = nodes[list].value;
+    list = nodes[list].parent;
+  }
+}
+
+// The confidences of the tokens of list `list` of the times
+static void GetConfidences(const std::vector<ListNode>& nodes,
+                           const std::vector<TokenPosteriors>& posteriors,
+                           int list,
+                           std::vector<TokenConfidence>* confidences) {
+  confidences->resize(list < 0 ? 0 : nodes[list].length);
+  for (int i = confidences->size() - 1; i >= 0; --i) {
+    (*confidences)[i] = posteriors[list].confidence();
+    list = nodes[list].parent;
+  }
+}
+
+// Copy list `list` of nodes to new_nodes and return its new id, the nodes
+// which are already copied are shared. A parent always has a smaller id
+// than its children in new_nodes.
+static int CopyList(const std::vector<ListNode>& nodes, int list,
+                    std::vector<int>* new_ids,
+                    std::vector<ListNode>* new_nodes,
+                    std::vector<int>* path) {
+  path->clear();
+  for (int i = list; i >= 0 && (*new_ids)[i] < 0; i = nodes[i].parent) {
+    path->push_back(i);
+  }
+  for (auto it = path->rbegin(); it != path->rend(); ++it) {
+    const ListNode& node = nodes[*it];
+    (*new_ids)[*it] = new_nodes->size();
+    new_nodes->push_back({node.parent < 0 ? -1 : (*new_ids)[node.parent],
+                          node.value, node.length});
+  }
+  return list < 0 ? -1 : (*new_ids)[list];
+}
+
+template <bool kContext, bool kTimes>
+int CtcPrefixBeamSearchT<kContext, kTimes>::FindChild(uint64_t key) const {
+  size_t mask = children_.size() - 1;
+  for (size_t i = ChildSlot(key, mask);; i = (i + 1) & mask) {
+    if (children_[i].key == key) return children_[i].node;
+    if (children_[i].key == kNoChild) return -1;
+  }
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::InsertChild(uint64_t key,
+                                                         int node) {
+  // Keep the load factor under 1/2
+  if (2 * (num_children_ + 1) > children_.size()) {
+    std::vector<Child> children(2 * children_.size(), {kNoChild, -1});
+    children_.swap(children);
+    num_children_ = 0;
+    for (const Child& child : children) {
+      if (child.key != kNoChild) InsertChild(child.key, child.node);
+    }
+  }
+  size_t mask = children_.size() - 1;
+  size_t i = ChildSlot(key, mask);
+  while (children_[i].key != kNoChild) i = (i + 1) & mask;
+  children_[i] = {key, node};
+  ++num_children_;
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::ClearChildren() {
+  if (children_.empty()) {
+    children_.resize(kMinChildSlots, {kNoChild, -1});
+  } else {
+    std::fill(children_.begin(), children_.end(), Child{kNoChild, -1});
+  }
+  num_children_ = 0;
+}
+
+template <bool kContext, bool kTimes>
+int CtcPrefixBeamSearchT<kContext, kTimes>::Extend(int node, int token) {
+  uint64_t key = ChildKey(node, token);
+  int child = FindChild(key);
+  if (child >= 0) return child;
+  child = nodes_.size();
+  nodes_.push_back({node, token, nodes_[node].length + 1});
+  InsertChild(key, child);
+  if (lm_ != nullptr) {
+    int state = 0;
+    float logp = lm_->Score(node_lms_[node].state, token, &state);
+    float score = node_lms_[node].score + opts_.lm_weight * logp;
+    node_lms_.push_back({state, score + opts_.lm_bonus});
+  }
+  return child;
+}
+
+template <bool kContext, bool kTimes>
+int CtcPrefixBeamSearchT<kContext, kTimes>::Append(
+    int list, int value, const TokenPosteriors& posteriors) {
+  lists_.push_back({list, value, list < 0 ? 1 : lists_[list].length + 1});
+  list_posteriors_.push_back(posteriors);
+  return lists_.size() - 1;
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::UpdateContext(
+    const PrefixContext& prefix_score, int word_id, int prefix_len,
+    PrefixContext* next_score) {
+  float score = 0;
+  bool is_start_boundary = false;
+  bool is_end_boundary = false;
+  int state =
+      context_graph_->GetNextState(prefix_score.context_state, word_id, &score,
+                                   &is_start_boundary, &is_end_boundary);
+  next_score->CopyContext(prefix_score);
+  next_score->context_state = state;
+  next_score->context_score += score;
+  if (is_start_boundary) {
+    next_score->start_boundaries =
+        Append(next_score->start_boundaries, prefix_len);
+  }
+  if (is_end_boundary) {
+    next_score->end_boundaries = Append(next_score->end_boundaries, prefix_len);
+  }
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::KeepContext(
+    const PrefixContext& prefix_score, PrefixContext* next_score) {
+  // Prefix not changed, copy the context from prefix.
+  if (context_graph_ && !next_score->has_context) {
+    next_score->CopyContext(prefix_score);
+    next_score->has_context = true;
+  }
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::ExtendContext(
+    const PrefixContext& prefix_score, int word_id, int prefix_len,
+    PrefixContext* next_score) {
+  // Prefix changed, calculate the context score.
+  if (context_graph_ && !next_score->has_context) {
+    UpdateContext(prefix_score, word_id, prefix_len, next_score);
+    next_score->has_context = true;
+  }
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::ViterbiBlank(
+    const PrefixViterbi& prefix_score, float prob,
+    PrefixViterbi* next_score) {
+  next_score->v_s = prefix_score.viterbi_score() + prob;
+  next_score->times_s = prefix_score.times();
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::ViterbiRepeat(
+    const PrefixViterbi& prefix_score, float prob,
+    PrefixViterbi* next_score) {
+  if (next_score->v_ns < prefix_score.v_ns + prob) {
+    next_score->v_ns = prefix_score.v_ns + prob;
+    if (next_score->cur_token_prob < prob) {
+      next_score->cur_token_prob = prob;
+      // Replace the time of the last token, and add the frame to its
+      // posteriors
+      CHECK_GE(prefix_score.times_ns, 0);
+      TokenPosteriors posteriors = list_posteriors_[prefix_score.times_ns];
+      float posterior = std::exp(prob);
+      posteriors.max = std::max(posteriors.max, posterior);
+      posteriors.min = std::min(posteriors.min, posterior);
+      posteriors.sum += posterior;
+      ++posteriors.frames;
+      next_score->times_ns = Append(lists_[prefix_score.times_ns].parent,
+                                    abs_time_step_, posteriors);
+    }
+  }
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::ViterbiExtend(
+    const PrefixViterbi& prefix_score, bool from_blank, float prob,
+    PrefixViterbi* next_score) {
+  float score =
+      from_blank ? prefix_score.v_s : prefix_score.viterbi_score();
+  if (next_score->v_ns < score + prob) {
+    next_score->v_ns = score + prob;
+    next_score->cur_token_prob = prob;
+    float posterior = std::exp(prob);
+    next_score->times_ns = Append(
+        from_blank ? prefix_score.times_s : prefix_score.times(),
+        abs_time_step_, {posterior, posterior, posterior, 1});
+  }
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::CopyTimes(PrefixViterbi* score) {
+  for (int* list : {&score->times_s, &score->times_ns}) {
+    *list = CopyList(lists_, *list, &new_list_ids_, &new_lists_, &path_);
+  }
+}
 
-  std::vector<int> output;
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::CopyBoundaries(
+    PrefixContext* score) {
+  for (int* list : {&score->start_boundaries, &score->end_boundaries}) {
+    *list = CopyList(lists_, *list, &new_list_ids_, &new_lists_, &path_);
+  }
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::CompactNodes() {
+  // The old and the new buffers are swapped, both of them are reused
+  new_ids_.assign(nodes_.size(), -1);
+  new_nodes_.clear();
+  new_ids_[0] = 0;
+  new_nodes_.push_back(nodes_[0]);
+  new_list_ids_.assign(lists_.size(), -1);
+  new_lists_.clear();
+  for (auto& hyp : cur_hyps_) {
+    hyp.first = CopyList(nodes_, hyp.first, &new_ids_, &new_nodes_, &path_);
+    CopyTimes(&hyp.second);
+    CopyBoundaries(&hyp.second);
+  }
+  new_list_posteriors_.resize(new_lists_.size());
+  for (int i = 0; i < new_list_ids_.size(); ++i) {
+    if (new_list_ids_[i] >= 0) {
+      new_list_posteriors_[new_list_ids_[i]] = list_posteriors_[i];
+    }
+  }
+  if (lm_ != nullptr) {
+    new_node_lms_.resize(new_nodes_.size());
+    for (int i = 0; i < new_ids_.size(); ++i) {
+      if (new_ids_[i] >= 0) new_node_lms_[new_ids_[i]] = node_lms_[i];
+    }
+    node_lms_.swap(new_node_lms_);
+  }
+  nodes_.swap(new_nodes_);
+  lists_.swap(new_lists_);
+  list_posteriors_.swap(new_list_posteriors_);
+  ClearChildren();
+  for (int i = 1; i < nodes_.size(); ++i) {
+    InsertChild(ChildKey(nodes_[i].parent, nodes_[i].value), i);
+  }
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::UpdateOutput(
+    const std::vector<int>& input, const PrefixContext& score,
+    std::vector<int>* output) const {
+  std::vector<int>& start_boundaries = start_boundaries_;
+  std::vector<int>& end_boundaries = end_boundaries_;
+  GetList(lists_, score.start_boundaries, &start_boundaries);
+  GetList(lists_, score.end_boundaries, &end_boundaries);
+
+  output->clear();
   int s = 0;
   int e = 0;
   for (int i = 0; i < input.size(); ++i) {
     if (s < start_boundaries.size() && i == start_boundaries[s]) {
-      output.emplace_back(context_graph_->start_tag_id());
+      output->emplace_back(context_graph_->start_tag_id());
       ++s;
     }
-    output.emplace_back(input[i]);
+    output->emplace_back(input[i]);
     if (e < end_boundaries.size() && i == end_boundaries[e]) {
-      output.emplace_back(context_graph_->end_tag_id());
+      output->emplace_back(context_graph_->end_tag_id());
       ++e;
     }
   }
-  outputs_.emplace_back(output);
 }
 
-void CtcPrefixBeamSearch::UpdateHypotheses(
-    const std::vector<std::pair<std::vector<int>, PrefixScore>>& hpys) {
-  cur_hyps_.clear();
-  outputs_.clear();
-  hypotheses_.clear();
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::UpdatePrefixes() const {
+  if (prefixes_updated_) return;
+  hypotheses_.resize(cur_hyps_.size());
+  outputs_.resize(cur_hyps_.size());
+  times_.resize(cur_hyps_.size());
+  confidences_.resize(cur_hyps_.size());
+  for (int i = 0; i < cur_hyps_.size(); ++i) {
+    GetList(nodes_, cur_hyps_[i].first, &hypotheses_[i]);
+    UpdateOutput(hypotheses_[i], cur_hyps_[i].second, &outputs_[i]);
+    GetList(lists_, TimesList(cur_hyps_[i].second), &times_[i]);
+    GetConfidences(lists_, list_posteriors_, TimesList(cur_hyps_[i].second),
+                   &confidences_[i]);
+  }
+  prefixes_updated_ = true;
+}
+
+template <bool kContext, bool kTimes>
+size_t CtcPrefixBeamSearchT<kContext, kTimes>::MemoryBytes() const {
+  return VectorBytes(nodes_) + VectorBytes(children_) +
+         VectorBytes(node_lms_) + VectorBytes(lists_) +
+         VectorBytes(list_posteriors_) + VectorBytes(new_list_posteriors_) +
+         VectorBytes(start_boundaries_) + VectorBytes(end_boundaries_) +
+         VectorBytes(cur_hyps_) + VectorBytes(likelihood_) +
+         VectorBytes(viterbi_likelihood_) + VectorBytes(hyp_s_) +
+         VectorBytes(hyp_ns_) + VectorBytes(hyp_scores_) +
+         VectorBytes(topk_score_) + VectorBytes(topk_index_) +
+         VectorBytes(next_hyps_) + VectorBytes(next_hyp_index_) +
+         VectorBytes(new_ids_) + VectorBytes(new_list_ids_) +
+         VectorBytes(path_) + VectorBytes(new_nodes_) +
+         VectorBytes(new_lists_) + VectorBytes(new_node_lms_) +
+         VectorBytes(hypotheses_) + VectorBytes(times_) +
+         VectorBytes(confidences_) + VectorBytes(outputs_);
+}
+
+template <bool kContext, bool kTimes>
+bool CtcPrefixBeamSearchT<kContext, kTimes>::SaveState(
+    StateWriter* writer) const {
+  writer->Write<uint8_t>(kContext);
+  writer->Write<uint8_t>(kTimes);
+  writer->Write<uint8_t>(lm_ != nullptr);
+  writer->Write<int32_t>(abs_time_step_);
+  writer->WriteVector(nodes_);
+  writer->WriteVector(node_lms_);
+  writer->WriteVector(lists_);
+  writer->WriteVector(list_posteriors_);
+  writer->Write<uint64_t>(cur_hyps_.size());
+  for (const auto& hyp : cur_hyps_) {
+    writer->Write<int32_t>(hyp.first);
+    writer->Write(hyp.second);
+  }
+  return true;
+}
+
+template <bool kContext, bool kTimes>
+bool CtcPrefixBeamSearchT<kContext, kTimes>::RestoreState(
+    StateReader* reader) {
+  Reset();
+  uint8_t context = 0;
+  uint8_t times = 0;
+  uint8_t has_lm = 0;
+  uint64_t num_hyps = 0;
+  std::vector<std::pair<int, Score>> hyps;
+  bool ok = reader->Read(&context) && reader->Read(&times) &&
+            reader->Read(&has_lm) && context == kContext &&
+            times == kTimes && has_lm == (lm_ != nullptr) &&
+            reader->Read(&abs_time_step_) && reader->ReadVector(&nodes_) &&
+            reader->ReadVector(&node_lms_) && reader->ReadVector(&lists_) &&
+            reader->ReadVector(&list_posteriors_) &&
+            reader->Read(&num_hyps) &&
+            num_hyps <= reader->remaining() / (sizeof(int32_t) +
+                                               sizeof(Score));
+  // Node 0 is the empty prefix, the others are lists of one token or more
+  ok = ok && !nodes_.empty() && nodes_[0].parent == -1 &&
+       nodes_[0].length == 0 && ValidLists(lists_) &&
+       list_posteriors_.size() == lists_.size() &&
+       node_lms_.size() == (lm_ != nullptr ? nodes_.size() : 0);
+  for (int i = 1; ok && i < nodes_.size(); ++i) {
+    const ListNode& node = nodes_[i];
+    ok = node.parent >= 0 && node.parent < i &&
+         node.length == nodes_[node.parent].length + 1;
+  }
+  for (uint64_t i = 0; ok && i < num_hyps; ++i) {
+    int32_t node = 0;
+    Score score;
+    ok = reader->Read(&node) && reader->Read(&score) && node >= 0 &&
+         node < nodes_.size() && ValidTimes(score, lists_.size()) &&
+         ValidBoundaries(score, lists_.size());
+    hyps.emplace_back(node, score);
+  }
+  if (!ok || hyps.empty()) {
+    Reset();
+    return false;
+  }
+  ClearChildren();
+  for (int i = 1; i < nodes_.size(); ++i) {
+    InsertChild(ChildKey(nodes_[i].parent, nodes_[i].value), i);
+  }
+  UpdateHypotheses(&hyps);
+  return true;
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::UpdateHypotheses(
+    std::vector<std::pair<int, Score>>* hpys) {
+  cur_hyps_.swap(*hpys);
   likelihood_.clear();
   viterbi_likelihood_.clear();
-  times_.clear();
-  for (auto& item : hpys) {
-    cur_hyps_[item.first] = item.second;
-    UpdateOutputs(item);
-    hypotheses_.emplace_back(std::move(item.first));
+  for (const auto& item : cur_hyps_) {
     likelihood_.emplace_back(item.second.total_score());
-    viterbi_likelihood_.emplace_back(item.second.viterbi_score());
-    times_.emplace_back(item.second.times());
+    AddViterbiLikelihood(item.second, &viterbi_likelihood_);
+  }
+  prefixes_updated_ = false;
+  if (nodes_.size() + lists_.size() > compact_threshold_) {
+    CompactNodes();
+    compact_threshold_ =
+        std::max(kMinCompactNodes, 2 * (nodes_.size() + lists_.size()));
+  }
+}
+
+template <bool kContext, bool kTimes>
+typename CtcPrefixBeamSearchT<kContext, kTimes>::Score&
+CtcPrefixBeamSearchT<kContext, kTimes>::NextHyp(int node) {
+  if (node >= next_hyp_index_.size()) {
+    next_hyp_index_.resize(std::max(nodes_.size(), 2 * next_hyp_index_.size()),
+                           -1);
+  }
+  int& index = next_hyp_index_[node];
+  if (index < 0) {
+    index = next_hyps_.size();
+    // PrefixScore(-inf, -inf) by default, the fields s(blank ending score)
+    // and ns(none blank ending score) are -inf
+    next_hyps_.emplace_back(node, Score());
   }
+  return next_hyps_[index].second;
 }
 
 // Please refer https://robin1001.github.io/2020/12/11/ctc-search
 // for how CTC prefix beam search works, and there is a simple graph demo in
-// it.
-void CtcPrefixBeamSearch::Search(const std::vector<std::vector<float>>& logp) {
-  if (logp.size() == 0) return;
-  int first_beam_size = std::min(static_cast<int>(logp[0].size()),
-                                 opts_.first_beam_size);
-  for (int t = 0; t < logp.size(); ++t, ++abs_time_step_) {
-    const std::vector<float>& logp_t = logp[t];
-    std::unordered_map<std::vector<int>, PrefixScore, PrefixHash> next_hyps;
+// it. The steps of the features compiled out are empty overloads, so the
+// loop of the plain search only updates the blank and none blank ending
+// scores and the LM scores.
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::Search(
+    const LogProbMatrix& logp) {
+  if (logp.rows() == 0) return;
+  int first_beam_size = std::min(
+      logp.cols(),
+      std::max(static_cast<int>(opts_.first_beam_size * beam_scale_), 1));
+  for (int t = 0; t < logp.rows(); ++t, ++abs_time_step_) {
+    const float* logp_t = logp.Row(t);
+    if (std::exp(logp_t[opts_.blank]) > opts_.blank_skip_thresh) {
+      SkipBlankFrame(logp_t[opts_.blank]);
+      continue;
+    }
     // 1. First beam prune, only select topk candidates
-    std::vector<float> topk_score;
-    std::vector<int32_t> topk_index;
-    TopK(logp_t, first_beam_size, &topk_score, &topk_index);
-
-    // 2. Token passing
-    for (int i = 0; i < topk_index.size(); ++i) {
-      int id = topk_index[i];
-      auto prob = topk_score[i];
-      for (const auto& it : cur_hyps_) {
-        const std::vector<int>& prefix = it.first;
-        const PrefixScore& prefix_score = it.second;
-        // If prefix doesn't exist in next_hyps, next_hyps[prefix] will insert
-        // PrefixScore(-inf, -inf) by default, since the default constructor
-        // of PrefixScore will set fields s(blank ending score) and
-        // ns(none blank ending score) to -inf, respectively.
-        if (id == opts_.blank) {
-          // Case 0: *a + ε => *a
-          PrefixScore& next_score = next_hyps[prefix];
-          next_score.s = LogAdd(next_score.s, prefix_score.score() + prob);
-          next_score.v_s = prefix_score.viterbi_score() + prob;
-          next_score.times_s = prefix_score.times();
-          // Prefix not changed, copy the context from prefix.
-          if (context_graph_ && !next_score.has_context) {
-            next_score.CopyContext(prefix_score);
-            next_score.has_context = true;
-          }
-        } else if (!prefix.empty() && id == prefix.back()) {
-          // Case 1: *a + a => *a
-          PrefixScore& next_score1 = next_hyps[prefix];
-          next_score1.ns = LogAdd(next_score1.ns, prefix_score.ns + prob);
-          if (next_score1.v_ns < prefix_score.v_ns + prob) {
-            next_score1.v_ns = prefix_score.v_ns + prob;
-            if (next_score1.cur_token_prob < prob) {
-              next_score1.cur_token_prob = prob;
-              next_score1.times_ns = prefix_score.times_ns;
-              CHECK_GT(next_score1.times_ns.size(), 0);
-              next_score1.times_ns.back() = abs_time_step_;
-            }
-          }
-          if (context_graph_ && !next_score1.has_context) {
-            next_score1.CopyContext(prefix_score);
-            next_score1.has_context = true;
-          }
-
-          // Case 2: *aε + a => *aa
-          std::vector<int> new_prefix(prefix);
-          new_prefix.emplace_back(id);
-          PrefixScore& next_score2 = next_hyps[new_prefix];
-          next_score2.ns = LogAdd(next_score2.ns, prefix_score.s + prob);
-          if (next_score2.v_ns < prefix_score.v_s + prob) {
-            next_score2.v_ns = prefix_score.v_s + prob;
-            next_score2.cur_token_prob = prob;
-            next_score2.times_ns = prefix_score.times_s;
-            next_score2.times_ns.emplace_back(abs_time_step_);
-          }
-          if (context_graph_ && !next_score2.has_context) {
-            // Prefix changed, calculate the context score.
-            next_score2.UpdateContext(context_graph_, prefix_score, id,
-                                      prefix.size());
-            next_score2.has_context = true;
-          }
-        } else {
-          // Case 3: *a + b => *ab, *aε + b => *ab
-          std::vector<int> new_prefix(prefix);
-          new_prefix.emplace_back(id);
-          PrefixScore& next_score = next_hyps[new_prefix];
-          next_score.ns = LogAdd(next_score.ns, prefix_score.score() + prob);
-          if (next_score.v_ns < prefix_score.viterbi_score() + prob) {
-            next_score.v_ns = prefix_score.viterbi_score() + prob;
-            next_score.cur_token_prob = prob;
-            next_score.times_ns = prefix_score.times();
-            next_score.times_ns.emplace_back(abs_time_step_);
-          }
-          if (context_graph_ && !next_score.has_context) {
-            // Calculate the context score.
-            next_score.UpdateContext(context_graph_, prefix_score, id,
-                                     prefix.size());
-            next_score.has_context = true;
-          }
-        }
+    TopK(logp_t, logp.cols(), first_beam_size, &topk_score_, &topk_index_);
+    SearchFrame();
+  }
+}
+
+// The same as above, the top k of a frame are the ones of the pruned
+// candidates, so only k + 1 log probs are read per frame
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::Search(
+    const SparseLogProbMatrix& logp) {
+  if (logp.rows() == 0) return;
+  CHECK_EQ(logp.blank(), opts_.blank);
+  int first_beam_size = std::min(
+      logp.cols(),
+      std::max(static_cast<int>(opts_.first_beam_size * beam_scale_), 1));
+  for (int t = 0; t < logp.rows(); ++t, ++abs_time_step_) {
+    if (std::exp(logp.BlankValue(t)) > opts_.blank_skip_thresh) {
+      SkipBlankFrame(logp.BlankValue(t));
+      continue;
+    }
+    TopK(logp.Values(t), logp.cols(), first_beam_size, &topk_score_,
+         &topk_index_);
+    const int32_t* ids = logp.Ids(t);
+    for (int& index : topk_index_) index = ids[index];
+    SearchFrame();
+  }
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::SearchFrame() {
+  next_hyps_.clear();
+  // 2. Token passing, the scores of the hypotheses are used by each of
+  // the tokens, so they are computed at once for the beam
+  int num_hyps = cur_hyps_.size();
+  hyp_s_.resize(num_hyps);
+  hyp_ns_.resize(num_hyps);
+  hyp_scores_.resize(num_hyps);
+  for (int j = 0; j < num_hyps; ++j) {
+    hyp_s_[j] = cur_hyps_[j].second.s;
+    hyp_ns_[j] = cur_hyps_[j].second.ns;
+  }
+  LogAdd(hyp_s_.data(), hyp_ns_.data(), num_hyps, hyp_scores_.data());
+  for (int i = 0; i < topk_index_.size(); ++i) {
+    int id = topk_index_[i];
+    auto prob = topk_score_[i];
+    for (int j = 0; j < num_hyps; ++j) {
+      const auto& it = cur_hyps_[j];
+      const float score = hyp_scores_[j];
+      int prefix = it.first;
+      // A copy, Extend() may reallocate nodes_
+      const ListNode node = nodes_[prefix];
+      const Score& prefix_score = it.second;
+      // The reference of NextHyp() is only valid until the next call
+      if (id == opts_.blank) {
+        // Case 0: *a + ε => *a
+        Score& next_score = NextHyp(prefix);
+        next_score.s = LogAdd(next_score.s, score + prob);
+        ViterbiBlank(prefix_score, prob, &next_score);
+        next_score.lm_score = prefix_score.lm_score;
+        KeepContext(prefix_score, &next_score);
+      } else if (prefix != 0 && id == node.value) {
+        // Case 1: *a + a => *a
+        Score& next_score1 = NextHyp(prefix);
+        next_score1.ns = LogAdd(next_score1.ns, prefix_score.ns + prob);
+        ViterbiRepeat(prefix_score, prob, &next_score1);
+        next_score1.lm_score = prefix_score.lm_score;
+        KeepContext(prefix_score, &next_score1);
+
+        // Case 2: *aε + a => *aa
+        int new_prefix = Extend(prefix, id);
+        Score& next_score2 = NextHyp(new_prefix);
+        next_score2.ns = LogAdd(next_score2.ns, prefix_score.s + prob);
+        next_score2.lm_score = LmScore(new_prefix);
+        ViterbiExtend(prefix_score, true, prob, &next_score2);
+        ExtendContext(prefix_score, id, node.length, &next_score2);
+      } else {
+        // Case 3: *a + b => *ab, *aε + b => *ab
+        int new_prefix = Extend(prefix, id);
+        Score& next_score = NextHyp(new_prefix);
+        next_score.ns = LogAdd(next_score.ns, score + prob);
+        next_score.lm_score = LmScore(new_prefix);
+        ViterbiExtend(prefix_score, false, prob, &next_score);
+        ExtendContext(prefix_score, id, node.length, &next_score);
       }
     }
+  }
+
+  for (const auto& item : next_hyps_) next_hyp_index_[item.first] = -1;
 
-    // 3. Second beam prune, only keep top n best paths
-    std::vector<std::pair<std::vector<int>, PrefixScore>> arr(next_hyps.begin(),
-                                                              next_hyps.end());
-    int second_beam_size =
-        std::min(static_cast<int>(arr.size()), opts_.second_beam_size);
-    std::nth_element(arr.begin(), arr.begin() + second_beam_size, arr.end(),
-                     PrefixScoreCompare);
-    arr.resize(second_beam_size);
-    std::sort(arr.begin(), arr.end(), PrefixScoreCompare);
+  // 3. Second beam prune, only keep top n best paths
+  int second_beam_size = std::min(
+      static_cast<int>(next_hyps_.size()),
+      std::max(static_cast<int>(opts_.second_beam_size * beam_scale_), 1));
+  std::nth_element(next_hyps_.begin(),
+                   next_hyps_.begin() + second_beam_size, next_hyps_.end(),
+                   PrefixScoreCompare<Score>);
+  next_hyps_.resize(second_beam_size);
+  std::sort(next_hyps_.begin(), next_hyps_.end(), PrefixScoreCompare<Score>);
+
+  // 4. Update cur_hyps_ and get new result, the old ones are left in
+  // next_hyps_ for their buffer
+  UpdateHypotheses(&next_hyps_);
+}
 
-    // 4. Update cur_hyps_ and get new result
-    UpdateHypotheses(arr);
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::SkipBlankFrame(float prob) {
+  // Only Case 0: *a + ε => *a, the other tokens are too unlikely to survive
+  // the second beam prune. The hypotheses don't merge, and their order
+  // doesn't change, so they're updated in place.
+  viterbi_likelihood_.clear();
+  for (int i = 0; i < cur_hyps_.size(); ++i) {
+    Score& score = cur_hyps_[i].second;
+    score.s = score.score() + prob;
+    score.ns = -kFloatMax;
+    SkipBlankViterbi(prob, &score);
+    likelihood_[i] = score.total_score();
+    AddViterbiLikelihood(score, &viterbi_likelihood_);
+  }
+  // The prefixes and the times of the viterbi paths are not changed, so
+  // the materialized ones are still valid.
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::FinalizeSearch() {
+  UpdateFinalContext();
+  UpdateFinalLm();
+}
+
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::UpdateFinalLm() {
+  if (lm_ == nullptr) return;
+  std::vector<std::pair<int, Score>> arr(cur_hyps_);
+  for (auto& item : arr) {
+    item.second.lm_score +=
+        opts_.lm_weight * lm_->FinalScore(node_lms_[item.first].state);
   }
+  std::sort(arr.begin(), arr.end(), PrefixScoreCompare<Score>);
+  UpdateHypotheses(&arr);
 }
 
-void CtcPrefixBeamSearch::FinalizeSearch() { UpdateFinalContext(); }
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::FinalContext(
+    PrefixContext* prefix_score, int prefix_len) {
+  if (prefix_score->context_state != 0) {
+    UpdateContext(*prefix_score, 0, prefix_len, prefix_score);
+  }
+}
 
-void CtcPrefixBeamSearch::UpdateFinalContext() {
-  if (context_graph_ == nullptr) return;
-  CHECK_EQ(hypotheses_.size(), cur_hyps_.size());
-  CHECK_EQ(hypotheses_.size(), likelihood_.size());
+template <bool kContext, bool kTimes>
+void CtcPrefixBeamSearchT<kContext, kTimes>::UpdateFinalContext() {
+  if (!kContext || context_graph_ == nullptr) return;
+  CHECK_EQ(cur_hyps_.size(), likelihood_.size());
   // We should backoff the context score/state when the context is
   // not fully matched at the last time.
-  for (const auto& prefix : hypotheses_) {
-    PrefixScore& prefix_score = cur_hyps_[prefix];
-    if (prefix_score.context_state != 0) {
-      prefix_score.UpdateContext(context_graph_, prefix_score, 0,
-                                 prefix.size());
-    }
+  std::vector<std::pair<int, Score>> arr(cur_hyps_);
+  for (auto& item : arr) {
+    FinalContext(&item.second, nodes_[item.first].length);
   }
-  std::vector<std::pair<std::vector<int>, PrefixScore>> arr(cur_hyps_.begin(),
-                                                            cur_hyps_.end());
-  std::sort(arr.begin(), arr.end(), PrefixScoreCompare);
+  std::sort(arr.begin(), arr.end(), PrefixScoreCompare<Score>);
 
   // Update cur_hyps_ and get new result
-  UpdateHypotheses(arr);
+  UpdateHypotheses(&arr);
+}
+
+template class CtcPrefixBeamSearchT<false, false>;
+template class CtcPrefixBeamSearchT<false, true>;
+template class CtcPrefixBeamSearchT<true, false>;
+template class CtcPrefixBeamSearchT<true, true>;
+
+std::unique_ptr<SearchInterface> NewCtcPrefixBeamSearch(
+    const CtcPrefixBeamSearchOptions& opts,
+    const std::shared_ptr<ContextGraph>& context_graph,
+    const std::shared_ptr<NgramLm>& lm, bool times) {
+  if (context_graph != nullptr) {
+    if (times) {
+      return std::unique_ptr<SearchInterface>(
+          new CtcPrefixBeamSearchT<true, true>(opts, context_graph, lm));
+    }
+    return std::unique_ptr<SearchInterface>(
+        new CtcPrefixBeamSearchT<true, false>(opts, context_graph, lm));
+  }
+  if (times) {
+    return std::unique_ptr<SearchInterface>(
+        new CtcPrefixBeamSearchT<false, true>(opts, nullptr, lm));
+  }
+  return std::unique_ptr<SearchInterface>(
+      new CtcPrefixBeamSearchT<false, false>(opts, nullptr, lm));
 }
 
 }  // namespace wenet
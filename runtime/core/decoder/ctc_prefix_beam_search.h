@@ -4,13 +4,15 @@
 #ifndef DECODER_CTC_PREFIX_BEAM_SEARCH_H_
 #define DECODER_CTC_PREFIX_BEAM_SEARCH_H_
 
+#include <cstdint>
 #include <memory>
-#include <unordered_map>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 #include "decoder/context_graph.h"
 #include "decoder/search_interface.h"
+#include "utils/ngram_lm.h"
 #include "utils/utils.h"
 
 namespace wenet {
@@ -19,113 +21,295 @@ struct CtcPrefixBeamSearchOptions {
   int blank = 0;  // blank id
   int first_beam_size = 10;
   int second_beam_size = 10;
+  // When blank prob is greater than this thresh, only the blank ending
+  // scores of the hypotheses are updated on the frame, 1.0 means no skip
+  float blank_skip_thresh = 1.0;
+  // Shallow fusion of the n-gram LM, the score of a prefix is added by
+  // lm_weight * log p(token | history) + lm_bonus for each token of it
+  float lm_weight = 0.5;
+  float lm_bonus = 0.0;
 };
 
-struct PrefixScore {
-  float s = -kFloatMax;               // blank ending score
-  float ns = -kFloatMax;              // none blank ending score
+// Node of a persistent list of ints, the list of a node is the list of its
+// parent followed by its value, so the lists share their common heads and
+// appending to a list is O(1).
+struct ListNode {
+  int parent;
+  int value;
+  int length;
+};
+
+// The posteriors of the last token of a list of times, it's kept beside
+// the node of the list in CtcPrefixBeamSearch::list_posteriors_
+struct TokenPosteriors {
+  float max;
+  float min;
+  float sum;
+  int frames;
+
+  TokenConfidence confidence() const {
+    return {max, frames > 0 ? sum / frames : 0, min};
+  }
+};
+
+// The viterbi scores of a prefix and the times of its viterbi paths, they
+// are only tracked for the timestamps
+struct PrefixViterbi {
   float v_s = -kFloatMax;             // viterbi blank ending score
   float v_ns = -kFloatMax;            // viterbi none blank ending score
   float cur_token_prob = -kFloatMax;  // prob of current token
-  std::vector<int> times_s;           // times of viterbi blank path
-  std::vector<int> times_ns;          // times of viterbi none blank path
+  // The lists below are nodes of CtcPrefixBeamSearch::lists_, -1 is empty
+  int times_s = -1;                   // times of viterbi blank path
+  int times_ns = -1;                  // times of viterbi none blank path
 
-  float score() const { return LogAdd(s, ns); }
   float viterbi_score() const { return v_s > v_ns ? v_s : v_ns; }
-  const std::vector<int>& times() const {
-    return v_s > v_ns ? times_s : times_ns;
-  }
+  int times() const { return v_s > v_ns ? times_s : times_ns; }
+};
 
+// The context biasing state of a prefix
+struct PrefixContext {
   bool has_context = false;
   int context_state = 0;
   float context_score = 0;
-  std::vector<int> start_boundaries;
-  std::vector<int> end_boundaries;
+  int start_boundaries = -1;
+  int end_boundaries = -1;
 
-  void CopyContext(const PrefixScore& prefix_score) {
+  void CopyContext(const PrefixContext& prefix_score) {
     context_state = prefix_score.context_state;
     context_score = prefix_score.context_score;
     start_boundaries = prefix_score.start_boundaries;
     end_boundaries = prefix_score.end_boundaries;
   }
+};
 
-  void UpdateContext(const std::shared_ptr<ContextGraph>& context_graph,
-                     const PrefixScore& prefix_score, int word_id,
-                     int prefix_len) {
-    this->CopyContext(prefix_score);
-
-    float score = 0;
-    bool is_start_boundary = false;
-    bool is_end_boundary = false;
-
-    context_state =
-        context_graph->GetNextState(prefix_score.context_state, word_id, &score,
-                                    &is_start_boundary, &is_end_boundary);
-    context_score += score;
-    if (is_start_boundary) start_boundaries.emplace_back(prefix_len);
-    if (is_end_boundary) end_boundaries.emplace_back(prefix_len);
-  }
+// The empty ones of the features compiled out
+struct NoPrefixViterbi {};
+struct NoPrefixContext {};
 
-  float total_score() const { return score() + context_score; }
-};
+inline float ContextScore(const PrefixContext& context) {
+  return context.context_score;
+}
+inline float ContextScore(const NoPrefixContext&) { return 0; }
 
-struct PrefixHash {
-  size_t operator()(const std::vector<int>& prefix) const {
-    size_t hash_code = 0;
-    // here we use KB&DR hash code
-    for (int id : prefix) {
-      hash_code = id + 31 * hash_code;
-    }
-    return hash_code;
+// The score of a prefix, it only has the fields of the features of the
+// search, so the one of the plain search is three floats
+template <bool kContext, bool kTimes>
+struct PrefixScore
+    : std::conditional<kTimes, PrefixViterbi, NoPrefixViterbi>::type,
+      std::conditional<kContext, PrefixContext, NoPrefixContext>::type {
+  float s = -kFloatMax;   // blank ending score
+  float ns = -kFloatMax;  // none blank ending score
+  // The weighted LM score of the prefix
+  float lm_score = 0;
+
+  float score() const { return LogAdd(s, ns); }
+  float total_score() const {
+    return score() + ContextScore(*this) + lm_score;
   }
 };
 
-class CtcPrefixBeamSearch : public SearchInterface {
+// CTC prefix beam search, specialized at compile time on its features:
+// kContext for the context biasing and kTimes for the timestamps and the
+// viterbi scores they come from. The search of neither of them has a lean
+// inner loop and a small PrefixScore. NewCtcPrefixBeamSearch() picks the
+// one of the decoding.
+template <bool kContext, bool kTimes>
+class CtcPrefixBeamSearchT : public SearchInterface {
  public:
-  explicit CtcPrefixBeamSearch(
+  using Score = PrefixScore<kContext, kTimes>;
+
+  // context_graph must be nullptr without kContext
+  explicit CtcPrefixBeamSearchT(
       const CtcPrefixBeamSearchOptions& opts,
-      const std::shared_ptr<ContextGraph>& context_graph = nullptr);
+      const std::shared_ptr<ContextGraph>& context_graph = nullptr,
+      const std::shared_ptr<NgramLm>& lm = nullptr);
 
-  void Search(const std::vector<std::vector<float>>& logp) override;
+  using SearchInterface::Search;
+  void Search(const LogProbMatrix& logp) override;
+  void Search(const SparseLogProbMatrix& logp) override;
   void Reset() override;
   void FinalizeSearch() override;
+  void set_context_graph(
+      const std::shared_ptr<ContextGraph>& context_graph) override;
   SearchType Type() const override { return SearchType::kPrefixBeamSearch; }
-  void UpdateOutputs(const std::pair<std::vector<int>, PrefixScore>& prefix);
-  void UpdateHypotheses(
-      const std::vector<std::pair<std::vector<int>, PrefixScore>>& hpys);
+  void UpdateHypotheses(std::vector<std::pair<int, Score>>* hpys);
   void UpdateFinalContext();
+  // Add the LM score of </s>
+  void UpdateFinalLm();
 
+  // Empty without kTimes
   const std::vector<float>& viterbi_likelihood() const {
     return viterbi_likelihood_;
   }
   const std::vector<std::vector<int>>& Inputs() const override {
+    UpdatePrefixes();
     return hypotheses_;
   }
   const std::vector<std::vector<int>>& Outputs() const override {
+    UpdatePrefixes();
     return outputs_;
   }
   const std::vector<float>& Likelihood() const override { return likelihood_; }
-  const std::vector<std::vector<int>>& Times() const override { return times_; }
+  // Empty times without kTimes
+  const std::vector<std::vector<int>>& Times() const override {
+    UpdatePrefixes();
+    return times_;
+  }
+  // The posteriors of the tokens on the viterbi paths, empty without kTimes
+  const std::vector<std::vector<TokenConfidence>>& Confidences()
+      const override {
+    UpdatePrefixes();
+    return confidences_;
+  }
+  size_t MemoryBytes() const override;
+  int NumHypotheses() const override { return nodes_.size(); }
+  void set_beam_scale(float scale) override { beam_scale_ = scale; }
+  // The prefix tree, the lists and the scores of the hypotheses as they
+  // are, the features must be the same ones
+  bool SaveState(StateWriter* writer) const override;
+  bool RestoreState(StateReader* reader) override;
 
  private:
+  // Return the node of prefix `node` followed by `token`, it's created if it
+  // doesn't exist yet, and so is its LM state
+  int Extend(int node, int token);
+  float LmScore(int node) const { return lm_ ? node_lms_[node].score : 0; }
+  // Return the list `list` of lists_ followed by `value`, the posteriors
+  // of its last node are the ones of the token of a time
+  int Append(int list, int value, const TokenPosteriors& posteriors = {});
+  // Pass a frame of the candidates in topk_score_ and topk_index_
+  void SearchFrame();
+  // Pass a blank frame of blank log prob prob with the blank ending scores
+  // only
+  void SkipBlankFrame(float prob);
+  void UpdateContext(const PrefixContext& prefix_score, int word_id,
+                     int prefix_len, PrefixContext* next_score);
+  // The steps of the features in the search, the ones of the features
+  // compiled out are empty.
+  // Case 0 and 1, the prefix is not changed, so is its context
+  void KeepContext(const PrefixContext& prefix_score,
+                   PrefixContext* next_score);
+  void KeepContext(const NoPrefixContext&, NoPrefixContext*) {}
+  // Case 2 and 3, the prefix of prefix_len is extended by word_id
+  void ExtendContext(const PrefixContext& prefix_score, int word_id,
+                     int prefix_len, PrefixContext* next_score);
+  void ExtendContext(const NoPrefixContext&, int, int, NoPrefixContext*) {}
+  // Case 0: *a + ε => *a
+  void ViterbiBlank(const PrefixViterbi& prefix_score, float prob,
+                    PrefixViterbi* next_score);
+  void ViterbiBlank(const NoPrefixViterbi&, float, NoPrefixViterbi*) {}
+  // Case 1: *a + a => *a
+  void ViterbiRepeat(const PrefixViterbi& prefix_score, float prob,
+                     PrefixViterbi* next_score);
+  void ViterbiRepeat(const NoPrefixViterbi&, float, NoPrefixViterbi*) {}
+  // Case 2 from the blank ending path and case 3 from the best path
+  void ViterbiExtend(const PrefixViterbi& prefix_score, bool from_blank,
+                     float prob, PrefixViterbi* next_score);
+  void ViterbiExtend(const NoPrefixViterbi&, bool, float, NoPrefixViterbi*) {}
+  // Back off the context state not fully matched at the end
+  void FinalContext(PrefixContext* prefix_score, int prefix_len);
+  void FinalContext(NoPrefixContext*, int) {}
+  // Copy the lists of lists_ a score refers to in CompactNodes()
+  void CopyTimes(PrefixViterbi* score);
+  void CopyTimes(NoPrefixViterbi*) {}
+  void CopyBoundaries(PrefixContext* score);
+  void CopyBoundaries(NoPrefixContext*) {}
+  // The children_ table
+  int FindChild(uint64_t key) const;
+  void InsertChild(uint64_t key, int node);
+  void ClearChildren();
+  // The score of prefix `node` in next_hyps_, it's added if not there yet
+  Score& NextHyp(int node);
+  // Drop the nodes and the lists which are not used by any hypothesis
+  void CompactNodes();
+  void UpdateOutput(const std::vector<int>& input,
+                    const PrefixContext& score,
+                    std::vector<int>* output) const;
+  void UpdateOutput(const std::vector<int>& input, const NoPrefixContext&,
+                    std::vector<int>* output) const {
+    *output = input;
+  }
+  // Materialize hypotheses_, outputs_, times_ and confidences_ from
+  // cur_hyps_
+  void UpdatePrefixes() const;
   int abs_time_step_ = 0;
+  float beam_scale_ = 1.0;
+
+  // The prefix tree of the utterance, a hypothesis is a node, so a prefix
+  // is extended in O(1), and it's only materialized when it's read. Node 0
+  // is the empty prefix.
+  std::vector<ListNode> nodes_;
+  // (parent << 32 | token) => node, an open addressing table of linear
+  // probing, it's cleared without freeing its slots
+  struct Child {
+    uint64_t key;
+    int node;
+  };
+  std::vector<Child> children_;
+  size_t num_children_ = 0;
+  // The LM state and the weighted LM score of each node, it's computed once
+  // when the node is created
+  struct NodeLm {
+    int state;
+    float score;
+  };
+  std::vector<NodeLm> node_lms_;
+  // The times and the context boundaries of the hypotheses, a hypothesis
+  // shares them with its ancestors, they're only materialized when read
+  std::vector<ListNode> lists_;
+  std::vector<TokenPosteriors> list_posteriors_;
+  mutable std::vector<int> start_boundaries_;
+  mutable std::vector<int> end_boundaries_;
+  // Compact the nodes when there are more nodes than it
+  size_t compact_threshold_ = 0;
 
   // N-best list and corresponding likelihood_, in sorted order
-  std::vector<std::vector<int>> hypotheses_;
+  std::vector<std::pair<int, Score>> cur_hyps_;
   std::vector<float> likelihood_;
   std::vector<float> viterbi_likelihood_;
-  std::vector<std::vector<int>> times_;
+  // Scratch of the blank and none blank ending scores of cur_hyps_ and
+  // their sums, for each frame
+  std::vector<float> hyp_s_, hyp_ns_, hyp_scores_;
+  // The scratch below is kept across the frames and the utterances, so a
+  // session stops allocating once its buffers are large enough.
+  // The topk of each frame
+  std::vector<float> topk_score_;
+  std::vector<int32_t> topk_index_;
+  // The hypotheses of the next frame, and the index of each node in it, -1
+  // if it's not there
+  std::vector<std::pair<int, Score>> next_hyps_;
+  std::vector<int> next_hyp_index_;
+  // The new ids and the new nodes and lists of CompactNodes()
+  std::vector<int> new_ids_, new_list_ids_, path_;
+  std::vector<ListNode> new_nodes_, new_lists_;
+  std::vector<TokenPosteriors> new_list_posteriors_;
+  std::vector<NodeLm> new_node_lms_;
+  mutable bool prefixes_updated_ = false;
+  mutable std::vector<std::vector<int>> hypotheses_;
+  mutable std::vector<std::vector<int>> times_;
+  mutable std::vector<std::vector<TokenConfidence>> confidences_;
+  // Outputs contain the hypotheses_ and tags like: <context> and </context>
+  mutable std::vector<std::vector<int>> outputs_;
 
-  std::unordered_map<std::vector<int>, PrefixScore, PrefixHash> cur_hyps_;
   std::shared_ptr<ContextGraph> context_graph_ = nullptr;
-  // Outputs contain the hypotheses_ and tags like: <context> and </context>
-  std::vector<std::vector<int>> outputs_;
+  std::shared_ptr<NgramLm> lm_ = nullptr;
   const CtcPrefixBeamSearchOptions& opts_;
 
  public:
-  WENET_DISALLOW_COPY_AND_ASSIGN(CtcPrefixBeamSearch);
+  WENET_DISALLOW_COPY_AND_ASSIGN(CtcPrefixBeamSearchT);
 };
 
+// The search of all the features, the context biasing is still off
+// without a context graph
+using CtcPrefixBeamSearch = CtcPrefixBeamSearchT<true, true>;
+
+// The search of the features of the decoding, with the context biasing if
+// context_graph isn't nullptr and the times if `times`
+std::unique_ptr<SearchInterface> NewCtcPrefixBeamSearch(
+    const CtcPrefixBeamSearchOptions& opts,
+    const std::shared_ptr<ContextGraph>& context_graph,
+    const std::shared_ptr<NgramLm>& lm, bool times);
+
 }  // namespace wenet
 
 #endif  // DECODER_CTC_PREFIX_BEAM_SEARCH_H_
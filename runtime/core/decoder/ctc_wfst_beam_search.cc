@@ -3,29 +3,44 @@
 
 #include "decoder/ctc_wfst_beam_search.h"
 
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <map>
+#include <queue>
+#include <sstream>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 
+#include "fst/lookahead-filter.h"
+#include "fst/lookahead-matcher.h"
+#include "kaldi/lat/determinize-lattice-pruned.h"
+#include "kaldi/lat/kaldi-lattice.h"
+
 namespace wenet {
 
 void DecodableTensorScaled::Reset() {
   num_frames_ready_ = 0;
   done_ = false;
-  // Give an empty initialization, will throw error when
-  // AcceptLoglikes is not called
-  logp_.clear();
+  first_frame_ = 0;
+  rows_.clear();
 }
 
 void DecodableTensorScaled::AcceptLoglikes(
-    const std::vector<float>& logp) {
-  ++num_frames_ready_;
-  // TODO(Binbin Zhang): Avoid copy here
-  logp_ = logp;
+    const std::vector<const float*>& rows) {
+  first_frame_ = num_frames_ready_;
+  num_frames_ready_ += rows.size();
+  rows_ = rows;
 }
 
 float DecodableTensorScaled::LogLikelihood(int32 frame, int32 index) {
   CHECK_GT(index, 0);
   CHECK_LT(frame, num_frames_ready_);
-  return scale_ * logp_[index - 1];
+  CHECK_GE(frame, first_frame_);
+  return scale_ * rows_[frame - first_frame_][index - 1];
 }
 
 bool DecodableTensorScaled::IsLastFrame(int32 frame) const {
@@ -38,13 +53,276 @@ int32 DecodableTensorScaled::NumIndices() const {
   return 0;
 }
 
+fst::Fst<fst::StdArc>* ComposeDecodingGraph(
+    const fst::StdVectorFst& token_fst, const fst::Fst<fst::StdArc>& lg_fst,
+    size_t cache_bytes) {
+  using Matcher = fst::SortedMatcher<fst::Fst<fst::StdArc>>;
+  using LookAheadMatcher = fst::ArcLookAheadMatcher<Matcher>;
+  using SequenceFilter = fst::AltSequenceComposeFilter<LookAheadMatcher>;
+  using LookAheadFilter =
+      fst::LookAheadComposeFilter<SequenceFilter, LookAheadMatcher>;
+  using PushWeightsFilter =
+      fst::PushWeightsComposeFilter<LookAheadFilter, LookAheadMatcher>;
+  fst::CacheOptions cache_opts(true, cache_bytes);
+  fst::ComposeFstOptions<fst::StdArc, LookAheadMatcher, PushWeightsFilter>
+      compose_opts(cache_opts);
+  return new fst::ComposeFst<fst::StdArc>(token_fst, lg_fst, compose_opts);
+}
+
+// The posteriors of the tokens of the frames of a linear lattice, from the
+// acoustic costs of its arcs, which are -acoustic_scale * log prob. The
+// frames without a token, i.e. the epsilon arcs, are skipped as by
+// fst::GetLinearSymbolSequence()
+static void GetFramePosteriors(const kaldi::Lattice& lat,
+                               float acoustic_scale,
+                               std::vector<float>* posteriors) {
+  posteriors->clear();
+  auto state = lat.Start();
+  while (state != fst::kNoStateId &&
+         lat.Final(state) == kaldi::LatticeWeight::Zero()) {
+    fst::ArcIterator<kaldi::Lattice> aiter(lat, state);
+    if (aiter.Done()) break;
+    const kaldi::LatticeArc& arc = aiter.Value();
+    if (arc.ilabel != 0) {
+      posteriors->push_back(
+          std::exp(-arc.weight.Value2() / acoustic_scale));
+    }
+    state = arc.nextstate;
+  }
+}
+
+// Lazy N-best of the distinct output sequences in a raw lattice, by an A*
+// search with the costs to the final states as the heuristic, which is
+// exact. A partial path is dropped if a better one has reached the same
+// state with the same outputs, so the alignments of one output sequence are
+// not enumerated. Each N-best is returned as a linear lattice.
+static void GetNbestPaths(const kaldi::Lattice& lat, int n,
+                          std::vector<kaldi::Lattice>* nbest_lats) {
+  using StateId = kaldi::LatticeArc::StateId;
+  nbest_lats->clear();
+  if (lat.Start() == fst::kNoStateId) return;
+  std::vector<kaldi::LatticeWeight> backward;
+  fst::ShortestDistance(lat, &backward, true);
+  auto cost_of = [](const kaldi::LatticeWeight& w) {
+    return static_cast<double>(w.Value1()) + w.Value2();
+  };
+  auto backward_cost = [&](StateId s) {
+    if (s >= static_cast<StateId>(backward.size())) {
+      return std::numeric_limits<double>::infinity();
+    }
+    return cost_of(backward[s]);
+  };
+
+  // A partial path ends at state, or at the final of state if is_final,
+  // prefix is its output sequence in a trie
+  struct Node {
+    StateId state;
+    int parent;
+    int prefix;
+    bool is_final;
+    double cost;
+    kaldi::LatticeArc arc;  // the arc from the parent node
+  };
+  std::vector<Node> nodes;
+  std::unordered_map<uint64_t, int> prefix_children;
+  std::unordered_set<uint64_t> expanded;
+  std::unordered_set<int> emitted;
+  using QueueElem = std::pair<double, int>;
+  std::priority_queue<QueueElem, std::vector<QueueElem>,
+                      std::greater<QueueElem>> queue;
+  auto push = [&](const Node& node) {
+    double f = node.cost + (node.is_final ? 0 : backward_cost(node.state));
+    if (f == std::numeric_limits<double>::infinity()) return;
+    nodes.push_back(node);
+    queue.emplace(f, nodes.size() - 1);
+  };
+  push({lat.Start(), -1, 0, false, 0, kaldi::LatticeArc()});
+  while (!queue.empty() && static_cast<int>(nbest_lats->size()) < n) {
+    int index = queue.top().second;
+    queue.pop();
+    const Node node = nodes[index];
+    if (node.is_final) {
+      if (!emitted.insert(node.prefix).second) continue;
+      // Trace back to a linear lattice
+      std::vector<kaldi::LatticeArc> arcs;
+      // nodes[0] is the start
+      for (int i = node.parent; i > 0; i = nodes[i].parent) {
+        arcs.push_back(nodes[i].arc);
+      }
+      kaldi::Lattice path;
+      StateId state = path.AddState();
+      path.SetStart(state);
+      for (auto it = arcs.rbegin(); it != arcs.rend(); ++it) {
+        kaldi::LatticeArc arc = *it;
+        arc.nextstate = path.AddState();
+        path.AddArc(state, arc);
+        state = arc.nextstate;
+      }
+      path.SetFinal(state, node.arc.weight);
+      nbest_lats->push_back(std::move(path));
+      continue;
+    }
+    uint64_t key = (static_cast<uint64_t>(node.state) << 32) | node.prefix;
+    if (!expanded.insert(key).second) continue;
+    kaldi::LatticeWeight final_weight = lat.Final(node.state);
+    if (final_weight != kaldi::LatticeWeight::Zero()) {
+      kaldi::LatticeArc arc(0, 0, final_weight, node.state);
+      push({node.state, index, node.prefix, true,
+            node.cost + cost_of(final_weight), arc});
+    }
+    for (fst::ArcIterator<kaldi::Lattice> aiter(lat, node.state);
+         !aiter.Done(); aiter.Next()) {
+      const kaldi::LatticeArc& arc = aiter.Value();
+      int prefix = node.prefix;
+      if (arc.olabel != 0) {
+        uint64_t child = (static_cast<uint64_t>(prefix) << 32) | arc.olabel;
+        auto it = prefix_children.find(child);
+        if (it == prefix_children.end()) {
+          it = prefix_children.emplace(child, prefix_children.size() + 1)
+                   .first;
+        }
+        prefix = it->second;
+      }
+      push({arc.nextstate, index, prefix, false,
+            node.cost + cost_of(arc.weight), arc});
+    }
+  }
+}
+
+void RescoreLattice(const kaldi::CompactLattice& clat, const NgramLm& lm,
+                    const NgramLm* old_lm, float lm_scale,
+                    const std::vector<int>& skipped_words,
+                    kaldi::CompactLattice* rescored) {
+  using StateId = kaldi::CompactLatticeArc::StateId;
+  // The state of clat, of lm and of old_lm
+  using Key = std::tuple<StateId, int, int>;
+  rescored->DeleteStates();
+  if (clat.Start() == fst::kNoStateId) return;
+  std::map<Key, StateId> states;
+  std::vector<std::pair<Key, StateId>> queue;
+  auto get_state = [&](const Key& key) {
+    auto it = states.find(key);
+    if (it != states.end()) return it->second;
+    StateId state = rescored->AddState();
+    states.emplace(key, state);
+    queue.emplace_back(key, state);
+    return state;
+  };
+  // The weight of the LM log probs of a word, or of </s>
+  auto rescore = [&](const kaldi::LatticeWeight& weight, float logprob,
+                     float old_logprob) {
+    float graph_cost = old_lm != nullptr ? weight.Value1() + old_logprob : 0;
+    return kaldi::LatticeWeight(graph_cost - lm_scale * logprob,
+                                weight.Value2());
+  };
+  rescored->SetStart(get_state(Key(clat.Start(), lm.BeginState(),
+                                   old_lm != nullptr ? old_lm->BeginState()
+                                                     : 0)));
+  while (!queue.empty()) {
+    StateId s = std::get<0>(queue.back().first);
+    int lm_state = std::get<1>(queue.back().first);
+    int old_state = std::get<2>(queue.back().first);
+    StateId state = queue.back().second;
+    queue.pop_back();
+    kaldi::CompactLatticeWeight final_weight = clat.Final(s);
+    if (final_weight != kaldi::CompactLatticeWeight::Zero()) {
+      rescored->SetFinal(
+          state, kaldi::CompactLatticeWeight(
+                     rescore(final_weight.Weight(), lm.FinalScore(lm_state),
+                             old_lm != nullptr ? old_lm->FinalScore(old_state)
+                                               : 0),
+                     final_weight.String()));
+    }
+    for (fst::ArcIterator<kaldi::CompactLattice> aiter(clat, s);
+         !aiter.Done(); aiter.Next()) {
+      kaldi::CompactLatticeArc arc = aiter.Value();
+      int next_lm_state = lm_state;
+      int next_old_state = old_state;
+      float logprob = 0;
+      float old_logprob = 0;
+      if (arc.ilabel != 0 &&
+          std::find(skipped_words.begin(), skipped_words.end(), arc.ilabel) ==
+              skipped_words.end()) {
+        logprob = lm.Score(lm_state, arc.ilabel, &next_lm_state);
+        if (old_lm != nullptr) {
+          old_logprob = old_lm->Score(old_state, arc.ilabel, &next_old_state);
+        }
+      }
+      arc.weight = kaldi::CompactLatticeWeight(
+          rescore(arc.weight.Weight(), logprob, old_logprob),
+          arc.weight.String());
+      arc.nextstate = get_state(Key(arc.nextstate, next_lm_state,
+                                    next_old_state));
+      rescored->AddArc(state, arc);
+    }
+  }
+}
+
+// Append the lattice part to lat. The final states of lat go on by the arcs
+// of the start of part, with their final weights, which hold the strings of
+// their last frames, put in front of the weights of the arcs.
+static void AppendLattice(const kaldi::CompactLattice& part,
+                          kaldi::CompactLattice* lat) {
+  using StateId = kaldi::CompactLatticeArc::StateId;
+  if (part.Start() == fst::kNoStateId) {
+    lat->DeleteStates();
+    return;
+  }
+  std::vector<StateId> finals;
+  for (StateId s = 0; s < lat->NumStates(); ++s) {
+    if (lat->Final(s) != kaldi::CompactLatticeWeight::Zero()) {
+      finals.push_back(s);
+    }
+  }
+  const StateId offset = lat->NumStates();
+  for (StateId s = 0; s < part.NumStates(); ++s) {
+    lat->AddState();
+  }
+  for (StateId s = 0; s < part.NumStates(); ++s) {
+    lat->SetFinal(s + offset, part.Final(s));
+    for (fst::ArcIterator<kaldi::CompactLattice> aiter(part, s); !aiter.Done();
+         aiter.Next()) {
+      kaldi::CompactLatticeArc arc = aiter.Value();
+      arc.nextstate += offset;
+      lat->AddArc(s + offset, arc);
+    }
+  }
+  for (StateId s : finals) {
+    kaldi::CompactLatticeWeight final_weight = lat->Final(s);
+    lat->SetFinal(s, fst::Times(final_weight, part.Final(part.Start())));
+    for (fst::ArcIterator<kaldi::CompactLattice> aiter(part, part.Start());
+         !aiter.Done(); aiter.Next()) {
+      kaldi::CompactLatticeArc arc = aiter.Value();
+      arc.weight = fst::Times(final_weight, arc.weight);
+      arc.nextstate += offset;
+      lat->AddArc(s, arc);
+    }
+  }
+  // The copy of the start of part is not reachable
+  fst::Connect(lat);
+}
+
 CtcWfstBeamSearch::CtcWfstBeamSearch(
     const fst::Fst<fst::StdArc>& fst, const CtcWfstBeamSearchOptions& opts,
-    const std::shared_ptr<ContextGraph>& context_graph)
-    : decodable_(opts.acoustic_scale),
-      decoder_(fst, opts, context_graph),
+    const std::shared_ptr<ContextGraph>& context_graph,
+    const std::shared_ptr<NgramLm>& rescore_lm,
+    const std::shared_ptr<NgramLm>& rescore_old_lm)
+    : lazy_fst_(fst.Properties(fst::kExpanded, false) ? nullptr
+                                                      : fst.Copy(true)),
+      decodable_(opts.acoustic_scale),
       context_graph_(context_graph),
+      rescore_lm_(rescore_lm),
+      rescore_old_lm_(rescore_old_lm),
       opts_(opts) {
+  const fst::Fst<fst::StdArc>& search_fst =
+      lazy_fst_ != nullptr ? *lazy_fst_ : fst;
+  if (opts.nbest == 1 && !opts.output_lattice && rescore_lm_ == nullptr) {
+    viterbi_decoder_.reset(
+        new kaldi::ViterbiFasterDecoder(search_fst, opts, context_graph));
+  } else {
+    decoder_.reset(
+        new kaldi::LatticeFasterOnlineDecoder(search_fst, opts, context_graph));
+  }
   Reset();
 }
 
@@ -52,47 +330,85 @@ void CtcWfstBeamSearch::Reset() {
   num_frames_ = 0;
   decoded_frames_mapping_.clear();
   is_last_frame_blank_ = false;
+  last_frame_logp_ = nullptr;
   last_best_ = 0;
   inputs_.clear();
   outputs_.clear();
   likelihood_.clear();
   times_.clear();
+  confidences_.clear();
+  lattice_.clear();
+  partial_lattice_.DeleteStates();
+  partial_lattice_frames_ = 0;
+  best_path_.clear();
+  best_path_index_.clear();
+  best_alignment_.clear();
+  best_outputs_.clear();
   decodable_.Reset();
-  decoder_.InitDecoding();
+  if (viterbi_decoder_ != nullptr) {
+    viterbi_decoder_->InitDecoding();
+  } else {
+    decoder_->InitDecoding();
+  }
 }
 
-void CtcWfstBeamSearch::Search(const std::vector<std::vector<float>>& logp) {
-  if (0 == logp.size()) {
+void CtcWfstBeamSearch::Search(const LogProbMatrix& logp) {
+  if (0 == logp.rows()) {
     return;
   }
-  // Every time we get the log posterior, we decode it all before return
-  for (int i = 0; i < logp.size(); i++) {
-    float blank_score = std::exp(logp[i][0]);
+  // Pick the frames to decode first, then decode them all before return, so
+  // the decoder is advanced once per chunk
+  decoded_rows_.clear();
+  for (int i = 0; i < logp.rows(); i++) {
+    const float* logp_i = logp.Row(i);
+    float blank_score = std::exp(logp_i[0]);
     if (blank_score > opts_.blank_skip_thresh) {
       VLOG(3) << "skipping frame " << num_frames_ << " score " << blank_score;
       is_last_frame_blank_ = true;
-      last_frame_prob_ = logp[i];
+      last_frame_logp_ = logp_i;
     } else {
       // Get the best symbol
-      int cur_best = std::max_element(logp[i].begin(),
-                                      logp[i].end()) - logp[i].begin();
+      int cur_best = std::max_element(logp_i, logp_i + logp.cols()) - logp_i;
       // Optional, adding one blank frame if we has skipped it in two same
       // symbols
       if (cur_best != 0 && is_last_frame_blank_ && cur_best == last_best_) {
-        decodable_.AcceptLoglikes(last_frame_prob_);
-        decoder_.AdvanceDecoding(&decodable_, 1);
+        decoded_rows_.push_back(last_frame_logp_);
         decoded_frames_mapping_.push_back(num_frames_ - 1);
         VLOG(2) << "Adding blank frame at symbol " << cur_best;
       }
       last_best_ = cur_best;
 
-      decodable_.AcceptLoglikes(logp[i]);
-      decoder_.AdvanceDecoding(&decodable_, 1);
+      decoded_rows_.push_back(logp_i);
       decoded_frames_mapping_.push_back(num_frames_);
       is_last_frame_blank_ = false;
     }
     num_frames_++;
   }
+  if (!decoded_rows_.empty()) {
+    decodable_.AcceptLoglikes(decoded_rows_);
+    if (viterbi_decoder_ != nullptr) {
+      viterbi_decoder_->AdvanceDecoding(&decodable_);
+    } else {
+      decoder_->AdvanceDecoding(&decodable_);
+      int num_decoded = decoder_->NumFramesDecoded();
+      if (opts_.output_lattice && opts_.determinize_period > 0 &&
+          num_decoded - partial_lattice_frames_ > opts_.determinize_period) {
+        // Cut at the last frame all the paths pass through, the frames after
+        // it are left to FinalizeSearch() at least
+        for (int f = num_decoded - 1; f > partial_lattice_frames_; --f) {
+          if (decoder_->HasSingleToken(f)) {
+            DeterminizeLatticePart(f, false);
+            break;
+          }
+        }
+      }
+    }
+  }
+  // The chunk is not valid after return, keep the skipped frame
+  if (is_last_frame_blank_ && last_frame_logp_ != last_frame_prob_.data()) {
+    last_frame_prob_.assign(last_frame_logp_, last_frame_logp_ + logp.cols());
+    last_frame_logp_ = last_frame_prob_.data();
+  }
   // Get the best path
   inputs_.clear();
   outputs_.clear();
@@ -101,74 +417,268 @@ void CtcWfstBeamSearch::Search(const std::vector<std::vector<float>>& logp) {
     inputs_.resize(1);
     outputs_.resize(1);
     likelihood_.resize(1);
-    kaldi::Lattice lat;
-    decoder_.GetBestPath(&lat, false);
-    std::vector<int> alignment;
-    kaldi::LatticeWeight weight;
-    fst::GetLinearSymbolSequence(lat, &alignment, &outputs_[0], &weight);
-    ConvertToInputs(alignment, &inputs_[0]);
+    if (viterbi_decoder_ != nullptr) {
+      TraceBackPartialPath(*viterbi_decoder_);
+    } else {
+      TraceBackPartialPath(*decoder_);
+    }
+    ConvertToInputs(best_alignment_, &inputs_[0]);
+    outputs_[0] = best_outputs_;
     RemoveContinuousTags(&outputs_[0]);
-    VLOG(3) << weight.Value1() << " " << weight.Value2();
-    likelihood_[0] = -(weight.Value1() + weight.Value2());
+    VLOG(3) << "cost " << best_path_.back().cost;
+    likelihood_[0] = -best_path_.back().cost;
+  }
+}
+
+template <typename Decoder>
+void CtcWfstBeamSearch::TraceBackPartialPath(const Decoder& decoder) {
+  std::vector<PathNode> new_nodes;
+  std::vector<kaldi::LatticeArc> arcs;
+  int merged = -1;
+  auto iter = decoder.BestPathEnd(false);
+  while (!iter.Done()) {
+    auto it = best_path_index_.find(iter.tok);
+    if (it != best_path_index_.end() &&
+        best_path_[it->second].frame == iter.frame) {
+      merged = it->second;
+      break;
+    }
+    new_nodes.push_back({iter.tok, iter.frame, 0, 0, 0});
+    arcs.emplace_back();
+    iter = decoder.TraceBackBestPath(iter, &arcs.back());
+  }
+  VLOG(3) << "Traced back " << new_nodes.size() << " tokens, merged at "
+          << merged << " of " << best_path_.size();
+  // Drop the old path after the merged token
+  for (int i = merged + 1; i < best_path_.size(); ++i) {
+    best_path_index_.erase(best_path_[i].tok);
+  }
+  best_path_.resize(merged + 1);
+  best_alignment_.resize(merged < 0 ? 0 : best_path_[merged].num_alignment);
+  best_outputs_.resize(merged < 0 ? 0 : best_path_[merged].num_outputs);
+  double cost = merged < 0 ? 0 : best_path_[merged].cost;
+  // arcs[i] is the arc into new_nodes[i]
+  for (int i = static_cast<int>(new_nodes.size()) - 1; i >= 0; --i) {
+    const kaldi::LatticeArc& arc = arcs[i];
+    if (arc.ilabel != 0) best_alignment_.push_back(arc.ilabel);
+    if (arc.olabel != 0) best_outputs_.push_back(arc.olabel);
+    cost += arc.weight.Value1() + arc.weight.Value2();
+    PathNode& node = new_nodes[i];
+    node.num_alignment = best_alignment_.size();
+    node.num_outputs = best_outputs_.size();
+    node.cost = cost;
+    best_path_index_[node.tok] = best_path_.size();
+    best_path_.push_back(node);
   }
 }
 
 void CtcWfstBeamSearch::FinalizeSearch() {
   decodable_.SetFinish();
-  decoder_.FinalizeDecoding();
+  if (viterbi_decoder_ != nullptr) {
+    viterbi_decoder_->FinalizeDecoding();
+  } else {
+    decoder_->FinalizeDecoding();
+    // To compare the graphs, e.g. the ones of fstoptimizetlg
+    VLOG(1) << "Active tokens per frame "
+            << static_cast<float>(decoder_->NumActiveToks()) /
+                   std::max(decoder_->NumFramesDecoded(), 1);
+  }
   inputs_.clear();
   outputs_.clear();
   likelihood_.clear();
   times_.clear();
+  confidences_.clear();
+  lattice_.clear();
   if (decoded_frames_mapping_.size() > 0) {
     std::vector<kaldi::Lattice> nbest_lats;
-    if (opts_.nbest == 1) {
+    if (viterbi_decoder_ != nullptr) {
       kaldi::Lattice lat;
-      decoder_.GetBestPath(&lat, true);
+      viterbi_decoder_->GetBestPath(&lat, true);
       nbest_lats.push_back(std::move(lat));
     } else {
-      // Get N-best path by lattice(CompactLattice)
-      kaldi::CompactLattice clat;
-      decoder_.GetLattice(&clat, true);
-      kaldi::Lattice lat, nbest_lat;
-      fst::ConvertLattice(clat, &lat);
+      // Get the N-best word lists from the raw lattice, which is pruned by
+      // lattice_beam in FinalizeDecoding, without determinizing it
+      kaldi::Lattice lat;
+      decoder_->GetRawLattice(&lat, true);
       // TODO(Binbin Zhang): it's n-best word lists here, not character n-best
-      fst::ShortestPath(lat, &nbest_lat, opts_.nbest);
-      fst::ConvertNbestToVector(nbest_lat, &nbest_lats);
+      if (rescore_lm_ == nullptr) {
+        GetNbestPaths(lat, opts_.nbest, &nbest_lats);
+      }
+      if (opts_.output_lattice || rescore_lm_ != nullptr) {
+        kaldi::CompactLattice clat;
+        const kaldi::CompactLattice* word_lat = &clat;
+        if (opts_.output_lattice && opts_.determinize_period > 0) {
+          lat.DeleteStates();
+          DeterminizeLatticePart(decoder_->NumFramesDecoded(), true);
+          word_lat = &partial_lattice_;
+        } else {
+          DeterminizeLattice(&lat, &clat);
+        }
+        kaldi::CompactLattice rescored;
+        if (rescore_lm_ != nullptr) {
+          std::vector<int> skipped_words;
+          if (context_graph_ != nullptr) {
+            skipped_words = {context_graph_->start_tag_id(),
+                             context_graph_->end_tag_id()};
+          }
+          RescoreLattice(*word_lat, *rescore_lm_, rescore_old_lm_.get(),
+                         opts_.rescore_lm_scale, skipped_words, &rescored);
+          word_lat = &rescored;
+          // The N-best of the rescored lattice, with the frames of the
+          // tokens on the input as the raw lattice
+          fst::ConvertLattice(rescored, &lat);
+          GetNbestPaths(lat, opts_.nbest, &nbest_lats);
+        }
+        if (opts_.output_lattice) SetLattice(*word_lat);
+      }
     }
     int nbest = nbest_lats.size();
     inputs_.resize(nbest);
     outputs_.resize(nbest);
     likelihood_.resize(nbest);
     times_.resize(nbest);
+    // The paths of the rescored lattice have the costs of the words
+    const bool confidences =
+        rescore_lm_ == nullptr && opts_.acoustic_scale > 0;
+    if (confidences) confidences_.resize(nbest);
+    std::vector<float> posteriors;
     for (int i = 0; i < nbest; i++) {
       kaldi::LatticeWeight weight;
       std::vector<int> alignment;
       fst::GetLinearSymbolSequence(nbest_lats[i], &alignment, &outputs_[i],
                                    &weight);
-      ConvertToInputs(alignment, &inputs_[i], &times_[i]);
+      if (confidences) {
+        GetFramePosteriors(nbest_lats[i], opts_.acoustic_scale, &posteriors);
+      }
+      ConvertToInputs(alignment, &inputs_[i], &times_[i],
+                      confidences ? &posteriors : nullptr,
+                      confidences ? &confidences_[i] : nullptr);
       RemoveContinuousTags(&outputs_[i]);
       likelihood_[i] = -(weight.Value1() + weight.Value2());
     }
   }
 }
 
-void CtcWfstBeamSearch::ConvertToInputs(const std::vector<int>& alignment,
-                                        std::vector<int>* input,
-                                        std::vector<int>* time) {
+size_t CtcWfstBeamSearch::MemoryBytes() const {
+  size_t bytes = VectorBytes(decoded_frames_mapping_) +
+                 VectorBytes(last_frame_prob_) + VectorBytes(decoded_rows_) +
+                 VectorBytes(inputs_) + VectorBytes(outputs_) +
+                 VectorBytes(likelihood_) + VectorBytes(times_) +
+                 VectorBytes(confidences_) + lattice_.capacity() +
+                 VectorBytes(best_path_) +
+                 best_path_index_.size() * (sizeof(void*) + sizeof(int)) +
+                 VectorBytes(best_alignment_) + VectorBytes(best_outputs_);
+  if (viterbi_decoder_ != nullptr) {
+    bytes += viterbi_decoder_->AllocatedBytes();
+  } else {
+    bytes += decoder_->AllocatedBytes();
+  }
+  return bytes;
+}
+
+int CtcWfstBeamSearch::NumHypotheses() const {
+  if (viterbi_decoder_ != nullptr) return viterbi_decoder_->NumToks();
+  return decoder_->NumToks();
+}
+
+void CtcWfstBeamSearch::set_beam_scale(float scale) {
+  kaldi::LatticeFasterDecoderConfig config = opts_;
+  config.beam *= scale;
+  if (config.max_active != std::numeric_limits<int32>::max()) {
+    config.max_active = std::max(static_cast<int32>(config.max_active * scale),
+                                 std::max(config.min_active, 1));
+  }
+  if (viterbi_decoder_ != nullptr) {
+    viterbi_decoder_->SetOptions(config);
+  } else {
+    decoder_->SetOptions(config);
+  }
+}
+
+void CtcWfstBeamSearch::ConvertToInputs(
+    const std::vector<int>& alignment, std::vector<int>* input,
+    std::vector<int>* time, const std::vector<float>* posteriors,
+    std::vector<TokenConfidence>* confidences) {
   input->clear();
   if (time != nullptr) time->clear();
+  if (confidences != nullptr) confidences->clear();
+  if (posteriors == nullptr || posteriors->size() != alignment.size()) {
+    confidences = nullptr;
+  }
+  int frames = 0;
   for (int cur = 0; cur < alignment.size(); ++cur) {
     // ignore blank
     if (alignment[cur] - 1 == 0) continue;
     // merge continuous same label
-    if (cur > 0 && alignment[cur] == alignment[cur - 1]) continue;
+    if (cur > 0 && alignment[cur] == alignment[cur - 1]) {
+      if (confidences != nullptr) {
+        // The mean is kept as the sum until the last frame of the token
+        float posterior = (*posteriors)[cur];
+        TokenConfidence& confidence = confidences->back();
+        confidence.max = std::max(confidence.max, posterior);
+        confidence.min = std::min(confidence.min, posterior);
+        confidence.mean += posterior;
+        ++frames;
+        if (cur + 1 == alignment.size() ||
+            alignment[cur + 1] != alignment[cur]) {
+          confidence.mean /= frames;
+        }
+      }
+      continue;
+    }
 
     input->push_back(alignment[cur] - 1);
     if (time != nullptr) {
       time->push_back(decoded_frames_mapping_[cur]);
     }
+    if (confidences != nullptr) {
+      float posterior = (*posteriors)[cur];
+      confidences->push_back({posterior, posterior, posterior});
+      frames = 1;
+    }
+  }
+}
+
+void CtcWfstBeamSearch::DeterminizeLattice(kaldi::Lattice* raw_lat,
+                                           kaldi::CompactLattice* clat) const {
+  // Words on the input as GetLattice() of the decoder does, so the CTC token
+  // ids plus one of the decoded frames are the strings of the arcs, and the
+  // acoustic costs are scaled by acoustic_scale
+  fst::Invert(raw_lat);
+  fst::ArcSort(raw_lat, fst::ILabelCompare<kaldi::LatticeArc>());
+  fst::DeterminizeLatticePrunedOptions det_opts;
+  det_opts.max_mem = opts_.det_opts.max_mem;
+  fst::DeterminizeLatticePruned(*raw_lat, opts_.lattice_beam, clat, det_opts);
+  raw_lat->DeleteStates();
+  fst::Connect(clat);
+}
+
+void CtcWfstBeamSearch::DeterminizeLatticePart(int end_frame,
+                                               bool use_final_probs) {
+  // The parts are joined at the single token of partial_lattice_frames_, so
+  // the paths of the whole lattice are kept. The pruning of a part is looser
+  // than of the whole, the best path of the whole is the best paths of the
+  // parts. A final state of a part may have arcs too, so the joined lattice
+  // may not be deterministic at the joints.
+  kaldi::Lattice raw_lat;
+  kaldi::CompactLattice clat;
+  decoder_->GetRawLatticePart(partial_lattice_frames_, end_frame,
+                              use_final_probs, &raw_lat);
+  DeterminizeLattice(&raw_lat, &clat);
+  VLOG(2) << "Determinized the lattice of frames " << partial_lattice_frames_
+          << " to " << end_frame << ", " << clat.NumStates() << " states";
+  if (partial_lattice_frames_ == 0) {
+    partial_lattice_ = std::move(clat);
+  } else {
+    AppendLattice(clat, &partial_lattice_);
   }
+  partial_lattice_frames_ = end_frame;
+}
+
+void CtcWfstBeamSearch::SetLattice(const kaldi::CompactLattice& clat) {
+  std::ostringstream os;
+  kaldi::WriteCompactLattice(os, true, clat);
+  lattice_ = os.str();
 }
 
 void CtcWfstBeamSearch::RemoveContinuousTags(std::vector<int>* output) {
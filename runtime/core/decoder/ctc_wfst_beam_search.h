@@ -5,11 +5,16 @@
 #define DECODER_CTC_WFST_BEAM_SEARCH_H_
 
 #include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "decoder/context_graph.h"
 #include "decoder/search_interface.h"
 #include "kaldi/decoder/lattice-faster-online-decoder.h"
+#include "kaldi/decoder/viterbi-faster-decoder.h"
+#include "kaldi/lat/kaldi-lattice.h"
+#include "utils/ngram_lm.h"
 #include "utils/utils.h"
 
 namespace wenet {
@@ -23,14 +28,22 @@ class DecodableTensorScaled : public kaldi::DecodableInterface {
   bool IsLastFrame(int32 frame) const override;
   float LogLikelihood(int32 frame, int32 index) override;
   int32 NumIndices() const override;
-  void AcceptLoglikes(const std::vector<float>& logp);
+  // Accept the rows of a chunk at once, the frames before them must have
+  // been decoded. The rows are not copied, they must be valid until all the
+  // frames are decoded.
+  void AcceptLoglikes(const std::vector<const float*>& rows);
+  void AcceptLoglikes(const float* logp) {
+    AcceptLoglikes(std::vector<const float*>{logp});
+  }
   void SetFinish() { done_ = true; }
 
  private:
   int num_frames_ready_ = 0;
   float scale_ = 1.0;
   bool done_ = false;
-  std::vector<float> logp_;
+  // Frame of rows_[0]
+  int first_frame_ = 0;
+  std::vector<const float*> rows_;
 };
 
 // LatticeFasterDecoderConfig has the following key members
@@ -39,20 +52,63 @@ class DecodableTensorScaled : public kaldi::DecodableInterface {
 // lattice_beam: Lattice generation beam
 struct CtcWfstBeamSearchOptions : public kaldi::LatticeFasterDecoderConfig {
   float acoustic_scale = 1.0;
+  // The lattice is only generated for nbest > 1, the single best path is
+  // decoded by the faster ViterbiFasterDecoder
   float nbest = 10;
+  // Keep the word lattice of FinalizeSearch(), the raw lattice determinized
+  // and pruned by lattice_beam, for the rescoring outside, e.g. by a larger
+  // LM. It also enables the lattice decoder for nbest == 1.
+  bool output_lattice = false;
+  // With output_lattice, determinize the lattice in parts while searching:
+  // once this many frames are decoded since the last part, the raw lattice
+  // up to the last frame of a single token, which all the paths pass
+  // through, is determinized and appended. FinalizeSearch() then only
+  // determinizes the rest. 0 determinizes the whole lattice at the end.
+  int determinize_period = 0;
   // When blank score is greater than this thresh, skip the frame in viterbi
   // search
   float blank_skip_thresh = 0.98;
+  // The scale of the LM of the lattice rescoring, see RescoreLattice()
+  float rescore_lm_scale = 1.0;
 };
 
+// Rescore the word lattice clat of the first pass by lm, a larger LM of the
+// words than the one of the graph, into rescored. The lattice is composed
+// with lm on the fly, so only the histories of its paths are expanded. The
+// first pass LM costs are subtracted by old_lm, the LM of the graph, or
+// the graph costs are replaced by the ones of lm without it, which drops
+// the costs of the lexicon and of the context biasing too. The words of
+// skipped_words, e.g. the context tags, are not scored.
+void RescoreLattice(const kaldi::CompactLattice& clat, const NgramLm& lm,
+                    const NgramLm* old_lm, float lm_scale,
+                    const std::vector<int>& skipped_words,
+                    kaldi::CompactLattice* rescored);
+
+// Compose T and LG lazily, with the look-ahead on the output of T. The states
+// are expanded when they are visited and kept in a cache of cache_bytes, so
+// the memory scales with the searched part of the graph. The arcs of T must
+// be sorted by olabel, and the arcs of LG by ilabel (see
+// tools/fst/make_tlg.sh). T is only read, so one T could be composed with
+// many graphs by many threads.
+fst::Fst<fst::StdArc>* ComposeDecodingGraph(
+    const fst::StdVectorFst& token_fst, const fst::Fst<fst::StdArc>& lg_fst,
+    size_t cache_bytes);
+
 class CtcWfstBeamSearch : public SearchInterface {
  public:
   explicit CtcWfstBeamSearch(
       const fst::Fst<fst::StdArc>& fst, const CtcWfstBeamSearchOptions& opts,
-      const std::shared_ptr<ContextGraph>& context_graph);
-  void Search(const std::vector<std::vector<float>>& logp) override;
+      const std::shared_ptr<ContextGraph>& context_graph,
+      const std::shared_ptr<NgramLm>& rescore_lm = nullptr,
+      const std::shared_ptr<NgramLm>& rescore_old_lm = nullptr);
+  using SearchInterface::Search;
+  void Search(const LogProbMatrix& logp) override;
   void Reset() override;
   void FinalizeSearch() override;
+  void set_context_graph(
+      const std::shared_ptr<ContextGraph>& context_graph) override {
+    context_graph_ = context_graph;
+  }
   SearchType Type() const override { return SearchType::kWfstBeamSearch; }
   // For CTC prefix beam search, both inputs and outputs are hypotheses_
   const std::vector<std::vector<int>>& Inputs() const override {
@@ -63,26 +119,96 @@ class CtcWfstBeamSearch : public SearchInterface {
   }
   const std::vector<float>& Likelihood() const override { return likelihood_; }
   const std::vector<std::vector<int>>& Times() const override { return times_; }
+  // From the acoustic costs of the frames of the N-best paths of
+  // FinalizeSearch(), empty with the lattice rescoring, whose paths don't
+  // keep the costs of the frames
+  const std::vector<std::vector<TokenConfidence>>& Confidences()
+      const override {
+    return confidences_;
+  }
+  const std::string& Lattice() const override { return lattice_; }
+  // The lattice determinized so far with determinize_period, of the frames
+  // decoded until partial_lattice_frames(), it has no final-probs
+  const kaldi::CompactLattice& partial_lattice() const {
+    return partial_lattice_;
+  }
+  int partial_lattice_frames() const { return partial_lattice_frames_; }
+  size_t MemoryBytes() const override;
+  int NumHypotheses() const override;
+  // Scale beam and max_active, the lattice beam is kept
+  void set_beam_scale(float scale) override;
 
  private:
-  // Sub one and remove <blank>
+  // A token on the partial best path, with the sizes of the alignment and
+  // outputs and the cost of the path up to it
+  struct PathNode {
+    void* tok;
+    int frame;
+    int num_alignment;
+    int num_outputs;
+    double cost;
+  };
+  // Trace back the best path until it merges with the previous one, and
+  // reuse the cached prefix, so the cost doesn't grow with the utterance.
+  // The tokens before the current frame are never changed by the decoder,
+  // and a token can't be reallocated at the same frame, so a token with
+  // the same frame and address is the same one.
+  template <typename Decoder>
+  void TraceBackPartialPath(const Decoder& decoder);
+  // Sub one and remove <blank>, the posteriors of the frames of alignment
+  // are merged into the confidences of the tokens if they're given
   void ConvertToInputs(const std::vector<int>& alignment,
                        std::vector<int>* input,
-                       std::vector<int>* time = nullptr);
+                       std::vector<int>* time = nullptr,
+                       const std::vector<float>* posteriors = nullptr,
+                       std::vector<TokenConfidence>* confidences = nullptr);
   void RemoveContinuousTags(std::vector<int>* output);
+  // Determinize and prune the raw lattice by lattice_beam, raw_lat is
+  // consumed
+  void DeterminizeLattice(kaldi::Lattice* raw_lat,
+                          kaldi::CompactLattice* clat) const;
+  // Determinize the raw lattice from partial_lattice_frames_ to end_frame
+  // and append it to partial_lattice_
+  void DeterminizeLatticePart(int end_frame, bool use_final_probs);
+  // Write clat into lattice_
+  void SetLattice(const kaldi::CompactLattice& clat);
 
   int num_frames_ = 0;
   std::vector<int> decoded_frames_mapping_;
 
   int last_best_ = 0;  // last none blank best id
+  // The last skipped blank frame, it points to a row of the current chunk,
+  // or to last_frame_prob_ if it's skipped in the previous chunk
+  const float* last_frame_logp_ = nullptr;
   std::vector<float> last_frame_prob_;
   bool is_last_frame_blank_ = false;
+  // Rows of the frames to decode in the current chunk
+  std::vector<const float*> decoded_rows_;
   std::vector<std::vector<int>> inputs_, outputs_;
   std::vector<float> likelihood_;
   std::vector<std::vector<int>> times_;
+  std::vector<std::vector<TokenConfidence>> confidences_;
+  std::string lattice_;
+  kaldi::CompactLattice partial_lattice_;
+  int partial_lattice_frames_ = 0;
+  // The best path of the last partial result, from the start token
+  std::vector<PathNode> best_path_;
+  std::unordered_map<void*, int> best_path_index_;
+  std::vector<int> best_alignment_;
+  std::vector<int> best_outputs_;
+  // A lazy fst, e.g. the composed graph, fills its cache while it's searched
+  // and is not thread safe, so each search decodes its own copy
+  std::unique_ptr<fst::Fst<fst::StdArc>> lazy_fst_;
   DecodableTensorScaled decodable_;
-  kaldi::LatticeFasterOnlineDecoder decoder_;
+  // Only one of them is created, depending on opts.nbest, opts.output_lattice
+  // and the rescoring
+  std::unique_ptr<kaldi::LatticeFasterOnlineDecoder> decoder_;
+  std::unique_ptr<kaldi::ViterbiFasterDecoder> viterbi_decoder_;
   std::shared_ptr<ContextGraph> context_graph_;
+  // Optional, the LMs of RescoreLattice() in FinalizeSearch(), the N-best
+  // are of the rescored lattice then
+  std::shared_ptr<NgramLm> rescore_lm_;
+  std::shared_ptr<NgramLm> rescore_old_lm_;
   const CtcWfstBeamSearchOptions& opts_;
 };
 
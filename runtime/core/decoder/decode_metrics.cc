@@ -0,0 +1,109 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/decode_metrics.h"
+
+#include "decoder/batch_encoder_scheduler.h"
+#include "decoder/decode_scheduler.h"
+
+namespace wenet {
+
+static DecodeMetrics* NewDecodeMetrics() {
+  MetricsRegistry* registry = MetricsRegistry::Global();
+  DecodeMetrics* metrics = new DecodeMetrics();
+  metrics->encoder_forward_ms = registry->GetHistogram(
+      "wenet_encoder_forward_ms", "Encoder forward latency of a chunk",
+      LatencyBuckets());
+  metrics->search_ms = registry->GetHistogram(
+      "wenet_search_ms", "CTC search latency of a chunk", LatencyBuckets());
+  metrics->rescoring_ms = registry->GetHistogram(
+      "wenet_rescoring_ms", "Attention rescoring latency of a sentence",
+      LatencyBuckets());
+  metrics->rescoring_sentences = registry->GetGauge(
+      "wenet_rescoring_sentences",
+      "Sentences whose N-best is to be rescored, including the skipped ones");
+  metrics->rescoring_skipped = registry->GetGauge(
+      "wenet_rescoring_skipped",
+      "Sentences whose rescoring is skipped by the confidence of the N-best");
+  metrics->cascade_sentences = registry->GetGauge(
+      "wenet_cascade_sentences",
+      "Sentences rescored by the cascade model for the low confidence");
+  metrics->speculative_rescorings = registry->GetGauge(
+      "wenet_speculative_rescorings",
+      "Rescorings of the N-best started in the trailing silence of a sentence "
+      "ahead of its endpoint");
+  metrics->speculative_rescoring_hits = registry->GetGauge(
+      "wenet_speculative_rescoring_hits",
+      "Sentences whose final rescoring reused a speculative one");
+  metrics->result_cache_hits = registry->GetGauge(
+      "wenet_result_cache_hits",
+      "Offline audios whose results are of the result cache");
+  metrics->result_cache_misses = registry->GetGauge(
+      "wenet_result_cache_misses",
+      "Offline audios decoded as they are not in the result cache");
+  metrics->result_cache_bytes = registry->GetGauge(
+      "wenet_result_cache_bytes", "Bytes of the results in the result cache");
+  metrics->coalesced_partials = registry->GetGauge(
+      "wenet_coalesced_partials",
+      "Unsent partial results replaced by a newer one for a slow client");
+  metrics->first_partial_ms = registry->GetHistogram(
+      "wenet_first_partial_ms",
+      "Latency from the first audio of a stream to its first partial result",
+      LatencyBuckets());
+  metrics->final_ms = registry->GetHistogram(
+      "wenet_final_ms",
+      "Latency from the end of the input of a stream to its final result",
+      LatencyBuckets());
+  metrics->stream_rtf = registry->GetHistogram(
+      "wenet_stream_rtf", "RTF of the finished streams", RtfBuckets());
+  metrics->active_sessions = registry->GetGauge(
+      "wenet_active_sessions", "Streams being decoded");
+  metrics->model_state_bytes = registry->GetGauge(
+      "wenet_model_state_bytes",
+      "Bytes of the model caches and the encoder outputs of the streams");
+  metrics->search_state_bytes = registry->GetGauge(
+      "wenet_search_state_bytes",
+      "Bytes of the prefixes or the tokens of the searches of the streams");
+  metrics->feature_bytes = registry->GetGauge(
+      "wenet_feature_bytes",
+      "Bytes of the feature queues and chunks of the streams");
+  metrics->memory_degraded_sessions = registry->GetGauge(
+      "wenet_memory_degraded_sessions",
+      "Streams decoded with smaller beams over their memory budget");
+  metrics->beam_level = registry->GetGauge(
+      "wenet_beam_level",
+      "Level of the load adaptive beams, 0 is the full beams");
+  return metrics;
+}
+
+DecodeMetrics* DecodeMetrics::Get() {
+  static DecodeMetrics* metrics = NewDecodeMetrics();
+  return metrics;
+}
+
+void SetQueueMetrics(DecodeScheduler* scheduler,
+                     std::shared_ptr<BatchEncoderScheduler> encoder_scheduler) {
+  MetricsRegistry* registry = MetricsRegistry::Global();
+  registry->SetGaugeCallback(
+      "wenet_decode_queue_depth", "Runnable streams waiting for a worker",
+      [scheduler]() { return scheduler->num_queued(); });
+  if (encoder_scheduler != nullptr) {
+    registry->SetGaugeCallback(
+        "wenet_encoder_queue_load",
+        "Queued encoder chunks in units of the max batch size",
+        [encoder_scheduler]() { return encoder_scheduler->load(); });
+  }
+}
+
+}  // namespace wenet
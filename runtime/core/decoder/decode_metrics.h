@@ -0,0 +1,76 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_DECODE_METRICS_H_
+#define DECODER_DECODE_METRICS_H_
+
+#include <memory>
+
+#include "utils/metrics.h"
+
+namespace wenet {
+
+class BatchEncoderScheduler;
+class DecodeScheduler;
+
+// The metrics of the decoding and the streams of the servers, in
+// MetricsRegistry::Global(). The latencies are in milliseconds.
+struct DecodeMetrics {
+  Histogram* encoder_forward_ms;
+  Histogram* search_ms;
+  Histogram* rescoring_ms;
+  // Sentences to rescore, and the ones skipped by the confidence of their
+  // N-best, the skip rate is the ratio of them
+  Gauge* rescoring_sentences;
+  Gauge* rescoring_skipped;
+  // Sentences rescored by the cascade model
+  Gauge* cascade_sentences;
+  // Speculative rescorings started in the trailing silences, and the
+  // sentences whose final rescoring reused one of them
+  Gauge* speculative_rescorings;
+  Gauge* speculative_rescoring_hits;
+  // Offline requests answered by the result cache or decoded, and the bytes
+  // of the cached results
+  Gauge* result_cache_hits;
+  Gauge* result_cache_misses;
+  Gauge* result_cache_bytes;
+  // Partial results dropped from the write queue of a slow client for a
+  // newer one
+  Gauge* coalesced_partials;
+  // From the first audio of a stream to its first partial result
+  Histogram* first_partial_ms;
+  // From the end of the input of a stream to its final result
+  Histogram* final_ms;
+  Histogram* stream_rtf;
+  Gauge* active_sessions;
+  // Bytes of the states of all the decoders, see AsrDecoder::memory()
+  Gauge* model_state_bytes;
+  Gauge* search_state_bytes;
+  Gauge* feature_bytes;
+  // Decoders over their memory budget, with the beams scaled down
+  Gauge* memory_degraded_sessions;
+  // Level of the beams picked by AdaptiveBeamPolicy, 0 is the full beams
+  Gauge* beam_level;
+
+  static DecodeMetrics* Get();
+};
+
+// Report the queue depths of the schedulers of a server, which must outlive
+// the registry's rendering. encoder_scheduler is optional.
+void SetQueueMetrics(DecodeScheduler* scheduler,
+                     std::shared_ptr<BatchEncoderScheduler> encoder_scheduler);
+
+}  // namespace wenet
+
+#endif  // DECODER_DECODE_METRICS_H_
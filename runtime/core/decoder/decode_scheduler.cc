@@ -0,0 +1,264 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/decode_scheduler.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <utility>
+
+#include "utils/log.h"
+#include "utils/string.h"
+#include "utils/timer.h"
+
+namespace wenet {
+
+// The scheduler and the index of the worker running on this thread, the
+// sessions notified on a worker are queued on it
+static thread_local DecodeScheduler* current_scheduler = nullptr;
+static thread_local int current_worker = -1;
+
+// The sessions of a tenant of a priority, the flow of the fair queueing
+struct DecodeScheduler::Session::Tenant {
+  DecodePriority priority;
+  float weight;
+  // The virtual start time of its next run, it's advanced by the time of
+  // each run divided by the weight
+  double tag = 0;
+  // Its runnable sessions, it's backlogged if there are any
+  std::deque<std::shared_ptr<Session>> sessions;
+};
+
+DecodeScheduler::Session::Session(DecodeScheduler* scheduler,
+                                  std::function<bool()> run,
+                                  std::shared_ptr<Tenant> tenant)
+    : scheduler_(scheduler), run_(std::move(run)), tenant_(std::move(tenant)) {}
+
+void DecodeScheduler::Session::Notify() {
+  if (pending_.fetch_add(1) == 0) {
+    scheduler_->Enqueue(shared_from_this());
+  }
+}
+
+void DecodeScheduler::Session::Post(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.emplace_back(std::move(task));
+  }
+  Notify();
+}
+
+void DecodeScheduler::Session::Run() {
+  Timer timer;
+  int pending = pending_.load();
+  std::vector<std::function<void()>> tasks;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks.swap(tasks_);
+  }
+  for (auto& task : tasks) {
+    try {
+      task();
+    } catch (std::exception const& e) {
+      LOG(ERROR) << e.what();
+    }
+  }
+  if (run_ != nullptr) {
+    bool done = true;
+    try {
+      done = !run_();
+    } catch (std::exception const& e) {
+      LOG(ERROR) << e.what();
+    }
+    if (done) run_ = nullptr;
+  }
+  if (tenant_ != nullptr) {
+    scheduler_->Charge(this, timer.ElapsedUs());
+  }
+  // Notified during the run, run again after the other queued sessions.
+  // pending_ stays non-zero, so nobody else queues it meanwhile.
+  if (!pending_.compare_exchange_strong(pending, 0)) {
+    scheduler_->Enqueue(shared_from_this());
+  }
+}
+
+DecodeScheduler::DecodeScheduler(int num_workers,
+                                 std::shared_ptr<ThreadPlacement> placement)
+    : placement_(std::move(placement)) {
+  if (num_workers <= 0) {
+    num_workers = std::max<int>(std::thread::hardware_concurrency(), 1);
+  }
+  for (int i = 0; i < num_workers; ++i) {
+    workers_.emplace_back(new Worker);
+  }
+  for (int i = 0; i < num_workers; ++i) {
+    workers_[i]->thread = std::thread(&DecodeScheduler::WorkerLoop, this, i);
+  }
+}
+
+DecodeScheduler::~DecodeScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  queue_cond_.notify_all();
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
+}
+
+std::shared_ptr<DecodeScheduler::Session> DecodeScheduler::NewSession(
+    std::function<bool()> run, const DecodeClass& decode_class) {
+  std::shared_ptr<Tenant> tenant;
+  if (fair_) {
+    std::lock_guard<std::mutex> lock(fair_mutex_);
+    // Drop the ones of no session
+    for (auto it = tenants_.begin(); it != tenants_.end();) {
+      it = it->second.expired() ? tenants_.erase(it) : std::next(it);
+    }
+    auto key = std::make_pair(decode_class.priority, decode_class.tenant);
+    tenant = tenants_[key].lock();
+    if (tenant == nullptr) {
+      tenant = std::make_shared<Tenant>();
+      tenant->priority = decode_class.priority;
+      auto it = weights_.find(decode_class.tenant);
+      tenant->weight = it != weights_.end() ? it->second : 1.0f;
+      tenants_[key] = tenant;
+    }
+  }
+  return std::shared_ptr<Session>(
+      new Session(this, std::move(run), std::move(tenant)));
+}
+
+void DecodeScheduler::EnableFairQueueing(
+    std::unordered_map<std::string, float> weights) {
+  std::lock_guard<std::mutex> lock(fair_mutex_);
+  fair_ = true;
+  weights_ = std::move(weights);
+}
+
+void DecodeScheduler::Enqueue(std::shared_ptr<Session> session) {
+  if (session->tenant_ != nullptr) {
+    std::lock_guard<std::mutex> lock(fair_mutex_);
+    Tenant* tenant = session->tenant_.get();
+    if (tenant->sessions.empty()) {
+      // Backlogged again, the idle time isn't credited
+      const int priority = static_cast<int>(tenant->priority);
+      tenant->tag = std::max(tenant->tag, virtual_time_[priority]);
+      backlogged_[priority].push_back(tenant);
+    }
+    tenant->sessions.emplace_back(std::move(session));
+  } else {
+    int index = current_worker;
+    if (current_scheduler != this) {
+      index = next_worker_.fetch_add(1) % workers_.size();
+    }
+    Worker* worker = workers_[index].get();
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    worker->sessions.emplace_back(std::move(session));
+  }
+  num_queued_.fetch_add(1);
+  // The empty critical section orders the count before the wait of a
+  // worker which has just checked it
+  { std::lock_guard<std::mutex> lock(mutex_); }
+  queue_cond_.notify_one();
+}
+
+bool DecodeScheduler::Dequeue(int index, std::shared_ptr<Session>* session) {
+  if (fair_) return DequeueFair(session);
+  const int num_workers = workers_.size();
+  for (int i = 0; i < num_workers; ++i) {
+    Worker* worker = workers_[(index + i) % num_workers].get();
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    if (worker->sessions.empty()) continue;
+    if (i == 0) {
+      *session = std::move(worker->sessions.front());
+      worker->sessions.pop_front();
+    } else {
+      *session = std::move(worker->sessions.back());
+      worker->sessions.pop_back();
+    }
+    num_queued_.fetch_sub(1);
+    return true;
+  }
+  return false;
+}
+
+bool DecodeScheduler::DequeueFair(std::shared_ptr<Session>* session) {
+  std::lock_guard<std::mutex> lock(fair_mutex_);
+  for (int priority = 0; priority < 2; ++priority) {
+    std::vector<Tenant*>& backlogged = backlogged_[priority];
+    if (backlogged.empty()) continue;
+    auto first = std::min_element(
+        backlogged.begin(), backlogged.end(),
+        [](const Tenant* a, const Tenant* b) { return a->tag < b->tag; });
+    Tenant* tenant = *first;
+    *session = std::move(tenant->sessions.front());
+    tenant->sessions.pop_front();
+    // Charge the estimate now, the other workers dequeue meanwhile
+    virtual_time_[priority] = tenant->tag;
+    tenant->tag += (*session)->run_us_ / tenant->weight;
+    if (tenant->sessions.empty()) {
+      *first = backlogged.back();
+      backlogged.pop_back();
+    }
+    num_queued_.fetch_sub(1);
+    return true;
+  }
+  return false;
+}
+
+void DecodeScheduler::Charge(Session* session, double run_us) {
+  std::lock_guard<std::mutex> lock(fair_mutex_);
+  Tenant* tenant = session->tenant_.get();
+  tenant->tag += (run_us - session->run_us_) / tenant->weight;
+  session->run_us_ = run_us;
+}
+
+void DecodeScheduler::WorkerLoop(int index) {
+  if (placement_ != nullptr) {
+    placement_->Enter();
+  }
+  current_scheduler = this;
+  current_worker = index;
+  while (true) {
+    std::shared_ptr<Session> session;
+    if (Dequeue(index, &session)) {
+      session->Run();
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    queue_cond_.wait(lock, [this] { return stop_ || num_queued_ > 0; });
+    if (stop_ && num_queued_ == 0) return;
+  }
+}
+
+bool ParseTenantWeights(const std::string& str,
+                        std::unordered_map<std::string, float>* weights) {
+  std::vector<std::string> items;
+  SplitStringToVector(Trim(str), ",", true, &items);
+  for (const std::string& item : items) {
+    size_t pos = item.rfind(':');
+    if (pos == std::string::npos) return false;
+    char* end = nullptr;
+    std::string value = item.substr(pos + 1);
+    float weight = strtof(value.c_str(), &end);
+    if (end == value.c_str() || *end != '\0' || !(weight > 0)) return false;
+    (*weights)[Trim(item.substr(0, pos))] = weight;
+  }
+  return true;
+}
+
+}  // namespace wenet
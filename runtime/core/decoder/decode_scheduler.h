@@ -0,0 +1,162 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_DECODE_SCHEDULER_H_
+#define DECODER_DECODE_SCHEDULER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "utils/thread_placement.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+enum class DecodePriority { kInteractive = 0, kBatch = 1 };
+
+// The class of a session of DecodeScheduler, for the fair queueing
+struct DecodeClass {
+  DecodePriority priority = DecodePriority::kInteractive;
+  std::string tenant;
+};
+
+// DecodeScheduler runs the decoding of many streams on a few worker
+// threads, instead of one blocked thread per stream. A session becomes
+// runnable by Notify(), typically from the ready callback of its
+// FeaturePipeline, and its run function then calls AsrDecoder::Decode(false)
+// until kWaitFeats. Each worker has its own queue of runnable sessions and
+// steals from the others when it is empty.
+// A session never runs on two workers at the same time, so its runs and
+// posted tasks are ordered. It is thread safe.
+//
+// With EnableFairQueueing(), the runnable sessions are queued by their
+// class instead: the interactive ones always run before the batch ones, and
+// within a priority the tenants share the workers by their weights, by the
+// start time fair queueing of the runs, charged by their run time. So a
+// flood of one tenant only delays the others by its share.
+class DecodeScheduler {
+ public:
+  class Session : public std::enable_shared_from_this<Session> {
+   public:
+    // Make the session runnable. The notifications while it is runnable or
+    // running are coalesced into one more run.
+    void Notify();
+    // Run `task` in the session, after the tasks posted before it
+    void Post(std::function<void()> task);
+
+   private:
+    friend class DecodeScheduler;
+    struct Tenant;
+    Session(DecodeScheduler* scheduler, std::function<bool()> run,
+            std::shared_ptr<Tenant> tenant);
+    void Run();
+
+    DecodeScheduler* scheduler_;
+    // Returns false when the session is done, it's released then, so it
+    // may hold the owner of the session
+    std::function<bool()> run_;
+    // Number of Notify() and Post() since the last run, the session is
+    // queued when it becomes non-zero
+    std::atomic<int> pending_{0};
+    std::mutex mutex_;
+    std::vector<std::function<void()>> tasks_;
+    // The flow of the fair queueing, nullptr without it
+    std::shared_ptr<Tenant> tenant_;
+    // The time(us) of the last run, the estimate of the next one, under
+    // the fair mutex
+    double run_us_ = 0;
+
+   public:
+    WENET_DISALLOW_COPY_AND_ASSIGN(Session);
+  };
+
+  // The workers are pinned by `placement` if it's not nullptr. num_workers
+  // 0 means one per cpu.
+  explicit DecodeScheduler(int num_workers,
+                           std::shared_ptr<ThreadPlacement> placement =
+                               nullptr);
+  // Run all the queued sessions and stop the workers
+  ~DecodeScheduler();
+
+  // `run` is called on the workers after Notify(), nullptr for a session
+  // which only runs the posted tasks
+  std::shared_ptr<Session> NewSession(std::function<bool()> run = nullptr,
+                                      const DecodeClass& decode_class =
+                                          DecodeClass());
+  // Queue the sessions by their classes, see above. The tenants not in
+  // `weights` weigh 1. Call it before any session.
+  void EnableFairQueueing(std::unordered_map<std::string, float> weights);
+  int num_workers() const { return workers_.size(); }
+  // Runnable sessions waiting for a worker
+  int num_queued() const { return num_queued_.load(); }
+
+ private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::shared_ptr<Session>> sessions;
+    std::thread thread;
+  };
+
+  using Tenant = Session::Tenant;
+
+  void Enqueue(std::shared_ptr<Session> session);
+  // Pop the front of the worker's own queue, or steal the back of another
+  bool Dequeue(int index, std::shared_ptr<Session>* session);
+  // Pop the session of the backlogged tenant of the earliest start tag
+  bool DequeueFair(std::shared_ptr<Session>* session);
+  // Correct the charge of the run of `session` by its real time
+  void Charge(Session* session, double run_us);
+  void WorkerLoop(int index);
+
+  std::shared_ptr<ThreadPlacement> placement_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  // The sessions from outside of the workers are queued round robin
+  std::atomic<unsigned> next_worker_{0};
+  std::atomic<int> num_queued_{0};
+  // The idle workers sleep on it
+  std::mutex mutex_;
+  std::condition_variable queue_cond_;
+  bool stop_ = false;
+  // The fair queueing, of the tenants per priority
+  std::atomic<bool> fair_{false};
+  std::unordered_map<std::string, float> weights_;
+  std::mutex fair_mutex_;
+  std::map<std::pair<DecodePriority, std::string>, std::weak_ptr<Tenant>>
+      tenants_;
+  // The tenants of queued sessions, and the virtual time, per priority
+  std::vector<Tenant*> backlogged_[2];
+  double virtual_time_[2] = {0, 0};
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(DecodeScheduler);
+};
+
+// Parse the tenant weights of "tenant:weight,...", e.g. "a:4,b:1", return
+// false if it's malformed or a weight isn't positive
+bool ParseTenantWeights(const std::string& str,
+                        std::unordered_map<std::string, float>* weights);
+
+}  // namespace wenet
+
+#endif  // DECODER_DECODE_SCHEDULER_H_
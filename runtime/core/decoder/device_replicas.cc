@@ -0,0 +1,86 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/device_replicas.h"
+
+#include <cctype>
+
+#include "utils/log.h"
+#include "utils/metrics.h"
+
+namespace wenet {
+
+DeviceReplicas::DeviceReplicas(
+    const std::vector<std::string>& devices,
+    const std::vector<std::shared_ptr<DecodeResource>>& resources) {
+  CHECK_EQ(devices.size(), resources.size());
+  CHECK(!devices.empty());
+  for (size_t i = 0; i < devices.size(); ++i) {
+    // A replica is never replicated again
+    CHECK(resources[i]->replicas == nullptr);
+    auto replica = std::make_shared<Replica>();
+    replica->device = devices[i];
+    replica->resource = resources[i];
+    replicas_.push_back(std::move(replica));
+  }
+}
+
+float DeviceReplicas::encoder_load(int i) const {
+  const auto& scheduler = replicas_[i]->resource->encoder_scheduler;
+  return scheduler == nullptr ? 0.0f : scheduler->load();
+}
+
+std::shared_ptr<DecodeResource> DeviceReplicas::Acquire() {
+  // The counts may change meanwhile, the pick is a hint of the balance
+  int best = 0;
+  for (int i = 1; i < size(); ++i) {
+    int diff = num_decoders(i) - num_decoders(best);
+    if (diff < 0 || (diff == 0 && encoder_load(i) < encoder_load(best))) {
+      best = i;
+    }
+  }
+  std::shared_ptr<Replica> replica = replicas_[best];
+  replica->num_decoders.fetch_add(1);
+  // Shares the ownership of the replica, which keeps the resource
+  std::shared_ptr<Replica> lease(replica.get(), [replica](Replica*) {
+    replica->num_decoders.fetch_sub(1);
+  });
+  return std::shared_ptr<DecodeResource>(lease, replica->resource.get());
+}
+
+void DeviceReplicas::SetMetrics() {
+  MetricsRegistry* registry = MetricsRegistry::Global();
+  for (const auto& replica : replicas_) {
+    // e.g. cuda_0 of cuda:0
+    std::string suffix = replica->device;
+    for (char& c : suffix) {
+      if (!isalnum(static_cast<unsigned char>(c))) c = '_';
+    }
+    std::shared_ptr<Replica> r = replica;
+    registry->SetGaugeCallback(
+        "wenet_device_decoders_" + suffix,
+        "Decoders pinned to the model replica on " + replica->device,
+        [r]() { return r->num_decoders.load(); });
+    registry->SetGaugeCallback(
+        "wenet_device_encoder_load_" + suffix,
+        "Queued encoder chunks of the model replica on " + replica->device +
+            " in units of the max batch size",
+        [r]() {
+          const auto& scheduler = r->resource->encoder_scheduler;
+          return scheduler == nullptr ? 0.0 : scheduler->load();
+        });
+  }
+}
+
+}  // namespace wenet
@@ -0,0 +1,75 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_DEVICE_REPLICAS_H_
+#define DECODER_DEVICE_REPLICAS_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "decoder/asr_decoder.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// DeviceReplicas hosts the replicas of a model on the devices of a host,
+// e.g. one per GPU, so one server process uses all of them. Each replica
+// is a DecodeResource of its own model, model pool and batch schedulers,
+// which shares the graphs, the LMs and the post processor with the others.
+// A decoder is pinned to the replica it acquires at its construction for
+// its lifetime, its model caches stay on that device, and its chunks are
+// batched with the ones of the other decoders of the device. The new
+// decoders go to the device of the fewest decoders, and of the lowest
+// encoder queue load among them. It is thread safe.
+class DeviceReplicas {
+ public:
+  // resources[i] is of devices[i]
+  DeviceReplicas(const std::vector<std::string>& devices,
+                 const std::vector<std::shared_ptr<DecodeResource>>& resources);
+
+  // The resource of the least loaded device, the decoder is counted on the
+  // device until the last copy of it is released
+  std::shared_ptr<DecodeResource> Acquire();
+
+  int size() const { return replicas_.size(); }
+  const std::string& device(int i) const { return replicas_[i]->device; }
+  // The decoders pinned to the device
+  int num_decoders(int i) const { return replicas_[i]->num_decoders.load(); }
+  // The queued encoder chunks of the device in units of its max batch size,
+  // 0 without the batching
+  float encoder_load(int i) const;
+
+  // Report the decoders and the encoder queue load of each device, e.g.
+  // wenet_device_decoders_cuda_0, the replicas must outlive the registry's
+  // rendering
+  void SetMetrics();
+
+ private:
+  struct Replica {
+    std::string device;
+    std::shared_ptr<DecodeResource> resource;
+    std::atomic<int> num_decoders{0};
+  };
+
+  std::vector<std::shared_ptr<Replica>> replicas_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(DeviceReplicas);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_DEVICE_REPLICAS_H_
@@ -0,0 +1,189 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/model_registry.h"
+
+#include <sys/stat.h>
+
+#include <chrono>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <utility>
+
+#include "utils/log.h"
+#include "utils/string.h"
+
+namespace wenet {
+
+bool ParseModelManifest(const std::string& text,
+                        std::vector<ModelSpec>* specs) {
+  specs->clear();
+  std::set<std::string> names;
+  std::istringstream stream(text);
+  std::string line;
+  int num_lines = 0;
+  while (std::getline(stream, line)) {
+    ++num_lines;
+    line = Trim(line);
+    if (line.empty() || line[0] == '#') continue;
+    std::vector<std::string> fields;
+    SplitString(line, &fields);
+    ModelSpec spec;
+    spec.name = fields[0];
+    for (size_t i = 1; i < fields.size(); ++i) {
+      size_t pos = fields[i].find('=');
+      if (pos == std::string::npos || pos == 0) {
+        LOG(ERROR) << "Malformed option " << fields[i] << " at line "
+                   << num_lines << " of the manifest";
+        return false;
+      }
+      spec.options[fields[i].substr(0, pos)] = fields[i].substr(pos + 1);
+    }
+    if (!names.insert(spec.name).second) {
+      LOG(ERROR) << "Duplicated model " << spec.name << " at line "
+                 << num_lines << " of the manifest";
+      return false;
+    }
+    specs->push_back(std::move(spec));
+  }
+  return true;
+}
+
+ModelRegistry::ModelRegistry(Loader loader) : loader_(std::move(loader)) {}
+
+ModelRegistry::~ModelRegistry() {
+  if (watcher_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(watch_mutex_);
+      stop_ = true;
+    }
+    watch_cond_.notify_one();
+    watcher_.join();
+  }
+}
+
+bool ModelRegistry::LoadManifest(const std::string& path) {
+  std::ifstream is(path);
+  if (!is.good()) {
+    LOG(ERROR) << "Can't open the manifest " << path;
+    return false;
+  }
+  std::stringstream text;
+  text << is.rdbuf();
+  std::vector<ModelSpec> specs;
+  if (!ParseModelManifest(text.str(), &specs)) return false;
+  if (specs.empty()) {
+    LOG(ERROR) << "No model in the manifest " << path;
+    return false;
+  }
+  std::set<std::string> names;
+  for (const ModelSpec& spec : specs) {
+    names.insert(spec.name);
+    bool changed = true;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = entries_.find(spec.name);
+      changed = it == entries_.end() || !(it->second.spec == spec);
+    }
+    if (changed) Load(spec);
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (names.count(it->first) == 0) {
+      LOG(INFO) << "Unregister model " << it->first;
+      it = entries_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  default_name_ = specs[0].name;
+  return true;
+}
+
+void ModelRegistry::Load(const ModelSpec& spec) {
+  std::lock_guard<std::mutex> load_lock(load_mutex_);
+  LOG(INFO) << "Loading model " << spec.name;
+  // Loaded without blocking the sessions, which get the old version
+  // meanwhile
+  std::shared_ptr<DecodeResource> resource = loader_(spec, &cache_);
+  CHECK(resource != nullptr);
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry& entry = entries_[spec.name];
+  entry.spec = spec;
+  entry.resource = std::move(resource);
+  ++entry.version;
+  if (default_name_.empty()) default_name_ = spec.name;
+  LOG(INFO) << "Model " << spec.name << " version " << entry.version
+            << " is ready";
+}
+
+std::shared_ptr<DecodeResource> ModelRegistry::Get(
+    const std::string& name) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(name.empty() ? default_name_ : name);
+  return it == entries_.end() ? nullptr : it->second.resource;
+}
+
+std::vector<std::string> ModelRegistry::names() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<std::string> names;
+  for (const auto& it : entries_) {
+    names.push_back(it.first);
+  }
+  return names;
+}
+
+std::string ModelRegistry::default_name() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return default_name_;
+}
+
+int ModelRegistry::version(const std::string& name) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(name);
+  return it == entries_.end() ? 0 : it->second.version;
+}
+
+// Modification time of path, 0 if it can't be stat
+static int64_t ModifiedTime(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) return 0;
+  return static_cast<int64_t>(st.st_mtime);
+}
+
+void ModelRegistry::Watch(const std::string& path, int interval_s) {
+  CHECK_GT(interval_s, 0);
+  CHECK(!watcher_.joinable()) << "The registry watches one manifest";
+  watcher_ = std::thread(&ModelRegistry::WatchLoop, this, path, interval_s);
+}
+
+void ModelRegistry::WatchLoop(const std::string& path, int interval_s) {
+  int64_t mtime = ModifiedTime(path);
+  std::unique_lock<std::mutex> lock(watch_mutex_);
+  while (!watch_cond_.wait_for(lock, std::chrono::seconds(interval_s),
+                               [this] { return stop_; })) {
+    int64_t new_mtime = ModifiedTime(path);
+    if (new_mtime == mtime) continue;
+    mtime = new_mtime;
+    LOG(INFO) << "The manifest " << path << " is modified, reload it";
+    lock.unlock();
+    if (!LoadManifest(path)) {
+      LOG(ERROR) << "Failed to reload " << path << ", keep the old models";
+    }
+    lock.lock();
+  }
+}
+
+}  // namespace wenet
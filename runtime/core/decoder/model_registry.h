@@ -0,0 +1,155 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_MODEL_REGISTRY_H_
+#define DECODER_MODEL_REGISTRY_H_
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "decoder/asr_decoder.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// One model of the manifest, a line of "name key=value ...", the keys are
+// interpreted by the loader of the registry, e.g. model_path and dict_path
+struct ModelSpec {
+  std::string name;
+  std::map<std::string, std::string> options;
+
+  std::string Get(const std::string& key,
+                  const std::string& default_value = "") const {
+    auto it = options.find(key);
+    return it == options.end() ? default_value : it->second;
+  }
+  bool operator==(const ModelSpec& other) const {
+    return name == other.name && options == other.options;
+  }
+};
+
+// Parse the manifest, the empty lines and the ones starting with '#' are
+// skipped. Return false if a line is malformed or a name is duplicated.
+bool ParseModelManifest(const std::string& text,
+                        std::vector<ModelSpec>* specs);
+
+// The components which the models load from the same path are loaded once
+// and shared, e.g. the symbol tables, the fsts and the post processors. The
+// cache only keeps weak references, a component is freed with the last model
+// which uses it. It is thread safe.
+class ResourceCache {
+ public:
+  // Return the cached component of key, or the one made by load(), which
+  // is cached then. The same key must be of the same type T, and load()
+  // must not call Get() of the same key.
+  template <typename T>
+  std::shared_ptr<T> Get(const std::string& key,
+                         const std::function<std::shared_ptr<T>()>& load) {
+    std::shared_ptr<Entry> entry;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::shared_ptr<Entry>& slot = entries_[key];
+      if (slot == nullptr) slot = std::make_shared<Entry>();
+      entry = slot;
+    }
+    // Loaded with the lock of the key held, so a component is never loaded
+    // twice, while the ones of the other keys are loaded in parallel, e.g.
+    // by the steps of a startup
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    std::shared_ptr<void> value = entry->value.lock();
+    if (value != nullptr) {
+      return std::static_pointer_cast<T>(value);
+    }
+    std::shared_ptr<T> loaded = load();
+    entry->value = loaded;
+    return loaded;
+  }
+
+ private:
+  struct Entry {
+    std::mutex mutex;
+    std::weak_ptr<void> value;
+  };
+
+  std::mutex mutex_;
+  std::map<std::string, std::shared_ptr<Entry>> entries_;
+};
+
+// ModelRegistry hosts the DecodeResources of several models, which the
+// sessions pick by name at their start. A model is reloaded by replacing
+// its resource atomically, the new sessions get the new version while the
+// running ones keep the shared_ptr to the old one, which is freed when they
+// are all done. It is thread safe.
+class ModelRegistry {
+ public:
+  using Loader = std::function<std::shared_ptr<DecodeResource>(
+      const ModelSpec& spec, ResourceCache* cache)>;
+
+  explicit ModelRegistry(Loader loader);
+  ~ModelRegistry();
+
+  // Load or reload the models of the manifest file whose specs are new or
+  // changed, and unregister the ones which are gone. The first model of the
+  // manifest is the default one.
+  bool LoadManifest(const std::string& path);
+  // Load spec and replace the model of the same name, if any
+  void Load(const ModelSpec& spec);
+
+  // The resource of the model of name, or the default model if name is
+  // empty, nullptr if there is no such model
+  std::shared_ptr<DecodeResource> Get(const std::string& name = "") const;
+  std::vector<std::string> names() const;
+  std::string default_name() const;
+  // Times the model of name is loaded, 0 if there is no such model
+  int version(const std::string& name) const;
+
+  // Reload the manifest whenever it's modified, checked every interval_s
+  // seconds on a background thread
+  void Watch(const std::string& path, int interval_s);
+
+ private:
+  struct Entry {
+    ModelSpec spec;
+    std::shared_ptr<DecodeResource> resource;
+    int version = 0;
+  };
+
+  void WatchLoop(const std::string& path, int interval_s);
+
+  Loader loader_;
+  ResourceCache cache_;
+  // Loads are serialized, the entries are only locked to be swapped
+  std::mutex load_mutex_;
+  mutable std::mutex mutex_;
+  std::map<std::string, Entry> entries_;
+  std::string default_name_;
+
+  std::mutex watch_mutex_;
+  std::condition_variable watch_cond_;
+  bool stop_ = false;
+  std::thread watcher_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(ModelRegistry);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_MODEL_REGISTRY_H_
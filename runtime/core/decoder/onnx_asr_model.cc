@@ -1,418 +1,824 @@
-// Copyright 2020 Mobvoi Inc. All Rights Reserved.
-// Author: binbinzhang@mobvoi.com (Binbin Zhang)
-//         di.wu@mobvoi.com (Di Wu)
-//         lizexuan@huya.com (Zexuan Li)
-//         sxc19@mails.tsinghua.edu.cn (Xingchen Song)
-
-#include "decoder/onnx_asr_model.h"
-
-#include <algorithm>
-#include <memory>
-#include <utility>
-
-namespace wenet {
-
-void OnnxAsrModel::GetInputOutputInfo(
-    const std::shared_ptr<Ort::Session>& session,
-    std::vector<const char*>* in_names, std::vector<const char*>* out_names) {
-  Ort::AllocatorWithDefaultOptions allocator;
-  // Input info
-  int num_nodes = session->GetInputCount();
-  in_names->resize(num_nodes);
-  for (int i = 0; i < num_nodes; ++i) {
-    char* name = session->GetInputName(i, allocator);
-    Ort::TypeInfo type_info = session->GetInputTypeInfo(i);
-    auto tensor_info = type_info.GetTensorTypeAndShapeInfo();
-    ONNXTensorElementDataType type = tensor_info.GetElementType();
-    std::vector<int64_t> node_dims = tensor_info.GetShape();
-    std::stringstream shape;
-    for (auto j : node_dims) {
-      shape << j;
-      shape << " ";
-    }
-    LOG(INFO) << "\tInput " << i << " : name=" << name << " type=" << type
-              << " dims=" << shape.str();
-    (*in_names)[i] = name;
-  }
-  // Output info
-  num_nodes = session->GetOutputCount();
-  out_names->resize(num_nodes);
-  for (int i = 0; i < num_nodes; ++i) {
-    char* name = session->GetOutputName(i, allocator);
-    Ort::TypeInfo type_info = session->GetOutputTypeInfo(i);
-    auto tensor_info = type_info.GetTensorTypeAndShapeInfo();
-    ONNXTensorElementDataType type = tensor_info.GetElementType();
-    std::vector<int64_t> node_dims = tensor_info.GetShape();
-    std::stringstream shape;
-    for (auto j : node_dims) {
-      shape << j;
-      shape << " ";
-    }
-    LOG(INFO) << "\tOutput " << i << " : name=" << name << " type=" << type
-              << " dims=" << shape.str();
-    (*out_names)[i] = name;
-  }
-}
-
-void OnnxAsrModel::Read(const std::string& model_dir, const int num_threads) {
-  std::string encoder_onnx_path = model_dir + "/encoder.onnx";
-  std::string rescore_onnx_path = model_dir + "/decoder.onnx";
-  std::string ctc_onnx_path = model_dir + "/ctc.onnx";
-
-  // 1. Load sessions
-  try {
-    Ort::Env env;
-    Ort::SessionOptions session_options;
-    session_options.SetIntraOpNumThreads(num_threads);
-    session_options.SetInterOpNumThreads(num_threads);
-
-    Ort::Session encoder_session{env, encoder_onnx_path.data(),
-                                 session_options};
-    encoder_session_ =
-        std::make_shared<Ort::Session>(std::move(encoder_session));
-
-    Ort::Session rescore_session{env, rescore_onnx_path.data(),
-                                 session_options};
-    rescore_session_ =
-        std::make_shared<Ort::Session>(std::move(rescore_session));
-
-    Ort::Session ctc_session{env, ctc_onnx_path.data(), session_options};
-    ctc_session_ = std::make_shared<Ort::Session>(std::move(ctc_session));
-  } catch (std::exception const& e) {
-    LOG(ERROR) << "error when load onnx model";
-    exit(0);
-  }
-
-  // 2. Read metadata
-  auto model_metadata = encoder_session_->GetModelMetadata();
-
-  Ort::AllocatorWithDefaultOptions allocator;
-  encoder_output_size_ = std::move(
-      atoi(model_metadata.LookupCustomMetadataMap("output_size", allocator)));
-  num_blocks_ = std::move(
-      atoi(model_metadata.LookupCustomMetadataMap("num_blocks", allocator)));
-  head_ = std::move(
-      atoi(model_metadata.LookupCustomMetadataMap("head", allocator)));
-  cnn_module_kernel_ = std::move(atoi(
-      model_metadata.LookupCustomMetadataMap("cnn_module_kernel", allocator)));
-  subsampling_rate_ = std::move(atoi(
-      model_metadata.LookupCustomMetadataMap("subsampling_rate", allocator)));
-  right_context_ = std::move(
-      atoi(model_metadata.LookupCustomMetadataMap("right_context", allocator)));
-  sos_ = std::move(
-      atoi(model_metadata.LookupCustomMetadataMap("sos_symbol", allocator)));
-  eos_ = std::move(
-      atoi(model_metadata.LookupCustomMetadataMap("eos_symbol", allocator)));
-  is_bidirectional_decoder_ =
-      std::move(atoi(model_metadata.LookupCustomMetadataMap(
-          "is_bidirectional_decoder", allocator)));
-  chunk_size_ = std::move(
-      atoi(model_metadata.LookupCustomMetadataMap("chunk_size", allocator)));
-  num_left_chunks_ = std::move(
-      atoi(model_metadata.LookupCustomMetadataMap("left_chunks", allocator)));
-
-  LOG(INFO) << "Onnx Model Info:";
-  LOG(INFO) << "\tencoder_output_size " << encoder_output_size_;
-  LOG(INFO) << "\tnum_blocks " << num_blocks_;
-  LOG(INFO) << "\thead " << head_;
-  LOG(INFO) << "\tcnn_module_kernel " << cnn_module_kernel_;
-  LOG(INFO) << "\tsubsampling_rate " << subsampling_rate_;
-  LOG(INFO) << "\tright_context " << right_context_;
-  LOG(INFO) << "\tsos " << sos_;
-  LOG(INFO) << "\teos " << eos_;
-  LOG(INFO) << "\tis bidirectional decoder " << is_bidirectional_decoder_;
-  LOG(INFO) << "\tchunk_size " << chunk_size_;
-  LOG(INFO) << "\tnum_left_chunks " << num_left_chunks_;
-
-  // 3. Read model nodes
-  LOG(INFO) << "Onnx Encoder:";
-  GetInputOutputInfo(encoder_session_, &encoder_in_names_, &encoder_out_names_);
-  LOG(INFO) << "Onnx CTC:";
-  GetInputOutputInfo(ctc_session_, &ctc_in_names_, &ctc_out_names_);
-  LOG(INFO) << "Onnx Rescore:";
-  GetInputOutputInfo(rescore_session_, &rescore_in_names_, &rescore_out_names_);
-}
-
-OnnxAsrModel::OnnxAsrModel(const OnnxAsrModel& other) {
-  // metadatas
-  encoder_output_size_ = other.encoder_output_size_;
-  num_blocks_ = other.num_blocks_;
-  head_ = other.head_;
-  cnn_module_kernel_ = other.cnn_module_kernel_;
-  right_context_ = other.right_context_;
-  subsampling_rate_ = other.subsampling_rate_;
-  sos_ = other.sos_;
-  eos_ = other.eos_;
-  is_bidirectional_decoder_ = other.is_bidirectional_decoder_;
-  chunk_size_ = other.chunk_size_;
-  num_left_chunks_ = other.num_left_chunks_;
-  offset_ = other.offset_;
-
-  // sessions
-  encoder_session_ = other.encoder_session_;
-  ctc_session_ = other.ctc_session_;
-  rescore_session_ = other.rescore_session_;
-
-  // node names
-  encoder_in_names_ = other.encoder_in_names_;
-  encoder_out_names_ = other.encoder_out_names_;
-  ctc_in_names_ = other.ctc_in_names_;
-  ctc_out_names_ = other.ctc_out_names_;
-  rescore_in_names_ = other.rescore_in_names_;
-  rescore_out_names_ = other.rescore_out_names_;
-}
-
-std::shared_ptr<AsrModel> OnnxAsrModel::Copy() const {
-  auto asr_model = std::make_shared<OnnxAsrModel>(*this);
-  // Reset the inner states for new decoding
-  asr_model->Reset();
-  return asr_model;
-}
-
-void OnnxAsrModel::Reset() {
-  offset_ = 0;
-  encoder_outs_.clear();
-  // Reset att_cache
-  Ort::MemoryInfo memory_info =
-      Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
-  if (num_left_chunks_ > 0) {
-    int required_cache_size = chunk_size_ * num_left_chunks_;
-    offset_ = required_cache_size;
-    att_cache_.resize(num_blocks_ * head_ * required_cache_size *
-                          encoder_output_size_ / head_ * 2,
-                      0.0);
-    const int64_t att_cache_shape[] = {num_blocks_, head_, required_cache_size,
-                                       encoder_output_size_ / head_ * 2};
-    att_cache_ort_ = Ort::Value::CreateTensor<float>(
-        memory_info, att_cache_.data(), att_cache_.size(), att_cache_shape, 4);
-  } else {
-    att_cache_.resize(0, 0.0);
-    const int64_t att_cache_shape[] = {num_blocks_, head_, 0,
-                                       encoder_output_size_ / head_ * 2};
-    att_cache_ort_ = Ort::Value::CreateTensor<float>(
-        memory_info, att_cache_.data(), att_cache_.size(), att_cache_shape, 4);
-  }
-
-  // Reset cnn_cache
-  cnn_cache_.resize(
-      num_blocks_ * encoder_output_size_ * (cnn_module_kernel_ - 1), 0.0);
-  const int64_t cnn_cache_shape[] = {num_blocks_, 1, encoder_output_size_,
-                                     cnn_module_kernel_ - 1};
-  cnn_cache_ort_ = Ort::Value::CreateTensor<float>(
-      memory_info, cnn_cache_.data(), cnn_cache_.size(), cnn_cache_shape, 4);
-}
-
-void OnnxAsrModel::ForwardEncoderFunc(
-    const std::vector<std::vector<float>>& chunk_feats,
-    std::vector<std::vector<float>>* out_prob) {
-  Ort::MemoryInfo memory_info =
-      Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
-  // 1. Prepare onnx required data, splice cached_feature_ and chunk_feats
-  // chunk
-  int num_frames = cached_feature_.size() + chunk_feats.size();
-  const int feature_dim = chunk_feats[0].size();
-  std::vector<float> feats;
-  for (size_t i = 0; i < cached_feature_.size(); ++i) {
-    for (size_t j = 0; j < feature_dim; ++j) {
-      feats.emplace_back(cached_feature_[i][j]);
-    }
-  }
-  for (size_t i = 0; i < chunk_feats.size(); ++i) {
-    for (size_t j = 0; j < feature_dim; ++j) {
-      feats.emplace_back(chunk_feats[i][j]);
-    }
-  }
-  const int64_t feats_shape[3] = {1, num_frames, feature_dim};
-  Ort::Value feats_ort = Ort::Value::CreateTensor<float>(
-      memory_info, feats.data(), feats.size(), feats_shape, 3);
-  // offset
-  int64_t offset_int64 = static_cast<int64_t>(offset_);
-  Ort::Value offset_ort = Ort::Value::CreateTensor<int64_t>(
-      memory_info, &offset_int64, 1, std::vector<int64_t>{}.data(), 0);
-  // required_cache_size
-  int64_t required_cache_size = chunk_size_ * num_left_chunks_;
-  Ort::Value required_cache_size_ort = Ort::Value::CreateTensor<int64_t>(
-      memory_info, &required_cache_size, 1, std::vector<int64_t>{}.data(), 0);
-  // att_mask
-  Ort::Value att_mask_ort{nullptr};
-  std::vector<uint8_t> att_mask(required_cache_size + chunk_size_, 1);
-  if (num_left_chunks_ > 0) {
-    int chunk_idx = offset_ / chunk_size_ - num_left_chunks_;
-    if (chunk_idx < num_left_chunks_) {
-      for (int i = 0; i < (num_left_chunks_ - chunk_idx) * chunk_size_; ++i) {
-        att_mask[i] = 0;
-      }
-    }
-    const int64_t att_mask_shape[] = {1, 1, required_cache_size + chunk_size_};
-    att_mask_ort = Ort::Value::CreateTensor<bool>(
-        memory_info, reinterpret_cast<bool*>(att_mask.data()), att_mask.size(),
-        att_mask_shape, 3);
-  }
-
-  // 2. Encoder chunk forward
-  std::vector<Ort::Value> inputs;
-  for (auto name : encoder_in_names_) {
-    if (!strcmp(name, "chunk")) {
-      inputs.emplace_back(std::move(feats_ort));
-    } else if (!strcmp(name, "offset")) {
-      inputs.emplace_back(std::move(offset_ort));
-    } else if (!strcmp(name, "required_cache_size")) {
-      inputs.emplace_back(std::move(required_cache_size_ort));
-    } else if (!strcmp(name, "att_cache")) {
-      inputs.emplace_back(std::move(att_cache_ort_));
-    } else if (!strcmp(name, "cnn_cache")) {
-      inputs.emplace_back(std::move(cnn_cache_ort_));
-    } else if (!strcmp(name, "att_mask")) {
-      inputs.emplace_back(std::move(att_mask_ort));
-    }
-  }
-
-  std::vector<Ort::Value> ort_outputs = encoder_session_->Run(
-      Ort::RunOptions{nullptr}, encoder_in_names_.data(), inputs.data(),
-      inputs.size(), encoder_out_names_.data(), encoder_out_names_.size());
-
-  offset_ += static_cast<int>(
-      ort_outputs[0].GetTensorTypeAndShapeInfo().GetShape()[1]);
-  att_cache_ort_ = std::move(ort_outputs[1]);
-  cnn_cache_ort_ = std::move(ort_outputs[2]);
-
-  std::vector<Ort::Value> ctc_inputs;
-  ctc_inputs.emplace_back(std::move(ort_outputs[0]));
-
-  std::vector<Ort::Value> ctc_ort_outputs = ctc_session_->Run(
-      Ort::RunOptions{nullptr}, ctc_in_names_.data(), ctc_inputs.data(),
-      ctc_inputs.size(), ctc_out_names_.data(), ctc_out_names_.size());
-  encoder_outs_.push_back(std::move(ctc_inputs[0]));
-
-  float* logp_data = ctc_ort_outputs[0].GetTensorMutableData<float>();
-  auto type_info = ctc_ort_outputs[0].GetTensorTypeAndShapeInfo();
-
-  int num_outputs = type_info.GetShape()[1];
-  int output_dim = type_info.GetShape()[2];
-  out_prob->resize(num_outputs);
-  for (int i = 0; i < num_outputs; i++) {
-    (*out_prob)[i].resize(output_dim);
-    memcpy((*out_prob)[i].data(), logp_data + i * output_dim,
-           sizeof(float) * output_dim);
-  }
-}
-
-float OnnxAsrModel::ComputeAttentionScore(const float* prob,
-                                          const std::vector<int>& hyp, int eos,
-                                          int decode_out_len) {
-  float score = 0.0f;
-  for (size_t j = 0; j < hyp.size(); ++j) {
-    score += *(prob + j * decode_out_len + hyp[j]);
-  }
-  score += *(prob + hyp.size() * decode_out_len + eos);
-  return score;
-}
-
-void OnnxAsrModel::AttentionRescoring(const std::vector<std::vector<int>>& hyps,
-                                      float reverse_weight,
-                                      std::vector<float>* rescoring_score) {
-  Ort::MemoryInfo memory_info =
-      Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
-  CHECK(rescoring_score != nullptr);
-  int num_hyps = hyps.size();
-  rescoring_score->resize(num_hyps, 0.0f);
-
-  if (num_hyps == 0) {
-    return;
-  }
-  // No encoder output
-  if (encoder_outs_.size() == 0) {
-    return;
-  }
-
-  std::vector<int64_t> hyps_lens;
-  int max_hyps_len = 0;
-  for (size_t i = 0; i < num_hyps; ++i) {
-    int length = hyps[i].size() + 1;
-    max_hyps_len = std::max(length, max_hyps_len);
-    hyps_lens.emplace_back(static_cast<int64_t>(length));
-  }
-
-  std::vector<float> rescore_input;
-  int encoder_len = 0;
-  for (int i = 0; i < encoder_outs_.size(); i++) {
-    float* encoder_outs_data = encoder_outs_[i].GetTensorMutableData<float>();
-    auto type_info = encoder_outs_[i].GetTensorTypeAndShapeInfo();
-    for (int j = 0; j < type_info.GetElementCount(); j++) {
-      rescore_input.emplace_back(encoder_outs_data[j]);
-    }
-    encoder_len += type_info.GetShape()[1];
-  }
-
-  const int64_t decode_input_shape[] = {1, encoder_len, encoder_output_size_};
-
-  std::vector<int64_t> hyps_pad;
-
-  for (size_t i = 0; i < num_hyps; ++i) {
-    const std::vector<int>& hyp = hyps[i];
-    hyps_pad.emplace_back(sos_);
-    size_t j = 0;
-    for (; j < hyp.size(); ++j) {
-      hyps_pad.emplace_back(hyp[j]);
-    }
-    if (j == max_hyps_len - 1) {
-      continue;
-    }
-    for (; j < max_hyps_len - 1; ++j) {
-      hyps_pad.emplace_back(0);
-    }
-  }
-
-  const int64_t hyps_pad_shape[] = {num_hyps, max_hyps_len};
-
-  const int64_t hyps_lens_shape[] = {num_hyps};
-
-  Ort::Value decode_input_tensor_ = Ort::Value::CreateTensor<float>(
-      memory_info, rescore_input.data(), rescore_input.size(),
-      decode_input_shape, 3);
-  Ort::Value hyps_pad_tensor_ = Ort::Value::CreateTensor<int64_t>(
-      memory_info, hyps_pad.data(), hyps_pad.size(), hyps_pad_shape, 2);
-  Ort::Value hyps_lens_tensor_ = Ort::Value::CreateTensor<int64_t>(
-      memory_info, hyps_lens.data(), hyps_lens.size(), hyps_lens_shape, 1);
-
-  std::vector<Ort::Value> rescore_inputs;
-
-  rescore_inputs.emplace_back(std::move(hyps_pad_tensor_));
-  rescore_inputs.emplace_back(std::move(hyps_lens_tensor_));
-  rescore_inputs.emplace_back(std::move(decode_input_tensor_));
-
-  std::vector<Ort::Value> rescore_outputs = rescore_session_->Run(
-      Ort::RunOptions{nullptr}, rescore_in_names_.data(), rescore_inputs.data(),
-      rescore_inputs.size(), rescore_out_names_.data(),
-      rescore_out_names_.size());
-
-  float* decoder_outs_data = rescore_outputs[0].GetTensorMutableData<float>();
-  float* r_decoder_outs_data = rescore_outputs[1].GetTensorMutableData<float>();
-
-  auto type_info = rescore_outputs[0].GetTensorTypeAndShapeInfo();
-  int decode_out_len = type_info.GetShape()[2];
-
-  for (size_t i = 0; i < num_hyps; ++i) {
-    const std::vector<int>& hyp = hyps[i];
-    float score = 0.0f;
-    // left to right decoder score
-    score = ComputeAttentionScore(
-        decoder_outs_data + max_hyps_len * decode_out_len * i, hyp, eos_,
-        decode_out_len);
-    // Optional: Used for right to left score
-    float r_score = 0.0f;
-    if (is_bidirectional_decoder_ && reverse_weight > 0) {
-      std::vector<int> r_hyp(hyp.size());
-      std::reverse_copy(hyp.begin(), hyp.end(), r_hyp.begin());
-      // right to left decoder score
-      r_score = ComputeAttentionScore(
-          r_decoder_outs_data + max_hyps_len * decode_out_len * i, r_hyp, eos_,
-          decode_out_len);
-    }
-    // combined left-to-right and right-to-left score
-    (*rescoring_score)[i] =
-        score * (1 - reverse_weight) + r_score * reverse_weight;
-  }
-}
-
-}  // namespace wenet
+// Copyright 2020 Mobvoi Inc. All Rights Reserved.
+// Author: binbinzhang@mobvoi.com (Binbin Zhang)
+//         di.wu@mobvoi.com (Di Wu)
+//         lizexuan@huya.com (Zexuan Li)
+//         sxc19@mails.tsinghua.edu.cn (Xingchen Song)
+
+#include "decoder/onnx_asr_model.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <utility>
+
+#ifdef USE_NNAPI
+#include "nnapi_provider_factory.h"  // NOLINT
+#endif
+
+#include "utils/mapped_file.h"
+#include "utils/state_io.h"
+#include "utils/timer.h"
+
+namespace wenet {
+
+std::shared_ptr<Ort::Env> OnnxAsrModel::env_ = nullptr;
+bool OnnxAsrModel::global_thread_pool_ = false;
+
+void OnnxAsrModel::InitEngineThreads(int num_threads,
+                                     int num_interop_threads) {
+  CHECK(env_ == nullptr) << "InitEngineThreads should be called only once";
+  const OrtApi& api = Ort::GetApi();
+  OrtThreadingOptions* tp_options = nullptr;
+  Ort::ThrowOnError(api.CreateThreadingOptions(&tp_options));
+  Ort::ThrowOnError(api.SetGlobalIntraOpNumThreads(tp_options, num_threads));
+  Ort::ThrowOnError(api.SetGlobalInterOpNumThreads(tp_options,
+                                                        num_interop_threads));
+  env_ = std::make_shared<Ort::Env>(tp_options, ORT_LOGGING_LEVEL_WARNING,
+                                    "wenet");
+  api.ReleaseThreadingOptions(tp_options);
+  global_thread_pool_ = true;
+  VLOG(1) << "Onnx global intra-op threads: " << num_threads
+          << ", inter-op threads: " << num_interop_threads;
+}
+
+void OnnxAsrModel::AppendExecutionProviders(
+    const OnnxSessionOptions& opts, Ort::SessionOptions* session_options) {
+  for (const auto& provider : opts.providers) {
+    try {
+      if (provider == "cuda") {
+        OrtCUDAProviderOptions cuda_options{};
+        session_options->AppendExecutionProvider_CUDA(cuda_options);
+      } else if (provider == "tensorrt") {
+        OrtTensorRTProviderOptions trt_options{};
+        session_options->AppendExecutionProvider_TensorRT(trt_options);
+      } else if (provider == "openvino") {
+        OrtOpenVINOProviderOptions openvino_options{};
+        session_options->AppendExecutionProvider_OpenVINO(openvino_options);
+#ifdef USE_NNAPI
+      } else if (provider == "nnapi") {
+        // Not the slow nnapi-reference cpu implementation, the ops which
+        // the accelerators don't support fall back to the ORT cpu kernels
+        Ort::ThrowOnError(OrtSessionOptionsAppendExecutionProvider_Nnapi(
+            *session_options, NNAPI_FLAG_CPU_DISABLED));
+#endif
+#ifdef USE_XNNPACK
+      } else if (provider == "xnnpack") {
+        // XNNPACK runs the int8 kernels in its own pool of num_threads, so
+        // the one of ORT, for the rest ops, is not to contend with it
+        session_options->AppendExecutionProvider(
+            "XNNPACK",
+            {{"intra_op_num_threads", std::to_string(opts.num_threads)}});
+        session_options->SetIntraOpNumThreads(1);
+#endif
+      } else if (provider == "cpu") {
+        // CPU is always available as the last one
+        break;
+      } else {
+        LOG(WARNING) << "Unknown onnx execution provider " << provider;
+        continue;
+      }
+      LOG(INFO) << "Append onnx execution provider " << provider;
+    } catch (std::exception const& e) {
+      LOG(WARNING) << "Onnx execution provider " << provider
+                   << " is not available: " << e.what();
+    }
+  }
+}
+
+void OnnxAsrModel::GetInputOutputInfo(
+    const std::shared_ptr<Ort::Session>& session,
+    std::vector<const char*>* in_names, std::vector<const char*>* out_names) {
+  Ort::AllocatorWithDefaultOptions allocator;
+  // Input info
+  int num_nodes = session->GetInputCount();
+  in_names->resize(num_nodes);
+  for (int i = 0; i < num_nodes; ++i) {
+    char* name = session->GetInputName(i, allocator);
+    Ort::TypeInfo type_info = session->GetInputTypeInfo(i);
+    auto tensor_info = type_info.GetTensorTypeAndShapeInfo();
+    ONNXTensorElementDataType type = tensor_info.GetElementType();
+    std::vector<int64_t> node_dims = tensor_info.GetShape();
+    std::stringstream shape;
+    for (auto j : node_dims) {
+      shape << j;
+      shape << " ";
+    }
+    LOG(INFO) << "\tInput " << i << " : name=" << name << " type=" << type
+              << " dims=" << shape.str();
+    (*in_names)[i] = name;
+  }
+  // Output info
+  num_nodes = session->GetOutputCount();
+  out_names->resize(num_nodes);
+  for (int i = 0; i < num_nodes; ++i) {
+    char* name = session->GetOutputName(i, allocator);
+    Ort::TypeInfo type_info = session->GetOutputTypeInfo(i);
+    auto tensor_info = type_info.GetTensorTypeAndShapeInfo();
+    ONNXTensorElementDataType type = tensor_info.GetElementType();
+    std::vector<int64_t> node_dims = tensor_info.GetShape();
+    std::stringstream shape;
+    for (auto j : node_dims) {
+      shape << j;
+      shape << " ";
+    }
+    LOG(INFO) << "\tOutput " << i << " : name=" << name << " type=" << type
+              << " dims=" << shape.str();
+    (*out_names)[i] = name;
+  }
+}
+
+// FNV-1a of data in hex
+static std::string HashHex(const char* data, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 1099511628211ULL;
+  }
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+  return hex;
+}
+
+std::shared_ptr<Ort::Session> OnnxAsrModel::CreateSession(
+    const std::string& path, const OnnxSessionOptions& opts,
+    const Ort::SessionOptions& session_options) {
+  Timer timer;
+  if (opts.mmap_weights) {
+    // e.g. encoder.ort of encoder.onnx
+    std::string ort_path = path.substr(0, path.rfind(".onnx")) + ".ort";
+    std::shared_ptr<MappedFile> file = MappedFile::Open(ort_path, true);
+    if (file != nullptr) {
+      // The initializers are the tensors of the mapped graph in place, and
+      // they aren't prepacked into private copies
+      Ort::SessionOptions mapped_options = session_options.Clone();
+      mapped_options.AddConfigEntry("session.use_ort_model_bytes_directly",
+                                    "1");
+      mapped_options.AddConfigEntry(
+          "session.use_ort_model_bytes_for_initializers", "1");
+      mapped_options.AddConfigEntry("session.disable_prepacking", "1");
+      // The graph is unmapped with the session
+      std::shared_ptr<Ort::Session> session(
+          new Ort::Session(*env_, file->data(), file->size(), mapped_options),
+          [file](Ort::Session* s) { delete s; });
+      LOG(INFO) << "Mapped graph " << ort_path << " in " << timer.Elapsed()
+                << " ms";
+      return session;
+    }
+    LOG(WARNING) << "No ORT format graph " << ort_path << ", the weights of "
+                 << path << " are private";
+  }
+  std::string cache_path;
+  if (!opts.optimized_cache_dir.empty()) {
+    std::unique_ptr<MappedFile> file = MappedFile::Open(path);
+    CHECK(file != nullptr) << "Can't read " << path;
+    std::string key = HashHex(file->data(), file->size()) + "|" +
+                      OrtGetApiBase()->GetVersionString() + "|" +
+                      std::to_string(opts.graph_optimization_level);
+    for (const auto& provider : opts.providers) key += "|" + provider;
+    // e.g. encoder.<hash>.onnx of encoder.onnx
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    name = name.substr(0, name.rfind(".onnx"));
+    cache_path = opts.optimized_cache_dir + "/" + name + "." +
+                 HashHex(key.data(), key.size()) + ".onnx";
+  }
+  if (!cache_path.empty() && std::ifstream(cache_path).good()) {
+    // Optimized already, only the provider specific ones are applied
+    Ort::SessionOptions cached_options = session_options.Clone();
+    cached_options.SetGraphOptimizationLevel(ORT_DISABLE_ALL);
+    auto session = std::make_shared<Ort::Session>(*env_, cache_path.c_str(),
+                                                  cached_options);
+    LOG(INFO) << "Loaded optimized graph " << cache_path << " in "
+              << timer.Elapsed() << " ms";
+    return session;
+  }
+  std::shared_ptr<Ort::Session> session;
+  if (!cache_path.empty()) {
+    // Written to a temporary file and renamed, so the processes starting
+    // at the same time never read a partial graph
+    std::string tmp_path = cache_path + ".tmp" + std::to_string(
+        std::chrono::steady_clock::now().time_since_epoch().count());
+    Ort::SessionOptions caching_options = session_options.Clone();
+    caching_options.SetOptimizedModelFilePath(tmp_path.c_str());
+    try {
+      session = std::make_shared<Ort::Session>(*env_, path.c_str(),
+                                               caching_options);
+      if (std::rename(tmp_path.c_str(), cache_path.c_str()) == 0) {
+        LOG(INFO) << "Saved optimized graph " << cache_path;
+      }
+    } catch (const std::exception& e) {
+      LOG(WARNING) << "Failed to save optimized graph " << cache_path << ": "
+                   << e.what();
+    }
+    std::remove(tmp_path.c_str());
+  }
+  if (session == nullptr) {
+    session = std::make_shared<Ort::Session>(*env_, path.c_str(),
+                                             session_options);
+  }
+  LOG(INFO) << "Optimized graph " << path << " in " << timer.Elapsed()
+            << " ms";
+  return session;
+}
+
+void OnnxAsrModel::Read(const std::string& model_dir, const int num_threads) {
+  OnnxSessionOptions opts;
+  opts.num_threads = num_threads;
+  Read(model_dir, opts);
+}
+
+void OnnxAsrModel::Read(const std::string& model_dir,
+                        const OnnxSessionOptions& opts) {
+  const std::string suffix = opts.quantized ? ".quant.onnx" : ".onnx";
+  std::string encoder_onnx_path = model_dir + "/encoder" + suffix;
+  std::string rescore_onnx_path = model_dir + "/decoder" + suffix;
+  std::string ctc_onnx_path = model_dir + "/ctc" + suffix;
+  // The fused graph of encoder and ctc activation, which outputs
+  // (probs, r_att_cache, r_cnn_cache, output), is used if it's exported
+  std::string fused_onnx_path = model_dir + "/encoder_ctc" + suffix;
+  fused_ctc_ = std::ifstream(fused_onnx_path).good();
+  if (fused_ctc_) {
+    LOG(INFO) << "Use fused encoder and ctc graph " << fused_onnx_path;
+    encoder_onnx_path = fused_onnx_path;
+  }
+
+  // 1. Load sessions
+  try {
+    if (env_ == nullptr) {
+      env_ = std::make_shared<Ort::Env>(ORT_LOGGING_LEVEL_WARNING, "wenet");
+    }
+    Ort::SessionOptions session_options;
+    if (global_thread_pool_) {
+      session_options.DisablePerSessionThreads();
+    } else {
+      session_options.SetIntraOpNumThreads(opts.num_threads);
+      session_options.SetInterOpNumThreads(opts.num_threads);
+    }
+    session_options.SetGraphOptimizationLevel(
+        static_cast<GraphOptimizationLevel>(opts.graph_optimization_level));
+    if (!opts.cpu_mem_arena) {
+      session_options.DisableCpuMemArena();
+    }
+    AppendExecutionProviders(opts, &session_options);
+
+    encoder_session_ =
+        CreateSession(encoder_onnx_path, opts, session_options);
+    rescore_session_ =
+        CreateSession(rescore_onnx_path, opts, session_options);
+    if (!fused_ctc_) {
+      ctc_session_ = CreateSession(ctc_onnx_path, opts, session_options);
+    }
+  } catch (std::exception const& e) {
+    LOG(ERROR) << "error when load onnx model";
+    exit(0);
+  }
+
+  // 2. Read metadata
+  auto model_metadata = encoder_session_->GetModelMetadata();
+
+  Ort::AllocatorWithDefaultOptions allocator;
+  encoder_output_size_ = std::move(
+      atoi(model_metadata.LookupCustomMetadataMap("output_size", allocator)));
+  num_blocks_ = std::move(
+      atoi(model_metadata.LookupCustomMetadataMap("num_blocks", allocator)));
+  head_ = std::move(
+      atoi(model_metadata.LookupCustomMetadataMap("head", allocator)));
+  cnn_module_kernel_ = std::move(atoi(
+      model_metadata.LookupCustomMetadataMap("cnn_module_kernel", allocator)));
+  subsampling_rate_ = std::move(atoi(
+      model_metadata.LookupCustomMetadataMap("subsampling_rate", allocator)));
+  right_context_ = std::move(
+      atoi(model_metadata.LookupCustomMetadataMap("right_context", allocator)));
+  sos_ = std::move(
+      atoi(model_metadata.LookupCustomMetadataMap("sos_symbol", allocator)));
+  eos_ = std::move(
+      atoi(model_metadata.LookupCustomMetadataMap("eos_symbol", allocator)));
+  is_bidirectional_decoder_ =
+      std::move(atoi(model_metadata.LookupCustomMetadataMap(
+          "is_bidirectional_decoder", allocator)));
+  chunk_size_ = std::move(
+      atoi(model_metadata.LookupCustomMetadataMap("chunk_size", allocator)));
+  num_left_chunks_ = std::move(
+      atoi(model_metadata.LookupCustomMetadataMap("left_chunks", allocator)));
+
+  LOG(INFO) << "Onnx Model Info:";
+  LOG(INFO) << "\tencoder_output_size " << encoder_output_size_;
+  LOG(INFO) << "\tnum_blocks " << num_blocks_;
+  LOG(INFO) << "\thead " << head_;
+  LOG(INFO) << "\tcnn_module_kernel " << cnn_module_kernel_;
+  LOG(INFO) << "\tsubsampling_rate " << subsampling_rate_;
+  LOG(INFO) << "\tright_context " << right_context_;
+  LOG(INFO) << "\tsos " << sos_;
+  LOG(INFO) << "\teos " << eos_;
+  LOG(INFO) << "\tis bidirectional decoder " << is_bidirectional_decoder_;
+  LOG(INFO) << "\tchunk_size " << chunk_size_;
+  LOG(INFO) << "\tnum_left_chunks " << num_left_chunks_;
+
+  // 3. Read model nodes
+  LOG(INFO) << "Onnx Encoder:";
+  GetInputOutputInfo(encoder_session_, &encoder_in_names_, &encoder_out_names_);
+  if (!fused_ctc_) {
+    LOG(INFO) << "Onnx CTC:";
+    GetInputOutputInfo(ctc_session_, &ctc_in_names_, &ctc_out_names_);
+  }
+  LOG(INFO) << "Onnx Rescore:";
+  GetInputOutputInfo(rescore_session_, &rescore_in_names_, &rescore_out_names_);
+  for (size_t i = 0; i < encoder_in_names_.size(); ++i) {
+    if (!strcmp(encoder_in_names_[i], "conv_cache")) {
+      conv_cache_size_ = encoder_session_->GetInputTypeInfo(i)
+                             .GetTensorTypeAndShapeInfo()
+                             .GetShape()[2];
+      LOG(INFO) << "\tconv_cache_size " << conv_cache_size_;
+    }
+  }
+}
+
+OnnxAsrModel::OnnxAsrModel(const OnnxAsrModel& other) {
+  // metadatas
+  encoder_output_size_ = other.encoder_output_size_;
+  num_blocks_ = other.num_blocks_;
+  head_ = other.head_;
+  cnn_module_kernel_ = other.cnn_module_kernel_;
+  right_context_ = other.right_context_;
+  subsampling_rate_ = other.subsampling_rate_;
+  sos_ = other.sos_;
+  eos_ = other.eos_;
+  is_bidirectional_decoder_ = other.is_bidirectional_decoder_;
+  chunk_size_ = other.chunk_size_;
+  num_left_chunks_ = other.num_left_chunks_;
+  offset_ = other.offset_;
+  rescoring_hyp_buckets_ = other.rescoring_hyp_buckets_;
+  rescoring_frame_buckets_ = other.rescoring_frame_buckets_;
+  io_binding_ = other.io_binding_;
+  fused_ctc_ = other.fused_ctc_;
+  keep_encoder_out_ = other.keep_encoder_out_;
+  conv_cache_size_ = other.conv_cache_size_;
+
+  // sessions
+  encoder_session_ = other.encoder_session_;
+  ctc_session_ = other.ctc_session_;
+  rescore_session_ = other.rescore_session_;
+
+  // node names
+  encoder_in_names_ = other.encoder_in_names_;
+  encoder_out_names_ = other.encoder_out_names_;
+  ctc_in_names_ = other.ctc_in_names_;
+  ctc_out_names_ = other.ctc_out_names_;
+  rescore_in_names_ = other.rescore_in_names_;
+  rescore_out_names_ = other.rescore_out_names_;
+}
+
+std::shared_ptr<AsrModel> OnnxAsrModel::Copy() const {
+  auto asr_model = std::make_shared<OnnxAsrModel>(*this);
+  // Reset the inner states for new decoding
+  asr_model->Reset();
+  return asr_model;
+}
+
+void OnnxAsrModel::Reset() {
+  offset_ = 0;
+  encoder_out_.Clear();
+  // Reset att_cache
+  Ort::MemoryInfo memory_info =
+      Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+  if (num_left_chunks_ > 0) {
+    int required_cache_size = chunk_size_ * num_left_chunks_;
+    offset_ = required_cache_size;
+    att_cache_.resize(num_blocks_ * head_ * required_cache_size *
+                          encoder_output_size_ / head_ * 2,
+                      0.0);
+    const int64_t att_cache_shape[] = {num_blocks_, head_, required_cache_size,
+                                       encoder_output_size_ / head_ * 2};
+    att_cache_ort_ = Ort::Value::CreateTensor<float>(
+        memory_info, att_cache_.data(), att_cache_.size(), att_cache_shape, 4);
+  } else {
+    att_cache_.resize(0, 0.0);
+    const int64_t att_cache_shape[] = {num_blocks_, head_, 0,
+                                       encoder_output_size_ / head_ * 2};
+    att_cache_ort_ = Ort::Value::CreateTensor<float>(
+        memory_info, att_cache_.data(), att_cache_.size(), att_cache_shape, 4);
+  }
+
+  // Reset cnn_cache
+  cnn_cache_.resize(
+      num_blocks_ * encoder_output_size_ * (cnn_module_kernel_ - 1), 0.0);
+  const int64_t cnn_cache_shape[] = {num_blocks_, 1, encoder_output_size_,
+                                     cnn_module_kernel_ - 1};
+  cnn_cache_ort_ = Ort::Value::CreateTensor<float>(
+      memory_info, cnn_cache_.data(), cnn_cache_.size(), cnn_cache_shape, 4);
+
+  // Reset conv_cache, the next chunk is spliced
+  if (conv_cache_size_ > 0) {
+    conv_cache_.resize(conv_cache_size_, 0.0);
+    const int64_t conv_cache_shape[] = {1, 0, conv_cache_size_};
+    conv_cache_ort_ = Ort::Value::CreateTensor<float>(
+        memory_info, conv_cache_.data(), 0, conv_cache_shape, 3);
+  }
+
+  // Preallocate the output caches for IoBinding mode
+  att_cache_shape_.clear();
+  if (io_binding_ && num_left_chunks_ > 0) {
+    att_cache_shape_ = {num_blocks_, head_, chunk_size_ * num_left_chunks_,
+                        encoder_output_size_ / head_ * 2};
+    cnn_cache_shape_.assign(cnn_cache_shape, cnn_cache_shape + 4);
+    next_att_cache_.resize(att_cache_.size());
+    next_cnn_cache_.resize(cnn_cache_.size());
+  }
+}
+
+void OnnxAsrModel::ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                                     LogProbMatrix* out_prob) {
+  Ort::MemoryInfo memory_info =
+      Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+  // 1. Prepare onnx required data, splice cached_feature_ and chunk_feats
+  // unless the overlap is in the conv cache
+  // chunk
+  bool conv_cache_valid =
+      conv_cache_size_ > 0 &&
+      conv_cache_ort_.GetTensorTypeAndShapeInfo().GetShape()[1] > 0;
+  FeatureMatrix spliced;
+  if (!conv_cache_valid) SpliceFeature(chunk_feats, &spliced);
+  const FeatureMatrix& feats = conv_cache_valid ? chunk_feats : spliced;
+  int num_frames = feats.rows();
+  const int feature_dim = feats.cols();
+  // Onnx tensor must be dense, pack the rows if they are padded
+  std::vector<float> packed_feats;
+  float* feats_data = const_cast<float*>(feats.data());
+  if (feats.stride() != feature_dim) {
+    packed_feats.resize(num_frames * feature_dim);
+    for (int i = 0; i < num_frames; ++i) {
+      memcpy(packed_feats.data() + i * feature_dim, feats.Row(i),
+             sizeof(float) * feature_dim);
+    }
+    feats_data = packed_feats.data();
+  }
+  const int64_t feats_shape[3] = {1, num_frames, feature_dim};
+  Ort::Value feats_ort = Ort::Value::CreateTensor<float>(
+      memory_info, feats_data, num_frames * feature_dim, feats_shape, 3);
+  // offset
+  int64_t offset_int64 = static_cast<int64_t>(offset_);
+  Ort::Value offset_ort = Ort::Value::CreateTensor<int64_t>(
+      memory_info, &offset_int64, 1, std::vector<int64_t>{}.data(), 0);
+  // required_cache_size
+  int64_t required_cache_size = chunk_size_ * num_left_chunks_;
+  Ort::Value required_cache_size_ort = Ort::Value::CreateTensor<int64_t>(
+      memory_info, &required_cache_size, 1, std::vector<int64_t>{}.data(), 0);
+  // att_mask
+  Ort::Value att_mask_ort{nullptr};
+  std::vector<uint8_t> att_mask(required_cache_size + chunk_size_, 1);
+  if (num_left_chunks_ > 0) {
+    int chunk_idx = offset_ / chunk_size_ - num_left_chunks_;
+    if (chunk_idx < num_left_chunks_) {
+      for (int i = 0; i < (num_left_chunks_ - chunk_idx) * chunk_size_; ++i) {
+        att_mask[i] = 0;
+      }
+    }
+    const int64_t att_mask_shape[] = {1, 1, required_cache_size + chunk_size_};
+    att_mask_ort = Ort::Value::CreateTensor<bool>(
+        memory_info, reinterpret_cast<bool*>(att_mask.data()), att_mask.size(),
+        att_mask_shape, 3);
+  }
+
+  // 2. Encoder chunk forward
+  std::vector<Ort::Value> inputs;
+  for (auto name : encoder_in_names_) {
+    if (!strcmp(name, "chunk")) {
+      inputs.emplace_back(std::move(feats_ort));
+    } else if (!strcmp(name, "offset")) {
+      inputs.emplace_back(std::move(offset_ort));
+    } else if (!strcmp(name, "required_cache_size")) {
+      inputs.emplace_back(std::move(required_cache_size_ort));
+    } else if (!strcmp(name, "att_cache")) {
+      inputs.emplace_back(std::move(att_cache_ort_));
+    } else if (!strcmp(name, "cnn_cache")) {
+      inputs.emplace_back(std::move(cnn_cache_ort_));
+    } else if (!strcmp(name, "att_mask")) {
+      inputs.emplace_back(std::move(att_mask_ort));
+    } else if (!strcmp(name, "conv_cache")) {
+      inputs.emplace_back(std::move(conv_cache_ort_));
+    }
+  }
+
+  // The new conv cache is the 4th output if there is one, the encoder
+  // output is the last output of the fused graph, skip it if there is no
+  // rescoring
+  const size_t num_cache_outputs = conv_cache_size_ > 0 ? 4 : 3;
+  size_t num_outputs = encoder_out_names_.size();
+  if (fused_ctc_ && !keep_encoder_out_) {
+    num_outputs = num_cache_outputs;
+  }
+  std::vector<Ort::Value> ort_outputs;
+  if (!att_cache_shape_.empty()) {  // IoBinding mode
+    // The new caches are written to the next buffers in place, then swap
+    // them with the current ones, no allocation and copy for the caches.
+    Ort::IoBinding binding(*encoder_session_);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      binding.BindInput(encoder_in_names_[i], inputs[i]);
+    }
+    Ort::Value next_att_cache_ort = Ort::Value::CreateTensor<float>(
+        memory_info, next_att_cache_.data(), next_att_cache_.size(),
+        att_cache_shape_.data(), att_cache_shape_.size());
+    Ort::Value next_cnn_cache_ort = Ort::Value::CreateTensor<float>(
+        memory_info, next_cnn_cache_.data(), next_cnn_cache_.size(),
+        cnn_cache_shape_.data(), cnn_cache_shape_.size());
+    binding.BindOutput(encoder_out_names_[0], memory_info);
+    binding.BindOutput(encoder_out_names_[1], next_att_cache_ort);
+    binding.BindOutput(encoder_out_names_[2], next_cnn_cache_ort);
+    for (size_t i = 3; i < num_outputs; ++i) {
+      binding.BindOutput(encoder_out_names_[i], memory_info);
+    }
+    encoder_session_->Run(Ort::RunOptions{nullptr}, binding);
+    ort_outputs = binding.GetOutputValues();
+    att_cache_.swap(next_att_cache_);
+    cnn_cache_.swap(next_cnn_cache_);
+  } else {
+    ort_outputs = encoder_session_->Run(
+        Ort::RunOptions{nullptr}, encoder_in_names_.data(), inputs.data(),
+        inputs.size(), encoder_out_names_.data(), num_outputs);
+  }
+
+  offset_ += static_cast<int>(
+      ort_outputs[0].GetTensorTypeAndShapeInfo().GetShape()[1]);
+  att_cache_ort_ = std::move(ort_outputs[1]);
+  cnn_cache_ort_ = std::move(ort_outputs[2]);
+  if (conv_cache_size_ > 0) {
+    conv_cache_ort_ = std::move(ort_outputs[3]);
+  }
+
+  const Ort::Value* chunk_out = nullptr;
+  const Ort::Value* ctc_out = nullptr;
+  std::vector<Ort::Value> ctc_ort_outputs;
+  if (fused_ctc_) {
+    ctc_out = &ort_outputs[0];
+    if (num_outputs > num_cache_outputs) {
+      chunk_out = &ort_outputs[num_cache_outputs];
+    }
+  } else {
+    chunk_out = &ort_outputs[0];
+    ctc_ort_outputs = ctc_session_->Run(
+        Ort::RunOptions{nullptr}, ctc_in_names_.data(), &ort_outputs[0], 1,
+        ctc_out_names_.data(), ctc_out_names_.size());
+    ctc_out = &ctc_ort_outputs[0];
+  }
+  const float* logp_data = ctc_out->GetTensorData<float>();
+  auto type_info = ctc_out->GetTensorTypeAndShapeInfo();
+
+  int num_outputs = type_info.GetShape()[1];
+  int output_dim = type_info.GetShape()[2];
+  if (chunk_out != nullptr) {
+    // The runs of the kept frames, the blank is 0
+    const float* data = chunk_out->GetTensorData<float>();
+    SelectRescoringFrames(logp_data, num_outputs, output_dim,
+                          rescoring_blank_threshold_, &rescoring_frames_);
+    for (size_t i = 0; i < rescoring_frames_.size();) {
+      size_t end = i + 1;
+      while (end < rescoring_frames_.size() &&
+             rescoring_frames_[end] == rescoring_frames_[end - 1] + 1) {
+        end++;
+      }
+      AppendEncoderOut(
+          data + static_cast<size_t>(rescoring_frames_[i]) *
+                     encoder_output_size_,
+          end - i);
+      i = end;
+    }
+  }
+  out_prob->Resize(num_outputs, output_dim);
+  for (int i = 0; i < num_outputs; i++) {
+    memcpy(out_prob->Row(i), logp_data + i * output_dim,
+           sizeof(float) * output_dim);
+  }
+}
+
+// Bytes of a cache returned by the session, 0 if it wraps one of the
+// buffers of the model, which are counted already
+static size_t OrtCacheBytes(const Ort::Value& value,
+                            const std::vector<float>& buffer) {
+  if (!value || !value.IsTensor()) return 0;
+  if (value.GetTensorData<float>() == buffer.data()) return 0;
+  return value.GetTensorTypeAndShapeInfo().GetElementCount() * sizeof(float);
+}
+
+size_t OnnxAsrModel::MemoryBytes() const {
+  return AsrModel::MemoryBytes() + encoder_out_.MemoryBytes() +
+         VectorBytes(att_cache_) + VectorBytes(cnn_cache_) +
+         VectorBytes(next_att_cache_) + VectorBytes(next_cnn_cache_) +
+         OrtCacheBytes(att_cache_ort_, att_cache_) +
+         OrtCacheBytes(cnn_cache_ort_, cnn_cache_) +
+         OrtCacheBytes(conv_cache_ort_, conv_cache_) + VectorBytes(conv_cache_);
+}
+
+bool OnnxAsrModel::GetEncoderOut(FeatureMatrix* encoder_out) const {
+  const int num_frames = encoder_out_.num_frames();
+  const int dim = encoder_out_.dim();
+  encoder_out->Resize(num_frames, num_frames > 0 ? dim : 0);
+  if (num_frames == 0) return true;
+  std::vector<float> buffer;
+  const float* data = encoder_out_.Data(&buffer);
+  for (int i = 0; i < num_frames; ++i) {
+    memcpy(encoder_out->Row(i), data + static_cast<size_t>(i) * dim,
+           sizeof(float) * dim);
+  }
+  return true;
+}
+
+bool OnnxAsrModel::SetEncoderOut(const FeatureMatrix& encoder_out) {
+  encoder_out_.Clear();
+  if (encoder_out.empty()) return true;
+  if (encoder_out.cols() != encoder_output_size_) return false;
+  for (int i = 0; i < encoder_out.rows(); ++i) {
+    AppendEncoderOut(encoder_out.Row(i), 1);
+  }
+  return true;
+}
+
+// The shape and the values of a cache
+static void WriteOrtCache(const Ort::Value& value, StateWriter* writer) {
+  Ort::TensorTypeAndShapeInfo info = value.GetTensorTypeAndShapeInfo();
+  writer->WriteVector(info.GetShape());
+  writer->WriteArray(value.GetTensorData<float>(), info.GetElementCount());
+}
+
+// Read a cache of the shape of value into buffer and wrap it as value. The
+// size of time_dim may differ, e.g. the attention cache of all the left
+// chunks grows with the stream, -1 means none.
+static bool ReadOrtCache(StateReader* reader, int time_dim,
+                         std::vector<float>* buffer, Ort::Value* value) {
+  std::vector<int64_t> expected =
+      value->GetTensorTypeAndShapeInfo().GetShape();
+  std::vector<int64_t> shape;
+  if (!reader->ReadVector(&shape) || shape.size() != expected.size()) {
+    return false;
+  }
+  uint64_t numel = 1;
+  const uint64_t max_numel = reader->remaining() / sizeof(float);
+  for (int i = 0; i < shape.size(); ++i) {
+    if (shape[i] < 0 || (i != time_dim && shape[i] != expected[i]) ||
+        (shape[i] > 0 &&
+         numel > max_numel / static_cast<uint64_t>(shape[i]))) {
+      return false;
+    }
+    numel *= shape[i];
+  }
+  buffer->resize(numel);
+  if (!reader->ReadArray(buffer->data(), numel)) return false;
+  Ort::MemoryInfo memory_info =
+      Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+  *value = Ort::Value::CreateTensor<float>(memory_info, buffer->data(),
+                                           buffer->size(), shape.data(),
+                                           shape.size());
+  return true;
+}
+
+bool OnnxAsrModel::SaveCaches(StateWriter* writer) const {
+  WriteOrtCache(att_cache_ort_, writer);
+  WriteOrtCache(cnn_cache_ort_, writer);
+  return true;
+}
+
+bool OnnxAsrModel::RestoreCaches(StateReader* reader) {
+  // The attention cache is of a fixed size only with limited left chunks,
+  // which IoBinding mode relies on
+  const int time_dim = num_left_chunks_ > 0 ? -1 : 2;
+  return ReadOrtCache(reader, time_dim, &att_cache_, &att_cache_ort_) &&
+         ReadOrtCache(reader, -1, &cnn_cache_, &cnn_cache_ort_);
+}
+
+void OnnxAsrModel::AppendEncoderOut(const float* data, int num_frames) {
+  const int dim = encoder_output_size_;
+  const int max_frames = max_encoder_frames_;
+  if (max_frames > 0 && num_frames > max_frames) {
+    data += static_cast<size_t>(num_frames - max_frames) * dim;
+    num_frames = max_frames;
+  }
+  // Drop the oldest frames
+  if (max_frames > 0 && encoder_out_.num_frames() + num_frames > max_frames) {
+    encoder_out_.DropFront(encoder_out_.num_frames() + num_frames -
+                           max_frames);
+  }
+  // The dtype only changes between the sentences
+  if (encoder_out_.num_frames() == 0 &&
+      encoder_out_.dtype() != encoder_out_dtype_) {
+    encoder_out_.set_dtype(encoder_out_dtype_);
+  }
+  encoder_out_.Append(data, num_frames, dim);
+}
+
+float OnnxAsrModel::ComputeAttentionScore(const float* prob,
+                                          const std::vector<int>& hyp, int eos,
+                                          int decode_out_len) {
+  float score = 0.0f;
+  for (size_t j = 0; j < hyp.size(); ++j) {
+    score += *(prob + j * decode_out_len + hyp[j]);
+  }
+  score += *(prob + hyp.size() * decode_out_len + eos);
+  return score;
+}
+
+void OnnxAsrModel::AttentionRescoring(const std::vector<std::vector<int>>& hyps,
+                                      float reverse_weight,
+                                      std::vector<float>* rescoring_score) {
+  Ort::MemoryInfo memory_info =
+      Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+  CHECK(rescoring_score != nullptr);
+  int num_hyps = hyps.size();
+  rescoring_score->resize(num_hyps, 0.0f);
+
+  if (num_hyps == 0) {
+    return;
+  }
+  // No encoder output
+  const int encoder_out_len = encoder_out_.num_frames();
+  if (encoder_out_len == 0) {
+    return;
+  }
+
+  std::vector<int64_t> hyps_lens;
+  int max_hyps_len = 0;
+  for (size_t i = 0; i < num_hyps; ++i) {
+    int length = hyps[i].size() + 1;
+    max_hyps_len = std::max(length, max_hyps_len);
+    hyps_lens.emplace_back(static_cast<int64_t>(length));
+  }
+  // The exported decoder masks the hyps by hyps_lens but takes no encoder
+  // lengths, so only the hyps are padded to the buckets
+  max_hyps_len = BucketSize(max_hyps_len, rescoring_hyp_buckets_);
+
+  const int64_t decode_input_shape[] = {1, encoder_out_len,
+                                        encoder_output_size_};
+
+  std::vector<int64_t> hyps_pad;
+
+  for (size_t i = 0; i < num_hyps; ++i) {
+    const std::vector<int>& hyp = hyps[i];
+    hyps_pad.emplace_back(sos_);
+    size_t j = 0;
+    for (; j < hyp.size(); ++j) {
+      hyps_pad.emplace_back(hyp[j]);
+    }
+    if (j == max_hyps_len - 1) {
+      continue;
+    }
+    for (; j < max_hyps_len - 1; ++j) {
+      hyps_pad.emplace_back(0);
+    }
+  }
+
+  const int64_t hyps_pad_shape[] = {num_hyps, max_hyps_len};
+
+  const int64_t hyps_lens_shape[] = {num_hyps};
+
+  // The stored encoder outputs are dequantized only for the rescoring, the
+  // buffer is freed after it
+  std::vector<float> encoder_out_buffer;
+  Ort::Value decode_input_tensor_ = Ort::Value::CreateTensor<float>(
+      memory_info, const_cast<float*>(encoder_out_.Data(&encoder_out_buffer)),
+      static_cast<size_t>(encoder_out_len) * encoder_output_size_,
+      decode_input_shape, 3);
+  Ort::Value hyps_pad_tensor_ = Ort::Value::CreateTensor<int64_t>(
+      memory_info, hyps_pad.data(), hyps_pad.size(), hyps_pad_shape, 2);
+  Ort::Value hyps_lens_tensor_ = Ort::Value::CreateTensor<int64_t>(
+      memory_info, hyps_lens.data(), hyps_lens.size(), hyps_lens_shape, 1);
+
+  std::vector<Ort::Value> rescore_inputs;
+
+  rescore_inputs.emplace_back(std::move(hyps_pad_tensor_));
+  rescore_inputs.emplace_back(std::move(hyps_lens_tensor_));
+  rescore_inputs.emplace_back(std::move(decode_input_tensor_));
+
+  std::vector<Ort::Value> rescore_outputs = rescore_session_->Run(
+      Ort::RunOptions{nullptr}, rescore_in_names_.data(), rescore_inputs.data(),
+      rescore_inputs.size(), rescore_out_names_.data(),
+      rescore_out_names_.size());
+
+  float* decoder_outs_data = rescore_outputs[0].GetTensorMutableData<float>();
+  float* r_decoder_outs_data = rescore_outputs[1].GetTensorMutableData<float>();
+
+  auto type_info = rescore_outputs[0].GetTensorTypeAndShapeInfo();
+  int decode_out_len = type_info.GetShape()[2];
+
+  for (size_t i = 0; i < num_hyps; ++i) {
+    const std::vector<int>& hyp = hyps[i];
+    float score = 0.0f;
+    // left to right decoder score
+    score = ComputeAttentionScore(
+        decoder_outs_data + max_hyps_len * decode_out_len * i, hyp, eos_,
+        decode_out_len);
+    // Optional: Used for right to left score
+    float r_score = 0.0f;
+    if (is_bidirectional_decoder_ && reverse_weight > 0) {
+      std::vector<int> r_hyp(hyp.size());
+      std::reverse_copy(hyp.begin(), hyp.end(), r_hyp.begin());
+      // right to left decoder score
+      r_score = ComputeAttentionScore(
+          r_decoder_outs_data + max_hyps_len * decode_out_len * i, r_hyp, eos_,
+          decode_out_len);
+    }
+    // combined left-to-right and right-to-left score
+    (*rescoring_score)[i] =
+        score * (1 - reverse_weight) + r_score * reverse_weight;
+  }
+}
+
+}  // namespace wenet
@@ -1,74 +1,167 @@
-// Copyright 2020 Mobvoi Inc. All Rights Reserved.
-// Author: binbinzhang@mobvoi.com (Binbin Zhang)
-//         di.wu@mobvoi.com (Di Wu)
-//         lizexuan@huya.com (Zexuan Li)
-//         sxc19@mails.tsinghua.edu.cn (Xingchen Song)
-
-#ifndef DECODER_ONNX_ASR_MODEL_H_
-#define DECODER_ONNX_ASR_MODEL_H_
-
-#include <memory>
-#include <string>
-#include <vector>
-
-#include "onnxruntime_cxx_api.h"  // NOLINT
-
-#include "decoder/asr_model.h"
-#include "utils/utils.h"
-#include "utils/log.h"
-
-namespace wenet {
-
-class OnnxAsrModel : public AsrModel {
- public:
-  OnnxAsrModel() = default;
-  OnnxAsrModel(const OnnxAsrModel& other);
-  void Read(const std::string& model_dir, int num_threads = 1);
-  void Reset() override;
-  void AttentionRescoring(const std::vector<std::vector<int>>& hyps,
-                          float reverse_weight,
-                          std::vector<float>* rescoring_score) override;
-  std::shared_ptr<AsrModel> Copy() const override;
-  void GetInputOutputInfo(const std::shared_ptr<Ort::Session>& session,
-                          std::vector<const char*>* in_names,
-                          std::vector<const char*>* out_names);
-
- protected:
-  void ForwardEncoderFunc(const std::vector<std::vector<float>>& chunk_feats,
-                          std::vector<std::vector<float>>* ctc_prob) override;
-
-  float ComputeAttentionScore(const float* prob, const std::vector<int>& hyp,
-                              int eos, int decode_out_len);
-
- private:
-  int encoder_output_size_ = 0;
-  int num_blocks_ = 0;
-  int cnn_module_kernel_ = 0;
-  int head_ = 0;
-
-  // sessions
-  std::shared_ptr<Ort::Session> encoder_session_ = nullptr;
-  std::shared_ptr<Ort::Session> rescore_session_ = nullptr;
-  std::shared_ptr<Ort::Session> ctc_session_ = nullptr;
-
-  // node names
-  std::vector<const char*> encoder_in_names_, encoder_out_names_;
-  std::vector<const char*> ctc_in_names_, ctc_out_names_;
-  std::vector<const char*> rescore_in_names_, rescore_out_names_;
-
-  // caches
-  Ort::Value att_cache_ort_{nullptr};
-  Ort::Value cnn_cache_ort_{nullptr};
-  std::vector<Ort::Value> encoder_outs_;
-  // NOTE: Instead of making a copy of the xx_cache, ONNX only maintains
-  //  its data pointer when initializing xx_cache_ort (see https://github.com/
-  //  microsoft/onnxruntime/blob/master/onnxruntime/core/framework
-  //  /tensor.cc#L102-L129), so we need the following variables to keep
-  //  our data "alive" during the lifetime of decoder.
-  std::vector<float> att_cache_;
-  std::vector<float> cnn_cache_;
-};
-
-}  // namespace wenet
-
-#endif  // DECODER_ONNX_ASR_MODEL_H_
+// Copyright 2020 Mobvoi Inc. All Rights Reserved.
+// Author: binbinzhang@mobvoi.com (Binbin Zhang)
+//         di.wu@mobvoi.com (Di Wu)
+//         lizexuan@huya.com (Zexuan Li)
+//         sxc19@mails.tsinghua.edu.cn (Xingchen Song)
+
+#ifndef DECODER_ONNX_ASR_MODEL_H_
+#define DECODER_ONNX_ASR_MODEL_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "onnxruntime_cxx_api.h"  // NOLINT
+
+#include "decoder/asr_model.h"
+#include "utils/quantized_frames.h"
+#include "utils/utils.h"
+#include "utils/log.h"
+
+namespace wenet {
+
+struct OnnxSessionOptions {
+  // Per session threads, not used when the global thread pool is created by
+  // OnnxAsrModel::InitEngineThreads
+  int num_threads = 1;
+  // Execution providers in priority order, the first available one is used
+  // and CPU is always the fallback. Supported: cuda, tensorrt, openvino, cpu,
+  // and nnapi, xnnpack of the Android builds (USE_NNAPI, USE_XNNPACK)
+  std::vector<std::string> providers = {"cpu"};
+  // 0: disable all, 1: basic, 2: extended, 99: all optimizations
+  int graph_optimization_level = 99;
+  bool cpu_mem_arena = true;
+  // Read the int8 quantized graphs of the model dir, encoder.quant.onnx,
+  // ctc.quant.onnx and decoder.quant.onnx, as exported by
+  // wenet/bin/export_onnx_cpu.py
+  bool quantized = false;
+  // Save the graphs optimized by the first start to this dir and load them
+  // at the later starts without optimizing them again. The files are keyed
+  // by the hash of the graph, the onnxruntime version, the providers and
+  // the optimization level. The optimized graphs may be specific to the
+  // cpu, so the dir shouldn't be shared by different hosts. Empty means no
+  // cache.
+  std::string optimized_cache_dir;
+  // Read the ORT format graphs beside the onnx ones instead, e.g.
+  // encoder.ort of encoder.onnx, converted by python -m
+  // onnxruntime.tools.convert_onnx_models_to_ort, from their read only
+  // mappings, and run them on their initializers in place, so the processes
+  // of the same model share the physical pages of the weights. The weights
+  // are not prepacked then, which may cost some speed of the GEMMs. The onnx
+  // graph is read as usual if there's no ORT format one.
+  bool mmap_weights = false;
+};
+
+class OnnxAsrModel : public AsrModel {
+ public:
+  // Create the process-wide Ort::Env with a global thread pool shared by all
+  // the sessions. Note: call it at most once and before Read().
+  static void InitEngineThreads(int num_threads = 1,
+                                int num_interop_threads = 1);
+
+ public:
+  OnnxAsrModel() = default;
+  OnnxAsrModel(const OnnxAsrModel& other);
+  void Read(const std::string& model_dir, int num_threads = 1);
+  void Read(const std::string& model_dir, const OnnxSessionOptions& opts);
+  // IoBinding mode, the caches are preallocated and ping-ponged between two
+  // buffers instead of being allocated for each chunk. It only takes effect
+  // when the model has a fixed cache size, i.e. num_left_chunks > 0.
+  void set_io_binding(bool io_binding) { io_binding_ = io_binding; }
+  // Only for the fused encoder+ctc graph(encoder_ctc.onnx in model_dir), if
+  // false, the encoder output is not fetched, so there is no rescoring.
+  void set_keep_encoder_out(bool keep) { keep_encoder_out_ = keep; }
+  void Reset() override;
+  void AttentionRescoring(const std::vector<std::vector<int>>& hyps,
+                          float reverse_weight,
+                          std::vector<float>* rescoring_score) override;
+  std::shared_ptr<AsrModel> Copy() const override;
+  // Dequantized from or quantized into encoder_out_dtype_
+  bool GetEncoderOut(FeatureMatrix* encoder_out) const override;
+  bool SetEncoderOut(const FeatureMatrix& encoder_out) override;
+  size_t MemoryBytes() const override;
+  void GetInputOutputInfo(const std::shared_ptr<Ort::Session>& session,
+                          std::vector<const char*>* in_names,
+                          std::vector<const char*>* out_names);
+
+ protected:
+  void ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                          LogProbMatrix* ctc_prob) override;
+  // The caches are checked against the shapes of the model, they're read
+  // into att_cache_ and cnn_cache_
+  bool SaveCaches(StateWriter* writer) const override;
+  bool RestoreCaches(StateReader* reader) override;
+
+  float ComputeAttentionScore(const float* prob, const std::vector<int>& hyp,
+                              int eos, int decode_out_len);
+  // Append num_frames encoder outputs to encoder_out_, and drop the oldest
+  // ones over max_encoder_frames_
+  void AppendEncoderOut(const float* data, int num_frames);
+  static void AppendExecutionProviders(const OnnxSessionOptions& opts,
+                                       Ort::SessionOptions* session_options);
+  // The session of the graph of path, through opts.optimized_cache_dir if
+  // it's set
+  static std::shared_ptr<Ort::Session> CreateSession(
+      const std::string& path, const OnnxSessionOptions& opts,
+      const Ort::SessionOptions& session_options);
+
+ private:
+  int encoder_output_size_ = 0;
+  int num_blocks_ = 0;
+  int cnn_module_kernel_ = 0;
+  int head_ = 0;
+  bool io_binding_ = false;
+  // encoder_session_ runs the fused encoder+ctc graph, no ctc_session_
+  bool fused_ctc_ = false;
+  bool keep_encoder_out_ = true;
+  // Size of the conv cache of the subsampling if the encoder takes it, see
+  // wenet/bin/export_onnx_cpu.py --conv_cache, 0 if it doesn't
+  int64_t conv_cache_size_ = 0;
+  // The buffer of the frames kept for the rescoring of a chunk
+  std::vector<int> rescoring_frames_;
+
+  // Shared by all the models and sessions in the process
+  static std::shared_ptr<Ort::Env> env_;
+  static bool global_thread_pool_;
+
+  // sessions
+  std::shared_ptr<Ort::Session> encoder_session_ = nullptr;
+  std::shared_ptr<Ort::Session> rescore_session_ = nullptr;
+  std::shared_ptr<Ort::Session> ctc_session_ = nullptr;
+
+  // node names
+  std::vector<const char*> encoder_in_names_, encoder_out_names_;
+  std::vector<const char*> ctc_in_names_, ctc_out_names_;
+  std::vector<const char*> rescore_in_names_, rescore_out_names_;
+
+  // caches
+  Ort::Value att_cache_ort_{nullptr};
+  Ort::Value cnn_cache_ort_{nullptr};
+  // (1, 1, conv_cache_size_) after a chunk, so the next chunk isn't spliced
+  // with cached_feature_, or (1, 0, conv_cache_size_) after Reset(), then
+  // the chunk is spliced as the first chunk
+  Ort::Value conv_cache_ort_{nullptr};
+  // Encoder outputs of all chunks, (T, encoder_output_size_) in
+  // encoder_out_dtype_, the chunks are appended to it directly, so rescoring
+  // needs no concat. With max_encoder_frames_, the oldest ones are dropped.
+  QuantizedFrames encoder_out_;
+  // NOTE: Instead of making a copy of the xx_cache, ONNX only maintains
+  //  its data pointer when initializing xx_cache_ort (see https://github.com/
+  //  microsoft/onnxruntime/blob/master/onnxruntime/core/framework
+  //  /tensor.cc#L102-L129), so we need the following variables to keep
+  //  our data "alive" during the lifetime of decoder.
+  std::vector<float> att_cache_;
+  std::vector<float> cnn_cache_;
+  // Backs the empty conv_cache_ort_
+  std::vector<float> conv_cache_;
+  // The other buffers of ping-pong caches in IoBinding mode
+  std::vector<float> next_att_cache_;
+  std::vector<float> next_cnn_cache_;
+  // Empty if not in IoBinding mode
+  std::vector<int64_t> att_cache_shape_;
+  std::vector<int64_t> cnn_cache_shape_;
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_ONNX_ASR_MODEL_H_
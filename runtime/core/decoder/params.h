@@ -5,37 +5,293 @@
 #ifndef DECODER_PARAMS_H_
 #define DECODER_PARAMS_H_
 
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
 #include <memory>
+#include <mutex>
 #include <utility>
 #include <string>
 #include <vector>
 
 #include "decoder/asr_decoder.h"
+#include "decoder/asr_decoder_pool.h"
+#include "decoder/device_replicas.h"
+#include "decoder/model_registry.h"
+#include "decoder/result_cache.h"
 #include "decoder/torch_asr_model.h"
+#include "decoder/torch_fbank.h"
+#ifdef USE_ONNX
 #include "decoder/onnx_asr_model.h"
+#endif
 #include "frontend/feature_pipeline.h"
 #include "post_processor/post_processor.h"
+#include "utils/async_log.h"
 #include "utils/flags.h"
+#include "utils/huge_pages.h"
+#include "utils/mapped_file.h"
+#include "utils/startup_loader.h"
 #include "utils/string.h"
+#include "utils/thread_budget.h"
+#include "utils/timer.h"
 
 // TorchAsrModel flags
 DEFINE_int32(num_threads, 1, "num threads for GEMM");
+DEFINE_int32(thread_budget, 0,
+             "the intra-op threads shared by the encoder and the rescoring "
+             "calls of all the torch sessions, each call is granted "
+             "thread_budget / (number of running calls) of them, so a lone "
+             "call fans out over the idle cores and the calls of a busy "
+             "host run single threaded, it needs the OpenMP libtorch. 0 "
+             "means the fixed num_threads of each call");
+DEFINE_int32(max_threads_per_call, 0,
+             "the most threads of one call of thread_budget, 0 means all "
+             "of them");
 DEFINE_string(model_path, "", "pytorch exported model path");
+DEFINE_string(device, "cpu", "device of TorchAsrModel, cpu or cuda:N");
+DEFINE_string(devices, "",
+              "the devices of the replicas of TorchAsrModel, e.g. "
+              "cuda:0,cuda:1, each one with its own model pool and batch "
+              "schedulers, the decoders are pinned to the least loaded one, "
+              "it replaces --device, empty means --device only");
+DEFINE_bool(fp16, false, "run TorchAsrModel in half precision, cuda only");
+DEFINE_bool(torch_freeze, false,
+            "freeze the inference methods of TorchAsrModel and optimize "
+            "their graphs at load, e.g. conv-bn folding and MKLDNN weight "
+            "prepacking, compare the RTF of decoder_main with and without");
+DEFINE_bool(torch_quantized, false,
+            "read the dynamic int8 model beside --model_path instead, e.g. "
+            "final_quant.zip of final.zip, exported by "
+            "wenet/bin/export_jit.py --output_quant_file, cpu only");
+DEFINE_int32(ctc_topk, 0,
+             "keep only the blank and the topk ctc log probs of each frame "
+             "on the device for the prefix beam search, at least --nbest, "
+             "which are passed to the search and the endpoint as they are, "
+             "0 means copying all of them back to the host");
+
+// Cascade flags
+DEFINE_string(cascade_model_path, "",
+              "a larger torch model of the same units, which rescores the "
+              "sentences of low confidence, see --cascade_posterior");
+DEFINE_string(cascade_onnx_dir, "",
+              "a larger onnx model of the same units, which rescores the "
+              "sentences of low confidence, see --cascade_posterior");
+DEFINE_double(cascade_posterior, 0.9,
+              "with a cascade model, the sentences whose top hypothesis has "
+              "a posterior among the N-best below this are rescored by the "
+              "cascade model over their whole features");
+
+// AsrModelPool flags
+DEFINE_int32(model_pool_size, 0,
+             "model states created ahead for the decoding sessions, "
+             "0 means no pool and each session copies the model");
+DEFINE_int32(model_pool_max_idle, 256,
+             "max idle model states kept in the pool");
+
+// ModelRegistry flags
+DEFINE_string(model_manifest, "",
+              "manifest of the models the sessions choose from, one model a "
+              "line of \"name key=value ...\", the keys are model_path, "
+              "onnx_dir, fst_path, token_fst_path, dict_path, unit_path, "
+              "context_path, context_ac_path, keyword_path, ngram_lm_path, "
+              "itn_fst_path, cascade_model_path, cascade_onnx_dir and "
+              "language_type, which override the flags of "
+              "the same names. The first one is the default model");
+DEFINE_int32(model_manifest_reload_s, 0,
+             "check the manifest every model_manifest_reload_s seconds and "
+             "reload the changed models, 0 means no reloading");
+
+// AsrDecoderPool flags
+DEFINE_int32(decoder_pool_size, 0,
+             "feature pipelines and decoders created ahead for the sessions "
+             "of the servers, 0 means no pool and each session creates them");
+DEFINE_int32(decoder_pool_max_idle, 256,
+             "max idle decoders kept in the pool");
+
+// BatchEncoderScheduler flags
+DEFINE_int32(max_batch_size, 1,
+             "max sessions in one batched encoder forward, "
+             "1 means no cross-session batching");
+DEFINE_int32(max_batch_wait_us, 2000,
+             "max time(us) a chunk waits for other sessions to batch with");
+
+// AdaptiveChunkPolicy flags
+DEFINE_string(adaptive_chunk_sizes, "",
+              "comma separated chunk sizes from small to large, the chunk "
+              "size of each sentence is picked by the encoder load, only for "
+              "models trained with dynamic chunk and max_batch_size > 1, "
+              "empty means a fixed chunk_size");
+DEFINE_double(adaptive_high_load, 1.0,
+              "move to a larger chunk size above this encoder load");
+DEFINE_double(adaptive_low_load, 0.5,
+              "move to a smaller chunk size below this encoder load");
+
+// AdaptiveBeamPolicy flags
+DEFINE_string(adaptive_beam_scales, "",
+              "comma separated scales of the search beams from 1.0 down to "
+              "the tightest, e.g. 1.0,0.75,0.5, the beams are tightened when "
+              "the decoding of the host falls behind, empty means fixed "
+              "beams");
+DEFINE_double(adaptive_beam_high_rtf, 0.5,
+              "tighten the beams above this average RTF of the chunks");
+DEFINE_double(adaptive_beam_low_rtf, 0.2,
+              "relax the beams below this average RTF of the chunks");
+DEFINE_int32(adaptive_beam_interval_ms, 1000,
+             "min interval between two moves of the beams");
+
+// BatchRescoringScheduler flags
+DEFINE_int32(rescoring_workers, 0,
+             "num threads of the batched attention rescoring pool, "
+             "0 means rescoring in the decoding thread");
+DEFINE_int32(max_rescoring_batch_size, 8,
+             "max sessions in one batched attention rescoring");
+DEFINE_int32(max_rescoring_wait_us, 5000,
+             "max time(us) a N-best waits for other sessions to batch with");
+
+// Pipelining flags
+DEFINE_int32(pipeline_threads, 0,
+             "num threads which forward the encoder of the next chunk of "
+             "each stream while it searches the current one, 0 means the "
+             "encoder and the search of a stream run in turn");
 
 // OnnxAsrModel flags
 DEFINE_int32(num_onnx_threads, 1, "num threads for Onnx");
 DEFINE_string(onnx_dir, "", "directory where the onnx model is saved");
+DEFINE_string(onnx_providers, "cpu",
+              "comma separated onnx execution providers in priority order, "
+              "supported: cuda, tensorrt, openvino, cpu");
+DEFINE_int32(onnx_graph_opt_level, 99,
+             "onnx graph optimization level, "
+             "0: disable, 1: basic, 2: extended, 99: all");
+DEFINE_bool(onnx_cpu_arena, true, "use cpu memory arena in onnx sessions");
+DEFINE_bool(onnx_global_threads, true,
+            "share one global thread pool of num_onnx_threads among all "
+            "onnx sessions");
+DEFINE_bool(onnx_quantized, false,
+            "read the int8 quantized graphs, *.quant.onnx, of onnx_dir");
+DEFINE_bool(onnx_io_binding, false,
+            "use IoBinding and preallocated caches for onnx encoder, only "
+            "works when num_left_chunks > 0");
+DEFINE_string(onnx_optimized_cache_dir, "",
+              "save the onnx graphs optimized by the first start to this "
+              "dir, and load them at the later starts without optimizing "
+              "them again, e.g. a volume of the host, empty means no cache");
+
+// Rescoring shape flags
+DEFINE_string(rescoring_hyp_buckets, "",
+              "comma separated lengths the rescoring hyps are padded to, so "
+              "the engines compiling per shape, e.g. on GPU, reuse a few "
+              "graphs, empty means the exact lengths");
+DEFINE_string(rescoring_frame_buckets, "",
+              "comma separated encoder lengths the rescoring pads to, only "
+              "for the torch models exporting "
+              "forward_attention_decoder_batch, which masks them, empty "
+              "means the exact lengths");
+
+// Warmup flags
+DEFINE_bool(warmup, false,
+            "run synthetic inputs through the model before serving");
+DEFINE_string(warmup_chunk_sizes, "",
+              "comma separated chunk sizes to warm up, default chunk_size");
+DEFINE_string(warmup_num_left_chunks, "",
+              "comma separated num left chunks to warm up, "
+              "default num_left_chunks");
+DEFINE_string(warmup_nbest_sizes, "",
+              "comma separated N-best sizes to warm up rescoring, "
+              "default nbest");
+DEFINE_int32(warmup_hyp_length, 10, "tokens of each warmup hypothesis");
+
+// Startup flags
+DEFINE_int32(startup_threads, 4,
+             "threads to read the model, the fsts and the symbol tables of "
+             "a model in parallel, 1 means one by one");
+
+// ThreadPlacement flags
+DEFINE_bool(numa_pinning, false,
+            "pin each server session and its threads to one NUMA node");
+DEFINE_string(numa_nodes, "",
+              "comma separated NUMA node ids for the sessions, default all");
+
+// AdmissionController flags
+DEFINE_double(max_load, 0,
+              "cores for the full profile streams, estimated by their RTF, "
+              "0 means no admission control");
+DEFINE_double(max_degraded_load, 0,
+              "streams over max_load are admitted with the degraded profile "
+              "until max_degraded_load, and rejected over it");
 
 // FeaturePipelineConfig flags
 DEFINE_int32(num_bins, 80, "num mel bins for fbank feature");
 DEFINE_int32(sample_rate, 16000, "sample rate for audio");
+DEFINE_bool(vad, false, "skip the model on the silence found by an energy vad");
+DEFINE_double(vad_energy_margin, 2.0,
+              "speech is vad_energy_margin above the noise floor in log mel");
+DEFINE_double(vad_min_energy, 3.0, "min mean log mel energy of speech");
+DEFINE_int32(vad_hangover_ms, 300, "silence kept as speech after speech");
+DEFINE_int32(fbank_batch_frames, 0,
+             "compute the fbank of all the sessions in batches of up to "
+             "fbank_batch_frames frames, 0 means per session fbank");
+DEFINE_int32(fbank_batch_wait_us, 1000,
+             "max time(us) a fbank request waits for a batch");
+DEFINE_string(fbank_device, "",
+              "compute the fbank batches by libtorch on this device, e.g. "
+              "cuda:0 with the encoder, needs fbank_batch_frames, empty "
+              "means the cpu kernels");
+DEFINE_bool(fixed_point_fbank, false,
+            "compute the fbank in fixed point, for the cpus of slow float "
+            "math, it can't be used with fbank_batch_frames");
+DEFINE_int32(max_queued_frames, 0,
+             "the servers stop reading a stream when it has "
+             "max_queued_frames undecoded frames, 0 means no limit");
 
 // TLG fst
 DEFINE_string(fst_path, "", "TLG fst path");
+DEFINE_string(token_fst_path, "",
+              "token fst (T) path, if it's set, --fst_path is the LG and "
+              "they are composed on the fly instead of a static TLG");
+DEFINE_int32(fst_cache_size, 64,
+             "cache size in MB of the states of the on the fly composed "
+             "graph, for each decoding session");
+DEFINE_bool(fst_mmap, true,
+            "map the TLG into memory if it's an aligned const fst, see "
+            "kaldi/fstbin/fsttoconst, so the processes share its pages");
+DEFINE_bool(huge_pages, false,
+            "back the arcs of a const TLG, the mapped files, e.g. the n-gram "
+            "LMs and the symbol tables, and the torch tensors by the 2 MB "
+            "huge pages, which cuts the TLB misses of their random reads, "
+            "the pages are private to the process then. The other heaps "
+            "follow GLIBC_TUNABLES=glibc.malloc.hugetlb=1 of glibc 2.35");
+DEFINE_bool(mmap_weights, false,
+            "keep the weights of the models in read only mapped files, "
+            "which the processes of the same model share, e.g. the servers "
+            "of the NUMA nodes. The torch models on cpu are mapped from "
+            "their weights files, e.g. final.zip.weights, written by the "
+            "first start beside the model; the onnx models from their ORT "
+            "format graphs, e.g. encoder.ort, converted by python -m "
+            "onnxruntime.tools.convert_onnx_models_to_ort");
 
 // DecodeOptions flags
 DEFINE_int32(chunk_size, 16, "decoding chunk size");
 DEFINE_int32(num_left_chunks, -1, "left chunks in decoding");
+DEFINE_int32(max_encoder_frames, 0,
+             "max encoder outputs kept for the rescoring of a sentence, the "
+             "older ones of a longer sentence are dropped, so the memory of "
+             "a stream without endpoints is bounded, 0 means no limit");
+DEFINE_double(rescoring_blank_threshold, 1.0,
+              "keep only the encoder outputs whose ctc blank posterior is "
+              "below it, and the least blank one of each chunk, for the "
+              "rescoring, which cuts the memory of a stream and the cost of "
+              "the rescoring, e.g. 0.99. Check the WER parity against 1 by "
+              "tools/compute-wer.py. 1 means all of them");
+DEFINE_string(encoder_out_dtype, "float32",
+              "dtype of the encoder outputs kept for the rescoring, float32, "
+              "float16 or int8 of a scale per frame, they're dequantized only "
+              "by the rescoring, only the onnx models support it");
+DEFINE_int32(max_session_memory_mb, 0,
+             "memory budget of the states of a stream, the model caches, "
+             "the encoder outputs, the search and the features. Over it, "
+             "the beams are halved, and then the sentence is ended, 0 means "
+             "no limit");
 DEFINE_double(ctc_weight, 0.5,
               "ctc weight when combining ctc score and rescoring score");
 DEFINE_double(rescoring_weight, 1.0,
@@ -44,26 +300,113 @@ DEFINE_double(reverse_weight, 0.0,
               "used for bitransformer rescoring. it must be 0.0 if decoder is"
               "conventional transformer decoder, and only reverse_weight > 0.0"
               "dose the right to left decoder will be calculated and used");
+DEFINE_int32(prefix_rescoring_interval, 0,
+             "every this many chunks, forward the decoder over the stable "
+             "prefixes of the N-best and cache its states, so the rescoring "
+             "at the end of a long sentence only forwards the tokens after "
+             "them, needs a torch model exporting "
+             "forward_attention_decoder_prefix and reverse_weight 0, 0 "
+             "means off");
+DEFINE_int32(prefix_rescoring_margin, 2,
+             "the last tokens of a hypothesis not cached as its prefix, "
+             "which are likely to change");
+DEFINE_int32(speculative_rescoring_silence_ms, 0,
+             "rescore the N-best ahead of the endpoint once the trailing "
+             "silence of a sentence reaches this, on the pipeline pool of "
+             "--pipeline_threads if it's set, and reuse the scores at the "
+             "endpoint if the N-best is unchanged, below the 1000 ms of the "
+             "endpoint rule, 0 means off");
+DEFINE_bool(prefix_tree_rescoring, false,
+            "rescore the N-best by the prefix tree of them, the decoder "
+            "runs once per branch of the tree instead of once per padded "
+            "hypothesis, needs a torch model exporting "
+            "forward_attention_decoder_prefix and reverse_weight 0");
+DEFINE_double(rescoring_skip_margin, 0.0,
+              "skip the rescoring of a sentence when the ctc log likelihood "
+              "of its top hypothesis is over the second one by this margin, "
+              "0 means off");
+DEFINE_double(rescoring_skip_posterior, 0.0,
+              "skip the rescoring of a sentence when the posterior of its "
+              "top hypothesis among the N-best reaches this, 0 means off");
 DEFINE_int32(max_active, 7000, "max active states in ctc wfst search");
 DEFINE_int32(min_active, 200, "min active states in ctc wfst search");
 DEFINE_double(beam, 16.0, "beam in ctc wfst search");
 DEFINE_double(lattice_beam, 10.0, "lattice beam in ctc wfst search");
 DEFINE_double(acoustic_scale, 1.0, "acoustic scale for ctc wfst search");
+DEFINE_int32(wfst_search_threads, 1,
+             "threads expanding the arcs of a frame in ctc wfst search, "
+             "including the decoding one, each decoder has its own, for the "
+             "huge graphs only, 1 means none");
 DEFINE_double(blank_skip_thresh, 1.0,
-              "blank skip thresh for ctc wfst search, 1.0 means no skip");
+              "blank skip thresh for ctc wfst or prefix search, "
+              "1.0 means no skip");
 DEFINE_int32(nbest, 10, "nbest for ctc wfst or prefix search");
+DEFINE_bool(output_lattice, false,
+            "keep the word lattice of the final results of ctc wfst search, "
+            "determinized and pruned by --lattice_beam, for the second pass "
+            "rescoring outside");
+DEFINE_string(rescore_lm_path, "",
+              "rescore the word lattice of ctc wfst search by this n-gram LM "
+              "of the words, a larger one than the LM of --fst_path, which "
+              "is converted from ARPA by kaldi/lmbin/arpa2ngram with the "
+              "words of --dict_path and mapped into memory");
+DEFINE_string(rescore_old_lm_path, "",
+              "the LM of --fst_path in the format of --rescore_lm_path, its "
+              "costs are subtracted by the rescoring, otherwise the graph "
+              "costs are replaced, the costs of the lexicon and the context "
+              "biasing too");
+DEFINE_double(rescore_lm_scale, 1.0, "scale of --rescore_lm_path");
+DEFINE_int32(determinize_period, 0,
+             "with --output_lattice, determinize the lattice while searching "
+             "once this many frames are decoded since the last part, up to "
+             "the last frame all the paths pass through, so the final result "
+             "only determinizes the rest, 0 determinizes it all at the end");
 
 // SymbolTable flags
 DEFINE_string(dict_path, "",
               "dict symbol table path, it's same as unit_path when we don't "
-              "use LM in decoding");
+              "use LM in decoding, either the text table or the binary one "
+              "of compile_symbol_table_main, which is mapped into memory");
 DEFINE_string(
     unit_path, "",
-    "e2e model unit symbol table, is used to get timestamp of the result");
+    "e2e model unit symbol table, is used to get timestamp of the result, "
+    "text or binary as dict_path");
 
 // Context flags
 DEFINE_string(context_path, "", "context path, is used to build context graph");
 DEFINE_double(context_score, 3.0, "is used to rescore the decoded result");
+DEFINE_bool(context_aho_corasick, false,
+            "build the Aho-Corasick automaton for the contexts, which is "
+            "faster to build and search for a very large list");
+DEFINE_string(context_ac_path, "",
+              "Aho-Corasick automaton path, it's written after building the "
+              "graph from --context_path, or mapped into memory otherwise");
+DEFINE_string(ngram_lm_path, "",
+              "n-gram LM of the CTC prefix beam search, which is converted "
+              "from ARPA by kaldi/lmbin/arpa2ngram, it's not used with "
+              "--fst_path");
+DEFINE_double(lm_weight, 0.5, "weight of the n-gram LM score");
+DEFINE_double(lm_bonus, 0.0, "score added for each token with the n-gram LM");
+DEFINE_int32(context_cache_size, 0,
+             "max number of the per-session context graphs which are cached, "
+             "0 means the sessions can't set their own contexts");
+DEFINE_int32(result_cache_mb, 0,
+             "max MB of the cached results of the offline requests, the "
+             "identical audios, e.g. the recorded prompts or the retries, "
+             "are decoded once, 0 means no cache");
+
+// CtcKeywordSpotting flags
+DEFINE_string(keyword_path, "",
+              "keywords, one a line, optionally followed by a tab and its "
+              "threshold, the results are the keywords spotted instead of "
+              "the recognition, not used with --fst_path");
+DEFINE_double(keyword_threshold, 0.5,
+              "default threshold of the keyword confidence, the geometric "
+              "mean of the peak posteriors of its tokens");
+DEFINE_double(keyword_min_token_prob, 0.05,
+              "min posterior of the peak of a keyword token");
+DEFINE_int32(keyword_max_token_gap, 50,
+             "max frames, after subsampling, between two tokens of a keyword");
 
 // PostProcessOptions flags
 DEFINE_int32(language_type, 0,
@@ -71,11 +414,83 @@ DEFINE_int32(language_type, 0,
              "0x00 = kMandarinEnglish, "
              "0x01 = kIndoEuropean");
 DEFINE_bool(lowercase, true, "lowercase final result if needed");
+DEFINE_string(itn_fst_path, "",
+              "inverse text normalization fst of the final results, over the "
+              "bytes of the text, e.g. of pynini or WeTextProcessing, it's "
+              "memory mapped if it's an aligned const fst");
+DEFINE_int32(itn_cache_size, 1000,
+             "max number of the recent inverse text normalized results "
+             "which are cached, 0 means no cache");
+
+// Logging flags
+DEFINE_int32(async_log_flush_ms, 0,
+             "queue the messages to the log files in the buffers of the "
+             "logging threads, and write them on a background thread every "
+             "this, so the decoding threads don't wait for the writes, 0 "
+             "means the synchronous logging of glog");
+DEFINE_int32(async_log_buffer_kb, 256,
+             "KB of the log buffer of each thread, the messages which don't "
+             "fit are dropped");
 
 namespace wenet {
+// Parse the comma separated integers of str, or use default_value if str is
+// empty
+std::vector<int> ParseIntList(const std::string& str) {
+  std::vector<int> values;
+  std::vector<std::string> strs;
+  SplitStringToVector(str, ",", true, &strs);
+  for (const std::string& s : strs) {
+    values.push_back(std::stoi(s));
+  }
+  return values;
+}
+
+std::vector<int> ParseIntListFlag(const std::string& str, int default_value) {
+  std::vector<int> values = ParseIntList(str);
+  if (values.empty()) {
+    values.push_back(default_value);
+  }
+  return values;
+}
+
+// Call it after google::InitGoogleLogging()
+void InitAsyncLoggingFromFlags() {
+  if (FLAGS_async_log_flush_ms > 0) {
+    InstallAsyncLogging(static_cast<size_t>(FLAGS_async_log_buffer_kb) << 10,
+                        FLAGS_async_log_flush_ms);
+  }
+}
+
 std::shared_ptr<FeaturePipelineConfig> InitFeaturePipelineConfigFromFlags() {
   auto feature_config = std::make_shared<FeaturePipelineConfig>(
       FLAGS_num_bins, FLAGS_sample_rate);
+  feature_config->use_vad = FLAGS_vad;
+  feature_config->vad_opts.energy_margin = FLAGS_vad_energy_margin;
+  feature_config->vad_opts.min_energy = FLAGS_vad_min_energy;
+  feature_config->vad_opts.hangover_frames =
+      FLAGS_vad_hangover_ms * feature_config->sample_rate / 1000 /
+      feature_config->frame_shift;
+  feature_config->max_queued_frames = FLAGS_max_queued_frames;
+  feature_config->fixed_point = FLAGS_fixed_point_fbank;
+  if (FLAGS_fbank_batch_frames > 0) {
+    BatchFbankOptions batch_opts;
+    batch_opts.max_batch_frames = FLAGS_fbank_batch_frames;
+    batch_opts.max_wait_us = FLAGS_fbank_batch_wait_us;
+    std::shared_ptr<FbankBatchComputer> computer;
+    if (!FLAGS_fbank_device.empty()) {
+      Fbank fbank(feature_config->num_bins, feature_config->sample_rate,
+                  feature_config->frame_length, feature_config->frame_shift);
+      computer = std::make_shared<TorchFbankComputer>(fbank,
+                                                      FLAGS_fbank_device);
+      LOG(INFO) << "Compute the fbank batches on " << FLAGS_fbank_device;
+    }
+    feature_config->fbank_scheduler = std::make_shared<BatchFbankScheduler>(
+        batch_opts, feature_config->num_bins, feature_config->sample_rate,
+        feature_config->frame_length, feature_config->frame_shift, computer);
+  } else {
+    CHECK(FLAGS_fbank_device.empty())
+        << "--fbank_device needs --fbank_batch_frames";
+  }
   return feature_config;
 }
 
@@ -83,86 +498,643 @@ std::shared_ptr<DecodeOptions> InitDecodeOptionsFromFlags() {
   auto decode_config = std::make_shared<DecodeOptions>();
   decode_config->chunk_size = FLAGS_chunk_size;
   decode_config->num_left_chunks = FLAGS_num_left_chunks;
+  decode_config->max_encoder_frames = FLAGS_max_encoder_frames;
+  decode_config->rescoring_blank_threshold = FLAGS_rescoring_blank_threshold;
+  CHECK(ParseFrameDtype(FLAGS_encoder_out_dtype,
+                        &decode_config->encoder_out_dtype))
+      << "Unknown --encoder_out_dtype " << FLAGS_encoder_out_dtype;
+  decode_config->max_session_memory_mb = FLAGS_max_session_memory_mb;
   decode_config->ctc_weight = FLAGS_ctc_weight;
   decode_config->reverse_weight = FLAGS_reverse_weight;
   decode_config->rescoring_weight = FLAGS_rescoring_weight;
+  decode_config->prefix_rescoring_interval = FLAGS_prefix_rescoring_interval;
+  decode_config->prefix_rescoring_margin = FLAGS_prefix_rescoring_margin;
+  decode_config->rescoring_skip_margin = FLAGS_rescoring_skip_margin;
+  decode_config->rescoring_skip_posterior = FLAGS_rescoring_skip_posterior;
+  decode_config->cascade_posterior = FLAGS_cascade_posterior;
+  decode_config->speculative_rescoring_silence_ms =
+      FLAGS_speculative_rescoring_silence_ms;
   decode_config->ctc_wfst_search_opts.max_active = FLAGS_max_active;
   decode_config->ctc_wfst_search_opts.min_active = FLAGS_min_active;
   decode_config->ctc_wfst_search_opts.beam = FLAGS_beam;
   decode_config->ctc_wfst_search_opts.lattice_beam = FLAGS_lattice_beam;
   decode_config->ctc_wfst_search_opts.acoustic_scale = FLAGS_acoustic_scale;
+  decode_config->ctc_wfst_search_opts.num_threads = FLAGS_wfst_search_threads;
   decode_config->ctc_wfst_search_opts.blank_skip_thresh =
       FLAGS_blank_skip_thresh;
   decode_config->ctc_wfst_search_opts.nbest = FLAGS_nbest;
+  decode_config->ctc_wfst_search_opts.output_lattice = FLAGS_output_lattice;
+  decode_config->ctc_wfst_search_opts.determinize_period =
+      FLAGS_determinize_period;
+  decode_config->ctc_wfst_search_opts.rescore_lm_scale = FLAGS_rescore_lm_scale;
   decode_config->ctc_prefix_search_opts.first_beam_size = FLAGS_nbest;
   decode_config->ctc_prefix_search_opts.second_beam_size = FLAGS_nbest;
+  decode_config->ctc_prefix_search_opts.blank_skip_thresh =
+      FLAGS_blank_skip_thresh;
+  decode_config->ctc_prefix_search_opts.lm_weight = FLAGS_lm_weight;
+  decode_config->ctc_prefix_search_opts.lm_bonus = FLAGS_lm_bonus;
+  decode_config->ctc_keyword_opts.threshold = FLAGS_keyword_threshold;
+  decode_config->ctc_keyword_opts.min_token_prob = FLAGS_keyword_min_token_prob;
+  decode_config->ctc_keyword_opts.max_token_gap = FLAGS_keyword_max_token_gap;
   return decode_config;
 }
 
-std::shared_ptr<DecodeResource> InitDecodeResourceFromFlags() {
+// The model of the flags, the flags of the paths are the options of the spec
+ModelSpec ModelSpecFromFlags() {
+  ModelSpec spec;
+  spec.name = "default";
+  spec.options = {{"model_path", FLAGS_model_path},
+                  {"onnx_dir", FLAGS_onnx_dir},
+                  {"fst_path", FLAGS_fst_path},
+                  {"token_fst_path", FLAGS_token_fst_path},
+                  {"dict_path", FLAGS_dict_path},
+                  {"unit_path", FLAGS_unit_path},
+                  {"context_path", FLAGS_context_path},
+                  {"context_ac_path", FLAGS_context_ac_path},
+                  {"keyword_path", FLAGS_keyword_path},
+                  {"ngram_lm_path", FLAGS_ngram_lm_path},
+                  {"rescore_lm_path", FLAGS_rescore_lm_path},
+                  {"rescore_old_lm_path", FLAGS_rescore_old_lm_path},
+                  {"itn_fst_path", FLAGS_itn_fst_path},
+                  {"cascade_model_path", FLAGS_cascade_model_path},
+                  {"cascade_onnx_dir", FLAGS_cascade_onnx_dir},
+                  {"language_type", std::to_string(FLAGS_language_type)}};
+  return spec;
+}
+
+// Back the arcs of a const fst, one array in the order of the states, by
+// the huge pages, they're most of the graph
+void AdviseFstHugePages(const fst::Fst<fst::StdArc>& fst) {
+  auto expanded = dynamic_cast<const fst::ExpandedFst<fst::StdArc>*>(&fst);
+  if (fst.Type() != "const" || expanded == nullptr) {
+    LOG(WARNING) << "Only the arcs of a const fst are in the huge pages";
+    return;
+  }
+  const fst::StdArc* begin = nullptr;
+  const fst::StdArc* end = nullptr;
+  for (int s = 0; s < expanded->NumStates(); ++s) {
+    fst::ArcIteratorData<fst::StdArc> data;
+    fst.InitArcIterator(s, &data);
+    if (data.narcs == 0) continue;
+    if (begin == nullptr) begin = data.arcs;
+    end = data.arcs + data.narcs;
+  }
+  if (begin == nullptr ||
+      !AdviseHugePages(begin, sizeof(fst::StdArc) * (end - begin))) {
+    LOG(WARNING) << "Failed to back the arcs by the huge pages";
+  }
+}
+
+// Load the model of spec, the other settings are from the flags. The
+// components of the same paths are shared with the other models by cache,
+// and so are the server wide admission controller and thread placement,
+// nullptr cache means no sharing.
+std::shared_ptr<DecodeResource> InitDecodeResourceFromSpec(
+    const ModelSpec& spec, ResourceCache* cache) {
+  auto shared = [cache](const std::string& key, auto load) {
+    return cache == nullptr ? load() : cache->Get<typename decltype(
+                                           load())::element_type>(key, load);
+  };
   auto resource = std::make_shared<DecodeResource>();
+  if (FLAGS_huge_pages) {
+    MappedFile::set_huge_pages(true);
+#ifndef _WIN32
+    // Read by c10 at the first allocation of the torch tensors
+    setenv("THP_MEM_ALLOC_ENABLE", "1", 0);
+#endif
+  }
+  const std::string onnx_dir = spec.Get("onnx_dir");
+  const std::string model_path = spec.Get("model_path");
+  const std::string fst_path = spec.Get("fst_path");
+  const std::string token_fst_path = spec.Get("token_fst_path");
+  const std::string dict_path = spec.Get("dict_path");
+  const std::string unit_path = spec.Get("unit_path");
+  const std::string context_path = spec.Get("context_path");
+  const std::string context_ac_path = spec.Get("context_ac_path");
+  const std::string keyword_path = spec.Get("keyword_path");
+  const std::string ngram_lm_path = spec.Get("ngram_lm_path");
+  const std::string rescore_lm_path = spec.Get("rescore_lm_path");
+  const std::string rescore_old_lm_path = spec.Get("rescore_old_lm_path");
+  const std::string itn_fst_path = spec.Get("itn_fst_path");
+  const std::string cascade_model_path = spec.Get("cascade_model_path");
+  const std::string cascade_onnx_dir = spec.Get("cascade_onnx_dir");
+  const int language_type = std::stoi(spec.Get("language_type", "0"));
 
-  if (!FLAGS_onnx_dir.empty()) {
-    LOG(INFO) << "Reading onnx model ";
-    auto model = std::make_shared<OnnxAsrModel>();
-    model->Read(FLAGS_onnx_dir, FLAGS_num_onnx_threads);
-    resource->model = model;
-  } else {
-    LOG(INFO) << "Reading torch model " << FLAGS_model_path;
-    TorchAsrModel::InitEngineThreads(FLAGS_num_threads);
-    auto model = std::make_shared<TorchAsrModel>();
-    model->Read(FLAGS_model_path);
-    resource->model = model;
-  }
-
-  std::shared_ptr<fst::Fst<fst::StdArc>> fst = nullptr;
-  if (!FLAGS_fst_path.empty()) {
-    LOG(INFO) << "Reading fst " << FLAGS_fst_path;
-    fst.reset(fst::Fst<fst::StdArc>::Read(FLAGS_fst_path));
-    CHECK(fst != nullptr);
-  }
-  resource->fst = fst;
-
-  LOG(INFO) << "Reading symbol table " << FLAGS_dict_path;
-  auto symbol_table = std::shared_ptr<fst::SymbolTable>(
-      fst::SymbolTable::ReadText(FLAGS_dict_path));
-  resource->symbol_table = symbol_table;
-
-  std::shared_ptr<fst::SymbolTable> unit_table = nullptr;
-  if (!FLAGS_unit_path.empty()) {
-    LOG(INFO) << "Reading unit table " << FLAGS_unit_path;
-    unit_table = std::shared_ptr<fst::SymbolTable>(
-        fst::SymbolTable::ReadText(FLAGS_unit_path));
-    CHECK(unit_table != nullptr);
-  } else if (fst == nullptr) {
+  // Set up and warmed up once, when it's loaded
+  auto prepare = [](AsrModel* model) {
+    model->set_rescoring_buckets(ParseIntList(FLAGS_rescoring_hyp_buckets),
+                                 ParseIntList(FLAGS_rescoring_frame_buckets));
+    if (!FLAGS_warmup) return;
+    // The servers start listening after the resource is initialized, so no
+    // traffic comes before the warmup is done
+    LOG(INFO) << "Warming up model";
+    WarmupOptions warmup_opts;
+    warmup_opts.feature_dim = FLAGS_num_bins;
+    warmup_opts.chunk_sizes =
+        ParseIntListFlag(FLAGS_warmup_chunk_sizes, FLAGS_chunk_size);
+    warmup_opts.num_left_chunks =
+        ParseIntListFlag(FLAGS_warmup_num_left_chunks, FLAGS_num_left_chunks);
+    warmup_opts.nbest_sizes =
+        ParseIntListFlag(FLAGS_warmup_nbest_sizes, FLAGS_nbest);
+    warmup_opts.hyp_length = FLAGS_warmup_hyp_length;
+    warmup_opts.reverse_weight = FLAGS_reverse_weight;
+    model->Warmup(warmup_opts);
+  };
+  // The reads are the steps of the loader, each one sets its own members,
+  // the model pool waits for the model and the context graph for the
+  // symbol table. The cheap components are made after them.
+  Timer timer;
+  StartupLoader loader(FLAGS_startup_threads);
+  // The onnx model of model_dir or the torch one of model_file, shared by
+  // the key of its path
+  auto read_model = [&](const std::string& model_dir,
+                        const std::string& model_file, int ctc_topk,
+                        const std::string& device) {
+    std::shared_ptr<AsrModel> asr_model;
+    if (!model_dir.empty()) {
+#ifdef USE_ONNX
+      std::string onnx_key = "onnx:" + model_dir;
+      if (FLAGS_onnx_quantized) onnx_key += ":quant";
+      asr_model = shared(onnx_key, [&]() {
+        LOG(INFO) << "Reading onnx model " << model_dir;
+        if (FLAGS_onnx_global_threads) {
+          // Once for all the models of the process
+          static std::once_flag engine_once;
+          std::call_once(engine_once, []() {
+            OnnxAsrModel::InitEngineThreads(FLAGS_num_onnx_threads);
+          });
+        }
+        OnnxSessionOptions onnx_opts;
+        onnx_opts.num_threads = FLAGS_num_onnx_threads;
+        SplitStringToVector(FLAGS_onnx_providers, ",", true,
+                            &onnx_opts.providers);
+        onnx_opts.graph_optimization_level = FLAGS_onnx_graph_opt_level;
+        onnx_opts.cpu_mem_arena = FLAGS_onnx_cpu_arena;
+        onnx_opts.quantized = FLAGS_onnx_quantized;
+        onnx_opts.optimized_cache_dir = FLAGS_onnx_optimized_cache_dir;
+        onnx_opts.mmap_weights = FLAGS_mmap_weights;
+        auto model = std::make_shared<OnnxAsrModel>();
+        model->Read(model_dir, onnx_opts);
+        model->set_io_binding(FLAGS_onnx_io_binding);
+        model->set_keep_encoder_out(FLAGS_rescoring_weight != 0.0);
+        prepare(model.get());
+        return std::static_pointer_cast<AsrModel>(model);
+      });
+#else
+      LOG(FATAL) << "onnx_dir " << model_dir << " needs the build with ONNX";
+#endif
+    } else {
+      std::string path = model_file;
+      if (FLAGS_torch_quantized) {
+        path = TorchAsrModel::QuantizedModelPath(model_file);
+        CHECK(std::ifstream(path).good())
+            << "No quantized model " << path << " of " << model_file
+            << ", export it by wenet/bin/export_jit.py --output_quant_file";
+        CHECK(device == "cpu") << "The dynamic int8 models run on cpu only";
+      }
+      std::string key = "torch:" + path + ":" + device +
+                        ":topk=" + std::to_string(ctc_topk);
+      if (FLAGS_torch_freeze) key += ":frozen";
+      asr_model = shared(key, [&]() {
+        LOG(INFO) << "Reading torch model " << path << " on " << device;
+        static std::once_flag engine_once;
+        std::call_once(engine_once, []() {
+          TorchAsrModel::InitEngineThreads(FLAGS_num_threads);
+        });
+        if (FLAGS_torch_quantized) {
+          // The int8 weights are packed for the engine at the load
+          static std::once_flag qengine_once;
+          std::call_once(qengine_once, []() {
+            CHECK(TorchAsrModel::InitQuantizedEngine())
+                << "The libtorch has no quantized engine";
+          });
+        }
+        auto model = std::make_shared<TorchAsrModel>();
+        model->set_mmap_weights(FLAGS_mmap_weights);
+        model->Read(path, device, FLAGS_fp16, FLAGS_torch_freeze);
+        if (FLAGS_thread_budget > 0) {
+          // One budget of the process, whatever the models
+          static auto budget = std::make_shared<ThreadBudget>(
+              FLAGS_thread_budget, FLAGS_max_threads_per_call);
+          model->set_thread_budget(budget);
+        }
+        if (ctc_topk > 0) {
+          model->set_ctc_topk(ctc_topk);
+        }
+        model->set_prefix_tree_rescoring(FLAGS_prefix_tree_rescoring);
+        prepare(model.get());
+        return std::static_pointer_cast<AsrModel>(model);
+      });
+    }
+    return asr_model;
+  };
+  // The wfst search needs the scores of all the tokens
+  const int ctc_topk = FLAGS_ctc_topk > 0 && fst_path.empty() ?
+                       std::max(FLAGS_ctc_topk, FLAGS_nbest) : 0;
+  std::vector<std::string> devices;
+  SplitStringToVector(FLAGS_devices, ",", true, &devices);
+  CHECK(devices.empty() || onnx_dir.empty())
+      << "--devices is of the torch models";
+  if (devices.empty()) devices.push_back(FLAGS_device);
+  loader.Add("model", [&]() {
+    resource->model = read_model(onnx_dir, model_path, ctc_topk, devices[0]);
+  });
+  // The replicas on the other devices are read in parallel
+  std::vector<std::shared_ptr<AsrModel>> replica_models(devices.size());
+  for (size_t i = 1; i < devices.size(); ++i) {
+    loader.Add("model:" + devices[i], [&, i]() {
+      replica_models[i] =
+          read_model(onnx_dir, model_path, ctc_topk, devices[i]);
+    });
+  }
+
+  if (!cascade_onnx_dir.empty() || !cascade_model_path.empty()) {
+    loader.Add("cascade_model", [&]() {
+      // Its ctc outputs are not searched
+      resource->cascade_model =
+          read_model(cascade_onnx_dir, cascade_model_path, 0, devices[0]);
+    });
+  }
+
+  if (FLAGS_model_pool_size > 0) {
+    loader.Add("model_pool", [&]() {
+      LOG(INFO) << "Model state pool of " << FLAGS_model_pool_size;
+      AsrModelPoolOptions pool_opts;
+      pool_opts.initial_size = FLAGS_model_pool_size;
+      pool_opts.max_idle =
+          std::max(FLAGS_model_pool_max_idle, FLAGS_model_pool_size);
+      resource->model_pool =
+          std::make_shared<AsrModelPool>(resource->model, pool_opts);
+    }, {"model"});
+  }
+
+  if (!fst_path.empty()) {
+    loader.Add("fst", [&]() {
+      resource->fst = shared("fst:" + fst_path + ":" + token_fst_path, [&]() {
+        LOG(INFO) << "Reading fst " << fst_path;
+        // Other fst types or an unaligned const fst are still read into
+        // memory
+        fst::FstReadOptions read_opts(fst_path);
+        // The huge pages are of the memory read into, not of the file
+        if (FLAGS_fst_mmap && !FLAGS_huge_pages) {
+          read_opts.mode = fst::FstReadOptions::MAP;
+        }
+        std::ifstream fst_stream(fst_path,
+                                 std::ios_base::in | std::ios_base::binary);
+        CHECK(fst_stream.good()) << "Can't open " << fst_path;
+        std::shared_ptr<fst::Fst<fst::StdArc>> graph(
+            fst::Fst<fst::StdArc>::Read(fst_stream, read_opts));
+        CHECK(graph != nullptr);
+        if (FLAGS_huge_pages) AdviseFstHugePages(*graph);
+        if (!token_fst_path.empty()) {
+          LOG(INFO) << "Reading token fst " << token_fst_path;
+          std::unique_ptr<fst::StdVectorFst> token_fst(
+              fst::StdVectorFst::Read(token_fst_path));
+          CHECK(token_fst != nullptr);
+          fst::ArcSort(token_fst.get(), fst::OLabelCompare<fst::StdArc>());
+          graph.reset(ComposeDecodingGraph(
+              *token_fst, *graph,
+              static_cast<size_t>(FLAGS_fst_cache_size) << 20));
+        }
+        return graph;
+      });
+    });
+  }
+
+  if (!ngram_lm_path.empty()) {
+    loader.Add("ngram_lm", [&]() {
+      resource->ngram_lm = shared("ngram_lm:" + ngram_lm_path, [&]() {
+        LOG(INFO) << "Reading n-gram LM " << ngram_lm_path;
+        std::shared_ptr<NgramLm> ngram_lm = NgramLm::Read(ngram_lm_path);
+        CHECK(ngram_lm != nullptr);
+        return ngram_lm;
+      });
+    });
+  }
+
+  // The LMs of the lattice rescoring are mapped, so they're shared by the
+  // processes of a host too
+  auto read_rescore_lm = [&](const std::string& name, const std::string& path,
+                             std::shared_ptr<NgramLm>* lm) {
+    loader.Add(name, [&, path, lm]() {
+      *lm = shared("ngram_lm:" + path, [&]() {
+        LOG(INFO) << "Reading rescoring LM " << path;
+        std::shared_ptr<NgramLm> ngram_lm = NgramLm::Read(path);
+        CHECK(ngram_lm != nullptr);
+        return ngram_lm;
+      });
+    });
+  };
+  if (!rescore_lm_path.empty()) {
+    CHECK(!fst_path.empty()) << "The lattices are of ctc wfst search";
+    read_rescore_lm("rescore_lm", rescore_lm_path, &resource->rescore_lm);
+    if (!rescore_old_lm_path.empty()) {
+      read_rescore_lm("rescore_old_lm", rescore_old_lm_path,
+                      &resource->rescore_old_lm);
+    }
+  }
+
+  // A text table is parsed into the fst::SymbolTable, a binary one, see
+  // SymbolStrings, is mapped without it. The context tags are reserved.
+  auto read_symbols = [&](const std::string& path,
+                          std::shared_ptr<fst::SymbolTable>* table,
+                          std::shared_ptr<SymbolStrings>* strings) {
+    if (SymbolStrings::IsBinary(path)) {
+      *strings = shared("symbol_strings:" + path, [&]() {
+        LOG(INFO) << "Mapping binary symbol table " << path;
+        std::shared_ptr<SymbolStrings> symbols = SymbolStrings::Read(path);
+        CHECK(symbols != nullptr);
+        return symbols;
+      });
+      return;
+    }
+    *table = shared("symbol_table:" + path, [&]() {
+      LOG(INFO) << "Reading symbol table " << path;
+      auto symbol_table = std::shared_ptr<fst::SymbolTable>(
+          fst::SymbolTable::ReadText(path));
+      CHECK(symbol_table != nullptr);
+      return symbol_table;
+    });
+    *strings = shared("symbol_strings:" + path, [&]() {
+      return std::make_shared<SymbolStrings>(
+          **table, std::vector<std::string>{kContextStartTag, kContextEndTag});
+    });
+  };
+  loader.Add("symbol_table", [&]() {
+    read_symbols(dict_path, &resource->symbol_table,
+                 &resource->symbol_strings);
+  });
+
+  if (!unit_path.empty()) {
+    loader.Add("unit_table", [&]() {
+      read_symbols(unit_path, &resource->unit_table, &resource->unit_strings);
+    });
+  }
+
+  if (!context_path.empty()) {
+    loader.Add("context_graph", [&]() {
+      LOG(INFO) << "Reading context " << context_path;
+      std::vector<std::string> contexts;
+      std::ifstream infile(context_path);
+      std::string context;
+      while (getline(infile, context)) {
+        contexts.emplace_back(Trim(context));
+      }
+      ContextConfig config;
+      config.context_score = FLAGS_context_score;
+      config.use_aho_corasick =
+          FLAGS_context_aho_corasick || !context_ac_path.empty();
+      resource->context_graph = std::make_shared<ContextGraph>(config);
+      resource->context_graph->BuildContextGraph(contexts,
+                                                 resource->symbol_strings);
+      if (!context_ac_path.empty()) {
+        LOG(INFO) << "Writing context automaton " << context_ac_path;
+        CHECK(resource->context_graph->WriteAhoCorasick(context_ac_path));
+      }
+    }, {"symbol_table"});
+  } else if (!context_ac_path.empty()) {
+    loader.Add("context_graph", [&]() {
+      LOG(INFO) << "Reading context automaton " << context_ac_path;
+      ContextConfig config;
+      config.context_score = FLAGS_context_score;
+      config.use_aho_corasick = true;
+      resource->context_graph = std::make_shared<ContextGraph>(config);
+      CHECK(resource->context_graph->ReadAhoCorasick(
+          context_ac_path, resource->symbol_strings));
+    }, {"symbol_table"});
+  }
+
+  if (!keyword_path.empty()) {
+    // The keywords are of the model units, which are the symbols without
+    // --fst_path
+    CHECK(fst_path.empty()) << "--keyword_path is not used with --fst_path";
+    loader.Add("keywords", [&]() {
+      resource->keywords = shared(
+          "keywords:" + keyword_path + ":" + dict_path, [&]() {
+        LOG(INFO) << "Reading keywords " << keyword_path;
+        std::shared_ptr<KeywordSet> keywords = KeywordSet::Read(
+            keyword_path, *resource->symbol_strings, FLAGS_keyword_threshold);
+        CHECK(keywords != nullptr) << "Can't read " << keyword_path;
+        return keywords;
+      });
+    }, {"symbol_table"});
+  }
+
+  loader.Add("post_processor", [&]() {
+    resource->post_processor = shared(
+        "post_processor:" + std::to_string(language_type) + ":" + itn_fst_path,
+        [&]() {
+          PostProcessOptions post_process_opts;
+          post_process_opts.language_type =
+            language_type == 0 ? kMandarinEnglish : kIndoEuropean;
+          post_process_opts.lowercase = FLAGS_lowercase;
+          post_process_opts.itn_cache_size = FLAGS_itn_cache_size;
+          auto post_process_resource = std::make_shared<PostProcessResource>();
+          if (!itn_fst_path.empty()) {
+            LOG(INFO) << "Reading itn fst " << itn_fst_path;
+            fst::FstReadOptions read_opts(itn_fst_path);
+            read_opts.mode = fst::FstReadOptions::MAP;
+            std::ifstream fst_stream(itn_fst_path,
+                                     std::ios_base::in | std::ios_base::binary);
+            CHECK(fst_stream.good()) << "Can't open " << itn_fst_path;
+            std::shared_ptr<fst::Fst<fst::StdArc>> itn_fst(
+                fst::Fst<fst::StdArc>::Read(fst_stream, read_opts));
+            CHECK(itn_fst != nullptr);
+            if (!itn_fst->Properties(fst::kILabelSorted, true)) {
+              LOG(WARNING) << itn_fst_path << " is not sorted by the input "
+                           << "labels, it's sorted in memory";
+              auto sorted = std::make_shared<fst::StdVectorFst>(*itn_fst);
+              fst::ArcSort(sorted.get(), fst::ILabelCompare<fst::StdArc>());
+              itn_fst = sorted;
+            }
+            post_process_resource->itn_fst = itn_fst;
+          }
+          return std::make_shared<PostProcessor>(
+              std::move(post_process_opts), std::move(post_process_resource));
+        });
+  });
+  loader.Run();
+
+  if (unit_path.empty() && resource->fst == nullptr) {
     LOG(INFO) << "Use symbol table as unit table";
-    unit_table = symbol_table;
+    resource->unit_table = resource->symbol_table;
+    resource->unit_strings = resource->symbol_strings;
+  }
+
+  // The batches are of the sessions of one model
+  if (FLAGS_max_batch_size > 1) {
+    LOG(INFO) << "Batch encoder forward, max batch size "
+              << FLAGS_max_batch_size;
+    BatchEncoderOptions batch_opts;
+    batch_opts.max_batch_size = FLAGS_max_batch_size;
+    batch_opts.max_wait_us = FLAGS_max_batch_wait_us;
+    resource->encoder_scheduler =
+        std::make_shared<BatchEncoderScheduler>(batch_opts);
+  }
+
+  if (!FLAGS_adaptive_chunk_sizes.empty()) {
+    CHECK(resource->encoder_scheduler != nullptr)
+        << "adaptive_chunk_sizes requires max_batch_size > 1";
+    LOG(INFO) << "Adaptive chunk sizes " << FLAGS_adaptive_chunk_sizes;
+    AdaptiveChunkOptions chunk_opts;
+    chunk_opts.chunk_sizes =
+        ParseIntListFlag(FLAGS_adaptive_chunk_sizes, FLAGS_chunk_size);
+    chunk_opts.high_load = FLAGS_adaptive_high_load;
+    chunk_opts.low_load = FLAGS_adaptive_low_load;
+    resource->chunk_policy = std::make_shared<AdaptiveChunkPolicy>(chunk_opts);
   }
-  resource->unit_table = unit_table;
 
-  if (!FLAGS_context_path.empty()) {
-    LOG(INFO) << "Reading context " << FLAGS_context_path;
-    std::vector<std::string> contexts;
-    std::ifstream infile(FLAGS_context_path);
-    std::string context;
-    while (getline(infile, context)) {
-      contexts.emplace_back(Trim(context));
+  if (!FLAGS_adaptive_beam_scales.empty()) {
+    // Shared by the models, it's the load of the host
+    resource->beam_policy = shared("beam_policy", []() {
+      LOG(INFO) << "Adaptive beam scales " << FLAGS_adaptive_beam_scales;
+      AdaptiveBeamOptions beam_opts;
+      std::vector<std::string> scales;
+      SplitStringToVector(FLAGS_adaptive_beam_scales, ",", true, &scales);
+      beam_opts.beam_scales.clear();
+      for (const std::string& scale : scales) {
+        beam_opts.beam_scales.push_back(std::stof(scale));
+      }
+      beam_opts.high_rtf = FLAGS_adaptive_beam_high_rtf;
+      beam_opts.low_rtf = FLAGS_adaptive_beam_low_rtf;
+      beam_opts.interval_ms = FLAGS_adaptive_beam_interval_ms;
+      return std::make_shared<AdaptiveBeamPolicy>(beam_opts);
+    });
+  }
+
+  if (FLAGS_rescoring_workers > 0) {
+    LOG(INFO) << "Batch attention rescoring, " << FLAGS_rescoring_workers
+              << " workers, max batch size " << FLAGS_max_rescoring_batch_size;
+    BatchRescoringOptions rescoring_opts;
+    rescoring_opts.num_workers = FLAGS_rescoring_workers;
+    rescoring_opts.max_batch_size = FLAGS_max_rescoring_batch_size;
+    rescoring_opts.max_wait_us = FLAGS_max_rescoring_wait_us;
+    resource->rescoring_scheduler =
+        std::make_shared<BatchRescoringScheduler>(rescoring_opts);
+    if (resource->cascade_model != nullptr) {
+      resource->cascade_rescoring_scheduler =
+          std::make_shared<BatchRescoringScheduler>(rescoring_opts);
     }
+  }
+
+  if (FLAGS_numa_pinning) {
+    resource->thread_placement = shared("thread_placement", []() {
+      ThreadPlacementOptions placement_opts;
+      if (!FLAGS_numa_nodes.empty()) {
+        placement_opts.nodes = ParseIntListFlag(FLAGS_numa_nodes, 0);
+      }
+      return std::make_shared<ThreadPlacement>(placement_opts);
+    });
+  }
+
+  if (FLAGS_max_load > 0) {
+    resource->admission_controller = shared("admission_controller", []() {
+      LOG(INFO) << "Admission control, max load " << FLAGS_max_load
+                << ", max degraded load " << FLAGS_max_degraded_load;
+      AdmissionOptions admission_opts;
+      admission_opts.max_load = FLAGS_max_load;
+      admission_opts.max_degraded_load = FLAGS_max_degraded_load;
+      return std::make_shared<AdmissionController>(admission_opts);
+    });
+  }
+
+  if (FLAGS_pipeline_threads > 0) {
+    resource->pipeline_pool = shared("pipeline_pool", [&]() {
+      LOG(INFO) << "Pipelined encoder forward, " << FLAGS_pipeline_threads
+                << " threads";
+      return std::make_shared<ThreadPool>(FLAGS_pipeline_threads,
+                                          resource->thread_placement);
+    });
+  }
+
+  if (FLAGS_context_cache_size > 0) {
     ContextConfig config;
     config.context_score = FLAGS_context_score;
-    resource->context_graph = std::make_shared<ContextGraph>(config);
-    resource->context_graph->BuildContextGraph(contexts, symbol_table);
+    resource->context_graph_cache = std::make_shared<ContextGraphCache>(
+        config, resource->symbol_strings, FLAGS_context_cache_size);
+  }
+  if (FLAGS_result_cache_mb > 0) {
+    resource->result_cache = std::make_shared<ResultCache>(
+        static_cast<size_t>(FLAGS_result_cache_mb) << 20);
   }
 
-  PostProcessOptions post_process_opts;
-  post_process_opts.language_type =
-    FLAGS_language_type == 0 ? kMandarinEnglish : kIndoEuropean;
-  post_process_opts.lowercase = FLAGS_lowercase;
-  resource->post_processor =
-    std::make_shared<PostProcessor>(std::move(post_process_opts));
+  if (devices.size() > 1) {
+    // The replicas share all but the model and the ones batching it
+    std::vector<std::shared_ptr<DecodeResource>> replicas;
+    replicas.push_back(std::make_shared<DecodeResource>(*resource));
+    for (size_t i = 1; i < devices.size(); ++i) {
+      auto replica = std::make_shared<DecodeResource>(*resource);
+      replica->model = replica_models[i];
+      if (resource->model_pool != nullptr) {
+        AsrModelPoolOptions pool_opts;
+        pool_opts.initial_size = FLAGS_model_pool_size;
+        pool_opts.max_idle =
+            std::max(FLAGS_model_pool_max_idle, FLAGS_model_pool_size);
+        replica->model_pool =
+            std::make_shared<AsrModelPool>(replica->model, pool_opts);
+      }
+      if (resource->encoder_scheduler != nullptr) {
+        BatchEncoderOptions batch_opts;
+        batch_opts.max_batch_size = FLAGS_max_batch_size;
+        batch_opts.max_wait_us = FLAGS_max_batch_wait_us;
+        replica->encoder_scheduler =
+            std::make_shared<BatchEncoderScheduler>(batch_opts);
+      }
+      if (resource->rescoring_scheduler != nullptr) {
+        BatchRescoringOptions rescoring_opts;
+        rescoring_opts.num_workers = FLAGS_rescoring_workers;
+        rescoring_opts.max_batch_size = FLAGS_max_rescoring_batch_size;
+        rescoring_opts.max_wait_us = FLAGS_max_rescoring_wait_us;
+        replica->rescoring_scheduler =
+            std::make_shared<BatchRescoringScheduler>(rescoring_opts);
+      }
+      replicas.push_back(replica);
+    }
+    resource->replicas = std::make_shared<DeviceReplicas>(devices, replicas);
+    resource->replicas->SetMetrics();
+    LOG(INFO) << "Model replicas on " << FLAGS_devices;
+  }
+  LOG(INFO) << "Model " << spec.name << " is ready in " << timer.Elapsed()
+            << " ms";
+  MemoryStats memory_stats;
+  if (ReadMemoryStats(&memory_stats)) {
+    LOG(INFO) << "Memory: " << MemoryStatsString(memory_stats);
+  }
   return resource;
 }
 
+std::shared_ptr<DecodeResource> InitDecodeResourceFromFlags() {
+  return InitDecodeResourceFromSpec(ModelSpecFromFlags(), nullptr);
+}
+
+// The models of --model_manifest, nullptr if it's not set
+std::shared_ptr<ModelRegistry> InitModelRegistryFromFlags() {
+  if (FLAGS_model_manifest.empty()) return nullptr;
+  auto registry =
+      std::make_shared<ModelRegistry>(&InitDecodeResourceFromSpec);
+  CHECK(registry->LoadManifest(FLAGS_model_manifest));
+  if (FLAGS_model_manifest_reload_s > 0) {
+    registry->Watch(FLAGS_model_manifest, FLAGS_model_manifest_reload_s);
+  }
+  return registry;
+}
+
+// The pool of the sessions of the servers, nullptr if it's disabled
+std::shared_ptr<AsrDecoderPool> InitDecoderPoolFromFlags(
+    std::shared_ptr<FeaturePipelineConfig> feature_config,
+    std::shared_ptr<DecodeOptions> decode_config,
+    std::shared_ptr<DecodeResource> resource) {
+  if (FLAGS_decoder_pool_size <= 0) return nullptr;
+  LOG(INFO) << "Decoder pool of " << FLAGS_decoder_pool_size;
+  AsrDecoderPoolOptions pool_opts;
+  pool_opts.initial_size = FLAGS_decoder_pool_size;
+  pool_opts.max_idle =
+      std::max(FLAGS_decoder_pool_max_idle, FLAGS_decoder_pool_size);
+  return std::make_shared<AsrDecoderPool>(
+      std::move(feature_config), std::move(decode_config),
+      std::move(resource), pool_opts);
+}
+
 }  // namespace wenet
 
 #endif  // DECODER_PARAMS_H_
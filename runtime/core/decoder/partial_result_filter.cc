@@ -0,0 +1,58 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/partial_result_filter.h"
+
+#include <vector>
+
+#include "utils/string.h"
+
+namespace wenet {
+
+bool PartialResultFilter::Filter(const std::string& sentence, int64_t now_ms,
+                                 int* num_stable, std::string* suffix) {
+  if (opts_.changed_only && last_sent_ms_ >= 0 &&
+      sentence == last_sentence_) {
+    return false;
+  }
+  if (opts_.min_interval_ms > 0 && last_sent_ms_ >= 0 &&
+      now_ms - last_sent_ms_ < opts_.min_interval_ms) {
+    return false;
+  }
+  if (opts_.incremental) {
+    std::vector<std::string> last_chars, chars;
+    SplitUTF8StringToChars(last_sentence_, &last_chars);
+    SplitUTF8StringToChars(sentence, &chars);
+    size_t i = 0;
+    while (i < last_chars.size() && i < chars.size() &&
+           last_chars[i] == chars[i]) {
+      ++i;
+    }
+    *num_stable = i;
+    suffix->clear();
+    for (; i < chars.size(); ++i) {
+      suffix->append(chars[i]);
+    }
+  }
+  last_sent_ms_ = now_ms;
+  last_sentence_ = sentence;
+  return true;
+}
+
+void PartialResultFilter::Reset() {
+  last_sent_ms_ = -1;
+  last_sentence_.clear();
+}
+
+}  // namespace wenet
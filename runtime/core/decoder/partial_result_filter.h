@@ -0,0 +1,68 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_PARTIAL_RESULT_FILTER_H_
+#define DECODER_PARTIAL_RESULT_FILTER_H_
+
+#include <cstdint>
+#include <string>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct PartialResultOptions {
+  // At least min_interval_ms between two partial results, 0 means a partial
+  // result after every decoded chunk
+  int min_interval_ms = 0;
+  // Skip the partial results whose 1-best sentence is the same as the last
+  // sent one
+  bool changed_only = false;
+  // Send the 1-best only, as the number of the leading chars kept from the
+  // last sent sentence and the changed suffix
+  bool incremental = false;
+};
+
+// PartialResultFilter decides which partial results of a session are sent,
+// before they are serialized. It is not thread safe, each session has its
+// own.
+class PartialResultFilter {
+ public:
+  explicit PartialResultFilter(const PartialResultOptions& opts)
+      : opts_(opts) {}
+
+  // Return true if the partial result with the 1-best `sentence` decoded
+  // at now_ms is to be sent. In incremental mode the sentence is sent as
+  // the first num_stable UTF-8 chars of the last sent sentence followed by
+  // suffix.
+  bool Filter(const std::string& sentence, int64_t now_ms, int* num_stable,
+              std::string* suffix);
+  // On a final result, the next partial result is compared with nothing
+  void Reset();
+
+  const PartialResultOptions& options() const { return opts_; }
+
+ private:
+  const PartialResultOptions opts_;
+  // -1 means no partial result is sent since the last final result
+  int64_t last_sent_ms_ = -1;
+  std::string last_sentence_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(PartialResultFilter);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_PARTIAL_RESULT_FILTER_H_
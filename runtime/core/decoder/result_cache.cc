@@ -0,0 +1,115 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/result_cache.h"
+
+#include <cstring>
+#include <iterator>
+
+#include "decoder/decode_metrics.h"
+#include "utils/log.h"
+
+namespace wenet {
+
+ResultCache::ResultCache(size_t max_bytes) : max_bytes_(max_bytes) {
+  CHECK_GT(max_bytes_, 0);
+}
+
+static inline uint64_t Mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// 8 bytes a step, so an hour of 16 kHz PCM hashes in a few milliseconds
+uint64_t ResultCache::Hash(const void* data, size_t size, uint64_t seed) {
+  const uint64_t kMul = 0x9e3779b97f4a7c15ULL;
+  const char* p = static_cast<const char*>(data);
+  uint64_t h = Mix(seed ^ (size * kMul));
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, p + i, sizeof(word));
+    h = (h ^ Mix(word)) * kMul;
+  }
+  if (i < size) {
+    uint64_t word = 0;
+    memcpy(&word, p + i, size - i);
+    h = (h ^ Mix(word)) * kMul;
+  }
+  return Mix(h);
+}
+
+uint64_t ResultCache::Key(const int16_t* pcm, size_t num_samples,
+                          int sample_rate, uint64_t fingerprint) {
+  uint64_t seed = Hash(&sample_rate, sizeof(sample_rate), fingerprint);
+  return Hash(pcm, num_samples * sizeof(int16_t), seed);
+}
+
+size_t ResultCache::ResultBytes(const std::vector<DecodeResult>& result) {
+  size_t bytes = sizeof(Entry) + result.size() * sizeof(DecodeResult);
+  for (const auto& path : result) {
+    bytes += path.sentence.capacity() +
+             path.word_pieces.size() * sizeof(WordPiece);
+    for (const auto& piece : path.word_pieces) {
+      bytes += piece.word.capacity();
+    }
+  }
+  return bytes;
+}
+
+bool ResultCache::Lookup(uint64_t key, std::vector<DecodeResult>* result) {
+  DecodeMetrics* metrics = DecodeMetrics::Get();
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    metrics->result_cache_misses->Add(1);
+    return false;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second);
+  *result = it->second->result;
+  metrics->result_cache_hits->Add(1);
+  return true;
+}
+
+void ResultCache::Insert(uint64_t key,
+                         const std::vector<DecodeResult>& result) {
+  Entry entry;
+  entry.key = key;
+  entry.result = result;
+  entry.bytes = ResultBytes(result);
+  if (entry.bytes > max_bytes_) return;
+  DecodeMetrics* metrics = DecodeMetrics::Get();
+  // Destroyed after the lock is released
+  LruList evicted;
+  std::lock_guard<std::mutex> lock(mutex_);
+  // The same audio decoded by two requests at once
+  if (entries_.count(key) > 0) return;
+  lru_.push_front(std::move(entry));
+  entries_[key] = lru_.begin();
+  bytes_ += lru_.front().bytes;
+  metrics->result_cache_bytes->Add(lru_.front().bytes);
+  while (bytes_ > max_bytes_) {
+    auto last = std::prev(lru_.end());
+    bytes_ -= last->bytes;
+    metrics->result_cache_bytes->Add(-static_cast<int64_t>(last->bytes));
+    entries_.erase(last->key);
+    evicted.splice(evicted.begin(), lru_, last);
+  }
+}
+
+}  // namespace wenet
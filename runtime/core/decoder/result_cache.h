@@ -0,0 +1,85 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_RESULT_CACHE_H_
+#define DECODER_RESULT_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "decoder/asr_decoder.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// ResultCache keeps the final results of the recently decoded audios, so
+// the identical ones, e.g. the recorded prompts played back into the IVR
+// or the retries of the same upload, are not decoded again. The audios are
+// keyed by a 64 bits hash of their PCM and the fingerprint of the model and
+// the options which decoded them, the PCM itself is not kept. The entries
+// are evicted least recently used first to keep the bytes of the results
+// under max_bytes. It is thread safe and can be shared by all the offline
+// requests of a server.
+class ResultCache {
+ public:
+  explicit ResultCache(size_t max_bytes);
+
+  // A fast hash of data, seeded by seed, e.g. to chain the PCM after the
+  // fingerprint of the options
+  static uint64_t Hash(const void* data, size_t size, uint64_t seed = 0);
+  static uint64_t Key(const int16_t* pcm, size_t num_samples, int sample_rate,
+                      uint64_t fingerprint);
+
+  // Return false if the audio of key is not cached
+  bool Lookup(uint64_t key, std::vector<DecodeResult>* result);
+  void Insert(uint64_t key, const std::vector<DecodeResult>& result);
+
+  int size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+  }
+  size_t bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+
+ private:
+  struct Entry {
+    uint64_t key;
+    std::vector<DecodeResult> result;
+    size_t bytes;
+  };
+  // The most recently used one is at the front
+  using LruList = std::list<Entry>;
+
+  static size_t ResultBytes(const std::vector<DecodeResult>& result);
+
+  const size_t max_bytes_;
+  mutable std::mutex mutex_;
+  LruList lru_;
+  std::unordered_map<uint64_t, LruList::iterator> entries_;
+  size_t bytes_ = 0;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(ResultCache);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_RESULT_CACHE_H_
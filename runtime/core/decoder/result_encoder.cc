@@ -0,0 +1,127 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/result_encoder.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace wenet {
+
+// The protobuf wire types
+static const int kVarint = 0;
+static const int kLengthDelimited = 2;
+static const int kFixed32 = 5;
+
+// The field numbers of wenet.proto
+static const int kResponseType = 2;
+static const int kResponseNbest = 3;
+static const int kResponseNumStable = 4;
+static const int kResponseSuffix = 5;
+static const int kResponseLattice = 6;
+static const int kOneBestSentence = 1;
+static const int kOneBestWordpieces = 2;
+static const int kOnePieceWord = 1;
+static const int kOnePieceStart = 2;
+static const int kOnePieceEnd = 3;
+static const int kOnePieceMaxConfidence = 4;
+static const int kOnePieceMeanConfidence = 5;
+static const int kOnePieceMinConfidence = 6;
+
+static void PutVarint(uint64_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+static void PutTag(int field, int wire_type, std::string* out) {
+  PutVarint(static_cast<uint64_t>(field << 3 | wire_type), out);
+}
+
+// The default values are not written, as protobuf does for proto3. The
+// negative int32 is sign extended to 64 bits.
+static void PutInt32(int field, int value, std::string* out) {
+  if (value == 0) return;
+  PutTag(field, kVarint, out);
+  PutVarint(static_cast<uint64_t>(static_cast<int64_t>(value)), out);
+}
+
+static void PutFloat(int field, float value, std::string* out) {
+  if (value == 0) return;
+  PutTag(field, kFixed32, out);
+  uint32_t bits = 0;
+  memcpy(&bits, &value, sizeof(bits));
+  // Little endian as the wire format
+  for (int i = 0; i < 4; ++i) {
+    out->push_back(static_cast<char>(bits >> (8 * i)));
+  }
+}
+
+static void PutBytes(int field, const std::string& value, std::string* out) {
+  if (value.empty()) return;
+  PutTag(field, kLengthDelimited, out);
+  PutVarint(value.size(), out);
+  out->append(value);
+}
+
+// The embedded messages are written even if they are empty
+static void PutMessage(int field, const std::string& value,
+                       std::string* out) {
+  PutTag(field, kLengthDelimited, out);
+  PutVarint(value.size(), out);
+  out->append(value);
+}
+
+void EncodeResult(ResultType type, const std::vector<DecodeResult>& results,
+                  int nbest, bool word_pieces, std::string* out) {
+  out->clear();
+  PutInt32(kResponseType, static_cast<int>(type), out);
+  std::string one_best, one_piece;
+  for (int i = 0; i < nbest && i < static_cast<int>(results.size()); ++i) {
+    one_best.clear();
+    PutBytes(kOneBestSentence, results[i].sentence, &one_best);
+    if (word_pieces) {
+      for (const WordPiece& word_piece : results[i].word_pieces) {
+        one_piece.clear();
+        PutBytes(kOnePieceWord, word_piece.word, &one_piece);
+        PutInt32(kOnePieceStart, word_piece.start, &one_piece);
+        PutInt32(kOnePieceEnd, word_piece.end, &one_piece);
+        PutFloat(kOnePieceMaxConfidence, word_piece.confidence.max,
+                 &one_piece);
+        PutFloat(kOnePieceMeanConfidence, word_piece.confidence.mean,
+                 &one_piece);
+        PutFloat(kOnePieceMinConfidence, word_piece.confidence.min,
+                 &one_piece);
+        PutMessage(kOneBestWordpieces, one_piece, &one_best);
+      }
+    }
+    PutMessage(kResponseNbest, one_best, out);
+  }
+}
+
+void EncodeIncrementalResult(int num_stable, const std::string& suffix,
+                             std::string* out) {
+  out->clear();
+  PutInt32(kResponseType, static_cast<int>(ResultType::kPartialResult), out);
+  PutInt32(kResponseNumStable, num_stable, out);
+  PutBytes(kResponseSuffix, suffix, out);
+}
+
+void AppendLattice(const std::string& lattice, std::string* out) {
+  PutBytes(kResponseLattice, lattice, out);
+}
+
+}  // namespace wenet
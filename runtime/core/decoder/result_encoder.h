@@ -0,0 +1,55 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_RESULT_ENCODER_H_
+#define DECODER_RESULT_ENCODER_H_
+
+#include <string>
+#include <vector>
+
+#include "decoder/asr_decoder.h"
+
+namespace wenet {
+
+// The same values as Response.Type of grpc/wenet.proto
+enum class ResultType {
+  kServerReady = 0,
+  kPartialResult = 1,
+  kFinalResult = 2,
+  kSpeechEnd = 3,
+  kFinalCtcResult = 4,
+};
+
+// The compact binary result encoding, the Response message of
+// grpc/wenet.proto in the protobuf wire format, so the clients decode it
+// with the generated code of wenet.proto. It's written by hand here, the
+// servers and the C API don't depend on protobuf unless gRPC is built.
+
+// Encode the top nbest of results as a Response with status ok, the word
+// pieces are included if word_pieces is true.
+void EncodeResult(ResultType type, const std::vector<DecodeResult>& results,
+                  int nbest, bool word_pieces, std::string* out);
+
+// Encode an incremental partial result, see PartialResultFilter, as a
+// Response with num_stable and suffix.
+void EncodeIncrementalResult(int num_stable, const std::string& suffix,
+                             std::string* out);
+
+// Append the lattice field of Response to an encoded result, see
+// AsrDecoder::lattice(). Nothing is appended for an empty lattice.
+void AppendLattice(const std::string& lattice, std::string* out);
+
+}  // namespace wenet
+
+#endif  // DECODER_RESULT_ENCODER_H_
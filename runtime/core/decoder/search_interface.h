@@ -4,21 +4,54 @@
 #ifndef DECODER_SEARCH_INTERFACE_H_
 #define DECODER_SEARCH_INTERFACE_H_
 
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utils/matrix.h"
+#include "utils/sparse_log_prob_matrix.h"
+
 namespace wenet {
 
-#include <vector>
+class ContextGraph;
+class StateReader;
+class StateWriter;
 
 enum SearchType {
   kPrefixBeamSearch = 0x00,
   kWfstBeamSearch = 0x01,
+  kKeywordSpotting = 0x02,
+};
+
+// The posteriors of a token over the frames of the viterbi path it spans,
+// i.e. the frames of its peak and repeats, the blank frames are not counted
+struct TokenConfidence {
+  float max = 0;
+  float mean = 0;
+  float min = 0;
 };
 
 class SearchInterface {
  public:
   virtual ~SearchInterface() {}
-  virtual void Search(const std::vector<std::vector<float>>& logp) = 0;
+  virtual void Search(const LogProbMatrix& logp) = 0;
+  // Convenient wrapper of the above for the callers which use nested vectors
+  void Search(const std::vector<std::vector<float>>& logp) {
+    Search(LogProbMatrix(logp));
+  }
+  // The log probs pruned by the model, see SparseLogProbMatrix. By default
+  // they're scattered to the dense ones, the searches which only read the
+  // top tokens of a frame override it.
+  virtual void Search(const SparseLogProbMatrix& logp) {
+    logp.ToDense(&dense_logp_);
+    Search(dense_logp_);
+  }
   virtual void Reset() = 0;
   virtual void FinalizeSearch() = 0;
+  // Replace the context graph, nullptr disables the context biasing. It's
+  // only called right after Reset(), when no hypothesis has a context state
+  virtual void set_context_graph(
+      const std::shared_ptr<ContextGraph>& context_graph) = 0;
 
   virtual SearchType Type() const = 0;
   // N-best inputs id
@@ -29,6 +62,37 @@ class SearchInterface {
   virtual const std::vector<float>& Likelihood() const = 0;
   // N-best timestamp
   virtual const std::vector<std::vector<int>>& Times() const = 0;
+  // N-best confidences of the inputs, empty if the search doesn't track
+  // them. They come from the CTC posteriors along the best paths, so
+  // they're much cheaper than the lattice posteriors.
+  virtual const std::vector<std::vector<TokenConfidence>>& Confidences()
+      const {
+    static const std::vector<std::vector<TokenConfidence>> empty;
+    return empty;
+  }
+  // The word lattice of the last FinalizeSearch(), a CompactLattice in the
+  // Kaldi binary format, empty if the search doesn't output lattices
+  virtual const std::string& Lattice() const {
+    static const std::string empty;
+    return empty;
+  }
+  // Bytes held by the search state, e.g. the prefixes or the tokens, for the
+  // memory accounting of the sessions
+  virtual size_t MemoryBytes() const { return 0; }
+  // Number of the live hypotheses, the prefixes or the tokens
+  virtual int NumHypotheses() const { return 0; }
+  // Scale the beams of the following frames, e.g. 0.5 to bound the memory
+  // of a session, 1 restores the options
+  virtual void set_beam_scale(float scale) {}
+  // The hypotheses of the sentence so far, so a search of the same options,
+  // context graph and LM continues it after RestoreState(), see
+  // AsrDecoder::SaveState(). Return false if the search doesn't support it.
+  virtual bool SaveState(StateWriter* writer) const { return false; }
+  virtual bool RestoreState(StateReader* reader) { return false; }
+
+ private:
+  // The buffer of the default Search() of the pruned log probs
+  LogProbMatrix dense_logp_;
 };
 
 }  // namespace wenet
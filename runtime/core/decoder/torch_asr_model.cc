@@ -5,30 +5,116 @@
 #include "decoder/torch_asr_model.h"
 
 #include <algorithm>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <numeric>
 #include <memory>
+#include <tuple>
 #include <utility>
 
 #include "torch/script.h"
 #include "torch/torch.h"
 
+#include "decoder/torch_mapped_weights.h"
+#include "utils/state_io.h"
+#include "utils/timer.h"
+
 namespace wenet {
 
-void TorchAsrModel::InitEngineThreads(int num_threads) {
+void TorchAsrModel::InitEngineThreads(int num_threads,
+                                      int num_interop_threads) {
   // For multi-thread performance
   at::set_num_threads(num_threads);
   // Note: Do not call the set_num_interop_threads function more than once.
   // Please see https://github.com/pytorch/pytorch/blob/master/aten/src/ATen/
   // ParallelThreadPoolNative.cpp#L54-L56
-  at::set_num_interop_threads(1);
+  at::set_num_interop_threads(num_interop_threads);
   VLOG(1) << "Num intra-op threads: " << at::get_num_threads();
   VLOG(1) << "Num inter-op threads: " << at::get_num_interop_threads();
 }
 
+// Set the intra-op threads of the calling thread to the ones granted by the
+// budget in its scope, and restore them. With OpenMP the threads are the
+// nthreads-var of the calling thread, so the sessions don't see the
+// settings of each other. The nested scopes, e.g. ForwardEncoder() of the
+// sessions which can't be batched by ForwardEncoderBatch(), keep the grant
+// of the outermost one.
+class ScopedIntraOpThreads {
+ public:
+  explicit ScopedIntraOpThreads(ThreadBudget* budget) {
+#if AT_PARALLEL_OPENMP
+    if (budget == nullptr || in_scope_) return;
+    lease_.reset(new ThreadBudget::Lease(budget->Acquire()));
+    in_scope_ = true;
+    saved_threads_ = at::get_num_threads();
+    at::set_num_threads(lease_->threads());
+#endif
+  }
+  ~ScopedIntraOpThreads() {
+    if (lease_ != nullptr) {
+      at::set_num_threads(saved_threads_);
+      in_scope_ = false;
+    }
+  }
+
+ private:
+  static thread_local bool in_scope_;
+  std::unique_ptr<ThreadBudget::Lease> lease_;
+  int saved_threads_ = 1;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(ScopedIntraOpThreads);
+};
+
+thread_local bool ScopedIntraOpThreads::in_scope_ = false;
+
+std::string TorchAsrModel::QuantizedModelPath(const std::string& model_path) {
+  size_t dot = model_path.rfind('.');
+  size_t slash = model_path.find_last_of("/\\");
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    return model_path + "_quant";
+  }
+  return model_path.substr(0, dot) + "_quant" + model_path.substr(dot);
+}
+
+bool TorchAsrModel::InitQuantizedEngine() {
+  const auto& engines = at::globalContext().supportedQEngines();
+  for (auto engine : {at::QEngine::FBGEMM, at::QEngine::QNNPACK}) {
+    if (std::find(engines.begin(), engines.end(), engine) != engines.end()) {
+      at::globalContext().setQEngine(engine);
+      VLOG(1) << "Quantized engine: " << static_cast<int>(engine);
+      return true;
+    }
+  }
+  return false;
+}
+
 void TorchAsrModel::Read(const std::string& model_path) {
-  torch::jit::script::Module model = torch::jit::load(model_path);
+  Read(model_path, "cpu", false);
+}
+
+void TorchAsrModel::Read(const std::string& model_path,
+                         const std::string& device, bool fp16, bool freeze) {
+  device_ = torch::Device(device);
+  if (device_.is_cuda()) {
+    CHECK(torch::cuda::is_available()) << "CUDA is not available";
+  }
+  fp16_ = fp16;
+  CHECK(!fp16_ || device_.is_cuda()) << "fp16 is only supported on cuda";
+  Timer timer;
+  torch::jit::script::Module model = torch::jit::load(model_path, device_);
   model_ = std::make_shared<TorchModule>(std::move(model));
   torch::NoGradGuard no_grad;
   model_->eval();
+  if (mmap_weights_ && device_.is_cpu()) {
+    MapTorchWeights(model_path, model_.get());
+  }
+  if (fp16_) {
+    model_->to(torch::kHalf);
+  }
+  LOG(INFO) << "Loaded torch model " << model_path << " in "
+            << timer.Elapsed() << " ms";
   torch::jit::IValue o1 = model_->run_method("subsampling_rate");
   CHECK_EQ(o1.isInt(), true);
   subsampling_rate_ = o1.toInt();
@@ -44,6 +130,62 @@ void TorchAsrModel::Read(const std::string& model_path) {
   torch::jit::IValue o5 = model_->run_method("is_bidirectional_decoder");
   CHECK_EQ(o5.isBool(), true);
   is_bidirectional_decoder_ = o5.toBool();
+  has_conv_cache_method_ =
+      model_->find_method("forward_encoder_chunk_conv_cache").has_value();
+  has_batch_method_ =
+      model_->find_method("forward_encoder_chunk_batch").has_value();
+  has_batch_rescoring_method_ =
+      model_->find_method("forward_attention_decoder_batch").has_value();
+  has_utterance_batch_method_ =
+      model_->find_method("forward_encoder_batch").has_value();
+  has_prefix_rescoring_method_ =
+      model_->find_method("forward_attention_decoder_prefix").has_value();
+
+  if (freeze) {
+    // The metadata methods are read above, only the inference ones are
+    // kept by the frozen module
+    std::vector<std::string> methods = {"forward_encoder_chunk",
+                                        "ctc_activation",
+                                        "forward_attention_decoder"};
+    if (has_conv_cache_method_) {
+      methods.push_back("forward_encoder_chunk_conv_cache");
+    }
+    if (has_batch_method_) methods.push_back("forward_encoder_chunk_batch");
+    if (has_utterance_batch_method_) {
+      methods.push_back("forward_encoder_batch");
+    }
+    if (has_batch_rescoring_method_) {
+      methods.push_back("forward_attention_decoder_batch");
+    }
+    if (has_prefix_rescoring_method_) {
+      methods.push_back("forward_attention_decoder_prefix");
+    }
+    timer.Reset();
+    TorchModule frozen = torch::jit::freeze(*model_, methods);
+    frozen = torch::jit::optimize_for_inference(frozen, methods);
+    model_ = std::make_shared<TorchModule>(std::move(frozen));
+    LOG(INFO) << "Froze and optimized " << methods.size()
+              << " methods of the torch model in " << timer.Elapsed()
+              << " ms";
+  }
+  auto methods = std::make_shared<Methods>();
+  methods->forward_encoder_chunk = model_->find_method("forward_encoder_chunk");
+  methods->ctc_activation = model_->find_method("ctc_activation");
+  methods->forward_attention_decoder =
+      model_->find_method("forward_attention_decoder");
+  CHECK(methods->forward_encoder_chunk.has_value() &&
+        methods->ctc_activation.has_value() &&
+        methods->forward_attention_decoder.has_value());
+  methods->forward_encoder_chunk_conv_cache =
+      model_->find_method("forward_encoder_chunk_conv_cache");
+  methods->forward_encoder_chunk_batch =
+      model_->find_method("forward_encoder_chunk_batch");
+  methods->forward_encoder_batch = model_->find_method("forward_encoder_batch");
+  methods->forward_attention_decoder_batch =
+      model_->find_method("forward_attention_decoder_batch");
+  methods->forward_attention_decoder_prefix =
+      model_->find_method("forward_attention_decoder_prefix");
+  methods_ = methods;
 
   VLOG(1) << "Torch Model Info:";
   VLOG(1) << "\tsubsampling_rate " << subsampling_rate_;
@@ -51,6 +193,11 @@ void TorchAsrModel::Read(const std::string& model_path) {
   VLOG(1) << "\tsos " << sos_;
   VLOG(1) << "\teos " << eos_;
   VLOG(1) << "\tis bidirectional decoder " << is_bidirectional_decoder_;
+  VLOG(1) << "\tconv cache of subsampling " << has_conv_cache_method_;
+  VLOG(1) << "\tbatched chunk forward " << has_batch_method_;
+  VLOG(1) << "\tdevice " << device_ << (fp16_ ? " fp16" : "")
+          << (freeze ? " frozen" : "");
+  Reset();
 }
 
 TorchAsrModel::TorchAsrModel(const TorchAsrModel& other) {
@@ -63,11 +210,25 @@ TorchAsrModel::TorchAsrModel(const TorchAsrModel& other) {
   chunk_size_ = other.chunk_size_;
   num_left_chunks_ = other.num_left_chunks_;
   offset_ = other.offset_;
+  rescoring_hyp_buckets_ = other.rescoring_hyp_buckets_;
+  rescoring_frame_buckets_ = other.rescoring_frame_buckets_;
+  has_conv_cache_method_ = other.has_conv_cache_method_;
+  has_batch_method_ = other.has_batch_method_;
+  has_batch_rescoring_method_ = other.has_batch_rescoring_method_;
+  has_utterance_batch_method_ = other.has_utterance_batch_method_;
+  has_prefix_rescoring_method_ = other.has_prefix_rescoring_method_;
+  prefix_tree_rescoring_ = other.prefix_tree_rescoring_;
+  device_ = other.device_;
+  fp16_ = other.fp16_;
+  mmap_weights_ = other.mmap_weights_;
+  thread_budget_ = other.thread_budget_;
+  ctc_topk_ = other.ctc_topk_;
   // 2. Model copy, just copy the model ptr since:
   // PyTorch allows using multiple CPU threads during TorchScript model
   // inference, please see https://pytorch.org/docs/stable/notes/cpu_
   // threading_torchscript_inference.html
   model_ = other.model_;
+  methods_ = other.methods_;
 
   // NOTE(Binbin Zhang):
   // inner states for forward are not copied here.
@@ -82,34 +243,114 @@ std::shared_ptr<AsrModel> TorchAsrModel::Copy() const {
 
 void TorchAsrModel::Reset() {
   offset_ = 0;
-  att_cache_ = std::move(torch::zeros({0, 0, 0, 0}));
-  cnn_cache_ = std::move(torch::zeros({0, 0, 0, 0}));
-  encoder_outs_.clear();
-  cached_feature_.clear();
+  att_cache_ = std::move(torch::zeros({0, 0, 0, 0}, FloatOptions()));
+  att_cache_frames_ = 0;
+  cnn_cache_ = std::move(torch::zeros({0, 0, 0, 0}, FloatOptions()));
+  conv_cache_ = torch::Tensor();
+  // Keep the buffer of encoder_out_ for the next sentence
+  encoder_out_start_ = 0;
+  encoder_out_len_ = 0;
+  rescoring_prefixes_.clear();
+  cached_feature_.Resize(0, 0);
 }
 
 
-void TorchAsrModel::ForwardEncoderFunc(
-    const std::vector<std::vector<float>>& chunk_feats,
-    std::vector<std::vector<float>> *out_prob) {
-  // 1. Prepare libtorch required data, splice cached_feature_ and chunk_feats
-  // The first dimension is for batchsize, which is 1.
-  int num_frames = cached_feature_.size() + chunk_feats.size();
-  const int feature_dim = chunk_feats[0].size();
-  torch::Tensor feats =
-      torch::zeros({1, num_frames, feature_dim}, torch::kFloat);
-  for (size_t i = 0; i < cached_feature_.size(); ++i) {
-    torch::Tensor row = torch::from_blob(
-        const_cast<float *>(cached_feature_[i].data()),
-        {feature_dim}, torch::kFloat).clone();
-    feats[0][i] = std::move(row);
+static void CopyCtcProb(const torch::Tensor& ctc_log_probs_on_device,
+                        LogProbMatrix* out_prob) {
+  // No-op for cpu float tensors
+  torch::Tensor ctc_log_probs =
+      ctc_log_probs_on_device.to(torch::kCPU, torch::kFloat).contiguous();
+  int num_outputs = ctc_log_probs.size(0);
+  int output_dim = ctc_log_probs.size(1);
+  out_prob->Resize(num_outputs, output_dim);
+  const float* src = ctc_log_probs.data_ptr<float>();
+  for (int i = 0; i < num_outputs; i++) {
+    memcpy(out_prob->Row(i), src + i * output_dim,
+           sizeof(float) * output_dim);
+  }
+}
+
+
+// Keep the blank and the topk other log probs of each frame on the device,
+// only (..., T, topk + 1) values and indices are copied back to the host.
+// The blank is always the first one, it's needed by blank skipping and the
+// endpoint even if it's not in the topk.
+static void PruneCtcProb(const torch::Tensor& ctc_log_probs, int topk,
+                         torch::Tensor* values, torch::Tensor* indices) {
+  int64_t num_tokens = ctc_log_probs.size(-1) - 1;
+  auto topk_out = ctc_log_probs.narrow(-1, 1, num_tokens)
+                      .topk(std::min<int64_t>(topk, num_tokens), -1);
+  torch::Tensor blank = ctc_log_probs.narrow(-1, 0, 1);
+  *values = torch::cat({blank, std::get<0>(topk_out)}, -1)
+                .to(torch::kCPU, torch::kFloat).contiguous();
+  *indices = torch::cat({torch::zeros_like(blank, torch::kLong),
+                         std::get<1>(topk_out) + 1}, -1)
+                 .to(torch::kCPU).contiguous();
+}
+
+
+// Scatter the pruned (T, topk + 1) log probs to a (T, output_dim) matrix,
+// the pruned ones are -inf and never get into the prefix beam.
+static void CopyPrunedCtcProb(const torch::Tensor& values,
+                              const torch::Tensor& indices, int output_dim,
+                              LogProbMatrix* out_prob) {
+  int num_outputs = values.size(0);
+  int num_kept = values.size(1);
+  out_prob->Resize(num_outputs, output_dim);
+  auto values_a = values.accessor<float, 2>();
+  auto indices_a = indices.accessor<int64_t, 2>();
+  for (int i = 0; i < num_outputs; i++) {
+    float* row = out_prob->Row(i);
+    std::fill(row, row + output_dim, -std::numeric_limits<float>::infinity());
+    for (int j = 0; j < num_kept; j++) {
+      row[indices_a[i][j]] = values_a[i][j];
+    }
   }
-  for (size_t i = 0; i < chunk_feats.size(); ++i) {
-    torch::Tensor row = torch::from_blob(
-        const_cast<float *>(chunk_feats[i].data()),
-        {feature_dim}, torch::kFloat).clone();
-    feats[0][cached_feature_.size() + i] = std::move(row);
+}
+
+
+// The pruned (T, topk + 1) log probs as they are
+static void CopySparseCtcProb(const torch::Tensor& values,
+                              const torch::Tensor& indices, int output_dim,
+                              SparseLogProbMatrix* out_prob) {
+  int num_outputs = values.size(0);
+  int num_kept = values.size(1);
+  out_prob->Resize(num_outputs, num_kept - 1, output_dim);
+  auto values_a = values.accessor<float, 2>();
+  auto indices_a = indices.accessor<int64_t, 2>();
+  for (int i = 0; i < num_outputs; i++) {
+    float* row_values = out_prob->Values(i);
+    int32_t* row_ids = out_prob->Ids(i);
+    for (int j = 0; j < num_kept; j++) {
+      row_values[j] = values_a[i][j];
+      row_ids[j] = static_cast<int32_t>(indices_a[i][j]);
+    }
   }
+}
+
+
+torch::Tensor TorchAsrModel::PrepareFeats(const FeatureMatrix& chunk_feats,
+                                          bool splice) {
+  // Wrap the spliced features with one from_blob, no per row copy.
+  // The first dimension is for batchsize, which is 1.
+  if (splice) SpliceFeature(chunk_feats, &input_feats_);
+  const FeatureMatrix& input = splice ? input_feats_ : chunk_feats;
+  int num_frames = input.rows();
+  int stride = input.stride();
+  torch::Tensor feats = torch::from_blob(
+      const_cast<float*>(input.data()), {1, num_frames, input.cols()},
+      {num_frames * stride, stride, 1}, torch::kFloat);
+  // A copy if it's not for a cpu float model
+  return feats.to(FloatOptions());
+}
+
+
+torch::Tensor TorchAsrModel::ForwardCtcLogProbs(
+    const FeatureMatrix& chunk_feats) {
+  // 1. Prepare libtorch required data, splice cached_feature_ and chunk_feats
+  // unless the overlap is in the conv cache
+  bool conv_cache_valid = has_conv_cache_method_ && conv_cache_.defined();
+  torch::Tensor feats = PrepareFeats(chunk_feats, !conv_cache_valid);
 
   // 2. Encoder chunk forward
   int requried_cache_size = chunk_size_ * num_left_chunks_;
@@ -121,28 +362,431 @@ void TorchAsrModel::ForwardEncoderFunc(
                                             cnn_cache_};
 
   // Refer interfaces in wenet/transformer/asr_model.py
-  auto outputs = model_->get_method(
-      "forward_encoder_chunk")(inputs).toTuple()->elements();
-  CHECK_EQ(outputs.size(), 3);
+  std::vector<torch::jit::IValue> outputs;
+  if (has_conv_cache_method_) {
+    // The spliced chunk with an empty cache is the same as the first chunk
+    inputs.push_back(conv_cache_valid
+                         ? conv_cache_
+                         : torch::zeros({0, 0, 0}, FloatOptions()));
+    outputs = (*methods_->forward_encoder_chunk_conv_cache)(inputs)
+                  .toTuple()->elements();
+    CHECK_EQ(outputs.size(), 4);
+    conv_cache_ = outputs[3].toTensor();
+  } else {
+    outputs = (*methods_->forward_encoder_chunk)(inputs).toTuple()->elements();
+    CHECK_EQ(outputs.size(), 3);
+  }
   torch::Tensor chunk_out = outputs[0].toTensor();
-  att_cache_ = outputs[1].toTensor();
+  UpdateAttCache(outputs[1].toTensor(), chunk_out.size(1));
   cnn_cache_ = outputs[2].toTensor();
   offset_ += chunk_out.size(1);
 
   // The first dimension of returned value is for batchsize, which is 1
   torch::Tensor ctc_log_probs =
-      model_->run_method("ctc_activation", chunk_out).toTensor()[0];
-  encoder_outs_.push_back(std::move(chunk_out));
+      (*methods_->ctc_activation)({chunk_out}).toTensor()[0];
+  AppendEncoderOut(RescoringFrames(chunk_out, ctc_log_probs));
+  return ctc_log_probs;
+}
 
+
+void TorchAsrModel::ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                                      LogProbMatrix* out_prob) {
+  ScopedIntraOpThreads threads(thread_budget_.get());
+  torch::Tensor ctc_log_probs = ForwardCtcLogProbs(chunk_feats);
   // Copy to output
-  int num_outputs = ctc_log_probs.size(0);
+  if (ctc_topk_ > 0 && ctc_topk_ < ctc_log_probs.size(1)) {
+    torch::Tensor values, indices;
+    PruneCtcProb(ctc_log_probs, ctc_topk_, &values, &indices);
+    CopyPrunedCtcProb(values, indices, ctc_log_probs.size(1), out_prob);
+  } else {
+    CopyCtcProb(ctc_log_probs, out_prob);
+  }
+}
+
+
+void TorchAsrModel::ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                                      SparseLogProbMatrix* out_prob) {
+  ScopedIntraOpThreads threads(thread_budget_.get());
+  torch::Tensor ctc_log_probs = ForwardCtcLogProbs(chunk_feats);
+  torch::Tensor values, indices;
   int output_dim = ctc_log_probs.size(1);
-  out_prob->resize(num_outputs);
-  for (int i = 0; i < num_outputs; i++) {
-    (*out_prob)[i].resize(output_dim);
-    memcpy((*out_prob)[i].data(), ctc_log_probs[i].data_ptr(),
-           sizeof(float) * output_dim);
+  PruneCtcProb(ctc_log_probs, ctc_topk_ > 0 ? ctc_topk_ : output_dim,
+               &values, &indices);
+  CopySparseCtcProb(values, indices, output_dim, out_prob);
+}
+
+
+void TorchAsrModel::ForwardEncoderBatch(
+    const std::vector<EncoderBatchItem>& items) {
+  ScopedIntraOpThreads threads(thread_budget_.get());
+  // Sessions could be stacked only when they have the same offset, the same
+  // number of input frames and the same attention cache size.
+  using GroupKey = std::tuple<int, int, int64_t, int>;
+  std::map<GroupKey, std::vector<const EncoderBatchItem*>> groups;
+  // The first and only forward of the whole utterances, whatever lengths
+  std::vector<const EncoderBatchItem*> utterances;
+  for (const auto& item : items) {
+    auto model = dynamic_cast<TorchAsrModel*>(item.model);
+    if (model != nullptr && has_utterance_batch_method_ &&
+        model->chunk_size_ <= 0 && model->offset_ == 0 &&
+        model->cached_feature_.empty() &&
+        item.chunk_feats->rows() > model->right_context_ + 1) {
+      utterances.push_back(&item);
+      continue;
+    }
+    if (model == nullptr || !has_batch_method_) {
+      item.model->ForwardEncoder(*item.chunk_feats, item.ctc_prob);
+      continue;
+    }
+    item.ctc_prob->Resize(0, 0);
+    int num_frames = model->cached_feature_.rows() + item.chunk_feats->rows();
+    if (num_frames <= model->right_context_ + 1) continue;
+    GroupKey key(model->offset_, num_frames, model->att_cache_.size(2),
+                 model->chunk_size_ * model->num_left_chunks_);
+    groups[key].push_back(&item);
+  }
+
+  if (utterances.size() == 1) {
+    utterances[0]->model->ForwardEncoder(*utterances[0]->chunk_feats,
+                                         utterances[0]->ctc_prob);
+  } else if (utterances.size() > 1) {
+    ForwardUtteranceGroup(utterances);
+  }
+  for (const auto& it : groups) {
+    const auto& group = it.second;
+    if (group.size() == 1) {
+      group[0]->model->ForwardEncoder(*group[0]->chunk_feats,
+                                      group[0]->ctc_prob);
+    } else {
+      ForwardEncoderGroup(group);
+    }
+  }
+}
+
+
+void TorchAsrModel::ForwardUtteranceGroup(
+    const std::vector<const EncoderBatchItem*>& group) {
+  // 1. Pad the utterances to the longest one, the padding is masked out by
+  // the lengths
+  const int batch_size = group.size();
+  int max_frames = 0;
+  for (const auto* item : group) {
+    max_frames = std::max(max_frames, item->chunk_feats->rows());
+  }
+  const int feature_dim = group[0]->chunk_feats->cols();
+  torch::Tensor feats =
+      torch::zeros({batch_size, max_frames, feature_dim}, torch::kFloat);
+  torch::Tensor feats_lens = torch::zeros({batch_size}, torch::kInt);
+  for (int b = 0; b < batch_size; ++b) {
+    const FeatureMatrix& chunk_feats = *group[b]->chunk_feats;
+    float* dst = feats[b].data_ptr<float>();
+    for (int t = 0; t < chunk_feats.rows(); ++t) {
+      memcpy(dst + t * feature_dim, chunk_feats.Row(t),
+             sizeof(float) * feature_dim);
+    }
+    feats_lens[b] = chunk_feats.rows();
+  }
+  auto first = static_cast<TorchAsrModel*>(group[0]->model);
+  torch::NoGradGuard no_grad;
+  std::vector<torch::jit::IValue> inputs = {
+      feats.to(first->FloatOptions()), feats_lens.to(first->device_)};
+
+  // 2. Full context forward, refer
+  // wenet/transformer/asr_model.py::forward_encoder_batch
+  auto outputs =
+      (*methods_->forward_encoder_batch)(inputs).toTuple()->elements();
+  CHECK_EQ(outputs.size(), 2);
+  torch::Tensor encoder_out = outputs[0].toTensor();
+  torch::Tensor out_lens = outputs[1].toTensor().to(torch::kCPU);
+  CHECK_EQ(encoder_out.size(0), batch_size);
+  torch::Tensor ctc_log_probs =
+      (*methods_->ctc_activation)({encoder_out}).toTensor();
+  int output_dim = ctc_log_probs.size(2);
+  bool prune = first->ctc_topk_ > 0 && first->ctc_topk_ < output_dim;
+  torch::Tensor values, indices;
+  if (prune) {
+    PruneCtcProb(ctc_log_probs, first->ctc_topk_, &values, &indices);
+  }
+
+  // 3. Scatter the valid outputs back to each session
+  for (int b = 0; b < batch_size; ++b) {
+    auto model = static_cast<TorchAsrModel*>(group[b]->model);
+    int num_outputs = out_lens[b].item<int64_t>();
+    model->offset_ += num_outputs;
+    model->AppendEncoderOut(model->RescoringFrames(
+        encoder_out.narrow(0, b, 1).narrow(1, 0, num_outputs),
+        ctc_log_probs[b].narrow(0, 0, num_outputs)));
+    if (prune) {
+      CopyPrunedCtcProb(values[b].narrow(0, 0, num_outputs),
+                        indices[b].narrow(0, 0, num_outputs), output_dim,
+                        group[b]->ctc_prob);
+    } else {
+      CopyCtcProb(ctc_log_probs[b].narrow(0, 0, num_outputs),
+                  group[b]->ctc_prob);
+    }
+    model->CacheFeature(*group[b]->chunk_feats);
+    // The next chunk is spliced with cached_feature_ instead
+    model->conv_cache_ = torch::Tensor();
+  }
+}
+
+
+void TorchAsrModel::ForwardEncoderGroup(
+    const std::vector<const EncoderBatchItem*>& group) {
+  // 1. Stack the input and the caches of all sessions in the group
+  const int batch_size = group.size();
+  std::vector<torch::Tensor> feats_list, att_cache_list, cnn_cache_list;
+  for (const auto* item : group) {
+    auto model = static_cast<TorchAsrModel*>(item->model);
+    feats_list.push_back(model->PrepareFeats(*item->chunk_feats));
+    att_cache_list.push_back(model->att_cache_);
+    cnn_cache_list.push_back(model->cnn_cache_);
+  }
+  auto first = static_cast<TorchAsrModel*>(group[0]->model);
+  int requried_cache_size = first->chunk_size_ * first->num_left_chunks_;
+  torch::NoGradGuard no_grad;
+  // att_cache: (elayers, b, head, cache_t1, d_k * 2)
+  // cnn_cache: (elayers, b, hidden-dim, cache_t2)
+  std::vector<torch::jit::IValue> inputs = {torch::cat(feats_list, 0),
+                                            first->offset_,
+                                            requried_cache_size,
+                                            torch::stack(att_cache_list, 1),
+                                            torch::cat(cnn_cache_list, 1)};
+
+  // 2. Batched encoder chunk forward, refer
+  // wenet/transformer/asr_model.py::forward_encoder_chunk_batch
+  auto outputs =
+      (*methods_->forward_encoder_chunk_batch)(inputs).toTuple()->elements();
+  CHECK_EQ(outputs.size(), 3);
+  torch::Tensor chunk_out = outputs[0].toTensor();
+  torch::Tensor att_cache = outputs[1].toTensor();
+  torch::Tensor cnn_cache = outputs[2].toTensor();
+  CHECK_EQ(chunk_out.size(0), batch_size);
+  torch::Tensor ctc_log_probs =
+      (*methods_->ctc_activation)({chunk_out}).toTensor();
+  // Prune the whole batch by one topk, and copy it back by one transfer
+  int output_dim = ctc_log_probs.size(2);
+  bool prune = first->ctc_topk_ > 0 && first->ctc_topk_ < output_dim;
+  torch::Tensor values, indices;
+  if (prune) {
+    PruneCtcProb(ctc_log_probs, first->ctc_topk_, &values, &indices);
+  }
+
+  // 3. Scatter the output and the new caches back to each session
+  for (int b = 0; b < batch_size; ++b) {
+    auto model = static_cast<TorchAsrModel*>(group[b]->model);
+    model->UpdateAttCache(att_cache.select(1, b), chunk_out.size(1));
+    // Transformer has no cnn cache, it's an empty tensor
+    if (cnn_cache.size(1) == batch_size) {
+      model->cnn_cache_ = cnn_cache.narrow(1, b, 1).clone();
+    } else {
+      model->cnn_cache_ = cnn_cache;
+    }
+    model->offset_ += chunk_out.size(1);
+    model->AppendEncoderOut(
+        model->RescoringFrames(chunk_out.narrow(0, b, 1), ctc_log_probs[b]));
+    if (prune) {
+      CopyPrunedCtcProb(values[b], indices[b], output_dim,
+                        group[b]->ctc_prob);
+    } else {
+      CopyCtcProb(ctc_log_probs[b], group[b]->ctc_prob);
+    }
+    model->CacheFeature(*group[b]->chunk_feats);
+    // The next chunk is spliced with cached_feature_ instead
+    model->conv_cache_ = torch::Tensor();
+  }
+}
+
+
+void TorchAsrModel::UpdateAttCache(const torch::Tensor& new_cache,
+                                   int num_new) {
+  if (num_left_chunks_ <= 0 || new_cache.size(0) == 0) {
+    // The cache grows with the sentence, or no attention cache at all
+    att_cache_ = new_cache.contiguous();
+    return;
+  }
+  const int capacity = chunk_size_ * num_left_chunks_;
+  if (!att_cache_ring_.defined() ||
+      att_cache_ring_.size(0) != new_cache.size(0) ||
+      att_cache_ring_.size(1) != new_cache.size(1) ||
+      att_cache_ring_.size(2) != 2 * capacity ||
+      att_cache_ring_.size(3) != new_cache.size(3)) {
+    att_cache_ring_ = torch::zeros(
+        {new_cache.size(0), new_cache.size(1), 2 * capacity, new_cache.size(3)},
+        new_cache.options());
+  }
+  num_new = std::min({num_new, capacity, static_cast<int>(new_cache.size(2))});
+  torch::Tensor frames =
+      new_cache.narrow(2, new_cache.size(2) - num_new, num_new);
+  // At most two pieces if the new frames wrap around the end of the ring
+  int pos = att_cache_frames_ % capacity;
+  int first = std::min(num_new, capacity - pos);
+  att_cache_ring_.narrow(2, pos, first).copy_(frames.narrow(2, 0, first));
+  att_cache_ring_.narrow(2, pos + capacity, first)
+      .copy_(frames.narrow(2, 0, first));
+  if (first < num_new) {
+    int rest = num_new - first;
+    att_cache_ring_.narrow(2, 0, rest).copy_(frames.narrow(2, first, rest));
+    att_cache_ring_.narrow(2, capacity, rest)
+        .copy_(frames.narrow(2, first, rest));
+  }
+  att_cache_frames_ += num_new;
+  int filled = std::min(att_cache_frames_, static_cast<int64_t>(capacity));
+  att_cache_ = att_cache_ring_.narrow(
+      2, (att_cache_frames_ - filled) % capacity, filled);
+}
+
+
+torch::Tensor TorchAsrModel::RescoringFrames(
+    const torch::Tensor& chunk_out, const torch::Tensor& ctc_log_probs) const {
+  if (rescoring_blank_threshold_ >= 1.0f || chunk_out.size(1) == 0) {
+    return chunk_out;
+  }
+  // Selected on the device, only the indexes of the kept frames are copied
+  // back, the blank is 0
+  torch::Tensor blank = ctc_log_probs.select(1, 0);
+  torch::Tensor keep = blank < std::log(rescoring_blank_threshold_);
+  keep.index_fill_(0, blank.argmin().unsqueeze(0), true);
+  return chunk_out.index_select(1, keep.nonzero().squeeze(1));
+}
+
+
+void TorchAsrModel::AppendEncoderOut(const torch::Tensor& chunk_out) {
+  torch::Tensor chunk = chunk_out;
+  int chunk_len = chunk.size(1);
+  const int max_frames = max_encoder_frames_;
+  if (max_frames > 0 && chunk_len > max_frames) {
+    chunk = chunk.narrow(1, chunk_len - max_frames, max_frames);
+    chunk_len = max_frames;
+  }
+  // Drop the oldest frames
+  if (max_frames > 0 && encoder_out_len_ + chunk_len > max_frames) {
+    int num_dropped = encoder_out_len_ + chunk_len - max_frames;
+    encoder_out_start_ += num_dropped;
+    encoder_out_len_ -= num_dropped;
+  }
+  int capacity = encoder_out_.defined() ? encoder_out_.size(1) : 0;
+  if (encoder_out_start_ + encoder_out_len_ + chunk_len > capacity) {
+    if (max_frames > 0 && capacity >= 2 * max_frames) {
+      // The kept frames start after max_frames, so they don't overlap
+      // their new place
+      if (encoder_out_len_ > 0) {
+        encoder_out_.narrow(1, 0, encoder_out_len_).copy_(EncoderOut());
+      }
+    } else {
+      int new_capacity = std::max(capacity * 2, encoder_out_len_ + chunk_len);
+      if (max_frames > 0) {
+        new_capacity = std::min(new_capacity, 2 * max_frames);
+      }
+      torch::Tensor buffer = torch::empty({1, new_capacity, chunk.size(2)},
+                                          chunk.options());
+      if (encoder_out_len_ > 0) {
+        buffer.narrow(1, 0, encoder_out_len_).copy_(EncoderOut());
+      }
+      encoder_out_ = std::move(buffer);
+    }
+    encoder_out_start_ = 0;
+  }
+  encoder_out_.narrow(1, encoder_out_start_ + encoder_out_len_, chunk_len)
+      .copy_(chunk);
+  encoder_out_len_ += chunk_len;
+}
+
+// The sizes and the float32 values of tensor
+static void WriteTensor(const torch::Tensor& tensor, StateWriter* writer) {
+  torch::Tensor values = tensor.to(torch::kCPU, torch::kFloat).contiguous();
+  writer->Write<int32_t>(values.dim());
+  for (int64_t size : values.sizes()) writer->Write(size);
+  writer->WriteArray(values.data_ptr<float>(), values.numel());
+}
+
+static bool ReadTensor(StateReader* reader, torch::Tensor* tensor) {
+  int32_t dim = 0;
+  if (!reader->Read(&dim) || dim < 0 || dim > 8) return false;
+  std::vector<int64_t> sizes(dim);
+  // The values must be in the state, so the sizes are checked before the
+  // tensor is allocated
+  uint64_t numel = 1;
+  const uint64_t max_numel = reader->remaining() / sizeof(float);
+  for (int64_t& size : sizes) {
+    if (!reader->Read(&size) || size < 0 ||
+        (size > 0 && numel > max_numel / static_cast<uint64_t>(size))) {
+      return false;
+    }
+    numel *= size;
   }
+  *tensor = torch::empty(sizes, torch::kFloat);
+  return reader->ReadArray(tensor->data_ptr<float>(), tensor->numel());
+}
+
+bool TorchAsrModel::SaveCaches(StateWriter* writer) const {
+  torch::NoGradGuard no_grad;
+  WriteTensor(att_cache_, writer);
+  WriteTensor(cnn_cache_, writer);
+  return true;
+}
+
+bool TorchAsrModel::RestoreCaches(StateReader* reader) {
+  torch::NoGradGuard no_grad;
+  torch::Tensor att_cache;
+  torch::Tensor cnn_cache;
+  if (!ReadTensor(reader, &att_cache) || !ReadTensor(reader, &cnn_cache) ||
+      att_cache.dim() != 4) {
+    return false;
+  }
+  // Into the ring of the limited left chunks, as if the frames of the cache
+  // were just returned by the model
+  att_cache_frames_ = 0;
+  UpdateAttCache(att_cache.to(FloatOptions()), att_cache.size(2));
+  cnn_cache_ = cnn_cache.to(FloatOptions());
+  return true;
+}
+
+size_t TorchAsrModel::MemoryBytes() const {
+  size_t bytes = AsrModel::MemoryBytes() + input_feats_.AllocatedBytes() +
+                 cnn_cache_.nbytes();
+  if (conv_cache_.defined()) bytes += conv_cache_.nbytes();
+  // att_cache_ is a view of the ring if there is one
+  bytes += att_cache_ring_.defined() ? att_cache_ring_.nbytes()
+                                     : att_cache_.nbytes();
+  if (encoder_out_.defined()) bytes += encoder_out_.nbytes();
+  for (const auto& prefix : rescoring_prefixes_) {
+    bytes += prefix.second.cache.nbytes();
+  }
+  return bytes;
+}
+
+bool TorchAsrModel::GetEncoderOut(FeatureMatrix* encoder_out) const {
+  if (encoder_out_len_ == 0) {
+    encoder_out->Resize(0, 0);
+    return true;
+  }
+  torch::Tensor out = EncoderOut().squeeze(0).to(torch::kCPU, torch::kFloat)
+                                              .contiguous();
+  int num_frames = out.size(0);
+  int dim = out.size(1);
+  encoder_out->Resize(num_frames, dim);
+  const float* data = out.data_ptr<float>();
+  for (int i = 0; i < num_frames; ++i) {
+    memcpy(encoder_out->Row(i), data + i * dim, sizeof(float) * dim);
+  }
+  return true;
+}
+
+
+bool TorchAsrModel::SetEncoderOut(const FeatureMatrix& encoder_out) {
+  encoder_out_start_ = 0;
+  encoder_out_len_ = 0;
+  rescoring_prefixes_.clear();
+  if (encoder_out.empty()) return true;
+  torch::NoGradGuard no_grad;
+  torch::Tensor out = torch::from_blob(
+      const_cast<float*>(encoder_out.data()),
+      {encoder_out.rows(), encoder_out.cols()}, {encoder_out.stride(), 1},
+      torch::kFloat);
+  AppendEncoderOut(out.to(device_, fp16_ ? torch::kHalf : torch::kFloat)
+                      .unsqueeze(0));
+  return true;
 }
 
 
@@ -163,6 +807,7 @@ void TorchAsrModel::AttentionRescoring(
     const std::vector<std::vector<int>>& hyps,
     float reverse_weight,
     std::vector<float>* rescoring_score) {
+  ScopedIntraOpThreads threads(thread_budget_.get());
   CHECK(rescoring_score != nullptr);
   int num_hyps = hyps.size();
   rescoring_score->resize(num_hyps, 0.0f);
@@ -171,7 +816,37 @@ void TorchAsrModel::AttentionRescoring(
     return;
   }
   // No encoder output
-  if (encoder_outs_.size() == 0) {
+  if (encoder_out_len_ == 0) {
+    return;
+  }
+
+  // Only the tokens after the cached prefixes and after the prefixes
+  // shared by the hyps are forwarded
+  if ((!rescoring_prefixes_.empty() ||
+       (prefix_tree_rescoring_ && has_prefix_rescoring_method_)) &&
+      reverse_weight <= 0.0) {
+    torch::NoGradGuard no_grad;
+    std::vector<std::vector<int>> targets(hyps);
+    for (auto& target : targets) target.push_back(eos_);
+    std::vector<int> indexes(num_hyps);
+    std::iota(indexes.begin(), indexes.end(), 0);
+    // The hyps of a common prefix are adjacent when sorted
+    std::sort(indexes.begin(), indexes.end(), [&targets](int a, int b) {
+      return targets[a] < targets[b];
+    });
+    RescorePrefixTree(targets, indexes, 0, num_hyps, 0, nullptr,
+                      rescoring_score);
+    return;
+  }
+
+  // The encoder time is only padded by the batch method, which masks it
+  if (!rescoring_frame_buckets_.empty() && has_batch_rescoring_method_) {
+    RescoringBatchItem item;
+    item.model = this;
+    item.hyps = &hyps;
+    item.reverse_weight = reverse_weight;
+    item.rescoring_score = rescoring_score;
+    RescoreBatch({&item});
     return;
   }
 
@@ -184,6 +859,7 @@ void TorchAsrModel::AttentionRescoring(
     max_hyps_len = std::max(length, max_hyps_len);
     hyps_length[i] = static_cast<int64_t>(length);
   }
+  max_hyps_len = BucketSize(max_hyps_len, rescoring_hyp_buckets_);
   torch::Tensor hyps_tensor =
       torch::zeros({num_hyps, max_hyps_len}, torch::kLong);
   for (size_t i = 0; i < num_hyps; ++i) {
@@ -194,31 +870,157 @@ void TorchAsrModel::AttentionRescoring(
     }
   }
 
-  // Step 2: Forward attention decoder by hyps and corresponding encoder_outs_
-  torch::Tensor encoder_out = torch::cat(encoder_outs_, 1);
-  auto outputs = model_-> run_method("forward_attention_decoder", hyps_tensor,
-      hyps_length, encoder_out, reverse_weight).toTuple()->elements();
-  auto probs = outputs[0].toTensor();
-  auto r_probs = outputs[1].toTensor();
+  // Step 2: Forward attention decoder by hyps and corresponding encoder_out_
+  torch::Tensor encoder_out = EncoderOut();
+  auto outputs = (*methods_->forward_attention_decoder)(
+      {hyps_tensor.to(device_), hyps_length.to(device_), encoder_out,
+       reverse_weight}).toTuple()->elements();
+  // Scores are computed on the host in float
+  auto probs = outputs[0].toTensor().to(torch::kCPU, torch::kFloat);
+  auto r_probs = outputs[1].toTensor().to(torch::kCPU, torch::kFloat);
   CHECK_EQ(probs.size(0), num_hyps);
   CHECK_EQ(probs.size(1), max_hyps_len);
 
   // Step 3: Compute rescoring score
-  for (size_t i = 0; i < num_hyps; ++i) {
+  ComputeRescoringScore(probs, r_probs, 0, hyps, reverse_weight,
+                        rescoring_score);
+}
+
+
+const TorchAsrModel::RescoringPrefix* TorchAsrModel::FindRescoringPrefix(
+    const std::vector<int>& tokens) const {
+  const RescoringPrefix* longest = nullptr;
+  size_t longest_len = 0;
+  for (const auto& prefix : rescoring_prefixes_) {
+    const std::vector<int>& prefix_tokens = prefix.first;
+    if (prefix_tokens.size() > longest_len &&
+        prefix_tokens.size() <= tokens.size() &&
+        std::equal(prefix_tokens.begin(), prefix_tokens.end(),
+                   tokens.begin())) {
+      longest = &prefix.second;
+      longest_len = prefix_tokens.size();
+    }
+  }
+  return longest;
+}
+
+void TorchAsrModel::RescorePrefixTree(
+    const std::vector<std::vector<int>>& targets,
+    const std::vector<int>& indexes, int begin, int end, int depth,
+    const RescoringPrefix* base, std::vector<float>* rescoring_score) {
+  const std::vector<int>& first = targets[indexes[begin]];
+  const std::vector<int>& last = targets[indexes[end - 1]];
+  // The common prefix of the sorted range is the one of its first and
+  // last targets, all of a single one or of duplicates
+  int common = depth;
+  while (common < first.size() && common < last.size() &&
+         first[common] == last[common]) {
+    ++common;
+  }
+  // The states of the common prefix, from the longer one of the prefixes
+  // cached by CacheRescoringPrefixes() and the one of the parent
+  const RescoringPrefix* node = base;
+  RescoringPrefix entry;
+  if (common > depth) {
+    std::vector<int> prefix(first.begin(), first.begin() + common);
+    const RescoringPrefix* cached = FindRescoringPrefix(prefix);
+    if (cached != nullptr && cached->cache.size(2) > depth) node = cached;
+    if (node == nullptr || node->cache.size(2) < common) {
+      entry.score = ForwardDecoderPrefix(prefix, node, &entry.cache);
+      node = &entry;
+    }
+  }
+  // The targets which are the common prefix come first when sorted
+  int i = begin;
+  while (i < end && targets[indexes[i]].size() == common) {
+    (*rescoring_score)[indexes[i++]] = node->score;
+  }
+  // A branch for each token after the common prefix
+  while (i < end) {
+    int j = i + 1;
+    while (j < end &&
+           targets[indexes[j]][common] == targets[indexes[i]][common]) {
+      ++j;
+    }
+    RescorePrefixTree(targets, indexes, i, j, common, node, rescoring_score);
+    i = j;
+  }
+}
+
+float TorchAsrModel::ForwardDecoderPrefix(const std::vector<int>& targets,
+                                          const RescoringPrefix* prefix,
+                                          torch::Tensor* cache) {
+  int num_tokens = targets.size();
+  int num_cached = prefix == nullptr ? 0 : prefix->cache.size(2);
+  CHECK_LT(num_cached, num_tokens);
+  torch::Tensor tokens = torch::zeros({1, num_tokens}, torch::kLong);
+  tokens[0][0] = sos_;
+  for (int j = 0; j + 1 < num_tokens; ++j) {
+    tokens[0][j + 1] = targets[j];
+  }
+  torch::Tensor prefix_cache = prefix == nullptr
+                                   ? torch::zeros({0, 0, 0, 0}, FloatOptions())
+                                   : prefix->cache;
+  auto outputs = (*methods_->forward_attention_decoder_prefix)(
+      {tokens.to(device_), EncoderOut(), prefix_cache}).toTuple()->elements();
+  // (1, num_tokens - num_cached, vocab_size)
+  auto probs = outputs[0].toTensor().to(torch::kCPU, torch::kFloat);
+  CHECK_EQ(probs.size(1), num_tokens - num_cached);
+  auto accessor = probs.accessor<float, 3>();
+  float score = prefix == nullptr ? 0.0f : prefix->score;
+  for (int j = num_cached; j < num_tokens; ++j) {
+    score += accessor[0][j - num_cached][targets[j]];
+  }
+  if (cache != nullptr) {
+    *cache = outputs[1].toTensor();
+  }
+  return score;
+}
+
+bool TorchAsrModel::CacheRescoringPrefixes(
+    const std::vector<std::vector<int>>& prefixes) {
+  if (!has_prefix_rescoring_method_ || encoder_out_len_ == 0) {
+    return false;
+  }
+  torch::NoGradGuard no_grad;
+  // The prefixes cached before are extended, and the ones which are still
+  // in the N-best are kept as they are
+  std::map<std::vector<int>, RescoringPrefix> cached;
+  for (const auto& prefix : prefixes) {
+    if (prefix.empty() || cached.count(prefix) > 0) continue;
+    const RescoringPrefix* base = FindRescoringPrefix(prefix);
+    if (base != nullptr && base->cache.size(2) == prefix.size()) {
+      cached.emplace(prefix, *base);
+      continue;
+    }
+    RescoringPrefix entry;
+    entry.score = ForwardDecoderPrefix(prefix, base, &entry.cache);
+    cached.emplace(prefix, std::move(entry));
+  }
+  rescoring_prefixes_ = std::move(cached);
+  return true;
+}
+
+void TorchAsrModel::ComputeRescoringScore(
+    const torch::Tensor& probs, const torch::Tensor& r_probs, int start,
+    const std::vector<std::vector<int>>& hyps, float reverse_weight,
+    std::vector<float>* rescoring_score) {
+  // hyps[i] is decoded at probs[start + i]
+  for (size_t i = 0; i < hyps.size(); ++i) {
     const std::vector<int>& hyp = hyps[i];
     float score = 0.0f;
     // left-to-right decoder score
-    score = ComputeAttentionScore(probs[i], hyp, eos_);
+    score = ComputeAttentionScore(probs[start + i], hyp, eos_);
     // Optional: Used for right to left score
     float r_score = 0.0f;
     if (is_bidirectional_decoder_ && reverse_weight > 0) {
       // right-to-left score
-      CHECK_EQ(r_probs.size(0), num_hyps);
-      CHECK_EQ(r_probs.size(1), max_hyps_len);
+      CHECK_EQ(r_probs.size(0), probs.size(0));
+      CHECK_EQ(r_probs.size(1), probs.size(1));
       std::vector<int> r_hyp(hyp.size());
       std::reverse_copy(hyp.begin(), hyp.end(), r_hyp.begin());
       // right to left decoder score
-      r_score = ComputeAttentionScore(r_probs[i], r_hyp, eos_);
+      r_score = ComputeAttentionScore(r_probs[start + i], r_hyp, eos_);
     }
 
     // combined left-to-right and right-to-left score
@@ -228,4 +1030,103 @@ void TorchAsrModel::AttentionRescoring(
 }
 
 
+void TorchAsrModel::AttentionRescoringBatch(
+    const std::vector<RescoringBatchItem>& items) {
+  ScopedIntraOpThreads threads(thread_budget_.get());
+  // Sessions which could not be batched are rescored one by one
+  std::vector<const RescoringBatchItem*> batch;
+  for (const auto& item : items) {
+    auto model = dynamic_cast<TorchAsrModel*>(item.model);
+    if (model == nullptr || !has_batch_rescoring_method_ ||
+        item.reverse_weight != items[0].reverse_weight ||
+        !model->rescoring_prefixes_.empty() ||
+        (model->prefix_tree_rescoring_ &&
+         model->has_prefix_rescoring_method_ && item.reverse_weight <= 0.0)) {
+      item.model->AttentionRescoring(*item.hyps, item.reverse_weight,
+                                     item.rescoring_score);
+      continue;
+    }
+    item.rescoring_score->assign(item.hyps->size(), 0.0f);
+    if (!item.hyps->empty() && model->encoder_out_len_ > 0) {
+      batch.push_back(&item);
+    }
+  }
+  if (batch.size() == 1) {
+    batch[0]->model->AttentionRescoring(*batch[0]->hyps,
+                                        batch[0]->reverse_weight,
+                                        batch[0]->rescoring_score);
+    return;
+  }
+  if (batch.empty()) return;
+  RescoreBatch(batch);
+}
+
+void TorchAsrModel::RescoreBatch(
+    const std::vector<const RescoringBatchItem*>& batch) {
+  torch::NoGradGuard no_grad;
+  // Step 1: Prepare input for libtorch, the hyps of all sessions are
+  // concatenated, and each hyp has a copy of its session's encoder output
+  int num_hyps = 0;
+  int max_hyps_len = 0;
+  int max_encoder_len = 0;
+  std::vector<torch::Tensor> encoder_outs;
+  for (const auto* item : batch) {
+    auto model = static_cast<TorchAsrModel*>(item->model);
+    encoder_outs.push_back(model->EncoderOut());
+    max_encoder_len = std::max(max_encoder_len,
+                               static_cast<int>(encoder_outs.back().size(1)));
+    for (const auto& hyp : *item->hyps) {
+      max_hyps_len = std::max(static_cast<int>(hyp.size()) + 1, max_hyps_len);
+    }
+    num_hyps += item->hyps->size();
+  }
+  // Padded to the buckets, the hyps and the encoder outputs are masked by
+  // hyps_length and encoder_lens
+  max_hyps_len = BucketSize(max_hyps_len, rescoring_hyp_buckets_);
+  max_encoder_len = BucketSize(max_encoder_len, rescoring_frame_buckets_);
+  const int encoder_dim = encoder_outs[0].size(2);
+  torch::Tensor hyps_length = torch::zeros({num_hyps}, torch::kLong);
+  torch::Tensor hyps_tensor =
+      torch::zeros({num_hyps, max_hyps_len}, torch::kLong);
+  torch::Tensor encoder_lens = torch::zeros({num_hyps}, torch::kLong);
+  torch::Tensor encoder_out = torch::zeros(
+      {num_hyps, max_encoder_len, encoder_dim}, FloatOptions());
+  int start = 0;
+  for (size_t b = 0; b < batch.size(); ++b) {
+    const auto& hyps = *batch[b]->hyps;
+    int n = hyps.size();
+    int encoder_len = encoder_outs[b].size(1);
+    encoder_out.narrow(0, start, n).narrow(1, 0, encoder_len).copy_(
+        encoder_outs[b].expand({n, encoder_len, encoder_dim}));
+    for (int i = 0; i < n; ++i) {
+      hyps_length[start + i] = static_cast<int64_t>(hyps[i].size() + 1);
+      encoder_lens[start + i] = static_cast<int64_t>(encoder_len);
+      hyps_tensor[start + i][0] = sos_;
+      for (size_t j = 0; j < hyps[i].size(); ++j) {
+        hyps_tensor[start + i][j + 1] = hyps[i][j];
+      }
+    }
+    start += n;
+  }
+
+  // Step 2: Forward attention decoder in one batch
+  float reverse_weight = batch[0]->reverse_weight;
+  auto outputs = (*methods_->forward_attention_decoder_batch)(
+      {hyps_tensor.to(device_), hyps_length.to(device_), encoder_out,
+       encoder_lens.to(device_), reverse_weight}).toTuple()->elements();
+  auto probs = outputs[0].toTensor().to(torch::kCPU, torch::kFloat);
+  auto r_probs = outputs[1].toTensor().to(torch::kCPU, torch::kFloat);
+  CHECK_EQ(probs.size(0), num_hyps);
+  CHECK_EQ(probs.size(1), max_hyps_len);
+
+  // Step 3: Compute rescoring score for each session
+  start = 0;
+  for (const auto* item : batch) {
+    ComputeRescoringScore(probs, r_probs, start, *item->hyps, reverse_weight,
+                          item->rescoring_score);
+    start += item->hyps->size();
+  }
+}
+
+
 }  // namespace wenet
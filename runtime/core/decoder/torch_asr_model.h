@@ -5,6 +5,7 @@
 #ifndef DECODER_TORCH_ASR_MODEL_H_
 #define DECODER_TORCH_ASR_MODEL_H_
 
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -13,6 +14,7 @@
 #include "torch/torch.h"
 
 #include "decoder/asr_model.h"
+#include "utils/thread_budget.h"
 #include "utils/utils.h"
 
 namespace wenet {
@@ -20,37 +22,221 @@ namespace wenet {
 class TorchAsrModel: public AsrModel {
  public:
   // Note: Do not call the InitEngineThreads function more than once.
-  static void InitEngineThreads(int num_threads = 1);
+  static void InitEngineThreads(int num_threads = 1,
+                                int num_interop_threads = 1);
+  // The dynamic int8 model beside model_path, e.g. final_quant.zip of
+  // final.zip, as exported by wenet/bin/export_jit.py --output_quant_file
+  static std::string QuantizedModelPath(const std::string& model_path);
+  // Select the int8 kernels of the quantized models before reading them,
+  // fbgemm on x86, which uses the VNNI instructions if the cpu has them,
+  // otherwise qnnpack. Return false if neither is built in.
+  static bool InitQuantizedEngine();
 
  public:
   using TorchModule = torch::jit::script::Module;
   TorchAsrModel() = default;
   TorchAsrModel(const TorchAsrModel& other);
   void Read(const std::string& model_path);
+  // device: "cpu" or "cuda:N", the caches and the encoder outputs stay on
+  // the device, only the ctc log probs and the rescoring probs are copied
+  // back to the host. fp16: run the model in half precision, cuda only.
+  // freeze: inline the parameters of the inference methods as constants
+  // and run the inference optimization passes on their graphs, e.g. the
+  // conv-bn folding and the MKLDNN prepacking of the weights on cpu.
+  void Read(const std::string& model_path, const std::string& device,
+            bool fp16, bool freeze = false);
+  // Map the weights of the cpu models read after it from their weights
+  // files, so the processes of the same model share them, see
+  // MapTorchWeights()
+  void set_mmap_weights(bool mmap_weights) { mmap_weights_ = mmap_weights; }
+  // Run each encoder and rescoring call by the intra-op threads granted by
+  // the budget shared by all the sessions, instead of the fixed ones of
+  // InitEngineThreads(), nullptr means the fixed ones. Only the OpenMP
+  // builds of libtorch set the threads per calling thread, it's a no-op of
+  // the others. Copied to the copies.
+  void set_thread_budget(std::shared_ptr<ThreadBudget> budget) {
+    thread_budget_ = std::move(budget);
+  }
   std::shared_ptr<TorchModule> torch_model() const { return model_; }
+  // Keep only the blank and the topk other ctc log probs of each frame, the
+  // others are -inf. It's done on the device, so a (T, topk + 1) instead of
+  // a (T, vocab_size) matrix is copied back, and it's passed to the search
+  // as it is by ForwardEncoder() of SparseLogProbMatrix. It's lossless for
+  // the prefix beam search when topk >= first_beam_size, 0 means no pruning.
+  void set_ctc_topk(int topk) { ctc_topk_ = topk; }
+  int ctc_topk() const override { return ctc_topk_; }
+  // Rescore the N-best by the prefix tree of them, the decoder runs once
+  // per branch of the tree from the cache of its parent, instead of over
+  // all the padded hyps. Left to right only, and needs the
+  // `forward_attention_decoder_prefix` method.
+  void set_prefix_tree_rescoring(bool enable) {
+    prefix_tree_rescoring_ = enable;
+  }
   void Reset() override;
   void AttentionRescoring(
       const std::vector<std::vector<int>>& hyps,
       float reverse_weight,
       std::vector<float>* rescoring_score) override;
+  // Cached by `forward_attention_decoder_prefix` if the model exports it
+  bool CacheRescoringPrefixes(
+      const std::vector<std::vector<int>>& prefixes) override;
   std::shared_ptr<AsrModel> Copy() const override;
+  bool GetEncoderOut(FeatureMatrix* encoder_out) const override;
+  bool SetEncoderOut(const FeatureMatrix& encoder_out) override;
+  // The caches and encoder_out_ may be on the device, they are counted all
+  // the same
+  size_t MemoryBytes() const override;
+  // Sessions with the same offset and cache size are stacked and forwarded
+  // by `forward_encoder_chunk_batch` if the exported model supports it. The
+  // whole utterances of the non-streaming sessions, chunk_size <= 0, are
+  // padded and forwarded by `forward_encoder_batch` instead.
+  void ForwardEncoderBatch(
+      const std::vector<EncoderBatchItem>& items) override;
+  // The N-best of all sessions are padded and rescored by one
+  // `forward_attention_decoder_batch` call if the model supports it.
+  void AttentionRescoringBatch(
+      const std::vector<RescoringBatchItem>& items) override;
 
  protected:
-  void ForwardEncoderFunc(
-      const std::vector<std::vector<float>>& chunk_feats,
-      std::vector<std::vector<float>> *ctc_prob) override;
+  void ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                          LogProbMatrix* ctc_prob) override;
+  void ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                          SparseLogProbMatrix* ctc_prob) override;
+  // Forward the chunk and keep its encoder outputs, return its (T, vocab)
+  // ctc log probs on the device
+  torch::Tensor ForwardCtcLogProbs(const FeatureMatrix& chunk_feats);
+  // The attention and the conv caches as float32 on the host, they're moved
+  // back to device_ in the dtype of fp16_
+  bool SaveCaches(StateWriter* writer) const override;
+  bool RestoreCaches(StateReader* reader) override;
+  // Splice cached_feature_ and chunk_feats to a (1, T, D) tensor, which
+  // shares the memory of input_feats_. Only chunk_feats if splice is false.
+  torch::Tensor PrepareFeats(const FeatureMatrix& chunk_feats,
+                             bool splice = true);
+  // Options of the float tensors on device_, in half precision for fp16_
+  torch::TensorOptions FloatOptions() const {
+    return torch::TensorOptions().device(device_).dtype(
+        fp16_ ? torch::kHalf : torch::kFloat);
+  }
+  void ForwardEncoderGroup(const std::vector<const EncoderBatchItem*>& group);
+  void ForwardUtteranceGroup(
+      const std::vector<const EncoderBatchItem*>& group);
+  // Keep the attention cache returned by the model, the last num_new frames
+  // of it are the new ones. With limited left chunks, they are written to
+  // att_cache_ring_ in place and att_cache_ becomes a view of it.
+  void UpdateAttCache(const torch::Tensor& new_cache, int num_new);
+  // Append one chunk output (1, T, dim) to encoder_out_, and drop the
+  // oldest ones over max_encoder_frames_
+  void AppendEncoderOut(const torch::Tensor& chunk_out);
+  // The frames of one chunk output (1, T, dim) kept for the rescoring by
+  // their (T, vocab) ctc log probs, see set_rescoring_blank_threshold()
+  torch::Tensor RescoringFrames(const torch::Tensor& chunk_out,
+                                const torch::Tensor& ctc_log_probs) const;
+  // View of all the valid encoder outputs, (1, encoder_out_len_, dim)
+  torch::Tensor EncoderOut() const {
+    return encoder_out_.narrow(1, encoder_out_start_, encoder_out_len_);
+  }
 
+  // Rescore the items of this backend by one
+  // `forward_attention_decoder_batch` call
+  void RescoreBatch(const std::vector<const RescoringBatchItem*>& batch);
+  // The decoder states of the first tokens of the hyps and the score of
+  // them, see CacheRescoringPrefixes()
+  struct RescoringPrefix {
+    // (num_blocks, 1, prefix_len, dim)
+    torch::Tensor cache;
+    float score = 0.0f;
+  };
+  // The longest cached prefix of tokens, nullptr if none
+  const RescoringPrefix* FindRescoringPrefix(
+      const std::vector<int>& tokens) const;
+  // Score the hyps of indexes [begin, end) of the sorted targets, which
+  // share their first depth tokens, whose states are base. The common
+  // tokens of them are forwarded once, then each branch after them.
+  void RescorePrefixTree(const std::vector<std::vector<int>>& targets,
+                         const std::vector<int>& indexes, int begin, int end,
+                         int depth, const RescoringPrefix* base,
+                         std::vector<float>* rescoring_score);
+  // Forward the decoder over sos and targets but the last one, each
+  // position predicts the next target. The positions of prefix are taken
+  // from its cache. Return the score of the targets, the states of all the
+  // positions are returned by cache if it's not nullptr.
+  float ForwardDecoderPrefix(const std::vector<int>& targets,
+                             const RescoringPrefix* prefix,
+                             torch::Tensor* cache);
   float ComputeAttentionScore(const torch::Tensor& prob,
                               const std::vector<int>& hyp,
                               int eos);
+  void ComputeRescoringScore(const torch::Tensor& probs,
+                             const torch::Tensor& r_probs, int start,
+                             const std::vector<std::vector<int>>& hyps,
+                             float reverse_weight,
+                             std::vector<float>* rescoring_score);
 
  private:
+  // The methods called for every chunk, looked up once by Read() instead
+  // of by name at each call. The ones of the batches are optional.
+  struct Methods {
+    c10::optional<torch::jit::Method> forward_encoder_chunk;
+    // Optional, see conv_cache_
+    c10::optional<torch::jit::Method> forward_encoder_chunk_conv_cache;
+    c10::optional<torch::jit::Method> ctc_activation;
+    c10::optional<torch::jit::Method> forward_attention_decoder;
+    c10::optional<torch::jit::Method> forward_encoder_chunk_batch;
+    c10::optional<torch::jit::Method> forward_encoder_batch;
+    c10::optional<torch::jit::Method> forward_attention_decoder_batch;
+    c10::optional<torch::jit::Method> forward_attention_decoder_prefix;
+  };
+
   std::shared_ptr<TorchModule> model_ = nullptr;
-  std::vector<torch::Tensor> encoder_outs_;
+  // Of model_, shared by the copies as model_
+  std::shared_ptr<const Methods> methods_ = nullptr;
+  torch::Device device_ = torch::kCPU;
+  bool fp16_ = false;
+  bool mmap_weights_ = false;
+  std::shared_ptr<ThreadBudget> thread_budget_ = nullptr;
+  int ctc_topk_ = 0;
+  // If the model exports the chunk forward method with the conv cache of
+  // the subsampling
+  bool has_conv_cache_method_ = false;
+  // If the model exports the batched chunk forward method
+  bool has_batch_method_ = false;
+  // If the model exports the batched full context forward method
+  bool has_utterance_batch_method_ = false;
+  // If the model exports the batched attention decoder method
+  bool has_batch_rescoring_method_ = false;
+  // If the model exports the incremental attention decoder method
+  bool has_prefix_rescoring_method_ = false;
+  bool prefix_tree_rescoring_ = false;
+  // Of the stable N-best prefixes of this sentence, by the tokens
+  std::map<std::vector<int>, RescoringPrefix> rescoring_prefixes_;
+  // Encoder outputs of all chunks are written to encoder_out_ directly,
+  // (1, capacity, dim), encoder_out_len_ frames from encoder_out_start_ are
+  // valid. It grows geometrically, so rescoring gets a view instead of a
+  // concat. With max_encoder_frames_, it stops at twice of it, and the kept
+  // frames are moved to the front when the end is reached. It's kept by
+  // Reset(), so a reused model doesn't allocate it again.
+  torch::Tensor encoder_out_;
+  int encoder_out_start_ = 0;
+  int encoder_out_len_ = 0;
+  // Buffer of the spliced input features
+  FeatureMatrix input_feats_;
   // transformer/conformer attention cache
   torch::Tensor att_cache_ = torch::zeros({0, 0, 0, 0});
+  // Fixed capacity ring buffer of the attention cache when num_left_chunks_
+  // > 0, (elayers, head, 2 * capacity, d_k * 2). Every frame is written at i
+  // and i + capacity, so the latest frames are always one window in time
+  // order. It's allocated once and kept by Reset().
+  torch::Tensor att_cache_ring_;
+  int64_t att_cache_frames_ = 0;  // Total frames written to the ring
   // conformer-only conv_module cache
   torch::Tensor cnn_cache_ = torch::zeros({0, 0, 0, 0});
+  // The unconsumed inputs of the conv layers of the subsampling at the end
+  // of the last chunk, (1, 1, size), so the next chunk isn't spliced with
+  // cached_feature_ and its overlap isn't computed again. It's dropped by
+  // Reset() and the batched forwards, the next chunk is spliced then and
+  // rebuilds it. Undefined if it's not valid.
+  torch::Tensor conv_cache_;
 };
 
 }  // namespace wenet
@@ -0,0 +1,121 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/torch_fbank.h"
+
+#include <cstring>
+#include <limits>
+
+#include "utils/log.h"
+#include "utils/trace.h"
+
+namespace wenet {
+
+TorchFbankComputer::TorchFbankComputer(const Fbank& fbank,
+                                       const std::string& device)
+    : device_(device),
+      num_bins_(fbank.num_bins()),
+      frame_length_(fbank.frame_length()),
+      frame_shift_(fbank.frame_shift()),
+      fft_points_(fbank.fft_points()),
+      use_log_(fbank.use_log()),
+      remove_dc_offset_(fbank.remove_dc_offset()) {
+  if (device_.is_cuda()) {
+    CHECK(torch::cuda::is_available()) << "CUDA is not available";
+  }
+  std::vector<float> window = fbank.povey_window();
+  // Copied even if device_ is cpu, the host tables are freed
+  window_ = torch::from_blob(window.data(), {1, frame_length_}, torch::kFloat)
+                .to(device_, torch::kFloat, false, true);
+  frame_offsets_ =
+      torch::arange(frame_length_, torch::kLong).view({1, -1}).to(device_);
+  std::vector<float> mel_matrix;
+  fbank.MelMatrix(&mel_matrix);
+  mel_matrix_ = torch::from_blob(mel_matrix.data(),
+                                 {fbank.num_fft_bins(), num_bins_},
+                                 torch::kFloat)
+                    .to(device_, torch::kFloat, false, true);
+}
+
+void TorchFbankComputer::Compute(
+    const std::vector<const FbankRequest*>& requests, int num_frames) {
+  WENET_TRACE_SCOPE("fbank_torch");
+  // 1. The samples used by the frames of all the requests, one after
+  // another, and the start of each frame in them
+  samples_.clear();
+  starts_.clear();
+  for (const FbankRequest* request : requests) {
+    int n = NumFrames(request->num_samples);
+    if (n == 0) continue;
+    size_t offset = samples_.size();
+    int num_samples = (n - 1) * frame_shift_ + frame_length_;
+    samples_.resize(offset + num_samples);
+    if (request->float_wave != nullptr) {
+      memcpy(samples_.data() + offset, request->float_wave,
+             sizeof(float) * num_samples);
+    } else {
+      for (int i = 0; i < num_samples; ++i) {
+        samples_[offset + i] = request->int16_wave[i];
+      }
+    }
+    for (int j = 0; j < n; ++j) {
+      starts_.push_back(offset + j * frame_shift_);
+    }
+  }
+  CHECK_EQ(static_cast<int>(starts_.size()), num_frames);
+  if (num_frames == 0) return;
+
+  torch::NoGradGuard no_grad;
+  torch::Tensor samples =
+      torch::from_blob(samples_.data(),
+                       {static_cast<int64_t>(samples_.size())}, torch::kFloat)
+          .to(device_);
+  torch::Tensor starts =
+      torch::from_blob(starts_.data(), {num_frames, 1}, torch::kLong)
+          .to(device_);
+  // 2. Frames, (num_frames, frame_length_), as Fbank::ComputePowerSpectrum()
+  torch::Tensor frames = samples.take(starts + frame_offsets_);
+  if (remove_dc_offset_) {
+    frames = frames - frames.mean(1, true);
+  }
+  // x[i] -= 0.97 * x[i - 1], x[0] -= 0.97 * x[0]
+  torch::Tensor previous = torch::cat(
+      {frames.narrow(1, 0, 1), frames.narrow(1, 0, frame_length_ - 1)}, 1);
+  frames = (frames - 0.97f * previous) * window_;
+  // 3. Power spectrums of the bins [0, fft_points_ / 2), the frames are zero
+  // padded to fft_points_
+  torch::Tensor spectrum =
+      torch::view_as_real(torch::fft::rfft(frames, fft_points_, 1));
+  torch::Tensor power =
+      spectrum.pow(2).sum(-1).narrow(1, 0, fft_points_ / 2);
+  // 4. Mel filter bank
+  torch::Tensor feats = power.matmul(mel_matrix_);
+  if (use_log_) {
+    feats = feats.clamp_min(std::numeric_limits<float>::epsilon()).log();
+  }
+  feats = feats.to(torch::kCPU).contiguous();
+
+  // 5. Scatter the frames back
+  const float* data = feats.data_ptr<float>();
+  int row = 0;
+  for (const FbankRequest* request : requests) {
+    int n = NumFrames(request->num_samples);
+    for (int j = 0; j < n; ++j, ++row) {
+      memcpy(request->feat + j * request->stride, data + row * num_bins_,
+             sizeof(float) * num_bins_);
+    }
+  }
+}
+
+}  // namespace wenet
@@ -0,0 +1,77 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_TORCH_FBANK_H_
+#define DECODER_TORCH_FBANK_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "torch/torch.h"
+
+#include "frontend/batch_fbank_scheduler.h"
+#include "frontend/fbank.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// Compute the fbank batches of BatchFbankScheduler by libtorch on a device,
+// e.g. the GPU of the encoder, so the frontend of many streams doesn't take
+// the cpu. The samples of all the requests are copied to the device once,
+// the frames are gathered there, then the dc offset, the preemphasis and
+// the window are applied to all of them, the power spectrums are computed
+// by one batched fft (cuFFT on cuda), and the mel filter bank is applied by
+// one GEMM. Only the (num_frames, num_bins) features are copied back. It
+// matches Fbank up to the float rounding of the fft and the GEMM, dither is
+// not supported.
+class TorchFbankComputer : public FbankBatchComputer {
+ public:
+  // fbank holds the config of the scheduler, device is "cpu" or "cuda:N"
+  TorchFbankComputer(const Fbank& fbank, const std::string& device);
+
+  void Compute(const std::vector<const FbankRequest*>& requests,
+               int num_frames) override;
+
+ private:
+  int NumFrames(int num_samples) const {
+    if (num_samples < frame_length_) return 0;
+    return 1 + (num_samples - frame_length_) / frame_shift_;
+  }
+
+  torch::Device device_;
+  const int num_bins_;
+  const int frame_length_;
+  const int frame_shift_;
+  const int fft_points_;
+  const bool use_log_;
+  const bool remove_dc_offset_;
+  // (1, frame_length_) on device_
+  torch::Tensor window_;
+  // The sample offsets in a frame, (1, frame_length_) on device_
+  torch::Tensor frame_offsets_;
+  // (fft_points_ / 2, num_bins_) on device_
+  torch::Tensor mel_matrix_;
+  // The samples of a batch and the starts of its frames in them, on the
+  // host
+  std::vector<float> samples_;
+  std::vector<int64_t> starts_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(TorchFbankComputer);
+};
+
+}  // namespace wenet
+
+#endif  // DECODER_TORCH_FBANK_H_
@@ -0,0 +1,193 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/torch_mapped_weights.h"
+
+#include <sys/stat.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "utils/log.h"
+#include "utils/mapped_file.h"
+#include "utils/state_io.h"
+#include "utils/timer.h"
+
+namespace wenet {
+
+// "WNTW" of the weights files, and their version
+static const uint32_t kWeightsMagic = 0x57544e57;
+static const uint32_t kWeightsVersion = 1;
+// The tensors are aligned to the pages in the file
+static const size_t kWeightsAlignment = 4096;
+
+static size_t AlignWeights(size_t offset) {
+  return (offset + kWeightsAlignment - 1) / kWeightsAlignment *
+         kWeightsAlignment;
+}
+
+std::string MappedWeightsPath(const std::string& model_path) {
+  return model_path + ".weights";
+}
+
+// The parameters and the buffers of the module in the order of the module,
+// the ones which can't be mapped are skipped, e.g. of another device
+static std::vector<std::pair<std::string, torch::Tensor>> WeightTensors(
+    const torch::jit::script::Module& module) {
+  std::vector<std::pair<std::string, torch::Tensor>> tensors;
+  auto add = [&tensors](const std::string& name, const torch::Tensor& t) {
+    if (t.defined() && t.device().is_cpu() && t.layout() == torch::kStrided &&
+        t.is_contiguous() && t.numel() > 0) {
+      tensors.emplace_back(name, t);
+    }
+  };
+  for (const auto& p : module.named_parameters(true)) add(p.name, p.value);
+  for (const auto& b : module.named_buffers(true)) add(b.name, b.value);
+  return tensors;
+}
+
+// The header of the tensors, their offsets are from the start of the data
+// after the header
+static std::string WeightsHeader(
+    const std::vector<std::pair<std::string, torch::Tensor>>& tensors,
+    int64_t model_size, int64_t model_mtime_ns) {
+  std::string header;
+  StateWriter writer(&header);
+  writer.Write<uint32_t>(kWeightsMagic);
+  writer.Write<uint32_t>(kWeightsVersion);
+  writer.Write<int64_t>(model_size);
+  writer.Write<int64_t>(model_mtime_ns);
+  writer.Write<uint64_t>(tensors.size());
+  uint64_t offset = 0;
+  for (const auto& t : tensors) {
+    uint64_t nbytes = t.second.numel() * t.second.element_size();
+    writer.WriteString(t.first);
+    writer.Write<int32_t>(static_cast<int32_t>(t.second.scalar_type()));
+    writer.WriteVector(t.second.sizes().vec());
+    writer.Write<uint64_t>(offset);
+    writer.Write<uint64_t>(nbytes);
+    offset = AlignWeights(offset + nbytes);
+  }
+  return header;
+}
+
+static bool WriteWeights(
+    const std::string& path,
+    const std::vector<std::pair<std::string, torch::Tensor>>& tensors,
+    const std::string& header) {
+  std::string tmp_path = path + ".tmp" + std::to_string(
+      std::chrono::steady_clock::now().time_since_epoch().count());
+  FILE* fp = fopen(tmp_path.c_str(), "wb");
+  if (fp == nullptr) return false;
+  uint64_t header_size = header.size();
+  bool ok = fwrite(&header_size, sizeof(header_size), 1, fp) == 1 &&
+            fwrite(header.data(), 1, header.size(), fp) == header.size();
+  const std::vector<char> zeros(kWeightsAlignment, 0);
+  size_t pos = sizeof(header_size) + header.size();
+  size_t data_start = AlignWeights(pos);
+  size_t offset = 0;
+  for (size_t i = 0; ok && i < tensors.size(); ++i) {
+    const torch::Tensor& t = tensors[i].second;
+    size_t nbytes = t.numel() * t.element_size();
+    size_t padding = data_start + offset - pos;
+    ok = fwrite(zeros.data(), 1, padding, fp) == padding &&
+         fwrite(t.data_ptr(), 1, nbytes, fp) == nbytes;
+    pos = data_start + offset + nbytes;
+    offset = AlignWeights(offset + nbytes);
+  }
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Check the header of the mapped weights file against the one of the
+// module, return the start of the data, 0 if it doesn't match
+static size_t CheckWeights(const MappedFile& file, const std::string& header,
+                           uint64_t data_bytes) {
+  uint64_t header_size = 0;
+  StateReader reader(file.data(), file.size());
+  if (!reader.Read(&header_size) || header_size != header.size() ||
+      header_size > reader.remaining() ||
+      memcmp(file.data() + sizeof(header_size), header.data(),
+             header.size()) != 0) {
+    return 0;
+  }
+  size_t data_start = AlignWeights(sizeof(header_size) + header_size);
+  if (data_start > file.size() || file.size() - data_start < data_bytes) {
+    return 0;
+  }
+  return data_start;
+}
+
+size_t MapTorchWeights(const std::string& model_path,
+                       torch::jit::script::Module* module) {
+  Timer timer;
+  struct stat st;
+  if (stat(model_path.c_str(), &st) != 0) return 0;
+  auto tensors = WeightTensors(*module);
+  if (tensors.empty()) return 0;
+  int64_t mtime = static_cast<int64_t>(st.st_mtime) * 1000000000;
+#ifdef __linux__
+  mtime += st.st_mtim.tv_nsec;
+#endif
+  std::string header = WeightsHeader(tensors, st.st_size, mtime);
+  uint64_t data_bytes = 0;
+  for (const auto& t : tensors) {
+    data_bytes = AlignWeights(data_bytes) +
+                 t.second.numel() * t.second.element_size();
+  }
+  const std::string path = MappedWeightsPath(model_path);
+  std::shared_ptr<MappedFile> file = MappedFile::Open(path, true);
+  size_t data_start =
+      file == nullptr ? 0 : CheckWeights(*file, header, data_bytes);
+  if (data_start == 0) {
+    // Missing or stale
+    file.reset();
+    if (!WriteWeights(path, tensors, header)) {
+      LOG(WARNING) << "Can't write the weights file " << path
+                   << ", the weights of " << model_path << " are private";
+      return 0;
+    }
+    LOG(INFO) << "Wrote the weights file " << path;
+    file = MappedFile::Open(path, true);
+    data_start = file == nullptr ? 0 : CheckWeights(*file, header, data_bytes);
+    if (data_start == 0) return 0;
+  }
+  // The tensors share the mapping, it's unmapped with the last of them
+  torch::NoGradGuard no_grad;
+  size_t offset = 0;
+  for (auto& t : tensors) {
+    size_t nbytes = t.second.numel() * t.second.element_size();
+    torch::Tensor mapped = torch::from_blob(
+        const_cast<char*>(file->data() + data_start + offset),
+        t.second.sizes(), [file](void*) {},
+        torch::TensorOptions().dtype(t.second.scalar_type()));
+    t.second.set_data(mapped);
+    offset = AlignWeights(offset + nbytes);
+  }
+  LOG(INFO) << "Mapped " << tensors.size() << " weights of " << model_path
+            << ", " << data_bytes / (1 << 20) << " MB, in " << timer.Elapsed()
+            << " ms";
+  return data_bytes;
+}
+
+}  // namespace wenet
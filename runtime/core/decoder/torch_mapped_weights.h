@@ -0,0 +1,44 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DECODER_TORCH_MAPPED_WEIGHTS_H_
+#define DECODER_TORCH_MAPPED_WEIGHTS_H_
+
+#include <string>
+
+#include "torch/script.h"
+
+namespace wenet {
+
+// The weights file of a torch model, e.g. final.zip.weights of final.zip
+std::string MappedWeightsPath(const std::string& model_path);
+
+// Replace the storages of the parameters and the buffers of the cpu module
+// read from model_path by the read only mapping of its weights file, so the
+// processes of the same model share the physical pages of the weights, and
+// the private copies read by torch::jit::load are freed. The weights file
+// is written by the first start, or whenever it's stale, i.e. the model
+// file has another size or mtime, to a temporary file and renamed, so the
+// processes starting at once never map a partial one. Return the bytes of
+// the mapped weights, 0 if they can't be mapped, e.g. the dir of the model
+// is read only, the module is kept as it is then. The packed weights of the
+// quantized modules are not parameters, so they stay private, and so do the
+// new weights of torch::jit::freeze, e.g. of the conv-bn folding. The
+// mapped tensors are read only, writing them crashes.
+size_t MapTorchWeights(const std::string& model_path,
+                       torch::jit::script::Module* module);
+
+}  // namespace wenet
+
+#endif  // DECODER_TORCH_MAPPED_WEIGHTS_H_
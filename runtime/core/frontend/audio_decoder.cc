@@ -0,0 +1,81 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "frontend/audio_decoder.h"
+
+#ifdef USE_OPUS
+#include "opus.h"
+#endif
+
+#include "utils/log.h"
+
+namespace wenet {
+
+#ifdef USE_OPUS
+// Each packet is one opus packet, as it's produced by opus_encode() on the
+// client. Opus decodes to 8, 12, 16, 24 or 48 kHz whatever the rate of the
+// encoder is, so no resampling is needed for these feature sample rates.
+class OpusAudioDecoder : public AudioDecoder {
+ public:
+  explicit OpusAudioDecoder(OpusDecoder* decoder, int sample_rate)
+      : decoder_(decoder), max_frame_size_(sample_rate * 120 / 1000) {}
+  ~OpusAudioDecoder() override { opus_decoder_destroy(decoder_); }
+
+  bool Decode(const char* data, size_t size,
+              std::vector<int16_t>* pcm) override {
+    size_t offset = pcm->size();
+    // A packet has at most 120 ms of audio
+    pcm->resize(offset + max_frame_size_);
+    int num_samples = opus_decode(
+        decoder_, reinterpret_cast<const unsigned char*>(data), size,
+        pcm->data() + offset, max_frame_size_, 0);
+    if (num_samples < 0) {
+      LOG(WARNING) << "Opus decode error: " << opus_strerror(num_samples);
+      pcm->resize(offset);
+      return false;
+    }
+    pcm->resize(offset + num_samples);
+    return true;
+  }
+
+ private:
+  OpusDecoder* decoder_;
+  int max_frame_size_;
+};
+#endif
+
+std::unique_ptr<AudioDecoder> CreateAudioDecoder(const std::string& codec,
+                                                 int sample_rate) {
+  if (codec == "opus") {
+#ifdef USE_OPUS
+    int error = OPUS_OK;
+    OpusDecoder* decoder = opus_decoder_create(sample_rate, 1, &error);
+    if (error != OPUS_OK) {
+      LOG(WARNING) << "Failed to create opus decoder at " << sample_rate
+                   << ": " << opus_strerror(error);
+      return nullptr;
+    }
+    return std::unique_ptr<AudioDecoder>(
+        new OpusAudioDecoder(decoder, sample_rate));
+#else
+    LOG(WARNING) << "Opus is not supported, please build with -DOPUS=ON";
+    return nullptr;
+#endif
+  }
+  LOG(WARNING) << "Unsupported codec " << codec;
+  return nullptr;
+}
+
+}  // namespace wenet
@@ -0,0 +1,47 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef FRONTEND_AUDIO_DECODER_H_
+#define FRONTEND_AUDIO_DECODER_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace wenet {
+
+// Decoder of the compressed audio packets of one stream. The decoder state
+// is kept across the packets, and the packets are decoded in memory to the
+// 16 bits PCM which is fed to FeaturePipeline.
+class AudioDecoder {
+ public:
+  virtual ~AudioDecoder() = default;
+
+  // Decode one packet, the 16 bits PCM is appended to pcm. Return false if
+  // the packet is corrupted.
+  virtual bool Decode(const char* data, size_t size,
+                      std::vector<int16_t>* pcm) = 0;
+};
+
+// Create the decoder of codec which decodes to mono PCM at sample_rate.
+// Return nullptr if the codec is not supported, e.g. "opus" is only
+// supported when it's built with -DOPUS=ON.
+std::unique_ptr<AudioDecoder> CreateAudioDecoder(const std::string& codec,
+                                                 int sample_rate);
+
+}  // namespace wenet
+
+#endif  // FRONTEND_AUDIO_DECODER_H_
@@ -0,0 +1,161 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "frontend/batch_fbank_scheduler.h"
+
+#include <cstring>
+#include <utility>
+
+#include "utils/log.h"
+#include "utils/trace.h"
+
+namespace wenet {
+
+BatchFbankScheduler::BatchFbankScheduler(const BatchFbankOptions& opts,
+                                         int num_bins, int sample_rate,
+                                         int frame_length, int frame_shift,
+                                         std::shared_ptr<FbankBatchComputer>
+                                             computer)
+    : opts_(opts),
+      num_bins_(num_bins),
+      frame_length_(frame_length),
+      frame_shift_(frame_shift),
+      computer_(std::move(computer)),
+      fbank_(num_bins, sample_rate, frame_length, frame_shift) {
+  CHECK_GT(opts_.max_batch_frames, 0);
+  CHECK_GE(opts_.max_wait_us, 0);
+  worker_ = std::thread(&BatchFbankScheduler::SchedulerLoop, this);
+}
+
+BatchFbankScheduler::~BatchFbankScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  task_cond_.notify_one();
+  worker_.join();
+}
+
+void BatchFbankScheduler::Compute(const FbankRequest* requests,
+                                  int num_requests) {
+  Task task;
+  task.requests = requests;
+  task.num_requests = num_requests;
+  task.num_frames = 0;
+  for (int i = 0; i < num_requests; ++i) {
+    task.num_frames += fbank_.NumFrames(requests[i].num_samples);
+  }
+  if (task.num_frames == 0) return;
+  task.arrival = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(mutex_);
+  tasks_.push_back(&task);
+  num_queued_frames_ += task.num_frames;
+  task_cond_.notify_one();
+  done_cond_.wait(lock, [&task] { return task.done; });
+}
+
+void BatchFbankScheduler::SchedulerLoop() {
+  while (true) {
+    std::vector<Task*> batch;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      task_cond_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+      if (tasks_.empty()) return;  // stop_ is set and all tasks are done
+      // Wait for more streams until the batch is full or the oldest request
+      // has waited long enough
+      auto deadline = tasks_.front()->arrival +
+                      std::chrono::microseconds(opts_.max_wait_us);
+      task_cond_.wait_until(lock, deadline, [this] {
+        return stop_ || num_queued_frames_ >= opts_.max_batch_frames;
+      });
+      // At least one task, a big task is not split
+      int num_frames = 0;
+      while (!tasks_.empty() &&
+             (batch.empty() || num_frames + tasks_.front()->num_frames <=
+                                   opts_.max_batch_frames)) {
+        num_frames += tasks_.front()->num_frames;
+        batch.push_back(tasks_.front());
+        tasks_.pop_front();
+      }
+      num_queued_frames_ -= num_frames;
+    }
+
+    ComputeBatch(batch);
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (Task* task : batch) {
+        task->done = true;
+      }
+    }
+    done_cond_.notify_all();
+  }
+}
+
+void BatchFbankScheduler::ComputeBatch(const std::vector<Task*>& batch) {
+  WENET_TRACE_SCOPE("fbank_batch");
+  int num_frames = 0;
+  for (const Task* task : batch) {
+    num_frames += task->num_frames;
+  }
+  VLOG(3) << "Compute fbank batch of " << batch.size() << " requests, "
+          << num_frames << " frames";
+  if (computer_ != nullptr) {
+    batch_requests_.clear();
+    for (const Task* task : batch) {
+      for (int i = 0; i < task->num_requests; ++i) {
+        batch_requests_.push_back(&task->requests[i]);
+      }
+    }
+    computer_->Compute(batch_requests_, num_frames);
+    return;
+  }
+  // The power spectrums of all the frames
+  power_.Resize(num_frames, fbank_.num_fft_bins());
+  int row = 0;
+  for (const Task* task : batch) {
+    for (int i = 0; i < task->num_requests; ++i) {
+      const FbankRequest& request = task->requests[i];
+      int n = fbank_.NumFrames(request.num_samples);
+      for (int j = 0; j < n; ++j, ++row) {
+        if (request.float_wave != nullptr) {
+          fbank_.ComputePowerSpectrum(request.float_wave + j * frame_shift_,
+                                      power_.Row(row));
+        } else {
+          fbank_.ComputePowerSpectrum(request.int16_wave + j * frame_shift_,
+                                      power_.Row(row));
+        }
+      }
+    }
+  }
+  // The mel filter bank on the whole batch
+  feats_.Resize(num_frames, num_bins_);
+  fbank_.ComputeMel(power_.data(), power_.stride(), num_frames,
+                    feats_.stride(), feats_.data());
+  // Scatter the frames back
+  row = 0;
+  for (const Task* task : batch) {
+    for (int i = 0; i < task->num_requests; ++i) {
+      const FbankRequest& request = task->requests[i];
+      int n = fbank_.NumFrames(request.num_samples);
+      for (int j = 0; j < n; ++j, ++row) {
+        memcpy(request.feat + j * request.stride, feats_.Row(row),
+               sizeof(float) * num_bins_);
+      }
+    }
+  }
+}
+
+}  // namespace wenet
@@ -0,0 +1,124 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef FRONTEND_BATCH_FBANK_SCHEDULER_H_
+#define FRONTEND_BATCH_FBANK_SCHEDULER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "frontend/fbank.h"
+#include "utils/matrix.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct BatchFbankOptions {
+  // The batch is computed once it has max_batch_frames frames
+  int max_batch_frames = 256;
+  // Max time(us) the first queued request waits for other streams
+  int max_wait_us = 1000;
+};
+
+// Compute the frames of num_samples samples of wave to feat, the i-th frame
+// is written to feat + i * stride, as Fbank::Compute(). One of the wave
+// pointers is set.
+struct FbankRequest {
+  const float* float_wave = nullptr;
+  const int16_t* int16_wave = nullptr;
+  int num_samples = 0;
+  int stride = 0;
+  float* feat = nullptr;
+};
+
+// Computes the frames of a batch of requests instead of the cpu path of
+// BatchFbankScheduler, e.g. on a GPU, see TorchFbankComputer. It must match
+// Fbank of the config of the scheduler, and it's only called by the worker
+// thread of the scheduler.
+class FbankBatchComputer {
+ public:
+  virtual ~FbankBatchComputer() = default;
+  // num_frames is the total number of the frames of the requests
+  virtual void Compute(const std::vector<const FbankRequest*>& requests,
+                       int num_frames) = 0;
+};
+
+// BatchFbankScheduler gathers the fbank requests of many FeaturePipelines
+// and computes them as one batch: the power spectrums of all the frames
+// are computed with the shared fft tables into one matrix, then the mel
+// filter bank is applied on the whole matrix, and the frames are scattered
+// back to the requests. The streams usually send 1 or 2 frames per packet,
+// which is too small to amortize the fft and the mel weights alone.
+// It is thread safe and can be shared by all the pipelines of a server, the
+// pipelines must have the fbank config of the scheduler.
+class BatchFbankScheduler {
+ public:
+  // The batches are computed by computer if it's set
+  BatchFbankScheduler(const BatchFbankOptions& opts, int num_bins,
+                      int sample_rate, int frame_length, int frame_shift,
+                      std::shared_ptr<FbankBatchComputer> computer = nullptr);
+  ~BatchFbankScheduler();
+
+  int num_bins() const { return num_bins_; }
+  int frame_length() const { return frame_length_; }
+  int frame_shift() const { return frame_shift_; }
+
+  // Block until all the requests are computed in some batch
+  void Compute(const FbankRequest* requests, int num_requests);
+
+ private:
+  struct Task {
+    const FbankRequest* requests;
+    int num_requests;
+    int num_frames;
+    std::chrono::steady_clock::time_point arrival;
+    bool done = false;
+  };
+
+  void SchedulerLoop();
+  void ComputeBatch(const std::vector<Task*>& batch);
+
+  const BatchFbankOptions opts_;
+  const int num_bins_;
+  const int frame_length_;
+  const int frame_shift_;
+  // Only used by the worker thread
+  std::shared_ptr<FbankBatchComputer> computer_;
+  std::vector<const FbankRequest*> batch_requests_;
+  Fbank fbank_;
+  Matrix<float> power_;
+  Matrix<float> feats_;
+
+  std::mutex mutex_;
+  std::condition_variable task_cond_;
+  std::condition_variable done_cond_;
+  std::deque<Task*> tasks_;
+  int num_queued_frames_ = 0;
+  bool stop_ = false;
+  std::thread worker_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(BatchFbankScheduler);
+};
+
+}  // namespace wenet
+
+#endif  // FRONTEND_BATCH_FBANK_SCHEDULER_H_
@@ -15,54 +15,46 @@
 #ifndef FRONTEND_FBANK_H_
 #define FRONTEND_FBANK_H_
 
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
 #include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <tuple>
 #include <utility>
 #include <vector>
 
+#include "frontend/fbank_kernels.h"
 #include "frontend/fft.h"
 #include "utils/log.h"
 
 namespace wenet {
 
-// This code is based on kaldi Fbank implentation, please see
-// https://github.com/kaldi-asr/kaldi/blob/master/src/feat/feature-fbank.cc
-class Fbank {
- public:
-  Fbank(int num_bins, int sample_rate, int frame_length, int frame_shift)
-      : num_bins_(num_bins),
-        sample_rate_(sample_rate),
-        frame_length_(frame_length),
-        frame_shift_(frame_shift),
-        use_log_(true),
-        remove_dc_offset_(true),
-        generator_(0),
-        distribution_(0, 1.0),
-        dither_(0.0) {
-    fft_points_ = UpperPowerOfTwo(frame_length_);
-    // generate bit reversal table and trigonometric function table
-    const int fft_points_4 = fft_points_ / 4;
-    bitrev_.resize(fft_points_);
-    sintbl_.resize(fft_points_ + fft_points_4);
-    make_sintbl(fft_points_, sintbl_.data());
-    make_bitrev(fft_points_, bitrev_.data());
-
-    int num_fft_bins = fft_points_ / 2;
-    float fft_bin_width = static_cast<float>(sample_rate_) / fft_points_;
-    int low_freq = 20, high_freq = sample_rate_ / 2;
+// The mel filter bank and the povey window of an Fbank configuration. They
+// are read only after construction, so one FbankTables is shared by all the
+// Fbank of the same configuration, e.g. of all the streams of a server, and
+// a new stream doesn't compute them again.
+struct FbankTables {
+  FbankTables(int num_bins, int sample_rate, int frame_length) {
+    fft_points = UpperPowerOfTwo(frame_length);
+    int num_fft_bins = fft_points / 2;
+    float fft_bin_width = static_cast<float>(sample_rate) / fft_points;
+    int low_freq = 20, high_freq = sample_rate / 2;
     float mel_low_freq = MelScale(low_freq);
     float mel_high_freq = MelScale(high_freq);
     float mel_freq_delta = (mel_high_freq - mel_low_freq) / (num_bins + 1);
-    bins_.resize(num_bins_);
-    center_freqs_.resize(num_bins_);
+    bin_starts.resize(num_bins);
+    bin_offsets.resize(num_bins + 1, 0);
+    center_freqs.resize(num_bins);
     for (int bin = 0; bin < num_bins; ++bin) {
       float left_mel = mel_low_freq + bin * mel_freq_delta,
             center_mel = mel_low_freq + (bin + 1) * mel_freq_delta,
             right_mel = mel_low_freq + (bin + 2) * mel_freq_delta;
-      center_freqs_[bin] = InverseMelScale(center_mel);
-      std::vector<float> this_bin(num_fft_bins);
-      int first_index = -1, last_index = -1;
+      center_freqs[bin] = InverseMelScale(center_mel);
+      int first_index = -1;
       for (int i = 0; i < num_fft_bins; ++i) {
         float freq = (fft_bin_width * i);  // Center frequency of this fft
         // bin.
@@ -73,26 +65,85 @@ class Fbank {
             weight = (mel - left_mel) / (center_mel - left_mel);
           else
             weight = (right_mel - mel) / (right_mel - center_mel);
-          this_bin[i] = weight;
+          weights.push_back(weight);
           if (first_index == -1) first_index = i;
-          last_index = i;
         }
       }
-      CHECK(first_index != -1 && last_index >= first_index);
-      bins_[bin].first = first_index;
-      int size = last_index + 1 - first_index;
-      bins_[bin].second.resize(size);
-      for (int i = 0; i < size; ++i) {
-        bins_[bin].second[i] = this_bin[first_index + i];
-      }
+      CHECK(first_index != -1);
+      bin_starts[bin] = first_index;
+      bin_offsets[bin + 1] = weights.size();
     }
 
     // povey window
-    povey_window_.resize(frame_length_);
+    povey_window.resize(frame_length);
     double a = M_2PI / (frame_length - 1);
     for (int i = 0; i < frame_length; ++i) {
-      povey_window_[i] = pow(0.5 - 0.5 * cos(a * i), 0.85);
+      povey_window[i] = pow(0.5 - 0.5 * cos(a * i), 0.85);
+    }
+  }
+
+  static std::shared_ptr<const FbankTables> Get(int num_bins,
+                                                int sample_rate,
+                                                int frame_length) {
+    static std::mutex mutex;
+    static std::map<std::tuple<int, int, int>,
+                    std::shared_ptr<const FbankTables>> cache;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& tables = cache[std::make_tuple(num_bins, sample_rate, frame_length)];
+    if (tables == nullptr) {
+      tables = std::make_shared<const FbankTables>(num_bins, sample_rate,
+                                                   frame_length);
     }
+    return tables;
+  }
+
+  static inline float InverseMelScale(float mel_freq) {
+    return 700.0f * (expf(mel_freq / 1127.0f) - 1.0f);
+  }
+
+  static inline float MelScale(float freq) {
+    return 1127.0f * logf(1.0f + freq / 700.0f);
+  }
+
+  static int UpperPowerOfTwo(int n) {
+    return static_cast<int>(pow(2, ceil(log(n) / log(2))));
+  }
+
+  int fft_points;
+  std::vector<float> center_freqs;
+  // The weights of all the bins in one array, the ones of bin j are
+  // weights[bin_offsets[j], bin_offsets[j + 1]) and apply to the fft bins
+  // from bin_starts[j]
+  std::vector<int> bin_starts;
+  std::vector<int> bin_offsets;
+  std::vector<float> weights;
+  std::vector<float> povey_window;
+};
+
+// This code is based on kaldi Fbank implentation, please see
+// https://github.com/kaldi-asr/kaldi/blob/master/src/feat/feature-fbank.cc
+class Fbank {
+ public:
+  Fbank(int num_bins, int sample_rate, int frame_length, int frame_shift)
+      : num_bins_(num_bins),
+        sample_rate_(sample_rate),
+        frame_length_(frame_length),
+        frame_shift_(frame_shift),
+        use_log_(true),
+        remove_dc_offset_(true),
+        generator_(0),
+        distribution_(0, 1.0),
+        dither_(0.0),
+        kernels_(&GetFbankKernels()),
+        tables_(FbankTables::Get(num_bins, sample_rate, frame_length)) {
+    fft_points_ = tables_->fft_points;
+    // the fft tables are shared by all the Fbank of the same fft points
+    fft_ = RealFft::Get(fft_points_);
+    frame_.resize(frame_length_);
+    fft_input_.resize(fft_points_, 0);
+    fft_real_.resize(fft_points_ / 2);
+    fft_img_.resize(fft_points_ / 2);
+    power_.resize(fft_points_ / 2);
   }
 
   void set_use_log(bool use_log) { use_log_ = use_log; }
@@ -103,116 +154,184 @@ class Fbank {
 
   void set_dither(float dither) { dither_ = dither; }
 
+  // Override the kernels picked by the cpu features, e.g. for parity tests
+  void set_kernels(const FbankKernels& kernels) { kernels_ = &kernels; }
+
   int num_bins() const { return num_bins_; }
+  int frame_length() const { return frame_length_; }
+  int frame_shift() const { return frame_shift_; }
+  int fft_points() const { return fft_points_; }
+  bool use_log() const { return use_log_; }
+  bool remove_dc_offset() const { return remove_dc_offset_; }
+  const std::vector<float>& povey_window() const {
+    return tables_->povey_window;
+  }
+
+  // The mel filter bank as a dense (num_fft_bins(), num_bins) row major
+  // matrix, e.g. to apply it by one GEMM on a GPU
+  void MelMatrix(std::vector<float>* matrix) const {
+    matrix->assign(static_cast<size_t>(num_fft_bins()) * num_bins_, 0.0f);
+    for (int j = 0; j < num_bins_; ++j) {
+      int start = tables_->bin_starts[j];
+      for (int k = tables_->bin_offsets[j]; k < tables_->bin_offsets[j + 1];
+           ++k) {
+        (*matrix)[(start++) * num_bins_ + j] = tables_->weights[k];
+      }
+    }
+  }
 
   static inline float InverseMelScale(float mel_freq) {
-    return 700.0f * (expf(mel_freq / 1127.0f) - 1.0f);
+    return FbankTables::InverseMelScale(mel_freq);
   }
 
   static inline float MelScale(float freq) {
-    return 1127.0f * logf(1.0f + freq / 700.0f);
+    return FbankTables::MelScale(freq);
   }
 
   static int UpperPowerOfTwo(int n) {
-    return static_cast<int>(pow(2, ceil(log(n) / log(2))));
+    return FbankTables::UpperPowerOfTwo(n);
   }
 
   // preemphasis
   void PreEmphasis(float coeff, std::vector<float>* data) const {
     if (coeff == 0.0) return;
-    for (int i = data->size() - 1; i > 0; i--)
-      (*data)[i] -= coeff * (*data)[i - 1];
-    (*data)[0] -= coeff * (*data)[0];
+    kernels_->PreEmphasis(coeff, data->data(), data->size());
   }
 
   // Apply povey window on data in place
   void Povey(std::vector<float>* data) const {
-    CHECK_GE(data->size(), povey_window_.size());
-    for (size_t i = 0; i < povey_window_.size(); ++i) {
-      (*data)[i] *= povey_window_[i];
-    }
+    const std::vector<float>& window = tables_->povey_window;
+    CHECK_GE(data->size(), window.size());
+    kernels_->Mul(window.data(), data->data(), window.size());
+  }
+
+  // Number of frames in `num_samples` samples
+  int NumFrames(int num_samples) const {
+    if (num_samples < frame_length_) return 0;
+    return 1 + ((num_samples - frame_length_) / frame_shift_);
   }
 
   // Compute fbank feat, return num frames
   int Compute(const std::vector<float>& wave,
               std::vector<std::vector<float>>* feat) {
-    int num_samples = wave.size();
-    if (num_samples < frame_length_) return 0;
-    int num_frames = 1 + ((num_samples - frame_length_) / frame_shift_);
+    int num_frames = NumFrames(wave.size());
     feat->resize(num_frames);
-    std::vector<float> fft_real(fft_points_, 0), fft_img(fft_points_, 0);
-    std::vector<float> power(fft_points_ / 2);
     for (int i = 0; i < num_frames; ++i) {
-      std::vector<float> data(wave.data() + i * frame_shift_,
-                              wave.data() + i * frame_shift_ + frame_length_);
-      // optional add noise
-      if (dither_ != 0.0) {
-        for (size_t j = 0; j < data.size(); ++j)
-          data[j] += dither_ * distribution_(generator_);
-      }
-      // optinal remove dc offset
-      if (remove_dc_offset_) {
-        float mean = 0.0;
-        for (size_t j = 0; j < data.size(); ++j) mean += data[j];
-        mean /= data.size();
-        for (size_t j = 0; j < data.size(); ++j) data[j] -= mean;
-      }
+      (*feat)[i].resize(num_bins_);
+      ComputeFrame(wave.data() + i * frame_shift_, (*feat)[i].data());
+    }
+    return num_frames;
+  }
 
-      PreEmphasis(0.97, &data);
-      Povey(&data);
-      // copy data to fft_real
-      memset(fft_img.data(), 0, sizeof(float) * fft_points_);
-      memset(fft_real.data() + frame_length_, 0,
-             sizeof(float) * (fft_points_ - frame_length_));
-      memcpy(fft_real.data(), data.data(), sizeof(float) * frame_length_);
-      fft(bitrev_.data(), sintbl_.data(), fft_real.data(), fft_img.data(),
-          fft_points_);
-      // power
-      for (int j = 0; j < fft_points_ / 2; ++j) {
-        power[j] = fft_real[j] * fft_real[j] + fft_img[j] * fft_img[j];
-      }
+  // Same as above, but the frames are written to the caller's buffer, the
+  // i-th frame starts at feat + i * stride. Only the scratch buffers of this
+  // object are used, so there is no allocation. The wave is float or 16 bits
+  // PCM, the PCM samples are converted while each frame is loaded.
+  template <typename T>
+  int Compute(const T* wave, int num_samples, int stride, float* feat) {
+    CHECK_GE(stride, num_bins_);
+    int num_frames = NumFrames(num_samples);
+    for (int i = 0; i < num_frames; ++i) {
+      ComputeFrame(wave + i * frame_shift_, feat + i * stride);
+    }
+    return num_frames;
+  }
 
-      (*feat)[i].resize(num_bins_);
-      // cepstral coefficients, triangle filter array
-      for (int j = 0; j < num_bins_; ++j) {
-        float mel_energy = 0.0;
-        int s = bins_[j].first;
-        for (size_t k = 0; k < bins_[j].second.size(); ++k) {
-          mel_energy += bins_[j].second[k] * power[s + k];
-        }
+  // Convert n samples of float or 16 bits PCM to float
+  void CopySamples(const float* x, int n, float* y) const {
+    std::copy(x, x + n, y);
+  }
+  void CopySamples(const int16_t* x, int n, float* y) const {
+    kernels_->Int16ToFloat(x, y, n);
+  }
+
+  // Number of the power spectrum bins of a frame
+  int num_fft_bins() const { return fft_points_ / 2; }
+
+  // The two stages of Compute(), they are public so the frames of many
+  // streams could be computed in one batch, see BatchFbankScheduler.
+  // Compute the power spectrum of one frame of frame_length_ samples from
+  // `wave` to `power`, which has num_fft_bins() bins.
+  template <typename T>
+  void ComputePowerSpectrum(const T* wave, float* power) {
+    CopySamples(wave, frame_length_, frame_.data());
+    // optional add noise
+    if (dither_ != 0.0) {
+      for (size_t j = 0; j < frame_.size(); ++j)
+        frame_[j] += dither_ * distribution_(generator_);
+    }
+    // optinal remove dc offset
+    if (remove_dc_offset_) {
+      float mean = kernels_->Sum(frame_.data(), frame_.size()) / frame_.size();
+      kernels_->Add(-mean, frame_.data(), frame_.size());
+    }
+
+    PreEmphasis(0.97, &frame_);
+    Povey(&frame_);
+    // copy data to fft_input_, the tail stays zero padded
+    memcpy(fft_input_.data(), frame_.data(), sizeof(float) * frame_length_);
+    fft_->Compute(fft_input_.data(), fft_real_.data(), fft_img_.data());
+    // power
+    kernels_->PowerSpectrum(fft_real_.data(), fft_img_.data(), power,
+                            fft_points_ / 2);
+  }
+
+  // Apply the mel filter bank on num_frames power spectrums, the i-th starts
+  // at power + i * power_stride, and write the i-th frame to
+  // feat + i * stride. The filter bank is a sparse matrix, it's applied bin
+  // by bin over all the frames, so the weights of a bin are loaded once.
+  void ComputeMel(const float* power, int power_stride, int num_frames,
+                  int stride, float* feat) const {
+    // cepstral coefficients, triangle filter array
+    const int* offsets = tables_->bin_offsets.data();
+    for (int j = 0; j < num_bins_; ++j) {
+      int s = tables_->bin_starts[j];
+      const float* weights = tables_->weights.data() + offsets[j];
+      int size = offsets[j + 1] - offsets[j];
+      for (int i = 0; i < num_frames; ++i) {
+        float mel_energy = kernels_->Dot(weights, power + i * power_stride + s,
+                                         size);
         // optional use log
         if (use_log_) {
           if (mel_energy < std::numeric_limits<float>::epsilon())
             mel_energy = std::numeric_limits<float>::epsilon();
           mel_energy = logf(mel_energy);
         }
-
-        (*feat)[i][j] = mel_energy;
-        // printf("%f ", mel_energy);
+        feat[i * stride + j] = mel_energy;
       }
-      // printf("\n");
     }
-    return num_frames;
   }
 
  private:
+  // Compute one frame of frame_length_ samples from `wave` to `feat`
+  template <typename T>
+  void ComputeFrame(const T* wave, float* feat) {
+    ComputePowerSpectrum(wave, power_.data());
+    ComputeMel(power_.data(), 0, 1, 0, feat);
+  }
+
   int num_bins_;
   int sample_rate_;
   int frame_length_, frame_shift_;
   int fft_points_;
   bool use_log_;
   bool remove_dc_offset_;
-  std::vector<float> center_freqs_;
-  std::vector<std::pair<int, std::vector<float>>> bins_;
-  std::vector<float> povey_window_;
   std::default_random_engine generator_;
   std::normal_distribution<float> distribution_;
   float dither_;
+  // SIMD kernels of the current cpu
+  const FbankKernels* kernels_;
+  // mel filter bank and povey window, shared with the other Fbank
+  std::shared_ptr<const FbankTables> tables_;
+  // real input fft, shared with the other Fbank
+  std::shared_ptr<const RealFft> fft_;
 
-  // bit reversal table
-  std::vector<int> bitrev_;
-  // trigonometric function table
-  std::vector<float> sintbl_;
+  // scratch buffers of ComputeFrame()
+  std::vector<float> frame_;
+  std::vector<float> fft_input_;
+  std::vector<float> fft_real_;
+  std::vector<float> fft_img_;
+  std::vector<float> power_;
 };
 
 }  // namespace wenet
@@ -0,0 +1,494 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "frontend/fbank_kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WENET_FBANK_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define WENET_FBANK_NEON
+#include <arm_neon.h>
+#endif
+
+#include "utils/log.h"
+
+namespace wenet {
+
+// Scalar kernels, the reference of the others
+
+static float SumScalar(const float* x, int n) {
+  float sum = 0.0;
+  for (int i = 0; i < n; ++i) sum += x[i];
+  return sum;
+}
+
+static void AddScalar(float value, float* x, int n) {
+  for (int i = 0; i < n; ++i) x[i] += value;
+}
+
+static void PreEmphasisScalar(float coeff, float* x, int n) {
+  for (int i = n - 1; i > 0; --i) x[i] -= coeff * x[i - 1];
+  x[0] -= coeff * x[0];
+}
+
+static void MulScalar(const float* w, float* x, int n) {
+  for (int i = 0; i < n; ++i) x[i] *= w[i];
+}
+
+static void PowerSpectrumScalar(const float* re, const float* im,
+                                float* power, int n) {
+  for (int i = 0; i < n; ++i) power[i] = re[i] * re[i] + im[i] * im[i];
+}
+
+static float DotScalar(const float* a, const float* b, int n) {
+  float sum = 0.0;
+  for (int i = 0; i < n; ++i) sum += a[i] * b[i];
+  return sum;
+}
+
+static void Int16ToFloatScalar(const int16_t* x, float* y, int n) {
+  for (int i = 0; i < n; ++i) y[i] = x[i];
+}
+
+#ifdef WENET_FBANK_X86
+
+// No FMA in the element wise kernels, so they round as the scalar ones
+
+#define WENET_AVX2 __attribute__((target("avx2,fma")))
+
+WENET_AVX2 static float HorizontalSum(__m256 v) {
+  __m128 lo = _mm256_castps256_ps128(v);
+  __m128 hi = _mm256_extractf128_ps(v, 1);
+  lo = _mm_add_ps(lo, hi);
+  lo = _mm_hadd_ps(lo, lo);
+  lo = _mm_hadd_ps(lo, lo);
+  return _mm_cvtss_f32(lo);
+}
+
+WENET_AVX2 static float SumAvx2(const float* x, int n) {
+  __m256 acc = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) acc = _mm256_add_ps(acc, _mm256_loadu_ps(x + i));
+  float sum = HorizontalSum(acc);
+  for (; i < n; ++i) sum += x[i];
+  return sum;
+}
+
+WENET_AVX2 static void AddAvx2(float value, float* x, int n) {
+  __m256 v = _mm256_set1_ps(value);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(x + i, _mm256_add_ps(_mm256_loadu_ps(x + i), v));
+  }
+  for (; i < n; ++i) x[i] += value;
+}
+
+WENET_AVX2 static void PreEmphasisAvx2(float coeff, float* x, int n) {
+  // From the end, x[i - 8, i) and x[i - 9, i - 1) are loaded before x[i - 8,
+  // i) is stored, and the lower blocks are not touched yet
+  __m256 c = _mm256_set1_ps(coeff);
+  int i = n;
+  for (; i - 8 >= 1; i -= 8) {
+    __m256 cur = _mm256_loadu_ps(x + i - 8);
+    __m256 prev = _mm256_loadu_ps(x + i - 9);
+    _mm256_storeu_ps(x + i - 8, _mm256_sub_ps(cur, _mm256_mul_ps(c, prev)));
+  }
+  for (--i; i > 0; --i) x[i] -= coeff * x[i - 1];
+  x[0] -= coeff * x[0];
+}
+
+WENET_AVX2 static void MulAvx2(const float* w, float* x, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_loadu_ps(x + i),
+                                          _mm256_loadu_ps(w + i)));
+  }
+  for (; i < n; ++i) x[i] *= w[i];
+}
+
+WENET_AVX2 static void PowerSpectrumAvx2(const float* re, const float* im,
+                                         float* power, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 r = _mm256_loadu_ps(re + i);
+    __m256 m = _mm256_loadu_ps(im + i);
+    _mm256_storeu_ps(power + i, _mm256_add_ps(_mm256_mul_ps(r, r),
+                                              _mm256_mul_ps(m, m)));
+  }
+  for (; i < n; ++i) power[i] = re[i] * re[i] + im[i] * im[i];
+}
+
+WENET_AVX2 static float DotAvx2(const float* a, const float* b, int n) {
+  __m256 acc = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i),
+                          acc);
+  }
+  float sum = HorizontalSum(acc);
+  for (; i < n; ++i) sum += a[i] * b[i];
+  return sum;
+}
+
+WENET_AVX2 static void Int16ToFloatAvx2(const int16_t* x, float* y, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i));
+    _mm256_storeu_ps(y + i, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v)));
+  }
+  for (; i < n; ++i) y[i] = x[i];
+}
+
+#define WENET_AVX512 __attribute__((target("avx512f")))
+
+WENET_AVX512 static float SumAvx512(const float* x, int n) {
+  __m512 acc = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    acc = _mm512_add_ps(acc, _mm512_loadu_ps(x + i));
+  }
+  float sum = _mm512_reduce_add_ps(acc);
+  for (; i < n; ++i) sum += x[i];
+  return sum;
+}
+
+WENET_AVX512 static void AddAvx512(float value, float* x, int n) {
+  __m512 v = _mm512_set1_ps(value);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm512_storeu_ps(x + i, _mm512_add_ps(_mm512_loadu_ps(x + i), v));
+  }
+  for (; i < n; ++i) x[i] += value;
+}
+
+WENET_AVX512 static void PreEmphasisAvx512(float coeff, float* x, int n) {
+  __m512 c = _mm512_set1_ps(coeff);
+  int i = n;
+  for (; i - 16 >= 1; i -= 16) {
+    __m512 cur = _mm512_loadu_ps(x + i - 16);
+    __m512 prev = _mm512_loadu_ps(x + i - 17);
+    _mm512_storeu_ps(x + i - 16, _mm512_sub_ps(cur, _mm512_mul_ps(c, prev)));
+  }
+  for (--i; i > 0; --i) x[i] -= coeff * x[i - 1];
+  x[0] -= coeff * x[0];
+}
+
+WENET_AVX512 static void MulAvx512(const float* w, float* x, int n) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm512_storeu_ps(x + i, _mm512_mul_ps(_mm512_loadu_ps(x + i),
+                                          _mm512_loadu_ps(w + i)));
+  }
+  for (; i < n; ++i) x[i] *= w[i];
+}
+
+WENET_AVX512 static void PowerSpectrumAvx512(const float* re, const float* im,
+                                             float* power, int n) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 r = _mm512_loadu_ps(re + i);
+    __m512 m = _mm512_loadu_ps(im + i);
+    _mm512_storeu_ps(power + i, _mm512_add_ps(_mm512_mul_ps(r, r),
+                                              _mm512_mul_ps(m, m)));
+  }
+  for (; i < n; ++i) power[i] = re[i] * re[i] + im[i] * im[i];
+}
+
+WENET_AVX512 static float DotAvx512(const float* a, const float* b, int n) {
+  __m512 acc = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    acc = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i),
+                          acc);
+  }
+  float sum = _mm512_reduce_add_ps(acc);
+  for (; i < n; ++i) sum += a[i] * b[i];
+  return sum;
+}
+
+WENET_AVX512 static void Int16ToFloatAvx512(const int16_t* x, float* y,
+                                            int n) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i));
+    _mm512_storeu_ps(y + i, _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(v)));
+  }
+  for (; i < n; ++i) y[i] = x[i];
+}
+
+#endif  // WENET_FBANK_X86
+
+#ifdef WENET_FBANK_NEON
+
+static float HorizontalSum(float32x4_t v) {
+  float32x2_t s = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+  return vget_lane_f32(vpadd_f32(s, s), 0);
+}
+
+static float SumNeon(const float* x, int n) {
+  float32x4_t acc = vdupq_n_f32(0);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) acc = vaddq_f32(acc, vld1q_f32(x + i));
+  float sum = HorizontalSum(acc);
+  for (; i < n; ++i) sum += x[i];
+  return sum;
+}
+
+static void AddNeon(float value, float* x, int n) {
+  float32x4_t v = vdupq_n_f32(value);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) vst1q_f32(x + i, vaddq_f32(vld1q_f32(x + i), v));
+  for (; i < n; ++i) x[i] += value;
+}
+
+static void PreEmphasisNeon(float coeff, float* x, int n) {
+  float32x4_t c = vdupq_n_f32(coeff);
+  int i = n;
+  for (; i - 4 >= 1; i -= 4) {
+    float32x4_t cur = vld1q_f32(x + i - 4);
+    float32x4_t prev = vld1q_f32(x + i - 5);
+    vst1q_f32(x + i - 4, vsubq_f32(cur, vmulq_f32(c, prev)));
+  }
+  for (--i; i > 0; --i) x[i] -= coeff * x[i - 1];
+  x[0] -= coeff * x[0];
+}
+
+static void MulNeon(const float* w, float* x, int n) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    vst1q_f32(x + i, vmulq_f32(vld1q_f32(x + i), vld1q_f32(w + i)));
+  }
+  for (; i < n; ++i) x[i] *= w[i];
+}
+
+static void PowerSpectrumNeon(const float* re, const float* im, float* power,
+                              int n) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t r = vld1q_f32(re + i);
+    float32x4_t m = vld1q_f32(im + i);
+    vst1q_f32(power + i, vaddq_f32(vmulq_f32(r, r), vmulq_f32(m, m)));
+  }
+  for (; i < n; ++i) power[i] = re[i] * re[i] + im[i] * im[i];
+}
+
+static float DotNeon(const float* a, const float* b, int n) {
+  float32x4_t acc = vdupq_n_f32(0);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+  }
+  float sum = HorizontalSum(acc);
+  for (; i < n; ++i) sum += a[i] * b[i];
+  return sum;
+}
+
+static void Int16ToFloatNeon(const int16_t* x, float* y, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t v = vld1q_s16(x + i);
+    vst1q_f32(y + i, vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))));
+    vst1q_f32(y + i + 4, vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))));
+  }
+  for (; i < n; ++i) y[i] = x[i];
+}
+
+#endif  // WENET_FBANK_NEON
+
+const FbankKernels& GetScalarFbankKernels() {
+  static const FbankKernels kernels = {
+      "scalar", SumScalar, AddScalar, PreEmphasisScalar,
+      MulScalar, PowerSpectrumScalar, DotScalar, Int16ToFloatScalar};
+  return kernels;
+}
+
+static const FbankKernels& SelectFbankKernelsImpl() {
+#ifdef WENET_FBANK_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    static const FbankKernels kernels = {
+        "avx512", SumAvx512, AddAvx512, PreEmphasisAvx512,
+        MulAvx512, PowerSpectrumAvx512, DotAvx512, Int16ToFloatAvx512};
+    return kernels;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    static const FbankKernels kernels = {
+        "avx2", SumAvx2, AddAvx2, PreEmphasisAvx2,
+        MulAvx2, PowerSpectrumAvx2, DotAvx2, Int16ToFloatAvx2};
+    return kernels;
+  }
+#endif
+#ifdef WENET_FBANK_NEON
+  static const FbankKernels kernels = {
+      "neon", SumNeon, AddNeon, PreEmphasisNeon,
+      MulNeon, PowerSpectrumNeon, DotNeon, Int16ToFloatNeon};
+  return kernels;
+#endif
+  return GetScalarFbankKernels();
+}
+
+static const FbankKernels& SelectFbankKernels() {
+  const FbankKernels& kernels = SelectFbankKernelsImpl();
+  VLOG(1) << "Fbank kernels: " << kernels.name;
+  return kernels;
+}
+
+const FbankKernels& GetFbankKernels() {
+  static const FbankKernels& kernels = SelectFbankKernels();
+  return kernels;
+}
+
+// Fixed point kernels
+
+static inline int32_t MulQ31(int32_t a, int32_t b) {
+  return static_cast<int32_t>(
+      (static_cast<int64_t>(a) * b + (INT64_C(1) << 30)) >> 31);
+}
+
+static void FixedPreEmphasisScalar(int32_t coeff, int32_t* x, int n) {
+  for (int i = n - 1; i > 0; --i) x[i] -= MulQ31(coeff, x[i - 1]);
+  x[0] -= MulQ31(coeff, x[0]);
+}
+
+static void FixedMulScalar(const int32_t* w, int32_t* x, int n) {
+  for (int i = 0; i < n; ++i) x[i] = MulQ31(x[i], w[i]);
+}
+
+static void FixedButterflyScalar(const int32_t* wr, const int32_t* wi,
+                                 int32_t* ar, int32_t* ai, int32_t* br,
+                                 int32_t* bi, int n) {
+  for (int i = 0; i < n; ++i) {
+    int64_t tr = MulQ31(br[i], wr[i]) - MulQ31(bi[i], wi[i]);
+    int64_t ti = MulQ31(br[i], wi[i]) + MulQ31(bi[i], wr[i]);
+    int64_t r = ar[i], m = ai[i];
+    ar[i] = static_cast<int32_t>((r + tr) >> 1);
+    ai[i] = static_cast<int32_t>((m + ti) >> 1);
+    br[i] = static_cast<int32_t>((r - tr) >> 1);
+    bi[i] = static_cast<int32_t>((m - ti) >> 1);
+  }
+}
+
+static void FixedPowerSpectrumScalar(const int32_t* re, const int32_t* im,
+                                     uint64_t* power, int n) {
+  for (int i = 0; i < n; ++i) {
+    power[i] = static_cast<uint64_t>(static_cast<int64_t>(re[i]) * re[i] +
+                                     static_cast<int64_t>(im[i]) * im[i]);
+  }
+}
+
+static void FixedDotScalar(const uint32_t* w, const uint64_t* p, int n,
+                           uint64_t* hi, uint64_t* lo) {
+  const uint64_t mask = (UINT64_C(1) << 31) - 1;
+  uint64_t h = 0, l = 0;
+  for (int i = 0; i < n; ++i) {
+    h += static_cast<uint64_t>(w[i]) * (p[i] >> 31);
+    l += static_cast<uint64_t>(w[i]) * (p[i] & mask);
+  }
+  *hi = h;
+  *lo = l;
+}
+
+#ifdef WENET_FBANK_NEON
+
+static void FixedPreEmphasisNeon(int32_t coeff, int32_t* x, int n) {
+  int32x4_t c = vdupq_n_s32(coeff);
+  int i = n;
+  for (; i - 4 >= 1; i -= 4) {
+    int32x4_t cur = vld1q_s32(x + i - 4);
+    int32x4_t prev = vld1q_s32(x + i - 5);
+    vst1q_s32(x + i - 4, vsubq_s32(cur, vqrdmulhq_s32(prev, c)));
+  }
+  for (--i; i > 0; --i) x[i] -= MulQ31(coeff, x[i - 1]);
+  x[0] -= MulQ31(coeff, x[0]);
+}
+
+static void FixedMulNeon(const int32_t* w, int32_t* x, int n) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    vst1q_s32(x + i, vqrdmulhq_s32(vld1q_s32(x + i), vld1q_s32(w + i)));
+  }
+  for (; i < n; ++i) x[i] = MulQ31(x[i], w[i]);
+}
+
+static void FixedButterflyNeon(const int32_t* wr, const int32_t* wi,
+                               int32_t* ar, int32_t* ai, int32_t* br,
+                               int32_t* bi, int n) {
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    int32x4_t vwr = vld1q_s32(wr + i), vwi = vld1q_s32(wi + i);
+    int32x4_t vbr = vld1q_s32(br + i), vbi = vld1q_s32(bi + i);
+    int32x4_t var = vld1q_s32(ar + i), vai = vld1q_s32(ai + i);
+    int32x4_t tr =
+        vsubq_s32(vqrdmulhq_s32(vbr, vwr), vqrdmulhq_s32(vbi, vwi));
+    int32x4_t ti =
+        vaddq_s32(vqrdmulhq_s32(vbr, vwi), vqrdmulhq_s32(vbi, vwr));
+    vst1q_s32(ar + i, vhaddq_s32(var, tr));
+    vst1q_s32(ai + i, vhaddq_s32(vai, ti));
+    vst1q_s32(br + i, vhsubq_s32(var, tr));
+    vst1q_s32(bi + i, vhsubq_s32(vai, ti));
+  }
+  FixedButterflyScalar(wr + i, wi + i, ar + i, ai + i, br + i, bi + i,
+                       n - i);
+}
+
+static void FixedPowerSpectrumNeon(const int32_t* re, const int32_t* im,
+                                   uint64_t* power, int n) {
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    int32x2_t r = vld1_s32(re + i), m = vld1_s32(im + i);
+    int64x2_t p = vmlal_s32(vmull_s32(r, r), m, m);
+    vst1q_u64(power + i, vreinterpretq_u64_s64(p));
+  }
+  FixedPowerSpectrumScalar(re + i, im + i, power + i, n - i);
+}
+
+static void FixedDotNeon(const uint32_t* w, const uint64_t* p, int n,
+                         uint64_t* hi, uint64_t* lo) {
+  const uint64x2_t mask = vdupq_n_u64((UINT64_C(1) << 31) - 1);
+  uint64x2_t h = vdupq_n_u64(0), l = vdupq_n_u64(0);
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    uint64x2_t v = vld1q_u64(p + i);
+    uint32x2_t vw = vld1_u32(w + i);
+    h = vmlal_u32(h, vshrn_n_u64(v, 31), vw);
+    l = vmlal_u32(l, vmovn_u64(vandq_u64(v, mask)), vw);
+  }
+  FixedDotScalar(w + i, p + i, n - i, hi, lo);
+  *hi += vgetq_lane_u64(h, 0) + vgetq_lane_u64(h, 1);
+  *lo += vgetq_lane_u64(l, 0) + vgetq_lane_u64(l, 1);
+}
+
+#endif  // WENET_FBANK_NEON
+
+const FixedFbankKernels& GetScalarFixedFbankKernels() {
+  static const FixedFbankKernels kernels = {
+      "scalar", FixedPreEmphasisScalar, FixedMulScalar, FixedButterflyScalar,
+      FixedPowerSpectrumScalar, FixedDotScalar};
+  return kernels;
+}
+
+const FixedFbankKernels& GetFixedFbankKernels() {
+#ifdef WENET_FBANK_NEON
+  static const FixedFbankKernels kernels = {
+      "neon", FixedPreEmphasisNeon, FixedMulNeon, FixedButterflyNeon,
+      FixedPowerSpectrumNeon, FixedDotNeon};
+  return kernels;
+#else
+  return GetScalarFixedFbankKernels();
+#endif
+}
+
+}  // namespace wenet
@@ -0,0 +1,79 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef FRONTEND_FBANK_KERNELS_H_
+#define FRONTEND_FBANK_KERNELS_H_
+
+#include <cstdint>
+
+namespace wenet {
+
+// The vector kernels of Fbank::Compute. GetFbankKernels() picks the
+// AVX-512, AVX2 or NEON implementation by the cpu features at runtime, and
+// the scalar one is the fallback. Mul, PreEmphasis, PowerSpectrum and
+// Int16ToFloat are bit exact to the scalar ones, Sum and Dot differ in the
+// summation order.
+struct FbankKernels {
+  const char* name;
+  // Return sum(x[0:n])
+  float (*Sum)(const float* x, int n);
+  // x[i] += value
+  void (*Add)(float value, float* x, int n);
+  // x[i] -= coeff * x[i - 1], x[0] -= coeff * x[0], in place
+  void (*PreEmphasis)(float coeff, float* x, int n);
+  // x[i] *= w[i]
+  void (*Mul)(const float* w, float* x, int n);
+  // power[i] = re[i] * re[i] + im[i] * im[i]
+  void (*PowerSpectrum)(const float* re, const float* im, float* power,
+                        int n);
+  // Return sum(a[i] * b[i])
+  float (*Dot)(const float* a, const float* b, int n);
+  // y[i] = x[i], 16 bits PCM to float
+  void (*Int16ToFloat)(const int16_t* x, float* y, int n);
+};
+
+const FbankKernels& GetFbankKernels();
+const FbankKernels& GetScalarFbankKernels();
+
+// The integer kernels of FixedFbank, MulQ31(a, b) is round(a * b / 2^31) as
+// the NEON vqrdmulh. GetFixedFbankKernels() picks the NEON implementation,
+// which is bit exact to the scalar one, on arm, and the scalar one elsewhere
+// since the float Fbank is faster on x86.
+struct FixedFbankKernels {
+  const char* name;
+  // x[i] -= MulQ31(coeff, x[i - 1]), x[0] -= MulQ31(coeff, x[0]), in place
+  void (*PreEmphasis)(int32_t coeff, int32_t* x, int n);
+  // x[i] = MulQ31(x[i], w[i])
+  void (*Mul)(const int32_t* w, int32_t* x, int n);
+  // The radix-2 butterflies of a block floating point FFT stage, t = b[i] *
+  // w[i] in complex, a[i] = (a[i] + t) >> 1 and b[i] = (a[i] - t) >> 1, so
+  // the magnitudes never grow
+  void (*Butterfly)(const int32_t* wr, const int32_t* wi, int32_t* ar,
+                    int32_t* ai, int32_t* br, int32_t* bi, int n);
+  // power[i] = re[i] * re[i] + im[i] * im[i], re and im are below 2^30.5
+  void (*PowerSpectrum)(const int32_t* re, const int32_t* im,
+                        uint64_t* power, int n);
+  // hi = sum(w[i] * (p[i] >> 31)) and lo = sum(w[i] * (p[i] & (2^31 - 1))),
+  // so the 62 bits power times the Q15 weights doesn't overflow
+  void (*Dot)(const uint32_t* w, const uint64_t* p, int n, uint64_t* hi,
+              uint64_t* lo);
+};
+
+const FixedFbankKernels& GetFixedFbankKernels();
+const FixedFbankKernels& GetScalarFixedFbankKernels();
+
+}  // namespace wenet
+
+#endif  // FRONTEND_FBANK_KERNELS_H_
@@ -0,0 +1,231 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "frontend/feature_io.h"
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include "utils/log.h"
+#include "utils/string.h"
+
+namespace wenet {
+
+// Split "ark,scp:a.ark,a.scp" into the types {"ark", "scp"} and the paths
+// {"a.ark", "a.scp"}, the options of Kaldi like "s" and "cs" are ignored
+static bool ParseSpecifier(const std::string& specifier,
+                           std::vector<std::string>* types,
+                           std::vector<std::string>* paths) {
+  size_t colon = specifier.find(':');
+  if (colon == std::string::npos) return false;
+  std::vector<std::string> options;
+  SplitStringToVector(specifier.substr(0, colon), ",", true, &options);
+  types->clear();
+  for (const auto& option : options) {
+    if (option == "ark" || option == "scp") types->push_back(option);
+  }
+  SplitStringToVector(specifier.substr(colon + 1), ",", true, paths);
+  return !types->empty() && types->size() == paths->size();
+}
+
+bool FeatureReader::Open(const std::string& rspecifier) {
+  std::vector<std::string> types, paths;
+  if (!ParseSpecifier(rspecifier, &types, &paths) || types.size() != 1) {
+    LOG(ERROR) << "Invalid rspecifier " << rspecifier;
+    return false;
+  }
+  is_script_ = types[0] == "scp";
+  done_ = false;
+  if (is_script_) {
+    script_.open(paths[0]);
+    if (!script_) {
+      LOG(ERROR) << "Failed to open " << paths[0];
+      return false;
+    }
+  } else {
+    archive_ = GetArchive(paths[0]);
+    if (archive_ == nullptr) return false;
+    pos_ = 0;
+  }
+  Next();
+  return true;
+}
+
+const MappedFile* FeatureReader::GetArchive(const std::string& path) {
+  auto it = archives_.find(path);
+  if (it == archives_.end()) {
+    it = archives_.emplace(path, MappedFile::Open(path)).first;
+    if (it->second == nullptr) {
+      LOG(ERROR) << "Failed to map " << path;
+    }
+  }
+  return it->second.get();
+}
+
+void FeatureReader::Next() {
+  if (done_) return;
+  if (is_script_) {
+    ReadScriptEntry();
+  } else {
+    ReadArchiveEntry();
+  }
+}
+
+void FeatureReader::ReadArchiveEntry() {
+  const char* data = archive_->data();
+  const size_t size = archive_->size();
+  // Skip the white spaces between the entries
+  while (pos_ < size && isspace(static_cast<unsigned char>(data[pos_]))) {
+    ++pos_;
+  }
+  if (pos_ >= size) {
+    done_ = true;
+    return;
+  }
+  size_t end = pos_;
+  while (end < size && data[end] != ' ') ++end;
+  CHECK_LT(end, size) << "Truncated archive";
+  key_.assign(data + pos_, end - pos_);
+  pos_ = ReadMatrix(*archive_, end + 1);
+}
+
+void FeatureReader::ReadScriptEntry() {
+  std::string line;
+  std::vector<std::string> strs;
+  while (strs.empty()) {
+    if (!std::getline(script_, line)) {
+      done_ = true;
+      return;
+    }
+    SplitString(line, &strs);
+  }
+  CHECK_EQ(strs.size(), 2) << "Invalid script line " << line;
+  key_ = strs[0];
+  // The offset follows the last colon of the path
+  std::string path = strs[1];
+  size_t pos = 0;
+  size_t colon = path.rfind(':');
+  if (colon != std::string::npos) {
+    pos = std::stoull(path.substr(colon + 1));
+    path = path.substr(0, colon);
+  }
+  const MappedFile* archive = GetArchive(path);
+  CHECK(archive != nullptr);
+  ReadMatrix(*archive, pos);
+}
+
+size_t FeatureReader::ReadMatrix(const MappedFile& archive, size_t pos) {
+  const char* data = archive.data();
+  const size_t size = archive.size();
+  // "\0B" of the binary mode, the token of the type, and the dimensions,
+  // each is the size of an int32 and the int32
+  CHECK_LE(pos + 2, size) << "Truncated archive";
+  CHECK(data[pos] == '\0' && data[pos + 1] == 'B')
+      << "Only the binary archives are supported";
+  pos += 2;
+  size_t space = pos;
+  while (space < size && data[space] != ' ') ++space;
+  CHECK_LT(space, size) << "Truncated archive";
+  std::string token(data + pos, space - pos);
+  CHECK(token == "FM" || token == "DM")
+      << "Unsupported matrix type " << token
+      << ", the compressed matrices are not supported";
+  pos = space + 1;
+  int32_t dims[2];
+  for (int i = 0; i < 2; ++i) {
+    CHECK_LE(pos + 5, size) << "Truncated archive";
+    CHECK_EQ(data[pos], 4);
+    memcpy(&dims[i], data + pos + 1, 4);
+    pos += 5;
+  }
+  const int rows = dims[0], cols = dims[1];
+  const size_t elem_size = token == "FM" ? sizeof(float) : sizeof(double);
+  CHECK_LE(pos + static_cast<size_t>(rows) * cols * elem_size, size)
+      << "Truncated archive";
+  value_.Resize(rows, cols);
+  for (int r = 0; r < rows; ++r) {
+    const char* row = data + pos + static_cast<size_t>(r) * cols * elem_size;
+    if (elem_size == sizeof(float)) {
+      memcpy(value_.Row(r), row, sizeof(float) * cols);
+    } else {
+      for (int c = 0; c < cols; ++c) {
+        double x;
+        memcpy(&x, row + c * sizeof(double), sizeof(double));
+        value_(r, c) = static_cast<float>(x);
+      }
+    }
+  }
+  return pos + static_cast<size_t>(rows) * cols * elem_size;
+}
+
+bool FeatureWriter::Open(const std::string& wspecifier) {
+  std::vector<std::string> types, paths;
+  if (!ParseSpecifier(wspecifier, &types, &paths) || types[0] != "ark" ||
+      (types.size() == 2 && types[1] != "scp") || types.size() > 2) {
+    LOG(ERROR) << "Invalid wspecifier " << wspecifier;
+    return false;
+  }
+  archive_path_ = paths[0];
+  archive_.open(archive_path_, std::ios::binary);
+  if (!archive_) {
+    LOG(ERROR) << "Failed to open " << archive_path_;
+    return false;
+  }
+  if (types.size() == 2) {
+    script_.open(paths[1]);
+    if (!script_) {
+      LOG(ERROR) << "Failed to open " << paths[1];
+      return false;
+    }
+  }
+  return true;
+}
+
+void FeatureWriter::WriteKey(const std::string& key) {
+  CHECK(archive_.is_open());
+  archive_ << key << ' ';
+  if (script_.is_open()) {
+    script_ << key << ' ' << archive_path_ << ':' << archive_.tellp() << '\n';
+  }
+  archive_.write("\0B", 2);
+}
+
+void FeatureWriter::Write(const std::string& key, const FeatureMatrix& feats) {
+  WriteKey(key);
+  archive_.write("FM ", 3);
+  int32_t dims[2] = {feats.rows(), feats.cols()};
+  for (int32_t dim : dims) {
+    archive_.put(4);
+    archive_.write(reinterpret_cast<const char*>(&dim), 4);
+  }
+  for (int r = 0; r < feats.rows(); ++r) {
+    archive_.write(reinterpret_cast<const char*>(feats.Row(r)),
+                   sizeof(float) * feats.cols());
+  }
+}
+
+void FeatureWriter::WriteBinary(const std::string& key,
+                                const std::string& object) {
+  WriteKey(key);
+  archive_.write(object.data(), object.size());
+}
+
+void FeatureWriter::Close() {
+  archive_.close();
+  if (script_.is_open()) script_.close();
+}
+
+}  // namespace wenet
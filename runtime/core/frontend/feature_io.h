@@ -0,0 +1,91 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FRONTEND_FEATURE_IO_H_
+#define FRONTEND_FEATURE_IO_H_
+
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utils/mapped_file.h"
+#include "utils/matrix.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// Sequential reader of the feature matrices of a Kaldi archive,
+// "ark:feats.ark", or of a Kaldi script file, "scp:feats.scp", whose lines
+// are "key feats.ark:offset". The archives are mapped into memory and the
+// matrices are parsed in place. Only the binary, uncompressed float (FM)
+// and double (DM) matrices are supported, as written by FeatureWriter or
+// by Kaldi's copy-feats without --compress.
+class FeatureReader {
+ public:
+  // Return false if the archive or the script can't be opened
+  bool Open(const std::string& rspecifier);
+
+  bool Done() const { return done_; }
+  const std::string& Key() const { return key_; }
+  const FeatureMatrix& Value() const { return value_; }
+  // Move to the next matrix, Done() is true after the last one
+  void Next();
+
+ private:
+  // Map an archive once, the entries of a script file usually point to a
+  // few archives
+  const MappedFile* GetArchive(const std::string& path);
+  // Parse the matrix at pos of the archive, return the end of it
+  size_t ReadMatrix(const MappedFile& archive, size_t pos);
+  void ReadArchiveEntry();
+  void ReadScriptEntry();
+
+  bool is_script_ = false;
+  bool done_ = true;
+  std::string key_;
+  FeatureMatrix value_;
+  std::map<std::string, std::unique_ptr<MappedFile>> archives_;
+  // Of "ark:"
+  const MappedFile* archive_ = nullptr;
+  size_t pos_ = 0;
+  // Of "scp:"
+  std::ifstream script_;
+};
+
+// Writer of the features to a Kaldi archive, "ark:feats.ark", optionally
+// with the script file of it, "ark,scp:feats.ark,feats.scp". The matrices
+// are written as binary float matrices.
+class FeatureWriter {
+ public:
+  // Return false if the files can't be opened
+  bool Open(const std::string& wspecifier);
+  void Write(const std::string& key, const FeatureMatrix& feats);
+  // Write an object which is already in the Kaldi binary format, e.g. the
+  // lattice of AsrDecoder::lattice()
+  void WriteBinary(const std::string& key, const std::string& object);
+  void Close();
+
+ private:
+  void WriteKey(const std::string& key);
+
+  std::string archive_path_;
+  std::ofstream archive_;
+  std::ofstream script_;
+};
+
+}  // namespace wenet
+
+#endif  // FRONTEND_FEATURE_IO_H_
@@ -15,8 +15,14 @@
 #include "frontend/feature_pipeline.h"
 
 #include <algorithm>
+#include <cstring>
 #include <utility>
 
+#include "utils/metrics.h"
+#include "utils/state_io.h"
+#include "utils/timer.h"
+#include "utils/trace.h"
+
 namespace wenet {
 
 FeaturePipeline::FeaturePipeline(const FeaturePipelineConfig& config)
@@ -24,82 +30,342 @@ FeaturePipeline::FeaturePipeline(const FeaturePipelineConfig& config)
       feature_dim_(config.num_bins),
       fbank_(config.num_bins, config.sample_rate, config.frame_length,
              config.frame_shift),
+      feature_queue_(config.num_bins),
       num_frames_(0),
-      input_finished_(false) {}
+      input_finished_(false),
+      remained_wav_(2 * config.frame_length),
+      num_remained_(0) {
+  if (config.fbank_scheduler != nullptr) {
+    const BatchFbankScheduler& scheduler = *config.fbank_scheduler;
+    CHECK_EQ(scheduler.num_bins(), config.num_bins);
+    CHECK_EQ(scheduler.frame_length(), config.frame_length);
+    CHECK_EQ(scheduler.frame_shift(), config.frame_shift);
+  }
+  if (config.fixed_point) {
+    CHECK(config.fbank_scheduler == nullptr)
+        << "The fixed point fbank can't be batched";
+    fixed_fbank_.reset(new FixedFbank(config.num_bins, config.sample_rate,
+                                      config.frame_length,
+                                      config.frame_shift));
+  }
+  if (config.use_vad) {
+    vad_.reset(new EnergyVad(config.vad_opts));
+  }
+}
 
-void FeaturePipeline::AcceptWaveform(const std::vector<float>& wav) {
-  std::vector<std::vector<float>> feats;
-  std::vector<float> waves;
-  waves.insert(waves.end(), remained_wav_.begin(), remained_wav_.end());
-  waves.insert(waves.end(), wav.begin(), wav.end());
-  int num_frames = fbank_.Compute(waves, &feats);
-  for (size_t i = 0; i < feats.size(); ++i) {
-    feature_queue_.Push(std::move(feats[i]));
+void FeaturePipeline::set_input_sample_rate(int sample_rate) {
+  if (sample_rate == config_.sample_rate) {
+    resampler_.reset();
+  } else if (resampler_ == nullptr ||
+             resampler_->input_rate() != sample_rate) {
+    LOG(INFO) << "Resample the input from " << sample_rate << " to "
+              << config_.sample_rate;
+    resampler_.reset(new Resampler(sample_rate, config_.sample_rate));
   }
-  num_frames_ += num_frames;
+}
 
-  int left_samples = waves.size() - config_.frame_shift * num_frames;
-  remained_wav_.resize(left_samples);
-  std::copy(waves.begin() + config_.frame_shift * num_frames, waves.end(),
-            remained_wav_.begin());
-  // We are still adding wave, notify input is not finished
-  finish_condition_.notify_one();
+void FeaturePipeline::AcceptWaveform(const float* wav, size_t num_samples) {
+  if (resampler_ != nullptr) {
+    resampled_wav_.clear();
+    resampler_->Resample(wav, num_samples, false, &resampled_wav_);
+    AcceptSamples(resampled_wav_.data(), resampled_wav_.size());
+  } else {
+    AcceptSamples(wav, num_samples);
+  }
+}
+
+void FeaturePipeline::AcceptWaveform(const int16_t* wav,
+                                     size_t num_samples) {
+  if (resampler_ != nullptr) {
+    resampler_input_.resize(num_samples);
+    fbank_.CopySamples(wav, num_samples, resampler_input_.data());
+    AcceptWaveform(resampler_input_.data(), num_samples);
+  } else {
+    AcceptSamples(wav, num_samples);
+  }
+}
+
+static void SetRequestWave(const float* wave, FbankRequest* request) {
+  request->float_wave = wave;
+}
+
+static void SetRequestWave(const int16_t* wave, FbankRequest* request) {
+  request->int16_wave = wave;
+}
+
+void FeaturePipeline::ComputeFbank(const FbankRequest* requests,
+                                   int num_requests) {
+  WENET_TRACE_SCOPE("fbank");
+  if (config_.fbank_scheduler != nullptr) {
+    config_.fbank_scheduler->Compute(requests, num_requests);
+    return;
+  }
+  for (int i = 0; i < num_requests; ++i) {
+    const FbankRequest& request = requests[i];
+    if (fixed_fbank_ != nullptr) {
+      if (request.float_wave != nullptr) {
+        fixed_fbank_->Compute(request.float_wave, request.num_samples,
+                              request.stride, request.feat);
+      } else {
+        fixed_fbank_->Compute(request.int16_wave, request.num_samples,
+                              request.stride, request.feat);
+      }
+    } else if (request.float_wave != nullptr) {
+      fbank_.Compute(request.float_wave, request.num_samples, request.stride,
+                     request.feat);
+    } else {
+      fbank_.Compute(request.int16_wave, request.num_samples, request.stride,
+                     request.feat);
+    }
+  }
+}
+
+template <typename T>
+void FeaturePipeline::AcceptSamples(const T* wav, int num_samples) {
+  const int frame_length = config_.frame_length;
+  const int frame_shift = config_.frame_shift;
+  // The frames start in the remained samples, they are computed on the
+  // remained samples followed by the first samples of wav, at most one
+  // frame length of wav is needed.
+  int num_head = std::min(num_samples, frame_length);
+  fbank_.CopySamples(wav, num_head, remained_wav_.data() + num_remained_);
+  int max_head_frames = (num_remained_ + frame_shift - 1) / frame_shift;
+  int num_head_frames = std::min(
+      max_head_frames, fbank_.NumFrames(num_remained_ + num_head));
+  // The frames start in wav, they are computed on wav directly
+  int offset = num_head_frames * frame_shift - num_remained_;
+  int num_wav_frames = 0;
+  if (offset >= 0) {
+    num_wav_frames = fbank_.NumFrames(num_samples - offset);
+  }
+  int num_frames = num_head_frames + num_wav_frames;
+  feats_.Resize(num_frames, feature_dim_);
+  FbankRequest requests[2];
+  int num_requests = 0;
+  if (num_head_frames > 0) {
+    FbankRequest& request = requests[num_requests++];
+    request.float_wave = remained_wav_.data();
+    request.num_samples = (num_head_frames - 1) * frame_shift + frame_length;
+    request.stride = feats_.stride();
+    request.feat = feats_.Row(0);
+  }
+  if (num_wav_frames > 0) {
+    FbankRequest& request = requests[num_requests++];
+    SetRequestWave(wav + offset, &request);
+    request.num_samples = num_samples - offset;
+    request.stride = feats_.stride();
+    request.feat = feats_.Row(num_head_frames);
+  }
+  Timer timer;
+  ComputeFbank(requests, num_requests);
+  static Histogram* fbank_ms = MetricsRegistry::Global()->GetHistogram(
+      "wenet_fbank_ms", "Fbank latency of an input waveform",
+      LatencyBuckets());
+  fbank_ms->Observe(timer.ElapsedUs() / 1000.0);
+
+  // Keep the residual samples, which are less than one frame length
+  if (offset >= 0) {
+    int start = offset + num_wav_frames * frame_shift;
+    num_remained_ = num_samples - start;
+    fbank_.CopySamples(wav + start, num_remained_, remained_wav_.data());
+  } else {
+    // All of wav is consumed by the head frames
+    int start = num_head_frames * frame_shift;
+    num_remained_ += num_samples - start;
+    std::copy(remained_wav_.begin() + start,
+              remained_wav_.begin() + start + num_remained_,
+              remained_wav_.begin());
+  }
+  CHECK_LT(num_remained_, frame_length);
+  PushFrames(feats_.data(), num_frames, feats_.stride());
+}
+
+void FeaturePipeline::AcceptFeatures(const FeatureMatrix& feats) {
+  CHECK(!input_finished_);
+  CHECK_EQ(feats.cols(), feature_dim_);
+  PushFrames(feats.data(), feats.rows(), feats.stride());
+}
+
+void FeaturePipeline::PushFrames(const float* data, int num_frames,
+                                 int stride) {
+  feature_queue_.Push(data, num_frames, stride);
+  num_frames_ += num_frames;
+  // Wake up the reader once for all the frames of this wav. The critical
+  // section orders the push before the wait of a reader which has just
+  // checked the queue.
+  if (num_frames > 0) {
+    bool ready = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (num_ready_frames_ > 0 &&
+          feature_queue_.Size() >= num_ready_frames_) {
+        num_ready_frames_ = 0;
+        ready = true;
+      }
+    }
+    finish_condition_.notify_one();
+    if (ready) ready_callback_();
+  }
 }
 
 void FeaturePipeline::set_input_finished() {
   CHECK(!input_finished_);
+  if (resampler_ != nullptr) {
+    // The outputs of the last input samples
+    resampled_wav_.clear();
+    resampler_->Resample(nullptr, 0, true, &resampled_wav_);
+    AcceptSamples(resampled_wav_.data(), resampled_wav_.size());
+  }
+  bool ready = false;
   {
     std::lock_guard<std::mutex> lock(mutex_);
     input_finished_ = true;
+    ready = num_ready_frames_ > 0;
+    num_ready_frames_ = 0;
   }
   finish_condition_.notify_one();
+  if (ready) ready_callback_();
 }
 
 bool FeaturePipeline::ReadOne(std::vector<float>* feat) {
-  if (!feature_queue_.Empty()) {
-    *feat = std::move(feature_queue_.Pop());
+  std::vector<std::vector<float>> feats;
+  if (Read(1, &feats)) {
+    *feat = std::move(feats[0]);
     return true;
-  } else {
+  }
+  return false;
+}
+
+bool FeaturePipeline::Read(int num_frames,
+                           std::vector<std::vector<float>>* feats) {
+  FeatureMatrix frames;
+  bool ok = Read(num_frames, &frames);
+  frames.CopyTo(feats);
+  return ok;
+}
+
+bool FeaturePipeline::PollFrames(int num_frames) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (input_finished_ || feature_queue_.Size() >= num_frames) {
+    return true;
+  }
+  if (ready_callback_ != nullptr) {
+    num_ready_frames_ = num_frames;
+  }
+  return false;
+}
+
+bool FeaturePipeline::Read(int num_frames, FeatureMatrix* feats) {
+  if (feature_queue_.Size() < num_frames) {
     std::unique_lock<std::mutex> lock(mutex_);
-    while (!input_finished_) {
-      // This will release the lock and wait for notify_one()
-      // from AcceptWaveform() or set_input_finished()
-      finish_condition_.wait(lock);
-      if (!feature_queue_.Empty()) {
-        *feat = std::move(feature_queue_.Pop());
-        return true;
+    // This will release the lock and wait for notify_one()
+    // from AcceptWaveform() or set_input_finished()
+    finish_condition_.wait(lock, [this, num_frames] {
+      return input_finished_ || feature_queue_.Size() >= num_frames;
+    });
+  }
+  // All the frames are pushed before the input is finished, so the size is
+  // final if it is still less than num_frames here.
+  int n = std::min(num_frames, feature_queue_.Size());
+  feats->Resize(n, feature_dim_);
+  CHECK_EQ(feature_queue_.Pop(n, feats->stride(), feats->data()), n);
+  if (config_.max_queued_frames > 0) {
+    bool space = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (wait_space_ && feature_queue_.Size() < config_.max_queued_frames) {
+        wait_space_ = false;
+        space = true;
       }
     }
-    CHECK(input_finished_);
-    // Double check queue.empty, see issue#893 for detailed discussions.
-    if (!feature_queue_.Empty()) {
-      *feat = std::move(feature_queue_.Pop());
-      return true;
-    } else {
-      return false;
+    if (space) space_callback_();
+  }
+  num_speech_frames_read_ = n;
+  if (vad_ != nullptr) {
+    num_speech_frames_read_ = 0;
+    for (int i = 0; i < n; ++i) {
+      num_speech_frames_read_ += vad_->IsSpeech(feats->Row(i), feature_dim_);
     }
   }
+  return n == num_frames;
 }
 
-bool FeaturePipeline::Read(int num_frames,
-                           std::vector<std::vector<float>>* feats) {
-  feats->clear();
-  std::vector<float> feat;
-  while (feats->size() < num_frames) {
-    if (ReadOne(&feat)) {
-      feats->push_back(std::move(feat));
-    } else {
-      return false;
-    }
+bool FeaturePipeline::PollSpace() {
+  if (config_.max_queued_frames <= 0) {
+    return true;
   }
-  return true;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (feature_queue_.Size() < config_.max_queued_frames) {
+    return true;
+  }
+  if (space_callback_ != nullptr) {
+    wait_space_ = true;
+  }
+  return false;
 }
 
 void FeaturePipeline::Reset() {
   input_finished_ = false;
+  num_ready_frames_ = 0;
+  wait_space_ = false;
   num_frames_ = 0;
-  remained_wav_.clear();
+  num_remained_ = 0;
+  if (resampler_ != nullptr) {
+    resampler_->Reset();
+  }
+  if (vad_ != nullptr) {
+    vad_->Reset();
+  }
+  num_speech_frames_read_ = 0;
   feature_queue_.Clear();
 }
 
+void FeaturePipeline::SaveState(StateWriter* writer) const {
+  writer->Write<int32_t>(num_frames_);
+  writer->Write<uint8_t>(input_finished());
+  writer->Write<int32_t>(num_remained_);
+  writer->WriteArray(remained_wav_.data(), num_remained_);
+  FeatureMatrix frames(feature_queue_.Size(), feature_dim_);
+  feature_queue_.Peek(frames.rows(), frames.stride(), frames.data());
+  writer->WriteMatrix(frames);
+  writer->Write<int32_t>(resampler_ != nullptr ? resampler_->input_rate()
+                                               : config_.sample_rate);
+  if (resampler_ != nullptr) resampler_->SaveState(writer);
+  writer->Write<uint8_t>(vad_ != nullptr);
+  if (vad_ != nullptr) vad_->SaveState(writer);
+  writer->Write<int32_t>(num_speech_frames_read_);
+}
+
+bool FeaturePipeline::RestoreState(StateReader* reader) {
+  Reset();
+  int32_t num_frames = 0;
+  uint8_t input_finished = 0;
+  int32_t num_remained = 0;
+  FeatureMatrix frames;
+  int32_t input_sample_rate = 0;
+  uint8_t has_vad = 0;
+  if (!reader->Read(&num_frames) || !reader->Read(&input_finished) ||
+      !reader->Read(&num_remained) || num_remained < 0 ||
+      num_remained >= config_.frame_length ||
+      !reader->ReadArray(remained_wav_.data(), num_remained) ||
+      !reader->ReadMatrix(&frames) ||
+      (frames.rows() > 0 && frames.cols() != feature_dim_) ||
+      !reader->Read(&input_sample_rate) || input_sample_rate <= 0) {
+    return false;
+  }
+  set_input_sample_rate(input_sample_rate);
+  if ((resampler_ != nullptr && !resampler_->RestoreState(reader)) ||
+      !reader->Read(&has_vad) || has_vad != (vad_ != nullptr) ||
+      (vad_ != nullptr && !vad_->RestoreState(reader)) ||
+      !reader->Read(&num_speech_frames_read_)) {
+    return false;
+  }
+  num_remained_ = num_remained;
+  feature_queue_.Push(frames.data(), frames.rows(), frames.stride());
+  num_frames_ = num_frames;
+  std::lock_guard<std::mutex> lock(mutex_);
+  input_finished_ = input_finished != 0;
+  return true;
+}
+
 }  // namespace wenet
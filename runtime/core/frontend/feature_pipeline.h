@@ -15,22 +15,45 @@
 #ifndef FRONTEND_FEATURE_PIPELINE_H_
 #define FRONTEND_FEATURE_PIPELINE_H_
 
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <string>
 #include <vector>
 
+#include "frontend/batch_fbank_scheduler.h"
 #include "frontend/fbank.h"
-#include "utils/blocking_queue.h"
+#include "frontend/fixed_fbank.h"
+#include "frontend/resampler.h"
+#include "frontend/vad.h"
+#include "utils/frame_queue.h"
 #include "utils/log.h"
+#include "utils/matrix.h"
 
 namespace wenet {
 
+class StateReader;
+class StateWriter;
+
 struct FeaturePipelineConfig {
   int num_bins;
   int sample_rate;
   int frame_length;
   int frame_shift;
+  // Optional energy VAD on the features, the decoder skips the model on the
+  // chunks without speech
+  bool use_vad = false;
+  VadOptions vad_opts;
+  // Optional, the fbank of all the pipelines is computed in batches by it
+  std::shared_ptr<BatchFbankScheduler> fbank_scheduler = nullptr;
+  // Compute the fbank by FixedFbank, for the cpus of slow float math, it
+  // can't be batched by fbank_scheduler
+  bool fixed_point = false;
+  // The producer stops feeding when max_queued_frames frames are not read
+  // yet, see PollSpace(), 0 means no limit
+  int max_queued_frames = 0;
   FeaturePipelineConfig(int num_bins, int sample_rate)
       : num_bins(num_bins),         // 80 dim fbank
         sample_rate(sample_rate) {  // 16k sample rate
@@ -48,10 +71,13 @@ struct FeaturePipelineConfig {
 // Typically, FeaturePipeline is used in two threads: one thread A calls
 // AcceptWaveform() to add raw wav data and set_input_finished() to notice
 // the end of input wav, another thread B (decoder thread) calls Read() to
-// consume features.So a BlockingQueue is used to make this class thread safe.
+// consume features. There is exactly one producer and one consumer, so the
+// features are passed by a lock free FrameQueue, and the reader only takes
+// the lock to sleep when there are not enough frames.
 
 // The Read() is designed as a blocking method when there is no feature
-// in feature_queue_ and the input is not finished.
+// in feature_queue_ and the input is not finished. The reader is woken up
+// once per AcceptWaveform(), not once per frame.
 
 // See bin/decoder_main.cc, websocket/websocket_server.cc and
 // decoder/torch_asr_decoder.cc for usage
@@ -61,7 +87,22 @@ class FeaturePipeline {
   explicit FeaturePipeline(const FeaturePipelineConfig& config);
 
   // The feature extraction is done in AcceptWaveform().
-  void AcceptWaveform(const std::vector<float>& wav);
+  void AcceptWaveform(const std::vector<float>& wav) {
+    AcceptWaveform(wav.data(), wav.size());
+  }
+  // Same as above, the samples are taken from the caller's buffer, so the
+  // 16 bits PCM of the network or the device is passed without conversion
+  // or copy, the conversion to float is fused into the framing.
+  void AcceptWaveform(const float* wav, size_t num_samples);
+  void AcceptWaveform(const int16_t* wav, size_t num_samples);
+  // Precomputed features of feature_dim() columns, e.g. read from an
+  // archive, they bypass the fbank
+  void AcceptFeatures(const FeatureMatrix& feats);
+
+  // The sample rate of the wav passed to AcceptWaveform(), the wav is
+  // resampled to config().sample_rate if they are different. Call it before
+  // the first AcceptWaveform() of the stream.
+  void set_input_sample_rate(int sample_rate);
 
   // Current extracted frames number.
   int num_frames() const { return num_frames_; }
@@ -71,7 +112,10 @@ class FeaturePipeline {
   // The caller should call this method when speech input is end.
   // Never call AcceptWaveform() after calling set_input_finished() !
   void set_input_finished();
-  bool input_finished() const { return input_finished_; }
+  bool input_finished() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return input_finished_;
+  }
 
   // Return False if input is finished and no feature could be read.
   // Return True if a feature is read.
@@ -86,35 +130,103 @@ class FeaturePipeline {
   // This function is a blocking method when there is no feature
   // in feature_queue_ and the input is not finished.
   bool Read(int num_frames, std::vector<std::vector<float>>* feats);
+  // Same as above, the features are packed into one contiguous matrix.
+  bool Read(int num_frames, FeatureMatrix* feats);
+
+  // Non-blocking readers, such as the sessions of a DecodeScheduler, poll
+  // the frames instead of blocking in Read(). PollFrames() returns true if
+  // Read(num_frames) won't block, otherwise the ready callback is called
+  // once it won't, on the thread of AcceptWaveform() or
+  // set_input_finished().
+  void set_ready_callback(std::function<void()> callback) {
+    ready_callback_ = std::move(callback);
+  }
+  bool PollFrames(int num_frames);
+  // The producers of the servers push back on a slow reader the same way,
+  // PollSpace() returns true if there are less than max_queued_frames
+  // queued frames, otherwise the space callback is called once there are,
+  // on the thread of Read().
+  void set_space_callback(std::function<void()> callback) {
+    space_callback_ = std::move(callback);
+  }
+  bool PollSpace();
 
   void Reset();
+  // The stream so far, i.e. the residual samples, the resampler and the
+  // VAD states and the frames not read yet, so the pipeline of another
+  // decoder of the same config continues it after RestoreState(), see
+  // AsrDecoder::SaveState(). Call them on the reader thread while no wav is
+  // accepted, RestoreState() resets the pipeline first.
+  void SaveState(StateWriter* writer) const;
+  bool RestoreState(StateReader* reader);
   bool IsLastFrame(int frame) const {
+    std::lock_guard<std::mutex> lock(mutex_);
     return input_finished_ && (frame == num_frames_ - 1);
   }
 
   int NumQueuedFrames() const {
     return feature_queue_.Size();
   }
+  // Bytes of the feature queue, which is the bulk of the pipeline
+  size_t MemoryBytes() const { return feature_queue_.AllocatedBytes(); }
+
+  bool vad_enabled() const { return vad_ != nullptr; }
+  // Number of the speech frames in the frames of the last Read(), all of
+  // them are speech if the VAD is disabled
+  int num_speech_frames_read() const { return num_speech_frames_read_; }
 
  private:
+  template <typename T>
+  void AcceptSamples(const T* wav, int num_samples);
+  // Queue the frames and wake up the reader
+  void PushFrames(const float* data, int num_frames, int stride);
+  // Compute the fbank of the requests by fbank_ or the fbank_scheduler of
+  // the config
+  void ComputeFbank(const FbankRequest* requests, int num_requests);
+
   const FeaturePipelineConfig& config_;
   int feature_dim_;
   Fbank fbank_;
+  // Used instead of fbank_ if config_.fixed_point
+  std::unique_ptr<FixedFbank> fixed_fbank_;
 
-  BlockingQueue<std::vector<float>> feature_queue_;
+  FrameQueue feature_queue_;
   int num_frames_;
   bool input_finished_;
 
   // The feature extraction is done in AcceptWaveform().
   // This wavefrom sample points are consumed by frame size.
   // The residual wavefrom sample points after framing are
-  // kept to be used in next AcceptWaveform() calling.
+  // kept to be used in next AcceptWaveform() calling. They are less than
+  // one frame, and the buffer also holds the first frame of the next wav,
+  // so it has a fixed size of two frames.
   std::vector<float> remained_wav_;
+  int num_remained_;
+  // Scratch features of AcceptWaveform()
+  FeatureMatrix feats_;
+
+  // Resampler of the input, nullptr if the input is of the sample rate of
+  // the config
+  std::unique_ptr<Resampler> resampler_;
+  // Scratch of the resampler, the converted 16 bits input and the output
+  std::vector<float> resampler_input_;
+  std::vector<float> resampled_wav_;
+
+  // The VAD runs on the reader side, when the frames are read
+  std::unique_ptr<EnergyVad> vad_;
+  int num_speech_frames_read_ = 0;
 
   // Used to block the Read when there is no feature in feature_queue_
   // and the input is not finished.
   mutable std::mutex mutex_;
   std::condition_variable finish_condition_;
+  // The ready callback is called when num_ready_frames_ frames are queued,
+  // 0 means no reader polled
+  std::function<void()> ready_callback_;
+  int num_ready_frames_ = 0;
+  // The space callback is called when the queue is below the capacity
+  std::function<void()> space_callback_;
+  bool wait_space_ = false;
 };
 
 }  // namespace wenet
@@ -4,7 +4,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <mutex>
+#include <unordered_map>
+
 #include "frontend/fft.h"
+#include "utils/log.h"
 
 namespace wenet {
 
@@ -118,4 +122,59 @@ int fft(const int* bitrev, const float* sintbl, float* x, float* y, int n) {
   return 0; /* finished successfully */
 }
 
+RealFft::RealFft(int n) : n_(n) {
+  CHECK_GE(n, 8);
+  CHECK_EQ(n & (n - 1), 0) << "fft points must be a power of 2";
+  const int m = n / 2;
+  bitrev_.resize(m);
+  sintbl_.resize(m + m / 4);
+  make_sintbl(m, sintbl_.data());
+  make_bitrev(m, bitrev_.data());
+  twiddle_cos_.resize(m);
+  twiddle_sin_.resize(m);
+  for (int k = 0; k < m; ++k) {
+    twiddle_cos_[k] = cos(M_2PI * k / n);
+    twiddle_sin_[k] = sin(M_2PI * k / n);
+  }
+}
+
+std::shared_ptr<const RealFft> RealFft::Get(int n) {
+  static std::mutex mutex;
+  static std::unordered_map<int, std::shared_ptr<const RealFft>> cache;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& fft = cache[n];
+  if (fft == nullptr) {
+    fft = std::make_shared<const RealFft>(n);
+  }
+  return fft;
+}
+
+void RealFft::Compute(const float* x, float* real, float* img) const {
+  const int m = n_ / 2;
+  for (int i = 0; i < m; ++i) {
+    real[i] = x[2 * i];
+    img[i] = x[2 * i + 1];
+  }
+  fft(bitrev_.data(), sintbl_.data(), real, img, m);
+  // Z = fft(z), the even part E[k] = (Z[k] + conj(Z[m - k])) / 2, the odd
+  // part O[k] = (Z[k] - conj(Z[m - k])) / 2i, and X[k] = E[k] + W^k O[k]
+  // where W = exp(-2i * pi / n). X[k] and X[m - k] are computed together
+  // since they are from the same pair of Z.
+  for (int k = 0; k <= m / 2; ++k) {
+    const int j = (m - k) % m;
+    const float a = real[k], b = img[k], c = real[j], d = img[j];
+    const float er = 0.5f * (a + c), ei = 0.5f * (b - d);
+    const float orr = 0.5f * (b + d), oi = -0.5f * (a - c);
+    // W^k O[k]
+    const float ck = twiddle_cos_[k], sk = twiddle_sin_[k];
+    real[k] = er + ck * orr + sk * oi;
+    img[k] = ei + ck * oi - sk * orr;
+    if (j != k) {
+      // E[j] = conj(E[k]), O[j] = conj(O[k]), W^j = -conj(W^k)
+      real[j] = er - ck * orr - sk * oi;
+      img[j] = -ei + ck * oi - sk * orr;
+    }
+  }
+}
+
 }  // namespace wenet
@@ -3,6 +3,9 @@
 #ifndef FRONTEND_FFT_H_
 #define FRONTEND_FFT_H_
 
+#include <memory>
+#include <vector>
+
 #ifndef M_PI
 #define M_PI 3.1415926535897932384626433832795
 #endif
@@ -20,6 +23,36 @@ void make_bitrev(int n, int* bitrev);
 
 int fft(const int* bitrev, const float* sintbl, float* x, float* y, int n);
 
+// FFT of n real points. The input is packed as a n/2 points complex sequence
+// (even samples as the real part, odd samples as the image part), which is
+// transformed by fft() and then split into the spectrum of the real input by
+// a post twiddle, so it takes about half of the work of fft() on the zero
+// image part.
+class RealFft {
+ public:
+  explicit RealFft(int n);
+
+  // The tables are read only after construction, so one RealFft is shared
+  // by all the users of the same size.
+  static std::shared_ptr<const RealFft> Get(int n);
+
+  // x: n real inputs
+  // real, img: n/2 outputs, the bins [0, n/2) of the spectrum
+  void Compute(const float* x, float* real, float* img) const;
+
+  int n() const { return n_; }
+
+ private:
+  int n_;
+  // bit reversal table of n/2 points
+  std::vector<int> bitrev_;
+  // trigonometric function table of n/2 points
+  std::vector<float> sintbl_;
+  // cos(2 * pi * k / n) and sin(2 * pi * k / n) of the post twiddle
+  std::vector<float> twiddle_cos_;
+  std::vector<float> twiddle_sin_;
+};
+
 }  // namespace wenet
 
 #endif  // FRONTEND_FFT_H_
@@ -0,0 +1,353 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "frontend/fixed_fbank.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <utility>
+
+#include "frontend/fbank.h"
+#include "frontend/fft.h"
+
+namespace wenet {
+
+// Entries of the log table, ln(1 + i / kLogTableSize) for i in [0, size]
+static const int kLogTableBits = 10;
+static const int kLogTableSize = 1 << kLogTableBits;
+// Bits of the Q formats
+static const int kSampleBits = 8;
+static const int kWeightBits = 15;
+// The frame is normalized below 2^kFrameBits before FFT, so the packed
+// complex points are below 2^29.5 and the spectrum below 2^30.5
+static const int kFrameBits = 29;
+
+struct FixedFbankTables {
+  int fft_points;
+  // log2 of the n / 2 points of the complex FFT
+  int log2_points;
+  // povey window in Q31
+  std::vector<int32_t> window;
+  // bit reversal table of n / 2 points
+  std::vector<int> bitrev;
+  // Q31 twiddles of the stage of h butterflies per group at [h, 2h),
+  // exp(-i * pi * j / h), so each stage reads them contiguously
+  std::vector<int32_t> twiddle_real;
+  std::vector<int32_t> twiddle_img;
+  // Q31 cos(2 * pi * k / n) and sin(2 * pi * k / n) of the post twiddle
+  std::vector<int32_t> post_cos;
+  std::vector<int32_t> post_sin;
+  // Q15 weights of the mel bins, from the first fft bin
+  std::vector<std::pair<int, std::vector<uint32_t>>> bins;
+  std::vector<float> log_table;
+  // ln(frame_length^2), the dc offset removed frame is scaled by it
+  float log_square_length;
+};
+
+static inline int32_t ToQ31(double x) {
+  const double max = std::numeric_limits<int32_t>::max();
+  return static_cast<int32_t>(
+      std::max(-max, std::min(max, std::round(x * 2147483648.0))));
+}
+
+static inline int32_t MulQ31(int32_t a, int32_t b) {
+  return static_cast<int32_t>(
+      (static_cast<int64_t>(a) * b + (INT64_C(1) << 30)) >> 31);
+}
+
+// Index of the highest set bit of v > 0
+static inline int HighestBit(uint64_t v) {
+#if defined(__GNUC__)
+  return 63 - __builtin_clzll(v);
+#else
+  int k = 0;
+  for (int s = 32; s > 0; s >>= 1) {
+    if (v >> s) {
+      v >>= s;
+      k += s;
+    }
+  }
+  return k;
+#endif
+}
+
+static std::shared_ptr<const FixedFbankTables> MakeTables(int num_bins,
+                                                          int sample_rate,
+                                                          int frame_length) {
+  auto tables = std::make_shared<FixedFbankTables>();
+  const int n = Fbank::UpperPowerOfTwo(frame_length);
+  const int m = n / 2;
+  CHECK_GE(n, 8);
+  tables->fft_points = n;
+  tables->log2_points = HighestBit(m);
+
+  tables->window.resize(frame_length);
+  double a = M_2PI / (frame_length - 1);
+  for (int i = 0; i < frame_length; ++i) {
+    tables->window[i] = ToQ31(pow(0.5 - 0.5 * cos(a * i), 0.85));
+  }
+
+  tables->bitrev.resize(m);
+  make_bitrev(m, tables->bitrev.data());
+  tables->twiddle_real.resize(m);
+  tables->twiddle_img.resize(m);
+  for (int h = 1; h < m; h <<= 1) {
+    for (int j = 0; j < h; ++j) {
+      tables->twiddle_real[h + j] = ToQ31(cos(M_PI * j / h));
+      tables->twiddle_img[h + j] = ToQ31(-sin(M_PI * j / h));
+    }
+  }
+  tables->post_cos.resize(m / 2 + 1);
+  tables->post_sin.resize(m / 2 + 1);
+  for (int k = 0; k <= m / 2; ++k) {
+    tables->post_cos[k] = ToQ31(cos(M_2PI * k / n));
+    tables->post_sin[k] = ToQ31(sin(M_2PI * k / n));
+  }
+
+  // The same filter bank as Fbank
+  float fft_bin_width = static_cast<float>(sample_rate) / n;
+  int low_freq = 20, high_freq = sample_rate / 2;
+  float mel_low_freq = Fbank::MelScale(low_freq);
+  float mel_high_freq = Fbank::MelScale(high_freq);
+  float mel_freq_delta = (mel_high_freq - mel_low_freq) / (num_bins + 1);
+  tables->bins.resize(num_bins);
+  for (int bin = 0; bin < num_bins; ++bin) {
+    float left_mel = mel_low_freq + bin * mel_freq_delta,
+          center_mel = mel_low_freq + (bin + 1) * mel_freq_delta,
+          right_mel = mel_low_freq + (bin + 2) * mel_freq_delta;
+    auto& weights = tables->bins[bin].second;
+    int first_index = -1;
+    for (int i = 0; i < m; ++i) {
+      float mel = Fbank::MelScale(fft_bin_width * i);
+      if (mel > left_mel && mel < right_mel) {
+        float weight;
+        if (mel <= center_mel)
+          weight = (mel - left_mel) / (center_mel - left_mel);
+        else
+          weight = (right_mel - mel) / (right_mel - center_mel);
+        if (first_index == -1) first_index = i;
+        weights.resize(i + 1 - first_index, 0);
+        weights.back() = static_cast<uint32_t>(
+            std::round(weight * (1 << kWeightBits)));
+      }
+    }
+    CHECK(first_index != -1);
+    tables->bins[bin].first = first_index;
+  }
+
+  tables->log_square_length = 2 * log(frame_length);
+  tables->log_table.resize(kLogTableSize + 1);
+  for (int i = 0; i <= kLogTableSize; ++i) {
+    tables->log_table[i] = log(1.0 + static_cast<double>(i) / kLogTableSize);
+  }
+  return tables;
+}
+
+static std::shared_ptr<const FixedFbankTables> GetTables(int num_bins,
+                                                         int sample_rate,
+                                                         int frame_length) {
+  static std::mutex mutex;
+  static std::map<std::tuple<int, int, int>,
+                  std::shared_ptr<const FixedFbankTables>> cache;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& tables = cache[std::make_tuple(num_bins, sample_rate, frame_length)];
+  if (tables == nullptr) {
+    tables = MakeTables(num_bins, sample_rate, frame_length);
+  }
+  return tables;
+}
+
+FixedFbank::FixedFbank(int num_bins, int sample_rate, int frame_length,
+                       int frame_shift)
+    : num_bins_(num_bins),
+      frame_length_(frame_length),
+      frame_shift_(frame_shift),
+      kernels_(&GetFixedFbankKernels()),
+      tables_(GetTables(num_bins, sample_rate, frame_length)) {
+  const int n = tables_->fft_points;
+  // The tail of frame_ stays zero padded
+  frame_.resize(n, 0);
+  fft_real_.resize(n / 2);
+  fft_img_.resize(n / 2);
+  power_.resize(n / 2);
+}
+
+int FixedFbank::Compute(const std::vector<float>& wave,
+                        std::vector<std::vector<float>>* feat) {
+  int num_frames = NumFrames(wave.size());
+  feat->resize(num_frames);
+  for (int i = 0; i < num_frames; ++i) {
+    (*feat)[i].resize(num_bins_);
+    LoadFrame(wave.data() + i * frame_shift_);
+    ComputeFrame((*feat)[i].data());
+  }
+  return num_frames;
+}
+
+void FixedFbank::LoadFrame(const int16_t* wave) {
+  for (int i = 0; i < frame_length_; ++i) {
+    frame_[i] = static_cast<int32_t>(wave[i]) * (1 << kSampleBits);
+  }
+}
+
+void FixedFbank::LoadFrame(const float* wave) {
+  const float max = 1 << (15 + kSampleBits);
+  for (int i = 0; i < frame_length_; ++i) {
+    float x = std::round(wave[i] * (1 << kSampleBits));
+    frame_[i] = static_cast<int32_t>(std::max(-max, std::min(max, x)));
+  }
+}
+
+void FixedFbank::Fft() {
+  const FixedFbankTables& t = *tables_;
+  const int m = t.fft_points / 2;
+  int32_t* re = fft_real_.data();
+  int32_t* im = fft_img_.data();
+  // The first two stages of the twiddles 1 and -i are without the calls and
+  // the multiplications, they are the same as Butterfly() since the points
+  // are below 2^30
+  for (int i = 0; i < m; i += 2) {
+    const int64_t ar = re[i], ai = im[i], br = re[i + 1], bi = im[i + 1];
+    re[i] = static_cast<int32_t>((ar + br) >> 1);
+    im[i] = static_cast<int32_t>((ai + bi) >> 1);
+    re[i + 1] = static_cast<int32_t>((ar - br) >> 1);
+    im[i + 1] = static_cast<int32_t>((ai - bi) >> 1);
+  }
+  for (int i = 0; i < m; i += 4) {
+    const int64_t ar = re[i], ai = im[i], br = re[i + 2], bi = im[i + 2];
+    re[i] = static_cast<int32_t>((ar + br) >> 1);
+    im[i] = static_cast<int32_t>((ai + bi) >> 1);
+    re[i + 2] = static_cast<int32_t>((ar - br) >> 1);
+    im[i + 2] = static_cast<int32_t>((ai - bi) >> 1);
+    // t = -i * b
+    const int64_t cr = re[i + 1], ci = im[i + 1];
+    const int64_t tr = im[i + 3], ti = -static_cast<int64_t>(re[i + 3]);
+    re[i + 1] = static_cast<int32_t>((cr + tr) >> 1);
+    im[i + 1] = static_cast<int32_t>((ci + ti) >> 1);
+    re[i + 3] = static_cast<int32_t>((cr - tr) >> 1);
+    im[i + 3] = static_cast<int32_t>((ci - ti) >> 1);
+  }
+  for (int h = 4; h < m; h <<= 1) {
+    const int32_t* wr = t.twiddle_real.data() + h;
+    const int32_t* wi = t.twiddle_img.data() + h;
+    for (int i = 0; i < m; i += 2 * h) {
+      kernels_->Butterfly(wr, wi, re + i, im + i, re + i + h, im + i + h, h);
+    }
+  }
+}
+
+void FixedFbank::ComputeFrame(float* feat) {
+  static const int32_t kPreEmphasis = ToQ31(0.97);
+  static const float kLn2 = log(2.0);
+  static const float kLogEpsilon =
+      log(std::numeric_limits<float>::epsilon());
+  const FixedFbankTables& t = *tables_;
+  const int m = t.fft_points / 2;
+  int32_t* x = frame_.data();
+  const int n = frame_length_;
+
+  // Remove dc offset exactly as n * x[i] - sum(x), and normalize the frame
+  // below 2^(kFrameBits - 1), so the preemphasis keeps it below
+  // 2^kFrameBits and the window has the full precision of the frame
+  int64_t sum = 0;
+  for (int i = 0; i < n; ++i) sum += x[i];
+  uint64_t max_abs = 0;
+  for (int i = 0; i < n; ++i) {
+    int64_t y = static_cast<int64_t>(x[i]) * n - sum;
+    max_abs = std::max(max_abs, static_cast<uint64_t>(y < 0 ? -y : y));
+  }
+  int shift = max_abs == 0 ? 0 : kFrameBits - 2 - HighestBit(max_abs);
+  for (int i = 0; i < n; ++i) {
+    int64_t y = static_cast<int64_t>(x[i]) * n - sum;
+    x[i] = static_cast<int32_t>(shift >= 0 ? y * (INT64_C(1) << shift)
+                                           : y >> -shift);
+  }
+  kernels_->PreEmphasis(kPreEmphasis, x, n);
+  kernels_->Mul(t.window.data(), x, n);
+
+  // Pack the frame as the n / 2 points complex sequence in the bit reversed
+  // order
+  for (int i = 0; i < m; ++i) {
+    const int j = t.bitrev[i];
+    fft_real_[j] = x[2 * i];
+    fft_img_[j] = x[2 * i + 1];
+  }
+  Fft();
+
+  // Split the spectrum of the real input as RealFft::Compute, the even and
+  // the odd parts are halved, so the bins stay below 2^30.5
+  int32_t* re = fft_real_.data();
+  int32_t* im = fft_img_.data();
+  for (int k = 0; k <= m / 2; ++k) {
+    const int j = (m - k) % m;
+    const int64_t a = re[k], b = im[k], c = re[j], d = im[j];
+    const int32_t er = static_cast<int32_t>((a + c) >> 1);
+    const int32_t ei = static_cast<int32_t>((b - d) >> 1);
+    const int32_t orr = static_cast<int32_t>((b + d) >> 1);
+    const int32_t oi = static_cast<int32_t>((c - a) >> 1);
+    // W^k O[k]
+    const int32_t ck = t.post_cos[k], sk = t.post_sin[k];
+    const int32_t wr = MulQ31(orr, ck) + MulQ31(oi, sk);
+    const int32_t wi = MulQ31(oi, ck) - MulQ31(orr, sk);
+    re[k] = er + wr;
+    im[k] = ei + wi;
+    if (j != k) {
+      re[j] = er - wr;
+      im[j] = -ei + wi;
+    }
+  }
+  kernels_->PowerSpectrum(re, im, power_.data(), m);
+
+  // The spectrum is scaled by frame_length * 2^(kSampleBits + shift -
+  // log2_points), and the power by the square of it
+  const int power_exponent = 2 * (kSampleBits + shift - t.log2_points);
+  for (int bin = 0; bin < num_bins_; ++bin) {
+    const auto& weights = t.bins[bin].second;
+    uint64_t hi, lo;
+    kernels_->Dot(weights.data(), power_.data() + t.bins[bin].first,
+                  weights.size(), &hi, &lo);
+    // mel energy = (hi * 2^31 + lo) * 2^exponent / frame_length^2
+    int exponent = -power_exponent - kWeightBits;
+    uint64_t v;
+    if (hi < (UINT64_C(1) << 31)) {
+      v = (hi << 31) + lo;
+    } else {
+      v = hi + (lo >> 31);
+      exponent += 31;
+    }
+    if (v == 0) {
+      feat[bin] = kLogEpsilon;
+      continue;
+    }
+    // ln(v) = ln(1.f) + k * ln(2), where 1.f is the mantissa of the highest
+    // bit k, and ln(1.f) is interpolated in the table by the next 16 bits
+    const int k = HighestBit(v);
+    const uint64_t u = v << (63 - k);
+    const int index = static_cast<int>((u >> (63 - kLogTableBits)) &
+                                       (kLogTableSize - 1));
+    const float frac = ((u >> (63 - kLogTableBits - 16)) & 0xffff) *
+                       (1.0f / 65536);
+    const float* table = t.log_table.data() + index;
+    float log_energy = table[0] + (table[1] - table[0]) * frac +
+                       (k + exponent) * kLn2 - t.log_square_length;
+    feat[bin] = std::max(log_energy, kLogEpsilon);
+  }
+}
+
+}  // namespace wenet
@@ -0,0 +1,102 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef FRONTEND_FIXED_FBANK_H_
+#define FRONTEND_FIXED_FBANK_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "frontend/fbank_kernels.h"
+#include "utils/log.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// The read only tables of a FixedFbank config, shared by all the FixedFbank
+// of the same config
+struct FixedFbankTables;
+
+// The fixed point Fbank for the cpus of slow float math, e.g. Cortex-A53.
+// It computes the same features as Fbank with the default options, i.e.
+// log, remove dc offset, preemphasis 0.97, povey window and no dither. The
+// dc offset is removed exactly in integers and the frame is normalized to 28
+// bits, the preemphasis, the window and the FFT twiddles are in Q31, the FFT
+// is block floating point halved by each stage, the power spectrum and the
+// mel filter bank of Q15 weights are exact in 64 bits, and the log is a
+// table lookup. The log mel energies are about 1e-4 from Fbank, and up to a
+// few 1e-2 for the bins of 120dB below the loudest one of the frame.
+class FixedFbank {
+ public:
+  FixedFbank(int num_bins, int sample_rate, int frame_length, int frame_shift);
+
+  // Override the kernels picked by the cpu, e.g. for parity tests
+  void set_kernels(const FixedFbankKernels& kernels) { kernels_ = &kernels; }
+
+  int num_bins() const { return num_bins_; }
+
+  // Number of frames in `num_samples` samples
+  int NumFrames(int num_samples) const {
+    if (num_samples < frame_length_) return 0;
+    return 1 + ((num_samples - frame_length_) / frame_shift_);
+  }
+
+  // Compute fbank feat, return num frames
+  int Compute(const std::vector<float>& wave,
+              std::vector<std::vector<float>>* feat);
+
+  // Same as Fbank::Compute, the frames are written to the caller's buffer,
+  // the i-th frame starts at feat + i * stride. The float samples are in
+  // the range of 16 bits PCM as the ones of Fbank.
+  template <typename T>
+  int Compute(const T* wave, int num_samples, int stride, float* feat) {
+    CHECK_GE(stride, num_bins_);
+    int num_frames = NumFrames(num_samples);
+    for (int i = 0; i < num_frames; ++i) {
+      LoadFrame(wave + i * frame_shift_);
+      ComputeFrame(feat + i * stride);
+    }
+    return num_frames;
+  }
+
+ private:
+  // Load frame_length_ samples to frame_ in Q8, the 16 bits PCM are exact
+  void LoadFrame(const int16_t* wave);
+  void LoadFrame(const float* wave);
+  // Compute the features of frame_ to feat
+  void ComputeFrame(float* feat);
+  // In place FFT of the n / 2 points complex sequence of fft_real_ and
+  // fft_img_, which is bit reversed and halved by each stage
+  void Fft();
+
+  int num_bins_;
+  int frame_length_, frame_shift_;
+  const FixedFbankKernels* kernels_;
+  std::shared_ptr<const FixedFbankTables> tables_;
+
+  // scratch buffers of ComputeFrame()
+  std::vector<int32_t> frame_;
+  std::vector<int32_t> fft_real_;
+  std::vector<int32_t> fft_img_;
+  std::vector<uint64_t> power_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(FixedFbank);
+};
+
+}  // namespace wenet
+
+#endif  // FRONTEND_FIXED_FBANK_H_
@@ -0,0 +1,134 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "frontend/resampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "frontend/fft.h"
+#include "utils/log.h"
+#include "utils/state_io.h"
+
+namespace wenet {
+
+static int Gcd(int a, int b) {
+  while (b != 0) {
+    int t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+Resampler::Resampler(int input_rate, int output_rate, int num_zeros)
+    : input_rate_(input_rate),
+      output_rate_(output_rate),
+      kernels_(&GetFbankKernels()) {
+  CHECK_GT(input_rate, 0);
+  CHECK_GT(output_rate, 0);
+  CHECK_GT(num_zeros, 0);
+  int gcd = Gcd(input_rate, output_rate);
+  up_ = output_rate / gcd;
+  down_ = input_rate / gcd;
+  // Cutoff in cycles per input sample, a little below the lower Nyquist
+  const double cutoff =
+      0.95 * 0.5 * std::min(1.0, static_cast<double>(up_) / down_);
+  // Half width of the filter in input samples
+  const double half_width = num_zeros / (2 * cutoff);
+  const int half_taps = static_cast<int>(std::ceil(half_width));
+  num_taps_ = 2 * half_taps;
+  // The output at input time t = base + p / up_ uses the inputs from
+  // base - half_taps + 1 to base + half_taps
+  filters_.resize(static_cast<size_t>(up_) * num_taps_);
+  for (int p = 0; p < up_; ++p) {
+    for (int k = 0; k < num_taps_; ++k) {
+      double x = static_cast<double>(p) / up_ + half_taps - 1 - k;
+      double w = 0.0;
+      if (std::fabs(x) < half_width) {
+        double window = 0.5 + 0.5 * std::cos(M_PI * x / half_width);
+        double sinc = x == 0.0 ? 1.0 : std::sin(M_2PI * cutoff * x) /
+                                           (M_2PI * cutoff * x);
+        w = 2 * cutoff * sinc * window;
+      }
+      filters_[p * num_taps_ + k] = w;
+    }
+  }
+  Reset();
+}
+
+void Resampler::Reset() {
+  // The samples before the stream are zeros
+  buffer_.assign(num_taps_, 0.0f);
+  buffer_start_ = -num_taps_;
+  num_inputs_ = 0;
+  num_outputs_ = 0;
+}
+
+void Resampler::Resample(const float* input, int num_samples, bool flush,
+                         std::vector<float>* output) {
+  buffer_.insert(buffer_.end(), input, input + num_samples);
+  num_inputs_ += num_samples;
+  int64_t num_available = num_inputs_;
+  // The outputs which cover the input [0, num_inputs_)
+  int64_t max_outputs = (num_inputs_ * up_ + down_ - 1) / down_;
+  if (flush) {
+    // The samples after the stream are zeros
+    buffer_.insert(buffer_.end(), num_taps_, 0.0f);
+    num_available += num_taps_;
+  }
+  const int half_taps = num_taps_ / 2;
+  while (num_outputs_ < max_outputs) {
+    int64_t base = num_outputs_ * down_ / up_;
+    int phase = num_outputs_ * down_ % up_;
+    int64_t first = base - half_taps + 1;
+    if (first + num_taps_ > num_available) break;
+    output->push_back(kernels_->Dot(filters_.data() + phase * num_taps_,
+                                    buffer_.data() + (first - buffer_start_),
+                                    num_taps_));
+    ++num_outputs_;
+  }
+  if (flush) {
+    Reset();
+    return;
+  }
+  // Drop the samples before the first input of the next output
+  int64_t next_first = num_outputs_ * down_ / up_ - half_taps + 1;
+  int64_t num_drop = std::min<int64_t>(next_first - buffer_start_,
+                                       buffer_.size());
+  if (num_drop > 0) {
+    buffer_.erase(buffer_.begin(), buffer_.begin() + num_drop);
+    buffer_start_ += num_drop;
+  }
+}
+
+void Resampler::SaveState(StateWriter* writer) const {
+  writer->WriteVector(buffer_);
+  writer->Write(buffer_start_);
+  writer->Write(num_inputs_);
+  writer->Write(num_outputs_);
+}
+
+bool Resampler::RestoreState(StateReader* reader) {
+  if (!reader->ReadVector(&buffer_) || !reader->Read(&buffer_start_) ||
+      !reader->Read(&num_inputs_) || !reader->Read(&num_outputs_) ||
+      buffer_start_ + static_cast<int64_t>(buffer_.size()) != num_inputs_) {
+    Reset();
+    return false;
+  }
+  return true;
+}
+
+}  // namespace wenet
@@ -0,0 +1,80 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef FRONTEND_RESAMPLER_H_
+#define FRONTEND_RESAMPLER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "frontend/fbank_kernels.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+class StateReader;
+class StateWriter;
+
+// Streaming polyphase resampler of a windowed sinc filter. The rate ratio
+// output_rate / input_rate is reduced to up / down, each output sample is
+// the dot product of one of the `up` filter phases and the input around it,
+// which is done by the SIMD Dot kernel of the fbank. The input tail is kept
+// between the calls of Resample(), so a stream can be fed in any pieces.
+class Resampler {
+ public:
+  // num_zeros: zero crossings of the sinc on each side, the quality of the
+  // low pass filter
+  Resampler(int input_rate, int output_rate, int num_zeros = 16);
+
+  // Resample num_samples samples in input, the output samples are appended
+  // to output. Pass flush = true with the last samples of the stream to get
+  // all the remaining outputs.
+  void Resample(const float* input, int num_samples, bool flush,
+                std::vector<float>* output);
+
+  void Reset();
+  // The input tail and the positions in the stream, a resampler of the
+  // same rates continues the stream after RestoreState()
+  void SaveState(StateWriter* writer) const;
+  bool RestoreState(StateReader* reader);
+
+  int input_rate() const { return input_rate_; }
+  int output_rate() const { return output_rate_; }
+
+ private:
+  int input_rate_;
+  int output_rate_;
+  int up_;
+  int down_;
+  int num_taps_;
+  // (up_, num_taps_) filters, the phase p is for the outputs at p / up_
+  // input samples after an input sample
+  std::vector<float> filters_;
+  const FbankKernels* kernels_;
+
+  // The input samples from buffer_start_ which may be used by the next
+  // outputs
+  std::vector<float> buffer_;
+  int64_t buffer_start_;
+  int64_t num_inputs_;
+  int64_t num_outputs_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(Resampler);
+};
+
+}  // namespace wenet
+
+#endif  // FRONTEND_RESAMPLER_H_
@@ -0,0 +1,57 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "frontend/vad.h"
+
+#include "utils/state_io.h"
+
+namespace wenet {
+
+bool EnergyVad::IsSpeech(const float* feat, int dim) {
+  float energy = 0;
+  for (int i = 0; i < dim; ++i) energy += feat[i];
+  energy /= dim;
+  if (energy < noise_floor_) {
+    noise_floor_ = energy;
+  } else {
+    noise_floor_ += opts_.floor_rise * (energy - noise_floor_);
+  }
+  if (energy > noise_floor_ + opts_.energy_margin &&
+      energy > opts_.min_energy) {
+    hangover_ = opts_.hangover_frames;
+    return true;
+  }
+  if (hangover_ > 0) {
+    --hangover_;
+    return true;
+  }
+  return false;
+}
+
+void EnergyVad::Reset() {
+  noise_floor_ = opts_.min_energy;
+  hangover_ = 0;
+}
+
+void EnergyVad::SaveState(StateWriter* writer) const {
+  writer->Write(noise_floor_);
+  writer->Write(hangover_);
+}
+
+bool EnergyVad::RestoreState(StateReader* reader) {
+  return reader->Read(&noise_floor_) && reader->Read(&hangover_);
+}
+
+}  // namespace wenet
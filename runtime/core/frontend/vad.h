@@ -0,0 +1,57 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef FRONTEND_VAD_H_
+#define FRONTEND_VAD_H_
+
+namespace wenet {
+
+class StateReader;
+class StateWriter;
+
+struct VadOptions {
+  // A frame is speech if its energy, the mean of the log mel energies, is
+  // energy_margin above the noise floor and above min_energy
+  float energy_margin = 2.0;
+  float min_energy = 3.0;
+  // The noise floor starts from min_energy, it follows a lower energy at
+  // once, and a higher energy by floor_rise per frame
+  float floor_rise = 0.002;
+  // Frames after a speech frame which are still taken as speech, so the
+  // short pauses in speech are kept
+  int hangover_frames = 30;
+};
+
+// A cheap frame level voice activity detector on the fbank features, it's
+// used to skip the model on the silence, see AsrDecoder::AdvanceDecoding.
+class EnergyVad {
+ public:
+  explicit EnergyVad(const VadOptions& opts) : opts_(opts) { Reset(); }
+
+  // feat: dim log mel energies of one frame
+  bool IsSpeech(const float* feat, int dim);
+  void Reset();
+  void SaveState(StateWriter* writer) const;
+  bool RestoreState(StateReader* reader);
+
+ private:
+  VadOptions opts_;
+  float noise_floor_;
+  int hangover_;
+};
+
+}  // namespace wenet
+
+#endif  // FRONTEND_VAD_H_
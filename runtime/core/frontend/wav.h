@@ -22,9 +22,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
 #include <string>
+#include <vector>
 
 #include "utils/log.h"
+#include "utils/utils.h"
 
 namespace wenet {
 
@@ -44,10 +47,83 @@ struct WavHeader {
   unsigned int data_size;
 };
 
+// Read the header of fp, and seek fp to the beginning of the samples
+static inline bool ReadWavHeader(FILE* fp, WavHeader* header) {
+  if (fread(header, 1, sizeof(*header), fp) != sizeof(*header)) {
+    LOG(WARNING) << "WaveData: incomplete wav header";
+    return false;
+  }
+  if (header->fmt_size < 16) {
+    fprintf(stderr,
+            "WaveData: expect PCM format data "
+            "to have fmt chunk of at least size 16.\n");
+    return false;
+  } else if (header->fmt_size > 16) {
+    int offset = 44 - 8 + header->fmt_size - 16;
+    fseek(fp, offset, SEEK_SET);
+    fread(header->data, 8, sizeof(char), fp);
+  }
+  // check "riff" "WAVE" "fmt " "data"
+
+  // Skip any subchunks between "fmt" and "data".  Usually there will
+  // be a single "fact" subchunk, but on Windows there can also be a
+  // "list" subchunk.
+  while (0 != strncmp(header->data, "data", 4)) {
+    // We will just ignore the data in these chunks.
+    fseek(fp, header->data_size, SEEK_CUR);
+    // read next subchunk
+    if (fread(header->data, 8, sizeof(char), fp) != 8) {
+      LOG(WARNING) << "WaveData: no data chunk";
+      return false;
+    }
+  }
+  switch (header->bit) {
+    case 8:
+    case 16:
+    case 32:
+      break;
+    default:
+      fprintf(stderr, "unsupported quantization bits");
+      exit(1);
+  }
+  return true;
+}
+
+// Convert num_samples samples of `channel` in the interleaved PCM of
+// num_channel channels and `bits` bits per sample to float
+static inline void PcmToFloat(const char* pcm, int bits, int num_channel,
+                              int channel, int num_samples, float* data) {
+  switch (bits) {
+    case 8: {
+      const char* p = pcm + channel;
+      for (int i = 0; i < num_samples; ++i) {
+        data[i] = static_cast<float>(p[i * num_channel]);
+      }
+      break;
+    }
+    case 16: {
+      const int16_t* p = reinterpret_cast<const int16_t*>(pcm) + channel;
+      for (int i = 0; i < num_samples; ++i) {
+        data[i] = static_cast<float>(p[i * num_channel]);
+      }
+      break;
+    }
+    case 32: {
+      const int32_t* p = reinterpret_cast<const int32_t*>(pcm) + channel;
+      for (int i = 0; i < num_samples; ++i) {
+        data[i] = static_cast<float>(p[i * num_channel]);
+      }
+      break;
+    }
+  }
+}
+
 class WavReader {
  public:
   WavReader() : data_(nullptr) {}
-  explicit WavReader(const std::string& filename) { Open(filename); }
+  explicit WavReader(const std::string& filename) : data_(nullptr) {
+    Open(filename);
+  }
 
   bool Open(const std::string& filename) {
     FILE* fp = fopen(filename.c_str(), "rb");
@@ -57,60 +133,31 @@ class WavReader {
     }
 
     WavHeader header;
-    fread(&header, 1, sizeof(header), fp);
-    if (header.fmt_size < 16) {
-      fprintf(stderr,
-              "WaveData: expect PCM format data "
-              "to have fmt chunk of at least size 16.\n");
+    if (!ReadWavHeader(fp, &header)) {
+      fclose(fp);
       return false;
-    } else if (header.fmt_size > 16) {
-      int offset = 44 - 8 + header.fmt_size - 16;
-      fseek(fp, offset, SEEK_SET);
-      fread(header.data, 8, sizeof(char), fp);
-    }
-    // check "riff" "WAVE" "fmt " "data"
-
-    // Skip any subchunks between "fmt" and "data".  Usually there will
-    // be a single "fact" subchunk, but on Windows there can also be a
-    // "list" subchunk.
-    while (0 != strncmp(header.data, "data", 4)) {
-      // We will just ignore the data in these chunks.
-      fseek(fp, header.data_size, SEEK_CUR);
-      // read next subchunk
-      fread(header.data, 8, sizeof(char), fp);
     }
 
     num_channel_ = header.channels;
     sample_rate_ = header.sample_rate;
     bits_per_sample_ = header.bit;
     int num_data = header.data_size / (bits_per_sample_ / 8);
+    delete[] data_;
     data_ = new float[num_data];
     num_sample_ = num_data / num_channel_;
 
-    for (int i = 0; i < num_data; ++i) {
-      switch (bits_per_sample_) {
-        case 8: {
-          char sample;
-          fread(&sample, 1, sizeof(char), fp);
-          data_[i] = static_cast<float>(sample);
-          break;
-        }
-        case 16: {
-          int16_t sample;
-          fread(&sample, 1, sizeof(int16_t), fp);
-          data_[i] = static_cast<float>(sample);
-          break;
-        }
-        case 32: {
-          int sample;
-          fread(&sample, 1, sizeof(int), fp);
-          data_[i] = static_cast<float>(sample);
-          break;
-        }
-        default:
-          fprintf(stderr, "unsupported quantization bits");
-          exit(1);
-      }
+    // Read all the PCM at once, and convert it in bulk
+    std::vector<char> pcm(header.data_size);
+    size_t size = fread(pcm.data(), 1, pcm.size(), fp);
+    if (size < pcm.size()) {
+      LOG(WARNING) << "Truncated wav " << filename;
+      memset(pcm.data() + size, 0, pcm.size() - size);
+    }
+    // The channels are deinterleaved while converting, each one is
+    // contiguous
+    for (int c = 0; c < num_channel_; ++c) {
+      PcmToFloat(pcm.data(), bits_per_sample_, num_channel_, c, num_sample_,
+                 data_ + static_cast<size_t>(c) * num_sample_);
     }
     fclose(fp);
     return true;
@@ -125,7 +172,13 @@ class WavReader {
     if (data_ != NULL) delete[] data_;
   }
 
+  // The num_sample() samples of the first channel
   const float* data() const { return data_; }
+  // The num_sample() samples of a channel, e.g. of the agent and of the
+  // customer of a call recording
+  const float* channel_data(int channel) const {
+    return data_ + static_cast<size_t>(channel) * num_sample_;
+  }
 
  private:
   int num_channel_;
@@ -135,6 +188,99 @@ class WavReader {
   float* data_;
 };
 
+// WavStreamReader reads a wav file chunk by chunk, so a long wav, e.g. hours
+// of audio, is fed to the FeaturePipeline with bounded memory:
+//
+//   WavStreamReader reader(path);
+//   std::vector<float> samples;
+//   while (reader.Read(16000, &samples) > 0) {
+//     feature_pipeline->AcceptWaveform(samples);
+//   }
+//
+// Only the first channel is read.
+class WavStreamReader {
+ public:
+  WavStreamReader() = default;
+  explicit WavStreamReader(const std::string& filename) { Open(filename); }
+  ~WavStreamReader() { Close(); }
+
+  bool Open(const std::string& filename) {
+    Close();
+    fp_ = fopen(filename.c_str(), "rb");
+    if (NULL == fp_) {
+      LOG(WARNING) << "Error in read " << filename;
+      return false;
+    }
+    WavHeader header;
+    if (!ReadWavHeader(fp_, &header)) {
+      Close();
+      return false;
+    }
+    num_channel_ = header.channels;
+    sample_rate_ = header.sample_rate;
+    bits_per_sample_ = header.bit;
+    num_sample_ = header.data_size / (bits_per_sample_ / 8) / num_channel_;
+    num_read_ = 0;
+    data_offset_ = ftell(fp_);
+    return true;
+  }
+
+  // Move to the sample `sample` of the wav, where the following Read()
+  // starts
+  bool Seek(int sample) {
+    if (NULL == fp_ || sample < 0 || sample > num_sample_) return false;
+    const int64_t block_size = num_channel_ * (bits_per_sample_ / 8);
+    if (fseek(fp_, data_offset_ + sample * block_size, SEEK_SET) != 0) {
+      return false;
+    }
+    num_read_ = sample;
+    return true;
+  }
+
+  // Read at most num_samples of the following samples to samples, return
+  // the number of samples read, 0 means the end of the wav.
+  int Read(int num_samples, std::vector<float>* samples) {
+    samples->clear();
+    if (NULL == fp_) return 0;
+    num_samples = std::min(num_samples, num_sample_ - num_read_);
+    const int block_size = num_channel_ * (bits_per_sample_ / 8);
+    pcm_.resize(static_cast<size_t>(num_samples) * block_size);
+    size_t size = fread(pcm_.data(), 1, pcm_.size(), fp_);
+    num_samples = size / block_size;
+    samples->resize(num_samples);
+    PcmToFloat(pcm_.data(), bits_per_sample_, num_channel_, 0, num_samples,
+               samples->data());
+    num_read_ += num_samples;
+    return num_samples;
+  }
+
+  int num_channel() const { return num_channel_; }
+  int sample_rate() const { return sample_rate_; }
+  int bits_per_sample() const { return bits_per_sample_; }
+  // sample points per channel of the whole wav
+  int num_sample() const { return num_sample_; }
+
+ private:
+  void Close() {
+    if (fp_ != NULL) fclose(fp_);
+    fp_ = NULL;
+  }
+
+  FILE* fp_ = NULL;
+  int num_channel_ = 0;
+  int sample_rate_ = 0;
+  int bits_per_sample_ = 0;
+  int num_sample_ = 0;
+  int num_read_ = 0;
+  // Where the samples start in the file
+  int64_t data_offset_ = 0;
+  // raw PCM of the current chunk
+  std::vector<char> pcm_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(WavStreamReader);
+};
+
 class WavWriter {
  public:
   WavWriter(const float* data, int num_sample, int num_channel, int sample_rate,
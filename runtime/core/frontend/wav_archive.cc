@@ -0,0 +1,271 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "frontend/wav_archive.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+#include "frontend/wav.h"
+#include "utils/log.h"
+#include "utils/string.h"
+
+namespace wenet {
+
+// The big sequential reads of the files on the network storage
+static const size_t kReadBufferBytes = 1 << 20;
+static const size_t kTarBlockBytes = 512;
+
+bool DecodeWavBytes(const std::string& bytes, WavData* wav) {
+#ifdef _WIN32
+  FILE* fp = tmpfile();
+  if (fp != NULL) {
+    fwrite(bytes.data(), 1, bytes.size(), fp);
+    rewind(fp);
+  }
+#else
+  FILE* fp = bytes.empty() ? NULL
+                           : fmemopen(const_cast<char*>(bytes.data()),
+                                      bytes.size(), "rb");
+#endif
+  if (fp == NULL) return false;
+  WavHeader header;
+  bool ok = ReadWavHeader(fp, &header) && header.channels > 0;
+  if (ok) {
+    const int block_size = header.channels * (header.bit / 8);
+    long offset = ftell(fp);  // NOLINT
+    size_t size = std::min<size_t>(header.data_size, bytes.size() - offset);
+    int num_samples = size / block_size;
+    wav->sample_rate = header.sample_rate;
+    wav->samples.resize(num_samples);
+    PcmToFloat(bytes.data() + offset, header.bit, header.channels, 0,
+               num_samples, wav->samples.data());
+  }
+  fclose(fp);
+  return ok;
+}
+
+// Read the whole file of path to bytes
+static bool ReadFile(const std::string& path, std::string* bytes) {
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (fp == NULL) return false;
+  bool ok = fseek(fp, 0, SEEK_END) == 0;
+  long size = ok ? ftell(fp) : -1;  // NOLINT
+  ok = size >= 0 && fseek(fp, 0, SEEK_SET) == 0;
+  if (ok) {
+    bytes->resize(size);
+    ok = fread(&(*bytes)[0], 1, size, fp) == static_cast<size_t>(size);
+  }
+  fclose(fp);
+  return ok;
+}
+
+// The size field of a tar header, octal, or base-256 of GNU tar if the
+// high bit of the first byte is set
+static bool ParseTarSize(const char* field, size_t len, uint64_t* size) {
+  *size = 0;
+  if (static_cast<unsigned char>(field[0]) & 0x80) {
+    *size = static_cast<unsigned char>(field[0]) & 0x7f;
+    for (size_t i = 1; i < len; ++i) {
+      *size = (*size << 8) | static_cast<unsigned char>(field[i]);
+    }
+    return true;
+  }
+  size_t i = 0;
+  while (i < len && field[i] == ' ') ++i;
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+    *size = (*size << 3) | (field[i] - '0');
+  }
+  return i < len && (field[i] == '\0' || field[i] == ' ');
+}
+
+// The "path" record of the pax extended header in bytes, "len path=value\n"
+static void ParsePaxPath(const std::string& bytes, std::string* path) {
+  size_t pos = 0;
+  while (pos < bytes.size()) {
+    size_t space = bytes.find(' ', pos);
+    if (space == std::string::npos) return;
+    size_t len = strtoul(bytes.c_str() + pos, nullptr, 10);
+    if (len == 0 || pos + len > bytes.size()) return;
+    std::string record = bytes.substr(space + 1, pos + len - space - 2);
+    if (record.compare(0, 5, "path=") == 0) *path = record.substr(5);
+    pos += len;
+  }
+}
+
+WavArchiveReader::~WavArchiveReader() {
+  if (!thread_.joinable()) return;
+  stop_ = true;
+  // Unblock the thread, it queues the nullptr once it sees stop_
+  while (ready_.Pop() != nullptr) {
+  }
+  thread_.join();
+}
+
+bool WavArchiveReader::Open(const std::string& rspecifier) {
+  CHECK(!thread_.joinable()) << "The reader is opened once";
+  size_t colon = rspecifier.find(':');
+  std::string type = rspecifier.substr(0, colon);
+  std::string path =
+      colon == std::string::npos ? "" : rspecifier.substr(colon + 1);
+  if (type == "tar") {
+    shard_ = path;
+  } else if (type == "scp" || type == "shards") {
+    is_shards_ = type == "shards";
+    script_.open(path);
+    if (!script_) {
+      LOG(ERROR) << "Failed to open " << path;
+      return false;
+    }
+  } else {
+    LOG(ERROR) << "Invalid rspecifier " << rspecifier;
+    return false;
+  }
+  thread_ = std::thread(&WavArchiveReader::Prefetch, this);
+  return true;
+}
+
+bool WavArchiveReader::Read(WavData* wav) {
+  std::unique_ptr<WavData> next = ready_.Pop();
+  if (next == nullptr) {
+    // For the other consumers
+    ready_.Push(nullptr);
+    return false;
+  }
+  std::swap(*wav, *next);
+  std::lock_guard<std::mutex> lock(free_mutex_);
+  free_.push_back(std::move(next));
+  return true;
+}
+
+std::unique_ptr<WavData> WavArchiveReader::NewWav() {
+  std::lock_guard<std::mutex> lock(free_mutex_);
+  if (free_.empty()) return std::unique_ptr<WavData>(new WavData);
+  std::unique_ptr<WavData> wav = std::move(free_.back());
+  free_.pop_back();
+  return wav;
+}
+
+bool WavArchiveReader::Queue(std::unique_ptr<WavData> wav) {
+  if (!DecodeWavBytes(wav->bytes, wav.get())) {
+    LOG(WARNING) << "Invalid wav of " << wav->key;
+  } else {
+    ready_.Push(std::move(wav));
+  }
+  return !stop_;
+}
+
+void WavArchiveReader::Prefetch() {
+  if (!shard_.empty()) {
+    ReadShard(shard_);
+  } else if (is_shards_) {
+    std::string line;
+    while (!stop_ && getline(script_, line)) {
+      std::vector<std::string> strs;
+      SplitString(line, &strs);
+      if (!strs.empty()) ReadShard(strs[0]);
+    }
+  } else {
+    ReadScript();
+  }
+  ready_.Push(nullptr);
+}
+
+void WavArchiveReader::ReadScript() {
+  std::string line;
+  while (!stop_ && getline(script_, line)) {
+    std::vector<std::string> strs;
+    SplitString(line, &strs);
+    if (strs.size() < 2) {
+      LOG(WARNING) << "Invalid line of wav scp: " << line;
+      continue;
+    }
+    std::unique_ptr<WavData> wav = NewWav();
+    wav->key = strs[0];
+    if (!ReadFile(strs[1], &wav->bytes)) {
+      LOG(WARNING) << "Failed to read " << strs[1];
+      continue;
+    }
+    if (!Queue(std::move(wav))) return;
+  }
+}
+
+void WavArchiveReader::ReadShard(const std::string& path) {
+  FILE* fp = fopen(path.c_str(), "rb");
+  if (fp == NULL) {
+    LOG(WARNING) << "Failed to open the shard " << path;
+    return;
+  }
+  setvbuf(fp, NULL, _IOFBF, kReadBufferBytes);
+  char header[kTarBlockBytes];
+  std::string long_name, bytes;
+  while (!stop_ &&
+         fread(header, 1, kTarBlockBytes, fp) == kTarBlockBytes &&
+         header[0] != '\0') {
+    uint64_t size = 0;
+    if (!ParseTarSize(header + 124, 12, &size)) {
+      LOG(WARNING) << "Invalid tar header in " << path;
+      break;
+    }
+    uint64_t padded = (size + kTarBlockBytes - 1) / kTarBlockBytes *
+                      kTarBlockBytes;
+    char type = header[156];
+    std::string name;
+    if (!long_name.empty()) {
+      name.swap(long_name);
+    } else {
+      name.assign(header, strnlen(header, 100));
+      if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != '\0') {
+        name = std::string(header + 345, strnlen(header + 345, 155)) + "/" +
+               name;
+      }
+    }
+    size_t slash = name.rfind('/');
+    std::string base = slash == std::string::npos ? name
+                                                  : name.substr(slash + 1);
+    size_t dot = base.rfind('.');
+    bool is_wav = (type == '0' || type == '\0') && dot != std::string::npos &&
+                  base.compare(dot, std::string::npos, ".wav") == 0;
+    if (type == 'L' || type == 'x' || is_wav) {
+      std::unique_ptr<WavData> wav;
+      std::string* data = &bytes;
+      if (is_wav) {
+        wav = NewWav();
+        data = &wav->bytes;
+      }
+      data->resize(size);
+      if (fread(&(*data)[0], 1, size, fp) != size ||
+          fseek(fp, padded - size, SEEK_CUR) != 0) {
+        LOG(WARNING) << "Truncated shard " << path;
+        break;
+      }
+      if (type == 'L') {
+        long_name.assign(data->c_str());
+      } else if (type == 'x') {
+        ParsePaxPath(*data, &long_name);
+      } else {
+        wav->key = base.substr(0, dot);
+        if (!Queue(std::move(wav))) break;
+      }
+    } else if (fseek(fp, padded, SEEK_CUR) != 0) {
+      LOG(WARNING) << "Truncated shard " << path;
+      break;
+    }
+  }
+  fclose(fp);
+}
+
+}  // namespace wenet
@@ -0,0 +1,87 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FRONTEND_WAV_ARCHIVE_H_
+#define FRONTEND_WAV_ARCHIVE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utils/blocking_queue.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// A wave read by WavArchiveReader, the first channel of it
+struct WavData {
+  std::string key;
+  int sample_rate = 0;
+  std::vector<float> samples;
+  // The bytes of the wav file, kept for the next wave read into this
+  std::string bytes;
+};
+
+// Decode the wav file in bytes to wav, return false if it's not a wav
+bool DecodeWavBytes(const std::string& bytes, WavData* wav);
+
+// Reads the waves of a wav.scp, "scp:wav.scp", of a tar shard, "tar:a.tar",
+// or of the tar shards of a list, one path per line, "shards:shards.list",
+// on a background thread ahead of the consumers, so the decoding doesn't
+// wait for the storage. The shards are the ones of the training, the members
+// "key.wav" are the waves, the others are skipped. At most lookahead waves
+// are read ahead, and the buffers of the waves taken are reused.
+class WavArchiveReader {
+ public:
+  explicit WavArchiveReader(int lookahead) : ready_(std::max(lookahead, 1)) {}
+  ~WavArchiveReader();
+
+  // Return false if the list can't be opened, the waves which can't be read
+  // are skipped with a warning
+  bool Open(const std::string& rspecifier);
+  // Move the next wave to wav, whose buffers are reused by the reader,
+  // return false after the last one. It's thread safe.
+  bool Read(WavData* wav);
+
+ private:
+  void Prefetch();
+  // Read the wav files of the lines of script_
+  void ReadScript();
+  void ReadShard(const std::string& path);
+  // Decode the bytes of wav and queue it, return false if stopped
+  bool Queue(std::unique_ptr<WavData> wav);
+  std::unique_ptr<WavData> NewWav();
+
+  bool is_shards_ = false;
+  std::string shard_;
+  std::ifstream script_;
+  std::thread thread_;
+  std::atomic<bool> stop_{false};
+  // The waves read, a nullptr after the last one
+  BlockingQueue<std::unique_ptr<WavData>> ready_;
+  std::mutex free_mutex_;
+  std::vector<std::unique_ptr<WavData>> free_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(WavArchiveReader);
+};
+
+}  // namespace wenet
+
+#endif  // FRONTEND_WAV_ARCHIVE_H_
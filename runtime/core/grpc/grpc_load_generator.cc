@@ -0,0 +1,297 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "grpc/grpc_load_generator.h"
+
+#include <grpcpp/alarm.h>
+#include <grpcpp/client_context.h>
+#include <grpcpp/create_channel.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+using grpc::ClientAsyncReaderWriter;
+using grpc::ClientContext;
+using grpc::Status;
+using wenet::Request;
+using wenet::Response;
+
+static int64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// The tag of an operation of a call, processed by the thread of the
+// completion queue
+struct GrpcClientEvent {
+  std::function<void(bool ok)> proceed;
+};
+
+// One Recognize call. Its events may be processed by any thread polling the
+// queue, so they're serialized by the mutex of the call. There is at most
+// one read, one write and one alarm pending, and the call is finished once
+// the reads are done and nothing else is pending, then it deletes itself.
+class GrpcLoadGenerator::Call {
+ public:
+  Call(GrpcLoadGenerator* generator, Lane* lane, const LoadTestWave& wave,
+       int stage)
+      : generator_(generator),
+        lane_(lane),
+        wave_(wave),
+        start_event_{[this](bool ok) { OnStart(ok); }},
+        read_event_{[this](bool ok) { OnRead(ok); }},
+        write_event_{[this](bool ok) { OnWrite(ok); }},
+        alarm_event_{[this](bool ok) { OnAlarm(ok); }},
+        finish_event_{[this](bool ok) { OnFinish(ok); }} {
+    stream_.stage = stage;
+    stream_.audio_ms = wave.pcm.size() * 1000.0 / wave.sample_rate;
+    chunk_samples_ = std::max(
+        generator->opts_.chunk_ms * wave.sample_rate / 1000, 1);
+  }
+
+  void Start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    setup_us_ = NowUs();
+    call_ = lane_->stub->PrepareAsyncRecognize(&context_, &lane_->cq);
+    call_->StartCall(&start_event_);
+  }
+
+ private:
+  void OnStart(bool ok) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!ok) return Fail("start");
+    const LoadTestOptions& opts = generator_->opts_;
+    request_.mutable_decode_config()->set_nbest_config(opts.nbest);
+    request_.mutable_decode_config()->set_continuous_decoding_config(
+        opts.continuous_decoding);
+    writing_ = true;
+    call_->Write(request_, &write_event_);
+    reading_ = true;
+    call_->Read(&response_, &read_event_);
+  }
+
+  // The audio is sent once the server is ready for it and the decode config
+  // is written, the time before the server is ready is the setup of the call
+  void StartAudio() {
+    if (!config_written_ || stream_.setup_ms < 0 || start_us_ > 0) return;
+    start_us_ = NowUs();
+    SendAudio();
+  }
+
+  void SendAudio() {
+    if (failed_ || !reading_) return MaybeFinish();
+    const int num_samples = wave_.pcm.size();
+    if (offset_ >= num_samples) {
+      end_us_ = NowUs();
+      writing_ = true;
+      call_->WritesDone(&write_event_);
+      return;
+    }
+    sending_ = std::min(chunk_samples_, num_samples - offset_);
+    request_.set_audio_data(wave_.pcm.data() + offset_,
+                            sending_ * sizeof(int16_t));
+    last_send_us_ = NowUs();
+    writing_ = true;
+    call_->Write(request_, &write_event_);
+  }
+
+  // Send the next chunk when the audio sent so far is due
+  void ScheduleAudio() {
+    const double speed = generator_->opts_.speed;
+    if (speed <= 0) return SendAudio();
+    int64_t due_us = start_us_ + static_cast<int64_t>(
+        offset_ * 1e6 / wave_.sample_rate / speed);
+    alarm_pending_ = true;
+    alarm_.Set(&lane_->cq,
+               std::chrono::system_clock::now() +
+                   std::chrono::microseconds(due_us - NowUs()),
+               &alarm_event_);
+  }
+
+  void OnWrite(bool ok) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    writing_ = false;
+    if (!ok) return Fail("write");
+    if (!config_written_) {
+      config_written_ = true;
+      return StartAudio();
+    }
+    if (end_us_ > 0) return MaybeFinish();
+    offset_ += sending_;
+    ScheduleAudio();
+  }
+
+  void OnAlarm(bool ok) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    alarm_pending_ = false;
+    // The alarm is cancelled when the call fails
+    if (!ok) return MaybeFinish();
+    SendAudio();
+  }
+
+  void OnRead(bool ok) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!ok) {
+      // The server is done with the responses, or the call is broken
+      reading_ = false;
+      if (alarm_pending_) alarm_.Cancel();
+      return MaybeFinish();
+    }
+    const int64_t now_us = NowUs();
+    if (response_.status() != Response::ok) {
+      LOG(WARNING) << wave_.key << " failed: " << response_.ShortDebugString();
+      failed_ = true;
+      context_.TryCancel();
+    } else if (response_.type() == Response::server_ready) {
+      if (stream_.setup_ms < 0) {
+        stream_.setup_ms = (now_us - setup_us_) / 1000.0;
+        StartAudio();
+      }
+    } else if (response_.type() == Response::partial_result) {
+      if (last_send_us_ > 0) {
+        if (stream_.first_partial_ms < 0) {
+          stream_.first_partial_ms = (now_us - start_us_) / 1000.0;
+        }
+        stream_.partial_ms.push_back((now_us - last_send_us_) / 1000.0);
+      }
+    } else if (response_.type() == Response::final_result) {
+      // The finals before the writes are done are of the endpoints
+      if (end_us_ > 0 && stream_.final_ms < 0) {
+        stream_.final_ms = (now_us - end_us_) / 1000.0;
+      }
+    } else if (response_.type() == Response::speech_end) {
+      speech_end_ = true;
+    }
+    call_->Read(&response_, &read_event_);
+  }
+
+  void Fail(const char* what) {
+    if (!failed_) {
+      LOG(WARNING) << wave_.key << " " << what << " failed";
+      failed_ = true;
+      // The pending operations fail with the call cancelled
+      context_.TryCancel();
+    }
+    if (alarm_pending_) alarm_.Cancel();
+    MaybeFinish();
+  }
+
+  // Finish the call once nothing else is pending on it, with mutex_ held
+  void MaybeFinish() {
+    if (finishing_ || reading_ || writing_ || alarm_pending_) return;
+    finishing_ = true;
+    call_->Finish(&status_, &finish_event_);
+  }
+
+  void OnFinish(bool ok) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!status_.ok()) {
+        LOG(WARNING) << wave_.key << " Recognize rpc failed: "
+                     << status_.error_message();
+      }
+      stream_.ok = ok && status_.ok() && speech_end_ && !failed_;
+    }
+    generator_->OnStreamDone(stream_);
+    delete this;
+  }
+
+  GrpcLoadGenerator* generator_;
+  Lane* lane_;
+  const LoadTestWave& wave_;
+  std::mutex mutex_;
+  ClientContext context_;
+  std::unique_ptr<ClientAsyncReaderWriter<Request, Response>> call_;
+  grpc::Alarm alarm_;
+  Request request_;
+  Response response_;
+  Status status_;
+  GrpcClientEvent start_event_;
+  GrpcClientEvent read_event_;
+  GrpcClientEvent write_event_;
+  GrpcClientEvent alarm_event_;
+  GrpcClientEvent finish_event_;
+  int chunk_samples_ = 0;
+  int offset_ = 0;
+  // The samples of the pending write
+  int sending_ = 0;
+  bool config_written_ = false;
+  bool reading_ = false;
+  bool writing_ = false;
+  bool alarm_pending_ = false;
+  bool finishing_ = false;
+  bool failed_ = false;
+  bool speech_end_ = false;
+  int64_t setup_us_ = 0;
+  // When the first audio is sent
+  int64_t start_us_ = 0;
+  int64_t last_send_us_ = 0;
+  int64_t end_us_ = 0;
+  LoadTestStream stream_;
+};
+
+GrpcLoadGenerator::GrpcLoadGenerator(const LoadTestOptions& opts,
+                                     std::vector<LoadTestWave> waves)
+    : LoadTest(opts, std::move(waves)) {}
+
+void GrpcLoadGenerator::Run() {
+  const std::string target = opts_.hostname + ":" + std::to_string(opts_.port);
+  lanes_.clear();
+  for (int i = 0; i < std::max(opts_.num_io_threads, 1); ++i) {
+    // The channels don't share a connection, as the websocket ones
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    auto channel = grpc::CreateCustomChannel(
+        target, grpc::InsecureChannelCredentials(), args);
+    std::unique_ptr<Lane> lane(new Lane);
+    lane->stub = ASR::NewStub(channel);
+    lanes_.push_back(std::move(lane));
+  }
+  std::vector<std::thread> threads;
+  for (auto& lane : lanes_) {
+    grpc::CompletionQueue* cq = &lane->cq;
+    threads.emplace_back([cq]() {
+      void* tag = nullptr;
+      bool ok = false;
+      while (cq->Next(&tag, &ok)) {
+        static_cast<GrpcClientEvent*>(tag)->proceed(ok);
+      }
+    });
+  }
+  LoadTest::Run();
+  for (auto& lane : lanes_) {
+    lane->cq.Shutdown();
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  lanes_.clear();
+}
+
+void GrpcLoadGenerator::StartStream(const LoadTestWave& wave, int stage) {
+  Lane* lane = lanes_[next_lane_.fetch_add(1) % lanes_.size()].get();
+  (new Call(this, lane, wave, stage))->Start();
+}
+
+}  // namespace wenet
@@ -0,0 +1,66 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GRPC_GRPC_LOAD_GENERATOR_H_
+#define GRPC_GRPC_LOAD_GENERATOR_H_
+
+#include <grpcpp/channel.h>
+#include <grpcpp/completion_queue.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "utils/load_test.h"
+#include "utils/utils.h"
+
+#include "grpc/wenet.grpc.pb.h"
+
+namespace wenet {
+
+// GrpcLoadGenerator streams the waves to a gRPC server by the Recognize
+// calls of the async stub. Each of the num_io_threads threads polls a
+// completion queue of its own, with a channel of its own, and the calls are
+// spread over them round robin. The setup of a call is from its start to
+// the server_ready response, as the one of a websocket connection, so the
+// reports of the two servers are comparable.
+class GrpcLoadGenerator : public LoadTest {
+ public:
+  GrpcLoadGenerator(const LoadTestOptions& opts,
+                    std::vector<LoadTestWave> waves);
+
+  void Run() override;
+
+ protected:
+  void StartStream(const LoadTestWave& wave, int stage) override;
+
+ private:
+  class Call;
+  friend class Call;
+
+  // A channel and the completion queue of its calls
+  struct Lane {
+    std::unique_ptr<ASR::Stub> stub;
+    grpc::CompletionQueue cq;
+  };
+  std::vector<std::unique_ptr<Lane>> lanes_;
+  std::atomic<int> next_lane_{0};
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(GrpcLoadGenerator);
+};
+
+}  // namespace wenet
+
+#endif  // GRPC_GRPC_LOAD_GENERATOR_H_
@@ -14,86 +14,377 @@
 
 #include "grpc/grpc_server.h"
 
+#include <algorithm>
+
+#include "decoder/decode_metrics.h"
+#include "utils/async_log.h"
+
 namespace wenet {
 
-using grpc::ServerReaderWriter;
+using grpc::ServerAsyncReaderWriter;
+using grpc::ServerCompletionQueue;
 using wenet::Request;
 using wenet::Response;
 
+void GrpcConnectionHandler::Create(
+    ASR::AsyncService* service, ServerCompletionQueue* cq,
+    DecodeScheduler* scheduler,
+    std::shared_ptr<FeaturePipelineConfig> feature_config,
+    std::shared_ptr<DecodeOptions> decode_config,
+    std::shared_ptr<DecodeResource> decode_resource,
+    std::shared_ptr<AsrDecoderPool> decoder_pool,
+    std::shared_ptr<ModelRegistry> model_registry) {
+  std::shared_ptr<GrpcConnectionHandler> handler(new GrpcConnectionHandler(
+      service, cq, scheduler, std::move(feature_config),
+      std::move(decode_config), std::move(decode_resource),
+      std::move(decoder_pool), std::move(model_registry)));
+  handler->self_ = handler;
+  service->RequestRecognize(&handler->context_, &handler->stream_, cq, cq,
+                            &handler->connect_event_);
+}
+
 GrpcConnectionHandler::GrpcConnectionHandler(
-    ServerReaderWriter<Response, Request>* stream,
-    std::shared_ptr<Request> request, std::shared_ptr<Response> response,
+    ASR::AsyncService* service, ServerCompletionQueue* cq,
+    DecodeScheduler* scheduler,
     std::shared_ptr<FeaturePipelineConfig> feature_config,
     std::shared_ptr<DecodeOptions> decode_config,
-    std::shared_ptr<DecodeResource> decode_resource)
-    : stream_(std::move(stream)),
-      request_(std::move(request)),
-      response_(std::move(response)),
+    std::shared_ptr<DecodeResource> decode_resource,
+    std::shared_ptr<AsrDecoderPool> decoder_pool,
+    std::shared_ptr<ModelRegistry> model_registry)
+    : service_(service),
+      cq_(cq),
+      stream_(&context_),
+      connect_event_{[this](bool ok) { OnConnect(ok); }},
+      read_event_{[this](bool ok) { OnRead(ok); }},
+      write_event_{[this](bool ok) { OnWrite(ok); }},
+      done_event_{[this](bool ok) { OnDone(ok); }},
       feature_config_(std::move(feature_config)),
       decode_config_(std::move(decode_config)),
-      decode_resource_(std::move(decode_resource)) {}
+      decode_resource_(std::move(decode_resource)),
+      decoder_pool_(std::move(decoder_pool)),
+      model_registry_(std::move(model_registry)),
+      scheduler_(scheduler),
+      rescoring_session_(scheduler->NewSession()) {}
+
+GrpcConnectionHandler::~GrpcConnectionHandler() { OnStreamEnd(); }
+
+void GrpcConnectionHandler::OnConnect(bool ok) {
+  if (!ok) {
+    // The server is shutting down
+    self_.reset();
+    return;
+  }
+  LOG(INFO) << "Get Recognize request";
+  // Wait for the next call
+  Create(service_, cq_, scheduler_, feature_config_, decode_config_,
+         decode_resource_, decoder_pool_, model_registry_);
+  stream_.Read(&request_, &read_event_);
+}
+
+void GrpcConnectionHandler::OnRead(bool ok) {
+  if (!ok) {
+    // The client is done with the writes, or the call is broken
+    OnSpeechEnd();
+    std::lock_guard<std::mutex> lock(mutex_);
+    read_done_ = true;
+    DoWrite();
+    return;
+  }
+  try {
+    OnRequest();
+  } catch (std::exception const& e) {
+    LOG(ERROR) << e.what();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (read_done_) {
+    DoWrite();
+  } else if (!write_done_ && feature_pipeline_ != nullptr &&
+             !feature_pipeline_->PollSpace()) {
+    // Stop reading until the decoding catches up, the space callback reads
+    // on then
+    VLOG(2) << "Pause reading, the feature queue is full";
+    read_paused_ = true;
+  } else {
+    stream_.Read(&request_, &read_event_);
+  }
+}
+
+void GrpcConnectionHandler::ResumeRead() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (read_paused_) {
+    read_paused_ = false;
+    stream_.Read(&request_, &read_event_);
+  }
+}
+
+void GrpcConnectionHandler::OnWrite(bool ok) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  writing_ = false;
+  write_queue_.pop_front();
+  if (!ok) {
+    // The call is broken, drop the responses
+    LOG(WARNING) << "Failed to write the response";
+    write_queue_.clear();
+  }
+  DoWrite();
+}
+
+void GrpcConnectionHandler::OnDone(bool ok) {
+  LOG(INFO) << "Recognize call is finished";
+  self_.reset();
+}
+
+void GrpcConnectionHandler::OnRequest() {
+  if (!got_start_tag_) {
+    nbest_ = request_.decode_config().nbest_config();
+    continuous_decoding_ =
+        request_.decode_config().continuous_decoding_config();
+    async_rescoring_ = request_.decode_config().async_rescoring_config();
+    sample_rate_ = request_.decode_config().sample_rate_config();
+    partial_opts_.min_interval_ms =
+        std::max(request_.decode_config().partial_interval_ms_config(), 0);
+    partial_opts_.changed_only =
+        request_.decode_config().partial_changed_only_config();
+    partial_opts_.incremental =
+        request_.decode_config().partial_incremental_config();
+    lattice_ = request_.decode_config().lattice_config();
+    if (model_registry_ != nullptr) {
+      // The current version of the model, or the default model
+      const std::string& model = request_.decode_config().model_config();
+      decode_resource_ = model_registry_->Get(model);
+      if (decode_resource_ == nullptr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        finish_status_ = Status(grpc::StatusCode::NOT_FOUND,
+                                "Unknown model " + model);
+        read_done_ = true;
+        write_done_ = true;
+        return;
+      }
+    }
+    const std::string& codec = request_.decode_config().codec_config();
+    if (!codec.empty() && codec != "pcm") {
+      audio_decoder_ = CreateAudioDecoder(codec, feature_config_->sample_rate);
+      if (audio_decoder_ == nullptr) {
+        Response response;
+        response.set_status(Response::failed);
+        WriteResponse(response);
+        // Stop reading, the call is finished once the response is written
+        std::lock_guard<std::mutex> lock(mutex_);
+        read_done_ = true;
+        write_done_ = true;
+        return;
+      }
+    }
+    OnSpeechStart();
+    if (got_start_tag_) OnContexts();
+  } else if (request_.has_decode_config()) {
+    // Replace the contexts mid-stream, from the next sentence on
+    OnContexts();
+  } else if (!stop_recognition_) {
+    OnSpeechData();
+  }
+}
 
 void GrpcConnectionHandler::OnSpeechStart() {
   LOG(INFO) << "Recieved speech start signal, start reading speech";
+  DecodeOptions decode_config = *decode_config_;
+  if (decode_resource_->admission_controller != nullptr) {
+    admission_ = decode_resource_->admission_controller->Enter();
+    if (admission_ == Admission::kRejected) {
+      // UNAVAILABLE is retryable, finish the call at once
+      std::lock_guard<std::mutex> lock(mutex_);
+      finish_status_ =
+          Status(grpc::StatusCode::UNAVAILABLE, "Server is overloaded");
+      read_done_ = true;
+      write_done_ = true;
+      return;
+    } else if (admission_ == Admission::kDegraded) {
+      VLOG(1) << "Decode with the degraded profile";
+      DegradeDecodeOptions(&decode_config);
+    }
+  }
+  if (lattice_) {
+    decode_config.ctc_wfst_search_opts.output_lattice = true;
+  }
   got_start_tag_ = true;
-  response_->set_status(Response::ok);
-  response_->set_type(Response::server_ready);
-  stream_->Write(*response_);
-  feature_pipeline_ = std::make_shared<FeaturePipeline>(*feature_config_);
-  decoder_ = std::make_shared<AsrDecoder>(
-      feature_pipeline_, decode_resource_, *decode_config_);
-  // Start decoder thread
-  decode_thread_ = std::make_shared<std::thread>(
-      &GrpcConnectionHandler::DecodeThreadFunc, this);
+  stream_active_ = true;
+  DecodeMetrics::Get()->active_sessions->Add(1);
+  partial_filter_.reset(new PartialResultFilter(partial_opts_));
+  timer_.Reset();
+  Response response;
+  response.set_status(Response::ok);
+  response.set_type(Response::server_ready);
+  WriteResponse(response);
+  // The pool is of the default model, of the version when it's created
+  if (decoder_pool_ != nullptr && admission_ != Admission::kDegraded &&
+      decoder_pool_->resource() == decode_resource_ &&
+      (!lattice_ || decode_config_->ctc_wfst_search_opts.output_lattice)) {
+    PooledDecoder pooled = decoder_pool_->Acquire();
+    feature_pipeline_ = std::move(pooled.feature_pipeline);
+    decoder_ = std::move(pooled.decoder);
+  } else {
+    feature_pipeline_ = std::make_shared<FeaturePipeline>(*feature_config_);
+    decoder_ = std::make_shared<AsrDecoder>(feature_pipeline_,
+                                            decode_resource_, decode_config);
+  }
+  // Only the N-best the client asked for are built for the partial results
+  decoder_->set_partial_nbest(nbest_);
+  // The compressed audio is decoded at the sample rate of the feature config
+  if (sample_rate_ > 0 && audio_decoder_ == nullptr) {
+    feature_pipeline_->set_input_sample_rate(sample_rate_);
+  }
+  std::weak_ptr<GrpcConnectionHandler> handler = shared_from_this();
+  feature_pipeline_->set_space_callback([handler]() {
+    if (auto self = handler.lock()) self->ResumeRead();
+  });
+  // The session holds the handler until the decoding is done
+  decode_session_ = scheduler_->NewSession(
+      [self = shared_from_this()]() { return self->DecodeAvailable(); });
+  std::weak_ptr<DecodeScheduler::Session> session = decode_session_;
+  feature_pipeline_->set_ready_callback([session]() {
+    if (auto s = session.lock()) s->Notify();
+  });
+  decode_session_->Notify();
 }
 
 void GrpcConnectionHandler::OnSpeechEnd() {
   LOG(INFO) << "Recieved speech end signal";
-  CHECK(feature_pipeline_ != nullptr);
-  feature_pipeline_->set_input_finished();
+  if (got_end_tag_) return;
   got_end_tag_ = true;
+  if (feature_pipeline_ != nullptr) {
+    end_timer_.Reset();
+    feature_pipeline_->set_input_finished();
+  } else if (!got_start_tag_) {
+    // Nothing to decode
+    std::lock_guard<std::mutex> lock(mutex_);
+    write_done_ = true;
+  }
 }
-
 void GrpcConnectionHandler::OnPartialResult() {
-  LOG(INFO) << "Partial result";
-  response_->set_status(Response::ok);
-  response_->set_type(Response::partial_result);
-  stream_->Write(*response_);
+  LOG_EVERY_MS(INFO, 1000) << "Partial result";
+  response_.set_status(Response::ok);
+  response_.set_type(Response::partial_result);
+  WriteResponse(response_);
+}
+
+void GrpcConnectionHandler::MaybePartialResult() {
+  const std::vector<DecodeResult>& results = decoder_->result();
+  const std::string& sentence = results.empty() ? "" : results[0].sentence;
+  int num_stable = 0;
+  std::string suffix;
+  if (!partial_filter_->Filter(sentence, timer_.Elapsed(), &num_stable,
+                               &suffix)) {
+    return;
+  }
+  if (!first_partial_sent_) {
+    first_partial_sent_ = true;
+    DecodeMetrics::Get()->first_partial_ms->Observe(
+        audio_timer_.ElapsedUs() / 1000.0);
+  }
+  if (partial_opts_.incremental) {
+    response_.set_num_stable(num_stable);
+    response_.set_suffix(suffix);
+  } else {
+    SerializeResult(false);
+  }
+  OnPartialResult();
 }
 
 void GrpcConnectionHandler::OnFinalResult() {
   LOG(INFO) << "Final result";
-  response_->set_status(Response::ok);
-  response_->set_type(Response::final_result);
-  stream_->Write(*response_);
+  response_.set_status(Response::ok);
+  response_.set_type(Response::final_result);
+  if (lattice_) {
+    response_.set_lattice(decoder_->lattice());
+  }
+  WriteResponse(response_);
+}
+
+void GrpcConnectionHandler::OnFinalCtcResult() {
+  LOG(INFO) << "Final ctc result";
+  response_.set_status(Response::ok);
+  response_.set_type(Response::final_ctc_result);
+  WriteResponse(response_);
 }
 
 void GrpcConnectionHandler::OnFinish() {
+  if (end_of_input_) {
+    DecodeMetrics::Get()->final_ms->Observe(end_timer_.ElapsedUs() / 1000.0);
+  }
   // Send finish tag
-  response_->set_status(Response::ok);
-  response_->set_type(Response::speech_end);
-  stream_->Write(*response_);
+  response_.set_status(Response::ok);
+  response_.set_type(Response::speech_end);
+  WriteResponse(response_);
+}
+
+void GrpcConnectionHandler::OnContexts() {
+  const auto& config = request_.decode_config();
+  if (config.contexts_config_size() == 0) return;
+  if (decode_resource_->context_graph_cache == nullptr) {
+    LOG(WARNING) << "Ignore the contexts, see --context_cache_size";
+    return;
+  }
+  std::vector<std::string> contexts(config.contexts_config().begin(),
+                                    config.contexts_config().end());
+  decoder_->SetContextGraph(
+      decode_resource_->context_graph_cache->Get(contexts));
 }
 
 void GrpcConnectionHandler::OnSpeechData() {
+  CHECK(feature_pipeline_ != nullptr);
+  CHECK(decoder_ != nullptr);
+  if (!got_audio_) {
+    got_audio_ = true;
+    audio_timer_.Reset();
+  }
+  if (audio_decoder_ != nullptr) {
+    // Each audio_data is one compressed packet
+    pcm_.clear();
+    if (!audio_decoder_->Decode(request_.audio_data().c_str(),
+                                request_.audio_data().length(), &pcm_)) {
+      LOG(WARNING) << "Skip the corrupted packet";
+      return;
+    }
+    VLOG(2) << "Decoded " << pcm_.size() << " samples";
+    feature_pipeline_->AcceptWaveform(pcm_.data(), pcm_.size());
+    return;
+  }
   // Read binary PCM data
   const int16_t* pdata =
-      reinterpret_cast<const int16_t*>(request_->audio_data().c_str());
-  int num_samples = request_->audio_data().length() / sizeof(int16_t);
-  std::vector<float> pcm_data(num_samples);
-  for (int i = 0; i < num_samples; i++) {
-    pcm_data[i] = static_cast<float>(*pdata);
-    pdata++;
-  }
+      reinterpret_cast<const int16_t*>(request_.audio_data().c_str());
+  int num_samples = request_.audio_data().length() / sizeof(int16_t);
   VLOG(2) << "Recieved " << num_samples << " samples";
-  CHECK(feature_pipeline_ != nullptr);
-  CHECK(decoder_ != nullptr);
-  feature_pipeline_->AcceptWaveform(pcm_data);
+  feature_pipeline_->AcceptWaveform(pdata, num_samples);
+}
+
+void GrpcConnectionHandler::WriteResponse(const Response& response) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (finished_) return;
+  write_queue_.push_back(response);
+  DoWrite();
+}
+
+void GrpcConnectionHandler::DoWrite() {
+  if (writing_ || finished_) return;
+  if (!write_queue_.empty()) {
+    writing_ = true;
+    stream_.Write(write_queue_.front(), &write_event_);
+  } else if (read_done_ && write_done_) {
+    finished_ = true;
+    stream_.Finish(finish_status_, &done_event_);
+  }
 }
 
 void GrpcConnectionHandler::SerializeResult(bool finish) {
-  for (const DecodeResult& path : decoder_->result()) {
-    Response_OneBest* one_best_ = response_->add_nbest();
+  SerializeResult(decoder_->result(), finish, &response_);
+}
+
+// Serialize the first nbest of results to `out`
+static void SerializeNbest(
+    const std::vector<DecodeResult>& results, bool finish, int nbest,
+    google::protobuf::RepeatedPtrField<Response_OneBest>* out) {
+  for (const DecodeResult& path : results) {
+    Response_OneBest* one_best_ = out->Add();
     one_best_->set_sentence(path.sentence);
     if (finish) {
       for (const WordPiece& word_piece : path.word_pieces) {
@@ -101,81 +392,260 @@ void GrpcConnectionHandler::SerializeResult(bool finish) {
         one_piece_->set_word(word_piece.word);
         one_piece_->set_start(word_piece.start);
         one_piece_->set_end(word_piece.end);
+        one_piece_->set_max_confidence(word_piece.confidence.max);
+        one_piece_->set_mean_confidence(word_piece.confidence.mean);
+        one_piece_->set_min_confidence(word_piece.confidence.min);
       }
     }
-    if (response_->nbest_size() == nbest_) {
+    if (out->size() == nbest) {
       break;
     }
   }
-  return;
 }
 
-void GrpcConnectionHandler::DecodeThreadFunc() {
+void GrpcConnectionHandler::SerializeResult(
+    const std::vector<DecodeResult>& results, bool finish,
+    Response* response) {
+  SerializeNbest(results, finish, nbest_, response->mutable_nbest());
+}
+
+void GrpcConnectionHandler::AsyncRescoring() {
+  decoder_->FinalizeFirstPass();
+  SerializeResult(true);
+  OnFinalCtcResult();
+  std::shared_ptr<PendingRescoring> pending = decoder_->DetachRescoring();
+  rescoring_session_->Post([self = shared_from_this(), pending]() {
+    // response_ belongs to the decoding
+    Response response;
+    self->decoder_->Rescoring(pending.get());
+    self->SerializeResult(pending->result, true, &response);
+    LOG(INFO) << "Final result";
+    response.set_status(Response::ok);
+    response.set_type(Response::final_result);
+    if (self->lattice_) {
+      response.set_lattice(pending->lattice);
+    }
+    self->WriteResponse(response);
+  });
+}
+
+void GrpcConnectionHandler::Finish() {
+  auto finish = [self = shared_from_this()]() {
+    self->OnFinish();
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    self->write_done_ = true;
+    self->DoWrite();
+    // Read the rest of the requests, they are ignored
+    if (self->read_paused_) {
+      self->read_paused_ = false;
+      self->stream_.Read(&self->request_, &self->read_event_);
+    }
+  };
+  if (async_rescoring_) {
+    rescoring_session_->Post(finish);
+  } else {
+    finish();
+  }
+}
+
+bool GrpcConnectionHandler::DecodeAvailable() {
   while (true) {
-    DecodeState state = decoder_->Decode();
-    response_->clear_status();
-    response_->clear_type();
-    response_->clear_nbest();
+    DecodeState state = decoder_->Decode(false);
+    if (state == DecodeState::kWaitFeats) {
+      return true;
+    }
+    response_.clear_status();
+    response_.clear_type();
+    response_.clear_nbest();
+    response_.clear_num_stable();
+    response_.clear_suffix();
+    response_.clear_lattice();
     if (state == DecodeState::kEndFeats) {
-      decoder_->Rescoring();
-      SerializeResult(true);
-      OnFinalResult();
-      OnFinish();
+      if (async_rescoring_) {
+        AsyncRescoring();
+      } else {
+        decoder_->Rescoring();
+        SerializeResult(true);
+        OnFinalResult();
+      }
+      end_of_input_ = true;
+      Finish();
       stop_recognition_ = true;
-      break;
+      OnStreamEnd();
+      return false;
     } else if (state == DecodeState::kEndpoint) {
-      decoder_->Rescoring();
-      SerializeResult(true);
-      OnFinalResult();
+      if (async_rescoring_) {
+        AsyncRescoring();
+      } else {
+        decoder_->Rescoring();
+        SerializeResult(true);
+        OnFinalResult();
+      }
       // If it's not continuous decoidng, continue to do next recognition
       // otherwise stop the recognition
       if (continuous_decoding_) {
         decoder_->ResetContinuousDecoding();
+        partial_filter_->Reset();
       } else {
-        OnFinish();
+        Finish();
         stop_recognition_ = true;
-        break;
+        OnStreamEnd();
+        return false;
       }
     } else {
       if (decoder_->DecodedSomething()) {
-        SerializeResult(false);
-        OnPartialResult();
+        MaybePartialResult();
       }
     }
   }
 }
 
-void GrpcConnectionHandler::operator()() {
-  try {
-    while (stream_->Read(request_.get())) {
-      if (!got_start_tag_) {
-        nbest_ = request_->decode_config().nbest_config();
-        continuous_decoding_ =
-            request_->decode_config().continuous_decoding_config();
-        OnSpeechStart();
-      } else {
-        OnSpeechData();
-      }
-    }
-    OnSpeechEnd();
-    LOG(INFO) << "Read all pcm data, wait for decoding thread";
-    if (decode_thread_ != nullptr) {
-      decode_thread_->join();
-    }
-  } catch (std::exception const& e) {
-    LOG(ERROR) << e.what();
+void GrpcConnectionHandler::OnStreamEnd() {
+  if (!stream_active_) return;
+  stream_active_ = false;
+  DecodeMetrics* metrics = DecodeMetrics::Get();
+  metrics->active_sessions->Add(-1);
+  if (decoder_->decoded_audio_ms() > 0) {
+    metrics->stream_rtf->Observe(
+        static_cast<double>(decoder_->decoding_time_ms()) /
+        decoder_->decoded_audio_ms());
   }
+  LeaveAdmission();
+}
+
+void GrpcConnectionHandler::LeaveAdmission() {
+  if (admission_ == Admission::kRejected) return;
+  decode_resource_->admission_controller->Leave(
+      admission_, decoder_->decoded_audio_ms(), decoder_->decoding_time_ms());
+  admission_ = Admission::kRejected;
 }
 
-Status GrpcServer::Recognize(ServerContext* context,
-                             ServerReaderWriter<Response, Request>* stream) {
-  LOG(INFO) << "Get Recognize request" << std::endl;
-  auto request = std::make_shared<Request>();
-  auto response = std::make_shared<Response>();
-  GrpcConnectionHandler handler(stream, request, response, feature_config_,
-                                decode_config_, decode_resource_);
-  std::thread t(std::move(handler));
-  t.join();
-  return Status::OK;
+void GrpcTranscribeHandler::Create(ASR::AsyncService* service,
+                                   ServerCompletionQueue* cq,
+                                   BatchTranscriber* transcriber) {
+  auto handler = new GrpcTranscribeHandler(service, cq, transcriber);
+  handler->self_.reset(handler);
+  service->RequestTranscribe(&handler->context_, &handler->request_,
+                             &handler->responder_, cq, cq,
+                             &handler->connect_event_);
 }
+
+GrpcTranscribeHandler::GrpcTranscribeHandler(ASR::AsyncService* service,
+                                             ServerCompletionQueue* cq,
+                                             BatchTranscriber* transcriber)
+    : service_(service),
+      cq_(cq),
+      transcriber_(transcriber),
+      responder_(&context_),
+      connect_event_{[this](bool ok) { OnConnect(ok); }},
+      done_event_{[this](bool ok) { OnDone(ok); }} {}
+
+void GrpcTranscribeHandler::OnConnect(bool ok) {
+  if (!ok) {
+    // The server is shutting down
+    self_.reset();
+    return;
+  }
+  // Wait for the next call
+  Create(service_, cq_, transcriber_);
+  if (transcriber_ == nullptr) {
+    responder_.FinishWithError(
+        Status(grpc::StatusCode::UNAVAILABLE,
+               "Offline transcription is disabled"),
+        &done_event_);
+    return;
+  }
+  LOG(INFO) << "Get Transcribe request of " << request_.audios_size()
+            << " audios";
+  auto audios =
+      std::make_shared<std::vector<TranscribeAudio>>(request_.audios_size());
+  for (int i = 0; i < request_.audios_size(); ++i) {
+    const std::string& data = request_.audios(i).audio_data();
+    TranscribeAudio& audio = (*audios)[i];
+    audio.sample_rate = request_.audios(i).sample_rate();
+    audio.pcm.resize(data.size() / sizeof(int16_t));
+    std::copy_n(data.data(), audio.pcm.size() * sizeof(int16_t),
+                reinterpret_cast<char*>(audio.pcm.data()));
+  }
+  // The handler is alive until the call is finished
+  transcriber_->TranscribeAsync(
+      audios, [this](const BatchTranscriber::Results& results) {
+        OnTranscribed(results);
+      });
+}
+
+void GrpcTranscribeHandler::OnTranscribed(
+    const BatchTranscriber::Results& results) {
+  int nbest = std::max(request_.nbest_config(), 1);
+  response_.set_status(Response::ok);
+  for (const auto& result : results) {
+    SerializeNbest(result, true, nbest,
+                   response_.add_results()->mutable_nbest());
+  }
+  responder_.Finish(response_, Status::OK, &done_event_);
+}
+
+void GrpcTranscribeHandler::OnDone(bool ok) {
+  // The call is finished, or broken
+  self_.reset();
+}
+
+GrpcServer::GrpcServer(std::shared_ptr<FeaturePipelineConfig> feature_config,
+                       std::shared_ptr<DecodeOptions> decode_config,
+                       std::shared_ptr<DecodeResource> decode_resource,
+                       int num_cqs, int num_decode_threads,
+                       const BatchTranscribeOptions& transcribe_opts,
+                       std::shared_ptr<AsrDecoderPool> decoder_pool,
+                       std::shared_ptr<ModelRegistry> model_registry)
+    : num_cqs_(std::max(num_cqs, 1)),
+      num_decode_threads_(num_decode_threads),
+      transcribe_opts_(transcribe_opts),
+      feature_config_(std::move(feature_config)),
+      decode_config_(std::move(decode_config)),
+      decode_resource_(std::move(decode_resource)),
+      decoder_pool_(std::move(decoder_pool)),
+      model_registry_(std::move(model_registry)) {}
+
+void GrpcServer::Run(grpc::ServerBuilder* builder) {
+  builder->RegisterService(&service_);
+  for (int i = 0; i < num_cqs_; ++i) {
+    cqs_.emplace_back(builder->AddCompletionQueue());
+  }
+  // The decode workers are pinned by the thread placement once, since the
+  // sessions share them
+  scheduler_.reset(new DecodeScheduler(num_decode_threads_,
+                                       decode_resource_->thread_placement));
+  SetQueueMetrics(scheduler_.get(), decode_resource_->encoder_scheduler);
+  if (transcribe_opts_.max_batch_size > 0) {
+    transcriber_.reset(new BatchTranscriber(feature_config_, decode_config_,
+                                            decode_resource_,
+                                            transcribe_opts_));
+  }
+  server_ = builder->BuildAndStart();
+  CHECK(server_ != nullptr);
+  LOG(INFO) << num_cqs_ << " completion queues, "
+            << scheduler_->num_workers() << " decode threads";
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_cqs_; ++i) {
+    threads.emplace_back(&GrpcServer::HandleEvents, this, cqs_[i].get());
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+void GrpcServer::HandleEvents(ServerCompletionQueue* cq) {
+  // Each queue waits for one call at a time
+  GrpcConnectionHandler::Create(&service_, cq, scheduler_.get(),
+                                feature_config_, decode_config_,
+                                decode_resource_, decoder_pool_,
+                                model_registry_);
+  GrpcTranscribeHandler::Create(&service_, cq, transcriber_.get());
+  void* tag = nullptr;
+  bool ok = false;
+  while (cq->Next(&tag, &ok)) {
+    static_cast<GrpcEvent*>(tag)->proceed(ok);
+  }
+}
+
 }  // namespace wenet
@@ -15,81 +15,252 @@
 #ifndef GRPC_GRPC_SERVER_H_
 #define GRPC_GRPC_SERVER_H_
 
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <utility>
 #include <vector>
 
 #include "decoder/asr_decoder.h"
+#include "decoder/asr_decoder_pool.h"
+#include "decoder/batch_transcriber.h"
+#include "decoder/decode_scheduler.h"
+#include "decoder/model_registry.h"
+#include "decoder/partial_result_filter.h"
+#include "frontend/audio_decoder.h"
 #include "frontend/feature_pipeline.h"
 #include "utils/log.h"
+#include "utils/timer.h"
 
 #include "grpc/wenet.grpc.pb.h"
 
 namespace wenet {
 
+using grpc::ServerAsyncReaderWriter;
+using grpc::ServerAsyncResponseWriter;
+using grpc::ServerCompletionQueue;
 using grpc::ServerContext;
-using grpc::ServerReaderWriter;
 using grpc::Status;
 using wenet::ASR;
 using wenet::Request;
 using wenet::Response;
+using wenet::TranscribeRequest;
+using wenet::TranscribeResponse;
 
-class GrpcConnectionHandler {
+// The events of the calls, the tag of an operation is its GrpcEvent, which
+// is processed by the thread of the completion queue
+struct GrpcEvent {
+  std::function<void(bool ok)> proceed;
+};
+
+// One Recognize call on the async API. The reads, the writes and the finish
+// of the stream are events of the completion queue of the call, processed
+// by the thread of the queue. The decoding runs in a session of the shared
+// DecodeScheduler by Decode(false), its responses are queued and written
+// one by one.
+class GrpcConnectionHandler
+    : public std::enable_shared_from_this<GrpcConnectionHandler> {
  public:
-  GrpcConnectionHandler(ServerReaderWriter<Response, Request> *stream,
-                        std::shared_ptr<Request> request,
-                        std::shared_ptr<Response> response,
-                        std::shared_ptr<FeaturePipelineConfig> feature_config,
-                        std::shared_ptr<DecodeOptions> decode_config,
-                        std::shared_ptr<DecodeResource> decode_resource);
-  void operator()();
+  // Wait for the next call on `cq`, the handler is alive until its call is
+  // finished
+  static void Create(ASR::AsyncService* service, ServerCompletionQueue* cq,
+                     DecodeScheduler* scheduler,
+                     std::shared_ptr<FeaturePipelineConfig> feature_config,
+                     std::shared_ptr<DecodeOptions> decode_config,
+                     std::shared_ptr<DecodeResource> decode_resource,
+                     std::shared_ptr<AsrDecoderPool> decoder_pool,
+                     std::shared_ptr<ModelRegistry> model_registry);
+  ~GrpcConnectionHandler();
 
  private:
+  GrpcConnectionHandler(ASR::AsyncService* service,
+                        ServerCompletionQueue* cq, DecodeScheduler* scheduler,
+                        std::shared_ptr<FeaturePipelineConfig> feature_config,
+                        std::shared_ptr<DecodeOptions> decode_config,
+                        std::shared_ptr<DecodeResource> decode_resource,
+                        std::shared_ptr<AsrDecoderPool> decoder_pool,
+                        std::shared_ptr<ModelRegistry> model_registry);
+  void OnConnect(bool ok);
+  void OnRead(bool ok);
+  void OnWrite(bool ok);
+  void OnDone(bool ok);
+  // Read on after the reading is paused by a full feature queue
+  void ResumeRead();
+  void OnRequest();
   void OnSpeechStart();
   void OnSpeechEnd();
   void OnFinish();
   void OnSpeechData();
+  // Bias the session to the contexts_config of the decode_config
+  void OnContexts();
   void OnPartialResult();
+  // Send the partial result of the decoded chunk, if the filter passes it
+  void MaybePartialResult();
   void OnFinalResult();
-  void DecodeThreadFunc();
+  void OnFinalCtcResult();
+  // Decode the available features, return false if the decoding is done
+  bool DecodeAvailable();
+  void AsyncRescoring();
+  // Send speech_end after the pending rescorings
+  void Finish();
+  // Report the finished stream to the metrics and the admission
+  // controller, once
+  void OnStreamEnd();
+  void LeaveAdmission();
+  // Thread safe, the responses are queued and written in order
+  void WriteResponse(const Response& response);
+  // Write the next queued response, or finish the call if all the requests
+  // are read and all the responses are written, with mutex_ held
+  void DoWrite();
   void SerializeResult(bool finish);
+  void SerializeResult(const std::vector<DecodeResult>& results, bool finish,
+                       Response* response);
 
   bool continuous_decoding_ = false;
+  // Send the first pass result as final_ctc_result at once on endpoint, and
+  // the rescored one as final_result when the asynchronous rescoring is done
+  bool async_rescoring_ = false;
   int nbest_ = 1;
-  ServerReaderWriter<Response, Request> *stream_;
-  std::shared_ptr<Request> request_;
-  std::shared_ptr<Response> response_;
+  // Send the word lattice with the final results
+  bool lattice_ = false;
+  // Throttling of the partial results, by the partial_*_config options
+  PartialResultOptions partial_opts_;
+  std::unique_ptr<PartialResultFilter> partial_filter_;
+  // The partial results are timed from the speech start
+  Timer timer_;
+  // The first partial result is timed from the first audio, and the final
+  // one of the stream ended by the input from the end of the input
+  Timer audio_timer_;
+  bool got_audio_ = false;
+  bool first_partial_sent_ = false;
+  Timer end_timer_;
+  bool end_of_input_ = false;
+  // Sample rate of the speech data, 0 means the sample rate of the feature
+  // config, the speech is resampled otherwise
+  int sample_rate_ = 0;
+  // Decoder of the compressed audio_data, nullptr for the raw 16 bits PCM
+  std::unique_ptr<AudioDecoder> audio_decoder_;
+  std::vector<int16_t> pcm_;
+
+  ASR::AsyncService* service_;
+  ServerCompletionQueue* cq_;
+  ServerContext context_;
+  ServerAsyncReaderWriter<Response, Request> stream_;
+  GrpcEvent connect_event_;
+  GrpcEvent read_event_;
+  GrpcEvent write_event_;
+  GrpcEvent done_event_;
+  // Holds the handler from the call is connected until it's finished
+  std::shared_ptr<GrpcConnectionHandler> self_;
+  Request request_;
+  // The response being serialized by the decoding
+  Response response_;
   std::shared_ptr<FeaturePipelineConfig> feature_config_;
   std::shared_ptr<DecodeOptions> decode_config_;
+  // The resource of the model of the stream, which it keeps to the end
   std::shared_ptr<DecodeResource> decode_resource_;
+  // Optional, the sessions of the default decode options are taken from it
+  std::shared_ptr<AsrDecoderPool> decoder_pool_;
+  // Optional, the stream picks a model by the model_config from it
+  std::shared_ptr<ModelRegistry> model_registry_;
 
   bool got_start_tag_ = false;
   bool got_end_tag_ = false;
   // When endpoint is detected, stop recognition, and stop receiving data.
-  bool stop_recognition_ = false;
+  std::atomic<bool> stop_recognition_{false};
   std::shared_ptr<FeaturePipeline> feature_pipeline_ = nullptr;
   std::shared_ptr<AsrDecoder> decoder_ = nullptr;
-  std::shared_ptr<std::thread> decode_thread_ = nullptr;
+  // From the speech start to OnStreamEnd()
+  bool stream_active_ = false;
+  // kRejected if the stream is not admitted, or it's already left
+  Admission admission_ = Admission::kRejected;
+  DecodeScheduler* scheduler_;
+  std::shared_ptr<DecodeScheduler::Session> decode_session_;
+  // The rescorings run one by one in their own session, so the final
+  // results are sent in order
+  std::shared_ptr<DecodeScheduler::Session> rescoring_session_;
+
+  // The responses to write, the front one is being written if writing_.
+  // The call is finished when the requests are all read, the responses
+  // are all written and speech_end is sent.
+  std::mutex mutex_;
+  std::deque<Response> write_queue_;
+  bool writing_ = false;
+  bool read_paused_ = false;
+  bool read_done_ = false;
+  bool write_done_ = false;
+  bool finished_ = false;
+  Status finish_status_ = Status::OK;
 };
 
-class GrpcServer final : public ASR::Service {
+// One Transcribe call. The audios are decoded on the pool of the
+// BatchTranscriber, which finishes the call with the results.
+class GrpcTranscribeHandler {
  public:
+  // Wait for the next call on `cq`, the handler is alive until its call is
+  // finished. The calls fail if transcriber is nullptr.
+  static void Create(ASR::AsyncService* service, ServerCompletionQueue* cq,
+                     BatchTranscriber* transcriber);
+
+ private:
+  GrpcTranscribeHandler(ASR::AsyncService* service,
+                        ServerCompletionQueue* cq,
+                        BatchTranscriber* transcriber);
+  void OnConnect(bool ok);
+  void OnDone(bool ok);
+  // Called on the pool of the transcriber
+  void OnTranscribed(const BatchTranscriber::Results& results);
+
+  ASR::AsyncService* service_;
+  ServerCompletionQueue* cq_;
+  BatchTranscriber* transcriber_;
+  ServerContext context_;
+  ServerAsyncResponseWriter<TranscribeResponse> responder_;
+  GrpcEvent connect_event_;
+  GrpcEvent done_event_;
+  std::unique_ptr<GrpcTranscribeHandler> self_;
+  TranscribeRequest request_;
+  TranscribeResponse response_;
+};
+
+class GrpcServer {
+ public:
+  // num_cqs completion queues serve the calls, one thread each, and
+  // num_decode_threads threads decode all of them, 0 means one per cpu
   GrpcServer(std::shared_ptr<FeaturePipelineConfig> feature_config,
              std::shared_ptr<DecodeOptions> decode_config,
-             std::shared_ptr<DecodeResource> decode_resource)
-      : feature_config_(std::move(feature_config)),
-        decode_config_(std::move(decode_config)),
-        decode_resource_(std::move(decode_resource)) {}
-  Status Recognize(ServerContext *context,
-                   ServerReaderWriter<Response, Request> *reader) override;
+             std::shared_ptr<DecodeResource> decode_resource,
+             int num_cqs = 1, int num_decode_threads = 0,
+             const BatchTranscribeOptions& transcribe_opts = {},
+             std::shared_ptr<AsrDecoderPool> decoder_pool = nullptr,
+             std::shared_ptr<ModelRegistry> model_registry = nullptr);
+
+  // Register the service to `builder`, start the server and serve the
+  // calls, it never returns
+  void Run(grpc::ServerBuilder* builder);
 
  private:
+  void HandleEvents(ServerCompletionQueue* cq);
+
+  int num_cqs_;
+  int num_decode_threads_;
+  ASR::AsyncService service_;
+  std::unique_ptr<DecodeScheduler> scheduler_;
+  BatchTranscribeOptions transcribe_opts_;
+  // Decoder of the Transcribe calls
+  std::unique_ptr<BatchTranscriber> transcriber_;
+  std::vector<std::unique_ptr<ServerCompletionQueue>> cqs_;
+  std::unique_ptr<grpc::Server> server_;
   std::shared_ptr<FeaturePipelineConfig> feature_config_;
   std::shared_ptr<DecodeOptions> decode_config_;
   std::shared_ptr<DecodeResource> decode_resource_;
+  std::shared_ptr<AsrDecoderPool> decoder_pool_;
+  std::shared_ptr<ModelRegistry> model_registry_;
   DISALLOW_COPY_AND_ASSIGN(GrpcServer);
 };
 
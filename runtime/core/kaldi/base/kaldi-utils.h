@@ -117,6 +117,14 @@ void Sleep(float seconds);
           (reinterpret_cast<char*>(&a))[1] = t;} while (0)
 
 
+// Hint the cache to load the line of addr, for the random accesses which
+// are known ahead, e.g. the arcs of the next state of a decoder
+#if defined(__GNUC__)
+#  define KALDI_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#  define KALDI_PREFETCH(addr)
+#endif
+
 // Makes copy constructor and operator= private.
 #define KALDI_DISALLOW_COPY_AND_ASSIGN(type)    \
   type(const type&);                  \
@@ -21,6 +21,7 @@
 // limitations under the License.
 
 #include <algorithm>
+#include <atomic>
 #include <unordered_set>
 
 #include "decoder/lattice-faster-decoder.h"
@@ -28,6 +29,10 @@
 
 namespace kaldi {
 
+// The fewest tokens of a frame worth waking the threads of
+// LatticeFasterDecoderConfig::num_threads up
+static const size_t kMinParallelToks = 256;
+
 // instantiate this class once for each thing you have to decode.
 template <typename FST, typename Token>
 LatticeFasterDecoderTpl<FST, Token>::LatticeFasterDecoderTpl(
@@ -37,8 +42,14 @@ LatticeFasterDecoderTpl<FST, Token>::LatticeFasterDecoderTpl(
       delete_fst_(false),
       config_(config),
       num_toks_(0),
+      num_active_toks_(0),
       context_graph_(context_graph) {
   config.Check();
+  ilabel_sorted_ = fst_->Properties(fst::kILabelSorted, false) != 0;
+  if (config_.num_threads > 1 && fst_->Properties(fst::kExpanded, false)) {
+    team_.reset(new ThreadTeam(config_.num_threads));
+    expanded_arcs_.resize(config_.num_threads);
+  }
   toks_.SetSize(
       1000);  // just so on the first frame we do something reasonable.
 }
@@ -46,8 +57,17 @@ LatticeFasterDecoderTpl<FST, Token>::LatticeFasterDecoderTpl(
 template <typename FST, typename Token>
 LatticeFasterDecoderTpl<FST, Token>::LatticeFasterDecoderTpl(
     const LatticeFasterDecoderConfig &config, FST *fst)
-    : fst_(fst), delete_fst_(true), config_(config), num_toks_(0) {
+    : fst_(fst),
+      delete_fst_(true),
+      config_(config),
+      num_toks_(0),
+      num_active_toks_(0) {
   config.Check();
+  ilabel_sorted_ = fst_->Properties(fst::kILabelSorted, false) != 0;
+  if (config_.num_threads > 1 && fst_->Properties(fst::kExpanded, false)) {
+    team_.reset(new ThreadTeam(config_.num_threads));
+    expanded_arcs_.resize(config_.num_threads);
+  }
   toks_.SetSize(
       1000);  // just so on the first frame we do something reasonable.
 }
@@ -65,14 +85,17 @@ void LatticeFasterDecoderTpl<FST, Token>::InitDecoding() {
   DeleteElems(toks_.Clear());
   cost_offsets_.clear();
   ClearActiveTokens();
+  token_pool_.Reset();
+  link_pool_.Reset();
   warned_ = false;
   num_toks_ = 0;
+  num_active_toks_ = 0;
   decoding_finalized_ = false;
   final_costs_.clear();
   StateId start_state = fst_->Start();
   KALDI_ASSERT(start_state != fst::kNoStateId);
   active_toks_.resize(1);
-  Token *start_tok = new Token(0.0, 0.0, NULL, NULL, NULL);
+  Token *start_tok = token_pool_.New(0.0, 0.0, nullptr, nullptr, nullptr);
   active_toks_[0].toks = start_tok;
   toks_.Insert(start_state, start_tok);
   num_toks_++;
@@ -111,18 +134,25 @@ bool LatticeFasterDecoderTpl<FST, Token>::GetBestPath(
 template <typename FST, typename Token>
 bool LatticeFasterDecoderTpl<FST, Token>::GetRawLattice(
     Lattice *ofst, bool use_final_probs) const {
-  typedef LatticeArc Arc;
-  typedef Arc::StateId StateId;
-  typedef Arc::Weight Weight;
-  typedef Arc::Label Label;
-
   // Note: you can't use the old interface (Decode()) if you want to
   // get the lattice with use_final_probs = false.  You'd have to do
   // InitDecoding() and then AdvanceDecoding().
   if (decoding_finalized_ && !use_final_probs)
     KALDI_ERR << "You cannot call FinalizeDecoding() and then call "
               << "GetRawLattice() with use_final_probs == false";
+  return GetRawLatticePart(0, NumFramesDecoded(), use_final_probs, ofst);
+}
 
+template <typename FST, typename Token>
+bool LatticeFasterDecoderTpl<FST, Token>::GetRawLatticePart(
+    int32 begin_frame, int32 end_frame, bool use_final_probs,
+    Lattice *ofst) const {
+  typedef LatticeArc Arc;
+  typedef Arc::StateId StateId;
+  typedef Arc::Weight Weight;
+
+  // The final-probs only belong to the last frame decoded
+  use_final_probs = use_final_probs && end_frame == NumFramesDecoded();
   unordered_map<Token *, BaseFloat> final_costs_local;
 
   const unordered_map<Token *, BaseFloat> &final_costs =
@@ -131,15 +161,14 @@ bool LatticeFasterDecoderTpl<FST, Token>::GetRawLattice(
     ComputeFinalCosts(&final_costs_local, NULL, NULL);
 
   ofst->DeleteStates();
-  // num-frames plus one (since frames are one-based, and we have
-  // an extra frame for the start-state).
-  int32 num_frames = active_toks_.size() - 1;
-  KALDI_ASSERT(num_frames > 0);
+  KALDI_ASSERT(begin_frame >= 0 && begin_frame < end_frame &&
+               end_frame <= NumFramesDecoded());
+  KALDI_ASSERT(begin_frame == 0 || HasSingleToken(begin_frame));
   const int32 bucket_count = num_toks_ / 2 + 3;
   unordered_map<Token *, StateId> tok_map(bucket_count);
   // First create all states.
   std::vector<Token *> token_list;
-  for (int32 f = 0; f <= num_frames; f++) {
+  for (int32 f = begin_frame; f <= end_frame; f++) {
     if (active_toks_[f].toks == NULL) {
       KALDI_WARN << "GetRawLattice: no tokens active on frame " << f
                  << ": not producing lattice.\n";
@@ -158,10 +187,12 @@ bool LatticeFasterDecoderTpl<FST, Token>::GetRawLattice(
                 << " load:" << tok_map.load_factor()
                 << " max:" << tok_map.max_load_factor();
   // Now create all arcs.
-  for (int32 f = 0; f <= num_frames; f++) {
+  for (int32 f = begin_frame; f <= end_frame; f++) {
     for (Token *tok = active_toks_[f].toks; tok != NULL; tok = tok->next) {
       StateId cur_state = tok_map[tok];
       for (ForwardLinkT *l = tok->links; l != NULL; l = l->next) {
+        // The emitting links of the end frame leave the part
+        if (f == end_frame && l->ilabel != 0) continue;
         typename unordered_map<Token *, StateId>::const_iterator iter =
             tok_map.find(l->next_tok);
         StateId nextstate = iter->second;
@@ -191,7 +222,7 @@ bool LatticeFasterDecoderTpl<FST, Token>::GetRawLattice(
                 nextstate);
         ofst->AddArc(state, arc);
       }
-      if (f == num_frames) {
+      if (f == end_frame) {
         if (use_final_probs && !final_costs.empty()) {
           typename unordered_map<Token *, BaseFloat>::const_iterator iter =
               final_costs.find(tok);
@@ -284,7 +315,8 @@ LatticeFasterDecoderTpl<FST, Token>::FindOrAddToken(StateId state,
     // tokens on the currently final frame have zero extra_cost
     // as any of them could end up
     // on the winning path.
-    Token *new_tok = new Token(tot_cost, extra_cost, NULL, toks, backpointer);
+    Token *new_tok =
+        token_pool_.New(tot_cost, extra_cost, nullptr, toks, backpointer);
     // NULL: no forward links yet
     toks = new_tok;
     num_toks_++;
@@ -370,7 +402,7 @@ void LatticeFasterDecoderTpl<FST, Token>::PruneForwardLinks(
             prev_link->next = next_link;
           else
             tok->links = next_link;
-          delete link;
+          link_pool_.Delete(link);
           link = next_link;  // advance link but leave prev_link the same.
           *links_pruned = true;
         } else {  // keep the link and update the tok_extra_cost if needed.
@@ -462,7 +494,7 @@ void LatticeFasterDecoderTpl<FST, Token>::PruneForwardLinksFinal() {
             prev_link->next = next_link;
           else
             tok->links = next_link;
-          delete link;
+          link_pool_.Delete(link);
           link = next_link;  // advance link but leave prev_link the same.
         } else {  // keep the link and update the tok_extra_cost if needed.
           if (link_extra_cost < 0.0) {  // this is just a precaution.
@@ -524,7 +556,7 @@ void LatticeFasterDecoderTpl<FST, Token>::PruneTokensForFrame(
         prev_tok->next = tok->next;
       else
         toks = tok->next;
-      delete tok;
+      token_pool_.Delete(tok);
       num_toks_--;
     } else {  // fetch next Token
       prev_tok = tok;
@@ -770,6 +802,7 @@ BaseFloat LatticeFasterDecoderTpl<FST, Token>::ProcessEmitting(
 
   PossiblyResizeHash(
       tok_cnt);  // This makes sure the hash is always big enough.
+  num_active_toks_ += tok_cnt;
 
   BaseFloat next_cutoff = std::numeric_limits<BaseFloat>::infinity();
   // pruning "online" before having seen all tokens
@@ -784,8 +817,9 @@ BaseFloat LatticeFasterDecoderTpl<FST, Token>::ProcessEmitting(
     StateId state = best_elem->key;
     Token *tok = best_elem->val;
     cost_offset = -tok->tot_cost;
-    for (fst::ArcIterator<FST> aiter(*fst_, state); !aiter.Done();
-         aiter.Next()) {
+    fst::ArcIterator<FST> aiter(*fst_, state);
+    SkipInputEpsilons(state, &aiter);
+    for (; !aiter.Done(); aiter.Next()) {
       const Arc &arc = aiter.Value();
       if (arc.ilabel != 0) {  // propagate..
         BaseFloat new_weight = arc.weight.Value() + cost_offset -
@@ -806,13 +840,28 @@ BaseFloat LatticeFasterDecoderTpl<FST, Token>::ProcessEmitting(
   // the tokens are now owned here, in final_toks, and the hash is empty.
   // 'owned' is a complex thing here; the point is we need to call DeleteElem
   // on each elem 'e' to let toks_ know we're done with them.
+  if (team_ != nullptr && tok_cnt >= kMinParallelToks) {
+    expand_toks_.clear();
+    for (const Elem *e = final_toks; e != NULL; e = e->tail) {
+      if (e->val->tot_cost <= cur_cutoff) expand_toks_.push_back(e);
+    }
+    next_cutoff = ProcessEmittingParallel(decodable, frame, cost_offset,
+                                          adaptive_beam, next_cutoff);
+    DeleteElems(final_toks);
+    return next_cutoff;
+  }
   for (Elem *e = final_toks, *e_tail; e != NULL; e = e_tail) {
     // loop this way because we delete "e" as we go.
     StateId state = e->key;
     Token *tok = e->val;
+    // The costs of the tokens are still in cache from GetCutoff()
+    if (e->tail != NULL && e->tail->val->tot_cost <= cur_cutoff) {
+      PrefetchArcs(e->tail->key);
+    }
     if (tok->tot_cost <= cur_cutoff) {
-      for (fst::ArcIterator<FST> aiter(*fst_, state); !aiter.Done();
-           aiter.Next()) {
+      fst::ArcIterator<FST> aiter(*fst_, state);
+      SkipInputEpsilons(state, &aiter);
+      for (; !aiter.Done(); aiter.Next()) {
         const Arc &arc = aiter.Value();
         if (arc.ilabel != 0) {  // propagate..
           BaseFloat ac_cost = cost_offset -
@@ -824,31 +873,7 @@ BaseFloat LatticeFasterDecoderTpl<FST, Token>::ProcessEmitting(
           else if (tot_cost + adaptive_beam < next_cutoff)
             next_cutoff =
                 tot_cost + adaptive_beam;  // prune by best current token
-          // Note: the frame indexes into active_toks_ are one-based,
-          // hence the + 1.
-          Elem *e_next =
-              FindOrAddToken(arc.nextstate, frame + 1, tot_cost, tok, NULL);
-          // NULL: no change indicator needed
-
-          bool is_start_boundary = false;
-          bool is_end_boundary = false;
-          float context_score = 0;
-          if (context_graph_) {
-            if (arc.olabel == 0) {
-              e_next->val->context_state = tok->context_state;
-            } else {
-              e_next->val->context_state = context_graph_->GetNextState(
-                  tok->context_state, arc.olabel, &context_score,
-                  &is_start_boundary, &is_end_boundary);
-              graph_cost -= context_score;
-            }
-          }
-          // Add ForwardLink from tok to next_tok (put on head of list
-          // tok->links)
-          tok->links = new ForwardLinkT(e_next->val, arc.ilabel, arc.olabel,
-                                        graph_cost, ac_cost, is_start_boundary,
-                                        is_end_boundary, tok->links);
-          tok->links->context_score = context_score;
+          AddEmittingArc(tok, arc, frame, ac_cost, tot_cost);
         }
       }  // for all arcs
     }
@@ -858,13 +883,103 @@ BaseFloat LatticeFasterDecoderTpl<FST, Token>::ProcessEmitting(
   return next_cutoff;
 }
 
+template <typename FST, typename Token>
+inline void LatticeFasterDecoderTpl<FST, Token>::AddEmittingArc(
+    Token *tok, const Arc &arc, int32 frame, BaseFloat ac_cost,
+    BaseFloat tot_cost) {
+  // Note: the frame indexes into active_toks_ are one-based,
+  // hence the + 1.
+  Elem *e_next = FindOrAddToken(arc.nextstate, frame + 1, tot_cost, tok, NULL);
+  // NULL: no change indicator needed
+
+  BaseFloat graph_cost = arc.weight.Value();
+  bool is_start_boundary = false;
+  bool is_end_boundary = false;
+  float context_score = 0;
+  if (context_graph_) {
+    if (arc.olabel == 0) {
+      e_next->val->context_state = tok->context_state;
+    } else {
+      e_next->val->context_state = context_graph_->GetNextState(
+          tok->context_state, arc.olabel, &context_score, &is_start_boundary,
+          &is_end_boundary);
+      graph_cost -= context_score;
+    }
+  }
+  // Add ForwardLink from tok to next_tok (put on head of list
+  // tok->links)
+  tok->links = link_pool_.New(e_next->val, arc.ilabel, arc.olabel, graph_cost,
+                              ac_cost, is_start_boundary, is_end_boundary,
+                              tok->links);
+  tok->links->context_score = context_score;
+}
+
+// Lowers *cutoff to value, unless another thread has lowered it below.
+static inline void AtomicMin(std::atomic<BaseFloat> *cutoff, BaseFloat value) {
+  BaseFloat cur = cutoff->load(std::memory_order_relaxed);
+  while (value < cur &&
+         !cutoff->compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+  }
+}
+
+template <typename FST, typename Token>
+BaseFloat LatticeFasterDecoderTpl<FST, Token>::ProcessEmittingParallel(
+    DecodableInterface *decodable, int32 frame, BaseFloat cost_offset,
+    BaseFloat adaptive_beam, BaseFloat next_cutoff) {
+  int32 num_threads = team_->NumThreads();
+  int32 num_toks = expand_toks_.size();
+  std::atomic<BaseFloat> shared_cutoff(next_cutoff);
+  team_->Run([&](int32 t) {
+    std::vector<ExpandedArc> &arcs = expanded_arcs_[t];
+    arcs.clear();
+    int32 begin = static_cast<int64>(num_toks) * t / num_threads,
+          end = static_cast<int64>(num_toks) * (t + 1) / num_threads;
+    BaseFloat cutoff = shared_cutoff.load(std::memory_order_relaxed);
+    for (int32 i = begin; i < end; i++) {
+      if (i + 1 < end) PrefetchArcs(expand_toks_[i + 1]->key);
+      StateId state = expand_toks_[i]->key;
+      BaseFloat cur_cost = expand_toks_[i]->val->tot_cost;
+      // Take the tighter cutoffs of the other threads once per token
+      cutoff = std::min(cutoff, shared_cutoff.load(std::memory_order_relaxed));
+      fst::ArcIterator<FST> aiter(*fst_, state);
+      SkipInputEpsilons(state, &aiter);
+      for (; !aiter.Done(); aiter.Next()) {
+        const Arc &arc = aiter.Value();
+        if (arc.ilabel != 0) {  // propagate..
+          BaseFloat ac_cost =
+                        cost_offset -
+                        decodable->LogLikelihood(frame, arc.ilabel),
+                    tot_cost = cur_cost + ac_cost + arc.weight.Value();
+          if (tot_cost >= cutoff) continue;
+          if (tot_cost + adaptive_beam < cutoff) {
+            cutoff = tot_cost + adaptive_beam;
+            AtomicMin(&shared_cutoff, cutoff);
+          }
+          arcs.push_back({i, arc, ac_cost, tot_cost});
+        }
+      }
+    }
+  });
+  // Any cutoff of a thread is above the final one, so the arcs pruned by the
+  // threads are pruned by it as well, and it's the same for any slicing.
+  next_cutoff = shared_cutoff.load(std::memory_order_relaxed);
+  for (const std::vector<ExpandedArc> &arcs : expanded_arcs_) {
+    for (const ExpandedArc &e : arcs) {
+      if (e.tot_cost >= next_cutoff) continue;
+      AddEmittingArc(expand_toks_[e.tok_index]->val, e.arc, frame, e.ac_cost,
+                     e.tot_cost);
+    }
+  }
+  return next_cutoff;
+}
+
 // static inline
 template <typename FST, typename Token>
 void LatticeFasterDecoderTpl<FST, Token>::DeleteForwardLinks(Token *tok) {
   ForwardLinkT *l = tok->links, *m;
   while (l != NULL) {
     m = l->next;
-    delete l;
+    link_pool_.Delete(l);
     l = m;
   }
   tok->links = NULL;
@@ -920,6 +1035,9 @@ void LatticeFasterDecoderTpl<FST, Token>::ProcessNonemitting(BaseFloat cutoff) {
     for (fst::ArcIterator<FST> aiter(*fst_, state); !aiter.Done();
          aiter.Next()) {
       const Arc &arc = aiter.Value();
+      // The emitting arcs of an ilabel sorted graph are after all the
+      // epsilon ones
+      if (arc.ilabel != 0 && ilabel_sorted_) break;
       if (arc.ilabel == 0) {  // propagate nonemitting only...
         BaseFloat graph_cost = arc.weight.Value(),
                   tot_cost = cur_cost + graph_cost;
@@ -944,8 +1062,8 @@ void LatticeFasterDecoderTpl<FST, Token>::ProcessNonemitting(BaseFloat cutoff) {
           }
 
           tok->links =
-              new ForwardLinkT(e_new->val, 0, arc.olabel, graph_cost, 0,
-                               is_start_boundary, is_end_boundary, tok->links);
+              link_pool_.New(e_new->val, 0, arc.olabel, graph_cost, 0,
+                             is_start_boundary, is_end_boundary, tok->links);
           tok->links->context_score = context_score;
 
           // "changed" tells us whether the new token has a different
@@ -976,7 +1094,7 @@ void LatticeFasterDecoderTpl<
     for (Token *tok = active_toks_[i].toks; tok != NULL;) {
       DeleteForwardLinks(tok);
       Token *next_tok = tok->next;
-      delete tok;
+      token_pool_.Delete(tok);
       num_toks_--;
       tok = next_tok;
     }
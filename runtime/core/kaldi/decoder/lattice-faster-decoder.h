@@ -25,7 +25,10 @@
 
 #include <limits>
 #include <memory>
+#include <new>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "base/kaldi-common.h"
@@ -35,7 +38,8 @@
 #include "itf/decodable-itf.h"
 #include "lat/determinize-lattice-pruned.h"
 #include "lat/kaldi-lattice.h"
-#include "util/hash-list.h"
+#include "util/kaldi-thread.h"
+#include "util/token-hash.h"
 
 namespace kaldi {
 
@@ -53,6 +57,10 @@ struct LatticeFasterDecoderConfig {
   // a very important parameter.  It affects the algorithm that prunes the
   // tokens as we go.
   BaseFloat prune_scale;
+  // The threads expanding the emitting arcs of a frame, including the calling
+  // one. The tokens are still created by the calling thread, so it pays off
+  // for the large graphs with many arcs to scan per frame only.
+  int32 num_threads;
 
   // Most of the options inside det_opts are not actually queried by the
   // LatticeFasterDecoder class itself, but by the code that calls it, for
@@ -68,7 +76,8 @@ struct LatticeFasterDecoderConfig {
         determinize_lattice(true),
         beam_delta(0.5),
         hash_ratio(2.0),
-        prune_scale(0.1) {}
+        prune_scale(0.1),
+        num_threads(1) {}
   void Register(OptionsItf *opts) {
     det_opts.Register(opts);
     opts->Register("beam", &beam,
@@ -97,12 +106,15 @@ struct LatticeFasterDecoderConfig {
     opts->Register("hash-ratio", &hash_ratio,
                    "Setting used in decoder to "
                    "control hash behavior");
+    opts->Register("num-threads", &num_threads,
+                   "Number of threads expanding the emitting arcs of a "
+                   "frame; 1 for none");
   }
   void Check() const {
     KALDI_ASSERT(beam > 0.0 && max_active > 1 && lattice_beam > 0.0 &&
                  min_active <= max_active && prune_interval > 0 &&
                  beam_delta > 0.0 && hash_ratio >= 1.0 && prune_scale > 0.0 &&
-                 prune_scale < 1.0);
+                 prune_scale < 1.0 && num_threads >= 1);
   }
 };
 
@@ -242,6 +254,65 @@ struct BackpointerToken {
         context_state(0) {}
 };
 
+// Allocates objects of T in blocks and keeps the deleted ones in a free list,
+// so the decoder doesn't call malloc/free for every token and forward link.
+// The blocks are kept until the pool is destroyed and reused by the following
+// utterances.
+template <typename T>
+class ObjectPool {
+ public:
+  explicit ObjectPool(size_t block_size = 1024) : block_size_(block_size) {}
+
+  template <typename... Args>
+  T *New(Args &&... args) {
+    if (free_head_ == NULL) AllocateBlock();
+    Slot *slot = free_head_;
+    free_head_ = slot->next;
+    return new (slot) T(std::forward<Args>(args)...);
+  }
+
+  void Delete(T *obj) {
+    obj->~T();
+    Slot *slot = reinterpret_cast<Slot *>(obj);
+    slot->next = free_head_;
+    free_head_ = slot;
+  }
+
+  // Rebuild the free list in the order of the blocks, so the next utterance
+  // gets its objects sequentially again. All the objects must be deleted.
+  void Reset() {
+    free_head_ = NULL;
+    for (size_t i = blocks_.size(); i > 0; --i) Link(blocks_[i - 1].get());
+  }
+
+  size_t AllocatedBytes() const {
+    return blocks_.size() * block_size_ * sizeof(Slot);
+  }
+
+ private:
+  union Slot {
+    Slot *next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  void AllocateBlock() {
+    blocks_.emplace_back(new Slot[block_size_]);
+    Link(blocks_.back().get());
+  }
+
+  void Link(Slot *block) {
+    for (size_t i = block_size_; i > 0; --i) {
+      block[i - 1].next = free_head_;
+      free_head_ = &block[i - 1];
+    }
+  }
+
+  size_t block_size_;
+  Slot *free_head_ = NULL;
+  std::vector<std::unique_ptr<Slot[]>> blocks_;
+  KALDI_DISALLOW_COPY_AND_ASSIGN(ObjectPool);
+};
+
 }  // namespace decoder
 
 /** This is the "normal" lattice-generating decoder.
@@ -321,6 +392,25 @@ class LatticeFasterDecoderTpl {
   /// We could put that here in future needed.
   bool GetRawLattice(Lattice *ofst, bool use_final_probs = true) const;
 
+  /// Outputs the part of the raw lattice between the tokens of frames
+  /// begin_frame and end_frame, for the lattices determinized chunk by chunk
+  /// while decoding.  The frames count as in NumFramesDecoded(), frame 0 is
+  /// the start.  If begin_frame > 0 it must have a single token (see
+  /// HasSingleToken()), which is the start state, so all the paths pass
+  /// through it and the parts can be joined at it.  The tokens of end_frame
+  /// are the final states, with the final-probs only if end_frame is the
+  /// last frame decoded and use_final_probs is true, as in GetRawLattice().
+  bool GetRawLatticePart(int32 begin_frame, int32 end_frame,
+                         bool use_final_probs, Lattice *ofst) const;
+
+  /// Returns true if only one token is left on frame, all the paths of the
+  /// lattice pass through it.  The tokens of a frame are only reduced by the
+  /// later pruning, never added, so it stays true once it's true.
+  bool HasSingleToken(int32 frame) const {
+    const Token *toks = active_toks_[frame].toks;
+    return toks != NULL && toks->next == NULL;
+  }
+
   /// [Deprecated, users should now use GetRawLattice and determinize it
   /// themselves, e.g. using DeterminizeLatticePhonePrunedWrapper].
   /// Outputs an FST corresponding to the lattice-determinized
@@ -366,13 +456,33 @@ class LatticeFasterDecoderTpl {
   // whenever we call ProcessEmitting().
   inline int32 NumFramesDecoded() const { return active_toks_.size() - 1; }
 
+  // Returns the number of the tokens alive.
+  inline int32 NumToks() const { return num_toks_; }
+
+  // Returns the active tokens of the frames decoded, summed over the frames,
+  // which the cost of the search is proportional to.
+  inline int64 NumActiveToks() const { return num_active_toks_; }
+
+  // Returns the bytes held by the search, including the blocks of the pools
+  // which are kept for the following utterances.
+  size_t AllocatedBytes() const {
+    return toks_.AllocatedBytes() + token_pool_.AllocatedBytes() +
+           link_pool_.AllocatedBytes() +
+           active_toks_.capacity() * sizeof(TokenList) +
+           queue_.capacity() * sizeof(const Elem *) +
+           (tmp_array_.capacity() + cost_offsets_.capacity()) *
+               sizeof(BaseFloat) +
+           expand_toks_.capacity() * sizeof(const Elem *) +
+           ExpandedArcsBytes();
+  }
+
  protected:
   // we make things protected instead of private, as code in
   // LatticeFasterOnlineDecoderTpl, which inherits from this, also uses the
   // internals.
 
   // Deletes the elements of the singly linked list tok->links.
-  inline static void DeleteForwardLinks(Token *tok);
+  inline void DeleteForwardLinks(Token *tok);
 
   // head of per-frame list of Tokens (list is in topological order),
   // and something saying whether we ever pruned it using PruneForwardLinks.
@@ -384,7 +494,7 @@ class LatticeFasterDecoderTpl {
         : toks(NULL), must_prune_forward_links(true), must_prune_tokens(true) {}
   };
 
-  using Elem = typename HashList<StateId, Token *>::Elem;
+  using Elem = typename TokenHash<StateId, Token *>::Elem;
   // Equivalent to:
   //  struct Elem {
   //    StateId key;
@@ -469,19 +579,81 @@ class LatticeFasterDecoderTpl {
   /// use.
   BaseFloat ProcessEmitting(DecodableInterface *decodable);
 
+  /// The emitting arcs of the tokens of ProcessEmitting() expanded by team_,
+  /// see ProcessEmittingParallel().  The arcs of a token are recorded in
+  /// order, by the thread of its slice of expand_toks_.
+  struct ExpandedArc {
+    int32 tok_index;  // into expand_toks_
+    Arc arc;
+    BaseFloat ac_cost;
+    BaseFloat tot_cost;
+  };
+
+  /// ProcessEmitting() of the tokens of expand_toks_ by team_.  The threads
+  /// scan the arcs of the contiguous slices of the tokens, price them and prune
+  /// them by a cutoff shared by a lock-free min, then the calling thread
+  /// creates the tokens and the links of the arcs left, in the order of the
+  /// tokens and the arcs.  It prunes by the final cutoff of the frame, so the
+  /// lattice is the same for any number of threads; next_cutoff is the cutoff
+  /// of the best token.
+  BaseFloat ProcessEmittingParallel(DecodableInterface *decodable, int32 frame,
+                                    BaseFloat cost_offset,
+                                    BaseFloat adaptive_beam,
+                                    BaseFloat next_cutoff);
+
+  /// Creates or updates the token of arc on frame + 1 from tok, and the link
+  /// to it, the part of ProcessEmitting() which is not thread-safe.
+  inline void AddEmittingArc(Token *tok, const Arc &arc, int32 frame,
+                             BaseFloat ac_cost, BaseFloat tot_cost);
+
+  size_t ExpandedArcsBytes() const {
+    size_t bytes = 0;
+    for (const auto &arcs : expanded_arcs_) {
+      bytes += arcs.capacity() * sizeof(ExpandedArc);
+    }
+    return bytes;
+  }
+
   /// Processes nonemitting (epsilon) arcs for one frame.  Called after
   /// ProcessEmitting() on each frame.  The cost cutoff is computed by the
   /// preceding ProcessEmitting().
   void ProcessNonemitting(BaseFloat cost_cutoff);
 
-  // HashList defined in ../util/hash-list.h.  It actually allows us to maintain
+  // Move aiter over the epsilon arcs of state, which come first if the
+  // graph is ilabel sorted, e.g. the TLG of fstcomposetlg. The arcs of a
+  // const fst are in compressed sparse rows, so the emitting pass then
+  // iterates over the emitting arcs only.
+  void SkipInputEpsilons(StateId state, fst::ArcIterator<FST> *aiter) const {
+    if (ilabel_sorted_) aiter->Seek(fst_->NumInputEpsilons(state));
+  }
+
+  // Prefetch the arcs of state, which are expanded next. The states of a
+  // frame are scattered over the graph, so the arcs of each one are a cache
+  // miss otherwise.
+  void PrefetchArcs(StateId state) const {
+    fst::ArcIteratorData<Arc> data;
+    fst_->InitArcIterator(state, &data);
+    if (data.base != NULL) {
+      // The arcs of a lazy fst are computed by its iterator
+      delete data.base;
+      return;
+    }
+    if (data.narcs > 0) KALDI_PREFETCH(data.arcs);
+    if (data.ref_count != NULL) --(*data.ref_count);
+  }
+
+  // TokenHash defined in ../util/token-hash.h, the open addressing version
+  // of HashList in ../util/hash-list.h.  It actually allows us to maintain
   // more than one list (e.g. for current and previous frames), but only one of
   // them at a time can be indexed by StateId.  It is indexed by frame-index
   // plus one, where the frame-index is zero-based, as used in decodable object.
   // That is, the emitting probs of frame t are accounted for in tokens at
   // toks_[t+1].  The zeroth frame is for nonemitting transition at the start of
   // the graph.
-  HashList<StateId, Token *> toks_;
+  TokenHash<StateId, Token *> toks_;
+  // The Elems of toks_ are pooled by TokenHash itself
+  decoder::ObjectPool<Token> token_pool_;
+  decoder::ObjectPool<ForwardLinkT> link_pool_;
 
   std::vector<TokenList> active_toks_;  // Lists of tokens, indexed by
   // frame (members of TokenList are toks, must_prune_forward_links,
@@ -489,12 +661,20 @@ class LatticeFasterDecoderTpl {
   std::vector<const Elem *>
       queue_;  // temp variable used in ProcessNonemitting,
   std::vector<BaseFloat> tmp_array_;  // used in GetCutoff.
+  // The threads of config_.num_threads, if the arcs of fst_ are stored, as
+  // the arc iterators of a lazy fst are not thread-safe
+  std::unique_ptr<ThreadTeam> team_;
+  // temp variables used in ProcessEmittingParallel()
+  std::vector<const Elem *> expand_toks_;
+  std::vector<std::vector<ExpandedArc>> expanded_arcs_;
 
   // fst_ is a pointer to the FST we are decoding from.
   const FST *fst_;
   // delete_fst_ is true if the pointer fst_ needs to be deleted when this
   // object is destroyed.
   bool delete_fst_;
+  // If the arcs of fst_ are known to be sorted by ilabel
+  bool ilabel_sorted_;
 
   std::vector<BaseFloat> cost_offsets_;  // This contains, for each
   // frame, an offset that was added to the acoustic log-likelihoods on that
@@ -502,6 +682,7 @@ class LatticeFasterDecoderTpl {
   // zero, to reduce roundoff errors.
   LatticeFasterDecoderConfig config_;
   int32 num_toks_;  // current total #toks allocated...
+  int64 num_active_toks_;
   bool warned_;
 
   /// decoding_finalized_ is true if someone called FinalizeDecoding().  [note,
@@ -0,0 +1,428 @@
+// decoder/viterbi-faster-decoder.cc
+
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/viterbi-faster-decoder.h"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+namespace kaldi {
+
+template <typename FST>
+typename ViterbiFasterDecoderTpl<FST>::TokenMap::Slot *
+ViterbiFasterDecoderTpl<FST>::TokenMap::Find(StateId state) {
+  // Keep the load factor under 0.5
+  if (2 * (filled_.size() + 1) > slots_.size()) {
+    Rehash(std::max<size_t>(1024, 2 * slots_.size()));
+  }
+  size_t mask = slots_.size() - 1;
+  size_t i = (static_cast<size_t>(state) * 0x9E3779B1u) & mask;
+  while (slots_[i].tok != NULL && slots_[i].state != state) {
+    i = (i + 1) & mask;
+  }
+  return &slots_[i];
+}
+
+template <typename FST>
+void ViterbiFasterDecoderTpl<FST>::TokenMap::Insert(Slot *slot, StateId state,
+                                                    Token *tok) {
+  KALDI_ASSERT(slot->tok == NULL);
+  slot->state = state;
+  slot->tok = tok;
+  filled_.push_back(slot - slots_.data());
+}
+
+template <typename FST>
+void ViterbiFasterDecoderTpl<FST>::TokenMap::Clear() {
+  for (int32 i : filled_) slots_[i].tok = NULL;
+  filled_.clear();
+}
+
+template <typename FST>
+void ViterbiFasterDecoderTpl<FST>::TokenMap::Swap(TokenMap *other) {
+  slots_.swap(other->slots_);
+  filled_.swap(other->filled_);
+}
+
+template <typename FST>
+void ViterbiFasterDecoderTpl<FST>::TokenMap::Rehash(size_t capacity) {
+  std::vector<Slot> old_slots(capacity, Slot{fst::kNoStateId, NULL});
+  old_slots.swap(slots_);
+  std::vector<int32> old_filled;
+  old_filled.swap(filled_);
+  for (int32 i : old_filled) {
+    const Slot &old = old_slots[i];
+    Insert(Find(old.state), old.state, old.tok);
+  }
+}
+
+template <typename FST>
+ViterbiFasterDecoderTpl<FST>::ViterbiFasterDecoderTpl(
+    const FST &fst, const LatticeFasterDecoderConfig &config,
+    const std::shared_ptr<wenet::ContextGraph> &context_graph)
+    : fst_(&fst),
+      config_(config),
+      context_graph_(context_graph),
+      ilabel_sorted_(fst.Properties(fst::kILabelSorted, false) != 0) {
+  config.Check();
+}
+
+template <typename FST>
+ViterbiFasterDecoderTpl<FST>::~ViterbiFasterDecoderTpl() {
+  ReleaseTokens(&cur_toks_);
+}
+
+template <typename FST>
+void ViterbiFasterDecoderTpl<FST>::InitDecoding() {
+  // All the tokens are referred by the active ones
+  ReleaseTokens(&cur_toks_);
+  token_pool_.Reset();
+  cost_offsets_.clear();
+  decoding_finalized_ = false;
+  warned_ = false;
+  StateId start_state = fst_->Start();
+  KALDI_ASSERT(start_state != fst::kNoStateId);
+  Token *start_tok = token_pool_.New();
+  *start_tok = Token{0.0, 0, 0, 0, 0.0, 0.0, NULL, 1};
+  cur_toks_.Insert(cur_toks_.Find(start_state), start_state, start_tok);
+  ProcessNonemitting(std::numeric_limits<BaseFloat>::infinity());
+}
+
+template <typename FST>
+void ViterbiFasterDecoderTpl<FST>::AdvanceDecoding(
+    DecodableInterface *decodable, int32 max_num_frames) {
+  if (std::is_same<FST, fst::Fst<fst::StdArc> >::value) {
+    // Call the AdvanceDecoding() of the more specific FST type, as
+    // LatticeFasterDecoderTpl does.
+    if (fst_->Type() == "const") {
+      reinterpret_cast<ViterbiFasterDecoderTpl<fst::ConstFst<fst::StdArc> > *>(
+          this)->AdvanceDecoding(decodable, max_num_frames);
+      return;
+    } else if (fst_->Type() == "vector") {
+      reinterpret_cast<
+          ViterbiFasterDecoderTpl<fst::VectorFst<fst::StdArc> > *>(this)
+          ->AdvanceDecoding(decodable, max_num_frames);
+      return;
+    }
+  }
+
+  KALDI_ASSERT(!decoding_finalized_ &&
+               "You must call InitDecoding() before AdvanceDecoding");
+  int32 num_frames_ready = decodable->NumFramesReady();
+  KALDI_ASSERT(num_frames_ready >= NumFramesDecoded());
+  int32 target_frames_decoded = num_frames_ready;
+  if (max_num_frames >= 0)
+    target_frames_decoded =
+        std::min(target_frames_decoded, NumFramesDecoded() + max_num_frames);
+  while (NumFramesDecoded() < target_frames_decoded) {
+    BaseFloat cost_cutoff = ProcessEmitting(decodable);
+    ProcessNonemitting(cost_cutoff);
+  }
+}
+
+template <typename FST>
+BaseFloat ViterbiFasterDecoderTpl<FST>::GetCutoff(const TokenMap &toks,
+                                                  BaseFloat *adaptive_beam,
+                                                  int32 *best_slot) {
+  BaseFloat best_weight = std::numeric_limits<BaseFloat>::infinity();
+  *best_slot = -1;
+  tmp_array_.clear();
+  bool need_array = config_.max_active != std::numeric_limits<int32>::max() ||
+                    config_.min_active != 0;
+  for (int32 i : toks.filled()) {
+    BaseFloat w = toks.slot(i).tok->tot_cost;
+    if (need_array) tmp_array_.push_back(w);
+    if (w < best_weight) {
+      best_weight = w;
+      *best_slot = i;
+    }
+  }
+  *adaptive_beam = config_.beam;
+  BaseFloat beam_cutoff = best_weight + config_.beam;
+  if (!need_array) return beam_cutoff;
+
+  if (tmp_array_.size() > static_cast<size_t>(config_.max_active)) {
+    std::nth_element(tmp_array_.begin(),
+                     tmp_array_.begin() + config_.max_active,
+                     tmp_array_.end());
+    BaseFloat max_active_cutoff = tmp_array_[config_.max_active];
+    if (max_active_cutoff < beam_cutoff) {  // max_active is tighter than beam.
+      *adaptive_beam = max_active_cutoff - best_weight + config_.beam_delta;
+      return max_active_cutoff;
+    }
+  }
+  if (tmp_array_.size() > static_cast<size_t>(config_.min_active)) {
+    BaseFloat min_active_cutoff = best_weight;
+    if (config_.min_active > 0) {
+      std::nth_element(
+          tmp_array_.begin(), tmp_array_.begin() + config_.min_active,
+          tmp_array_.size() > static_cast<size_t>(config_.max_active)
+              ? tmp_array_.begin() + config_.max_active
+              : tmp_array_.end());
+      min_active_cutoff = tmp_array_[config_.min_active];
+    }
+    if (min_active_cutoff > beam_cutoff) {  // min_active is looser than beam.
+      *adaptive_beam = min_active_cutoff - best_weight + config_.beam_delta;
+      return min_active_cutoff;
+    }
+  }
+  return beam_cutoff;
+}
+
+template <typename FST>
+bool ViterbiFasterDecoderTpl<FST>::UpdateToken(
+    StateId state, BaseFloat tot_cost, Token *backpointer, const Arc &arc,
+    BaseFloat graph_cost, BaseFloat ac_cost, int context_state) {
+  typename TokenMap::Slot *slot = cur_toks_.Find(state);
+  Token *tok = slot->tok;
+  if (tok == NULL) {
+    tok = token_pool_.New();
+    tok->ref_count = 1;
+    tok->backpointer = NULL;
+    cur_toks_.Insert(slot, state, tok);
+  } else if (tot_cost >= tok->tot_cost) {
+    return false;
+  }
+  if (tok->backpointer != backpointer) {
+    ++backpointer->ref_count;
+    if (tok->backpointer != NULL) ReleaseToken(tok->backpointer);
+    tok->backpointer = backpointer;
+  }
+  tok->tot_cost = tot_cost;
+  tok->context_state = context_state;
+  tok->ilabel = arc.ilabel;
+  tok->olabel = arc.olabel;
+  tok->graph_cost = graph_cost;
+  tok->ac_cost = ac_cost;
+  return true;
+}
+
+template <typename FST>
+void ViterbiFasterDecoderTpl<FST>::ReleaseToken(Token *tok) {
+  while (--tok->ref_count == 0) {
+    Token *prev = tok->backpointer;
+    token_pool_.Delete(tok);
+    if (prev == NULL) break;
+    tok = prev;
+  }
+}
+
+template <typename FST>
+void ViterbiFasterDecoderTpl<FST>::ReleaseTokens(TokenMap *toks) {
+  for (int32 i : toks->filled()) ReleaseToken(toks->slot(i).tok);
+  toks->Clear();
+}
+
+template <typename FST>
+BaseFloat ViterbiFasterDecoderTpl<FST>::ProcessEmitting(
+    DecodableInterface *decodable) {
+  int32 frame = NumFramesDecoded();
+  prev_toks_.Swap(&cur_toks_);
+  BaseFloat adaptive_beam;
+  int32 best_slot;
+  BaseFloat cur_cutoff = GetCutoff(prev_toks_, &adaptive_beam, &best_slot);
+  BaseFloat next_cutoff = std::numeric_limits<BaseFloat>::infinity();
+  BaseFloat cost_offset = 0.0;
+  // Process the best token first to get a tight bound on the next cutoff
+  if (best_slot >= 0) {
+    const typename TokenMap::Slot &best = prev_toks_.slot(best_slot);
+    cost_offset = -best.tok->tot_cost;
+    fst::ArcIterator<FST> aiter(*fst_, best.state);
+    SkipInputEpsilons(best.state, &aiter);
+    for (; !aiter.Done(); aiter.Next()) {
+      const Arc &arc = aiter.Value();
+      if (arc.ilabel != 0) {
+        BaseFloat new_weight = arc.weight.Value() + cost_offset -
+                               decodable->LogLikelihood(frame, arc.ilabel) +
+                               best.tok->tot_cost;
+        if (new_weight + adaptive_beam < next_cutoff)
+          next_cutoff = new_weight + adaptive_beam;
+      }
+    }
+  }
+  cost_offsets_.push_back(cost_offset);
+
+  for (int32 i : prev_toks_.filled()) {
+    const typename TokenMap::Slot &slot = prev_toks_.slot(i);
+    Token *tok = slot.tok;
+    if (tok->tot_cost > cur_cutoff) continue;
+    fst::ArcIterator<FST> aiter(*fst_, slot.state);
+    SkipInputEpsilons(slot.state, &aiter);
+    for (; !aiter.Done(); aiter.Next()) {
+      const Arc &arc = aiter.Value();
+      if (arc.ilabel == 0) continue;
+      BaseFloat ac_cost =
+          cost_offset - decodable->LogLikelihood(frame, arc.ilabel);
+      BaseFloat graph_cost = arc.weight.Value();
+      int context_state = tok->context_state;
+      if (context_graph_ && arc.olabel != 0) {
+        float context_score = 0;
+        bool is_start_boundary, is_end_boundary;
+        context_state = context_graph_->GetNextState(
+            tok->context_state, arc.olabel, &context_score,
+            &is_start_boundary, &is_end_boundary);
+        graph_cost -= context_score;
+      }
+      BaseFloat tot_cost = tok->tot_cost + ac_cost + graph_cost;
+      if (tot_cost >= next_cutoff) continue;
+      if (tot_cost + adaptive_beam < next_cutoff)
+        next_cutoff = tot_cost + adaptive_beam;
+      UpdateToken(arc.nextstate, tot_cost, tok, arc, graph_cost, ac_cost,
+                  context_state);
+    }
+  }
+  // The previous tokens are kept only if they're on a surviving path
+  ReleaseTokens(&prev_toks_);
+  return next_cutoff;
+}
+
+template <typename FST>
+void ViterbiFasterDecoderTpl<FST>::ProcessNonemitting(BaseFloat cutoff) {
+  KALDI_ASSERT(queue_.empty());
+  if (cur_toks_.filled().empty() && !warned_) {
+    KALDI_WARN << "Error, no surviving tokens: frame is "
+               << NumFramesDecoded() - 1;
+    warned_ = true;
+  }
+  for (int32 i : cur_toks_.filled()) {
+    StateId state = cur_toks_.slot(i).state;
+    if (fst_->NumInputEpsilons(state) != 0) queue_.push_back(state);
+  }
+  while (!queue_.empty()) {
+    StateId state = queue_.back();
+    queue_.pop_back();
+    Token *tok = cur_toks_.Find(state)->tok;
+    BaseFloat cur_cost = tok->tot_cost;
+    if (cur_cost >= cutoff) continue;
+    for (fst::ArcIterator<FST> aiter(*fst_, state); !aiter.Done();
+         aiter.Next()) {
+      const Arc &arc = aiter.Value();
+      if (arc.ilabel != 0) {
+        // The emitting arcs of an ilabel sorted graph are after all the
+        // epsilon ones
+        if (ilabel_sorted_) break;
+        continue;
+      }
+      BaseFloat graph_cost = arc.weight.Value();
+      int context_state = tok->context_state;
+      if (context_graph_ && arc.olabel != 0) {
+        float context_score = 0;
+        bool is_start_boundary, is_end_boundary;
+        context_state = context_graph_->GetNextState(
+            tok->context_state, arc.olabel, &context_score,
+            &is_start_boundary, &is_end_boundary);
+        graph_cost -= context_score;
+      }
+      BaseFloat tot_cost = cur_cost + graph_cost;
+      if (tot_cost >= cutoff) continue;
+      if (UpdateToken(arc.nextstate, tot_cost, tok, arc, graph_cost, 0.0,
+                      context_state) &&
+          fst_->NumInputEpsilons(arc.nextstate) != 0) {
+        queue_.push_back(arc.nextstate);
+      }
+    }
+  }
+}
+
+template <typename FST>
+bool ViterbiFasterDecoderTpl<FST>::GetBestPath(Lattice *olat,
+                                               bool use_final_probs) const {
+  olat->DeleteStates();
+  BaseFloat final_graph_cost;
+  BestPathIterator iter = BestPathEnd(use_final_probs, &final_graph_cost);
+  if (iter.Done()) return false;  // would have printed warning.
+  StateId state = olat->AddState();
+  olat->SetFinal(state, LatticeWeight(final_graph_cost, 0.0));
+  while (!iter.Done()) {
+    LatticeArc arc;
+    iter = TraceBackBestPath(iter, &arc);
+    arc.nextstate = state;
+    StateId new_state = olat->AddState();
+    olat->AddArc(new_state, arc);
+    state = new_state;
+  }
+  olat->SetStart(state);
+  return true;
+}
+
+template <typename FST>
+typename ViterbiFasterDecoderTpl<FST>::BestPathIterator
+ViterbiFasterDecoderTpl<FST>::BestPathEnd(bool use_final_probs,
+                                          BaseFloat *final_cost_out) const {
+  KALDI_ASSERT(NumFramesDecoded() > 0 &&
+               "You cannot call BestPathEnd if no frames were decoded.");
+  const BaseFloat infinity = std::numeric_limits<BaseFloat>::infinity();
+  // Any final state reached, or the final-probs are treated as one
+  bool reached_final = false;
+  if (use_final_probs) {
+    for (int32 i : cur_toks_.filled()) {
+      if (fst_->Final(cur_toks_.slot(i).state) != Weight::Zero()) {
+        reached_final = true;
+        break;
+      }
+    }
+  }
+  BaseFloat best_cost = infinity, best_final_cost = 0;
+  Token *best_tok = NULL;
+  for (int32 i : cur_toks_.filled()) {
+    const typename TokenMap::Slot &slot = cur_toks_.slot(i);
+    BaseFloat final_cost =
+        reached_final ? fst_->Final(slot.state).Value() : 0.0;
+    BaseFloat cost = slot.tok->tot_cost + final_cost;
+    if (cost < best_cost) {
+      best_cost = cost;
+      best_tok = slot.tok;
+      best_final_cost = final_cost;
+    }
+  }
+  if (best_tok == NULL) KALDI_WARN << "No final token found.";
+  if (final_cost_out) *final_cost_out = best_final_cost;
+  return BestPathIterator(best_tok, NumFramesDecoded() - 1);
+}
+
+template <typename FST>
+typename ViterbiFasterDecoderTpl<FST>::BestPathIterator
+ViterbiFasterDecoderTpl<FST>::TraceBackBestPath(BestPathIterator iter,
+                                                LatticeArc *oarc) const {
+  KALDI_ASSERT(!iter.Done() && oarc != NULL);
+  const Token *tok = static_cast<const Token *>(iter.tok);
+  int32 cur_t = iter.frame, step_t = 0;
+  if (tok->backpointer != NULL) {
+    oarc->ilabel = tok->ilabel;
+    oarc->olabel = tok->olabel;
+    BaseFloat acoustic_cost = tok->ac_cost;
+    if (tok->ilabel != 0) {
+      KALDI_ASSERT(static_cast<size_t>(cur_t) < cost_offsets_.size());
+      acoustic_cost -= cost_offsets_[cur_t];
+      step_t = -1;
+    }
+    oarc->weight = LatticeWeight(tok->graph_cost, acoustic_cost);
+  } else {
+    oarc->ilabel = 0;
+    oarc->olabel = 0;
+    oarc->weight = LatticeWeight::One();  // zero costs.
+  }
+  return BestPathIterator(tok->backpointer, cur_t + step_t);
+}
+
+// Instantiate the template for the FST types that we'll need.
+template class ViterbiFasterDecoderTpl<fst::Fst<fst::StdArc> >;
+template class ViterbiFasterDecoderTpl<fst::VectorFst<fst::StdArc> >;
+template class ViterbiFasterDecoderTpl<fst::ConstFst<fst::StdArc> >;
+
+}  // end namespace kaldi.
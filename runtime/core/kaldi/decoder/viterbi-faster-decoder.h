@@ -0,0 +1,175 @@
+// decoder/viterbi-faster-decoder.h
+
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef KALDI_DECODER_VITERBI_FASTER_DECODER_H_
+#define KALDI_DECODER_VITERBI_FASTER_DECODER_H_
+
+#include <memory>
+#include <vector>
+
+#include "decoder/lattice-faster-decoder.h"
+
+namespace kaldi {
+
+/** ViterbiFasterDecoderTpl is a token passing decoder for the single best
+    path only.  Each token keeps a backpointer and the arc it's reached by,
+    there are no forward links and no lattice pruning, and the tokens no
+    longer on any surviving path are freed by reference counting.  It shares
+    the config, the context biasing and the best path interface of
+    LatticeFasterOnlineDecoderTpl, so it could be used where no lattice or
+    N-best is needed.
+ */
+template <typename FST>
+class ViterbiFasterDecoderTpl {
+ public:
+  using Arc = typename FST::Arc;
+  using Label = typename Arc::Label;
+  using StateId = typename Arc::StateId;
+  using Weight = typename Arc::Weight;
+
+  ViterbiFasterDecoderTpl(
+      const FST &fst, const LatticeFasterDecoderConfig &config,
+      const std::shared_ptr<wenet::ContextGraph> &context_graph);
+  ~ViterbiFasterDecoderTpl();
+
+  // The same as LatticeFasterDecoderTpl::SetOptions, it applies from the
+  // next frame
+  void SetOptions(const LatticeFasterDecoderConfig &config) {
+    config_ = config;
+  }
+  const LatticeFasterDecoderConfig &GetOptions() const { return config_; }
+
+  struct Token {
+    BaseFloat tot_cost;
+    int context_state;
+    // The arc from backpointer to this token, ac_cost includes the cost
+    // offset of its frame
+    Label ilabel;
+    Label olabel;
+    BaseFloat graph_cost;
+    BaseFloat ac_cost;
+    Token *backpointer;
+    // Number of the tokens pointing to this one, plus one if it's active
+    int32 ref_count;
+  };
+
+  // The same as LatticeFasterOnlineDecoderTpl::BestPathIterator
+  struct BestPathIterator {
+    void *tok;
+    int32 frame;
+    BestPathIterator(void *t, int32 f) : tok(t), frame(f) {}
+    bool Done() const { return tok == NULL; }
+  };
+
+  void InitDecoding();
+  void AdvanceDecoding(DecodableInterface *decodable,
+                       int32 max_num_frames = -1);
+  // Nothing to prune, it only marks the end of decoding
+  void FinalizeDecoding() { decoding_finalized_ = true; }
+  int32 NumFramesDecoded() const { return cost_offsets_.size(); }
+  // The active tokens of the last frame, the older ones are only kept by
+  // the backpointers
+  int32 NumToks() const { return cur_toks_.filled().size(); }
+  // Bytes held by the search, including the blocks of token_pool_
+  size_t AllocatedBytes() const {
+    return cur_toks_.AllocatedBytes() + prev_toks_.AllocatedBytes() +
+           token_pool_.AllocatedBytes() +
+           queue_.capacity() * sizeof(StateId) +
+           (tmp_array_.capacity() + cost_offsets_.capacity()) *
+               sizeof(BaseFloat);
+  }
+
+  bool GetBestPath(Lattice *ofst, bool use_final_probs = true) const;
+  BestPathIterator BestPathEnd(bool use_final_probs,
+                               BaseFloat *final_cost = NULL) const;
+  BestPathIterator TraceBackBestPath(BestPathIterator iter,
+                                     LatticeArc *arc) const;
+
+ private:
+  // Open addressing (linear probing) map from the states to the active
+  // tokens of one frame, the filled slots are listed for the iteration and
+  // the cheap clearing.
+  class TokenMap {
+   public:
+    struct Slot {
+      StateId state;
+      Token *tok;
+    };
+    // Returns the slot of state, which is empty (tok == NULL) if it's not
+    // in the map, the slot must be filled by Insert() then.
+    Slot *Find(StateId state);
+    void Insert(Slot *slot, StateId state, Token *tok);
+    void Clear();
+    void Swap(TokenMap *other);
+    const std::vector<int32> &filled() const { return filled_; }
+    const Slot &slot(int32 i) const { return slots_[i]; }
+    size_t AllocatedBytes() const {
+      return slots_.capacity() * sizeof(Slot) +
+             filled_.capacity() * sizeof(int32);
+    }
+
+   private:
+    void Rehash(size_t capacity);
+    std::vector<Slot> slots_;
+    std::vector<int32> filled_;
+  };
+
+  // Move aiter over the epsilon arcs of state, which come first if the
+  // graph is ilabel sorted, e.g. the TLG of fstcomposetlg. The arcs of a
+  // const fst are in compressed sparse rows, so the emitting pass then
+  // iterates over the emitting arcs only.
+  void SkipInputEpsilons(StateId state, fst::ArcIterator<FST> *aiter) const {
+    if (ilabel_sorted_) aiter->Seek(fst_->NumInputEpsilons(state));
+  }
+  // The cutoff of the tokens in toks, also sets the best one
+  BaseFloat GetCutoff(const TokenMap &toks, BaseFloat *adaptive_beam,
+                      int32 *best_slot);
+  BaseFloat ProcessEmitting(DecodableInterface *decodable);
+  void ProcessNonemitting(BaseFloat cutoff);
+  // Adds the token of state, or updates it if tot_cost is better, and
+  // returns true if it's added or updated.
+  bool UpdateToken(StateId state, BaseFloat tot_cost, Token *backpointer,
+                   const Arc &arc, BaseFloat graph_cost, BaseFloat ac_cost,
+                   int context_state);
+  // Decreases the reference count, frees the token and, recursively, its
+  // backpointer if nothing refers to it.
+  void ReleaseToken(Token *tok);
+  void ReleaseTokens(TokenMap *toks);
+
+  const FST *fst_;
+  LatticeFasterDecoderConfig config_;
+  std::shared_ptr<wenet::ContextGraph> context_graph_;
+  // If the arcs of fst_ are known to be sorted by ilabel
+  bool ilabel_sorted_;
+  TokenMap cur_toks_;
+  TokenMap prev_toks_;
+  std::vector<StateId> queue_;
+  std::vector<BaseFloat> tmp_array_;
+  // The offset added to the acoustic costs of each decoded frame
+  std::vector<BaseFloat> cost_offsets_;
+  decoder::ObjectPool<Token> token_pool_;
+  bool decoding_finalized_ = false;
+  bool warned_ = false;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(ViterbiFasterDecoderTpl);
+};
+
+typedef ViterbiFasterDecoderTpl<fst::StdFst> ViterbiFasterDecoder;
+
+}  // end namespace kaldi.
+
+#endif  // KALDI_DECODER_VITERBI_FASTER_DECODER_H_
@@ -0,0 +1,597 @@
+// fstbin/fstcomposetlg.cc
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "base/kaldi-common.h"
+#include "fst/fstlib.h"
+#include "fstext/kaldi-fst-io.h"
+#include "util/kaldi-thread.h"
+#include "util/parse-options.h"
+
+namespace {
+
+using fst::StdArc;
+typedef StdArc::StateId StateId;
+typedef StdArc::Label Label;
+typedef StdArc::Weight Weight;
+using kaldi::int32;
+using kaldi::uint32;
+using kaldi::uint64;
+
+// An FST in compressed sparse rows, the arcs of each state are sorted on the
+// ilabel.
+struct ArcTable {
+  explicit ArcTable(const fst::StdVectorFst& fst) : start(fst.Start()) {
+    offsets.push_back(0);
+    for (StateId s = 0; s < fst.NumStates(); ++s) {
+      finals.push_back(fst.Final(s));
+      for (fst::ArcIterator<fst::StdVectorFst> aiter(fst, s); !aiter.Done();
+           aiter.Next()) {
+        arcs.push_back(aiter.Value());
+      }
+      std::stable_sort(arcs.begin() + offsets.back(), arcs.end(),
+                       fst::ILabelCompare<StdArc>());
+      offsets.push_back(arcs.size());
+    }
+  }
+
+  const StdArc* Begin(StateId s) const { return arcs.data() + offsets[s]; }
+  const StdArc* End(StateId s) const { return arcs.data() + offsets[s + 1]; }
+
+  StateId start;
+  std::vector<Weight> finals;
+  std::vector<size_t> offsets;
+  std::vector<StdArc> arcs;
+};
+
+// A state of T o LG, ordered by the LG state.
+inline uint64 PairKey(StateId lg_state, StateId t_state) {
+  return static_cast<uint64>(lg_state) << 32 | static_cast<uint32>(t_state);
+}
+
+// Calls fn(arc, next_key) for the arcs of the state key of T o LG, the
+// nextstate of the arc is left unset. LG has no input epsilons, so a T arc
+// with an epsilon olabel moves alone and the others match the LG arcs of the
+// same ilabel, there are no redundant epsilon paths to filter.
+template <class F>
+void ForEachArc(const ArcTable& t, const ArcTable& lg, uint64 key, F fn) {
+  const StateId lg_state = key >> 32, t_state = key & 0xffffffff;
+  for (const StdArc* a = t.Begin(t_state); a != t.End(t_state); ++a) {
+    if (a->olabel == 0) {
+      fn(StdArc(a->ilabel, 0, a->weight, fst::kNoStateId),
+         PairKey(lg_state, a->nextstate));
+      continue;
+    }
+    const StdArc* b = std::lower_bound(
+        lg.Begin(lg_state), lg.End(lg_state), a->olabel,
+        [](const StdArc& arc, Label label) { return arc.ilabel < label; });
+    for (; b != lg.End(lg_state) && b->ilabel == a->olabel; ++b) {
+      fn(StdArc(a->ilabel, b->olabel, fst::Times(a->weight, b->weight),
+                fst::kNoStateId),
+         PairKey(b->nextstate, a->nextstate));
+    }
+  }
+}
+
+// The empty slot of the PairSet, no state of T o LG has this key.
+const uint64 kEmptyKey = ~static_cast<uint64>(0);
+
+// Open addressing set of the visited states of the search.
+class PairSet {
+ public:
+  PairSet() : slots_(1024, kEmptyKey), size_(0) {}
+
+  bool Insert(uint64 key) {
+    if (2 * (size_ + 1) > slots_.size()) Grow();
+    const size_t mask = slots_.size() - 1;
+    for (size_t i = Hash(key) & mask;; i = (i + 1) & mask) {
+      if (slots_[i] == key) return false;
+      if (slots_[i] == kEmptyKey) {
+        slots_[i] = key;
+        ++size_;
+        return true;
+      }
+    }
+  }
+
+  // The keys in ascending order, the set is emptied.
+  std::vector<uint64> SortedKeys() {
+    std::vector<uint64> keys;
+    keys.reserve(size_);
+    for (uint64 key : slots_) {
+      if (key != kEmptyKey) keys.push_back(key);
+    }
+    std::vector<uint64>().swap(slots_);
+    size_ = 0;
+    std::sort(keys.begin(), keys.end());
+    return keys;
+  }
+
+ private:
+  static size_t Hash(uint64 key) {
+    return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 20);
+  }
+
+  void Grow() {
+    std::vector<uint64> slots(2 * slots_.size(), kEmptyKey);
+    slots.swap(slots_);
+    size_ = 0;
+    for (uint64 key : slots) {
+      if (key != kEmptyKey) Insert(key);
+    }
+  }
+
+  std::vector<uint64> slots_;
+  size_t size_;
+};
+
+// Temporary file of the arcs of a range of states, deleted on close.
+class SpillFile {
+ public:
+  explicit SpillFile(const std::string& dir) : file_(NULL) {
+#ifndef _WIN32
+    if (!dir.empty()) {
+      std::string name = dir + "/fstcomposetlg.XXXXXX";
+      std::vector<char> path(name.begin(), name.end());
+      path.push_back('\0');
+      int fd = mkstemp(path.data());
+      if (fd >= 0) {
+        unlink(path.data());
+        file_ = fdopen(fd, "w+b");
+      }
+    }
+#endif
+    if (file_ == NULL) file_ = std::tmpfile();
+    if (file_ == NULL) KALDI_ERR << "Failed to create a temporary file in "
+                                 << (dir.empty() ? "the default dir" : dir);
+  }
+  ~SpillFile() {
+    if (file_ != NULL) fclose(file_);
+  }
+
+  void Write(const StdArc* arcs, size_t n) {
+    if (n > 0 && fwrite(arcs, sizeof(StdArc), n, file_) != n) {
+      KALDI_ERR << "Failed to write the temporary file, disk full?";
+    }
+  }
+  void Read(StdArc* arcs, size_t n) {
+    if (n > 0 && fread(arcs, sizeof(StdArc), n, file_) != n) {
+      KALDI_ERR << "Failed to read the temporary file";
+    }
+  }
+  // Seeks to the arc n, or n arcs ahead if relative.
+  void Seek(uint64 n, bool relative) {
+    if (relative && n == 0) return;
+    const int whence = relative ? SEEK_CUR : SEEK_SET;
+#ifdef _WIN32
+    int ret = _fseeki64(file_, n * sizeof(StdArc), whence);
+#else
+    int ret = fseeko(file_, n * sizeof(StdArc), whence);
+#endif
+    if (ret != 0) KALDI_ERR << "Failed to seek the temporary file";
+  }
+
+ private:
+  FILE* file_;
+  KALDI_DISALLOW_COPY_AND_ASSIGN(SpillFile);
+};
+
+/*
+  The composition T o LG for a LG without input epsilons, i.e. determinized
+  by fstdeterminizestar. The states are found by a breadth first search whose
+  levels are expanded in parallel, then the state table is a sorted array of
+  the (LG state, T state) pairs, the state id being the index in it. The
+  states are split in shards of consecutive ids which are expanded in
+  parallel, the arcs of each shard are spilled to a temporary file and read
+  back in order by the writer, so only the states and never the arcs of TLG
+  are in memory.
+*/
+class TlgComposer {
+ public:
+  TlgComposer(int32 num_threads, const std::string& temp_dir)
+      : num_threads_(std::max(num_threads, 1)),
+        temp_dir_(temp_dir),
+        start_(fst::kNoStateId),
+        num_states_(0) {}
+
+  void Compose(const ArcTable& t, const ArcTable& lg) {
+    std::vector<uint64> keys = FindStates(t, lg);
+    start_ = std::lower_bound(keys.begin(), keys.end(),
+                              PairKey(lg.start, t.start)) - keys.begin();
+    num_states_ = keys.size();
+    finals_.resize(num_states_);
+    num_raw_arcs_.resize(num_states_);
+
+    const size_t num_shards = std::min<size_t>(num_states_, 4 * num_threads_);
+    for (size_t i = 0; i < num_shards; ++i) {
+      shards_.emplace_back(new Shard);
+      shards_[i]->begin = num_states_ * i / num_shards;
+      shards_[i]->end = num_states_ * (i + 1) / num_shards;
+      shards_[i]->cursor = shards_[i]->end;
+      shards_[i]->file.reset(new SpillFile(temp_dir_));
+    }
+    kaldi::ParallelFor(num_shards, num_threads_, [&](size_t i) {
+      Shard& shard = *shards_[i];
+      std::vector<StdArc> arcs;
+      for (StateId s = shard.begin; s < shard.end; ++s) {
+        arcs.clear();
+        ForEachArc(t, lg, keys[s], [&](StdArc arc, uint64 next_key) {
+          arc.nextstate = std::lower_bound(keys.begin(), keys.end(),
+                                           next_key) - keys.begin();
+          arcs.push_back(arc);
+        });
+        std::stable_sort(arcs.begin(), arcs.end(),
+                         fst::ILabelCompare<StdArc>());
+        finals_[s] = fst::Times(t.finals[keys[s] & 0xffffffff],
+                                lg.finals[keys[s] >> 32]);
+        num_raw_arcs_[s] = arcs.size();
+        shard.file->Write(arcs.data(), arcs.size());
+      }
+    });
+  }
+
+  // Removes the states which can't reach a final state, like the "connect"
+  // of fsttablecompose. All the states are accessible by construction.
+  void Connect() {
+    std::vector<uint64> offsets(num_states_ + 1, 0);
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      ReadShard(i, [&](StateId s, const StdArc& arc) {
+        ++offsets[arc.nextstate + 1];
+      });
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    std::vector<StateId> sources(offsets.back());
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      ReadShard(i, [&](StateId s, const StdArc& arc) {
+        sources[offsets[arc.nextstate]++] = s;
+      });
+    }
+    for (StateId s = num_states_; s > 0; --s) offsets[s] = offsets[s - 1];
+    offsets[0] = 0;
+
+    std::vector<bool> coaccessible(num_states_, false);
+    std::vector<StateId> queue;
+    for (StateId s = 0; s < num_states_; ++s) {
+      if (finals_[s] != Weight::Zero()) {
+        coaccessible[s] = true;
+        queue.push_back(s);
+      }
+    }
+    while (!queue.empty()) {
+      StateId s = queue.back();
+      queue.pop_back();
+      for (uint64 i = offsets[s]; i < offsets[s + 1]; ++i) {
+        if (!coaccessible[sources[i]]) {
+          coaccessible[sources[i]] = true;
+          queue.push_back(sources[i]);
+        }
+      }
+    }
+    std::vector<uint64>().swap(offsets);
+    std::vector<StateId>().swap(sources);
+
+    new_ids_.assign(num_states_, fst::kNoStateId);
+    if (start_ != fst::kNoStateId && coaccessible[start_]) {
+      for (StateId s = 0; s < num_states_; ++s) {
+        if (coaccessible[s]) {
+          new_ids_[s] = kept_.size();
+          kept_.push_back(s);
+        }
+      }
+    }
+    num_arcs_.assign(kept_.size(), 0);
+    kaldi::ParallelFor(shards_.size(), num_threads_, [&](size_t i) {
+      ReadShard(i, [&](StateId s, const StdArc& arc) {
+        if (new_ids_[s] != fst::kNoStateId &&
+            new_ids_[arc.nextstate] != fst::kNoStateId) {
+          ++num_arcs_[new_ids_[s]];
+        }
+      });
+    });
+    KALDI_LOG << "Removed " << num_states_ - kept_.size() << " of "
+              << num_states_ << " states which can't reach a final state";
+  }
+
+  StateId Start() const {
+    if (new_ids_.empty()) return start_;
+    return kept_.empty() ? fst::kNoStateId : new_ids_[start_];
+  }
+  StateId NumStates() const {
+    return new_ids_.empty() ? num_states_ : kept_.size();
+  }
+  Weight Final(StateId s) const { return finals_[OldId(s)]; }
+  size_t NumArcs(StateId s) const {
+    return new_ids_.empty() ? num_raw_arcs_[s] : num_arcs_[s];
+  }
+  uint64 TotalArcs() const {
+    uint64 n = 0;
+    for (StateId s = 0; s < NumStates(); ++s) n += NumArcs(s);
+    return n;
+  }
+
+  // The arcs of the state s, valid until the next call. The spilled arcs are
+  // read sequentially if the states are visited in order.
+  const std::vector<StdArc>& Arcs(StateId s) const {
+    if (s == buffer_state_) return buffer_;
+    const StateId old_id = OldId(s);
+    ReadArcs(old_id, &buffer_);
+    if (!new_ids_.empty()) {
+      size_t n = 0;
+      for (size_t i = 0; i < buffer_.size(); ++i) {
+        StateId next = new_ids_[buffer_[i].nextstate];
+        if (next == fst::kNoStateId) continue;
+        buffer_[n] = buffer_[i];
+        buffer_[n++].nextstate = next;
+      }
+      buffer_.resize(n);
+    }
+    buffer_state_ = s;
+    return buffer_;
+  }
+
+ private:
+  struct Shard {
+    StateId begin;
+    StateId end;
+    // The state whose arcs are next in the file
+    StateId cursor;
+    std::unique_ptr<SpillFile> file;
+  };
+
+  std::vector<uint64> FindStates(const ArcTable& t, const ArcTable& lg) {
+    const size_t kSliceSize = 4096;
+    PairSet visited;
+    std::vector<uint64> frontier(1, PairKey(lg.start, t.start)), next;
+    visited.Insert(frontier[0]);
+    while (!frontier.empty()) {
+      const size_t num_slices = (frontier.size() + kSliceSize - 1) / kSliceSize;
+      std::vector<std::vector<uint64>> found(num_slices);
+      kaldi::ParallelFor(num_slices, num_threads_, [&](size_t i) {
+        size_t end = std::min(frontier.size(), (i + 1) * kSliceSize);
+        for (size_t j = i * kSliceSize; j < end; ++j) {
+          ForEachArc(t, lg, frontier[j], [&](const StdArc&, uint64 next_key) {
+            found[i].push_back(next_key);
+          });
+        }
+      });
+      next.clear();
+      for (size_t i = 0; i < num_slices; ++i) {
+        for (uint64 key : found[i]) {
+          if (visited.Insert(key)) next.push_back(key);
+        }
+      }
+      frontier.swap(next);
+    }
+    return visited.SortedKeys();
+  }
+
+  StateId OldId(StateId s) const { return new_ids_.empty() ? s : kept_[s]; }
+
+  void ReadArcs(StateId s, std::vector<StdArc>* arcs) const {
+    size_t i = 0, j = shards_.size();
+    while (j - i > 1) {
+      size_t k = (i + j) / 2;
+      if (shards_[k]->begin <= s) i = k; else j = k;
+    }
+    Shard& shard = *shards_[i];
+    if (s < shard.cursor) {
+      shard.file->Seek(0, false);
+      shard.cursor = shard.begin;
+    }
+    uint64 skip = 0;
+    for (; shard.cursor < s; ++shard.cursor) {
+      skip += num_raw_arcs_[shard.cursor];
+    }
+    shard.file->Seek(skip, true);
+    arcs->resize(num_raw_arcs_[s]);
+    shard.file->Read(arcs->data(), arcs->size());
+    shard.cursor = s + 1;
+  }
+
+  template <class F>
+  void ReadShard(size_t i, F fn) {
+    std::vector<StdArc> arcs;
+    for (StateId s = shards_[i]->begin; s < shards_[i]->end; ++s) {
+      ReadArcs(s, &arcs);
+      for (const StdArc& arc : arcs) fn(s, arc);
+    }
+  }
+
+  const int32 num_threads_;
+  const std::string temp_dir_;
+  StateId start_;
+  StateId num_states_;
+  std::vector<Weight> finals_;
+  std::vector<uint32> num_raw_arcs_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  // Set by Connect(), the ids of the kept states, the old ids of the kept
+  // states and the number of their arcs to kept states.
+  std::vector<StateId> new_ids_;
+  std::vector<StateId> kept_;
+  std::vector<uint32> num_arcs_;
+
+  mutable StateId buffer_state_ = fst::kNoStateId;
+  mutable std::vector<StdArc> buffer_;
+};
+
+// ExpandedFst view of the TlgComposer for the writers of OpenFst, which visit
+// the states in order with one arc iterator at a time.
+class TlgFst : public fst::ExpandedFst<StdArc> {
+ public:
+  typedef StdArc Arc;
+
+  TlgFst(const TlgComposer* tlg, const fst::SymbolTable* isymbols,
+         const fst::SymbolTable* osymbols)
+      : tlg_(tlg), isymbols_(isymbols), osymbols_(osymbols) {}
+
+  StateId Start() const override { return tlg_->Start(); }
+  Weight Final(StateId s) const override { return tlg_->Final(s); }
+  StateId NumStates() const override { return tlg_->NumStates(); }
+  size_t NumArcs(StateId s) const override { return tlg_->NumArcs(s); }
+  size_t NumInputEpsilons(StateId s) const override {
+    size_t n = 0;
+    for (const StdArc& arc : tlg_->Arcs(s)) n += arc.ilabel == 0;
+    return n;
+  }
+  size_t NumOutputEpsilons(StateId s) const override {
+    size_t n = 0;
+    for (const StdArc& arc : tlg_->Arcs(s)) n += arc.olabel == 0;
+    return n;
+  }
+  // The properties are known by construction, they are not tested, which
+  // would visit the states out of order.
+  uint64 Properties(uint64 mask, bool test) const override {
+    return (fst::kExpanded | fst::kILabelSorted) & mask;
+  }
+  const std::string& Type() const override {
+    static const std::string type = "tlg";
+    return type;
+  }
+  TlgFst* Copy(bool safe = false) const override { return new TlgFst(*this); }
+  const fst::SymbolTable* InputSymbols() const override { return isymbols_; }
+  const fst::SymbolTable* OutputSymbols() const override { return osymbols_; }
+
+  void InitStateIterator(fst::StateIteratorData<Arc>* data) const override {
+    data->base = NULL;
+    data->nstates = NumStates();
+  }
+  void InitArcIterator(StateId s,
+                       fst::ArcIteratorData<Arc>* data) const override {
+    const std::vector<StdArc>& arcs = tlg_->Arcs(s);
+    data->base = NULL;
+    data->arcs = arcs.data();
+    data->narcs = arcs.size();
+    data->ref_count = NULL;
+  }
+
+ private:
+  const TlgComposer* tlg_;
+  const fst::SymbolTable* isymbols_;
+  const fst::SymbolTable* osymbols_;
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  try {
+    using namespace kaldi;  // NOLINT
+    using namespace fst;  // NOLINT
+    using kaldi::int32;
+
+    const char *usage =
+        "Composes the token FST T with LG into TLG, equivalent to\n"
+        "\"fsttablecompose T.fst LG.fst\" but multi-threaded, and the arcs of\n"
+        "TLG are spilled to temporary files instead of memory. LG must have\n"
+        "no input epsilons, i.e. it's determinized by fstdeterminizestar.\n"
+        "The arcs of TLG are sorted on the ilabel.\n"
+        "\n"
+        "Usage:  fstcomposetlg [options] <T.fst> <LG.fst> [<TLG.fst>]\n"
+        " e.g.:  fstcomposetlg --num-threads=8 --temp-dir=/data/tmp "
+        "T.fst LG.fst TLG.fst\n";
+
+    ParseOptions po(usage);
+
+    int32 num_threads = 1;
+    std::string temp_dir;
+    bool connect = true;
+    bool const_fst = false;
+
+    po.Register("num-threads", &num_threads,
+                "Number of threads of the composition.");
+    po.Register("temp-dir", &temp_dir,
+                "Directory of the temporary files of the arcs, the default "
+                "one of the system if empty.");
+    po.Register("connect", &connect,
+                "If true, remove the states which can't reach a final state.");
+    po.Register("const-fst", &const_fst,
+                "If true, write TLG as a ConstFst instead of a VectorFst.");
+
+    po.Read(argc, argv);
+
+    if (po.NumArgs() < 2 || po.NumArgs() > 3) {
+      po.PrintUsage();
+      exit(1);
+    }
+
+    std::string t_in_str = po.GetArg(1), lg_in_str = po.GetArg(2),
+                fst_out_str = po.GetOptArg(3);
+    if (fst_out_str == "") fst_out_str = "-";
+
+    std::unique_ptr<VectorFst<StdArc>> fst(ReadFstKaldi(t_in_str));
+    std::unique_ptr<SymbolTable> isymbols(
+        fst->InputSymbols() ? fst->InputSymbols()->Copy() : NULL);
+    ArcTable t(*fst);
+    fst.reset(ReadFstKaldi(lg_in_str));
+    std::unique_ptr<SymbolTable> osymbols(
+        fst->OutputSymbols() ? fst->OutputSymbols()->Copy() : NULL);
+    ArcTable lg(*fst);
+    fst.reset();
+
+    for (const StdArc& arc : lg.arcs) {
+      if (arc.ilabel == 0) {
+        KALDI_ERR << "LG has input epsilons, determinize it with "
+                  << "fstdeterminizestar first.";
+        return 1;
+      }
+    }
+    if (t.start == kNoStateId || lg.start == kNoStateId) {
+      KALDI_ERR << "T or LG is empty.";
+      return 1;
+    }
+
+    TlgComposer tlg(num_threads, temp_dir);
+    tlg.Compose(t, lg);
+    KALDI_LOG << "Composed " << tlg.NumStates() << " states and "
+              << tlg.TotalArcs() << " arcs";
+    if (connect) tlg.Connect();
+    if (tlg.Start() == kNoStateId) {
+      KALDI_WARN << "The composed FST is empty.";
+    }
+
+    TlgFst tlg_fst(&tlg, isymbols.get(), osymbols.get());
+    Output ko(fst_out_str, true, false);
+    FstWriteOptions wopts(PrintableWxfilename(fst_out_str));
+    bool ok;
+    if (const_fst) {
+      // The ConstFst indexes the arcs by uint32.
+      KALDI_ASSERT(tlg.TotalArcs() < std::numeric_limits<uint32>::max());
+      ok = StdConstFst::WriteFst(tlg_fst, ko.Stream(), wopts);
+    } else {
+      ok = StdVectorFst::WriteFst(tlg_fst, ko.Stream(), wopts);
+    }
+    if (!ok) {
+      KALDI_ERR << "Failed to write the FST to "
+                << PrintableWxfilename(fst_out_str);
+      return 1;
+    }
+    return 0;
+  } catch (const std::exception &e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
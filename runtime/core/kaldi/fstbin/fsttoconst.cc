@@ -0,0 +1,70 @@
+// fstbin/fsttoconst.cc
+
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "base/kaldi-common.h"
+#include "fst/fstlib.h"
+#include "fstext/kaldi-fst-io.h"
+#include "util/parse-options.h"
+
+int main(int argc, char *argv[]) {
+  try {
+    using namespace kaldi;  // NOLINT
+    using namespace fst;  // NOLINT
+
+    const char *usage =
+        "Converts an FST to an aligned ConstFst, which the decoder maps into\n"
+        "memory instead of reading it, so the processes on a host share one\n"
+        "copy of the graph (see --fst_mmap of the decoder)\n"
+        "\n"
+        "Usage:  fsttoconst [in.fst] out.fst\n"
+        "E.g:  fsttoconst TLG.fst TLG.const.fst\n";
+
+    ParseOptions po(usage);
+    po.Read(argc, argv);
+
+    if (po.NumArgs() < 1 || po.NumArgs() > 2) {
+      po.PrintUsage();
+      exit(1);
+    }
+
+    std::string fst_in_filename = po.NumArgs() == 2 ? po.GetArg(1) : "",
+                fst_out_filename = po.GetArg(po.NumArgs());
+
+    std::unique_ptr<VectorFst<StdArc>> fst(ReadFstKaldi(fst_in_filename));
+    ConstFst<StdArc> const_fst(*fst);
+    fst.reset();
+
+    // The arrays must be aligned to be mapped, so it's written to a file
+    // rather than to the standard output
+    std::ofstream strm(fst_out_filename,
+                       std::ios_base::out | std::ios_base::binary);
+    FstWriteOptions write_opts(fst_out_filename);
+    write_opts.align = true;
+    if (!strm || !const_fst.Write(strm, write_opts)) {
+      KALDI_ERR << "fsttoconst: Could not write FST to " << fst_out_filename;
+    }
+    return 0;
+  } catch (const std::exception &e) {
+    std::cerr << e.what();
+    return -1;
+  }
+  return 0;
+}
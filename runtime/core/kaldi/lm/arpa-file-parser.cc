@@ -20,6 +20,10 @@
 
 #include <fst/fstlib.h>
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <sstream>
 
 #include "base/kaldi-error.h"
@@ -34,7 +38,9 @@ ArpaFileParser::ArpaFileParser(const ArpaParseOptions& options,
     : options_(options),
       symbols_(symbols),
       line_number_(0),
-      warning_count_(0) {}
+      warning_count_(0),
+      current_words_(NULL),
+      current_order_(0) {}
 
 ArpaFileParser::~ArpaFileParser() {}
 
@@ -42,7 +48,9 @@ void TrimTrailingWhitespace(std::string* str) {
   str->erase(str->find_last_not_of(" \n\r\t") + 1);
 }
 
-void ArpaFileParser::Read(std::istream& is) {
+#define PARSE_ERR KALDI_ERR << LineReference() << ": "
+
+void ArpaFileParser::CheckOptions() const {
   // Argument sanity checks.
   if (options_.bos_symbol <= 0 || options_.eos_symbol <= 0 ||
       options_.bos_symbol == options_.eos_symbol)
@@ -67,14 +75,41 @@ void ArpaFileParser::Read(std::istream& is) {
   if (symbols_ != NULL && options_.unk_symbol > 0 &&
       symbols_->Find(options_.unk_symbol).empty())
     KALDI_ERR << "UNK symbol must exist in symbol table";
+}
+
+void ArpaFileParser::ParseCountLine() {
+  // Enters "\data\" section, and looks for patterns like "ngram 1=1000",
+  // which means there are 1000 unigrams.
+  std::size_t equal_symbol_pos = current_line_.find("=");
+  if (equal_symbol_pos != std::string::npos)
+    // Guaranteed spaces around the "=".
+    current_line_.replace(equal_symbol_pos, 1, " = ");
+  std::vector<std::string> col;
+  SplitStringToVector(current_line_, " \t", true, &col);
+  if (col.size() == 4 && col[0] == "ngram" && col[2] == "=") {
+    int32 order, ngram_count = 0;
+    if (!ConvertStringToInteger(col[1], &order) ||
+        !ConvertStringToInteger(col[3], &ngram_count)) {
+      PARSE_ERR << "cannot parse ngram count";
+    }
+    if (ngram_counts_.size() <= order) {
+      ngram_counts_.resize(order);
+    }
+    ngram_counts_[order - 1] = ngram_count;
+  } else {
+    KALDI_WARN << LineReference()
+               << ": uninterpretable line in \\data\\ section";
+  }
+}
+
+void ArpaFileParser::Read(std::istream& is) {
+  CheckOptions();
 
   ngram_counts_.clear();
   line_number_ = 0;
   warning_count_ = 0;
   current_line_.clear();
 
-#define PARSE_ERR KALDI_ERR << LineReference() << ": "
-
   // Give derived class an opportunity to prepare its state.
   ReadStarted();
 
@@ -98,28 +133,7 @@ void ArpaFileParser::Read(std::istream& is) {
 
     if (current_line_[0] == '\\') break;
 
-    // Enters "\data\" section, and looks for patterns like "ngram 1=1000",
-    // which means there are 1000 unigrams.
-    std::size_t equal_symbol_pos = current_line_.find("=");
-    if (equal_symbol_pos != std::string::npos)
-      // Guaranteed spaces around the "=".
-      current_line_.replace(equal_symbol_pos, 1, " = ");
-    std::vector<std::string> col;
-    SplitStringToVector(current_line_, " \t", true, &col);
-    if (col.size() == 4 && col[0] == "ngram" && col[2] == "=") {
-      int32 order, ngram_count = 0;
-      if (!ConvertStringToInteger(col[1], &order) ||
-          !ConvertStringToInteger(col[3], &ngram_count)) {
-        PARSE_ERR << "cannot parse ngram count";
-      }
-      if (ngram_counts_.size() <= order) {
-        ngram_counts_.resize(order);
-      }
-      ngram_counts_[order - 1] = ngram_count;
-    } else {
-      KALDI_WARN << LineReference()
-                 << ": uninterpretable line in \\data\\ section";
-    }
+    ParseCountLine();
   }
 
   if (ngram_counts_.size() == 0)
@@ -261,19 +275,423 @@ void ArpaFileParser::Read(std::istream& is) {
 
   current_line_.clear();
   ReadComplete();
+}
 
-#undef PARSE_ERR
+struct ArpaFileParser::Chunk {
+  Chunk()
+      : begin(NULL),
+        end(NULL),
+        num_lines(0),
+        num_ngrams(0),
+        num_skipped(0) {}
+
+  const char* begin;
+  const char* end;
+  NGramBlock block;
+  int32 num_lines;
+  // The n-gram lines, including the skipped ones.
+  int32 num_ngrams;
+  // The line in the chunk, its position and the word of the n-grams which
+  // are skipped for OOV words, up to max_warnings of them.
+  std::vector<std::pair<int32, const char*> > skipped;
+  std::vector<std::string> skipped_words;
+  size_t num_skipped;
+  // The position in block.words and the word of the novel words.
+  std::vector<std::pair<size_t, std::string> > novel;
+  // The line in the chunk, its position and the message of the errors, the
+  // n-grams with errors are dropped.
+  std::vector<std::pair<int32, const char*> > error_lines;
+  std::vector<std::string> errors;
+
+  void AddError(const char* line, const std::string& error) {
+    error_lines.push_back(std::make_pair(num_lines, line));
+    errors.push_back(error);
+  }
+};
+
+namespace {
+
+inline bool IsBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+bool ParseReal(const char* begin, const char* end, float* out) {
+  char buf[64];
+  size_t len = end - begin;
+  if (len == 0 || len >= sizeof(buf)) return false;
+  memcpy(buf, begin, len);
+  buf[len] = '\0';
+  char* stop = NULL;
+  *out = strtof(buf, &stop);
+  return stop == buf + len;
+}
+
+bool ParseInteger(const char* begin, const char* end, int32* out) {
+  char buf[32];
+  size_t len = end - begin;
+  if (len == 0 || len >= sizeof(buf)) return false;
+  memcpy(buf, begin, len);
+  buf[len] = '\0';
+  char* stop = NULL;
+  long value = strtol(buf, &stop, 10);  // NOLINT
+  if (stop != buf + len || value < std::numeric_limits<int32>::min() ||
+      value > std::numeric_limits<int32>::max())
+    return false;
+  *out = static_cast<int32>(value);
+  return true;
+}
+
+// Returns the end of the line at pos, which is end for the last line.
+inline const char* LineEnd(const char* pos, const char* end) {
+  const char* eol = static_cast<const char*>(memchr(pos, '\n', end - pos));
+  return eol == NULL ? end : eol;
+}
+
+}  // namespace
+
+void ArpaFileParser::ParseChunk(int32 order, bool add_symbols,
+                                Chunk* chunk) const {
+  const bool is_highest = order == ngram_counts_.size();
+  const size_t max_skipped = options_.max_warnings < 0
+                                 ? std::numeric_limits<size_t>::max()
+                                 : options_.max_warnings;
+  NGramBlock* block = &chunk->block;
+  block->order = order;
+  std::vector<std::pair<const char*, const char*> > col;
+  std::vector<int32> words(order);
+  std::string word_str;
+  const char* pos = chunk->begin;
+  while (pos < chunk->end) {
+    const char* line = pos;
+    const char* eol = LineEnd(pos, chunk->end);
+    pos = eol < chunk->end ? eol + 1 : eol;
+    ++chunk->num_lines;
+
+    col.clear();
+    for (const char* p = line; p < eol;) {
+      while (p < eol && IsBlank(*p)) ++p;
+      if (p == eol) break;
+      const char* q = p;
+      while (q < eol && !IsBlank(*q)) ++q;
+      col.push_back(std::make_pair(p, q));
+      p = q;
+    }
+    if (col.empty()) continue;
+
+    if (col.size() < 1 + order || col.size() > 2 + order ||
+        (is_highest && col.size() != 1 + order)) {
+      chunk->AddError(line, "Invalid n-gram data line");
+      continue;
+    }
+    ++chunk->num_ngrams;
+
+    float logprob, backoff = 0.0;
+    if (!ParseReal(col[0].first, col[0].second, &logprob)) {
+      chunk->AddError(line, "invalid n-gram logprob '" +
+                                std::string(col[0].first, col[0].second) +
+                                "'");
+      continue;
+    }
+    if (col.size() > order + 1 &&
+        !ParseReal(col[order + 1].first, col[order + 1].second, &backoff)) {
+      chunk->AddError(line, "invalid backoff weight '" +
+                                std::string(col[order + 1].first,
+                                            col[order + 1].second) +
+                                "'");
+      continue;
+    }
+    // Convert to natural log.
+    logprob *= M_LN10;
+    backoff *= M_LN10;
+
+    bool skip_ngram = false;
+    for (int32 index = 0; !skip_ngram && index < order; ++index) {
+      word_str.assign(col[1 + index].first, col[1 + index].second);
+      int32 word;
+      if (symbols_) {
+        word = symbols_->Find(word_str);
+        if (word == -1) {  // fst::kNoSymbol
+          switch (options_.oov_handling) {
+            case ArpaParseOptions::kAddToSymbols:
+              if (add_symbols) {
+                word = symbols_->AddSymbol(word_str);
+              } else {
+                // The symbols of the novel words are assigned in the file
+                // order by the caller.
+                chunk->novel.push_back(
+                    std::make_pair(block->words.size() + index, word_str));
+              }
+              break;
+            case ArpaParseOptions::kReplaceWithUnk:
+              word = options_.unk_symbol;
+              break;
+            case ArpaParseOptions::kSkipNGram:
+              if (chunk->skipped.size() < max_skipped) {
+                chunk->skipped.push_back(
+                    std::make_pair(chunk->num_lines, line));
+                chunk->skipped_words.push_back(word_str);
+              }
+              ++chunk->num_skipped;
+              skip_ngram = true;
+              break;
+            default:
+              chunk->AddError(line,
+                              "word '" + word_str + "' not in symbol table");
+              skip_ngram = true;
+          }
+        }
+      } else if (!ParseInteger(col[1 + index].first, col[1 + index].second,
+                               &word) ||
+                 word < 0) {
+        // Symbols not provided, LM file should contain integers.
+        chunk->AddError(line, "invalid symbol '" + word_str + "'");
+        skip_ngram = true;
+        break;
+      }
+      // Whichever way we got it, an epsilon is invalid.
+      if (word == 0) {
+        chunk->AddError(
+            line, "epsilon symbol '" + word_str + "' is illegal in ARPA LM");
+        skip_ngram = true;
+        break;
+      }
+      words[index] = word;
+    }
+    if (skip_ngram) {
+      // Drop the novel words of the n-gram.
+      while (!chunk->novel.empty() &&
+             chunk->novel.back().first >= block->words.size())
+        chunk->novel.pop_back();
+      continue;
+    }
+    block->words.insert(block->words.end(), words.begin(), words.end());
+    block->logprob.push_back(logprob);
+    block->backoff.push_back(backoff);
+  }
+}
+
+void ArpaFileParser::SetLine(int32 line_number, const char* pos,
+                             const char* end) {
+  line_number_ = line_number;
+  current_line_.assign(pos, LineEnd(pos, end));
+}
+
+void ArpaFileParser::Read(const char* data, size_t size) {
+  CheckOptions();
+
+  ngram_counts_.clear();
+  line_number_ = 0;
+  warning_count_ = 0;
+  current_line_.clear();
+
+  ReadStarted();
+
+  const char* end = data + size;
+  const char* pos = data;
+
+  // Processes "\data\" section, as Read(std::istream&) does.
+  bool keyword_found = false;
+  while (pos < end) {
+    const char* eol = LineEnd(pos, end);
+    ++line_number_;
+    current_line_.assign(pos, eol);
+    pos = eol < end ? eol + 1 : eol;
+    if (current_line_.find_first_not_of(" \t\n\r") == std::string::npos) {
+      continue;
+    }
+    TrimTrailingWhitespace(&current_line_);
+    if (!keyword_found) {
+      if (current_line_ == "\\data\\") {
+        KALDI_LOG << "Reading \\data\\ section.";
+        keyword_found = true;
+      }
+      continue;
+    }
+    if (current_line_[0] == '\\') break;
+    ParseCountLine();
+  }
+
+  if (ngram_counts_.size() == 0)
+    PARSE_ERR << "\\data\\ section missing or empty.";
+
+  HeaderAvailable();
+
+  // Processes "\N-grams:" section. The lines up to the next directive are
+  // split into chunks at line boundaries, which are tokenized in parallel.
+  const size_t kMinChunkSize = 1 << 20;
+  std::vector<Chunk> chunks;
+  for (int32 cur_order = 1; cur_order <= ngram_counts_.size(); ++cur_order) {
+    if (ngram_counts_[cur_order - 1] == 0)
+      KALDI_WARN << "Zero ngram count in ngram order " << cur_order
+                 << "(look for 'ngram " << cur_order << "=0' in the \\data\\ "
+                 << " section). There is possibly a problem with the file.";
+
+    std::ostringstream keyword;
+    keyword << "\\" << cur_order << "-grams:";
+    if (current_line_ != keyword.str()) {
+      PARSE_ERR << "invalid directive, expecting '" << keyword.str() << "'";
+    }
+    KALDI_LOG << "Reading " << current_line_ << " section.";
+    const int32 first_line = line_number_ + 1;
+
+    // Looks for the directive which ends the section. The other directives
+    // are parsed as n-grams, as Read(std::istream&) does.
+    std::ostringstream next_keyword;
+    next_keyword << "\\" << cur_order + 1 << "-grams:";
+    const char* section_end = end;
+    const char* next_pos = end;
+    std::string directive;
+    for (const char* p = pos; p < end; ++p) {
+      p = static_cast<const char*>(memchr(p, '\\', end - p));
+      if (p == NULL) break;
+      if (p != pos && p[-1] != '\n') continue;
+      const char* eol = LineEnd(p, end);
+      directive.assign(p, eol);
+      TrimTrailingWhitespace(&directive);
+      if (directive == next_keyword.str() || directive == "\\end\\") {
+        section_end = p;
+        next_pos = eol < end ? eol + 1 : eol;
+        break;
+      }
+      if (ShouldWarn()) {
+        KALDI_WARN << "ignoring possible directive '" << directive
+                   << "' expecting '" << next_keyword.str() << "'";
+      }
+      p = eol;
+    }
+
+    // Novel words must get their symbols in the file order, the unigrams
+    // are mostly novel, so they are tokenized in this thread.
+    const bool add_symbols =
+        symbols_ != NULL &&
+        options_.oov_handling == ArpaParseOptions::kAddToSymbols &&
+        cur_order == 1;
+    size_t num_chunks = 1;
+    if (!add_symbols) {
+      num_chunks = std::max<size_t>(
+          1, std::min<size_t>(std::max(options_.num_threads, 1),
+                              (section_end - pos) / kMinChunkSize));
+    }
+    chunks.clear();
+    chunks.resize(num_chunks);
+    for (size_t i = 0; i < num_chunks; ++i) {
+      const char* begin = i == 0 ? pos : chunks[i - 1].end;
+      const char* chunk_end = section_end;
+      if (i + 1 < num_chunks) {
+        chunk_end = pos + (section_end - pos) * (i + 1) / num_chunks;
+        const char* eol = LineEnd(std::max(chunk_end, begin), section_end);
+        chunk_end = eol < section_end ? eol + 1 : section_end;
+      }
+      chunks[i].begin = begin;
+      chunks[i].end = chunk_end;
+    }
+    ParallelFor(num_chunks, options_.num_threads, [&](size_t i) {
+      ParseChunk(cur_order, add_symbols, &chunks[i]);
+    });
+
+    int32 chunk_line = first_line;
+    int32 ngram_count = 0;
+    for (size_t i = 0; i < num_chunks; ++i) {
+      Chunk& chunk = chunks[i];
+      for (size_t j = 0; j < chunk.errors.size(); ++j) {
+        SetLine(chunk_line + chunk.error_lines[j].first - 1,
+                chunk.error_lines[j].second, end);
+        PARSE_ERR << chunk.errors[j];
+      }
+      for (size_t j = 0; j < chunk.novel.size(); ++j) {
+        chunk.block.words[chunk.novel[j].first] =
+            symbols_->AddSymbol(chunk.novel[j].second);
+      }
+      for (size_t j = 0; j < chunk.num_skipped; ++j) {
+        if (ShouldWarn() && j < chunk.skipped.size()) {
+          SetLine(chunk_line + chunk.skipped[j].first - 1,
+                  chunk.skipped[j].second, end);
+          KALDI_WARN << LineReference() << " skipped: word '"
+                     << chunk.skipped_words[j] << "' not in symbol table";
+        }
+      }
+      chunk_line += chunk.num_lines;
+      ngram_count += chunk.num_ngrams;
+    }
+    line_number_ = chunk_line;
+    if (section_end < end) {
+      current_line_ = directive;
+    } else {
+      current_line_.clear();
+    }
+    if (ngram_count > ngram_counts_[cur_order - 1]) {
+      PARSE_ERR << "header said there would be " << ngram_counts_[cur_order - 1]
+                << " n-grams of order " << cur_order
+                << ", but we saw more already.";
+    }
+
+    for (size_t i = 0; i < num_chunks; ++i) {
+      ConsumeNGrams(chunks[i].block);
+      chunks[i].block = NGramBlock();
+    }
+    pos = next_pos;
+  }
+
+  if (current_line_ != "\\end\\") {
+    PARSE_ERR << "invalid or unexpected directive line, expecting \\end\\";
+  }
+
+  if (warning_count_ > 0 &&
+      warning_count_ > static_cast<uint32>(options_.max_warnings)) {
+    KALDI_WARN << "Of " << warning_count_ << " parse warnings, "
+               << options_.max_warnings << " were reported. Run program with "
+               << "--max-arpa-warnings=-1 to see all warnings";
+  }
+
+  current_line_.clear();
+  ReadComplete();
+}
+
+void ArpaFileParser::ConsumeNGrams(const NGramBlock& block) {
+  NGram ngram;
+  ngram.words.resize(block.order);
+  current_order_ = block.order;
+  for (size_t i = 0; i < block.Size(); ++i) {
+    current_words_ = block.Words(i);
+    std::copy(current_words_, current_words_ + block.order,
+              ngram.words.begin());
+    ngram.logprob = block.logprob[i];
+    ngram.backoff = block.backoff[i];
+    ConsumeNGram(ngram);
+  }
+  current_words_ = NULL;
 }
 
 std::string ArpaFileParser::LineReference() const {
+  if (current_words_ != NULL) {
+    return "n-gram " + NGramReference(current_words_, current_order_);
+  }
   std::ostringstream ss;
   ss << "line " << line_number_ << " [" << current_line_ << "]";
   return ss.str();
 }
 
+std::string ArpaFileParser::NGramReference(const int32* words,
+                                           int32 order) const {
+  std::ostringstream ss;
+  ss << "[";
+  for (int32 i = 0; i < order; ++i) {
+    if (i > 0) ss << " ";
+    if (symbols_ != NULL) {
+      ss << symbols_->Find(words[i]);
+    } else {
+      ss << words[i];
+    }
+  }
+  ss << "]";
+  return ss.str();
+}
+
 bool ArpaFileParser::ShouldWarn() {
   return (warning_count_ != -1) &&
          (++warning_count_ <= static_cast<uint32>(options_.max_warnings));
 }
 
+#undef PARSE_ERR
+
 }  // namespace kaldi
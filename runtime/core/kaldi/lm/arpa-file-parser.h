@@ -28,6 +28,7 @@
 
 #include "base/kaldi-types.h"
 #include "itf/options-itf.h"
+#include "util/kaldi-thread.h"
 
 namespace kaldi {
 
@@ -47,7 +48,8 @@ struct ArpaParseOptions {
         eos_symbol(-1),
         unk_symbol(-1),
         oov_handling(kRaiseError),
-        max_warnings(30) {}
+        max_warnings(30),
+        num_threads(1) {}
 
   void Register(OptionsItf* opts) {
     // Registering only the max_warnings count, since other options are
@@ -56,6 +58,9 @@ struct ArpaParseOptions {
     opts->Register("max-arpa-warnings", &max_warnings,
                    "Maximum warnings to report on ARPA parsing, "
                    "0 to disable, -1 to show all");
+    opts->Register("num-threads", &num_threads,
+                   "Threads to tokenize the n-gram sections of a mapped "
+                   "ARPA file and to compile it");
   }
 
   int32 bos_symbol;  ///< Symbol for <s>, Required non-epsilon.
@@ -63,6 +68,7 @@ struct ArpaParseOptions {
   int32 unk_symbol;  ///< Symbol for <unk>, Required for kReplaceWithUnk.
   OovHandling oov_handling;  ///< How to handle OOV words in the file.
   int32 max_warnings;        ///< Maximum warnings to report, <0 unlimited.
+  int32 num_threads;         ///< Threads of the parser and its clients.
 };
 
 /**
@@ -76,6 +82,21 @@ struct NGram {
                              ///< Defaults to zero if not specified.
 };
 
+/**
+   N-grams of the same order in a compact layout, as they are tokenized from
+   a chunk of an "\N-grams:" section.
+*/
+struct NGramBlock {
+  NGramBlock() : order(0) {}
+  size_t Size() const { return logprob.size(); }
+  const int32* Words(size_t i) const { return &words[i * order]; }
+
+  int32 order;
+  std::vector<int32> words;    ///< order symbols of each n-gram, flattened.
+  std::vector<float> logprob;  ///< Log-prob of each n-gram.
+  std::vector<float> backoff;  ///< log-backoff weight of each n-gram.
+};
+
 /**
     ArpaFileParser is an abstract base class for ARPA LM file conversion.
 
@@ -98,6 +119,13 @@ class ArpaFileParser {
   /// Read ARPA LM file from a stream.
   void Read(std::istream& is);
 
+  /// Read ARPA LM file from memory, e.g. a mapped file. The lines of each
+  /// n-gram section are tokenized by Options().num_threads threads, and the
+  /// n-grams are sent to ConsumeNGrams() in the file order. When novel words
+  /// are added to the symbol table, they get the same symbols as by
+  /// Read(std::istream&).
+  void Read(const char* data, size_t size);
+
   /// Parser options.
   const ArpaParseOptions& Options() const { return options_; }
 
@@ -115,6 +143,12 @@ class ArpaFileParser {
   /// (k-1)-grams are processed before the first k-gram is.
   virtual void ConsumeNGram(const NGram&) = 0;
 
+  /// Override function called with a block of n-grams by Read(const char*,
+  /// size_t), the blocks are sent in the file order as well. The default
+  /// sends each of them to ConsumeNGram(), and LineReference() refers to the
+  /// n-gram rather than to its line.
+  virtual void ConsumeNGrams(const NGramBlock& block);
+
   /// Override function called after the last n-gram has been consumed.
   virtual void ReadComplete() {}
 
@@ -128,6 +162,10 @@ class ArpaFileParser {
   /// compiled, to print out as part of diagnostics.
   std::string LineReference() const;
 
+  /// Returns a formatted n-gram, the words are printed as symbols if there
+  /// is a symbol table, to print out as part of diagnostics.
+  std::string NGramReference(const int32* words, int32 order) const;
+
   /// Increments warning count, and returns true if a warning should be
   /// printed or false if the count has exceeded the set maximum.
   bool ShouldWarn();
@@ -136,12 +174,26 @@ class ArpaFileParser {
   const std::vector<int32>& NgramCounts() const { return ngram_counts_; }
 
  private:
+  struct Chunk;
+
+  void CheckOptions() const;
+  // Parses a line of the "\data\" section in current_line_.
+  void ParseCountLine();
+  // Tokenizes the n-grams of the chunk, the words are added to the symbol
+  // table if add_symbols, otherwise the novel words are left to the caller.
+  void ParseChunk(int32 order, bool add_symbols, Chunk* chunk) const;
+  // Sets the line number, and the current line to the line at pos.
+  void SetLine(int32 line_number, const char* pos, const char* end);
+
   ArpaParseOptions options_;
   fst::SymbolTable* symbols_;  // the pointer is not owned here.
   int32 line_number_;
   uint32 warning_count_;
   std::string current_line_;
   std::vector<int32> ngram_counts_;
+  // The n-gram being sent by the default ConsumeNGrams(), NULL otherwise.
+  const int32* current_words_;
+  int32 current_order_;
 };
 
 }  // namespace kaldi
@@ -20,312 +20,455 @@
 // limitations under the License.
 
 #include <algorithm>
-#include <functional>
 #include <limits>
 #include <sstream>
-#include <unordered_map>
+#include <string>
 #include <utility>
 #include <vector>
 
 #include "base/kaldi-math.h"
-#include "fstext/remove-eps-local.h"
 #include "lm/arpa-lm-compiler.h"
-#include "util/stl-utils.h"
-#include "util/text-utils.h"
 
 namespace kaldi {
 
-class ArpaLmCompilerImplInterface {
- public:
-  virtual ~ArpaLmCompilerImplInterface() {}
-  virtual void ConsumeNGram(const NGram& ngram, bool is_highest) = 0;
-};
-
 namespace {
 
 typedef int32 StateId;
 typedef int32 Symbol;
 
-// GeneralHistKey can represent state history in an arbitrarily large n
-// n-gram model with symbol ids fitting int32.
-class GeneralHistKey {
- public:
-  // Construct key from being and end iterators.
-  template <class InputIt>
-  GeneralHistKey(InputIt begin, InputIt end) : vector_(begin, end) {}
-  // Construct empty history key.
-  GeneralHistKey() : vector_() {}
-  // Return tails of the key as a GeneralHistKey. The tails of an n-gram
-  // w[1..n] is the sequence w[2..n] (and the heads is w[1..n-1], but the
-  // key class does not need this operartion).
-  GeneralHistKey Tails() const {
-    return GeneralHistKey(vector_.begin() + 1, vector_.end());
-  }
-  // Keys are equal if represent same state.
-  friend bool operator==(const GeneralHistKey& a, const GeneralHistKey& b) {
-    return a.vector_ == b.vector_;
-  }
-  // Public typename HashType for hashing.
-  struct HashType : public std::unary_function<GeneralHistKey, size_t> {
-    size_t operator()(const GeneralHistKey& key) const {
-      return VectorHasher<Symbol>().operator()(key.vector_);
-    }
-  };
+// Lexicographic order of the n-grams, or of their heads with order = n - 1.
+inline bool WordsLess(const int32* a, const int32* b, int32 order) {
+  return std::lexicographical_compare(a, a + order, b, b + order);
+}
 
- private:
-  std::vector<Symbol> vector_;
-};
+inline bool WordsEqual(const int32* a, const int32* b, int32 order) {
+  return std::equal(a, a + order, b);
+}
 
-// OptimizedHistKey combines 3 21-bit symbol ID values into one 64-bit
-// machine word. allowing significant memory reduction and some runtime
-// benefit over GeneralHistKey. Since 3 symbols are enough to track history
-// in a 4-gram model, this optimized key is used for smaller models with up
-// to 4-gram and symbol values up to 2^21-1.
-//
-// See GeneralHistKey for interface requirements of a key class.
-class OptimizedHistKey {
- public:
-  enum {
-    kShift = 21,  // 21 * 3 = 63 bits for data.
-    kMaxData = (1 << kShift) - 1
-  };
-  template <class InputIt>
-  OptimizedHistKey(InputIt begin, InputIt end) : data_(0) {
-    for (uint32 shift = 0; begin != end; ++begin, shift += kShift) {
-      data_ |= static_cast<uint64>(*begin) << shift;
-    }
-  }
-  OptimizedHistKey() : data_(0) {}
-  OptimizedHistKey Tails() const { return OptimizedHistKey(data_ >> kShift); }
-  friend bool operator==(const OptimizedHistKey& a, const OptimizedHistKey& b) {
-    return a.data_ == b.data_;
+// Sorts the slices of index on the threads and merges them pairwise.
+template <class Less>
+void ParallelSort(std::vector<uint32>* index, const Less& less,
+                  int32 num_threads) {
+  const size_t kMinSliceSize = 1 << 16;
+  size_t n = index->size();
+  size_t num_slices = std::max<size_t>(
+      1, std::min<size_t>(std::max(num_threads, 1), n / kMinSliceSize));
+  std::vector<size_t> bounds(num_slices + 1);
+  for (size_t i = 0; i <= num_slices; ++i) bounds[i] = n * i / num_slices;
+  std::vector<uint32>::iterator begin = index->begin();
+  ParallelFor(num_slices, num_threads, [&](size_t i) {
+    std::sort(begin + bounds[i], begin + bounds[i + 1], less);
+  });
+  for (size_t width = 1; width < num_slices; width *= 2) {
+    ParallelFor((num_slices + 2 * width - 1) / (2 * width), num_threads,
+                [&](size_t i) {
+                  size_t lo = 2 * i * width;
+                  size_t mid = std::min(lo + width, num_slices);
+                  size_t hi = std::min(lo + 2 * width, num_slices);
+                  std::inplace_merge(begin + bounds[lo], begin + bounds[mid],
+                                     begin + bounds[hi], less);
+                });
   }
-  struct HashType : public std::unary_function<OptimizedHistKey, size_t> {
-    size_t operator()(const OptimizedHistKey& key) const { return key.data_; }
-  };
-
- private:
-  explicit OptimizedHistKey(uint64 data) : data_(data) {}
-  uint64 data_;
-};
+}
 
 }  // namespace
 
-template <class HistKey>
-class ArpaLmCompilerImpl : public ArpaLmCompilerImplInterface {
+// The compact G. The n-grams of each order are collected into flat arrays,
+// sorted, and then the states and the arcs are laid out in the CSR layout,
+// as in a ConstFst.
+//
+// Generally, an n-gram "A B C" is an arc accepting "C" from the state of its
+// history "A B" to the state of "A B C", which has a backoff arc to its
+// backoff state "B C". As the n-grams of each order are sorted, the state of
+// a k-gram is its index in the sorted k-grams, the history of an n-gram is
+// found by a binary search, and the arcs of a state are the run of the
+// (k+1)-grams with its words as the heads, which come out ilabel sorted.
+//
+// Two notable exceptions are the highest order n-grams, and final n-grams.
+//
+// When adding a highest order n-gram (e. g., our "A B C" is in a 3-gram LM),
+// there is no point adding a state for "A B C", since there will be no other
+// arcs ingoing to this state, and an epsilon backoff arc into the backoff
+// model "B C", with the weight of \bar{1}. The arc accepting "C" goes from
+// "A B" directly to "B C", or to the state of its longest suffix if "B C"
+// does not exist. This saves as many states as there are the highest order
+// n-grams, which is typically about half the size of a large 3-gram model.
+//
+// Indeed, this does not apply to n-grams ending in EOS, since they do not
+// back off. These are special, as they do not have a back-off state, and
+// the state for "(..anything..) </s>" is always final. These are handled
+// in one of the two possible ways, If symbols <s> and </s> are being
+// replaced by epsilons, neither state nor arc is created, and the logprob
+// of the n-gram is applied to its source state as final weight. If <s> and
+// </s> are preserved, then a special final state for </s> is allocated and
+// used as the destination of the "</s>" acceptor arc.
+class ArpaLmCompilerImpl {
  public:
-  ArpaLmCompilerImpl(ArpaLmCompiler* parent, fst::StdVectorFst* fst,
-                     Symbol sub_eps);
-
-  virtual void ConsumeNGram(const NGram& ngram, bool is_highest);
+  ArpaLmCompilerImpl(ArpaLmCompiler* parent, Symbol sub_eps);
+
+  void AddNGram(const int32* words, int32 order, float logprob,
+                float backoff);
+  void Compile();
+  // Releases the compact G.
+  void Clear();
+
+  bool Empty() const { return offsets_.empty(); }
+  StateId Start() const { return start_; }
+  StateId NumStates() const { return finals_.size(); }
+  fst::TropicalWeight Final(StateId s) const { return finals_[s]; }
+  size_t NumArcs(StateId s) const { return offsets_[s + 1] - offsets_[s]; }
+  const fst::StdArc* Arcs(StateId s) const { return &arcs_[offsets_[s]]; }
+  size_t TotalArcs() const { return arcs_.size(); }
 
  private:
-  StateId AddStateWithBackoff(HistKey key, float backoff);
-  void CreateBackoff(HistKey key, StateId state, float weight);
+  // Sorts the n-grams of the order, drops the duplicates and the n-grams
+  // without a history, and splits the rest into histories_ and eos_ngrams_.
+  void SortNGrams(int32 order);
+  // Returns the state of the k-gram, or kNoStateId.
+  StateId FindState(const int32* words, int32 order) const;
+  // Returns the state of the longest suffix of the k-gram.
+  StateId BackoffState(const int32* words, int32 order) const;
+  // The destination of the arc of the i-th k-gram in histories_.
+  StateId NextState(int32 order, size_t i) const;
+  // Writes the arcs of the i-th state of the order to arcs, or just counts
+  // them if arcs is NULL, and returns the count. child and eos_child are the
+  // first (k+1)-grams in histories_ and eos_ngrams_ whose heads are not
+  // less than the words of the state, and are advanced past its arcs.
+  size_t ExpandState(int32 order, size_t i, size_t* child, size_t* eos_child,
+                     fst::StdArc* arcs);
+  void BuildStates();
+  // Removes states that only have a backoff arc coming out of them.
+  void RemoveRedundantStates();
 
   ArpaLmCompiler* parent_;  // Not owned.
-  fst::StdVectorFst* fst_;  // Not owned.
   Symbol bos_symbol_;
   Symbol eos_symbol_;
   Symbol sub_eps_;
-
+  int32 max_order_;
+  int32 num_threads_;
+
+  // The n-grams of each order in the file order.
+  std::vector<NGramBlock> ngrams_;
+  // The sorted k-grams which do not end in </s>, histories_[0] is the 0-gram
+  // and only the highest order n-grams are not states.
+  std::vector<NGramBlock> histories_;
+  // The sorted k-grams which end in </s>.
+  std::vector<NGramBlock> eos_ngrams_;
+  // The state of the first k-gram in histories_.
+  std::vector<StateId> first_state_;
   StateId eos_state_;
-  typedef unordered_map<HistKey, StateId, typename HistKey::HashType>
-      HistoryMap;
-  HistoryMap history_;
+  StateId bos_state_;
+
+  // The compact G.
+  StateId start_;
+  std::vector<fst::TropicalWeight> finals_;
+  std::vector<size_t> offsets_;
+  std::vector<fst::StdArc> arcs_;
 };
 
-template <class HistKey>
-ArpaLmCompilerImpl<HistKey>::ArpaLmCompilerImpl(ArpaLmCompiler* parent,
-                                                fst::StdVectorFst* fst,
-                                                Symbol sub_eps)
+ArpaLmCompilerImpl::ArpaLmCompilerImpl(ArpaLmCompiler* parent, Symbol sub_eps)
     : parent_(parent),
-      fst_(fst),
       bos_symbol_(parent->Options().bos_symbol),
       eos_symbol_(parent->Options().eos_symbol),
-      sub_eps_(sub_eps) {
-  // The algorithm maintains state per history. The 0-gram is a special state
-  // for empty history. All unigrams (including BOS) backoff into this state.
-  StateId zerogram = fst_->AddState();
-  history_[HistKey()] = zerogram;
-
-  // Also, if </s> is not treated as epsilon, create a common end state for
-  // all transitions accepting the </s>, since they do not back off. This small
-  // optimization saves about 2% states in an average grammar.
-  if (sub_eps_ == 0) {
-    eos_state_ = fst_->AddState();
-    fst_->SetFinal(eos_state_, 0);
+      sub_eps_(sub_eps),
+      max_order_(parent->NgramCounts().size()),
+      num_threads_(std::max(parent->Options().num_threads, 1)),
+      ngrams_(max_order_),
+      histories_(max_order_ + 1),
+      eos_ngrams_(max_order_ + 1),
+      first_state_(max_order_ + 1, fst::kNoStateId),
+      eos_state_(fst::kNoStateId),
+      bos_state_(fst::kNoStateId),
+      start_(fst::kNoStateId) {
+  for (int32 order = 1; order <= max_order_; ++order) {
+    NGramBlock& ngrams = ngrams_[order - 1];
+    size_t count = std::max(parent->NgramCounts()[order - 1], 0);
+    ngrams.order = order;
+    ngrams.words.reserve(count * order);
+    ngrams.logprob.reserve(count);
+    if (order < max_order_) ngrams.backoff.reserve(count);
   }
 }
 
-template <class HistKey>
-void ArpaLmCompilerImpl<HistKey>::ConsumeNGram(const NGram& ngram,
-                                               bool is_highest) {
-  // Generally, we do the following. Suppose we are adding an n-gram "A B
-  // C". Then find the node for "A B", add a new node for "A B C", and connect
-  // them with the arc accepting "C" with the specified weight. Also, add a
-  // backoff arc from the new "A B C" node to its backoff state "B C".
-  //
-  // Two notable exceptions are the highest order n-grams, and final n-grams.
-  //
-  // When adding a highest order n-gram (e. g., our "A B C" is in a 3-gram LM),
-  // the following optimization is performed. There is no point adding a node
-  // for "A B C" with a "C" arc from "A B", since there will be no other
-  // arcs ingoing to this node, and an epsilon backoff arc into the backoff
-  // model "B C", with the weight of \bar{1}. To save a node, create an arc
-  // accepting "C" directly from "A B" to "B C". This saves as many nodes
-  // as there are the highest order n-grams, which is typically about half
-  // the size of a large 3-gram model.
-  //
-  // Indeed, this does not apply to n-grams ending in EOS, since they do not
-  // back off. These are special, as they do not have a back-off state, and
-  // the node for "(..anything..) </s>" is always final. These are handled
-  // in one of the two possible ways, If symbols <s> and </s> are being
-  // replaced by epsilons, neither node nor arc is created, and the logprob
-  // of the n-gram is applied to its source node as final weight. If <s> and
-  // </s> are preserved, then a special final node for </s> is allocated and
-  // used as the destination of the "</s>" acceptor arc.
-  HistKey heads(ngram.words.begin(), ngram.words.end() - 1);
-  typename HistoryMap::iterator source_it = history_.find(heads);
-  if (source_it == history_.end()) {
-    // There was no "A B", therefore the probability of "A B C" is zero.
-    // Print a warning and discard current n-gram.
-    if (parent_->ShouldWarn())
-      KALDI_WARN << parent_->LineReference()
-                 << " skipped: no parent (n-1)-gram exists";
-    return;
-  }
+void ArpaLmCompilerImpl::AddNGram(const int32* words, int32 order,
+                                  float logprob, float backoff) {
+  NGramBlock& ngrams = ngrams_[order - 1];
+  ngrams.words.insert(ngrams.words.end(), words, words + order);
+  ngrams.logprob.push_back(logprob);
+  // The highest order n-grams do not back off.
+  if (order < max_order_) ngrams.backoff.push_back(backoff);
+}
 
-  StateId source = source_it->second;
-  StateId dest;
-  Symbol sym = ngram.words.back();
-  float weight = -ngram.logprob;
-  if (sym == sub_eps_ || sym == 0) {
-    KALDI_ERR << " <eps> or disambiguation symbol " << sym
-              << "found in the ARPA file. ";
-  }
-  if (sym == eos_symbol_) {
-    if (sub_eps_ == 0) {
-      // Keep </s> as a real symbol when not substituting.
-      dest = eos_state_;
-    } else {
-      // Treat </s> as if it was epsilon: mark source final, with the weight
-      // of the n-gram.
-      fst_->SetFinal(source, weight);
-      return;
+void ArpaLmCompilerImpl::SortNGrams(int32 order) {
+  NGramBlock& ngrams = ngrams_[order - 1];
+  size_t n = ngrams.Size();
+  KALDI_ASSERT(n < std::numeric_limits<uint32>::max());
+  std::vector<uint32> index(n);
+  for (size_t i = 0; i < n; ++i) index[i] = i;
+  // Ties are broken by the file order, so the first of the duplicates wins.
+  ParallelSort(
+      &index,
+      [&ngrams, order](uint32 a, uint32 b) {
+        const int32* wa = ngrams.Words(a);
+        const int32* wb = ngrams.Words(b);
+        if (WordsEqual(wa, wb, order)) return a < b;
+        return WordsLess(wa, wb, order);
+      },
+      num_threads_);
+
+  const bool is_highest = order == max_order_;
+  const NGramBlock& heads = histories_[order - 1];
+  NGramBlock& histories = histories_[order];
+  NGramBlock& eos_ngrams = eos_ngrams_[order];
+  histories.order = eos_ngrams.order = order;
+  histories.words.reserve(n * order);
+  histories.logprob.reserve(n);
+  if (!is_highest) histories.backoff.reserve(n);
+  size_t head = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const int32* words = ngrams.Words(index[i]);
+    if (i > 0 && WordsEqual(words, ngrams.Words(index[i - 1]), order)) {
+      if (parent_->ShouldWarn())
+        KALDI_WARN << "n-gram " << parent_->NGramReference(words, order)
+                   << " skipped: duplicate n-gram";
+      continue;
     }
-  } else {
-    // For the highest order n-gram, this may find an existing state, for
-    // non-highest, will create one (unless there are duplicate n-grams
-    // in the grammar, which cannot be reliably detected if highest order,
-    // so we better do not do that at all).
-    dest = AddStateWithBackoff(
-        HistKey(ngram.words.begin() + (is_highest ? 1 : 0), ngram.words.end()),
-        -ngram.backoff);
+    if (order > 1) {
+      while (head < heads.Size() &&
+             WordsLess(heads.Words(head), words, order - 1))
+        ++head;
+      if (head == heads.Size() ||
+          !WordsEqual(heads.Words(head), words, order - 1)) {
+        // There was no "A B", therefore the probability of "A B C" is zero.
+        if (parent_->ShouldWarn())
+          KALDI_WARN << "n-gram " << parent_->NGramReference(words, order)
+                     << " skipped: no parent (n-1)-gram exists";
+        continue;
+      }
+    }
+    NGramBlock& out =
+        words[order - 1] == eos_symbol_ ? eos_ngrams : histories;
+    out.words.insert(out.words.end(), words, words + order);
+    out.logprob.push_back(ngrams.logprob[index[i]]);
+    if (&out == &histories && !is_highest)
+      out.backoff.push_back(ngrams.backoff[index[i]]);
   }
+  // Release the n-grams in the file order.
+  ngrams = NGramBlock();
+}
 
-  if (sym == bos_symbol_) {
-    weight = 0;  // Accepting <s> is always free.
-    if (sub_eps_ == 0) {
-      // <s> is as a real symbol, only accepted in the start state.
-      source = fst_->AddState();
-      fst_->SetStart(source);
+StateId ArpaLmCompilerImpl::FindState(const int32* words,
+                                      int32 order) const {
+  if (order == 0) return 0;
+  if (order >= max_order_) return fst::kNoStateId;
+  const NGramBlock& histories = histories_[order];
+  size_t lo = 0, hi = histories.Size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (WordsLess(histories.Words(mid), words, order)) {
+      lo = mid + 1;
     } else {
-      // The new state for <s> unigram history *is* the start state.
-      fst_->SetStart(dest);
-      return;
+      hi = mid;
     }
   }
-
-  // Add arc from source to dest, whichever way it was found.
-  fst_->AddArc(source, fst::StdArc(sym, sym, weight, dest));
-  return;
+  if (lo < histories.Size() && WordsEqual(histories.Words(lo), words, order))
+    return first_state_[order] + lo;
+  return fst::kNoStateId;
 }
 
-// Find or create a new state for n-gram defined by key, and ensure it has a
-// backoff transition.  The key is either the current n-gram for all but
-// highest orders, or the tails of the n-gram for the highest order. The
-// latter arises from the chain-collapsing optimization described above.
-template <class HistKey>
-StateId ArpaLmCompilerImpl<HistKey>::AddStateWithBackoff(HistKey key,
-                                                         float backoff) {
-  typename HistoryMap::iterator dest_it = history_.find(key);
-  if (dest_it != history_.end()) {
-    // Found an existing state in the history map. Invariant: if the state in
-    // the map, then its backoff arc is in the FST. We are done.
-    return dest_it->second;
+// When the backoff state is not found, naturally fall back to the lower
+// order model, and all the way down until one is found (since the 0-gram
+// model is always present, the search is guaranteed to terminate).
+StateId ArpaLmCompilerImpl::BackoffState(const int32* words,
+                                         int32 order) const {
+  for (int32 i = 0; i <= order; ++i) {
+    StateId state = FindState(words + i, order - i);
+    if (state != fst::kNoStateId) return state;
   }
-  // Otherwise create a new state and its backoff arc, and register in the map.
-  StateId dest = fst_->AddState();
-  history_[key] = dest;
-  CreateBackoff(key.Tails(), dest, backoff);
-  return dest;
+  return 0;
 }
 
-// Create a backoff arc for a state. Key is a backoff destination that may or
-// may not exist. When the destination is not found, naturally fall back to
-// the lower order model, and all the way down until one is found (since the
-// 0-gram model is always present, the search is guaranteed to terminate).
-template <class HistKey>
-inline void ArpaLmCompilerImpl<HistKey>::CreateBackoff(HistKey key,
-                                                       StateId state,
-                                                       float weight) {
-  typename HistoryMap::iterator dest_it = history_.find(key);
-  while (dest_it == history_.end()) {
-    key = key.Tails();
-    dest_it = history_.find(key);
-  }
-
-  // The arc should transduce either <eos> or #0 to <eps>, depending on the
-  // epsilon substitution mode. This is the only case when input and output
-  // label may differ.
-  fst_->AddArc(state, fst::StdArc(sub_eps_, 0, weight, dest_it->second));
+StateId ArpaLmCompilerImpl::NextState(int32 order, size_t i) const {
+  if (order < max_order_) return first_state_[order] + i;
+  return BackoffState(histories_[order].Words(i) + 1, order - 1);
 }
 
-ArpaLmCompiler::~ArpaLmCompiler() {
-  if (impl_ != NULL) delete impl_;
+size_t ArpaLmCompilerImpl::ExpandState(int32 order, size_t i, size_t* child,
+                                       size_t* eos_child, fst::StdArc* arcs) {
+  const StateId state = order == 0 ? 0 : first_state_[order] + i;
+  const int32* words = order == 0 ? NULL : histories_[order].Words(i);
+  const int32 child_order = order + 1;
+  const NGramBlock& children = histories_[child_order];
+  const NGramBlock& eos_children = eos_ngrams_[child_order];
+
+  // The backoff arc and the arc of "(..) </s>" are merged into the arcs of
+  // the children by ilabel. The backoff arc transduces either <eps> or #0 to
+  // <eps>, depending on the epsilon substitution mode.
+  fst::StdArc extra[2];
+  int32 num_extra = 0;
+  if (order > 0) {
+    extra[num_extra++] =
+        fst::StdArc(sub_eps_, 0, -histories_[order].backoff[i],
+                    BackoffState(words + 1, order - 1));
+  }
+  if (*eos_child < eos_children.Size() &&
+      (order == 0 ||
+       WordsEqual(eos_children.Words(*eos_child), words, order))) {
+    float weight = -eos_children.logprob[*eos_child];
+    ++*eos_child;
+    if (sub_eps_ == 0) {
+      // Keep </s> as a real symbol when not substituting.
+      extra[num_extra++] =
+          fst::StdArc(eos_symbol_, eos_symbol_, weight, eos_state_);
+    } else if (arcs != NULL) {
+      // Treat </s> as if it was epsilon: mark the state final, with the
+      // weight of the n-gram.
+      finals_[state] = weight;
+    }
+  }
+  if (num_extra == 2 && extra[1].ilabel < extra[0].ilabel)
+    std::swap(extra[0], extra[1]);
+
+  size_t num_arcs = 0;
+  int32 next_extra = 0;
+  for (; *child < children.Size(); ++*child) {
+    const int32* child_words = children.Words(*child);
+    if (order > 0 && !WordsEqual(child_words, words, order)) break;
+    Symbol sym = child_words[order];
+    // <s> is accepted by the start state only.
+    if (sym == bos_symbol_) continue;
+    for (; next_extra < num_extra && extra[next_extra].ilabel < sym;
+         ++next_extra, ++num_arcs) {
+      if (arcs != NULL) arcs[num_arcs] = extra[next_extra];
+    }
+    if (arcs != NULL) {
+      arcs[num_arcs] = fst::StdArc(sym, sym, -children.logprob[*child],
+                                   NextState(child_order, *child));
+    }
+    ++num_arcs;
+  }
+  for (; next_extra < num_extra; ++next_extra, ++num_arcs) {
+    if (arcs != NULL) arcs[num_arcs] = extra[next_extra];
+  }
+  return num_arcs;
 }
 
-void ArpaLmCompiler::HeaderAvailable() {
-  KALDI_ASSERT(impl_ == NULL);
-  // Use optimized implementation if the grammar is 4-gram or less, and the
-  // maximum attained symbol id will fit into the optimized range.
-  int64 max_symbol = 0;
-  if (Symbols() != NULL) max_symbol = Symbols()->AvailableKey() - 1;
-  // If augmenting the symbol table, assume the worst case when all words in
-  // the model being read are novel.
-  if (Options().oov_handling == ArpaParseOptions::kAddToSymbols)
-    max_symbol += NgramCounts()[0];
-
-  if (NgramCounts().size() <= 4 && max_symbol < OptimizedHistKey::kMaxData) {
-    impl_ = new ArpaLmCompilerImpl<OptimizedHistKey>(this, &fst_, sub_eps_);
+void ArpaLmCompilerImpl::BuildStates() {
+  // The 0-gram is a special state for empty history. All unigrams (including
+  // BOS) backoff into this state.
+  StateId num_states = 1;
+  // Also, if </s> is not treated as epsilon, create a common end state for
+  // all transitions accepting the </s>, since they do not back off. This
+  // small optimization saves about 2% states in an average grammar.
+  if (sub_eps_ == 0) eos_state_ = num_states++;
+  // The state of <s> unigram history, or the 0-gram in a unigram model.
+  StateId bos_next = fst::kNoStateId;
+  const NGramBlock& unigrams = histories_[1];
+  for (size_t i = 0; i < unigrams.Size(); ++i) {
+    if (unigrams.words[i] == bos_symbol_) {
+      bos_next = max_order_ > 1 ? i : 0;
+      break;
+    }
+  }
+  // <s> is a real symbol, only accepted in the start state.
+  if (sub_eps_ == 0 && bos_next != fst::kNoStateId) bos_state_ = num_states++;
+  for (int32 order = 1; order < max_order_; ++order) {
+    first_state_[order] = num_states;
+    size_t count = histories_[order].Size();
+    KALDI_ASSERT(num_states + count < std::numeric_limits<StateId>::max());
+    num_states += count;
+  }
+  if (bos_next != fst::kNoStateId && max_order_ > 1)
+    bos_next += first_state_[1];
+
+  finals_.assign(num_states, fst::TropicalWeight::Zero());
+  offsets_.assign(num_states + 1, 0);
+  if (eos_state_ != fst::kNoStateId) finals_[eos_state_] = 0;
+  if (bos_state_ != fst::kNoStateId) {
+    offsets_[bos_state_ + 1] = 1;
+    start_ = bos_state_;
   } else {
-    impl_ = new ArpaLmCompilerImpl<GeneralHistKey>(this, &fst_, sub_eps_);
-    KALDI_LOG << "Reverting to slower state tracking because model is large: "
-              << NgramCounts().size() << "-gram with symbols up to "
-              << max_symbol;
+    // The new state for <s> unigram history *is* the start state.
+    start_ = bos_next;
   }
-}
 
-void ArpaLmCompiler::ConsumeNGram(const NGram& ngram) {
-  // <s> is invalid in tails, </s> in heads of an n-gram.
-  for (int i = 0; i < ngram.words.size(); ++i) {
-    if ((i > 0 && ngram.words[i] == Options().bos_symbol) ||
-        (i + 1 < ngram.words.size() &&
-         ngram.words[i] == Options().eos_symbol)) {
-      if (ShouldWarn())
-        KALDI_WARN << LineReference()
-                   << " skipped: n-gram has invalid BOS/EOS placement";
-      return;
+  // The states of each order are split into slices, which are expanded in
+  // parallel, twice, to count the arcs and then to write them.
+  std::vector<std::pair<size_t, size_t> > slices;
+  std::vector<size_t> slice_begins;
+  for (int32 pass = 0; pass < 2; ++pass) {
+    if (pass == 1) {
+      for (StateId s = 0; s < num_states; ++s) offsets_[s + 1] += offsets_[s];
+      arcs_.resize(offsets_[num_states]);
+      if (bos_state_ != fst::kNoStateId) {
+        // Accepting <s> is always free.
+        arcs_[offsets_[bos_state_]] =
+            fst::StdArc(bos_symbol_, bos_symbol_, 0, bos_next);
+      }
+    }
+    for (int32 order = 0; order < max_order_; ++order) {
+      const size_t num_order_states =
+          order == 0 ? 1 : histories_[order].Size();
+      const size_t num_slices = std::min<size_t>(
+          num_order_states, order == 0 ? 1 : 4 * num_threads_);
+      ParallelFor(num_slices, num_threads_, [&](size_t j) {
+        size_t begin = num_order_states * j / num_slices;
+        size_t end = num_order_states * (j + 1) / num_slices;
+        size_t child = 0, eos_child = 0;
+        if (order > 0 && begin > 0) {
+          const int32* words = histories_[order].Words(begin);
+          const NGramBlock& children = histories_[order + 1];
+          const NGramBlock& eos_children = eos_ngrams_[order + 1];
+          // The first children whose heads are not less than the words.
+          size_t lo = 0, hi = children.Size();
+          while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (WordsLess(children.Words(mid), words, order)) {
+              lo = mid + 1;
+            } else {
+              hi = mid;
+            }
+          }
+          child = lo;
+          lo = 0, hi = eos_children.Size();
+          while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (WordsLess(eos_children.Words(mid), words, order)) {
+              lo = mid + 1;
+            } else {
+              hi = mid;
+            }
+          }
+          eos_child = lo;
+        }
+        for (size_t i = begin; i < end; ++i) {
+          StateId state = order == 0 ? 0 : first_state_[order] + i;
+          if (pass == 0) {
+            offsets_[state + 1] =
+                ExpandState(order, i, &child, &eos_child, NULL);
+          } else {
+            ExpandState(order, i, &child, &eos_child,
+                        arcs_.data() + offsets_[state]);
+          }
+        }
+      });
     }
   }
+}
 
-  bool is_highest = ngram.words.size() == NgramCounts().size();
-  impl_->ConsumeNGram(ngram, is_highest);
+void ArpaLmCompilerImpl::Compile() {
+  for (int32 order = 1; order <= max_order_; ++order) SortNGrams(order);
+  BuildStates();
+  // Release the n-grams.
+  histories_.clear();
+  eos_ngrams_.clear();
+  KALDI_LOG << "Compiled " << NumStates() << " states and " << TotalArcs()
+            << " arcs";
+  RemoveRedundantStates();
 }
 
-void ArpaLmCompiler::RemoveRedundantStates() {
-  fst::StdArc::Label backoff_symbol = sub_eps_;
+void ArpaLmCompilerImpl::RemoveRedundantStates() {
+  const Symbol backoff_symbol = sub_eps_;
   if (backoff_symbol == 0) {
     // The method of removing redundant states implemented in this function
     // leads to slow determinization of L o G when people use the older style of
@@ -339,42 +482,201 @@ void ArpaLmCompiler::RemoveRedundantStates() {
     return;
   }
 
-  fst::StdArc::StateId num_states = fst_.NumStates();
-
-  // replace the #0 symbols on the input of arcs out of redundant states (states
-  // that are not final and have only a backoff arc leaving them), with <eps>.
-  for (fst::StdArc::StateId state = 0; state < num_states; state++) {
-    if (fst_.NumArcs(state) == 1 &&
-        fst_.Final(state) == fst::TropicalWeight::Zero()) {
-      fst::MutableArcIterator<fst::StdVectorFst> iter(&fst_, state);
-      fst::StdArc arc = iter.Value();
-      if (arc.ilabel == backoff_symbol) {
-        arc.ilabel = 0;
-        iter.SetValue(arc);
-      }
+  // A redundant state is not final and has only a backoff arc. The arcs into
+  // it are redirected to the end of its backoff chain, with the weights of
+  // the backoff arcs on the way, and it's dropped.
+  const StateId num_states = NumStates();
+  std::vector<StateId> new_ids(num_states);
+  StateId num_kept = 0;
+  for (StateId s = 0; s < num_states; ++s) {
+    bool redundant = s != start_ && NumArcs(s) == 1 &&
+                     finals_[s] == fst::TropicalWeight::Zero() &&
+                     Arcs(s)[0].ilabel == backoff_symbol;
+    new_ids[s] = redundant ? fst::kNoStateId : num_kept++;
+  }
+  for (size_t a = 0; a < arcs_.size(); ++a) {
+    fst::StdArc& arc = arcs_[a];
+    while (new_ids[arc.nextstate] == fst::kNoStateId) {
+      const fst::StdArc& backoff = arcs_[offsets_[arc.nextstate]];
+      arc.weight = fst::Times(arc.weight, backoff.weight);
+      arc.nextstate = backoff.nextstate;
     }
   }
-
-  // we could call fst::RemoveEps, and it would have the same effect in normal
-  // cases, where backoff_symbol != 0 and there are no epsilons in unexpected
-  // places, but RemoveEpsLocal is a bit safer in case something weird is going
-  // on; it guarantees not to blow up the FST.
-  fst::RemoveEpsLocal(&fst_);
+  size_t num_arcs = 0;
+  for (StateId s = 0; s < num_states; ++s) {
+    if (new_ids[s] == fst::kNoStateId) continue;
+    size_t begin = offsets_[s], end = offsets_[s + 1];
+    offsets_[new_ids[s]] = num_arcs;
+    finals_[new_ids[s]] = finals_[s];
+    for (size_t a = begin; a < end; ++a) {
+      fst::StdArc arc = arcs_[a];
+      arc.nextstate = new_ids[arc.nextstate];
+      arcs_[num_arcs++] = arc;
+    }
+  }
+  offsets_[num_kept] = num_arcs;
+  offsets_.resize(num_kept + 1);
+  finals_.resize(num_kept);
+  arcs_.resize(num_arcs);
+  if (start_ != fst::kNoStateId) start_ = new_ids[start_];
   KALDI_LOG << "Reduced num-states from " << num_states << " to "
-            << fst_.NumStates();
+            << num_kept;
+}
+
+void ArpaLmCompilerImpl::Clear() {
+  std::vector<fst::TropicalWeight>().swap(finals_);
+  std::vector<size_t>().swap(offsets_);
+  std::vector<fst::StdArc>().swap(arcs_);
+}
+
+namespace {
+
+// ExpandedFst view of the compact G, which is what it's written or copied
+// through.
+class CompactLmFst : public fst::ExpandedFst<fst::StdArc> {
+ public:
+  typedef fst::StdArc Arc;
+  typedef Arc::Weight Weight;
+
+  CompactLmFst(const ArpaLmCompilerImpl* impl,
+               const fst::SymbolTable* symbols)
+      : impl_(impl),
+        symbols_(symbols),
+        properties_(fst::kExpanded | fst::kILabelSorted) {}
+
+  StateId Start() const override { return impl_->Start(); }
+  Weight Final(StateId s) const override { return impl_->Final(s); }
+  StateId NumStates() const override { return impl_->NumStates(); }
+  size_t NumArcs(StateId s) const override { return impl_->NumArcs(s); }
+  size_t NumInputEpsilons(StateId s) const override {
+    size_t n = 0;
+    for (size_t i = 0; i < NumArcs(s); ++i) n += impl_->Arcs(s)[i].ilabel == 0;
+    return n;
+  }
+  size_t NumOutputEpsilons(StateId s) const override {
+    size_t n = 0;
+    for (size_t i = 0; i < NumArcs(s); ++i) n += impl_->Arcs(s)[i].olabel == 0;
+    return n;
+  }
+  uint64 Properties(uint64 mask, bool test) const override {
+    if (test) {
+      uint64 known, props = fst::TestProperties(*this, mask, &known);
+      properties_ = (properties_ & ~known) | (props & known);
+      return props & mask;
+    }
+    return properties_ & mask;
+  }
+  const std::string& Type() const override {
+    static const std::string type = "compact-lm";
+    return type;
+  }
+  CompactLmFst* Copy(bool safe = false) const override {
+    return new CompactLmFst(*this);
+  }
+  const fst::SymbolTable* InputSymbols() const override { return symbols_; }
+  const fst::SymbolTable* OutputSymbols() const override { return symbols_; }
+
+  void InitStateIterator(fst::StateIteratorData<Arc>* data) const override {
+    data->base = NULL;
+    data->nstates = NumStates();
+  }
+  void InitArcIterator(StateId s,
+                       fst::ArcIteratorData<Arc>* data) const override {
+    data->base = NULL;
+    data->arcs = impl_->Arcs(s);
+    data->narcs = impl_->NumArcs(s);
+    data->ref_count = NULL;
+  }
+
+ private:
+  const ArpaLmCompilerImpl* impl_;
+  const fst::SymbolTable* symbols_;
+  mutable uint64 properties_;
+};
+
+}  // namespace
+
+ArpaLmCompiler::~ArpaLmCompiler() {
+  if (impl_ != NULL) delete impl_;
+}
+
+const fst::StdVectorFst& ArpaLmCompiler::Fst() const {
+  if (impl_ != NULL && !impl_->Empty() && fst_.NumStates() == 0) {
+    fst_ = fst::StdVectorFst(CompactLmFst(impl_, Symbols()));
+  }
+  return fst_;
+}
+
+fst::StdVectorFst* ArpaLmCompiler::MutableFst() {
+  Fst();
+  if (impl_ != NULL) impl_->Clear();
+  return &fst_;
+}
+
+bool ArpaLmCompiler::WriteConstFst(std::ostream& os,
+                                   const fst::FstWriteOptions& opts) const {
+  if (impl_ == NULL || impl_->Empty()) {
+    return fst::StdConstFst::WriteFst(fst_, os, opts);
+  }
+  // The ConstFst indexes the arcs by uint32.
+  KALDI_ASSERT(impl_->TotalArcs() < std::numeric_limits<uint32>::max());
+  return fst::StdConstFst::WriteFst(CompactLmFst(impl_, Symbols()), os, opts);
+}
+
+void ArpaLmCompiler::HeaderAvailable() {
+  KALDI_ASSERT(impl_ == NULL);
+  impl_ = new ArpaLmCompilerImpl(this, sub_eps_);
+}
+
+bool ArpaLmCompiler::IsValidNGram(const int32* words, int32 order) const {
+  Symbol sym = words[order - 1];
+  if (sym == sub_eps_ || sym == 0) {
+    KALDI_ERR << " <eps> or disambiguation symbol " << sym
+              << "found in the ARPA file. ";
+  }
+  // <s> is invalid in tails, </s> in heads of an n-gram.
+  for (int i = 0; i < order; ++i) {
+    if ((i > 0 && words[i] == Options().bos_symbol) ||
+        (i + 1 < order && words[i] == Options().eos_symbol)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void ArpaLmCompiler::ConsumeNGram(const NGram& ngram) {
+  if (!IsValidNGram(ngram.words.data(), ngram.words.size())) {
+    if (ShouldWarn())
+      KALDI_WARN << LineReference()
+                 << " skipped: n-gram has invalid BOS/EOS placement";
+    return;
+  }
+  impl_->AddNGram(ngram.words.data(), ngram.words.size(), ngram.logprob,
+                  ngram.backoff);
+}
+
+void ArpaLmCompiler::ConsumeNGrams(const NGramBlock& block) {
+  for (size_t i = 0; i < block.Size(); ++i) {
+    const int32* words = block.Words(i);
+    if (!IsValidNGram(words, block.order)) {
+      if (ShouldWarn())
+        KALDI_WARN << "n-gram " << NGramReference(words, block.order)
+                   << " skipped: n-gram has invalid BOS/EOS placement";
+      continue;
+    }
+    impl_->AddNGram(words, block.order, block.logprob[i], block.backoff[i]);
+  }
 }
 
 void ArpaLmCompiler::Check() const {
-  if (fst_.Start() == fst::kNoStateId) {
+  if (impl_->Start() == fst::kNoStateId) {
     KALDI_ERR << "Arpa file did not contain the beginning-of-sentence symbol "
               << Symbols()->Find(Options().bos_symbol) << ".";
   }
 }
 
 void ArpaLmCompiler::ReadComplete() {
-  fst_.SetInputSymbols(Symbols());
-  fst_.SetOutputSymbols(Symbols());
-  RemoveRedundantStates();
+  impl_->Compile();
   Check();
 }
 
@@ -27,7 +27,7 @@
 
 namespace kaldi {
 
-class ArpaLmCompilerImplInterface;
+class ArpaLmCompilerImpl;
 
 class ArpaLmCompiler : public ArpaFileParser {
  public:
@@ -36,25 +36,33 @@ class ArpaLmCompiler : public ArpaFileParser {
       : ArpaFileParser(options, symbols), sub_eps_(sub_eps), impl_(NULL) {}
   ~ArpaLmCompiler();
 
-  const fst::StdVectorFst& Fst() const { return fst_; }
-  fst::StdVectorFst* MutableFst() { return &fst_; }
+  /// The n-grams are compiled into compact arrays of the states and the
+  /// ilabel sorted arcs, which are expanded into a VectorFst on the first
+  /// call of Fst() or MutableFst(). The latter releases the arrays.
+  const fst::StdVectorFst& Fst() const;
+  fst::StdVectorFst* MutableFst();
+
+  /// Writes the ConstFst straight from the compact arrays, so the VectorFst
+  /// is never built if it's the only output.
+  bool WriteConstFst(std::ostream& os,
+                     const fst::FstWriteOptions& opts) const;
 
  protected:
   // ArpaFileParser overrides.
   virtual void HeaderAvailable();
   virtual void ConsumeNGram(const NGram& ngram);
+  virtual void ConsumeNGrams(const NGramBlock& block);
   virtual void ReadComplete();
 
  private:
-  // this function removes states that only have a backoff arc coming
-  // out of them.
-  void RemoveRedundantStates();
+  // Returns false if <s> is in the tails or </s> is in the heads of the
+  // n-gram, which is skipped then.
+  bool IsValidNGram(const int32* words, int32 order) const;
   void Check() const;
 
   int sub_eps_;
-  ArpaLmCompilerImplInterface* impl_;  // Owned.
-  fst::StdVectorFst fst_;
-  template <class HistKey>
+  ArpaLmCompilerImpl* impl_;  // Owned.
+  mutable fst::StdVectorFst fst_;
   friend class ArpaLmCompilerImpl;
 };
 
@@ -17,11 +17,13 @@
 // See the Apache 2 License for the specific language governing permissions and
 // limitations under the License.
 
+#include <memory>
 #include <string>
 
 #include "lm/arpa-lm-compiler.h"
 #include "util/kaldi-io.h"
 #include "util/parse-options.h"
+#include "utils/mapped_file.h"
 
 int main(int argc, char *argv[]) {
   using namespace kaldi;  // NOLINT
@@ -33,7 +35,9 @@ int main(int argc, char *argv[]) {
         "data/lang/words.txt lm/input.arpa G.fst\n\n"
         "Note: When called without switches, the output G.fst will contain\n"
         "an embedded symbol table. This is compatible with the way a previous\n"
-        "version of arpa2fst worked.\n";
+        "version of arpa2fst worked.\n"
+        "A file (rather than a pipe) is mapped into memory, and its n-grams\n"
+        "are tokenized by --num-threads threads.\n";
 
     ParseOptions po(usage);
 
@@ -48,6 +52,7 @@ int main(int argc, char *argv[]) {
     std::string write_syms_filename;
     bool keep_symbols = false;
     bool ilabel_sort = true;
+    bool const_fst = false;
 
     po.Register("bos-symbol", &bos_symbol, "Beginning of sentence symbol");
     po.Register("eos-symbol", &eos_symbol, "End of sentence symbol");
@@ -63,6 +68,10 @@ int main(int argc, char *argv[]) {
                 "symbol tables are neither read or written (otherwise symbols "
                 "would be lost entirely)");
     po.Register("ilabel-sort", &ilabel_sort, "Ilabel-sort the output FST");
+    po.Register("const-fst", &const_fst,
+                "Write the output FST as a ConstFst, which is written "
+                "straight from the compiled n-grams, without building a "
+                "VectorFst. Its arcs are always ilabel sorted");
 
     po.Read(argc, argv);
 
@@ -114,13 +123,19 @@ int main(int argc, char *argv[]) {
     // Actually compile LM.
     KALDI_ASSERT(symbols != NULL);
     ArpaLmCompiler lm_compiler(options, disambig_symbol_id, symbols);
-    {
+    if (ClassifyRxfilename(arpa_rxfilename) == kFileInput) {
+      std::unique_ptr<wenet::MappedFile> file =
+          wenet::MappedFile::Open(arpa_rxfilename);
+      if (file == nullptr)
+        KALDI_ERR << "Could not read ARPA file " << arpa_rxfilename;
+      lm_compiler.Read(file->data(), file->size());
+    } else {
       Input ki(arpa_rxfilename);
       lm_compiler.Read(ki.Stream());
     }
 
     // Sort the FST in-place if requested by options.
-    if (ilabel_sort) {
+    if (ilabel_sort && !const_fst) {
       fst::ArcSort(lm_compiler.MutableFst(), fst::StdILabelCompare());
     }
 
@@ -135,7 +150,12 @@ int main(int argc, char *argv[]) {
     kaldi::Output kofst(fst_wxfilename, write_binary, write_header);
     fst::FstWriteOptions wopts(PrintableWxfilename(fst_wxfilename));
     wopts.write_isymbols = wopts.write_osymbols = keep_symbols;
-    lm_compiler.Fst().Write(kofst.Stream(), wopts);
+    if (const_fst) {
+      if (!lm_compiler.WriteConstFst(kofst.Stream(), wopts))
+        KALDI_ERR << "Could not write FST to " << fst_wxfilename;
+    } else {
+      lm_compiler.MutableFst()->Write(kofst.Stream(), wopts);
+    }
 
     delete symbols;
   } catch (const std::exception &e) {
@@ -0,0 +1,133 @@
+// lmbin/arpa2ngram.cc
+//
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "lm/arpa-file-parser.h"
+#include "util/kaldi-io.h"
+#include "util/parse-options.h"
+#include "utils/ngram_lm.h"
+
+namespace kaldi {
+
+// Collect the n-grams of the ARPA LM for wenet::NgramLm::Build()
+class NgramCollector : public ArpaFileParser {
+ public:
+  NgramCollector(const ArpaParseOptions &options, fst::SymbolTable *symbols)
+      : ArpaFileParser(options, symbols), unk_id_(symbols->Find("<unk>")) {}
+
+  std::vector<wenet::NgramLm::NGram> *MutableNGrams() { return &ngrams_; }
+  // The log prob of <unk> if it's in the LM
+  bool GetUnkLogprob(float *logprob) const {
+    if (has_unk_) *logprob = unk_logprob_;
+    return has_unk_;
+  }
+
+ protected:
+  void ConsumeNGram(const NGram &ngram) override {
+    if (ngram.words.size() == 1 && ngram.words[0] == unk_id_) {
+      unk_logprob_ = ngram.logprob;
+      has_unk_ = true;
+    }
+    ngrams_.emplace_back();
+    wenet::NgramLm::NGram &out = ngrams_.back();
+    out.words.assign(ngram.words.begin(), ngram.words.end());
+    out.logprob = ngram.logprob;
+    out.backoff = ngram.backoff;
+  }
+
+ private:
+  int64 unk_id_;
+  std::vector<wenet::NgramLm::NGram> ngrams_;
+  bool has_unk_ = false;
+  float unk_logprob_ = 0;
+};
+
+}  // namespace kaldi
+
+int main(int argc, char *argv[]) {
+  using namespace kaldi;  // NOLINT
+  try {
+    const char *usage =
+        "Convert an ARPA format language model into the quantized n-gram\n"
+        "trie of the CTC prefix beam search (see --ngram_lm_path of the\n"
+        "decoder). The words must be the modeling units, e.g. characters or\n"
+        "BPE pieces, the n-grams with the other words are skipped.\n"
+        "Usage: arpa2ngram [opts] <input-arpa> <output-lm>\n"
+        " e.g.: arpa2ngram --read-symbol-table=units.txt lm.arpa lm.bin\n";
+
+    ParseOptions po(usage);
+
+    ArpaParseOptions options;
+    options.Register(&po);
+
+    std::string bos_symbol = "<s>";
+    std::string eos_symbol = "</s>";
+    std::string read_syms_filename;
+    float unk_logprob = -100.0;
+
+    po.Register("bos-symbol", &bos_symbol, "Beginning of sentence symbol");
+    po.Register("eos-symbol", &eos_symbol, "End of sentence symbol");
+    po.Register("read-symbol-table", &read_syms_filename,
+                "The unit table of the model");
+    po.Register("unk-logprob", &unk_logprob,
+                "log10 prob of the words which are not in the LM, it's "
+                "not used if <unk> is in the LM");
+
+    po.Read(argc, argv);
+
+    if (po.NumArgs() != 2 || read_syms_filename.empty()) {
+      po.PrintUsage();
+      exit(1);
+    }
+    std::string arpa_rxfilename = po.GetArg(1),
+                lm_filename = po.GetArg(2);
+
+    kaldi::Input kisym(read_syms_filename);
+    fst::SymbolTable *symbols = fst::SymbolTable::ReadText(
+        kisym.Stream(), PrintableWxfilename(read_syms_filename));
+    if (symbols == NULL)
+      KALDI_ERR << "Could not read symbol table from file "
+                << read_syms_filename;
+    options.oov_handling = ArpaParseOptions::kSkipNGram;
+    // They're not units, the model never emits them
+    options.bos_symbol = symbols->AddSymbol(bos_symbol);
+    options.eos_symbol = symbols->AddSymbol(eos_symbol);
+
+    NgramCollector collector(options, symbols);
+    {
+      Input ki(arpa_rxfilename);
+      collector.Read(ki.Stream());
+    }
+    float logprob = unk_logprob * M_LN10;
+    collector.GetUnkLogprob(&logprob);
+    auto lm = wenet::NgramLm::Build(*collector.MutableNGrams(),
+                                    options.bos_symbol, options.eos_symbol,
+                                    logprob);
+    KALDI_LOG << "Order " << lm->order() << ", " << lm->num_ngrams()
+              << " n-grams";
+    if (!lm->Write(lm_filename)) {
+      KALDI_ERR << "Could not write LM to " << lm_filename;
+    }
+    delete symbols;
+  } catch (const std::exception &e) {
+    std::cerr << e.what();
+    return -1;
+  }
+}
@@ -112,6 +112,13 @@ class HashList {
   /// Returns current number of hash buckets.
   inline size_t Size() { return hash_size_; }
 
+  /// Returns the bytes of the buckets and of the element blocks, the blocks
+  /// are never freed before the destructor.
+  size_t AllocatedBytes() const {
+    return buckets_.capacity() * sizeof(HashBucket) +
+           allocated_.size() * allocate_block_size_ * sizeof(Elem);
+  }
+
   ~HashList();
 
  private:
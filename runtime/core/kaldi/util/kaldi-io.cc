@@ -23,13 +23,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#include <cstdint>
 #include <cstdlib>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
 
 #include "base/io-funcs.h"
 #include "base/kaldi-math.h"
 #include "util/kaldi-pipebuf.h"
 #include "util/parse-options.h"
 #include "util/text-utils.h"
+#include "utils/mapped_file.h"
 
 #ifdef KALDI_CYGWIN_COMPAT
 #include "util/kaldi-cygwin-io-inl.h"
@@ -389,6 +399,9 @@ class InputImplBase {
                                    // call Open twice
   // (has efficiency benefits).
 
+  // Only the mapped files have their data in memory, see Input::MappedData().
+  virtual bool MappedData(const char **data, size_t *size) { return false; }
+
   virtual ~InputImplBase() {}
 };
 
@@ -678,6 +691,145 @@ class OffsetFileInputImpl : public InputImplBase {
   std::ifstream is_;
 };
 
+#ifndef _WIN32
+// Read-only streambuf over the bytes of a mapped file, the reads are copies
+// from memory instead of syscalls.
+class MemoryStreambuf : public std::streambuf {
+ public:
+  void Reset(const char *data, size_t size, size_t pos) {
+    char *begin = const_cast<char *>(data);
+    setg(begin, begin + pos, begin + size);
+  }
+  size_t Pos() const { return gptr() - eback(); }
+  size_t Size() const { return egptr() - eback(); }
+
+ protected:
+  virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                           std::ios_base::openmode which) {
+    off_type pos = off;
+    if (dir == std::ios_base::cur) {
+      pos += Pos();
+    } else if (dir == std::ios_base::end) {
+      pos += Size();
+    }
+    if (!(which & std::ios_base::in) || pos < 0 ||
+        pos > static_cast<off_type>(Size())) {
+      return pos_type(off_type(-1));
+    }
+    setg(eback(), eback() + pos, egptr());
+    return pos_type(pos);
+  }
+  virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+  }
+};
+
+// The recently read files stay mapped, so reading the objects of an archive
+// by their offsets, even with a new Input for each of them like
+// ReadKaldiObject() does, maps the archive once. A file is mapped again if
+// its size or modification time changed.
+class MappedFileCache {
+ public:
+  static std::shared_ptr<const wenet::MappedFile> Get(
+      const std::string &filename) {
+    static MappedFileCache cache;
+    return cache.GetInternal(filename);
+  }
+
+ private:
+  struct Entry {
+    std::string filename;
+    off_t size;
+    time_t mtime;
+    std::shared_ptr<const wenet::MappedFile> file;
+  };
+  static const size_t kMaxFiles = 16;
+
+  std::shared_ptr<const wenet::MappedFile> GetInternal(
+      const std::string &filename) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+      return NULL;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::list<Entry>::iterator it = entries_.begin();
+         it != entries_.end(); ++it) {
+      if (it->filename == filename) {
+        if (it->size == st.st_size && it->mtime == st.st_mtime) {
+          entries_.splice(entries_.begin(), entries_, it);
+          return it->file;
+        }
+        entries_.erase(it);
+        break;
+      }
+    }
+    std::shared_ptr<const wenet::MappedFile> file(
+        wenet::MappedFile::Open(filename).release());
+    if (file == NULL) return NULL;
+    Entry entry = {filename, st.st_size, st.st_mtime, file};
+    entries_.push_front(entry);
+    if (entries_.size() > kMaxFiles) entries_.pop_back();
+    return file;
+  }
+
+  std::mutex mutex_;
+  std::list<Entry> entries_;  // Most recently used first.
+};
+
+// Offsets into files like OffsetFileInputImpl, but the file is mapped into
+// memory: seeking is setting a pointer and the objects may be viewed in
+// place, see Input::MappedData().
+class MappedFileInputImpl : public InputImplBase {
+ public:
+  MappedFileInputImpl() : is_(&buf_) {}
+
+  // Like OffsetFileInputImpl, it may be called when open, to seek in the
+  // same file.
+  virtual bool Open(const std::string &rxfilename, bool binary) {
+    std::string filename;
+    size_t offset;
+    OffsetFileInputImpl::SplitFilename(rxfilename, &filename, &offset);
+    if (file_ == NULL || filename != filename_) {
+      file_ = MappedFileCache::Get(MapOsPath(filename));
+      filename_ = filename;
+      if (file_ == NULL) return false;
+    }
+    if (offset > file_->size()) return false;
+    buf_.Reset(file_->data(), file_->size(), offset);
+    is_.clear();
+    return true;
+  }
+
+  virtual std::istream &Stream() {
+    if (file_ == NULL)
+      KALDI_ERR << "MappedFileInputImpl::Stream(), file is not open.";
+    return is_;
+  }
+
+  virtual int32 Close() {
+    if (file_ == NULL)
+      KALDI_ERR << "MappedFileInputImpl::Close(), file is not open.";
+    file_.reset();
+    return 0;
+  }
+
+  virtual InputType MyType() { return kOffsetFileInput; }
+
+  virtual bool MappedData(const char **data, size_t *size) {
+    if (file_ == NULL) return false;
+    *data = file_->data() + buf_.Pos();
+    *size = buf_.Size() - buf_.Pos();
+    return true;
+  }
+
+ private:
+  std::string filename_;
+  std::shared_ptr<const wenet::MappedFile> file_;
+  MemoryStreambuf buf_;
+  std::istream is_;
+};
+#endif  // _WIN32
+
 Output::Output(const std::string &wxfilename, bool binary, bool write_header)
     : impl_(NULL) {
   if (!Open(wxfilename, binary, write_header)) {
@@ -793,17 +945,18 @@ bool Input::OpenInternal(const std::string &rxfilename, bool file_binary,
     if (type == kOffsetFileInput && impl_->MyType() == kOffsetFileInput) {
       // We want to use the same object to Open... this is in case
       // the files are the same, so we can just seek.
-      if (!impl_->Open(rxfilename, file_binary)) {  // true is binary mode--
+      if (impl_->Open(rxfilename, file_binary)) {  // true is binary mode--
         // always open in binary.
-        delete impl_;
-        impl_ = NULL;
-        return false;
+        // read the binary header, if requested.
+        if (contents_binary != NULL)
+          return InitKaldiInputStream(impl_->Stream(), contents_binary);
+        else
+          return true;
       }
-      // read the binary header, if requested.
-      if (contents_binary != NULL)
-        return InitKaldiInputStream(impl_->Stream(), contents_binary);
-      else
-        return true;
+      // It may be another file which can't be mapped, fall through to the
+      // code below which opens it from scratch.
+      delete impl_;
+      impl_ = NULL;
     } else {
       Close();
       // and fall through to code below which actually opens the file.
@@ -816,7 +969,24 @@ bool Input::OpenInternal(const std::string &rxfilename, bool file_binary,
   } else if (type == kPipeInput) {
     impl_ = new PipeInputImpl();
   } else if (type == kOffsetFileInput) {
+#ifndef _WIN32
+    // Fall back to the stream if the file can't be mapped, e.g. a FIFO.
+    if (file_binary) {
+      impl_ = new MappedFileInputImpl();
+      if (!impl_->Open(rxfilename, file_binary)) {
+        delete impl_;
+        impl_ = new OffsetFileInputImpl();
+      } else if (contents_binary != NULL) {
+        return InitKaldiInputStream(impl_->Stream(), contents_binary);
+      } else {
+        return true;
+      }
+    } else {
+      impl_ = new OffsetFileInputImpl();
+    }
+#else
     impl_ = new OffsetFileInputImpl();
+#endif
   } else {  // type == kNoInput
     KALDI_WARN << "Invalid input filename format "
                << PrintableRxfilename(rxfilename);
@@ -843,6 +1013,41 @@ std::istream &Input::Stream() {
   return impl_->Stream();
 }
 
+bool Input::MappedData(const char **data, size_t *size) {
+  return IsOpen() && impl_->MappedData(data, size);
+}
+
+bool ReadFloatMatrixView(Input *ki, FloatMatrixView *view) {
+  const char *data;
+  size_t size;
+  if (!ki->MappedData(&data, &size)) return false;
+  // The token, then each dimension is its size as a char and the int32.
+  if (size < 3 || data[0] != 'F' || (data[1] != 'M' && data[1] != 'V') ||
+      data[2] != ' ') {
+    return false;
+  }
+  const bool is_matrix = data[1] == 'M';
+  const size_t header_size = is_matrix ? 13 : 8;
+  if (size < header_size) return false;
+  int32 dims[2] = {1, 0};
+  for (int32 i = is_matrix ? 0 : 1, pos = 3; i < 2; ++i, pos += 5) {
+    if (data[pos] != sizeof(int32)) return false;
+    memcpy(&dims[i], data + pos + 1, sizeof(int32));
+  }
+  const char *begin = data + header_size;
+  const size_t num_bytes =
+      static_cast<size_t>(dims[0]) * dims[1] * sizeof(float);
+  if (dims[0] < 0 || dims[1] < 0 || size - header_size < num_bytes ||
+      reinterpret_cast<uintptr_t>(begin) % alignof(float) != 0) {
+    return false;
+  }
+  view->data = reinterpret_cast<const float *>(begin);
+  view->num_rows = dims[0];
+  view->num_cols = dims[1];
+  ki->Stream().seekg(header_size + num_bytes, std::ios_base::cur);
+  return true;
+}
+
 // template <> void ReadKaldiObject(const std::string &filename,
 //                                  Matrix<float> *m) {
 //   if (!filename.empty() && filename[filename.size() - 1] == ']') {
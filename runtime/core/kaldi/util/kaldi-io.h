@@ -213,6 +213,13 @@ class Input {
   // Returns the underlying stream. Throws if !IsOpen()
   std::istream &Stream();
 
+  // If the input is an offset into a file which is mapped into memory, sets
+  // *data and *size to the bytes from the current position of Stream() to
+  // the end of the file and returns true, else returns false. The binary
+  // objects may then be viewed in place instead of copied, the bytes are
+  // valid until the Input is closed.
+  bool MappedData(const char **data, size_t *size);
+
   // Destructor does not throw: input streams may legitimately fail so we
   // don't worry about the status when we close them.
   ~Input();
@@ -231,6 +238,26 @@ void ReadKaldiObject(const std::string &filename, C *c) {
   c->Read(ki.Stream(), binary_in);
 }
 
+/// Zero-copy view of a binary float matrix ("FM") or vector ("FV", with
+/// num_rows == 1) in a mapped file.
+struct FloatMatrixView {
+  const float *data;
+  int32 num_rows;
+  int32 num_cols;
+};
+
+/// Views the float matrix or vector at the current position of ki in place
+/// and skips it in ki.Stream(). Returns false without reading if the input
+/// isn't mapped (see Input::MappedData()), the object is of another type, or
+/// its data isn't aligned for floats; then read it from ki.Stream().
+/// Typical usage, for the "ark:file:offset" of a feature matrix:
+///
+///   bool binary;
+///   Input ki(rxfilename, &binary);
+///   FloatMatrixView view;
+///   if (binary && ReadFloatMatrixView(&ki, &view)) { ... }
+bool ReadFloatMatrixView(Input *ki, FloatMatrixView *view);
+
 // Specialize the template for reading matrices, because we want to be able to
 // support reading 'ranges' (row and column ranges), like foo.mat[10:20].
 // template <> void ReadKaldiObject(const std::string &filename,
@@ -0,0 +1,72 @@
+// util/kaldi-thread.h
+
+// See ../../COPYING for clarification regarding multiple authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_UTIL_KALDI_THREAD_H_
+#define KALDI_UTIL_KALDI_THREAD_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "base/kaldi-types.h"
+#include "base/kaldi-utils.h"
+
+namespace kaldi {
+
+/// Runs fn(0), ..., fn(n - 1) on up to num_threads threads, and rethrows the
+/// first exception of the tasks after all of them are done.
+void ParallelFor(size_t n, int32 num_threads,
+                 const std::function<void(size_t)>& fn);
+
+/// A team of threads kept for the parallel steps which are too short to start
+/// the threads for each of them, e.g. the frames of a decoder.  Run() is
+/// called from one thread at a time.
+class ThreadTeam {
+ public:
+  /// num_threads includes the thread calling Run()
+  explicit ThreadTeam(int32 num_threads);
+  ~ThreadTeam();
+
+  int32 NumThreads() const { return threads_.size() + 1; }
+  /// Runs fn(0), ..., fn(NumThreads() - 1) at the same time, fn(0) on the
+  /// calling thread, and rethrows the first exception of them after all of
+  /// them are done.
+  void Run(const std::function<void(int32)>& fn);
+
+ private:
+  void Work(int32 index);
+
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  const std::function<void(int32)>* fn_ = nullptr;
+  uint64 generation_ = 0;
+  int32 pending_ = 0;
+  bool stop_ = false;
+  std::exception_ptr error_;
+  std::vector<std::thread> threads_;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(ThreadTeam);
+};
+
+}  // namespace kaldi
+
+#endif  // KALDI_UTIL_KALDI_THREAD_H_
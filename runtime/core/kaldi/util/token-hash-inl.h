@@ -0,0 +1,136 @@
+// util/token-hash-inl.h
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_UTIL_TOKEN_HASH_INL_H_
+#define KALDI_UTIL_TOKEN_HASH_INL_H_
+
+// Do not include this file directly.  It is included by token-hash.h
+
+namespace kaldi {
+
+template <class I, class T>
+TokenHash<I, T>::TokenHash() {
+  list_head_ = NULL;
+  list_tail_ = NULL;
+  freed_head_ = NULL;
+  Rehash(16);
+}
+
+template <class I, class T>
+typename TokenHash<I, T>::Elem *TokenHash<I, T>::Clear() {
+  for (size_t slot : used_) keys_[slot] = EmptyKey();
+  used_.clear();
+  Elem *ans = list_head_;
+  list_head_ = NULL;
+  list_tail_ = NULL;
+  return ans;
+}
+
+template <class I, class T>
+inline typename TokenHash<I, T>::Elem *TokenHash<I, T>::New() {
+  if (freed_head_ == NULL) {
+    Elem *tmp = new Elem[allocate_block_size_];
+    for (size_t i = 0; i + 1 < allocate_block_size_; i++)
+      tmp[i].tail = tmp + i + 1;
+    tmp[allocate_block_size_ - 1].tail = NULL;
+    freed_head_ = tmp;
+    allocated_.push_back(tmp);
+  }
+  Elem *ans = freed_head_;
+  freed_head_ = freed_head_->tail;
+  return ans;
+}
+
+template <class I, class T>
+inline typename TokenHash<I, T>::Elem *TokenHash<I, T>::Find(I key) {
+  for (size_t slot = Hash(key);; slot = (slot + 1) & mask_) {
+    I k = keys_[slot];
+    if (k == key) return elems_[slot];
+    if (k == EmptyKey()) return NULL;
+  }
+}
+
+template <class I, class T>
+inline typename TokenHash<I, T>::Elem *TokenHash<I, T>::Insert(I key,
+                                                                T val) {
+  KALDI_ASSERT(key != EmptyKey());
+  size_t slot = Hash(key);
+  for (;; slot = (slot + 1) & mask_) {
+    I k = keys_[slot];
+    if (k == key) return elems_[slot];
+    if (k == EmptyKey()) break;
+  }
+  Elem *elem = New();
+  elem->key = key;
+  elem->val = val;
+  elem->tail = NULL;
+  if (list_tail_ == NULL) {
+    list_head_ = elem;
+  } else {
+    list_tail_->tail = elem;
+  }
+  list_tail_ = elem;
+  keys_[slot] = key;
+  elems_[slot] = elem;
+  used_.push_back(slot);
+  // Keep it at most half full, so the probes are short
+  if (used_.size() * 2 > keys_.size()) Rehash(keys_.size() * 2);
+  return elem;
+}
+
+template <class I, class T>
+void TokenHash<I, T>::SetSize(size_t size) {
+  size_t num_slots = keys_.size();
+  while (num_slots < size) num_slots *= 2;
+  if (num_slots > keys_.size()) Rehash(num_slots);
+}
+
+template <class I, class T>
+void TokenHash<I, T>::Rehash(size_t num_slots) {
+  int log2 = 0;
+  while ((static_cast<size_t>(1) << log2) < num_slots) log2++;
+  shift_ = 64 - log2;
+  mask_ = num_slots - 1;
+  keys_.assign(num_slots, EmptyKey());
+  elems_.resize(num_slots);
+  used_.clear();
+  for (Elem *e = list_head_; e != NULL; e = e->tail) {
+    size_t slot = Hash(e->key);
+    while (keys_[slot] != EmptyKey()) slot = (slot + 1) & mask_;
+    keys_[slot] = e->key;
+    elems_[slot] = e;
+    used_.push_back(slot);
+  }
+}
+
+template <class I, class T>
+TokenHash<I, T>::~TokenHash() {
+  size_t num_in_list = 0, num_allocated = 0;
+  for (Elem *e = freed_head_; e != NULL; e = e->tail) num_in_list++;
+  for (size_t i = 0; i < allocated_.size(); i++) {
+    num_allocated += allocate_block_size_;
+    delete[] allocated_[i];
+  }
+  if (num_in_list != num_allocated) {
+    KALDI_WARN << "Possible memory leak: " << num_in_list
+               << " != " << num_allocated
+               << ": you might have forgotten to call Delete on "
+               << "some Elems";
+  }
+}
+
+}  // end namespace kaldi
+
+#endif  // KALDI_UTIL_TOKEN_HASH_INL_H_
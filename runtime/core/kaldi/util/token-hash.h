@@ -0,0 +1,135 @@
+// util/token-hash.h
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+// THIS CODE IS PROVIDED *AS IS* BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, EITHER EXPRESS OR IMPLIED, INCLUDING WITHOUT LIMITATION ANY IMPLIED
+// WARRANTIES OR CONDITIONS OF TITLE, FITNESS FOR A PARTICULAR PURPOSE,
+// MERCHANTABLITY OR NON-INFRINGEMENT.
+// See the Apache 2 License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KALDI_UTIL_TOKEN_HASH_H_
+#define KALDI_UTIL_TOKEN_HASH_H_
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "base/kaldi-error.h"
+#include "base/kaldi-utils.h"
+
+/* TokenHash is a drop-in replacement of HashList (see hash-list.h) for the
+   token maps of the decoders, of the same interface and the same list
+   semantics: Clear() hands the list of the last frame to the user, while the
+   hash indexes the list of the next one.
+
+   HashList chains the elements of a bucket in the list, so a lookup walks
+   the list from the bucket of the key, one pointer per element. Here the
+   hash is open addressing with linear probing, and of structure of arrays:
+   a lookup compares the keys of the contiguous slots in keys_, and reads
+   elems_ only on a hit. The table is kept at most half full, it grows by
+   itself in the middle of a frame too, and the slots used are remembered,
+   so Clear() only resets them. The Elems are pooled in blocks as in
+   HashList.
+*/
+
+namespace kaldi {
+
+template <class I, class T>
+class TokenHash {
+ public:
+  struct Elem {
+    I key;
+    T val;
+    Elem *tail;
+  };
+
+  TokenHash();
+
+  /// Clears the hash and gives the head of the current list to the user,
+  /// who must call Delete() for each element of it, as in HashList.
+  Elem *Clear();
+
+  /// Gives the head of the current list to the user, ownership is retained.
+  const Elem *GetList() const { return list_head_; }
+
+  /// Returns an Elem got by Clear() to the pool.
+  inline void Delete(Elem *e) {
+    e->tail = freed_head_;
+    freed_head_ = e;
+  }
+
+  /// Takes an Elem from the pool.
+  inline Elem *New();
+
+  /// Returns the Elem of key in the current list, NULL if not present.
+  inline Elem *Find(I key);
+
+  /// Returns the Elem of key, it's appended to the current list with val if
+  /// it's not present.
+  inline Elem *Insert(I key, T val);
+
+  /// Prefetches the slot of key, for an Insert() or a Find() soon after.
+  inline void Prefetch(I key) const {
+    KALDI_PREFETCH(&keys_[Hash(key) & mask_]);
+  }
+
+  /// Makes at least sz slots, which should be twice the elements expected,
+  /// as the buckets of HashList. Unlike HashList, it can be called at any
+  /// time.
+  void SetSize(size_t sz);
+
+  /// Returns the current number of slots.
+  inline size_t Size() const { return keys_.size(); }
+
+  /// Returns the bytes of the slots and of the element blocks, the blocks
+  /// are never freed before the destructor.
+  size_t AllocatedBytes() const {
+    return keys_.capacity() * sizeof(I) + elems_.capacity() * sizeof(Elem *) +
+           used_.capacity() * sizeof(size_t) +
+           allocated_.size() * allocate_block_size_ * sizeof(Elem);
+  }
+
+  ~TokenHash();
+
+ private:
+  // Fibonacci hashing, the high bits of the product are the best mixed,
+  // and the states of a graph are dense ints
+  inline size_t Hash(I key) const {
+    return static_cast<size_t>(
+        (static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ULL) >> shift_);
+  }
+  // Rehash the elements of the current list into num_slots slots, a power
+  // of 2
+  void Rehash(size_t num_slots);
+
+  static I EmptyKey() { return std::numeric_limits<I>::max(); }
+
+  // The slots, keys_[i] == EmptyKey() if slot i is empty
+  std::vector<I> keys_;
+  std::vector<Elem *> elems_;
+  // The slots used, which are reset by Clear()
+  std::vector<size_t> used_;
+  size_t mask_;
+  int shift_;
+
+  Elem *list_head_;
+  Elem *list_tail_;
+
+  Elem *freed_head_;
+  std::vector<Elem *> allocated_;
+  static const size_t allocate_block_size_ = 1024;
+
+  KALDI_DISALLOW_COPY_AND_ASSIGN(TokenHash);
+};
+
+}  // end namespace kaldi
+
+#include "util/token-hash-inl.h"
+
+#endif  // KALDI_UTIL_TOKEN_HASH_H_
@@ -14,52 +14,130 @@
 
 #include "post_processor/post_processor.h"
 
-#include <vector>
-#include <sstream>
+#include <cctype>
 
+#include "utils/log.h"
 #include "utils/string.h"
 
 namespace wenet {
 
 std::string PostProcessor::ProcessSpace(const std::string& str) {
-  std::string result = str;
-  // 1. remove ' ' if needed
-  // only spaces between mandarin words need to be removed, please note that
-  // if str contains '_', we assume that the decoding type must be
-  // `CtcPrefixBeamSearch` and this branch will do nothing since str must be
-  // obtained via "".join() (in function `TorchAsrDecoder::UpdateResult()`)
-  if (opts_.language_type == kMandarinEnglish && !str.empty()) {
-    result.clear();
-    // split str by ' '
-    std::vector<std::string> words;
-    std::stringstream ss(str);
-    std::string tmp;
-    while (ss >> tmp) {
-      words.push_back(tmp);
-    }
-    // check english word
+  std::string result;
+  // Both steps are done in one pass, from str to result
+  result.reserve(str.size());
+  if (opts_.language_type == kMandarinEnglish) {
+    // 1. remove ' ' if needed
+    // only spaces between mandarin words need to be removed, please note that
+    // if str contains '_', we assume that the decoding type must be
+    // `CtcPrefixBeamSearch` and this branch will do nothing since str must be
+    // obtained via "".join() (in function `TorchAsrDecoder::UpdateResult()`)
+    const char* end = str.data() + str.size();
+    const char* word = str.data();
     bool is_englishword_prev = false;
-    bool is_englishword_now = false;
-    for (std::string& w : words) {
-      is_englishword_now = CheckEnglishWord(w);
+    while (true) {
+      while (word < end && isspace(static_cast<unsigned char>(*word))) ++word;
+      if (word == end) break;
+      const char* word_end = word;
+      while (word_end < end &&
+             !isspace(static_cast<unsigned char>(*word_end))) {
+        ++word_end;
+      }
+      // check english word
+      bool is_englishword_now = CheckEnglishWord(word, word_end);
       if (is_englishword_prev && is_englishword_now) {
-        result += (' ' + w);
-      } else {
-        result += (w);
+        result.push_back(' ');
       }
+      // 2. replace '_' with ' '
+      AppendBlankProcessed(word, word_end, opts_.lowercase, &result);
       is_englishword_prev = is_englishword_now;
+      word = word_end;
+    }
+  } else {
+    // 2. replace '_' with ' '
+    // this should be done for all cases (both kMandarinEnglish and
+    // kIndoEuropean)
+    size_t start = str.find_first_not_of(WHITESPACE);
+    if (start != std::string::npos) {
+      size_t end = str.find_last_not_of(WHITESPACE) + 1;
+      AppendBlankProcessed(str.data() + start, str.data() + end,
+                           opts_.lowercase, &result);
+    }
+  }
+  // Ignore tailing space
+  if (!result.empty() && result.back() == ' ') {
+    result.pop_back();
+  }
+  return result;
+}
+
+std::string PostProcessor::InverseTN(const std::string& str) {
+  if (resource_ == nullptr || resource_->itn_fst == nullptr || str.empty()) {
+    return str;
+  }
+  if (opts_.itn_cache_size <= 0) return ComposeInverseTN(str);
+  {
+    std::lock_guard<std::mutex> lock(itn_mutex_);
+    auto it = itn_cache_.find(str);
+    if (it != itn_cache_.end()) {
+      itn_lru_.splice(itn_lru_.begin(), itn_lru_, it->second);
+      return it->second->second;
+    }
+  }
+  // Composed out of the lock, a result composed by two sessions at once is
+  // cached once
+  std::string result = ComposeInverseTN(str);
+  std::lock_guard<std::mutex> lock(itn_mutex_);
+  if (itn_cache_.count(str) == 0) {
+    itn_lru_.emplace_front(str, result);
+    itn_cache_.emplace(str, itn_lru_.begin());
+    if (static_cast<int>(itn_lru_.size()) > opts_.itn_cache_size) {
+      itn_cache_.erase(itn_lru_.back().first);
+      itn_lru_.pop_back();
     }
   }
-  // 2. replace '_' with ' '
-  // this should be done for all cases (both kMandarinEnglish and kIndoEuropean)
-  result = ProcessBlank(result, opts_.lowercase);
+  return result;
+}
+
+std::string PostProcessor::ComposeInverseTN(const std::string& str) const {
+  // The linear acceptor of the bytes of str
+  fst::StdVectorFst input;
+  fst::StdVectorFst::StateId state = input.AddState();
+  input.SetStart(state);
+  for (char c : str) {
+    fst::StdVectorFst::StateId next = input.AddState();
+    int label = static_cast<unsigned char>(c);
+    input.AddArc(state, fst::StdArc(label, label, 0, next));
+    state = next;
+  }
+  input.SetFinal(state, fst::StdArc::Weight::One());
+
+  fst::StdVectorFst composed;
+  fst::Compose(input, *resource_->itn_fst, &composed);
+  fst::StdVectorFst best;
+  fst::ShortestPath(composed, &best);
+  if (best.Start() == fst::kNoStateId) {
+    VLOG(1) << "No inverse text normalization of " << str;
+    return str;
+  }
+  // The shortest path is a chain from the start
+  std::string result;
+  result.reserve(str.size());
+  for (state = best.Start(); best.NumArcs(state) > 0;) {
+    fst::ArcIterator<fst::StdVectorFst> aiter(best, state);
+    const fst::StdArc& arc = aiter.Value();
+    if (arc.olabel != 0) result.push_back(static_cast<char>(arc.olabel));
+    state = arc.nextstate;
+  }
   return result;
 }
 
 std::string PostProcessor::Process(const std::string& str, bool finish) {
   std::string result;
   result = ProcessSpace(str);
-  // TODO(xcsong): do itn/punctuation if finish == true
+  if (finish) {
+    result = InverseTN(result);
+  }
+  // TODO(xcsong): do punctuation if finish == true
   return result;
 }
 
@@ -15,9 +15,14 @@
 #ifndef POST_PROCESSOR_POST_PROCESSOR_H_
 #define POST_PROCESSOR_POST_PROCESSOR_H_
 
+#include <list>
 #include <memory>
+#include <mutex>
 #include <utility>
 #include <string>
+#include <unordered_map>
+
+#include "fst/fstlib.h"
 
 #include "utils/utils.h"
 
@@ -42,26 +47,54 @@ struct PostProcessOptions {
   LanguageType language_type = kMandarinEnglish;
   // whether lowercase letters are required
   bool lowercase = true;
+  // itn options
+  // max number of the recent inverse text normalized results which are
+  // cached, e.g. of the repeated command phrases, 0 means no cache
+  int itn_cache_size = 1000;
 };
 
-// TODO(xcsong): add itn/punctuation related resource
-struct PostProcessResource {};
+// TODO(xcsong): add punctuation related resource
+struct PostProcessResource {
+  // The inverse text normalization WFST of the final results, e.g. from
+  // "一百二十三" to "123". Its labels are the bytes of the UTF-8 text, 0 is
+  // epsilon, as the byte mode FSTs of pynini or WeTextProcessing. It should
+  // be sorted by the input labels, a const fst could be memory mapped.
+  std::shared_ptr<fst::Fst<fst::StdArc>> itn_fst = nullptr;
+};
 
 // Post Processor
 class PostProcessor {
  public:
-  explicit PostProcessor(PostProcessOptions&& opts) : opts_(std::move(opts)) {}
-  explicit PostProcessor(const PostProcessOptions& opts) : opts_(opts) {}
+  explicit PostProcessor(PostProcessOptions&& opts,
+                         std::shared_ptr<PostProcessResource> resource =
+                             nullptr)
+      : opts_(std::move(opts)), resource_(std::move(resource)) {}
+  explicit PostProcessor(const PostProcessOptions& opts,
+                         std::shared_ptr<PostProcessResource> resource =
+                             nullptr)
+      : opts_(opts), resource_(std::move(resource)) {}
   // call other functions to do post processing
   std::string Process(const std::string& str, bool finish);
   // process spaces according to configurations
   std::string ProcessSpace(const std::string& str);
-  // TODO(xcsong): add itn/punctuation
-  // void InverseTN(const std::string& str);
+  // The best output of str composed with the itn fst, str itself if there is
+  // no itn fst or it doesn't accept str. It's thread safe.
+  std::string InverseTN(const std::string& str);
+  // TODO(xcsong): add punctuation
   // void Punctuate(const std::string& str);
 
  private:
+  std::string ComposeInverseTN(const std::string& str) const;
+
   const PostProcessOptions opts_;
+  std::shared_ptr<PostProcessResource> resource_;
+  // LRU cache of the itn results, the post processor is shared by the
+  // sessions of a resource
+  std::mutex itn_mutex_;
+  std::list<std::pair<std::string, std::string>> itn_lru_;
+  std::unordered_map<std::string,
+                     std::list<std::pair<std::string, std::string>>::iterator>
+      itn_cache_;
 
  public:
   WENET_DISALLOW_COPY_AND_ASSIGN(PostProcessor);
@@ -0,0 +1,64 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/adaptive_beam_policy.h"
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+TEST(AdaptiveBeamPolicyTest, BeamScaleTest) {
+  AdaptiveBeamOptions opts;
+  opts.beam_scales = {1.0, 0.75, 0.5};
+  opts.high_rtf = 0.5;
+  opts.low_rtf = 0.2;
+  opts.rtf_momentum = 1.0;
+  opts.interval_ms = 0;
+  AdaptiveBeamPolicy policy(opts);
+  // Light load, the full beams
+  EXPECT_FLOAT_EQ(policy.BeamScale(0.1, 0.1), 1.0);
+  // One step per call under heavy load, and stays at the tightest
+  EXPECT_FLOAT_EQ(policy.BeamScale(1.0, 0.1), 0.75);
+  EXPECT_FLOAT_EQ(policy.BeamScale(1.0, 0.1), 0.5);
+  EXPECT_FLOAT_EQ(policy.BeamScale(1.0, 0.1), 0.5);
+  EXPECT_EQ(policy.level(), 2);
+  // Keeps the current level between low_rtf and high_rtf
+  EXPECT_FLOAT_EQ(policy.BeamScale(0.3, 0.1), 0.5);
+  EXPECT_FLOAT_EQ(policy.BeamScale(0.1, 0.1), 0.75);
+  // A slow session is one step tighter than the others
+  EXPECT_FLOAT_EQ(policy.BeamScale(0.3, 0.8), 0.5);
+  EXPECT_FLOAT_EQ(policy.BeamScale(0.1, 0.1), 1.0);
+  EXPECT_FLOAT_EQ(policy.BeamScale(0.1, 0.8), 0.75);
+}
+
+TEST(AdaptiveBeamPolicyTest, SmoothTest) {
+  AdaptiveBeamOptions opts;
+  opts.beam_scales = {1.0, 0.5};
+  opts.rtf_momentum = 0.5;
+  opts.interval_ms = 0;
+  AdaptiveBeamPolicy policy(opts);
+  // A single slow chunk is averaged out
+  EXPECT_FLOAT_EQ(policy.BeamScale(0.8, 0.1), 1.0);
+  EXPECT_FLOAT_EQ(policy.rtf(), 0.4);
+  EXPECT_FLOAT_EQ(policy.BeamScale(0.8, 0.1), 0.5);
+  // The level doesn't move within the interval
+  AdaptiveBeamOptions slow_opts = opts;
+  slow_opts.interval_ms = 60000;
+  slow_opts.rtf_momentum = 1.0;
+  AdaptiveBeamPolicy slow_policy(slow_opts);
+  EXPECT_FLOAT_EQ(slow_policy.BeamScale(1.0, 0.1), 1.0);
+  EXPECT_EQ(slow_policy.level(), 0);
+}
+
+}  // namespace wenet
@@ -0,0 +1,41 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/adaptive_chunk_policy.h"
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+TEST(AdaptiveChunkPolicyTest, ChunkSizeTest) {
+  AdaptiveChunkOptions opts;
+  opts.chunk_sizes = {8, 16, 32};
+  opts.high_load = 1.0;
+  opts.low_load = 0.5;
+  AdaptiveChunkPolicy policy(opts);
+  // Light load, the smallest chunk size
+  EXPECT_EQ(policy.ChunkSize(0.0), 8);
+  // One step per call under heavy load, and stays at the largest
+  EXPECT_EQ(policy.ChunkSize(2.0), 16);
+  EXPECT_EQ(policy.ChunkSize(2.0), 32);
+  EXPECT_EQ(policy.ChunkSize(2.0), 32);
+  // Keeps the current size between low_load and high_load
+  EXPECT_EQ(policy.ChunkSize(0.8), 32);
+  EXPECT_EQ(policy.ChunkSize(0.1), 16);
+  EXPECT_EQ(policy.ChunkSize(0.1), 8);
+  EXPECT_EQ(policy.ChunkSize(0.1), 8);
+}
+
+}  // namespace wenet
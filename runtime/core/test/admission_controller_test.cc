@@ -0,0 +1,70 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/admission_controller.h"
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+TEST(AdmissionControllerTest, BudgetTest) {
+  AdmissionOptions opts;
+  opts.max_load = 1.0;
+  opts.max_degraded_load = 1.5;
+  opts.initial_rtf = 0.25;
+  opts.initial_degraded_rtf = 0.125;
+  AdmissionController controller(opts);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(controller.Enter(), Admission::kFull);
+  }
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(controller.Enter(), Admission::kDegraded);
+  }
+  EXPECT_EQ(controller.Enter(), Admission::kRejected);
+  EXPECT_FLOAT_EQ(controller.load(), 1.5);
+
+  // A full stream leaves, there is room for one more
+  controller.Leave(Admission::kFull, 0, 0);
+  EXPECT_FLOAT_EQ(controller.load(), 1.25);
+  EXPECT_EQ(controller.Enter(), Admission::kDegraded);
+  EXPECT_EQ(controller.Enter(), Admission::kDegraded);
+  EXPECT_EQ(controller.Enter(), Admission::kRejected);
+}
+
+TEST(AdmissionControllerTest, NoDegradedProfileTest) {
+  AdmissionOptions opts;
+  opts.max_load = 0.5;
+  opts.initial_rtf = 0.25;
+  AdmissionController controller(opts);
+  EXPECT_EQ(controller.Enter(), Admission::kFull);
+  EXPECT_EQ(controller.Enter(), Admission::kFull);
+  EXPECT_EQ(controller.Enter(), Admission::kRejected);
+}
+
+TEST(AdmissionControllerTest, MeasuredRtfTest) {
+  AdmissionOptions opts;
+  opts.max_load = 1.0;
+  opts.initial_rtf = 0.25;
+  opts.rtf_momentum = 0.5;
+  AdmissionController controller(opts);
+  EXPECT_EQ(controller.Enter(), Admission::kFull);
+  // The streams are cheaper than expected, RTF 0.125 on average
+  controller.Leave(Admission::kFull, 1000, 0);
+  for (int i = 0; i < 8; ++i) {
+    EXPECT_EQ(controller.Enter(), Admission::kFull);
+  }
+  EXPECT_EQ(controller.Enter(), Admission::kRejected);
+}
+
+}  // namespace wenet
@@ -0,0 +1,121 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/asr_decoder_pool.h"
+
+#include <memory>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+// Fake model which counts the copies of all its instances
+class FakeAsrModel : public AsrModel {
+ public:
+  explicit FakeAsrModel(int* num_copies) : num_copies_(num_copies) {}
+  void Reset() override {}
+  void AttentionRescoring(const std::vector<std::vector<int>>& hyps,
+                          float reverse_weight,
+                          std::vector<float>* rescoring_score) override {}
+  std::shared_ptr<AsrModel> Copy() const override {
+    ++(*num_copies_);
+    return std::make_shared<FakeAsrModel>(num_copies_);
+  }
+
+ protected:
+  void ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                          LogProbMatrix* ctc_prob) override {}
+
+ private:
+  int* num_copies_;
+};
+
+class AsrDecoderPoolTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    feature_config_ = std::make_shared<FeaturePipelineConfig>(80, 16000);
+    decode_config_ = std::make_shared<DecodeOptions>();
+    resource_ = std::make_shared<DecodeResource>();
+    resource_->model = std::make_shared<FakeAsrModel>(&num_copies_);
+  }
+
+  int num_copies_ = 0;
+  std::shared_ptr<FeaturePipelineConfig> feature_config_;
+  std::shared_ptr<DecodeOptions> decode_config_;
+  std::shared_ptr<DecodeResource> resource_;
+};
+
+TEST_F(AsrDecoderPoolTest, ReuseTest) {
+  AsrDecoderPoolOptions opts;
+  opts.initial_size = 2;
+  opts.max_idle = 3;
+  auto pool = std::make_shared<AsrDecoderPool>(feature_config_,
+                                               decode_config_, resource_,
+                                               opts);
+  EXPECT_EQ(num_copies_, 2);
+  EXPECT_EQ(pool->num_idle(), 2);
+
+  // The pair is given back when both of them are released
+  std::vector<int16_t> wav(16000, 0);
+  AsrDecoder* first = nullptr;
+  int num_frames = 0;
+  {
+    PooledDecoder pooled = pool->Acquire();
+    first = pooled.decoder.get();
+    EXPECT_EQ(pool->num_idle(), 1);
+    pooled.decoder = nullptr;
+    EXPECT_EQ(pool->num_idle(), 1);
+    pooled.feature_pipeline->AcceptWaveform(wav.data(), wav.size());
+    num_frames = pooled.feature_pipeline->num_frames();
+    pooled.feature_pipeline->set_input_sample_rate(8000);
+    pooled.feature_pipeline->AcceptWaveform(wav.data(), wav.size());
+  }
+  EXPECT_EQ(pool->num_idle(), 2);
+
+  // Reused, reset and at the sample rate of the config
+  PooledDecoder pooled = pool->Acquire();
+  EXPECT_EQ(pooled.decoder.get(), first);
+  EXPECT_EQ(pooled.feature_pipeline->num_frames(), 0);
+  pooled.feature_pipeline->AcceptWaveform(wav.data(), wav.size());
+  EXPECT_EQ(pooled.feature_pipeline->num_frames(), num_frames);
+  EXPECT_EQ(num_copies_, 2);
+  pooled = PooledDecoder();
+
+  // A new one when the pool is empty, and no more than max_idle are kept
+  std::vector<PooledDecoder> decoders;
+  for (int i = 0; i < 5; ++i) {
+    decoders.push_back(pool->Acquire());
+  }
+  EXPECT_EQ(num_copies_, 5);
+  EXPECT_EQ(pool->num_idle(), 0);
+  decoders.clear();
+  EXPECT_EQ(pool->num_idle(), opts.max_idle);
+}
+
+TEST_F(AsrDecoderPoolTest, PoolGoneTest) {
+  AsrDecoderPoolOptions opts;
+  opts.initial_size = 1;
+  auto pool = std::make_shared<AsrDecoderPool>(feature_config_,
+                                               decode_config_, resource_,
+                                               opts);
+  PooledDecoder pooled = pool->Acquire();
+  // The decoder outlives the pool, it's freed without going back
+  pool = nullptr;
+  pooled.feature_pipeline->AcceptWaveform(std::vector<float>(1600, 0));
+  pooled = PooledDecoder();
+}
+
+}  // namespace wenet
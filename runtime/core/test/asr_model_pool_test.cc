@@ -0,0 +1,130 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/asr_model_pool.h"
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+// Fake model which counts the copies and resets of all its instances
+class FakeAsrModel : public AsrModel {
+ public:
+  FakeAsrModel(int* num_copies, int* num_resets)
+      : num_copies_(num_copies), num_resets_(num_resets) {}
+  void Reset() override { ++(*num_resets_); }
+  void AttentionRescoring(const std::vector<std::vector<int>>& hyps,
+                          float reverse_weight,
+                          std::vector<float>* rescoring_score) override {}
+  std::shared_ptr<AsrModel> Copy() const override {
+    ++(*num_copies_);
+    auto model = std::make_shared<FakeAsrModel>(num_copies_, num_resets_);
+    model->chunk_size_ = chunk_size_;
+    return model;
+  }
+
+ protected:
+  void ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                          LogProbMatrix* ctc_prob) override {}
+
+ private:
+  int* num_copies_;
+  int* num_resets_;
+};
+
+TEST(AsrModelPoolTest, ReuseTest) {
+  int num_copies = 0, num_resets = 0;
+  auto prototype = std::make_shared<FakeAsrModel>(&num_copies, &num_resets);
+  AsrModelPoolOptions opts;
+  opts.initial_size = 2;
+  opts.max_idle = 3;
+  auto pool = std::make_shared<AsrModelPool>(prototype, opts);
+  EXPECT_EQ(num_copies, 2);
+  EXPECT_EQ(pool->num_idle(), 2);
+
+  // Reuse the idle one, with the settings of the prototype
+  AsrModel* first = nullptr;
+  {
+    std::shared_ptr<AsrModel> model = pool->Acquire();
+    first = model.get();
+    model->set_chunk_size(32);
+    EXPECT_EQ(pool->num_idle(), 1);
+  }
+  EXPECT_EQ(pool->num_idle(), 2);
+  EXPECT_EQ(num_resets, 1);
+  std::shared_ptr<AsrModel> model = pool->Acquire();
+  EXPECT_EQ(model.get(), first);
+  EXPECT_EQ(model->chunk_size(), prototype->chunk_size());
+  EXPECT_EQ(num_copies, 2);
+  model = nullptr;
+
+  // A new copy when the pool is empty, and no more than max_idle are kept
+  std::vector<std::shared_ptr<AsrModel>> models;
+  for (int i = 0; i < 5; ++i) {
+    models.push_back(pool->Acquire());
+  }
+  EXPECT_EQ(num_copies, 5);
+  EXPECT_EQ(pool->num_idle(), 0);
+  models.clear();
+  EXPECT_EQ(pool->num_idle(), opts.max_idle);
+}
+
+TEST(AsrModelPoolTest, PoolGoneTest) {
+  int num_copies = 0, num_resets = 0;
+  auto prototype = std::make_shared<FakeAsrModel>(&num_copies, &num_resets);
+  auto pool = std::make_shared<AsrModelPool>(prototype, AsrModelPoolOptions());
+  std::shared_ptr<AsrModel> model = pool->Acquire();
+  // The model outlives the pool, it's freed without going back
+  pool = nullptr;
+  model = nullptr;
+  EXPECT_EQ(num_resets, 0);
+}
+
+TEST(AsrModelPoolTest, BucketSizeTest) {
+  std::vector<int> buckets = {8, 16, 32};
+  EXPECT_EQ(AsrModel::BucketSize(1, buckets), 8);
+  EXPECT_EQ(AsrModel::BucketSize(8, buckets), 8);
+  EXPECT_EQ(AsrModel::BucketSize(9, buckets), 16);
+  EXPECT_EQ(AsrModel::BucketSize(32, buckets), 32);
+  // Over the largest one, rounded up to a multiple of it
+  EXPECT_EQ(AsrModel::BucketSize(33, buckets), 64);
+  EXPECT_EQ(AsrModel::BucketSize(100, buckets), 128);
+  EXPECT_EQ(AsrModel::BucketSize(7, {}), 7);
+}
+
+TEST(AsrModelPoolTest, SelectRescoringFramesTest) {
+  // The blank and another token of 4 frames
+  std::vector<float> log_probs = {std::log(0.999f), std::log(0.001f),
+                                  std::log(0.5f),   std::log(0.5f),
+                                  std::log(0.995f), std::log(0.005f),
+                                  std::log(0.1f),   std::log(0.9f)};
+  std::vector<int> frames;
+  AsrModel::SelectRescoringFrames(log_probs.data(), 4, 2, 0.99f, &frames);
+  EXPECT_EQ(frames, std::vector<int>({1, 3}));
+  AsrModel::SelectRescoringFrames(log_probs.data(), 4, 2, 1.0f, &frames);
+  EXPECT_EQ(frames, std::vector<int>({0, 1, 2, 3}));
+  // The least blank one of the frames all over the threshold
+  AsrModel::SelectRescoringFrames(log_probs.data() + 4, 1, 2, 0.99f,
+                                  &frames);
+  EXPECT_EQ(frames, std::vector<int>({0}));
+  AsrModel::SelectRescoringFrames(log_probs.data(), 3, 2, 0.4f, &frames);
+  EXPECT_EQ(frames, std::vector<int>({1}));
+}
+
+}  // namespace wenet
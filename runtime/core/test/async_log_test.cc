@@ -0,0 +1,145 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/async_log.h"
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+// Collect the messages written, as a log file would
+class CollectLogger : public google::base::Logger {
+ public:
+  void Write(bool force_flush, time_t timestamp, const char* message,
+             int message_len) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    messages_.emplace_back(message, message_len);
+    if (force_flush) num_forced_++;
+  }
+  void Flush() override {}
+  google::uint32 LogSize() override { return 0; }
+
+  std::vector<std::string> messages() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return messages_;
+  }
+  int num_forced() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return num_forced_;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::vector<std::string> messages_;
+  int num_forced_ = 0;
+};
+
+TEST(AsyncLogTest, RateLimiterTest) {
+  LogRateLimiter limiter(20);
+  EXPECT_EQ(limiter.Acquire(), 0);
+  EXPECT_EQ(limiter.Acquire(), -1);
+  EXPECT_EQ(limiter.Acquire(), -1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(30));
+  EXPECT_EQ(limiter.Acquire(), 2);
+  EXPECT_EQ(SuppressedLogs(0), "");
+  EXPECT_EQ(SuppressedLogs(2), "[2 suppressed] ");
+
+  int num_logged = 0;
+  for (int i = 0; i < 100; ++i) {
+    LOG_EVERY_MS(INFO, 60000) << (num_logged++, "message");
+  }
+  EXPECT_EQ(num_logged, 1);
+}
+
+TEST(AsyncLogTest, QueueTest) {
+  CollectLogger sink;
+  const int num_threads = 4;
+  const int num_messages = 1000;
+  {
+    // Never flushed in the background, it's drained at the end
+    AsyncLogQueue queue(1 << 20, 60000);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t) {
+      threads.emplace_back([&, t]() {
+        for (int i = 0; i < num_messages; ++i) {
+          std::string message =
+              std::to_string(t) + " " + std::to_string(i) + "\n";
+          EXPECT_TRUE(
+              queue.Push(&sink, 0, message.data(), message.size()));
+        }
+      });
+    }
+    for (auto& thread : threads) thread.join();
+    EXPECT_TRUE(sink.messages().empty());
+  }
+  std::vector<std::string> messages = sink.messages();
+  ASSERT_EQ(messages.size(), num_threads * num_messages);
+  // In order of each thread
+  std::vector<int> next(num_threads, 0);
+  for (const auto& message : messages) {
+    int t = message[0] - '0';
+    EXPECT_EQ(message, std::to_string(t) + " " + std::to_string(next[t]++) +
+                           "\n");
+  }
+}
+
+TEST(AsyncLogTest, DropTest) {
+  CollectLogger sink;
+  AsyncLogQueue queue(4096, 60000);
+  std::string message(1000, 'a');
+  int num_pushed = 0;
+  for (int i = 0; i < 10; ++i) {
+    num_pushed += queue.Push(&sink, 0, message.data(), message.size());
+  }
+  EXPECT_GT(num_pushed, 0);
+  EXPECT_LT(num_pushed, 10);
+  EXPECT_EQ(queue.dropped(), 10 - num_pushed);
+  // The space is reused after the drain, across the end of the ring
+  queue.Drain();
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(queue.Push(&sink, 0, message.data(), message.size()));
+    queue.Drain();
+  }
+  EXPECT_EQ(sink.messages().size(), num_pushed + 3);
+  EXPECT_EQ(sink.messages().back(), message);
+}
+
+TEST(AsyncLogTest, LoggerTest) {
+  CollectLogger sink;
+  AsyncLogQueue queue(1 << 16, 1);
+  AsyncLogger logger(&queue, &sink);
+  logger.Write(false, 0, "info", 4);
+  // The queued ones are written before the flushed one
+  logger.Write(true, 0, "warning", 7);
+  std::vector<std::string> messages = sink.messages();
+  ASSERT_EQ(messages.size(), 2);
+  EXPECT_EQ(messages[0], "info");
+  EXPECT_EQ(messages[1], "warning");
+  EXPECT_EQ(sink.num_forced(), 1);
+  // By the background thread
+  logger.Write(false, 0, "later", 5);
+  for (int i = 0; i < 1000 && sink.messages().size() < 3; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ASSERT_EQ(sink.messages().size(), 3);
+  EXPECT_EQ(sink.messages()[2], "later");
+}
+
+}  // namespace wenet
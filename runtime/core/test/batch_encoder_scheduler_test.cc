@@ -0,0 +1,121 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/batch_encoder_scheduler.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+// Fake model which outputs the sum of each input frame
+class FakeAsrModel : public AsrModel {
+ public:
+  explicit FakeAsrModel(std::atomic<int>* max_batch)
+      : max_batch_(max_batch) {}
+  void Reset() override {}
+  void AttentionRescoring(const std::vector<std::vector<int>>& hyps,
+                          float reverse_weight,
+                          std::vector<float>* rescoring_score) override {}
+  std::shared_ptr<AsrModel> Copy() const override { return nullptr; }
+  void ForwardEncoderBatch(
+      const std::vector<EncoderBatchItem>& items) override {
+    int size = items.size();
+    int prev = max_batch_->load();
+    while (size > prev && !max_batch_->compare_exchange_weak(prev, size)) {
+    }
+    AsrModel::ForwardEncoderBatch(items);
+  }
+
+ protected:
+  void ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                          LogProbMatrix* ctc_prob) override {
+    ctc_prob->Resize(chunk_feats.rows(), 1);
+    for (int i = 0; i < chunk_feats.rows(); ++i) {
+      float sum = 0;
+      for (int j = 0; j < chunk_feats.cols(); ++j) sum += chunk_feats(i, j);
+      (*ctc_prob)(i, 0) = sum;
+    }
+  }
+
+ private:
+  std::atomic<int>* max_batch_;
+};
+
+TEST(BatchEncoderSchedulerTest, ForwardEncoderTest) {
+  const int num_sessions = 8;
+  BatchEncoderOptions opts;
+  opts.max_batch_size = 4;
+  opts.max_wait_us = 100000;
+  BatchEncoderScheduler scheduler(opts);
+  std::atomic<int> max_batch(0);
+
+  std::vector<LogProbMatrix> outputs(num_sessions);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_sessions; ++i) {
+    threads.emplace_back([&, i]() {
+      FakeAsrModel model(&max_batch);
+      FeatureMatrix feats(std::vector<std::vector<float>>(
+          4, std::vector<float>(2, i)));
+      scheduler.ForwardEncoder(&model, feats, &outputs[i]);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  for (int i = 0; i < num_sessions; ++i) {
+    ASSERT_EQ(outputs[i].rows(), 4);
+    for (int j = 0; j < outputs[i].rows(); ++j) {
+      EXPECT_FLOAT_EQ(outputs[i](j, 0), 2.0f * i);
+    }
+  }
+  EXPECT_GT(max_batch.load(), 1);
+  EXPECT_LE(max_batch.load(), opts.max_batch_size);
+}
+
+TEST(BatchEncoderSchedulerTest, StatsTest) {
+  BatchEncoderOptions opts;
+  opts.max_batch_size = 2;
+  opts.max_wait_us = 1000000;
+  BatchEncoderScheduler scheduler(opts);
+  std::atomic<int> max_batch(0);
+
+  // Inputs of 2 and 6 frames, padded to 6 frames in one batch
+  std::vector<LogProbMatrix> outputs(2);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 2; ++i) {
+    threads.emplace_back([&, i]() {
+      FakeAsrModel model(&max_batch);
+      FeatureMatrix feats(std::vector<std::vector<float>>(
+          2 + 4 * i, std::vector<float>(2, 1)));
+      scheduler.ForwardEncoder(&model, feats, &outputs[i]);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  BatchEncoderStats stats = scheduler.stats();
+  EXPECT_EQ(stats.num_batches, 1);
+  EXPECT_EQ(stats.num_items, 2);
+  EXPECT_EQ(stats.valid_frames, 8);
+  EXPECT_EQ(stats.padded_frames, 12);
+}
+
+}  // namespace wenet
@@ -0,0 +1,77 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "frontend/batch_fbank_scheduler.h"
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "frontend/feature_pipeline.h"
+
+namespace wenet {
+
+TEST(BatchFbankSchedulerTest, ParityTest) {
+  FeaturePipelineConfig config(80, 16000);
+  BatchFbankOptions opts;
+  opts.max_batch_frames = 16;
+  config.fbank_scheduler = std::make_shared<BatchFbankScheduler>(
+      opts, config.num_bins, config.sample_rate, config.frame_length,
+      config.frame_shift);
+
+  const int num_streams = 4;
+  std::vector<std::vector<int16_t>> waves(num_streams);
+  std::default_random_engine g(0);
+  std::uniform_int_distribution<int> sample(-1000, 1000);
+  for (auto& wave : waves) {
+    wave.resize(16000);
+    for (auto& x : wave) x = sample(g);
+  }
+
+  // Each stream sends packets of 10 ms, 1 or 2 frames each
+  std::vector<std::vector<std::vector<float>>> feats(num_streams);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_streams; ++i) {
+    threads.emplace_back([&config, &waves, &feats, i]() {
+      FeaturePipeline pipeline(config);
+      const std::vector<int16_t>& wave = waves[i];
+      for (size_t start = 0; start < wave.size(); start += 160) {
+        pipeline.AcceptWaveform(wave.data() + start,
+                                std::min<size_t>(160, wave.size() - start));
+      }
+      pipeline.set_input_finished();
+      pipeline.Read(pipeline.num_frames(), &feats[i]);
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  for (int i = 0; i < num_streams; ++i) {
+    Fbank fbank(80, 16000, config.frame_length, config.frame_shift);
+    std::vector<std::vector<float>> expected;
+    fbank.Compute(std::vector<float>(waves[i].begin(), waves[i].end()),
+                  &expected);
+    ASSERT_EQ(feats[i].size(), expected.size());
+    for (size_t j = 0; j < expected.size(); ++j) {
+      EXPECT_EQ(feats[i][j], expected[j]) << i << " " << j;
+    }
+  }
+}
+
+}  // namespace wenet
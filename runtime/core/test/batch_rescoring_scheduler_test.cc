@@ -0,0 +1,83 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/batch_rescoring_scheduler.h"
+
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+// Fake model which scores each hyp by its length
+class FakeRescoringModel : public AsrModel {
+ public:
+  void Reset() override {}
+  void AttentionRescoring(const std::vector<std::vector<int>>& hyps,
+                          float reverse_weight,
+                          std::vector<float>* rescoring_score) override {
+    rescoring_score->clear();
+    for (const auto& hyp : hyps) {
+      rescoring_score->push_back(hyp.size() * (1 - reverse_weight));
+    }
+  }
+  std::shared_ptr<AsrModel> Copy() const override { return nullptr; }
+  void AttentionRescoringBatch(
+      const std::vector<RescoringBatchItem>& items) override {
+    max_batch_ = std::max(max_batch_, static_cast<int>(items.size()));
+    AsrModel::AttentionRescoringBatch(items);
+  }
+  int max_batch() const { return max_batch_; }
+
+ protected:
+  void ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                          LogProbMatrix* ctc_prob) override {}
+
+ private:
+  int max_batch_ = 0;
+};
+
+TEST(BatchRescoringSchedulerTest, AttentionRescoringTest) {
+  const int num_sessions = 6;
+  BatchRescoringOptions opts;
+  opts.num_workers = 1;
+  opts.max_batch_size = num_sessions;
+  opts.max_wait_us = 100000;
+  BatchRescoringScheduler scheduler(opts);
+
+  FakeRescoringModel model;
+  std::vector<std::vector<std::vector<int>>> hyps(num_sessions);
+  std::vector<std::vector<float>> scores(num_sessions);
+  std::vector<std::future<void>> futures;
+  for (int i = 0; i < num_sessions; ++i) {
+    hyps[i] = {std::vector<int>(i, 1), std::vector<int>(i + 1, 2)};
+    futures.push_back(
+        scheduler.AttentionRescoring(&model, hyps[i], 0.5, &scores[i]));
+  }
+  for (auto& future : futures) {
+    future.get();
+  }
+
+  for (int i = 0; i < num_sessions; ++i) {
+    ASSERT_EQ(scores[i].size(), 2);
+    EXPECT_FLOAT_EQ(scores[i][0], 0.5 * i);
+    EXPECT_FLOAT_EQ(scores[i][1], 0.5 * (i + 1));
+  }
+  EXPECT_EQ(model.max_batch(), num_sessions);
+}
+
+}  // namespace wenet
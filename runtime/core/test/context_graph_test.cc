@@ -0,0 +1,169 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/context_graph_cache.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+static std::shared_ptr<wenet::SymbolStrings> MakeSymbolTable() {
+  fst::SymbolTable symbol_table;
+  std::vector<std::string> words = {"<blank>", "a", "b", "c", "d", "e"};
+  for (int i = 0; i < words.size(); ++i) {
+    symbol_table.AddSymbol(words[i], i);
+  }
+  return std::make_shared<wenet::SymbolStrings>(
+      symbol_table, std::vector<std::string>{wenet::kContextStartTag,
+                                             wenet::kContextEndTag});
+}
+
+TEST(ContextGraphTest, GetNextStateTest) {
+  wenet::ContextConfig config;
+  config.context_score = 3.0;
+  wenet::ContextGraph graph(config);
+  graph.BuildContextGraph({"abc", "de"}, MakeSymbolTable());
+  // The tags are reserved after the words
+  EXPECT_EQ(graph.start_tag_id(), 6);
+  EXPECT_EQ(graph.end_tag_id(), 7);
+
+  float score = 0;
+  bool is_start = false;
+  bool is_end = false;
+  // a b c is matched from the start state back to it
+  int state = graph.GetNextState(0, 1, &score, &is_start, &is_end);
+  EXPECT_NE(state, 0);
+  EXPECT_FLOAT_EQ(score, 3.0);
+  EXPECT_TRUE(is_start);
+  EXPECT_FALSE(is_end);
+  is_start = false;
+  int state_b = graph.GetNextState(state, 2, &score, &is_start, &is_end);
+  EXPECT_FLOAT_EQ(score, 3.0);
+  EXPECT_FALSE(is_start);
+  EXPECT_FALSE(is_end);
+  EXPECT_EQ(graph.GetNextState(state_b, 3, &score, &is_start, &is_end), 0);
+  EXPECT_FLOAT_EQ(score, 3.0);
+  EXPECT_TRUE(is_end);
+
+  // a b d escapes and cleans the matched score
+  is_end = false;
+  EXPECT_EQ(graph.GetNextState(state_b, 4, &score, &is_start, &is_end), 0);
+  EXPECT_FLOAT_EQ(score, -6.0);
+  EXPECT_FALSE(is_end);
+
+  // No arc of e at the start state
+  score = 0;
+  EXPECT_EQ(graph.GetNextState(0, 5, &score, &is_start, &is_end), 0);
+  EXPECT_FLOAT_EQ(score, 0);
+  EXPECT_FALSE(is_start);
+}
+
+TEST(ContextGraphTest, CacheTest) {
+  wenet::ContextConfig config;
+  wenet::ContextGraphCache cache(config, MakeSymbolTable(), 2);
+  auto abc = cache.Get({"abc"}).get();
+  auto de = cache.Get({"de"}).get();
+  ASSERT_NE(abc, nullptr);
+  ASSERT_NE(de, nullptr);
+  EXPECT_NE(abc, de);
+  // Hit, and abc becomes the most recently used
+  EXPECT_EQ(cache.Get({"abc"}).get(), abc);
+  EXPECT_EQ(cache.size(), 2);
+  // de is evicted
+  auto ab = cache.Get({"ab"}).get();
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_EQ(cache.Get({"abc"}).get(), abc);
+  EXPECT_EQ(cache.Get({"ab"}).get(), ab);
+  EXPECT_NE(cache.Get({"de"}).get(), de);
+  // The phrase lists are not mixed up by the concatenation
+  EXPECT_NE(cache.Get({"a", "bc"}).get(), abc);
+}
+
+static std::unique_ptr<wenet::ContextGraph> MakeAhoCorasickGraph(
+    const std::vector<std::string>& contexts) {
+  wenet::ContextConfig config;
+  config.context_score = 3.0;
+  config.use_aho_corasick = true;
+  std::unique_ptr<wenet::ContextGraph> graph(new wenet::ContextGraph(config));
+  graph->BuildContextGraph(contexts, MakeSymbolTable());
+  return graph;
+}
+
+// Feed the word ids from the start state, return the total score and the
+// final state
+static float Match(wenet::ContextGraph* graph,
+                   const std::vector<int>& word_ids, int* state,
+                   int* num_ends) {
+  float total = 0;
+  *state = 0;
+  *num_ends = 0;
+  for (int word_id : word_ids) {
+    float score = 0;
+    bool is_start = false;
+    bool is_end = false;
+    *state = graph->GetNextState(*state, word_id, &score, &is_start, &is_end);
+    total += score;
+    if (is_end) ++(*num_ends);
+  }
+  return total;
+}
+
+TEST(ContextGraphTest, AhoCorasickTest) {
+  auto graph = MakeAhoCorasickGraph({"abc", "bd", "de", "d"});
+  int state = 0;
+  int num_ends = 0;
+  // a b d matches bd through the failure link of ab
+  EXPECT_FLOAT_EQ(Match(graph.get(), {1, 2, 4}, &state, &num_ends), 6.0);
+  EXPECT_EQ(num_ends, 1);
+  EXPECT_EQ(state, 0);
+  // a b e escapes and cleans the matched score
+  EXPECT_FLOAT_EQ(Match(graph.get(), {1, 2, 5}, &state, &num_ends), 0);
+  EXPECT_EQ(num_ends, 0);
+  EXPECT_EQ(state, 0);
+  // d is a match, and it goes on to the longer de
+  EXPECT_FLOAT_EQ(Match(graph.get(), {4}, &state, &num_ends), 3.0);
+  EXPECT_EQ(num_ends, 1);
+  EXPECT_NE(state, 0);
+  EXPECT_FLOAT_EQ(Match(graph.get(), {4, 5}, &state, &num_ends), 6.0);
+  EXPECT_EQ(num_ends, 2);
+  EXPECT_EQ(state, 0);
+  // d c keeps the score of d
+  EXPECT_FLOAT_EQ(Match(graph.get(), {4, 3}, &state, &num_ends), 3.0);
+  EXPECT_EQ(state, 0);
+}
+
+TEST(ContextGraphTest, AhoCorasickReadWriteTest) {
+  auto graph = MakeAhoCorasickGraph({"abc", "bd", "cde"});
+  std::string path = ::testing::TempDir() + "/context_graph_test.ac";
+  ASSERT_TRUE(graph->WriteAhoCorasick(path));
+  wenet::ContextGraph loaded((wenet::ContextConfig()));
+  ASSERT_TRUE(loaded.ReadAhoCorasick(path, MakeSymbolTable()));
+  std::vector<std::vector<int>> inputs = {
+      {1, 2, 3}, {1, 2, 4}, {3, 4, 5}, {2, 3, 4, 5}, {5, 1, 3}};
+  for (const auto& input : inputs) {
+    int state = 0;
+    int num_ends = 0;
+    int loaded_state = 0;
+    int loaded_num_ends = 0;
+    EXPECT_FLOAT_EQ(Match(graph.get(), input, &state, &num_ends),
+                    Match(&loaded, input, &loaded_state, &loaded_num_ends));
+    EXPECT_EQ(state, loaded_state);
+    EXPECT_EQ(num_ends, loaded_num_ends);
+  }
+  EXPECT_FALSE(loaded.ReadAhoCorasick(path + ".missing", MakeSymbolTable()));
+}
@@ -0,0 +1,143 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/ctc_cache.h"
+
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+static LogProbMatrix MakeChunk(int rows, int cols, float base) {
+  LogProbMatrix chunk(rows, cols);
+  for (int r = 0; r < rows; ++r) {
+    for (int c = 0; c < cols; ++c) {
+      chunk(r, c) = -(base + (r * 7 + c * 3) % cols);
+    }
+  }
+  return chunk;
+}
+
+static CtcCacheEntry MakeEntry() {
+  CtcCacheEntry entry;
+  entry.chunk_size = 4;
+  entry.num_feature_frames = 40;
+  entry.chunks = {MakeChunk(4, 10, 0), MakeChunk(4, 10, 1),
+                  MakeChunk(2, 10, 2)};
+  entry.encoder_out = LogProbMatrix(10, 6);
+  entry.encoder_out.SetZero();
+  return entry;
+}
+
+// Rescores by the length of the encoder outputs it attends to
+class FakeAsrModel : public AsrModel {
+ public:
+  FakeAsrModel() {
+    right_context_ = 6;
+    subsampling_rate_ = 4;
+  }
+  void Reset() override { encoder_frames_ = 0; }
+  void AttentionRescoring(const std::vector<std::vector<int>>& hyps,
+                          float reverse_weight,
+                          std::vector<float>* rescoring_score) override {
+    rescoring_score->assign(hyps.size(), encoder_frames_);
+  }
+  std::shared_ptr<AsrModel> Copy() const override {
+    return std::make_shared<FakeAsrModel>();
+  }
+  bool SetEncoderOut(const FeatureMatrix& encoder_out) override {
+    encoder_frames_ = encoder_out.rows();
+    return true;
+  }
+
+ protected:
+  void ForwardEncoderFunc(const FeatureMatrix& chunk_feats,
+                          LogProbMatrix* ctc_prob) override {
+    FAIL() << "The encoder is not expected to run";
+  }
+
+ private:
+  int encoder_frames_ = 0;
+};
+
+TEST(CtcCacheTest, DenseAndTopkTest) {
+  std::string ark = ::testing::TempDir() + "/ctc_cache_test.ark";
+  CtcCacheEntry entry = MakeEntry();
+  for (int topk : {0, 3}) {
+    CtcCacheWriter writer;
+    ASSERT_TRUE(writer.Open("ark:" + ark, topk));
+    writer.Write("utt0", entry);
+    writer.Write("utt1", entry);
+    writer.Close();
+
+    CtcCacheReader reader;
+    ASSERT_TRUE(reader.Open("ark:" + ark));
+    for (const char* key : {"utt0", "utt1"}) {
+      ASSERT_FALSE(reader.Done());
+      EXPECT_EQ(reader.Key(), key);
+      auto value = reader.Value();
+      EXPECT_EQ(value->chunk_size, 4);
+      EXPECT_EQ(value->num_feature_frames, 40);
+      EXPECT_EQ(value->encoder_out.rows(), 10);
+      ASSERT_EQ(value->chunks.size(), entry.chunks.size());
+      for (size_t i = 0; i < entry.chunks.size(); ++i) {
+        const LogProbMatrix& a = entry.chunks[i];
+        const LogProbMatrix& b = value->chunks[i];
+        ASSERT_EQ(a.rows(), b.rows());
+        ASSERT_EQ(a.cols(), b.cols());
+        for (int r = 0; r < a.rows(); ++r) {
+          int kept = 0;
+          for (int c = 0; c < a.cols(); ++c) {
+            if (b(r, c) == -std::numeric_limits<float>::infinity()) continue;
+            EXPECT_FLOAT_EQ(a(r, c), b(r, c));
+            ++kept;
+          }
+          EXPECT_EQ(kept, topk > 0 ? topk : a.cols());
+        }
+      }
+      reader.Next();
+    }
+    EXPECT_TRUE(reader.Done());
+  }
+}
+
+TEST(CtcCacheTest, ReplayTest) {
+  auto entry = std::make_shared<CtcCacheEntry>(MakeEntry());
+  ReplayAsrModel prototype(std::make_shared<FakeAsrModel>(), entry);
+  EXPECT_EQ(prototype.right_context(), 6);
+  EXPECT_EQ(prototype.subsampling_rate(), 4);
+  auto model = prototype.Copy();
+  FeatureMatrix feats(16, 80);
+  feats.SetZero();
+  LogProbMatrix ctc_prob;
+  for (const auto& chunk : entry->chunks) {
+    model->ForwardEncoder(feats, &ctc_prob);
+    ASSERT_EQ(ctc_prob.rows(), chunk.rows());
+    EXPECT_FLOAT_EQ(ctc_prob(0, 1), chunk(0, 1));
+  }
+  model->ForwardEncoder(feats, &ctc_prob);
+  EXPECT_TRUE(ctc_prob.empty());
+  EXPECT_EQ(model->offset(), 10);
+
+  std::vector<float> scores;
+  model->AttentionRescoring({{1, 2}, {3}}, 0.0, &scores);
+  EXPECT_EQ(scores, std::vector<float>({10, 10}));
+}
+
+}  // namespace wenet
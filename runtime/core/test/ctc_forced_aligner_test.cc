@@ -0,0 +1,132 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/ctc_forced_aligner.h"
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+// The log posteriors of the frames, each one is the token of it with the
+// prob and the blank with the rest
+static LogProbMatrix MakeFrames(
+    const std::vector<std::pair<int, float>>& frames) {
+  std::vector<std::vector<float>> logp;
+  for (const auto& frame : frames) {
+    std::vector<float> row(5, std::log(1e-4));
+    row[0] = std::log(1.0 - frame.second);
+    if (frame.first != 0) row[frame.first] = std::log(frame.second);
+    logp.emplace_back(row);
+  }
+  return LogProbMatrix(logp);
+}
+
+// The best score of all the CTC paths of the tokens, by enumerating the
+// paths
+static float BruteForceScore(const LogProbMatrix& logp,
+                             const std::vector<int>& tokens) {
+  const int vocab = logp.cols();
+  std::vector<int> path(logp.rows(), 0);
+  float best = -kFloatMax;
+  while (true) {
+    std::vector<int> collapsed;
+    int last = 0;
+    float score = 0;
+    for (int t = 0; t < logp.rows(); ++t) {
+      if (path[t] != 0 && path[t] != last) collapsed.push_back(path[t]);
+      last = path[t];
+      score += logp(t, path[t]);
+    }
+    if (collapsed == tokens) best = std::max(best, score);
+    int t = 0;
+    while (t < logp.rows() && ++path[t] == vocab) path[t++] = 0;
+    if (t == logp.rows()) break;
+  }
+  return best;
+}
+
+TEST(CtcForcedAlignerTest, AlignTest) {
+  // a a _ b _ b c
+  LogProbMatrix logp = MakeFrames({{1, 0.9},
+                                   {1, 0.8},
+                                   {0, 0.1},
+                                   {2, 0.7},
+                                   {0, 0.1},
+                                   {2, 0.9},
+                                   {3, 0.6}});
+  CtcForcedAlignerOptions opts;
+  CtcForcedAligner aligner(opts);
+  std::vector<CtcAlignedToken> alignment;
+  ASSERT_TRUE(aligner.Align(logp, {1, 2, 2, 3}, &alignment));
+  ASSERT_EQ(alignment.size(), 4);
+  EXPECT_EQ(alignment[0].token, 1);
+  EXPECT_EQ(alignment[0].start, 0);
+  EXPECT_EQ(alignment[0].end, 2);
+  EXPECT_NEAR(alignment[0].confidence, std::sqrt(0.9 * 0.8), 1e-5);
+  EXPECT_EQ(alignment[1].start, 3);
+  EXPECT_EQ(alignment[1].end, 4);
+  EXPECT_EQ(alignment[2].start, 5);
+  EXPECT_EQ(alignment[3].token, 3);
+  EXPECT_EQ(alignment[3].start, 6);
+  EXPECT_NEAR(alignment[3].confidence, 0.6, 1e-5);
+  EXPECT_NEAR(aligner.score(), BruteForceScore(logp, {1, 2, 2, 3}), 1e-4);
+
+  // The repeats need a blank between them
+  LogProbMatrix short_logp = MakeFrames({{1, 0.9}, {1, 0.9}});
+  EXPECT_FALSE(aligner.Align(short_logp, {1, 1}, &alignment));
+  EXPECT_TRUE(aligner.Align(short_logp, {1, 2}, &alignment));
+  // An empty transcript is all blanks
+  EXPECT_TRUE(aligner.Align(short_logp, {}, &alignment));
+  EXPECT_TRUE(alignment.empty());
+}
+
+TEST(CtcForcedAlignerTest, BruteForceTest) {
+  std::default_random_engine g(0);
+  std::uniform_real_distribution<float> dist(0.01, 1);
+  std::uniform_int_distribution<int> token(1, 3);
+  CtcForcedAligner aligner(CtcForcedAlignerOptions{});
+  for (int iter = 0; iter < 200; ++iter) {
+    int num_frames = 1 + iter % 6;
+    std::vector<std::vector<float>> rows(num_frames, std::vector<float>(4));
+    for (auto& row : rows) {
+      float sum = 0;
+      for (auto& x : row) sum += (x = dist(g));
+      for (auto& x : row) x = std::log(x / sum);
+    }
+    LogProbMatrix logp(rows);
+    std::vector<int> tokens(iter % 4);
+    for (auto& t : tokens) t = token(g);
+    float expected = BruteForceScore(logp, tokens);
+    std::vector<CtcAlignedToken> alignment;
+    bool ok = aligner.Align(logp, tokens, &alignment);
+    ASSERT_EQ(ok, expected > -kFloatMax) << iter;
+    if (!ok) continue;
+    EXPECT_NEAR(aligner.score(), expected, 1e-4) << iter;
+    // The frames of the tokens are in order and don't overlap
+    ASSERT_EQ(alignment.size(), tokens.size());
+    for (size_t i = 0; i < alignment.size(); ++i) {
+      EXPECT_EQ(alignment[i].token, tokens[i]);
+      EXPECT_LT(alignment[i].start, alignment[i].end);
+      if (i > 0) EXPECT_LE(alignment[i - 1].end, alignment[i].start);
+    }
+  }
+}
+
+}  // namespace wenet
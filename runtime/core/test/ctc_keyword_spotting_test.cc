@@ -0,0 +1,108 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "decoder/ctc_keyword_spotting.h"
+
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+static std::shared_ptr<SymbolStrings> MakeSymbolTable() {
+  fst::SymbolTable symbol_table;
+  std::vector<std::string> words = {"<blank>", "a", "b", "c", "d"};
+  for (int i = 0; i < words.size(); ++i) {
+    symbol_table.AddSymbol(words[i], i);
+  }
+  return std::make_shared<SymbolStrings>(symbol_table);
+}
+
+// The log posteriors of the frames, each one is the token of it with the
+// prob and the blank with the rest
+static std::vector<std::vector<float>> MakeFrames(
+    const std::vector<std::pair<int, float>>& frames) {
+  std::vector<std::vector<float>> logp;
+  for (const auto& frame : frames) {
+    std::vector<float> row(5, std::log(1e-4));
+    row[0] = std::log(1.0 - frame.second);
+    if (frame.first != 0) row[frame.first] = std::log(frame.second);
+    logp.emplace_back(row);
+  }
+  return logp;
+}
+
+TEST(CtcKeywordSpottingTest, KeywordSetTest) {
+  auto keywords =
+      KeywordSet::Build({"ab", "bc\t0.8", "ae", ""}, *MakeSymbolTable(), 0.5);
+  // e is unknown
+  ASSERT_EQ(keywords->keywords().size(), 2);
+  EXPECT_THAT(keywords->keywords()[0].tokens, ::testing::ElementsAre(1, 2));
+  EXPECT_FLOAT_EQ(keywords->keywords()[0].threshold, 0.5);
+  EXPECT_FLOAT_EQ(keywords->keywords()[1].threshold, 0.8);
+  EXPECT_EQ(keywords->num_states(), 4);
+}
+
+TEST(CtcKeywordSpottingTest, DetectTest) {
+  auto keywords =
+      KeywordSet::Build({"ab", "bb\t0.75"}, *MakeSymbolTable(), 0.5);
+  CtcKeywordSpottingOptions opts;
+  CtcKeywordSpotting kws(opts, keywords);
+  // a b is detected at the peak of b, b b needs a blank between the bs
+  kws.Search(MakeFrames({{0, 0.9}, {1, 0.6}, {1, 0.8}, {2, 0.7}, {0, 0.9}}));
+  ASSERT_EQ(kws.detections().size(), 1);
+  EXPECT_EQ(kws.detections()[0].keyword, 0);
+  EXPECT_EQ(kws.detections()[0].start, 2);
+  EXPECT_EQ(kws.detections()[0].end, 3);
+  EXPECT_NEAR(kws.detections()[0].confidence, std::sqrt(0.8 * 0.7), 1e-4);
+  EXPECT_THAT(kws.Outputs()[0], ::testing::ElementsAre(1, 2));
+  EXPECT_THAT(kws.Times()[0], ::testing::ElementsAre(2, 3));
+  EXPECT_EQ(kws.NumHypotheses(), 1);
+
+  // The second b, after the blank, makes b b
+  kws.Search(MakeFrames({{2, 0.9}}));
+  ASSERT_EQ(kws.detections().size(), 2);
+  EXPECT_EQ(kws.detections()[1].keyword, 1);
+  EXPECT_EQ(kws.detections()[1].start, 3);
+  EXPECT_EQ(kws.detections()[1].end, 5);
+  EXPECT_THAT(kws.Outputs()[0], ::testing::ElementsAre(1, 2, 2, 2));
+
+  kws.Reset();
+  EXPECT_TRUE(kws.detections().empty());
+  EXPECT_TRUE(kws.Outputs()[0].empty());
+  EXPECT_EQ(kws.NumHypotheses(), 0);
+}
+
+TEST(CtcKeywordSpottingTest, ThresholdTest) {
+  auto keywords = KeywordSet::Build({"cd\t0.8"}, *MakeSymbolTable(), 0.5);
+  CtcKeywordSpottingOptions opts;
+  opts.max_token_gap = 2;
+  CtcKeywordSpotting kws(opts, keywords);
+  // Below the threshold
+  kws.Search(MakeFrames({{3, 0.9}, {4, 0.5}, {0, 0.9}}));
+  EXPECT_TRUE(kws.detections().empty());
+  // The c is too far away
+  kws.Search(MakeFrames({{0, 0.9}, {0, 0.9}, {4, 0.9}}));
+  EXPECT_TRUE(kws.detections().empty());
+  kws.Search(MakeFrames({{3, 0.9}, {0, 0.9}, {4, 0.9}}));
+  ASSERT_EQ(kws.detections().size(), 1);
+  EXPECT_EQ(kws.detections()[0].start, 6);
+}
+
+}  // namespace wenet
@@ -3,14 +3,35 @@
 
 #include "decoder/ctc_prefix_beam_search.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
 #include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
+#include "utils/state_io.h"
 #include "utils/utils.h"
 
+// The heap allocations of the test binary
+static std::atomic<int64_t> g_num_allocs{0};
+
+void* operator new(size_t size) {
+  ++g_num_allocs;
+  void* ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+
 TEST(CtcPrefixBeamSearchTest, CtcPrefixBeamSearchLogicTest) {
   using ::testing::ElementsAre;
   // See https://robin1001.github.io/2020/12/11/ctc-search for the
@@ -61,3 +82,394 @@ TEST(CtcPrefixBeamSearchTest, CtcPrefixBeamSearchLogicTest) {
   ASSERT_THAT(times[1], ElementsAre(0, 2));
   ASSERT_THAT(times[2], ElementsAre(2));
 }
+
+TEST(CtcPrefixBeamSearchTest, ConfidenceTest) {
+  using ::testing::ElementsAre;
+  // Token 1 on the first two frames, blank, then token 2
+  std::vector<std::vector<float>> data = {{0.20, 0.60, 0.20},
+                                          {0.10, 0.80, 0.10},
+                                          {0.80, 0.10, 0.10},
+                                          {0.05, 0.05, 0.90}};
+  for (auto& row : data) {
+    for (auto& prob : row) prob = std::log(prob);
+  }
+  wenet::CtcPrefixBeamSearchOptions option;
+  option.first_beam_size = 3;
+  option.second_beam_size = 3;
+  wenet::CtcPrefixBeamSearch prefix_beam_search(option);
+  prefix_beam_search.Search(data);
+  prefix_beam_search.FinalizeSearch();
+  ASSERT_THAT(prefix_beam_search.Inputs()[0], ElementsAre(1, 2));
+  ASSERT_THAT(prefix_beam_search.Times()[0], ElementsAre(1, 3));
+  const auto& confidences = prefix_beam_search.Confidences();
+  ASSERT_EQ(confidences.size(), prefix_beam_search.Inputs().size());
+  ASSERT_EQ(confidences[0].size(), 2);
+  EXPECT_FLOAT_EQ(confidences[0][0].max, 0.8);
+  EXPECT_FLOAT_EQ(confidences[0][0].mean, 0.7);
+  EXPECT_FLOAT_EQ(confidences[0][0].min, 0.6);
+  EXPECT_FLOAT_EQ(confidences[0][1].max, 0.9);
+  EXPECT_FLOAT_EQ(confidences[0][1].mean, 0.9);
+  EXPECT_FLOAT_EQ(confidences[0][1].min, 0.9);
+
+  // Not tracked without the times
+  std::unique_ptr<wenet::SearchInterface> plain =
+      wenet::NewCtcPrefixBeamSearch(option, nullptr, nullptr, false);
+  plain->Search(data);
+  EXPECT_TRUE(plain->Confidences()[0].empty());
+}
+
+TEST(CtcPrefixBeamSearchTest, LongUtteranceTest) {
+  // Token (t / 2) % 5 + 1 is emitted at every even frame t, blank at every
+  // odd frame, the other tokens share the rest of the probability
+  const int num_frames = 6000;
+  const int vocab_size = 6;
+  std::vector<std::vector<float>> data(num_frames,
+                                       std::vector<float>(vocab_size));
+  std::vector<int> expected_inputs;
+  std::vector<int> expected_times;
+  for (int t = 0; t < num_frames; ++t) {
+    int best = t % 2 == 0 ? (t / 2) % 5 + 1 : 0;
+    for (int j = 0; j < vocab_size; ++j) {
+      data[t][j] = std::log(j == best ? 0.75 : 0.05);
+    }
+    if (best != 0) {
+      expected_inputs.push_back(best);
+      expected_times.push_back(t);
+    }
+  }
+  wenet::CtcPrefixBeamSearchOptions option;
+  option.first_beam_size = 4;
+  option.second_beam_size = 4;
+  wenet::CtcPrefixBeamSearch prefix_beam_search(option);
+  // Search in chunks, as it's done in streaming decoding
+  const int chunk_size = 16;
+  for (int t = 0; t < num_frames; t += chunk_size) {
+    std::vector<std::vector<float>> chunk(data.begin() + t,
+                                          data.begin() + t + chunk_size);
+    prefix_beam_search.Search(chunk);
+    EXPECT_EQ(prefix_beam_search.Inputs()[0].size(), (t + chunk_size) / 2);
+  }
+  prefix_beam_search.FinalizeSearch();
+  EXPECT_EQ(prefix_beam_search.Inputs()[0], expected_inputs);
+  EXPECT_EQ(prefix_beam_search.Outputs()[0], expected_inputs);
+  EXPECT_EQ(prefix_beam_search.Times()[0], expected_times);
+  EXPECT_EQ(prefix_beam_search.Inputs().size(), 4);
+  EXPECT_EQ(prefix_beam_search.Likelihood().size(), 4);
+
+  prefix_beam_search.Reset();
+  EXPECT_EQ(prefix_beam_search.Inputs().size(), 1);
+  EXPECT_TRUE(prefix_beam_search.Inputs()[0].empty());
+}
+
+TEST(CtcPrefixBeamSearchTest, BlankSkipTest) {
+  // A token at every 4th frame, blank dominant frames in between
+  const int num_frames = 400;
+  const int vocab_size = 8;
+  std::vector<std::vector<float>> data(num_frames,
+                                       std::vector<float>(vocab_size));
+  for (int t = 0; t < num_frames; ++t) {
+    int best = t % 4 == 0 ? (t / 4 * 3) % (vocab_size - 1) + 1 : 0;
+    float best_prob = best == 0 ? 0.995 : 0.6;
+    float blank_prob = best == 0 ? best_prob : 0.2;
+    float other_prob = (1.0 - best_prob - (best == 0 ? 0 : blank_prob)) /
+                       (vocab_size - (best == 0 ? 1 : 2));
+    for (int j = 0; j < vocab_size; ++j) {
+      float prob = j == best ? best_prob : (j == 0 ? blank_prob : other_prob);
+      data[t][j] = std::log(prob);
+    }
+  }
+  wenet::CtcPrefixBeamSearchOptions option;
+  option.first_beam_size = 5;
+  option.second_beam_size = 5;
+  wenet::CtcPrefixBeamSearch full_search(option);
+  full_search.Search(data);
+  full_search.FinalizeSearch();
+  option.blank_skip_thresh = 0.99;
+  wenet::CtcPrefixBeamSearch skip_search(option);
+  skip_search.Search(data);
+  skip_search.FinalizeSearch();
+
+  // The best path and its score are kept, the pruned paths through the
+  // skipped frames may change the rest of the N-best
+  ASSERT_FALSE(skip_search.Inputs().empty());
+  EXPECT_EQ(full_search.Inputs()[0].size(), num_frames / 4);
+  EXPECT_EQ(full_search.Inputs()[0], skip_search.Inputs()[0]);
+  EXPECT_EQ(full_search.Times()[0], skip_search.Times()[0]);
+  EXPECT_NEAR(full_search.Likelihood()[0], skip_search.Likelihood()[0],
+              0.01 * std::abs(full_search.Likelihood()[0]));
+}
+
+TEST(CtcPrefixBeamSearchTest, ShallowFusionTest) {
+  using ::testing::ElementsAre;
+  // The data of CtcPrefixBeamSearchLogicTest, [2, 1] is the best without LM
+  std::vector<std::vector<float>> data = {{0.25, 0.40, 0.35},
+                                          {0.40, 0.35, 0.25},
+                                          {0.10, 0.50, 0.40}};
+  for (auto& row : data) {
+    for (auto& p : row) p = std::log(p);
+  }
+  // The LM prefers 1 2 strongly, <s> = 3 and </s> = 4
+  std::vector<wenet::NgramLm::NGram> ngrams = {
+      {{1}, std::log(0.4f), 0},      {{2}, std::log(0.4f), 0},
+      {{3}, -99, 0},                 {{4}, std::log(0.2f), 0},
+      {{3, 1}, std::log(0.9f), 0},   {{3, 2}, std::log(0.05f), 0},
+      {{1, 2}, std::log(0.9f), 0},   {{2, 1}, std::log(0.05f), 0},
+  };
+  std::shared_ptr<wenet::NgramLm> lm = wenet::NgramLm::Build(ngrams, 3, 4, -20);
+  wenet::CtcPrefixBeamSearchOptions option;
+  option.first_beam_size = 3;
+  option.second_beam_size = 3;
+  option.lm_weight = 1.0;
+  // Make up for the LM cost of each token, or 1 would be the best
+  option.lm_bonus = 1.0;
+  wenet::CtcPrefixBeamSearch search(option, nullptr, lm);
+  search.Search(data);
+  search.FinalizeSearch();
+  ASSERT_THAT(search.Inputs()[0], ElementsAre(1, 2));
+  // All the 5 alignments of 1 2 survive the beam with the LM, their sum is
+  // 0.205, and the LM score of 1 2 </s> is added to it
+  EXPECT_NEAR(search.Likelihood()[0],
+              std::log(0.205f) + std::log(0.9f * 0.9f * 0.2f) + 2.0, 1e-4);
+  // No LM
+  wenet::CtcPrefixBeamSearch plain_search(option);
+  plain_search.Search(data);
+  plain_search.FinalizeSearch();
+  ASSERT_THAT(plain_search.Inputs()[0], ElementsAre(2, 1));
+}
+
+// log P(labels | data) by the CTC forward algorithm in double
+static double CtcLogLikelihood(const std::vector<std::vector<float>>& data,
+                               const std::vector<int>& labels) {
+  // The labels interleaved with blanks
+  std::vector<int> ext(2 * labels.size() + 1, 0);
+  for (size_t i = 0; i < labels.size(); ++i) ext[2 * i + 1] = labels[i];
+  const double neg_inf = -std::numeric_limits<double>::infinity();
+  auto log_add = [neg_inf](double a, double b) {
+    if (a == neg_inf) return b;
+    double m = std::max(a, b);
+    return m + std::log(std::exp(a - m) + std::exp(b - m));
+  };
+  std::vector<double> alpha(ext.size(), neg_inf);
+  alpha[0] = data[0][ext[0]];
+  if (ext.size() > 1) alpha[1] = data[0][ext[1]];
+  for (size_t t = 1; t < data.size(); ++t) {
+    std::vector<double> next(ext.size(), neg_inf);
+    for (size_t s = 0; s < ext.size(); ++s) {
+      double sum = alpha[s];
+      if (s >= 1) sum = log_add(sum, alpha[s - 1]);
+      if (s >= 2 && ext[s] != 0 && ext[s] != ext[s - 2]) {
+        sum = log_add(sum, alpha[s - 2]);
+      }
+      if (sum != neg_inf) next[s] = sum + data[t][ext[s]];
+    }
+    alpha.swap(next);
+  }
+  double result = alpha.back();
+  if (ext.size() > 1) result = log_add(result, alpha[ext.size() - 2]);
+  return result;
+}
+
+TEST(CtcPrefixBeamSearchTest, ExactLikelihoodTest) {
+  // With the beams large enough to keep all the prefixes, the likelihood of
+  // each hypothesis is its exact CTC probability, summed by LogAdd() frame
+  // by frame
+  const int num_frames = 6;
+  const int vocab_size = 3;
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> dist(-3, 3);
+  std::vector<std::vector<float>> data(num_frames,
+                                       std::vector<float>(vocab_size));
+  for (auto& row : data) {
+    float sum = 0;
+    for (auto& x : row) {
+      x = std::exp(dist(rng));
+      sum += x;
+    }
+    for (auto& x : row) x = std::log(x / sum);
+  }
+  wenet::CtcPrefixBeamSearchOptions option;
+  option.first_beam_size = vocab_size;
+  option.second_beam_size = 1000;
+  wenet::CtcPrefixBeamSearch search(option);
+  search.Search(data);
+  search.FinalizeSearch();
+  // All the label sequences of 6 frames over 2 tokens, the ones which need
+  // more frames for the blanks between the repeated tokens are impossible
+  int num_possible = 0;
+  for (size_t i = 0; i < search.Inputs().size(); ++i) {
+    double expected = CtcLogLikelihood(data, search.Inputs()[i]);
+    if (std::isinf(expected)) {
+      EXPECT_EQ(search.Likelihood()[i], -wenet::kFloatMax);
+      continue;
+    }
+    EXPECT_NEAR(search.Likelihood()[i], expected, 1e-4);
+    ++num_possible;
+  }
+  EXPECT_EQ(num_possible, 41);
+}
+
+TEST(CtcPrefixBeamSearchTest, NoAllocationTest) {
+  // Decode the same utterance chunk by chunk twice, the buffers of the
+  // search are large enough after the first time, so the second time
+  // doesn't allocate, neither the search nor the reads of its results
+  const int num_frames = 400;
+  const int chunk_size = 16;
+  const int vocab_size = 100;
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<float> dist(-10, 0);
+  wenet::LogProbMatrix data(num_frames, vocab_size);
+  for (int t = 0; t < num_frames; ++t) {
+    for (int i = 0; i < vocab_size; ++i) data(t, i) = dist(rng);
+    data(t, t % 3 == 0 ? 0 : 1 + t % (vocab_size - 1)) = -0.1;
+  }
+  wenet::CtcPrefixBeamSearchOptions option;
+  wenet::CtcPrefixBeamSearch search(option);
+  wenet::LogProbMatrix chunk(chunk_size, vocab_size);
+  int64_t num_allocs = 0;
+  for (int pass = 0; pass < 2; ++pass) {
+    search.Reset();
+    int64_t start = g_num_allocs;
+    for (int t = 0; t < num_frames; t += chunk_size) {
+      chunk.CopyRows(data, t, chunk_size, 0);
+      search.Search(chunk);
+      EXPECT_FALSE(search.Outputs()[0].empty());
+      EXPECT_EQ(search.Times()[0].size(), search.Inputs()[0].size());
+    }
+    num_allocs = g_num_allocs - start;
+  }
+  EXPECT_EQ(num_allocs, 0);
+}
+
+TEST(CtcPrefixBeamSearchTest, BeamScaleTest) {
+  const int num_frames = 200;
+  const int vocab_size = 10;
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> dist(-5, 0);
+  wenet::LogProbMatrix data(num_frames, vocab_size);
+  for (int t = 0; t < num_frames; ++t) {
+    for (int i = 0; i < vocab_size; ++i) data(t, i) = dist(rng);
+  }
+  wenet::CtcPrefixBeamSearchOptions option;
+  option.first_beam_size = 8;
+  option.second_beam_size = 8;
+  wenet::CtcPrefixBeamSearch search(option);
+  search.Search(data);
+  EXPECT_EQ(search.Inputs().size(), 8);
+  EXPECT_GT(search.MemoryBytes(), 0);
+  EXPECT_GT(search.NumHypotheses(), 8);
+
+  // The beams of the following frames are scaled
+  search.set_beam_scale(0.5);
+  search.Search(data);
+  EXPECT_EQ(search.Inputs().size(), 4);
+  search.set_beam_scale(1.0);
+  search.Search(data);
+  EXPECT_EQ(search.Inputs().size(), 8);
+
+  // The buffers are kept by Reset(), a shorter utterance takes no more
+  const size_t memory_bytes = search.MemoryBytes();
+  search.Reset();
+  search.Search(data);
+  EXPECT_EQ(search.MemoryBytes(), memory_bytes);
+}
+
+TEST(CtcPrefixBeamSearchTest, SaveRestoreTest) {
+  const int num_frames = 1200;
+  const int vocab_size = 10;
+  const int chunk_size = 100;
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> dist(-5, 0);
+  std::vector<wenet::LogProbMatrix> chunks(num_frames / chunk_size);
+  for (auto& chunk : chunks) {
+    chunk.Resize(chunk_size, vocab_size);
+    for (int t = 0; t < chunk_size; ++t) {
+      for (int i = 0; i < vocab_size; ++i) chunk(t, i) = dist(rng);
+    }
+  }
+  wenet::CtcPrefixBeamSearchOptions option;
+  option.first_beam_size = 8;
+  option.second_beam_size = 8;
+  wenet::CtcPrefixBeamSearch ref(option);
+  for (const auto& chunk : chunks) ref.Search(chunk);
+  ref.FinalizeSearch();
+
+  // The search is moved to another one in the middle, after the prefix tree
+  // is compacted
+  wenet::CtcPrefixBeamSearch first(option), second(option);
+  const int split = chunks.size() / 2 + 1;
+  for (int i = 0; i < split; ++i) first.Search(chunks[i]);
+  std::string state;
+  wenet::StateWriter writer(&state);
+  ASSERT_TRUE(first.SaveState(&writer));
+  wenet::StateReader reader(state);
+  ASSERT_TRUE(second.RestoreState(&reader));
+  EXPECT_EQ(reader.remaining(), 0);
+  EXPECT_EQ(second.Inputs(), first.Inputs());
+  EXPECT_EQ(second.Likelihood(), first.Likelihood());
+  for (int i = split; i < chunks.size(); ++i) second.Search(chunks[i]);
+  second.FinalizeSearch();
+  EXPECT_EQ(second.Inputs(), ref.Inputs());
+  EXPECT_EQ(second.Times(), ref.Times());
+  ASSERT_EQ(second.Confidences().size(), ref.Confidences().size());
+  for (int i = 0; i < ref.Confidences().size(); ++i) {
+    ASSERT_EQ(second.Confidences()[i].size(), ref.Confidences()[i].size());
+    for (int j = 0; j < ref.Confidences()[i].size(); ++j) {
+      EXPECT_EQ(second.Confidences()[i][j].mean,
+                ref.Confidences()[i][j].mean);
+    }
+  }
+  EXPECT_EQ(second.Likelihood(), ref.Likelihood());
+  EXPECT_EQ(second.viterbi_likelihood(), ref.viterbi_likelihood());
+
+  // A truncated state or the one of other features is rejected, and the
+  // search is reset
+  wenet::StateReader truncated(state.data(), state.size() - 1);
+  EXPECT_FALSE(second.RestoreState(&truncated));
+  EXPECT_EQ(second.Inputs().size(), 1);
+  EXPECT_TRUE(second.Inputs()[0].empty());
+  std::unique_ptr<wenet::SearchInterface> plain =
+      wenet::NewCtcPrefixBeamSearch(option, nullptr, nullptr, false);
+  wenet::StateReader other(state);
+  EXPECT_FALSE(plain->RestoreState(&other));
+}
+
+TEST(CtcPrefixBeamSearchTest, SparseTest) {
+  // The top k of the pruned log probs are the ones of the dense, so the
+  // search is the same if k is no less than the first beam
+  const int num_frames = 300;
+  const int vocab_size = 100;
+  std::mt19937 rng(11);
+  std::uniform_real_distribution<float> dist(-10, 0);
+  wenet::LogProbMatrix data(num_frames, vocab_size);
+  for (int t = 0; t < num_frames; ++t) {
+    for (int i = 0; i < vocab_size; ++i) data(t, i) = dist(rng);
+    data(t, t % 3 == 0 ? 0 : 1 + t % (vocab_size - 1)) = -0.01;
+  }
+  wenet::SparseLogProbMatrix sparse;
+  sparse.FromDense(data, 10);
+  EXPECT_EQ(sparse.cols(), 11);
+  for (int t = 0; t < num_frames; ++t) {
+    EXPECT_EQ(sparse.Ids(t)[0], 0);
+    EXPECT_EQ(sparse.BlankValue(t), data(t, 0));
+  }
+  wenet::LogProbMatrix dense;
+  sparse.ToDense(&dense);
+  EXPECT_EQ(dense(0, 0), data(0, 0));
+  EXPECT_EQ(dense(0, sparse.Ids(0)[10]), data(0, sparse.Ids(0)[10]));
+
+  wenet::CtcPrefixBeamSearchOptions option;
+  option.first_beam_size = 10;
+  option.second_beam_size = 10;
+  wenet::CtcPrefixBeamSearch dense_search(option);
+  wenet::CtcPrefixBeamSearch sparse_search(option);
+  dense_search.Search(data);
+  sparse_search.Search(sparse);
+  EXPECT_EQ(sparse_search.Inputs(), dense_search.Inputs());
+  EXPECT_EQ(sparse_search.Times(), dense_search.Times());
+  ASSERT_EQ(sparse_search.Likelihood().size(),
+            dense_search.Likelihood().size());
+  for (int i = 0; i < dense_search.Likelihood().size(); ++i) {
+    EXPECT_FLOAT_EQ(sparse_search.Likelihood()[i],
+                    dense_search.Likelihood()[i]);
+  }
+}
@@ -0,0 +1,289 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/decode_scheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "frontend/feature_pipeline.h"
+
+namespace wenet {
+
+TEST(DecodeSchedulerTest, PostOrderTest) {
+  const int num_sessions = 8;
+  const int num_tasks = 1000;
+  DecodeScheduler scheduler(4);
+  std::vector<std::shared_ptr<DecodeScheduler::Session>> sessions;
+  std::vector<std::vector<int>> outputs(num_sessions);
+  std::vector<std::atomic<int>> running(num_sessions);
+  std::atomic<int> num_overlapped{0};
+  std::atomic<int> num_done{0};
+  for (int i = 0; i < num_sessions; ++i) {
+    running[i] = 0;
+    sessions.push_back(scheduler.NewSession());
+  }
+  // Post from several threads, each one owns some sessions
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 2; ++t) {
+    threads.emplace_back([&, t]() {
+      for (int j = 0; j < num_tasks; ++j) {
+        for (int i = t; i < num_sessions; i += 2) {
+          sessions[i]->Post([&, i, j]() {
+            if (running[i].fetch_add(1) != 0) ++num_overlapped;
+            outputs[i].push_back(j);
+            running[i].fetch_sub(1);
+            ++num_done;
+          });
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  while (num_done < num_sessions * num_tasks) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(num_overlapped, 0);
+  for (int i = 0; i < num_sessions; ++i) {
+    ASSERT_EQ(outputs[i].size(), num_tasks);
+    for (int j = 0; j < num_tasks; ++j) {
+      EXPECT_EQ(outputs[i][j], j);
+    }
+  }
+}
+
+TEST(DecodeSchedulerTest, RunUntilDoneTest) {
+  DecodeScheduler scheduler(2);
+  std::atomic<int> num_runs{0};
+  std::promise<void> done;
+  auto session = scheduler.NewSession([&]() {
+    if (++num_runs == 3) {
+      done.set_value();
+      return false;
+    }
+    return true;
+  });
+  // The notifications come faster than the runs, they are coalesced, and
+  // the session is not run any more once it's done
+  for (int i = 0; i < 1000; ++i) {
+    session->Notify();
+  }
+  while (num_runs < 3) {
+    session->Notify();
+    std::this_thread::yield();
+  }
+  done.get_future().wait();
+  for (int i = 0; i < 10; ++i) {
+    session->Notify();
+  }
+  std::promise<void> flushed;
+  session->Post([&]() { flushed.set_value(); });
+  flushed.get_future().wait();
+  EXPECT_EQ(num_runs, 3);
+}
+
+TEST(DecodeSchedulerTest, FeaturePipelineTest) {
+  FeaturePipelineConfig config(80, 16000);
+  const int num_sessions = 16;
+  const int chunk_frames = 16;
+  DecodeScheduler scheduler(3);
+  std::vector<std::shared_ptr<FeaturePipeline>> pipelines;
+  std::vector<std::shared_ptr<DecodeScheduler::Session>> sessions;
+  std::vector<int> num_read(num_sessions, 0);
+  std::vector<std::promise<void>> done(num_sessions);
+  for (int i = 0; i < num_sessions; ++i) {
+    auto pipeline = std::make_shared<FeaturePipeline>(config);
+    // Read the chunks until the pipeline doesn't have one
+    auto session = scheduler.NewSession([&, pipeline, i]() {
+      while (pipeline->PollFrames(chunk_frames)) {
+        FeatureMatrix feats;
+        bool ok = pipeline->Read(chunk_frames, &feats);
+        num_read[i] += feats.rows();
+        if (!ok) {
+          done[i].set_value();
+          return false;
+        }
+      }
+      return true;
+    });
+    pipeline->set_ready_callback([session]() { session->Notify(); });
+    session->Notify();
+    pipelines.push_back(pipeline);
+    sessions.push_back(session);
+  }
+  // 1s of audio per session in 10ms packets
+  std::vector<int16_t> packet(160, 100);
+  for (int j = 0; j < 100; ++j) {
+    for (auto& pipeline : pipelines) {
+      pipeline->AcceptWaveform(packet.data(), packet.size());
+    }
+  }
+  for (auto& pipeline : pipelines) {
+    pipeline->set_input_finished();
+  }
+  for (int i = 0; i < num_sessions; ++i) {
+    done[i].get_future().wait();
+    EXPECT_EQ(num_read[i], pipelines[i]->num_frames());
+  }
+}
+
+TEST(DecodeSchedulerTest, BackPressureTest) {
+  FeaturePipelineConfig config(80, 16000);
+  config.max_queued_frames = 32;
+  const int chunk_frames = 16;
+  DecodeScheduler scheduler(1);
+  auto pipeline = std::make_shared<FeaturePipeline>(config);
+  int num_read = 0;
+  std::promise<void> done;
+  auto session = scheduler.NewSession([&]() {
+    while (pipeline->PollFrames(chunk_frames)) {
+      FeatureMatrix feats;
+      bool ok = pipeline->Read(chunk_frames, &feats);
+      num_read += feats.rows();
+      if (!ok) {
+        done.set_value();
+        return false;
+      }
+    }
+    return true;
+  });
+  pipeline->set_ready_callback([session]() { session->Notify(); });
+  std::mutex mutex;
+  std::condition_variable space_cond;
+  bool space = false;
+  pipeline->set_space_callback([&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    space = true;
+    space_cond.notify_one();
+  });
+  session->Notify();
+
+  // The producer waits for the space, the queue never goes much over the
+  // capacity
+  std::vector<int16_t> packet(320, 100);
+  int max_queued = 0;
+  for (int j = 0; j < 200; ++j) {
+    if (!pipeline->PollSpace()) {
+      std::unique_lock<std::mutex> lock(mutex);
+      space_cond.wait(lock, [&]() { return space; });
+      space = false;
+    }
+    pipeline->AcceptWaveform(packet.data(), packet.size());
+    max_queued = std::max(max_queued, pipeline->NumQueuedFrames());
+  }
+  pipeline->set_input_finished();
+  done.get_future().wait();
+  EXPECT_EQ(num_read, pipeline->num_frames());
+  EXPECT_LE(max_queued, config.max_queued_frames + 2);
+}
+
+TEST(DecodeSchedulerTest, FairQueueingTest) {
+  DecodeScheduler scheduler(1);
+  scheduler.EnableFairQueueing({{"a", 3.0f}});
+  // Each run takes the same time, the tenants of weights 3 and 1 always
+  // have a runnable session
+  std::atomic<int> num_runs{0};
+  std::atomic<int> runs[2] = {{0}, {0}};
+  std::promise<void> done;
+  std::vector<std::shared_ptr<DecodeScheduler::Session>> sessions;
+  for (int i = 0; i < 4; ++i) {
+    DecodeClass decode_class;
+    decode_class.tenant = i == 0 ? "a" : "b";
+    sessions.push_back(scheduler.NewSession(
+        [&, i]() {
+          std::this_thread::sleep_for(std::chrono::microseconds(200));
+          runs[i == 0 ? 0 : 1]++;
+          int n = ++num_runs;
+          if (n == 400) done.set_value();
+          return n < 400;
+        },
+        decode_class));
+  }
+  for (auto& session : sessions) {
+    session->Notify();
+  }
+  // Keep them runnable
+  std::atomic<bool> stop{false};
+  std::thread notifier([&]() {
+    while (!stop) {
+      for (auto& session : sessions) session->Notify();
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  });
+  done.get_future().wait();
+  stop = true;
+  notifier.join();
+  // 3 of 4 runs are of "a", though "b" has 3 sessions
+  EXPECT_GT(runs[0], 250);
+  EXPECT_LT(runs[0], 350);
+}
+
+TEST(DecodeSchedulerTest, PriorityTest) {
+  DecodeScheduler scheduler(1);
+  scheduler.EnableFairQueueing({});
+  // Hold the only worker until all the sessions are queued
+  std::promise<void> gate;
+  std::shared_future<void> opened = gate.get_future().share();
+  auto blocker = scheduler.NewSession();
+  blocker->Post([opened]() { opened.wait(); });
+  std::mutex mutex;
+  std::vector<int> order;
+  std::vector<std::shared_ptr<DecodeScheduler::Session>> sessions;
+  for (int i = 0; i < 6; ++i) {
+    DecodeClass decode_class;
+    // The first ones are batch
+    decode_class.priority =
+        i < 4 ? DecodePriority::kBatch : DecodePriority::kInteractive;
+    decode_class.tenant = "t" + std::to_string(i);
+    sessions.push_back(scheduler.NewSession(nullptr, decode_class));
+    sessions.back()->Post([&mutex, &order, i]() {
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(i);
+    });
+  }
+  gate.set_value();
+  std::promise<void> done;
+  sessions[0]->Post([&done]() { done.set_value(); });
+  done.get_future().wait();
+  std::lock_guard<std::mutex> lock(mutex);
+  ASSERT_GE(order.size(), 2);
+  EXPECT_GE(order[0], 4);
+  EXPECT_GE(order[1], 4);
+}
+
+TEST(DecodeSchedulerTest, ParseTenantWeightsTest) {
+  std::unordered_map<std::string, float> weights;
+  EXPECT_TRUE(ParseTenantWeights("a:4, b:0.5", &weights));
+  EXPECT_EQ(weights.size(), 2);
+  EXPECT_FLOAT_EQ(weights["a"], 4);
+  EXPECT_FLOAT_EQ(weights["b"], 0.5);
+  EXPECT_FALSE(ParseTenantWeights("a", &weights));
+  EXPECT_FALSE(ParseTenantWeights("a:0", &weights));
+  EXPECT_FALSE(ParseTenantWeights("a:x", &weights));
+}
+
+}  // namespace wenet
@@ -0,0 +1,61 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/device_replicas.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+TEST(DeviceReplicasTest, AcquireTest) {
+  std::vector<std::string> devices = {"cuda:0", "cuda:1", "cuda:2"};
+  std::vector<std::shared_ptr<DecodeResource>> resources;
+  for (size_t i = 0; i < devices.size(); ++i) {
+    resources.push_back(std::make_shared<DecodeResource>());
+  }
+  DeviceReplicas replicas(devices, resources);
+  ASSERT_EQ(replicas.size(), 3);
+  EXPECT_EQ(replicas.device(1), "cuda:1");
+  EXPECT_EQ(replicas.encoder_load(0), 0.0f);
+
+  // Spread over the devices in turn
+  std::vector<std::shared_ptr<DecodeResource>> leases;
+  for (int i = 0; i < 6; ++i) {
+    leases.push_back(replicas.Acquire());
+    EXPECT_EQ(leases.back().get(), resources[i % 3].get());
+  }
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(replicas.num_decoders(i), 2);
+  }
+  // The released device gets the next one, the copies of a lease count once
+  std::shared_ptr<DecodeResource> copy = leases[1];
+  leases[1].reset();
+  EXPECT_EQ(replicas.num_decoders(1), 2);
+  copy.reset();
+  EXPECT_EQ(replicas.num_decoders(1), 1);
+  leases[1] = replicas.Acquire();
+  EXPECT_EQ(leases[1].get(), resources[1].get());
+  EXPECT_EQ(replicas.num_decoders(1), 2);
+
+  leases.clear();
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(replicas.num_decoders(i), 0);
+  }
+}
+
+}  // namespace wenet
@@ -0,0 +1,301 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "frontend/fbank.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "frontend/feature_pipeline.h"
+#include "frontend/fixed_fbank.h"
+
+namespace wenet {
+
+static std::vector<float> RandomVector(int n, std::default_random_engine* g) {
+  std::uniform_real_distribution<float> dist(-1000, 1000);
+  std::vector<float> v(n);
+  for (auto& x : v) x = dist(*g);
+  return v;
+}
+
+static std::vector<int32_t> RandomInt32(int n, int bits,
+                                        std::default_random_engine* g) {
+  std::uniform_int_distribution<int32_t> dist(-(1 << bits), 1 << bits);
+  std::vector<int32_t> v(n);
+  for (auto& x : v) x = dist(*g);
+  return v;
+}
+
+TEST(FbankTest, KernelParityTest) {
+  const FbankKernels& ref = GetScalarFbankKernels();
+  const FbankKernels& simd = GetFbankKernels();
+  std::default_random_engine g(0);
+  // Lengths around the vector widths
+  for (int n : {1, 3, 4, 7, 8, 9, 15, 16, 17, 33, 400}) {
+    std::vector<float> a = RandomVector(n, &g), b = RandomVector(n, &g);
+    std::vector<float> x1 = a, x2 = a;
+    ref.PreEmphasis(0.97, x1.data(), n);
+    simd.PreEmphasis(0.97, x2.data(), n);
+    EXPECT_EQ(x1, x2) << simd.name << " PreEmphasis " << n;
+
+    x1 = a, x2 = a;
+    ref.Mul(b.data(), x1.data(), n);
+    simd.Mul(b.data(), x2.data(), n);
+    EXPECT_EQ(x1, x2) << simd.name << " Mul " << n;
+
+    x1 = a, x2 = a;
+    ref.Add(0.5, x1.data(), n);
+    simd.Add(0.5, x2.data(), n);
+    EXPECT_EQ(x1, x2) << simd.name << " Add " << n;
+
+    std::vector<float> p1(n), p2(n);
+    ref.PowerSpectrum(a.data(), b.data(), p1.data(), n);
+    simd.PowerSpectrum(a.data(), b.data(), p2.data(), n);
+    EXPECT_EQ(p1, p2) << simd.name << " PowerSpectrum " << n;
+
+    std::vector<int16_t> pcm(a.begin(), a.end());
+    ref.Int16ToFloat(pcm.data(), x1.data(), n);
+    simd.Int16ToFloat(pcm.data(), x2.data(), n);
+    EXPECT_EQ(x1, x2) << simd.name << " Int16ToFloat " << n;
+
+    float sum = ref.Sum(a.data(), n);
+    EXPECT_NEAR(simd.Sum(a.data(), n), sum, 1e-3 * n);
+    float dot = ref.Dot(a.data(), b.data(), n);
+    EXPECT_NEAR(simd.Dot(a.data(), b.data(), n), dot,
+                1e-5 * std::abs(dot) + 1e-2);
+  }
+}
+
+TEST(FbankTest, RealFftTest) {
+  std::default_random_engine g(0);
+  for (int n : {8, 16, 64, 512}) {
+    std::vector<float> x = RandomVector(n, &g);
+    std::vector<float> real = x, img(n, 0);
+    std::vector<int> bitrev(n);
+    std::vector<float> sintbl(n + n / 4);
+    make_bitrev(n, bitrev.data());
+    make_sintbl(n, sintbl.data());
+    fft(bitrev.data(), sintbl.data(), real.data(), img.data(), n);
+
+    std::vector<float> rreal(n / 2), rimg(n / 2);
+    RealFft::Get(n)->Compute(x.data(), rreal.data(), rimg.data());
+    for (int k = 0; k < n / 2; ++k) {
+      EXPECT_NEAR(rreal[k], real[k], 1e-6 * n * 1000) << n << " " << k;
+      EXPECT_NEAR(rimg[k], img[k], 1e-6 * n * 1000) << n << " " << k;
+    }
+  }
+  // The tables are shared by size
+  EXPECT_EQ(RealFft::Get(512), RealFft::Get(512));
+}
+
+TEST(FbankTest, ComputeParityTest) {
+  std::default_random_engine g(0);
+  std::vector<float> wave = RandomVector(16000, &g);
+  Fbank ref(80, 16000, 400, 160), simd(80, 16000, 400, 160);
+  ref.set_kernels(GetScalarFbankKernels());
+  std::vector<std::vector<float>> feat1, feat2;
+  int num_frames = ref.Compute(wave, &feat1);
+  EXPECT_EQ(simd.Compute(wave, &feat2), num_frames);
+  ASSERT_EQ(feat1.size(), feat2.size());
+  for (int i = 0; i < num_frames; ++i) {
+    EXPECT_THAT(feat2[i], testing::Pointwise(testing::FloatNear(1e-3),
+                                             feat1[i]));
+  }
+}
+
+TEST(FbankTest, SharedTablesTest) {
+  // The tables are shared by configuration
+  EXPECT_EQ(FbankTables::Get(80, 16000, 400),
+            FbankTables::Get(80, 16000, 400));
+  EXPECT_NE(FbankTables::Get(80, 16000, 400),
+            FbankTables::Get(80, 8000, 200));
+  for (int sample_rate : {16000, 8000}) {
+    Fbank fbank(80, sample_rate, sample_rate / 40, sample_rate / 100);
+    std::vector<float> matrix;
+    fbank.MelMatrix(&matrix);
+    ASSERT_EQ(matrix.size(), fbank.num_fft_bins() * 80);
+    // Each bin has some weights
+    for (int j = 0; j < 80; ++j) {
+      float sum = 0;
+      for (int i = 0; i < fbank.num_fft_bins(); ++i) sum += matrix[i * 80 + j];
+      EXPECT_GT(sum, 0) << sample_rate << " " << j;
+    }
+  }
+}
+
+TEST(FbankTest, StreamingTest) {
+  std::default_random_engine g(0);
+  std::vector<float> wave = RandomVector(16000, &g);
+  Fbank fbank(80, 16000, 400, 160);
+  std::vector<std::vector<float>> ref;
+  int num_frames = fbank.Compute(wave, &ref);
+
+  // Feed the wave by pieces shorter and longer than one frame
+  FeaturePipelineConfig config(80, 16000);
+  FeaturePipeline pipeline(config);
+  std::uniform_int_distribution<int> piece(1, 1000);
+  for (size_t start = 0; start < wave.size();) {
+    size_t end = std::min(wave.size(), start + piece(g));
+    pipeline.AcceptWaveform(
+        std::vector<float>(wave.begin() + start, wave.begin() + end));
+    start = end;
+  }
+  pipeline.set_input_finished();
+  EXPECT_EQ(pipeline.num_frames(), num_frames);
+  std::vector<std::vector<float>> feats;
+  EXPECT_FALSE(pipeline.Read(num_frames + 1, &feats));
+  ASSERT_EQ(feats.size(), num_frames);
+  for (int i = 0; i < num_frames; ++i) {
+    EXPECT_EQ(feats[i], ref[i]) << i;
+  }
+}
+
+TEST(FbankTest, Int16StreamingTest) {
+  std::default_random_engine g(0);
+  std::vector<float> wave = RandomVector(16000, &g);
+  std::vector<int16_t> pcm(wave.begin(), wave.end());
+  std::vector<float> pcm_float(pcm.begin(), pcm.end());
+  FeaturePipelineConfig config(80, 16000);
+  FeaturePipeline ref(config), pipeline(config);
+  ref.AcceptWaveform(pcm_float);
+  for (size_t start = 0; start < pcm.size(); start += 320) {
+    pipeline.AcceptWaveform(pcm.data() + start,
+                            std::min<size_t>(320, pcm.size() - start));
+  }
+  ref.set_input_finished();
+  pipeline.set_input_finished();
+  std::vector<std::vector<float>> feats1, feats2;
+  EXPECT_FALSE(ref.Read(ref.num_frames() + 1, &feats1));
+  EXPECT_FALSE(pipeline.Read(pipeline.num_frames() + 1, &feats2));
+  EXPECT_EQ(feats1, feats2);
+}
+
+TEST(FbankTest, FixedKernelParityTest) {
+  const FixedFbankKernels& ref = GetScalarFixedFbankKernels();
+  const FixedFbankKernels& simd = GetFixedFbankKernels();
+  std::default_random_engine g(0);
+  for (int n : {1, 3, 4, 5, 7, 8, 9, 33, 400}) {
+    // In the ranges of FixedFbank
+    std::vector<int32_t> a = RandomInt32(n, 28, &g);
+    std::vector<int32_t> w = RandomInt32(n, 30, &g);
+    std::vector<int32_t> x1 = a, x2 = a;
+    ref.PreEmphasis(2083059139, x1.data(), n);
+    simd.PreEmphasis(2083059139, x2.data(), n);
+    EXPECT_EQ(x1, x2) << simd.name << " PreEmphasis " << n;
+
+    x1 = a, x2 = a;
+    ref.Mul(w.data(), x1.data(), n);
+    simd.Mul(w.data(), x2.data(), n);
+    EXPECT_EQ(x1, x2) << simd.name << " Mul " << n;
+
+    std::vector<int32_t> wr = RandomInt32(n, 30, &g);
+    std::vector<int32_t> ar1 = RandomInt32(n, 29, &g), ar2 = ar1;
+    std::vector<int32_t> ai1 = RandomInt32(n, 29, &g), ai2 = ai1;
+    std::vector<int32_t> br1 = RandomInt32(n, 29, &g), br2 = br1;
+    std::vector<int32_t> bi1 = RandomInt32(n, 29, &g), bi2 = bi1;
+    ref.Butterfly(wr.data(), w.data(), ar1.data(), ai1.data(), br1.data(),
+                  bi1.data(), n);
+    simd.Butterfly(wr.data(), w.data(), ar2.data(), ai2.data(), br2.data(),
+                   bi2.data(), n);
+    EXPECT_EQ(ar1, ar2) << simd.name << " Butterfly " << n;
+    EXPECT_EQ(ai1, ai2) << simd.name << " Butterfly " << n;
+    EXPECT_EQ(br1, br2) << simd.name << " Butterfly " << n;
+    EXPECT_EQ(bi1, bi2) << simd.name << " Butterfly " << n;
+
+    std::vector<int32_t> re = RandomInt32(n, 30, &g);
+    std::vector<int32_t> im = RandomInt32(n, 30, &g);
+    std::vector<uint64_t> p1(n), p2(n);
+    ref.PowerSpectrum(re.data(), im.data(), p1.data(), n);
+    simd.PowerSpectrum(re.data(), im.data(), p2.data(), n);
+    EXPECT_EQ(p1, p2) << simd.name << " PowerSpectrum " << n;
+
+    std::vector<uint32_t> weights(n);
+    for (int i = 0; i < n; ++i) weights[i] = std::abs(w[i]) >> 15;
+    uint64_t hi1, lo1, hi2, lo2;
+    ref.Dot(weights.data(), p1.data(), n, &hi1, &lo1);
+    simd.Dot(weights.data(), p1.data(), n, &hi2, &lo2);
+    EXPECT_EQ(hi1, hi2) << simd.name << " Dot " << n;
+    EXPECT_EQ(lo1, lo2) << simd.name << " Dot " << n;
+  }
+}
+
+TEST(FbankTest, FixedFbankParityTest) {
+  std::default_random_engine g(0);
+  std::normal_distribution<float> noise(0, 1);
+  // Noise, and tones of 60dB above the noise like voiced speech
+  std::vector<float> wave = RandomVector(16000, &g);
+  std::vector<float> tones(16000);
+  for (int i = 0; i < 16000; ++i) {
+    tones[i] = std::round(8000 * sin(M_2PI * 440 * i / 16000) +
+                          3000 * sin(M_2PI * 1234 * i / 16000) +
+                          30 * noise(g));
+  }
+  for (const auto& x : {std::make_pair(&wave, 1e-3), {&tones, 1e-2}}) {
+    Fbank ref(80, 16000, 400, 160);
+    FixedFbank fixed(80, 16000, 400, 160);
+    std::vector<std::vector<float>> feat1, feat2;
+    int num_frames = ref.Compute(*x.first, &feat1);
+    EXPECT_EQ(fixed.Compute(*x.first, &feat2), num_frames);
+    for (int i = 0; i < num_frames; ++i) {
+      EXPECT_THAT(feat2[i], testing::Pointwise(testing::FloatNear(x.second),
+                                               feat1[i]));
+    }
+  }
+
+  // The floor of Fbank on silence
+  std::vector<float> silence(1000, 100);
+  Fbank ref(80, 16000, 400, 160);
+  FixedFbank fixed(80, 16000, 400, 160);
+  std::vector<std::vector<float>> feat1, feat2;
+  ref.Compute(silence, &feat1);
+  fixed.Compute(silence, &feat2);
+  EXPECT_EQ(feat1, feat2);
+}
+
+TEST(FbankTest, FixedFbankStreamingTest) {
+  std::default_random_engine g(0);
+  std::vector<float> wave = RandomVector(16000, &g);
+  std::vector<int16_t> pcm(wave.begin(), wave.end());
+  std::vector<float> pcm_float(pcm.begin(), pcm.end());
+  FixedFbank fbank(80, 16000, 400, 160);
+  std::vector<std::vector<float>> ref;
+  int num_frames = fbank.Compute(pcm_float, &ref);
+
+  // The 16 bits PCM and the float samples of them are the same
+  FeaturePipelineConfig config(80, 16000);
+  config.fixed_point = true;
+  FeaturePipeline pipeline(config);
+  std::uniform_int_distribution<int> piece(1, 1000);
+  for (size_t start = 0; start < pcm.size();) {
+    size_t end = std::min(pcm.size(), start + piece(g));
+    pipeline.AcceptWaveform(pcm.data() + start, end - start);
+    start = end;
+  }
+  pipeline.set_input_finished();
+  EXPECT_EQ(pipeline.num_frames(), num_frames);
+  std::vector<std::vector<float>> feats;
+  EXPECT_FALSE(pipeline.Read(num_frames + 1, &feats));
+  ASSERT_EQ(feats.size(), num_frames);
+  for (int i = 0; i < num_frames; ++i) {
+    EXPECT_EQ(feats[i], ref[i]) << i;
+  }
+}
+
+}  // namespace wenet
@@ -0,0 +1,127 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "frontend/feature_io.h"
+
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+static FeatureMatrix MakeFeats(int rows, int cols, float base) {
+  FeatureMatrix feats(rows, cols);
+  for (int r = 0; r < rows; ++r) {
+    for (int c = 0; c < cols; ++c) {
+      feats(r, c) = base + r * cols + c;
+    }
+  }
+  return feats;
+}
+
+static void ExpectFeatsEq(const FeatureMatrix& a, const FeatureMatrix& b) {
+  ASSERT_EQ(a.rows(), b.rows());
+  ASSERT_EQ(a.cols(), b.cols());
+  for (int r = 0; r < a.rows(); ++r) {
+    for (int c = 0; c < a.cols(); ++c) {
+      EXPECT_FLOAT_EQ(a(r, c), b(r, c));
+    }
+  }
+}
+
+TEST(FeatureIoTest, ArchiveAndScriptTest) {
+  std::string ark = ::testing::TempDir() + "/feature_io_test.ark";
+  std::string scp = ::testing::TempDir() + "/feature_io_test.scp";
+  std::vector<FeatureMatrix> feats = {MakeFeats(3, 80, 0),
+                                      MakeFeats(17, 80, 1000),
+                                      MakeFeats(0, 80, 0)};
+  FeatureWriter writer;
+  ASSERT_TRUE(writer.Open("ark,scp:" + ark + "," + scp));
+  for (size_t i = 0; i < feats.size(); ++i) {
+    writer.Write("utt" + std::to_string(i), feats[i]);
+  }
+  writer.Close();
+
+  for (const std::string& rspecifier : {"ark:" + ark, "scp:" + scp}) {
+    FeatureReader reader;
+    ASSERT_TRUE(reader.Open(rspecifier));
+    size_t i = 0;
+    for (; !reader.Done(); reader.Next(), ++i) {
+      ASSERT_LT(i, feats.size());
+      EXPECT_EQ(reader.Key(), "utt" + std::to_string(i));
+      ExpectFeatsEq(reader.Value(), feats[i]);
+    }
+    EXPECT_EQ(i, feats.size());
+  }
+}
+
+TEST(FeatureIoTest, DoubleMatrixTest) {
+  // A double matrix of Kaldi, "key \0BDM " followed by the dimensions
+  std::string ark = ::testing::TempDir() + "/feature_io_test_double.ark";
+  {
+    std::ofstream os(ark, std::ios::binary);
+    os.write("utt \0BDM ", 9);
+    int32_t dims[2] = {2, 3};
+    for (int32_t dim : dims) {
+      os.put(4);
+      os.write(reinterpret_cast<const char*>(&dim), 4);
+    }
+    for (int i = 0; i < 6; ++i) {
+      double x = i * 0.5;
+      os.write(reinterpret_cast<const char*>(&x), sizeof(x));
+    }
+  }
+  FeatureReader reader;
+  ASSERT_TRUE(reader.Open("ark:" + ark));
+  ASSERT_FALSE(reader.Done());
+  EXPECT_EQ(reader.Key(), "utt");
+  ASSERT_EQ(reader.Value().rows(), 2);
+  ASSERT_EQ(reader.Value().cols(), 3);
+  EXPECT_FLOAT_EQ(reader.Value()(1, 2), 2.5);
+  reader.Next();
+  EXPECT_TRUE(reader.Done());
+}
+
+TEST(FeatureIoTest, WriteBinaryTest) {
+  std::string ark = ::testing::TempDir() + "/feature_io_test_binary.ark";
+  std::string scp = ::testing::TempDir() + "/feature_io_test_binary.scp";
+  FeatureWriter writer;
+  ASSERT_TRUE(writer.Open("ark,scp:" + ark + "," + scp));
+  writer.WriteBinary("a", std::string("\xd6\x00", 2));
+  writer.WriteBinary("bc", "x");
+  writer.Close();
+  std::ifstream is(ark, std::ios::binary);
+  std::string content((std::istreambuf_iterator<char>(is)),
+                      std::istreambuf_iterator<char>());
+  EXPECT_EQ(content, std::string("a \0B\xd6\x00" "bc \0Bx", 12));
+  std::ifstream script(scp);
+  std::string line;
+  ASSERT_TRUE(std::getline(script, line));
+  EXPECT_EQ(line, "a " + ark + ":2");
+  ASSERT_TRUE(std::getline(script, line));
+  EXPECT_EQ(line, "bc " + ark + ":9");
+}
+
+TEST(FeatureIoTest, InvalidSpecifierTest) {
+  FeatureReader reader;
+  EXPECT_FALSE(reader.Open("feats.ark"));
+  FeatureWriter writer;
+  EXPECT_FALSE(writer.Open("scp:feats.scp"));
+}
+
+}  // namespace wenet
@@ -0,0 +1,96 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "decoder/ctc_wfst_beam_search.h"
+#include "gtest/gtest.h"
+
+// Words 1, 2, <s> = 3 and </s> = 4
+static const int kBos = 3;
+static const int kEos = 4;
+
+static std::unique_ptr<wenet::NgramLm> MakeLm(float p1, float p2) {
+  std::vector<wenet::NgramLm::NGram> ngrams = {
+      {{3}, -99, 0},
+      {{1}, std::log(p1), 0},
+      {{2}, std::log(p2), 0},
+      {{4}, std::log(0.5f), 0},
+  };
+  return wenet::NgramLm::Build(ngrams, kBos, kEos, -20);
+}
+
+// Two paths of one word, 1 and 2, of the graph costs 1 and 2
+static kaldi::CompactLattice MakeLattice() {
+  kaldi::CompactLattice clat;
+  clat.AddState();
+  clat.AddState();
+  clat.SetStart(0);
+  for (int word = 1; word <= 2; ++word) {
+    clat.AddArc(0, kaldi::CompactLatticeArc(
+                       word, word,
+                       kaldi::CompactLatticeWeight(
+                           kaldi::LatticeWeight(word, 10), {5, 6}),
+                       1));
+  }
+  clat.SetFinal(1, kaldi::CompactLatticeWeight::One());
+  return clat;
+}
+
+// The graph cost of the path of word in clat
+static float GraphCost(const kaldi::CompactLattice& clat, int word) {
+  for (fst::ArcIterator<kaldi::CompactLattice> aiter(clat, clat.Start());
+       !aiter.Done(); aiter.Next()) {
+    const kaldi::CompactLatticeArc& arc = aiter.Value();
+    if (arc.ilabel != word) continue;
+    EXPECT_EQ(arc.weight.Weight().Value2(), 10);
+    EXPECT_EQ(arc.weight.String(), std::vector<int>({5, 6}));
+    return arc.weight.Weight().Value1() +
+           clat.Final(arc.nextstate).Weight().Value1();
+  }
+  ADD_FAILURE() << "No path of " << word;
+  return 0;
+}
+
+TEST(LatticeRescoringTest, ReplaceTest) {
+  auto lm = MakeLm(0.1, 0.4);
+  kaldi::CompactLattice rescored;
+  wenet::RescoreLattice(MakeLattice(), *lm, nullptr, 2.0, {}, &rescored);
+  // The histories of a unigram LM are all the same state
+  EXPECT_EQ(rescored.NumStates(), 2);
+  EXPECT_NEAR(GraphCost(rescored, 1), -2 * std::log(0.1 * 0.5), 1e-4);
+  EXPECT_NEAR(GraphCost(rescored, 2), -2 * std::log(0.4 * 0.5), 1e-4);
+}
+
+TEST(LatticeRescoringTest, SubtractTest) {
+  auto lm = MakeLm(0.1, 0.4);
+  auto old_lm = MakeLm(0.2, 0.2);
+  kaldi::CompactLattice rescored;
+  wenet::RescoreLattice(MakeLattice(), *lm, old_lm.get(), 1.0, {}, &rescored);
+  EXPECT_NEAR(GraphCost(rescored, 1), 1 + std::log(0.2f) - std::log(0.1f),
+              1e-4);
+  EXPECT_NEAR(GraphCost(rescored, 2), 2 + std::log(0.2f) - std::log(0.4f),
+              1e-4);
+}
+
+TEST(LatticeRescoringTest, SkippedWordTest) {
+  auto lm = MakeLm(0.1, 0.4);
+  kaldi::CompactLattice rescored;
+  wenet::RescoreLattice(MakeLattice(), *lm, nullptr, 1.0, {1}, &rescored);
+  EXPECT_NEAR(GraphCost(rescored, 1), -std::log(0.5f), 1e-4);
+  EXPECT_NEAR(GraphCost(rescored, 2), -std::log(0.4 * 0.5), 1e-4);
+}
@@ -0,0 +1,116 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/load_test.h"
+
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "utils/thread_pool.h"
+
+namespace wenet {
+
+// The streams are done at once with fixed latencies, or after sleep_ms on
+// the pool
+class FakeLoadTest : public LoadTest {
+ public:
+  FakeLoadTest(const LoadTestOptions& opts, int sleep_ms)
+      : LoadTest(opts, Waves()), sleep_ms_(sleep_ms), pool_(2) {}
+
+ protected:
+  void StartStream(const LoadTestWave& wave, int stage) override {
+    LoadTestStream stream;
+    stream.stage = stage;
+    stream.ok = true;
+    stream.audio_ms = wave.pcm.size() * 1000.0 / wave.sample_rate;
+    stream.setup_ms = 3;
+    stream.first_partial_ms = 10;
+    stream.partial_ms = {10, 30};
+    stream.final_ms = 150;
+    if (sleep_ms_ == 0) return OnStreamDone(stream);
+    pool_.Post([this, stream]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms_));
+      OnStreamDone(stream);
+    });
+  }
+
+ private:
+  static std::vector<LoadTestWave> Waves() {
+    std::vector<LoadTestWave> waves(1);
+    waves[0].key = "test";
+    waves[0].pcm.resize(16000);
+    return waves;
+  }
+
+  int sleep_ms_;
+  ThreadPool pool_;
+};
+
+static std::vector<std::string> Split(const std::string& text, char delim) {
+  std::vector<std::string> fields;
+  std::istringstream is(text);
+  std::string field;
+  while (std::getline(is, field, delim)) {
+    fields.push_back(field);
+  }
+  return fields;
+}
+
+TEST(LoadTestTest, OpenLoopTest) {
+  LoadTestOptions opts;
+  opts.arrival_rates = {20, 40};
+  opts.stage_seconds = 0.1;
+  FakeLoadTest load_test(opts, 0);
+  load_test.Run();
+  std::string report = load_test.Report();
+  EXPECT_THAT(report, testing::HasSubstr("streams 2 failed 0 dropped 0"));
+  EXPECT_THAT(report, testing::HasSubstr("streams 4 failed 0 dropped 0"));
+
+  std::vector<std::string> rows = Split(load_test.Curve(), '\n');
+  ASSERT_EQ(rows.size(), 3);
+  EXPECT_THAT(rows[1], testing::StartsWith("0,20.000,1,2,0,0,"));
+
+  // The counts are cumulative
+  std::string histograms = load_test.Histograms();
+  EXPECT_THAT(histograms, testing::HasSubstr("0,setup,2,0\n"));
+  EXPECT_THAT(histograms, testing::HasSubstr("0,setup,5,2\n"));
+  EXPECT_THAT(histograms, testing::HasSubstr("1,partial,20,4\n"));
+  EXPECT_THAT(histograms, testing::HasSubstr("1,partial,50,8\n"));
+  EXPECT_THAT(histograms, testing::HasSubstr("1,final,100,0\n"));
+  EXPECT_THAT(histograms, testing::HasSubstr("1,final,+Inf,4\n"));
+}
+
+TEST(LoadTestTest, ClosedLoopTest) {
+  LoadTestOptions opts;
+  opts.max_connections = 2;
+  opts.stage_seconds = 0.1;
+  FakeLoadTest load_test(opts, 10);
+  load_test.Run();
+  std::vector<std::string> rows = Split(load_test.Curve(), '\n');
+  ASSERT_EQ(rows.size(), 2);
+  std::vector<std::string> fields = Split(rows[1], ',');
+  // Each connection streams one after another for the stage
+  int num_streams = std::stoi(fields[3]);
+  EXPECT_GT(num_streams, 2);
+  EXPECT_LE(num_streams, 2 * (100 / 10 + 1));
+  EXPECT_EQ(fields[2], "2");
+}
+
+}  // namespace wenet
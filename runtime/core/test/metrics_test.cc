@@ -0,0 +1,81 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/metrics.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+TEST(MetricsTest, HistogramTest) {
+  Histogram histogram({1, 10});
+  histogram.Observe(0.5);
+  histogram.Observe(1);
+  histogram.Observe(5);
+  histogram.Observe(50);
+  std::vector<uint64_t> counts;
+  double sum = 0;
+  histogram.Collect(&counts, &sum);
+  EXPECT_EQ(counts, std::vector<uint64_t>({2, 1, 1}));
+  EXPECT_DOUBLE_EQ(sum, 56.5);
+}
+
+TEST(MetricsTest, ShardedHistogramTest) {
+  Histogram histogram(LatencyBuckets());
+  const int num_threads = 8;
+  const int num_values = 10000;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&histogram]() {
+      for (int j = 0; j < num_values; ++j) histogram.Observe(1);
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  std::vector<uint64_t> counts;
+  double sum = 0;
+  histogram.Collect(&counts, &sum);
+  uint64_t total = 0;
+  for (uint64_t count : counts) total += count;
+  EXPECT_EQ(total, num_threads * num_values);
+  EXPECT_DOUBLE_EQ(sum, num_threads * num_values);
+}
+
+TEST(MetricsTest, RenderTest) {
+  MetricsRegistry registry;
+  Histogram* histogram = registry.GetHistogram("latency_ms", "help", {1, 10});
+  EXPECT_EQ(registry.GetHistogram("latency_ms", "help", {1, 10}), histogram);
+  histogram->Observe(5);
+  registry.GetGauge("sessions", "active sessions")->Add(2);
+  registry.SetGaugeCallback("queue_depth", "queue", []() { return 3.0; });
+  EXPECT_EQ(registry.Render(),
+            "# HELP latency_ms help\n"
+            "# TYPE latency_ms histogram\n"
+            "latency_ms_bucket{le=\"1\"} 0\n"
+            "latency_ms_bucket{le=\"10\"} 1\n"
+            "latency_ms_bucket{le=\"+Inf\"} 1\n"
+            "latency_ms_sum 5\n"
+            "latency_ms_count 1\n"
+            "# HELP queue_depth queue\n"
+            "# TYPE queue_depth gauge\n"
+            "queue_depth 3\n"
+            "# HELP sessions active sessions\n"
+            "# TYPE sessions gauge\n"
+            "sessions 2\n");
+}
+
+}  // namespace wenet
@@ -0,0 +1,162 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/model_registry.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+TEST(ModelRegistryTest, ParseManifestTest) {
+  std::vector<ModelSpec> specs;
+  EXPECT_TRUE(ParseModelManifest(
+      "# name key=value ...\n"
+      "zh model_path=zh.zip dict_path=words.txt\n"
+      "\n"
+      "  en model_path=en.zip language_type=1  \n",
+      &specs));
+  ASSERT_EQ(specs.size(), 2);
+  EXPECT_EQ(specs[0].name, "zh");
+  EXPECT_EQ(specs[0].Get("model_path"), "zh.zip");
+  EXPECT_EQ(specs[0].Get("dict_path"), "words.txt");
+  EXPECT_EQ(specs[0].Get("unit_path", "none"), "none");
+  EXPECT_EQ(specs[1].name, "en");
+  EXPECT_EQ(specs[1].Get("language_type"), "1");
+
+  EXPECT_FALSE(ParseModelManifest("zh model_path\n", &specs));
+  EXPECT_FALSE(ParseModelManifest("zh =zh.zip\n", &specs));
+  EXPECT_FALSE(ParseModelManifest("zh a=1\nzh a=2\n", &specs));
+}
+
+TEST(ModelRegistryTest, ResourceCacheTest) {
+  ResourceCache cache;
+  int num_loads = 0;
+  std::function<std::shared_ptr<std::string>()> load = [&num_loads]() {
+    ++num_loads;
+    return std::make_shared<std::string>("words");
+  };
+  auto a = cache.Get<std::string>("dict:words.txt", load);
+  auto b = cache.Get<std::string>("dict:words.txt", load);
+  EXPECT_EQ(a, b);
+  EXPECT_EQ(num_loads, 1);
+  // Freed with the last user, and loaded again then
+  a = nullptr;
+  b = nullptr;
+  auto c = cache.Get<std::string>("dict:words.txt", load);
+  EXPECT_EQ(num_loads, 2);
+}
+
+TEST(ModelRegistryTest, ResourceCacheConcurrentTest) {
+  ResourceCache cache;
+  std::atomic<int> num_loads{0};
+  std::atomic<int> num_running{0};
+  std::atomic<bool> overlapped{false};
+  std::function<std::shared_ptr<std::string>()> load = [&]() {
+    ++num_loads;
+    if (++num_running > 1) overlapped = true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    --num_running;
+    return std::make_shared<std::string>("words");
+  };
+  // The same key is loaded once, the different keys at the same time
+  std::vector<std::shared_ptr<std::string>> values(4);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&, i]() {
+      values[i] = cache.Get<std::string>(i < 2 ? "fst" : "dict", load);
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  EXPECT_EQ(num_loads.load(), 2);
+  EXPECT_TRUE(overlapped.load());
+  EXPECT_EQ(values[0], values[1]);
+  EXPECT_EQ(values[2], values[3]);
+  EXPECT_NE(values[0], values[2]);
+}
+
+class ModelRegistryManifestTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    path_ = ::testing::TempDir() + "model_registry_test_manifest";
+    // The post processor of the fake resource is shared by the paths
+    registry_.reset(new ModelRegistry(
+        [this](const ModelSpec& spec, ResourceCache* cache) {
+          ++num_loads_;
+          auto resource = std::make_shared<DecodeResource>();
+          std::function<std::shared_ptr<PostProcessor>()> load = []() {
+            return std::make_shared<PostProcessor>(PostProcessOptions());
+          };
+          resource->post_processor = cache->Get<PostProcessor>(
+              "post_processor:" + spec.Get("dict_path"), load);
+          return resource;
+        }));
+  }
+
+  void WriteManifest(const std::string& text) {
+    std::ofstream os(path_);
+    os << text;
+  }
+
+  std::string path_;
+  int num_loads_ = 0;
+  std::unique_ptr<ModelRegistry> registry_;
+};
+
+TEST_F(ModelRegistryManifestTest, LoadTest) {
+  WriteManifest("zh dict_path=words.txt\nen dict_path=words.txt\n");
+  ASSERT_TRUE(registry_->LoadManifest(path_));
+  EXPECT_EQ(num_loads_, 2);
+  EXPECT_EQ(registry_->default_name(), "zh");
+  EXPECT_EQ(registry_->Get(), registry_->Get("zh"));
+  EXPECT_EQ(registry_->Get("fr"), nullptr);
+  EXPECT_EQ(registry_->names(), std::vector<std::string>({"en", "zh"}));
+  // The components of the same paths are shared
+  EXPECT_EQ(registry_->Get("zh")->post_processor,
+            registry_->Get("en")->post_processor);
+}
+
+TEST_F(ModelRegistryManifestTest, ReloadTest) {
+  WriteManifest("zh dict_path=zh.txt\nen dict_path=en.txt\n");
+  ASSERT_TRUE(registry_->LoadManifest(path_));
+  // A running session of the old version
+  std::shared_ptr<DecodeResource> old_zh = registry_->Get("zh");
+  std::shared_ptr<DecodeResource> old_en = registry_->Get("en");
+
+  // Only the changed model is reloaded, the removed one is unregistered
+  WriteManifest("zh dict_path=zh2.txt\n");
+  ASSERT_TRUE(registry_->LoadManifest(path_));
+  EXPECT_EQ(num_loads_, 3);
+  EXPECT_EQ(registry_->version("zh"), 2);
+  EXPECT_NE(registry_->Get("zh"), old_zh);
+  EXPECT_EQ(registry_->Get("en"), nullptr);
+  EXPECT_EQ(registry_->version("en"), 0);
+  EXPECT_NE(old_zh->post_processor, nullptr);
+
+  // The same spec is not reloaded, and a bad manifest keeps the old models
+  ASSERT_TRUE(registry_->LoadManifest(path_));
+  EXPECT_EQ(num_loads_, 3);
+  WriteManifest("zh dict_path\n");
+  EXPECT_FALSE(registry_->LoadManifest(path_));
+  EXPECT_EQ(registry_->version("zh"), 2);
+}
+
+}  // namespace wenet
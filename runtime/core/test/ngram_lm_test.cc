@@ -0,0 +1,114 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "utils/ngram_lm.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+// Words 1, 2, 3, <s> = 4 and </s> = 5
+static const int kBos = 4;
+static const int kEos = 5;
+static const float kUnk = -20;
+
+static std::vector<wenet::NgramLm::NGram> MakeNGrams() {
+  std::vector<wenet::NgramLm::NGram> ngrams = {
+      {{4}, -99, -0.5},
+      {{1}, std::log(0.5f), -0.2},
+      {{2}, std::log(0.3f), -0.3},
+      {{3}, std::log(0.1f), -0.1},
+      {{5}, std::log(0.1f), 0},
+      {{4, 1}, std::log(0.6f), -0.4},
+      {{1, 2}, std::log(0.7f), -0.3},
+      {{2, 3}, std::log(0.4f), 0},
+      {{4, 1, 2}, std::log(0.9f), 0},
+      // The context 3 3 is not in the LM
+      {{3, 3, 3}, std::log(0.9f), 0},
+  };
+  return ngrams;
+}
+
+TEST(NgramLmTest, ScoreTest) {
+  auto lm = wenet::NgramLm::Build(MakeNGrams(), kBos, kEos, kUnk);
+  ASSERT_NE(lm, nullptr);
+  EXPECT_EQ(lm->order(), 3);
+  EXPECT_EQ(lm->num_ngrams(), 9);
+
+  int state = lm->BeginState();
+  // <s> 1
+  EXPECT_NEAR(lm->Score(state, 1, &state), std::log(0.6f), 1e-5);
+  // <s> 1 2
+  EXPECT_NEAR(lm->Score(state, 2, &state), std::log(0.9f), 1e-5);
+  // 1 2 3 backs off to 2 3
+  EXPECT_NEAR(lm->Score(state, 3, &state), -0.3 + std::log(0.4f), 1e-5);
+  // 2 3 1 backs off to 3 1 and then 1
+  int state_1 = 0;
+  EXPECT_NEAR(lm->Score(state, 1, &state_1), -0.1 + std::log(0.5f), 1e-5);
+  // 2 3 </s> backs off to </s>
+  EXPECT_NEAR(lm->FinalScore(state), -0.1 + std::log(0.1f), 1e-5);
+  // 1 and then 1 2
+  state = 0;
+  lm->Score(state, 1, &state);
+  EXPECT_NEAR(lm->Score(state, 2, &state), std::log(0.7f), 1e-5);
+  // An unknown word backs off through 1 2 and 2 to the root
+  EXPECT_NEAR(lm->Score(state, 7, &state), -0.6 + kUnk, 1e-5);
+  EXPECT_EQ(state, 0);
+}
+
+TEST(NgramLmTest, ReadWriteTest) {
+  auto lm = wenet::NgramLm::Build(MakeNGrams(), kBos, kEos, kUnk);
+  std::string path = ::testing::TempDir() + "/ngram_lm_test.bin";
+  ASSERT_TRUE(lm->Write(path));
+  auto loaded = wenet::NgramLm::Read(path);
+  ASSERT_NE(loaded, nullptr);
+  EXPECT_EQ(loaded->num_ngrams(), lm->num_ngrams());
+  std::vector<std::vector<int>> inputs = {
+      {1, 2, 3, 1}, {3, 3, 3}, {2, 1, 7, 2}, {1, 1, 1}};
+  for (const auto& input : inputs) {
+    int state = lm->BeginState();
+    int loaded_state = loaded->BeginState();
+    for (int word : input) {
+      EXPECT_FLOAT_EQ(lm->Score(state, word, &state),
+                      loaded->Score(loaded_state, word, &loaded_state));
+      EXPECT_EQ(state, loaded_state);
+    }
+    EXPECT_FLOAT_EQ(lm->FinalScore(state), loaded->FinalScore(loaded_state));
+  }
+  EXPECT_EQ(wenet::NgramLm::Read(path + ".missing"), nullptr);
+}
+
+TEST(NgramLmTest, QuantizeTest) {
+  // More distinct probabilities than the codebook size
+  std::vector<wenet::NgramLm::NGram> ngrams;
+  std::vector<float> probs;
+  srand(0);
+  for (int i = 1; i <= 5000; ++i) {
+    probs.push_back(-10.0f * rand() / RAND_MAX);
+    ngrams.push_back({{i}, probs.back(), 0});
+  }
+  auto lm = wenet::NgramLm::Build(ngrams, -1, -1, kUnk);
+  float max_error = 0;
+  for (int i = 1; i <= 5000; ++i) {
+    int state = 0;
+    float error = std::fabs(lm->Score(0, i, &state) - probs[i - 1]);
+    max_error = std::max(max_error, error);
+  }
+  EXPECT_LT(max_error, 0.05);
+}
@@ -0,0 +1,80 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/partial_result_filter.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+TEST(PartialResultFilterTest, DefaultTest) {
+  PartialResultFilter filter(PartialResultOptions{});
+  int num_stable = 0;
+  std::string suffix;
+  EXPECT_TRUE(filter.Filter("a", 0, &num_stable, &suffix));
+  EXPECT_TRUE(filter.Filter("a", 0, &num_stable, &suffix));
+}
+
+TEST(PartialResultFilterTest, ChangedOnlyTest) {
+  PartialResultOptions opts;
+  opts.changed_only = true;
+  PartialResultFilter filter(opts);
+  int num_stable = 0;
+  std::string suffix;
+  EXPECT_TRUE(filter.Filter("", 0, &num_stable, &suffix));
+  EXPECT_FALSE(filter.Filter("", 100, &num_stable, &suffix));
+  EXPECT_TRUE(filter.Filter("a", 200, &num_stable, &suffix));
+  EXPECT_FALSE(filter.Filter("a", 300, &num_stable, &suffix));
+  // The first partial result of the next sentence is always sent
+  filter.Reset();
+  EXPECT_TRUE(filter.Filter("a", 400, &num_stable, &suffix));
+}
+
+TEST(PartialResultFilterTest, MinIntervalTest) {
+  PartialResultOptions opts;
+  opts.min_interval_ms = 500;
+  PartialResultFilter filter(opts);
+  int num_stable = 0;
+  std::string suffix;
+  EXPECT_TRUE(filter.Filter("a", 0, &num_stable, &suffix));
+  EXPECT_FALSE(filter.Filter("ab", 200, &num_stable, &suffix));
+  EXPECT_FALSE(filter.Filter("abc", 499, &num_stable, &suffix));
+  EXPECT_TRUE(filter.Filter("abc", 500, &num_stable, &suffix));
+  EXPECT_FALSE(filter.Filter("abcd", 600, &num_stable, &suffix));
+}
+
+TEST(PartialResultFilterTest, IncrementalTest) {
+  PartialResultOptions opts;
+  opts.incremental = true;
+  PartialResultFilter filter(opts);
+  int num_stable = -1;
+  std::string suffix;
+  EXPECT_TRUE(filter.Filter("今天", 0, &num_stable, &suffix));
+  EXPECT_EQ(num_stable, 0);
+  EXPECT_EQ(suffix, "今天");
+  EXPECT_TRUE(filter.Filter("今天天气", 100, &num_stable, &suffix));
+  EXPECT_EQ(num_stable, 2);
+  EXPECT_EQ(suffix, "天气");
+  // The prefix is compared by chars, not bytes
+  EXPECT_TRUE(filter.Filter("今天夫", 200, &num_stable, &suffix));
+  EXPECT_EQ(num_stable, 2);
+  EXPECT_EQ(suffix, "夫");
+  EXPECT_TRUE(filter.Filter("今", 300, &num_stable, &suffix));
+  EXPECT_EQ(num_stable, 1);
+  EXPECT_EQ(suffix, "");
+}
+
+}  // namespace wenet
@@ -14,6 +14,7 @@
 
 #include "post_processor/post_processor.h"
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -113,3 +114,62 @@ TEST(PostProcessorTest, ProcessSpacekIndoEuropeanTest) {
               result_uppercase[i]);
   }
 }
+
+TEST(PostProcessorTest, ProcessSpaceBlankTest) {
+  wenet::PostProcessOptions opts;
+  wenet::PostProcessor post_processor(opts);
+
+  // The ▁ at the head or the tail, and the consecutive ones, are dropped
+  EXPECT_EQ(post_processor.ProcessSpace(""), "");
+  EXPECT_EQ(post_processor.ProcessSpace(" \t "), "");
+  EXPECT_EQ(post_processor.ProcessSpace("▁▁"), "");
+  EXPECT_EQ(post_processor.ProcessSpace("▁▁He's▁▁OK▁"), "he's ok");
+  // Only the english words are separated by spaces
+  EXPECT_EQ(post_processor.ProcessSpace(" a\tb 中 c d 文 1 e"), "a b中c d文1e");
+  EXPECT_EQ(post_processor.ProcessSpace(" 中▁a b c"), "中 ab c");
+}
+
+// ITN fst of the bytes, which maps "一" to "1" and "二" to "2", and keeps
+// the other bytes at a cost
+static std::shared_ptr<fst::StdVectorFst> BuildItnFst() {
+  auto itn_fst = std::make_shared<fst::StdVectorFst>();
+  int start = itn_fst->AddState();
+  itn_fst->SetStart(start);
+  itn_fst->SetFinal(start, fst::StdArc::Weight::One());
+  for (int byte = 1; byte < 256; ++byte) {
+    itn_fst->AddArc(start, fst::StdArc(byte, byte, 1.0, start));
+  }
+  // 一 is E4 B8 80, 二 is E4 BA 8C
+  int e4 = itn_fst->AddState();
+  int b8 = itn_fst->AddState();
+  int ba = itn_fst->AddState();
+  itn_fst->AddArc(start, fst::StdArc(0xE4, 0, 0.0, e4));
+  itn_fst->AddArc(e4, fst::StdArc(0xB8, 0, 0.0, b8));
+  itn_fst->AddArc(b8, fst::StdArc(0x80, '1', 0.0, start));
+  itn_fst->AddArc(e4, fst::StdArc(0xBA, 0, 0.0, ba));
+  itn_fst->AddArc(ba, fst::StdArc(0x8C, '2', 0.0, start));
+  fst::ArcSort(itn_fst.get(), fst::ILabelCompare<fst::StdArc>());
+  return itn_fst;
+}
+
+TEST(PostProcessorTest, InverseTNTest) {
+  auto resource = std::make_shared<wenet::PostProcessResource>();
+  resource->itn_fst = BuildItnFst();
+  wenet::PostProcessOptions opts;
+  opts.itn_cache_size = 1;
+  wenet::PostProcessor post_processor(opts, resource);
+
+  EXPECT_EQ(post_processor.InverseTN("一二三"), "12三");
+  EXPECT_EQ(post_processor.InverseTN(""), "");
+  // The cached ones are the same
+  EXPECT_EQ(post_processor.InverseTN("二一"), "21");
+  EXPECT_EQ(post_processor.InverseTN("二一"), "21");
+  EXPECT_EQ(post_processor.InverseTN("一二三"), "12三");
+  // Only the final results are normalized
+  EXPECT_EQ(post_processor.Process(" 一 二", false), "一二");
+  EXPECT_EQ(post_processor.Process(" 一 二", true), "12");
+
+  // No itn fst
+  wenet::PostProcessor no_itn(opts);
+  EXPECT_EQ(no_itn.Process("一二", true), "一二");
+}
@@ -0,0 +1,89 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "frontend/resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "utils/state_io.h"
+
+namespace wenet {
+
+static std::vector<float> Sine(float freq, int sample_rate, int n) {
+  std::vector<float> wav(n);
+  for (int i = 0; i < n; ++i) {
+    wav[i] = 1000 * std::sin(2 * M_PI * freq * i / sample_rate);
+  }
+  return wav;
+}
+
+TEST(ResamplerTest, SineTest) {
+  for (int input_rate : {8000, 44100, 48000}) {
+    Resampler resampler(input_rate, 16000);
+    std::vector<float> input = Sine(440, input_rate, input_rate);
+    std::vector<float> output;
+    resampler.Resample(input.data(), input.size(), true, &output);
+    ASSERT_EQ(output.size(), 16000) << input_rate;
+    std::vector<float> expected = Sine(440, 16000, 16000);
+    // Skip the edges, where the filter sees the zeros around the stream
+    for (int i = 100; i < 15900; ++i) {
+      EXPECT_NEAR(output[i], expected[i], 10) << input_rate << " " << i;
+    }
+  }
+}
+
+TEST(ResamplerTest, StreamingTest) {
+  std::vector<float> input = Sine(1000, 44100, 44100);
+  Resampler ref(44100, 16000), resampler(44100, 16000);
+  std::vector<float> expected, output;
+  ref.Resample(input.data(), input.size(), true, &expected);
+  // Pieces shorter and longer than the filter
+  const int pieces[] = {1, 7, 100, 441, 4410};
+  size_t start = 0;
+  for (int i = 0; start < input.size(); ++i) {
+    int n = std::min<size_t>(pieces[i % 5], input.size() - start);
+    bool last = start + n == input.size();
+    resampler.Resample(input.data() + start, n, last, &output);
+    start += n;
+  }
+  EXPECT_EQ(output, expected);
+}
+
+TEST(ResamplerTest, SaveRestoreTest) {
+  std::vector<float> input = Sine(1000, 44100, 44100);
+  Resampler ref(44100, 16000), first(44100, 16000), second(44100, 16000);
+  std::vector<float> expected, output;
+  ref.Resample(input.data(), input.size(), true, &expected);
+  // The stream is moved to another resampler in the middle
+  const int split = 10007;
+  first.Resample(input.data(), split, false, &output);
+  std::string state;
+  StateWriter writer(&state);
+  first.SaveState(&writer);
+  StateReader truncated(state.data(), state.size() - 1);
+  EXPECT_FALSE(second.RestoreState(&truncated));
+  StateReader reader(state);
+  ASSERT_TRUE(second.RestoreState(&reader));
+  EXPECT_EQ(reader.remaining(), 0);
+  second.Resample(input.data() + split, input.size() - split, true, &output);
+  EXPECT_EQ(output, expected);
+}
+
+}  // namespace wenet
@@ -0,0 +1,85 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/result_cache.h"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "decoder/decode_metrics.h"
+
+namespace wenet {
+
+static std::vector<DecodeResult> MakeResult(const std::string& sentence) {
+  DecodeResult path;
+  path.score = -1.0f;
+  path.sentence = sentence;
+  path.word_pieces.emplace_back(sentence, 0, 100);
+  return {path};
+}
+
+TEST(ResultCacheTest, KeyTest) {
+  std::vector<int16_t> pcm(16003);
+  for (size_t i = 0; i < pcm.size(); ++i) pcm[i] = i * 31 % 20000;
+  uint64_t key = ResultCache::Key(pcm.data(), pcm.size(), 16000, 1);
+  EXPECT_EQ(key, ResultCache::Key(pcm.data(), pcm.size(), 16000, 1));
+  // The sample rate, the options and every sample are of the key, the
+  // last samples are not of a whole 8 bytes word
+  EXPECT_NE(key, ResultCache::Key(pcm.data(), pcm.size(), 8000, 1));
+  EXPECT_NE(key, ResultCache::Key(pcm.data(), pcm.size(), 16000, 2));
+  EXPECT_NE(key, ResultCache::Key(pcm.data(), pcm.size() - 1, 16000, 1));
+  pcm.back() += 1;
+  EXPECT_NE(key, ResultCache::Key(pcm.data(), pcm.size(), 16000, 1));
+}
+
+TEST(ResultCacheTest, LruTest) {
+  DecodeMetrics* metrics = DecodeMetrics::Get();
+  int64_t hits = metrics->result_cache_hits->value();
+  int64_t misses = metrics->result_cache_misses->value();
+  std::vector<DecodeResult> result = MakeResult("hello");
+  // About two results
+  ResultCache probe(1 << 20);
+  probe.Insert(0, result);
+  ResultCache cache(probe.bytes() * 2 + probe.bytes() / 2);
+
+  std::vector<DecodeResult> out;
+  EXPECT_FALSE(cache.Lookup(1, &out));
+  cache.Insert(1, MakeResult("one"));
+  cache.Insert(2, MakeResult("two"));
+  ASSERT_TRUE(cache.Lookup(1, &out));
+  ASSERT_EQ(out.size(), 1);
+  EXPECT_EQ(out[0].sentence, "one");
+  ASSERT_EQ(out[0].word_pieces.size(), 1);
+  EXPECT_EQ(out[0].word_pieces[0].end, 100);
+  // 2 is the least recently used one
+  cache.Insert(3, MakeResult("three"));
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_LE(cache.bytes(), probe.bytes() * 2 + probe.bytes() / 2);
+  EXPECT_FALSE(cache.Lookup(2, &out));
+  EXPECT_TRUE(cache.Lookup(1, &out));
+  ASSERT_TRUE(cache.Lookup(3, &out));
+  EXPECT_EQ(out[0].sentence, "three");
+  EXPECT_EQ(metrics->result_cache_hits->value() - hits, 3);
+  EXPECT_EQ(metrics->result_cache_misses->value() - misses, 2);
+
+  // Too large to be cached
+  ResultCache tiny(1);
+  tiny.Insert(1, result);
+  EXPECT_EQ(tiny.size(), 0);
+  EXPECT_EQ(tiny.bytes(), 0);
+}
+
+}  // namespace wenet
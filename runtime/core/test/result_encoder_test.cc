@@ -0,0 +1,86 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/result_encoder.h"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+// The expected bytes are checked by
+// protoc --decode=wenet.Response -I grpc wenet.proto
+TEST(ResultEncoderTest, EncodeResultTest) {
+  std::vector<DecodeResult> results(2);
+  results[0].sentence = "hi";
+  results[0].word_pieces.emplace_back("hi", 0, 960);
+  results[1].sentence = "he";
+  std::string out;
+  EncodeResult(ResultType::kFinalResult, results, 1, true, &out);
+  // type: final_result
+  // nbest { sentence: "hi" wordpieces { word: "hi" end: 960 } }
+  EXPECT_EQ(out, std::string("\x10\x02\x1a\x0d\x0a\x02hi\x12\x07\x0a\x02hi"
+                             "\x18\xc0\x07", 17));
+
+  EncodeResult(ResultType::kPartialResult, results, 2, false, &out);
+  // type: partial_result nbest { sentence: "hi" } nbest { sentence: "he" }
+  EXPECT_EQ(out, std::string("\x10\x01\x1a\x04\x0a\x02hi\x1a\x04\x0a\x02he",
+                             14));
+}
+
+TEST(ResultEncoderTest, ConfidenceTest) {
+  std::vector<DecodeResult> results(1);
+  results[0].sentence = "a";
+  results[0].word_pieces.emplace_back("a", 0, 0);
+  results[0].word_pieces[0].confidence = {0.5, 0.25, 0.125};
+  std::string out;
+  EncodeResult(ResultType::kFinalResult, results, 1, true, &out);
+  // type: final_result nbest { sentence: "a" wordpieces { word: "a"
+  // max_confidence: 0.5 mean_confidence: 0.25 min_confidence: 0.125 } }
+  EXPECT_EQ(out, std::string("\x10\x02\x1a\x17\x0a\x01" "a\x12\x12\x0a\x01"
+                             "a\x25\x00\x00\x00\x3f\x2d\x00\x00\x80\x3e"
+                             "\x35\x00\x00\x00\x3e", 27));
+}
+
+TEST(ResultEncoderTest, NegativeTest) {
+  std::vector<DecodeResult> results(1);
+  results[0].word_pieces.emplace_back("", -1, 0);
+  std::string out;
+  EncodeResult(ResultType::kServerReady, results, 1, true, &out);
+  // nbest { wordpieces { start: -1 } }
+  EXPECT_EQ(out, std::string("\x1a\x0d\x12\x0b\x10\xff\xff\xff\xff\xff\xff"
+                             "\xff\xff\xff\x01", 15));
+}
+
+TEST(ResultEncoderTest, EncodeIncrementalResultTest) {
+  std::string out;
+  EncodeIncrementalResult(3, "ok", &out);
+  // type: partial_result num_stable: 3 suffix: "ok"
+  EXPECT_EQ(out, std::string("\x10\x01\x20\x03\x2a\x02ok", 8));
+}
+
+TEST(ResultEncoderTest, AppendLatticeTest) {
+  std::vector<DecodeResult> results;
+  std::string out;
+  EncodeResult(ResultType::kFinalResult, results, 1, true, &out);
+  AppendLattice("", &out);
+  EXPECT_EQ(out, std::string("\x10\x02", 2));
+  // type: final_result lattice: "\000\326"
+  AppendLattice(std::string("\x00\xd6", 2), &out);
+  EXPECT_EQ(out, std::string("\x10\x02\x32\x02\x00\xd6", 6));
+}
+
+}  // namespace wenet
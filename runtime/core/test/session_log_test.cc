@@ -0,0 +1,102 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/session_log.h"
+
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+TEST(SessionLogTest, ReadWriteTest) {
+  std::string path = ::testing::TempDir() + "/session_log_test.wslog";
+  std::string start = "{\"signal\": \"start\", \"nbest\": 2}";
+  std::vector<int16_t> pcm(300, 7);
+  // Over 127 bytes, the size takes two varint bytes
+  std::string audio(reinterpret_cast<const char*>(pcm.data()),
+                    pcm.size() * sizeof(int16_t));
+  {
+    SessionLogWriter writer;
+    ASSERT_TRUE(writer.Open(path));
+    writer.Write(SessionEvent::kText, start);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    writer.Write(SessionEvent::kAudio, audio);
+    writer.Write(SessionEvent::kResult, std::string());
+  }
+  SessionLogReader reader;
+  ASSERT_TRUE(reader.Open(path));
+  SessionRecord record;
+  ASSERT_TRUE(reader.Read(&record));
+  EXPECT_EQ(record.event, SessionEvent::kText);
+  EXPECT_EQ(record.data, start);
+  int64_t start_us = record.time_us;
+  ASSERT_TRUE(reader.Read(&record));
+  EXPECT_EQ(record.event, SessionEvent::kAudio);
+  EXPECT_EQ(record.data, audio);
+  EXPECT_GE(record.time_us - start_us, 5000);
+  int64_t audio_us = record.time_us;
+  ASSERT_TRUE(reader.Read(&record));
+  EXPECT_EQ(record.event, SessionEvent::kResult);
+  EXPECT_TRUE(record.data.empty());
+  EXPECT_GE(record.time_us, audio_us);
+  EXPECT_FALSE(reader.Read(&record));
+}
+
+TEST(SessionLogTest, TruncatedTest) {
+  std::string path = ::testing::TempDir() + "/session_log_truncated.wslog";
+  {
+    SessionLogWriter writer;
+    ASSERT_TRUE(writer.Open(path));
+    writer.Write(SessionEvent::kText, "start");
+    writer.Write(SessionEvent::kAudio, std::string(100, 'a'));
+  }
+  // Cut the data of the last record
+  std::string content;
+  {
+    std::ifstream is(path, std::ios::binary);
+    content.assign(std::istreambuf_iterator<char>(is),
+                   std::istreambuf_iterator<char>());
+  }
+  {
+    std::ofstream os(path, std::ios::binary | std::ios::trunc);
+    os.write(content.data(), content.size() - 10);
+  }
+  SessionLogReader reader;
+  ASSERT_TRUE(reader.Open(path));
+  SessionRecord record;
+  ASSERT_TRUE(reader.Read(&record));
+  EXPECT_EQ(record.data, "start");
+  EXPECT_FALSE(reader.Read(&record));
+}
+
+TEST(SessionLogTest, RecorderTest) {
+  SessionRecorder recorder(::testing::TempDir(), 2);
+  std::unique_ptr<SessionLogWriter> first = recorder.NewSession();
+  ASSERT_NE(first, nullptr);
+  EXPECT_EQ(recorder.NewSession(), nullptr);
+  std::unique_ptr<SessionLogWriter> third = recorder.NewSession();
+  ASSERT_NE(third, nullptr);
+  EXPECT_NE(first->path(), third->path());
+
+  SessionLogReader reader;
+  EXPECT_FALSE(reader.Open(::testing::TempDir() + "/no_such.wslog"));
+}
+
+}  // namespace wenet
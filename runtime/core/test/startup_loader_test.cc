@@ -0,0 +1,90 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/startup_loader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+static void TestDependencies(int num_threads) {
+  StartupLoader loader(num_threads);
+  std::mutex mutex;
+  std::vector<std::string> order;
+  auto step = [&](const std::string& name) {
+    return [&, name]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(name);
+    };
+  };
+  loader.Add("model", step("model"));
+  loader.Add("symbol_table", step("symbol_table"));
+  loader.Add("fst", step("fst"));
+  loader.Add("context_graph", step("context_graph"), {"symbol_table"});
+  loader.Add("model_pool", step("model_pool"), {"model"});
+  loader.Run();
+  ASSERT_EQ(order.size(), 5);
+  auto position = [&](const std::string& name) {
+    return std::find(order.begin(), order.end(), name) - order.begin();
+  };
+  EXPECT_LT(position("symbol_table"), position("context_graph"));
+  EXPECT_LT(position("model"), position("model_pool"));
+}
+
+TEST(StartupLoaderTest, SerialTest) { TestDependencies(1); }
+
+TEST(StartupLoaderTest, DependencyTest) { TestDependencies(4); }
+
+TEST(StartupLoaderTest, ParallelTest) {
+  StartupLoader loader(3);
+  std::atomic<int> num_running{0};
+  std::atomic<int> max_running{0};
+  for (int i = 0; i < 3; ++i) {
+    loader.Add("step" + std::to_string(i), [&]() {
+      int running = ++num_running;
+      int max = max_running.load();
+      while (running > max &&
+             !max_running.compare_exchange_weak(max, running)) {
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      --num_running;
+    });
+  }
+  loader.Run();
+  // The independent steps overlap
+  EXPECT_GT(max_running.load(), 1);
+}
+
+TEST(StartupLoaderTest, ExceptionTest) {
+  StartupLoader loader(2);
+  bool dependent_run = false;
+  loader.Add("fst", []() { throw std::runtime_error("no fst"); });
+  loader.Add("symbol_table", []() {});
+  loader.Add("compose", [&]() { dependent_run = true; }, {"fst"});
+  EXPECT_THROW(loader.Run(), std::runtime_error);
+  EXPECT_FALSE(dependent_run);
+}
+
+}  // namespace wenet
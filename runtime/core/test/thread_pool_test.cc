@@ -0,0 +1,122 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/thread_pool.h"
+
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+TEST(ThreadPoolTest, SubmitTest) {
+  ThreadPool pool(4);
+  EXPECT_EQ(pool.num_threads(), 4);
+  std::vector<std::future<int>> futures;
+  for (int i = 0; i < 100; ++i) {
+    futures.push_back(pool.Submit([i]() { return i * i; }));
+  }
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(futures[i].get(), i * i);
+  }
+  // The exception is in the future, the pool goes on
+  std::future<void> error =
+      pool.Submit([]() { throw std::runtime_error("error"); });
+  EXPECT_THROW(error.get(), std::runtime_error);
+  pool.Post([]() { throw std::runtime_error("logged"); });
+  EXPECT_EQ(pool.Submit([]() { return 1; }).get(), 1);
+}
+
+TEST(ThreadPoolTest, PriorityTest) {
+  ThreadPool pool(1);
+  // Block the only thread until all the tasks are queued
+  std::promise<void> running;
+  std::promise<void> start;
+  std::shared_future<void> started = start.get_future().share();
+  pool.Post([&running, started]() {
+    running.set_value();
+    started.wait();
+  });
+  running.get_future().wait();
+  std::mutex mutex;
+  std::vector<int> order;
+  for (int i = 0; i < 3; ++i) {
+    for (TaskPriority priority :
+         {TaskPriority::kLow, TaskPriority::kNormal, TaskPriority::kHigh}) {
+      pool.Post(
+          [&mutex, &order, priority]() {
+            std::lock_guard<std::mutex> lock(mutex);
+            order.push_back(static_cast<int>(priority));
+          },
+          priority);
+    }
+  }
+  EXPECT_EQ(pool.num_queued(), 9);
+  start.set_value();
+  pool.Drain();
+  EXPECT_THAT(order, ::testing::ElementsAre(0, 0, 0, 1, 1, 1, 2, 2, 2));
+}
+
+TEST(ThreadPoolTest, DrainTest) {
+  // The tasks post more tasks, which are queued on their own workers and
+  // stolen by the others, Drain() waits for all of them
+  const int num_tasks = 8;
+  const int fanout = 500;
+  ThreadPool pool(4);
+  std::atomic<int> num_done{0};
+  std::mutex mutex;
+  std::set<std::thread::id> threads;
+  for (int i = 0; i < num_tasks; ++i) {
+    pool.Post([&]() {
+      for (int j = 0; j < fanout; ++j) {
+        pool.Post([&]() {
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.insert(std::this_thread::get_id());
+          }
+          std::this_thread::sleep_for(std::chrono::microseconds(10));
+          ++num_done;
+        });
+      }
+      ++num_done;
+    });
+  }
+  pool.Drain();
+  EXPECT_EQ(num_done, num_tasks * (fanout + 1));
+  EXPECT_EQ(pool.num_queued(), 0);
+  EXPECT_GT(threads.size(), 1);
+  // The pool is still usable after the drain
+  EXPECT_EQ(pool.Submit([]() { return 2; }).get(), 2);
+}
+
+TEST(ThreadPoolTest, DestructorTest) {
+  // The queued tasks are run before the threads stop
+  std::atomic<int> num_done{0};
+  {
+    ThreadPool pool(2);
+    for (int i = 0; i < 1000; ++i) {
+      pool.Post([&num_done]() { ++num_done; });
+    }
+  }
+  EXPECT_EQ(num_done, 1000);
+}
+
+}  // namespace wenet
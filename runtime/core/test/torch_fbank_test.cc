@@ -0,0 +1,81 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/torch_fbank.h"
+
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+TEST(TorchFbankTest, ParityTest) {
+  Fbank fbank(80, 16000, 400, 160);
+  TorchFbankComputer computer(fbank, "cpu");
+
+  // Streams of different lengths, int16 and float
+  std::default_random_engine g(0);
+  std::uniform_int_distribution<int> sample(-1000, 1000);
+  std::vector<std::vector<int16_t>> int16_waves = {
+      std::vector<int16_t>(400), std::vector<int16_t>(1000),
+      std::vector<int16_t>(399)};
+  std::vector<float> float_wave(3200);
+  for (auto& wave : int16_waves) {
+    for (auto& x : wave) x = sample(g);
+  }
+  for (auto& x : float_wave) x = sample(g);
+
+  std::vector<FbankRequest> requests(4);
+  std::vector<std::vector<float>> feats(4);
+  int num_frames = 0;
+  for (int i = 0; i < 4; ++i) {
+    FbankRequest& request = requests[i];
+    if (i < 3) {
+      request.int16_wave = int16_waves[i].data();
+      request.num_samples = int16_waves[i].size();
+    } else {
+      request.float_wave = float_wave.data();
+      request.num_samples = float_wave.size();
+    }
+    request.stride = 96;
+    int n = fbank.NumFrames(request.num_samples);
+    feats[i].resize(n * request.stride);
+    request.feat = feats[i].data();
+    num_frames += n;
+  }
+  std::vector<const FbankRequest*> batch;
+  for (const auto& request : requests) batch.push_back(&request);
+  computer.Compute(batch, num_frames);
+
+  for (int i = 0; i < 4; ++i) {
+    std::vector<float> wave =
+        i < 3 ? std::vector<float>(int16_waves[i].begin(),
+                                   int16_waves[i].end())
+              : float_wave;
+    std::vector<std::vector<float>> expected;
+    fbank.Compute(wave, &expected);
+    ASSERT_EQ(feats[i].size(), expected.size() * 96);
+    for (size_t j = 0; j < expected.size(); ++j) {
+      for (int k = 0; k < 80; ++k) {
+        EXPECT_NEAR(feats[i][j * 96 + k], expected[j][k], 1e-3)
+            << i << " " << j << " " << k;
+      }
+    }
+  }
+}
+
+}  // namespace wenet
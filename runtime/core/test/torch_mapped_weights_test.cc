@@ -0,0 +1,63 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "decoder/torch_mapped_weights.h"
+
+#include <cstdio>
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "torch/torch.h"
+
+namespace wenet {
+
+TEST(TorchMappedWeightsTest, MapTest) {
+  torch::manual_seed(0);
+  torch::jit::script::Module module("m");
+  module.register_parameter("w", torch::randn({16, 8}), false);
+  module.register_buffer("b", torch::randn({8}));
+  module.define(R"(
+    def forward(self, x):
+        return x @ self.w + self.b
+  )");
+  std::string model_path = ::testing::TempDir() + "/mapped_weights.zip";
+  module.save(model_path);
+  torch::NoGradGuard no_grad;
+  torch::Tensor x = torch::randn({4, 16});
+  torch::Tensor expected = module.forward({x}).toTensor();
+
+  // Written by the first one, only mapped by the second one
+  for (int i = 0; i < 2; ++i) {
+    torch::jit::script::Module loaded = torch::jit::load(model_path);
+    EXPECT_EQ(MapTorchWeights(model_path, &loaded),
+              4096 + 8 * sizeof(float));
+    torch::Tensor w = loaded.attr("w").toTensor();
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(w.data_ptr()) % 4096, 0);
+    EXPECT_TRUE(torch::equal(loaded.forward({x}).toTensor(), expected));
+  }
+
+  // Stale after the model changes
+  module.attr("w").toTensor().mul_(2);
+  module.save(model_path);
+  torch::jit::script::Module loaded = torch::jit::load(model_path);
+  EXPECT_GT(MapTorchWeights(model_path, &loaded), 0);
+  EXPECT_FALSE(torch::equal(loaded.forward({x}).toTensor(), expected));
+  EXPECT_TRUE(torch::equal(loaded.forward({x}).toTensor(),
+                           module.forward({x}).toTensor()));
+  remove(model_path.c_str());
+  remove(MappedWeightsPath(model_path).c_str());
+}
+
+}  // namespace wenet
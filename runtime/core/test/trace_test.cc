@@ -0,0 +1,82 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/trace.h"
+
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "utils/json.h"
+
+namespace wenet {
+
+TEST(TraceTest, ChromeTraceTest) {
+  Tracer* tracer = Tracer::Get();
+  tracer->Clear();
+  { TraceScope scope("disabled"); }
+  tracer->set_enabled(true);
+  const int num_threads = 4;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back([]() {
+      TraceScope outer("outer");
+      for (int j = 0; j < 10; ++j) {
+        TraceScope inner("inner");
+      }
+    });
+  }
+  for (auto& t : threads) t.join();
+  tracer->set_enabled(false);
+
+  json::JSON trace = json::JSON::Load(tracer->ExportChromeTrace());
+  json::JSON& events = trace["traceEvents"];
+  ASSERT_EQ(events.length(), num_threads * 11);
+  std::set<int> tids;
+  for (int i = 0; i < events.length(); ++i) {
+    json::JSON& event = events[i];
+    std::string name = event["name"].ToString();
+    EXPECT_TRUE(name == "outer" || name == "inner") << name;
+    EXPECT_EQ(event["ph"].ToString(), "X");
+    EXPECT_GE(event["dur"].ToFloat(), 0);
+    tids.insert(event["tid"].ToInt());
+  }
+  EXPECT_EQ(tids.size(), num_threads);
+
+  tracer->Clear();
+  EXPECT_EQ(tracer->ExportChromeTrace(), "{\"traceEvents\":[]}");
+}
+
+TEST(TraceTest, RingBufferTest) {
+  Tracer* tracer = Tracer::Get();
+  tracer->Clear();
+  tracer->set_enabled(true);
+  std::thread([tracer]() {
+    for (int i = 0; i < Tracer::kCapacity + 10; ++i) {
+      tracer->Record("event", i * 1000, i * 1000 + 500);
+    }
+  }).join();
+  tracer->set_enabled(false);
+  json::JSON trace = json::JSON::Load(tracer->ExportChromeTrace());
+  json::JSON& events = trace["traceEvents"];
+  // Only the last kCapacity events are kept
+  ASSERT_EQ(events.length(), Tracer::kCapacity);
+  EXPECT_DOUBLE_EQ(events[0]["ts"].ToFloat(), 10);
+  EXPECT_DOUBLE_EQ(events[0]["dur"].ToFloat(), 0.5);
+  tracer->Clear();
+}
+
+}  // namespace wenet
@@ -3,8 +3,31 @@
 
 #include "utils/utils.h"
 
+#ifdef __linux__
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <thread>
 #include <vector>
 
+#include "utils/frame_queue.h"
+#include "utils/huge_pages.h"
+#include "utils/log.h"
+#include "utils/mapped_file.h"
+#include "utils/matrix.h"
+#include "utils/quantized_frames.h"
+#include "utils/shm_audio_ring.h"
+#include "utils/state_io.h"
+#include "utils/string.h"
+#include "utils/thread_budget.h"
+#include "utils/thread_placement.h"
+#include "utils/timer.h"
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -19,3 +42,464 @@ TEST(UtilsTest, TopKTest) {
   EXPECT_THAT(values, Pointwise(FloatNear(1e-8), {10, 9, 8}));
   ASSERT_THAT(indices, ElementsAre(9, 4, 8));
 }
+
+TEST(UtilsTest, TopKSimdTest) {
+  // Random log probs, with ties and the best ones in the tails, compared
+  // with the scalar TopK, and timed as the ctc prefix beam search does
+  const int vocab_size = 5003;
+  const int num_frames = 2000;
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> dist(-20, 0);
+  wenet::Matrix<float> logp(num_frames, vocab_size);
+  for (int t = 0; t < num_frames; ++t) {
+    for (int i = 0; i < vocab_size; ++i) {
+      logp(t, i) = t % 5 == 0 ? -1.0f : dist(rng);
+    }
+    logp(t, vocab_size - 1 - t % 3) = 0.0f;
+  }
+  std::vector<float> values, expected_values;
+  std::vector<int32_t> indices, expected_indices;
+  for (int k : {1, 10, 100}) {
+    for (int t = 0; t < num_frames; ++t) {
+      wenet::TopK(logp.Row(t), vocab_size, k, &values, &indices);
+      wenet::ScalarTopK(logp.Row(t), vocab_size, k, &expected_values,
+                        &expected_indices);
+      ASSERT_EQ(values, expected_values);
+      ASSERT_EQ(indices, expected_indices);
+    }
+  }
+  wenet::TopK(logp.Row(1), 5, 10, &values, &indices);
+  EXPECT_EQ(values.size(), 5);
+
+  const int k = 10;
+  wenet::Timer timer;
+  for (int t = 0; t < num_frames; ++t) {
+    wenet::ScalarTopK(logp.Row(t), vocab_size, k, &values, &indices);
+  }
+  int scalar_ms = timer.Elapsed();
+  timer.Reset();
+  for (int t = 0; t < num_frames; ++t) {
+    wenet::TopK(logp.Row(t), vocab_size, k, &values, &indices);
+  }
+  LOG(INFO) << "TopK of " << num_frames << " frames, vocab " << vocab_size
+            << ": scalar " << scalar_ms << " ms, simd " << timer.Elapsed()
+            << " ms";
+}
+
+TEST(UtilsTest, ParseCpuListTest) {
+  using ::testing::ElementsAre;
+  EXPECT_THAT(wenet::ParseCpuList("0-3,8,10-11\n"),
+              ElementsAre(0, 1, 2, 3, 8, 10, 11));
+  EXPECT_TRUE(wenet::ParseCpuList("").empty());
+}
+
+TEST(UtilsTest, ThreadBudgetTest) {
+  wenet::ThreadBudget budget(8, 4);
+  {
+    // A lone call is capped by the threads per call
+    auto lone = budget.Acquire();
+    EXPECT_EQ(lone.threads(), 4);
+    auto second = budget.Acquire();
+    EXPECT_EQ(second.threads(), 4);
+    auto third = budget.Acquire();
+    EXPECT_EQ(third.threads(), 2);
+    std::vector<wenet::ThreadBudget::Lease> busy;
+    for (int i = 0; i < 16; ++i) busy.push_back(budget.Acquire());
+    // Oversubscribed, single threaded
+    EXPECT_EQ(busy.back().threads(), 1);
+    EXPECT_EQ(budget.active(), 19);
+  }
+  EXPECT_EQ(budget.active(), 0);
+  EXPECT_EQ(budget.Acquire().threads(), 4);
+  EXPECT_EQ(budget.active(), 0);
+}
+
+TEST(UtilsTest, MatrixTest) {
+  std::vector<std::vector<float>> data = {{1, 2, 3}, {4, 5, 6}};
+  wenet::Matrix<float> m(data);
+  EXPECT_EQ(m.rows(), 2);
+  EXPECT_EQ(m.cols(), 3);
+  EXPECT_GE(m.stride(), m.cols());
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(m.Row(1)) %
+            wenet::Matrix<float>::kAlignment, 0);
+  EXPECT_FLOAT_EQ(m(1, 2), 6);
+  std::vector<std::vector<float>> out;
+  m.CopyTo(&out);
+  EXPECT_EQ(out, data);
+
+  wenet::Matrix<float> m2(3, 3);
+  m2.SetZero();
+  m2.CopyRows(m, 0, 2, 1);
+  EXPECT_FLOAT_EQ(m2(0, 0), 0);
+  EXPECT_FLOAT_EQ(m2(2, 1), 5);
+}
+
+TEST(UtilsTest, FrameQueueTest) {
+  const int dim = 3, num_frames = 10000;
+  // Small blocks, so the blocks are reused and inserted many times
+  wenet::FrameQueue queue(dim, 4);
+  std::thread producer([&queue]() {
+    std::vector<float> frames;
+    for (int i = 0; i < num_frames;) {
+      int n = std::min(1 + i % 7, num_frames - i);
+      frames.resize(n * dim);
+      for (int j = 0; j < n * dim; ++j) frames[j] = i * dim + j;
+      queue.Push(frames.data(), n, dim);
+      i += n;
+    }
+  });
+  std::vector<float> out(5 * dim);
+  int num_popped = 0;
+  while (num_popped < num_frames) {
+    int n = queue.Pop(5, dim, out.data());
+    for (int j = 0; j < n * dim; ++j) {
+      EXPECT_EQ(out[j], num_popped * dim + j);
+    }
+    num_popped += n;
+  }
+  producer.join();
+  EXPECT_EQ(queue.Size(), 0);
+}
+
+TEST(UtilsTest, FrameQueuePeekTest) {
+  const int dim = 2;
+  wenet::FrameQueue queue(dim, 3);
+  std::vector<float> frames(8 * dim);
+  for (int j = 0; j < frames.size(); ++j) frames[j] = j;
+  queue.Push(frames.data(), 8, dim);
+  std::vector<float> out(8 * dim);
+  EXPECT_EQ(queue.Pop(2, dim, out.data()), 2);
+  // Across the blocks, and the frames stay in the queue
+  EXPECT_EQ(queue.Peek(10, dim, out.data()), 6);
+  EXPECT_EQ(queue.Size(), 6);
+  for (int j = 0; j < 6 * dim; ++j) EXPECT_EQ(out[j], 2 * dim + j);
+  EXPECT_EQ(queue.Pop(6, dim, out.data()), 6);
+  for (int j = 0; j < 6 * dim; ++j) EXPECT_EQ(out[j], 2 * dim + j);
+  EXPECT_EQ(queue.Peek(1, dim, out.data()), 0);
+}
+
+TEST(UtilsTest, StateIoTest) {
+  std::string state;
+  wenet::StateWriter writer(&state);
+  writer.Write<int32_t>(-3);
+  writer.WriteVector(std::vector<float>{1.5, 2.5});
+  writer.WriteString("abc");
+  wenet::Matrix<float> m({{1, 2, 3}, {4, 5, 6}});
+  writer.WriteMatrix(m);
+  writer.WriteMatrix(wenet::Matrix<float>());
+
+  wenet::StateReader reader(state);
+  int32_t i = 0;
+  std::vector<float> v;
+  std::string str;
+  wenet::Matrix<float> m2, empty(2, 2);
+  ASSERT_TRUE(reader.Read(&i));
+  ASSERT_TRUE(reader.ReadVector(&v));
+  ASSERT_TRUE(reader.ReadString(&str));
+  ASSERT_TRUE(reader.ReadMatrix(&m2));
+  ASSERT_TRUE(reader.ReadMatrix(&empty));
+  EXPECT_EQ(reader.remaining(), 0);
+  EXPECT_FALSE(reader.Read(&i));
+  EXPECT_EQ(i, -3);
+  EXPECT_THAT(v, ::testing::ElementsAre(1.5, 2.5));
+  EXPECT_EQ(str, "abc");
+  ASSERT_EQ(m2.rows(), 2);
+  ASSERT_EQ(m2.cols(), 3);
+  EXPECT_FLOAT_EQ(m2(1, 2), 6);
+  EXPECT_TRUE(empty.empty());
+
+  // A truncated state or a size over it fails without allocating it
+  for (size_t size = 0; size < state.size(); ++size) {
+    wenet::StateReader truncated(state.data(), size);
+    bool ok = truncated.Read(&i) && truncated.ReadVector(&v) &&
+              truncated.ReadString(&str) && truncated.ReadMatrix(&m2) &&
+              truncated.ReadMatrix(&empty);
+    EXPECT_FALSE(ok) << size;
+  }
+  std::string huge;
+  wenet::StateWriter(&huge).Write<uint64_t>(uint64_t(1) << 60);
+  EXPECT_FALSE(wenet::StateReader(huge).ReadVector(&v));
+}
+
+TEST(UtilsTest, Base64EncodeTest) {
+  EXPECT_EQ(wenet::Base64Encode(""), "");
+  EXPECT_EQ(wenet::Base64Encode("f"), "Zg==");
+  EXPECT_EQ(wenet::Base64Encode("fo"), "Zm8=");
+  EXPECT_EQ(wenet::Base64Encode("foo"), "Zm9v");
+  EXPECT_EQ(wenet::Base64Encode("foobar"), "Zm9vYmFy");
+  EXPECT_EQ(wenet::Base64Encode(std::string("\x00\xd6\xff", 3)), "ANb/");
+}
+
+TEST(UtilsTest, EditDistanceTest) {
+  std::vector<std::string> units;
+  wenet::SplitToScoringUnits("\xe4\xbd\xa0\xe5\xa5\xbd hello  world's",
+                             &units);
+  EXPECT_EQ(units, std::vector<std::string>({"\xe4\xbd\xa0",
+                                             "\xe5\xa5\xbd", "hello",
+                                             "world's"}));
+  std::vector<std::string> ref = {"a", "b", "c", "d"};
+  EXPECT_EQ(wenet::EditDistance(ref, ref), 0);
+  EXPECT_EQ(wenet::EditDistance(ref, {}), 4);
+  EXPECT_EQ(wenet::EditDistance({}, ref), 4);
+  EXPECT_EQ(wenet::EditDistance(ref, {"a", "x", "c"}), 2);
+  EXPECT_EQ(wenet::EditDistance(ref, {"x", "a", "b", "c", "d"}), 1);
+}
+
+TEST(UtilsTest, LogAddTest) {
+  // Compared with the exact one, from the equal inputs to the differences
+  // beyond the float precision
+  std::mt19937 rng(11);
+  std::uniform_real_distribution<float> base_dist(-50, 0);
+  std::uniform_real_distribution<float> diff_dist(-20, 20);
+  const int n = 10003;
+  std::vector<float> x(n), y(n), z(n);
+  for (int i = 0; i < n; ++i) {
+    x[i] = base_dist(rng);
+    y[i] = i % 7 == 0 ? x[i] : x[i] + diff_dist(rng);
+  }
+  for (int i = 0; i < n; ++i) {
+    EXPECT_NEAR(wenet::LogAdd(x[i], y[i]), wenet::ExactLogAdd(x[i], y[i]),
+                5e-6);
+    EXPECT_EQ(wenet::LogAdd(x[i], y[i]), wenet::LogAdd(y[i], x[i]));
+  }
+  // The batch is the same as the scalar one, including the tail
+  wenet::LogAdd(x.data(), y.data(), n, z.data());
+  for (int i = 0; i < n; ++i) {
+    ASSERT_EQ(z[i], wenet::LogAdd(x[i], y[i]));
+  }
+  // -kFloatMax and -inf are the zero probability
+  const float inf = std::numeric_limits<float>::infinity();
+  EXPECT_EQ(wenet::LogAdd(-wenet::kFloatMax, -3.0f), -3.0f);
+  EXPECT_EQ(wenet::LogAdd(-inf, -3.0f), -3.0f);
+  EXPECT_EQ(wenet::LogAdd(-inf, -inf), -inf);
+  EXPECT_NEAR(wenet::LogAdd(std::log(0.25f), std::log(0.5f)),
+              std::log(0.75f), 1e-6);
+  std::vector<float> a = {-inf, -wenet::kFloatMax, -1.0f};
+  std::vector<float> b = {-2.0f, -2.0f, -inf};
+  std::vector<float> c(3);
+  wenet::LogAdd(a.data(), b.data(), 3, c.data());
+  EXPECT_THAT(c, ::testing::ElementsAre(-2.0f, -2.0f, -1.0f));
+}
+
+TEST(UtilsTest, SymbolStringsTest) {
+  fst::SymbolTable table;
+  table.AddSymbol("<blank>", 0);
+  table.AddSymbol("\xe2\x96\x81hello", 1);
+  table.AddSymbol("", 2);
+  table.AddSymbol("world", 4);
+  wenet::SymbolStrings strings(table);
+  for (int id : {0, 1, 2, 4}) {
+    EXPECT_EQ(strings.Find(id), table.Find(id));
+  }
+  // The missing ids are "" as SymbolTable::Find()
+  EXPECT_EQ(strings.Find(3), "");
+  EXPECT_EQ(strings.Find(5), "");
+  EXPECT_EQ(strings.Find(-1), "");
+  std::string sentence;
+  for (int id : {1, 3, 4}) strings.Append(id, &sentence);
+  EXPECT_EQ(sentence, "\xe2\x96\x81helloworld");
+  EXPECT_EQ(strings.size(1), 8);
+}
+
+TEST(UtilsTest, SymbolStringsFindTest) {
+  fst::SymbolTable table;
+  for (int i = 0; i < 1000; ++i) {
+    table.AddSymbol("word" + std::to_string(i), i);
+  }
+  wenet::SymbolStrings strings(table, {"<context>", "word7"});
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(strings.Find("word" + std::to_string(i)), i);
+  }
+  // Only the reserved symbols not in the table are appended
+  EXPECT_EQ(strings.Find("<context>"), 1000);
+  EXPECT_EQ(strings.Find(1000), "<context>");
+  EXPECT_EQ(strings.num_ids(), 1001);
+  EXPECT_EQ(strings.Find("word1000"), -1);
+  EXPECT_EQ(strings.Find(""), -1);
+
+  std::string path = ::testing::TempDir() + "/utils_test_words.bin";
+  ASSERT_TRUE(strings.Write(path));
+  EXPECT_TRUE(wenet::SymbolStrings::IsBinary(path));
+  auto mapped = wenet::SymbolStrings::Read(path);
+  ASSERT_NE(mapped, nullptr);
+  EXPECT_EQ(mapped->num_ids(), 1001);
+  EXPECT_EQ(mapped->Find("word999"), 999);
+  EXPECT_EQ(mapped->Find(42), "word42");
+  EXPECT_EQ(mapped->Find("<context>"), 1000);
+
+  std::vector<std::string> words;
+  EXPECT_TRUE(wenet::SplitUTF8StringToWords("word12", *mapped, &words));
+  EXPECT_THAT(words, ::testing::ElementsAre("word12"));
+}
+
+TEST(UtilsTest, QuantizedFramesTest) {
+  const int dim = 8;
+  std::mt19937 rng(7);
+  std::normal_distribution<float> dist(0.0f, 3.0f);
+  std::vector<float> data(20 * dim);
+  for (float& x : data) x = dist(rng);
+  std::fill(data.begin() + 5 * dim, data.begin() + 6 * dim, 0.0f);
+
+  for (auto dtype : {wenet::FrameDtype::kFloat32, wenet::FrameDtype::kFloat16,
+                     wenet::FrameDtype::kInt8}) {
+    wenet::QuantizedFrames frames(dtype);
+    std::vector<float> buffer;
+    // Drop and append, the dropped frames are reclaimed on the way
+    int dropped = 0;
+    for (int t = 0; t < 20; t += 4) {
+      frames.Append(data.data() + t * dim, 4, dim);
+      if (frames.num_frames() > 6) {
+        dropped += frames.num_frames() - 6;
+        frames.DropFront(frames.num_frames() - 6);
+      }
+    }
+    ASSERT_EQ(frames.num_frames(), 6);
+    ASSERT_EQ(dropped, 14);
+    const float* out = frames.Data(&buffer);
+    for (int t = 0; t < 6; ++t) {
+      const float* in = data.data() + (dropped + t) * dim;
+      float max_abs = 0.0f;
+      for (int i = 0; i < dim; ++i) {
+        max_abs = std::max(max_abs, std::fabs(in[i]));
+      }
+      for (int i = 0; i < dim; ++i) {
+        float error = std::fabs(out[t * dim + i] - in[i]);
+        switch (dtype) {
+          case wenet::FrameDtype::kFloat32:
+            EXPECT_EQ(error, 0.0f);
+            break;
+          case wenet::FrameDtype::kFloat16:
+            EXPECT_LE(error, std::fabs(in[i]) / 2048 + 1e-7f);
+            break;
+          case wenet::FrameDtype::kInt8:
+            EXPECT_LE(error, max_abs / 254 + 1e-6f);
+            break;
+        }
+      }
+    }
+    frames.Clear();
+    EXPECT_EQ(frames.num_frames(), 0);
+    // The zero frame
+    frames.Append(data.data() + 5 * dim, 1, dim);
+    out = frames.Data(&buffer);
+    for (int i = 0; i < dim; ++i) EXPECT_EQ(out[i], 0.0f);
+  }
+}
+
+TEST(UtilsTest, QuantizedFramesFloat16Test) {
+  std::vector<float> values = {1.0f,    -2.5f,  65504.0f, 1e5f,
+                               6e-8f,   -1e-9f, 0.1f,     std::ldexp(1.0f, -14),
+                               std::numeric_limits<float>::infinity()};
+  wenet::QuantizedFrames frames(wenet::FrameDtype::kFloat16);
+  frames.Append(values.data(), 1, values.size());
+  std::vector<float> buffer;
+  const float* out = frames.Data(&buffer);
+  EXPECT_EQ(out[0], 1.0f);
+  EXPECT_EQ(out[1], -2.5f);
+  EXPECT_EQ(out[2], 65504.0f);
+  EXPECT_TRUE(std::isinf(out[3]));
+  // Subnormal, 2^-24 is the least
+  EXPECT_EQ(out[4], std::ldexp(1.0f, -24));
+  EXPECT_EQ(out[5], 0.0f);
+  EXPECT_NEAR(out[6], 0.1f, 0.1f / 2048);
+  EXPECT_EQ(out[7], std::ldexp(1.0f, -14));
+  EXPECT_TRUE(std::isinf(out[8]));
+  EXPECT_LT(frames.MemoryBytes(), values.size() * sizeof(float));
+}
+
+TEST(UtilsTest, HugePagesTest) {
+  auto buffer = wenet::HugePageBuffer::Allocate(3 << 20);
+  ASSERT_NE(buffer, nullptr);
+  EXPECT_EQ(buffer->size(), 3 << 20);
+  buffer->data()[0] = 1;
+  buffer->data()[buffer->size() - 1] = 2;
+#ifdef __linux__
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(buffer->data()) %
+            wenet::kHugePageBytes, 0);
+#endif
+
+  std::string path = ::testing::TempDir() + "/huge_pages_test.bin";
+  std::string content(1000, 'a');
+  content[999] = 'b';
+  FILE* fp = fopen(path.c_str(), "wb");
+  ASSERT_NE(fp, nullptr);
+  fwrite(content.data(), 1, content.size(), fp);
+  fclose(fp);
+  wenet::MappedFile::set_huge_pages(true);
+  auto file = wenet::MappedFile::Open(path);
+  // Mapped all the same
+  auto shared_file = wenet::MappedFile::Open(path, true);
+  wenet::MappedFile::set_huge_pages(false);
+  ASSERT_NE(file, nullptr);
+  ASSERT_EQ(file->size(), content.size());
+  EXPECT_EQ(std::string(file->data(), file->size()), content);
+  ASSERT_NE(shared_file, nullptr);
+  EXPECT_EQ(std::string(shared_file->data(), shared_file->size()), content);
+  remove(path.c_str());
+}
+
+#ifdef __linux__
+TEST(UtilsTest, ShmAudioRingTest) {
+  auto consumer = wenet::ShmAudioRing::Create(100);
+  ASSERT_NE(consumer, nullptr);
+  // The producer maps the same memory by the fds, as another process would
+  // after ReceiveFds()
+  auto producer =
+      wenet::ShmAudioRing::Attach(dup(consumer->memory_fd()),
+                                  dup(consumer->doorbell_fd()));
+  ASSERT_NE(producer, nullptr);
+  EXPECT_EQ(producer->capacity(), 100);
+
+  std::thread writer([&producer]() {
+    std::vector<int16_t> samples(37);
+    int16_t next = 0;
+    for (int i = 0; i < 100; ++i) {
+      for (auto& sample : samples) sample = next++;
+      size_t written = 0;
+      while (written < samples.size()) {
+        written += producer->Write(samples.data() + written,
+                                   samples.size() - written);
+        producer->Ring();
+        std::this_thread::yield();
+      }
+    }
+    producer->set_input_finished();
+    producer->Ring();
+  });
+  int16_t expected = 0;
+  while (!consumer->Finished()) {
+    const int16_t* samples = nullptr;
+    size_t num_samples = consumer->Peek(&samples);
+    for (size_t i = 0; i < num_samples; ++i) {
+      ASSERT_EQ(samples[i], expected++);
+    }
+    consumer->Consume(num_samples);
+    consumer->ClearDoorbell();
+  }
+  writer.join();
+  EXPECT_EQ(expected, 3700);
+}
+
+TEST(UtilsTest, SendFdsTest) {
+  int sockets[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+  auto ring = wenet::ShmAudioRing::Create(16);
+  ASSERT_NE(ring, nullptr);
+  ASSERT_TRUE(wenet::SendFds(sockets[0], "ok\n",
+                             {ring->memory_fd(), ring->doorbell_fd()}));
+  std::string message;
+  std::vector<int> fds;
+  ASSERT_TRUE(wenet::ReceiveFds(sockets[1], 64, &message, &fds));
+  EXPECT_EQ(message, "ok\n");
+  ASSERT_EQ(fds.size(), 2);
+  auto attached = wenet::ShmAudioRing::Attach(fds[0], fds[1]);
+  ASSERT_NE(attached, nullptr);
+  std::vector<int16_t> samples = {1, 2, 3};
+  EXPECT_EQ(attached->Write(samples.data(), samples.size()), 3);
+  const int16_t* read = nullptr;
+  ASSERT_EQ(ring->Peek(&read), 3);
+  EXPECT_EQ(read[2], 3);
+  close(sockets[0]);
+  close(sockets[1]);
+}
+#endif
@@ -0,0 +1,45 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "frontend/vad.h"
+
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace wenet {
+
+TEST(VadTest, EnergyVadTest) {
+  VadOptions opts;
+  opts.hangover_frames = 3;
+  EnergyVad vad(opts);
+  std::vector<float> silence(80, 1.0), speech(80, 10.0);
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_FALSE(vad.IsSpeech(silence.data(), 80)) << i;
+  }
+  EXPECT_TRUE(vad.IsSpeech(speech.data(), 80));
+  // The hangover
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(vad.IsSpeech(silence.data(), 80)) << i;
+  }
+  EXPECT_FALSE(vad.IsSpeech(silence.data(), 80));
+
+  // Speech at the beginning of the stream is detected by the initial floor
+  vad.Reset();
+  EXPECT_TRUE(vad.IsSpeech(speech.data(), 80));
+}
+
+}  // namespace wenet
@@ -0,0 +1,163 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "frontend/wav_archive.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "frontend/wav.h"
+
+namespace wenet {
+
+static std::vector<float> MakeSamples(int num_samples, int base) {
+  std::vector<float> samples(num_samples);
+  for (int i = 0; i < num_samples; ++i) {
+    samples[i] = (base + i * 7) % 30000 - 15000;
+  }
+  return samples;
+}
+
+static std::string WriteWav(const std::string& name,
+                            const std::vector<float>& samples) {
+  std::string path = ::testing::TempDir() + "/" + name;
+  WavWriter writer(samples.data(), samples.size(), 1, 16000, 16);
+  writer.Write(path);
+  return path;
+}
+
+static std::string ReadBytes(const std::string& path) {
+  std::ifstream is(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(is),
+                     std::istreambuf_iterator<char>());
+}
+
+// A member of a tar, of type '0' by default
+static void AppendTarMember(const std::string& name, const std::string& data,
+                            std::string* tar, char type = '0') {
+  char header[512] = {0};
+  snprintf(header, 100, "%s", name.c_str());
+  snprintf(header + 124, 12, "%011o", static_cast<unsigned>(data.size()));
+  header[156] = type;
+  memcpy(header + 257, "ustar", 6);
+  tar->append(header, sizeof(header));
+  tar->append(data);
+  tar->append((512 - data.size() % 512) % 512, '\0');
+}
+
+static void ExpectWaves(const std::string& rspecifier,
+                        const std::vector<std::string>& keys,
+                        const std::vector<std::vector<float>>& samples) {
+  WavArchiveReader reader(1);
+  ASSERT_TRUE(reader.Open(rspecifier));
+  WavData wav;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    ASSERT_TRUE(reader.Read(&wav)) << rspecifier;
+    EXPECT_EQ(wav.key, keys[i]);
+    EXPECT_EQ(wav.sample_rate, 16000);
+    EXPECT_EQ(wav.samples, samples[i]);
+  }
+  EXPECT_FALSE(reader.Read(&wav));
+  EXPECT_FALSE(reader.Read(&wav));
+}
+
+TEST(WavArchiveTest, WavReaderChannelsTest) {
+  // The interleaved samples of two channels
+  const int num_samples = 1000;
+  std::vector<float> left = MakeSamples(num_samples, 0);
+  std::vector<float> right = MakeSamples(num_samples, 5000);
+  std::vector<float> interleaved;
+  for (int i = 0; i < num_samples; ++i) {
+    interleaved.push_back(left[i]);
+    interleaved.push_back(right[i]);
+  }
+  std::string path = ::testing::TempDir() + "/wav_archive_test_stereo.wav";
+  WavWriter(interleaved.data(), num_samples, 2, 16000, 16).Write(path);
+  WavReader reader(path);
+  ASSERT_EQ(reader.num_channel(), 2);
+  ASSERT_EQ(reader.num_sample(), num_samples);
+  EXPECT_EQ(reader.data(), reader.channel_data(0));
+  EXPECT_EQ(std::vector<float>(reader.channel_data(0),
+                               reader.channel_data(0) + num_samples),
+            left);
+  EXPECT_EQ(std::vector<float>(reader.channel_data(1),
+                               reader.channel_data(1) + num_samples),
+            right);
+}
+
+TEST(WavArchiveTest, ScriptAndShardsTest) {
+  std::vector<std::string> keys = {"utt0", "utt1", "utt2"};
+  std::vector<std::vector<float>> samples = {
+      MakeSamples(1600, 0), MakeSamples(0, 0), MakeSamples(4801, 100)};
+  std::string scp = ::testing::TempDir() + "/wav_archive_test.scp";
+  std::string tar0 = ::testing::TempDir() + "/wav_archive_test0.tar";
+  std::string tar1 = ::testing::TempDir() + "/wav_archive_test1.tar";
+  std::string list = ::testing::TempDir() + "/wav_archive_test.list";
+  {
+    std::ofstream os(scp);
+    std::string shard0, shard1;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      std::string path = WriteWav(keys[i] + ".wav", samples[i]);
+      os << keys[i] << " " << path << "\n";
+      std::string* shard = i == 0 ? &shard0 : &shard1;
+      // The transcripts of the training shards are skipped
+      AppendTarMember(keys[i] + ".txt", "text", shard);
+      if (i == 2) {
+        std::string name = std::string(120, 'd') + "/" + keys[i] + ".wav";
+        AppendTarMember("././@LongLink", name + '\0', shard, 'L');
+        AppendTarMember(name.substr(0, 99), ReadBytes(path), shard);
+      } else {
+        AppendTarMember("dir/" + keys[i] + ".wav", ReadBytes(path), shard);
+      }
+    }
+    shard0.append(1024, '\0');
+    std::ofstream(tar0, std::ios::binary) << shard0;
+    std::ofstream(tar1, std::ios::binary) << shard1;
+    std::ofstream(list) << tar0 << "\n" << tar1 << "\n";
+  }
+  ExpectWaves("scp:" + scp, keys, samples);
+  ExpectWaves("shards:" + list, keys, samples);
+  ExpectWaves("tar:" + tar0, {keys[0]}, {samples[0]});
+}
+
+TEST(WavArchiveTest, StopTest) {
+  std::string scp = ::testing::TempDir() + "/wav_archive_stop_test.scp";
+  {
+    std::ofstream os(scp);
+    std::string path = WriteWav("stop.wav", MakeSamples(160, 0));
+    for (int i = 0; i < 10; ++i) os << "utt" << i << " " << path << "\n";
+  }
+  // The reader is destroyed while it's blocked on the full queue
+  WavArchiveReader reader(2);
+  ASSERT_TRUE(reader.Open("scp:" + scp));
+  WavData wav;
+  ASSERT_TRUE(reader.Read(&wav));
+  EXPECT_EQ(wav.key, "utt0");
+}
+
+TEST(WavArchiveTest, InvalidTest) {
+  WavArchiveReader reader(1);
+  EXPECT_FALSE(reader.Open("ark:a.ark"));
+  WavData wav;
+  EXPECT_FALSE(DecodeWavBytes("", &wav));
+  EXPECT_FALSE(DecodeWavBytes("not a wav", &wav));
+}
+
+}  // namespace wenet
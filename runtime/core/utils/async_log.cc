@@ -0,0 +1,235 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/async_log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+namespace wenet {
+
+static int64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int64_t LogRateLimiter::Acquire() {
+  int64_t now = NowUs();
+  int64_t next = next_us_.load(std::memory_order_relaxed);
+  if (now < next ||
+      !next_us_.compare_exchange_strong(next, now + interval_us_,
+                                        std::memory_order_relaxed)) {
+    suppressed_.fetch_add(1, std::memory_order_relaxed);
+    return -1;
+  }
+  return suppressed_.exchange(0, std::memory_order_relaxed);
+}
+
+std::string SuppressedLogs(int64_t suppressed) {
+  if (suppressed <= 0) return "";
+  return "[" + std::to_string(suppressed) + " suppressed] ";
+}
+
+// The header of a message in a buffer, followed by its bytes
+struct AsyncLogQueue::Record {
+  google::base::Logger* sink;
+  int64_t timestamp;
+  uint32_t message_len;
+};
+
+static std::atomic<uint64_t> next_queue_id{0};
+
+AsyncLogQueue::AsyncLogQueue(size_t buffer_bytes, int flush_interval_ms)
+    : id_(next_queue_id.fetch_add(1)),
+      buffer_bytes_(std::max(buffer_bytes, sizeof(Record) + 1024)),
+      flush_interval_ms_(std::max(flush_interval_ms, 1)) {
+  thread_ = std::thread(&AsyncLogQueue::FlushLoop, this);
+}
+
+AsyncLogQueue::~AsyncLogQueue() {
+  {
+    std::lock_guard<std::mutex> lock(stop_mutex_);
+    stop_ = true;
+  }
+  stop_cond_.notify_one();
+  thread_.join();
+  Drain();
+}
+
+// The buffer of the calling thread, it's dropped after the thread exits
+AsyncLogQueue::Buffer* AsyncLogQueue::LocalBuffer() {
+  // The queues the thread logged to, mostly one
+  struct LocalBuffers {
+    std::vector<std::pair<uint64_t, std::shared_ptr<Buffer>>> buffers;
+    ~LocalBuffers() {
+      for (auto& buffer : buffers) buffer.second->exited.store(true);
+    }
+  };
+  thread_local LocalBuffers local;
+  for (auto& buffer : local.buffers) {
+    if (buffer.first == id_) return buffer.second.get();
+  }
+  auto buffer = std::make_shared<Buffer>(buffer_bytes_);
+  {
+    std::lock_guard<std::mutex> lock(buffers_mutex_);
+    buffers_.push_back(buffer);
+  }
+  local.buffers.emplace_back(id_, buffer);
+  return buffer.get();
+}
+
+// Copy size bytes at the position pos of the ring, wrapped around its end
+static void CopyToRing(std::vector<char>* ring, uint64_t pos, const void* src,
+                       size_t size) {
+  size_t offset = pos % ring->size();
+  size_t first = std::min(size, ring->size() - offset);
+  memcpy(ring->data() + offset, src, first);
+  memcpy(ring->data(), static_cast<const char*>(src) + first, size - first);
+}
+
+static void CopyFromRing(const std::vector<char>& ring, uint64_t pos,
+                         void* dst, size_t size) {
+  size_t offset = pos % ring.size();
+  size_t first = std::min(size, ring.size() - offset);
+  memcpy(dst, ring.data() + offset, first);
+  memcpy(static_cast<char*>(dst) + first, ring.data(), size - first);
+}
+
+bool AsyncLogQueue::Push(google::base::Logger* sink, time_t timestamp,
+                         const char* message, int message_len) {
+  Buffer* buffer = LocalBuffer();
+  Record record;
+  record.sink = sink;
+  record.timestamp = static_cast<int64_t>(timestamp);
+  record.message_len = static_cast<uint32_t>(std::max(message_len, 0));
+  const size_t size = sizeof(record) + record.message_len;
+  // Only this thread writes the tail
+  uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+  uint64_t head = buffer->head.load(std::memory_order_acquire);
+  if (buffer->data.size() - (tail - head) < size) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  CopyToRing(&buffer->data, tail, &record, sizeof(record));
+  CopyToRing(&buffer->data, tail + sizeof(record), message,
+             record.message_len);
+  buffer->tail.store(tail + size, std::memory_order_release);
+  return true;
+}
+
+void AsyncLogQueue::DrainBuffer(Buffer* buffer) {
+  uint64_t tail = buffer->tail.load(std::memory_order_acquire);
+  uint64_t head = buffer->head.load(std::memory_order_relaxed);
+  while (head < tail) {
+    Record record;
+    CopyFromRing(buffer->data, head, &record, sizeof(record));
+    scratch_.resize(record.message_len);
+    CopyFromRing(buffer->data, head + sizeof(record), &scratch_[0],
+                 record.message_len);
+    // The space is free for the writer once the message is copied out
+    head += sizeof(record) + record.message_len;
+    buffer->head.store(head, std::memory_order_release);
+    record.sink->Write(false, static_cast<time_t>(record.timestamp),
+                       scratch_.data(), record.message_len);
+  }
+}
+
+void AsyncLogQueue::Drain() {
+  std::lock_guard<std::mutex> drain_lock(drain_mutex_);
+  std::vector<std::shared_ptr<Buffer>> buffers;
+  {
+    std::lock_guard<std::mutex> lock(buffers_mutex_);
+    buffers = buffers_;
+  }
+  std::vector<Buffer*> exited;
+  for (auto& buffer : buffers) {
+    // Nothing is written after it's seen exited, it's drained for the last
+    // time
+    if (buffer->exited.load()) exited.push_back(buffer.get());
+    DrainBuffer(buffer.get());
+  }
+  if (exited.empty()) return;
+  std::lock_guard<std::mutex> lock(buffers_mutex_);
+  buffers_.erase(
+      std::remove_if(buffers_.begin(), buffers_.end(),
+                     [&exited](const std::shared_ptr<Buffer>& buffer) {
+                       return std::find(exited.begin(), exited.end(),
+                                        buffer.get()) != exited.end();
+                     }),
+      buffers_.end());
+}
+
+void AsyncLogQueue::FlushLoop() {
+  std::unique_lock<std::mutex> lock(stop_mutex_);
+  while (!stop_) {
+    stop_cond_.wait_for(lock, std::chrono::milliseconds(flush_interval_ms_),
+                        [this]() { return stop_; });
+    lock.unlock();
+    Drain();
+    lock.lock();
+  }
+}
+
+void AsyncLogger::Write(bool force_flush, time_t timestamp,
+                        const char* message, int message_len) {
+  if (force_flush) {
+    queue_->Drain();
+    sink_->Write(true, timestamp, message, message_len);
+    return;
+  }
+  queue_->Push(sink_, timestamp, message, message_len);
+}
+
+void AsyncLogger::Flush() {
+  queue_->Drain();
+  sink_->Flush();
+}
+
+// Never destroyed, the loggers are used until the process exits
+static std::atomic<AsyncLogQueue*> async_log_queue{nullptr};
+
+static void DrainAsyncLogging() {
+  AsyncLogQueue* queue = async_log_queue.load();
+  if (queue != nullptr) queue->Drain();
+}
+
+void InstallAsyncLogging(size_t buffer_bytes, int flush_interval_ms) {
+  AsyncLogQueue* queue = new AsyncLogQueue(buffer_bytes, flush_interval_ms);
+  AsyncLogQueue* expected = nullptr;
+  if (!async_log_queue.compare_exchange_strong(expected, queue)) {
+    LOG(WARNING) << "The asynchronous logging is already installed";
+    delete queue;
+    return;
+  }
+  for (int severity = google::GLOG_INFO; severity < google::NUM_SEVERITIES;
+       ++severity) {
+    google::base::Logger* sink = google::base::GetLogger(severity);
+    google::base::SetLogger(severity, new AsyncLogger(queue, sink));
+  }
+  // The messages queued at the exit
+  atexit(DrainAsyncLogging);
+  LOG(INFO) << "Asynchronous logging, " << buffer_bytes / 1024
+            << " KB buffer per thread, flushed every " << flush_interval_ms
+            << " ms";
+}
+
+int64_t AsyncLogDropped() {
+  AsyncLogQueue* queue = async_log_queue.load();
+  return queue == nullptr ? 0 : queue->dropped();
+}
+
+}  // namespace wenet
@@ -0,0 +1,151 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTILS_ASYNC_LOG_H_
+#define UTILS_ASYNC_LOG_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utils/log.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// LogRateLimiter passes one call in every interval, e.g. of a LOG call site
+// on a hot path, see LOG_EVERY_MS. It takes no lock.
+class LogRateLimiter {
+ public:
+  explicit LogRateLimiter(int interval_ms)
+      : interval_us_(static_cast<int64_t>(interval_ms) * 1000) {}
+
+  // The calls suppressed since the last passed one if this one passes,
+  // -1 otherwise
+  int64_t Acquire();
+
+ private:
+  const int64_t interval_us_;
+  std::atomic<int64_t> next_us_{0};
+  std::atomic<int64_t> suppressed_{0};
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(LogRateLimiter);
+};
+
+// The prefix of a rate limited message, e.g. "[12 suppressed] "
+std::string SuppressedLogs(int64_t suppressed);
+
+// LOG(severity) at most once every ms milliseconds of the call site, the
+// messages in between are counted, e.g.
+//   LOG_EVERY_MS(INFO, 1000) << "Partial result: " << result;
+// ms is a constant.
+#define LOG_EVERY_MS(severity, ms)                                      \
+  for (int64_t wenet_log_suppressed =                                   \
+           []() -> ::wenet::LogRateLimiter& {                           \
+             static ::wenet::LogRateLimiter limiter(ms);                \
+             return limiter;                                            \
+           }().Acquire();                                               \
+       wenet_log_suppressed >= 0; wenet_log_suppressed = -1)            \
+  LOG(severity) << ::wenet::SuppressedLogs(wenet_log_suppressed)
+
+// AsyncLogQueue moves the writes of the log messages off the logging
+// threads. Each thread appends its messages to its own ring buffer, which
+// takes no lock, and a background thread writes them to their sinks every
+// flush_interval_ms. The messages which don't fit in the buffer of a
+// thread are dropped and counted rather than blocking it. The order of the
+// messages of a thread is kept, the ones of different threads may be
+// written out of order by up to an interval, their timestamps are kept.
+class AsyncLogQueue {
+ public:
+  AsyncLogQueue(size_t buffer_bytes, int flush_interval_ms);
+  // Write the queued messages and stop the background thread
+  ~AsyncLogQueue();
+
+  // Return false if it's dropped
+  bool Push(google::base::Logger* sink, time_t timestamp, const char* message,
+            int message_len);
+  // Write the messages queued so far to their sinks, on the calling thread
+  void Drain();
+  int64_t dropped() const { return dropped_.load(); }
+
+ private:
+  struct Record;
+  struct Buffer {
+    explicit Buffer(size_t capacity) : data(capacity) {}
+    std::vector<char> data;
+    // Bytes ever read by Drain() and ever written by Push()
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    // The thread exited, the buffer is dropped once it's drained
+    std::atomic<bool> exited{false};
+  };
+  Buffer* LocalBuffer();
+  void DrainBuffer(Buffer* buffer);
+  void FlushLoop();
+
+  const uint64_t id_;
+  const size_t buffer_bytes_;
+  const int flush_interval_ms_;
+  std::atomic<int64_t> dropped_{0};
+  // Of buffers_
+  std::mutex buffers_mutex_;
+  std::vector<std::shared_ptr<Buffer>> buffers_;
+  // The single reader of the buffers
+  std::mutex drain_mutex_;
+  std::string scratch_;
+  std::mutex stop_mutex_;
+  std::condition_variable stop_cond_;
+  bool stop_ = false;
+  std::thread thread_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(AsyncLogQueue);
+};
+
+// AsyncLogger queues the messages of glog to a log file, sink, on an
+// AsyncLogQueue. The messages glog flushes at once, e.g. of WARNING and
+// above with the default --logbuflevel, are written synchronously after
+// the queued ones, so are all of them before a crash of LOG(FATAL).
+class AsyncLogger : public google::base::Logger {
+ public:
+  AsyncLogger(AsyncLogQueue* queue, google::base::Logger* sink)
+      : queue_(queue), sink_(sink) {}
+
+  void Write(bool force_flush, time_t timestamp, const char* message,
+             int message_len) override;
+  void Flush() override;
+  google::uint32 LogSize() override { return sink_->LogSize(); }
+
+ private:
+  AsyncLogQueue* queue_;
+  google::base::Logger* sink_;
+};
+
+// Replace the loggers of the log files of glog by the AsyncLoggers of one
+// queue, call it once after google::InitGoogleLogging(). The messages to
+// stderr, e.g. of --logtostderr, are still written synchronously.
+void InstallAsyncLogging(size_t buffer_bytes, int flush_interval_ms);
+// The messages dropped by the full buffers, 0 if it's not installed
+int64_t AsyncLogDropped();
+
+}  // namespace wenet
+
+#endif  // UTILS_ASYNC_LOG_H_
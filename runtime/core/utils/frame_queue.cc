@@ -0,0 +1,127 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "utils/frame_queue.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+FrameQueue::FrameQueue(int dim, int block_frames)
+    : dim_(dim), block_frames_(block_frames) {
+  CHECK_GT(dim, 0);
+  CHECK_GT(block_frames, 0);
+  // Two blocks, so the producer can fill one while the other is read
+  Block* first = NewBlock();
+  Block* second = NewBlock();
+  first->next = second;
+  second->next = first;
+  tail_ = first;
+  head_.store(first, std::memory_order_relaxed);
+}
+
+FrameQueue::~FrameQueue() {
+  Block* block = tail_;
+  do {
+    Block* next = block->next;
+    delete[] block->data;
+    delete block;
+    block = next;
+  } while (block != tail_);
+}
+
+FrameQueue::Block* FrameQueue::NewBlock() {
+  Block* block = new Block;
+  block->data = new float[static_cast<size_t>(block_frames_) * dim_];
+  block->next = nullptr;
+  num_blocks_.fetch_add(1, std::memory_order_relaxed);
+  return block;
+}
+
+void FrameQueue::Push(const float* frames, int num_frames, int stride) {
+  for (int i = 0; i < num_frames; ++i) {
+    if (tail_pos_ == block_frames_) {
+      // The blocks from tail_->next to head_ are free. If tail_->next is
+      // head_, the consumer may still read it, so insert a new block. The
+      // consumer only follows next of a block after the frames behind it
+      // are published, which happens after this store.
+      if (tail_->next == head_.load(std::memory_order_acquire)) {
+        Block* block = NewBlock();
+        block->next = tail_->next;
+        tail_->next = block;
+      }
+      tail_ = tail_->next;
+      tail_pos_ = 0;
+    }
+    memcpy(tail_->data + static_cast<size_t>(tail_pos_) * dim_,
+           frames + static_cast<size_t>(i) * stride, sizeof(float) * dim_);
+    ++tail_pos_;
+  }
+  // Publish all the frames of this call at once
+  num_pushed_.fetch_add(num_frames, std::memory_order_release);
+}
+
+int FrameQueue::Pop(int num_frames, int stride, float* out) {
+  int64_t num_popped = num_popped_.load(std::memory_order_relaxed);
+  int available = num_pushed_.load(std::memory_order_acquire) - num_popped;
+  int n = std::min(num_frames, available);
+  Block* head = head_.load(std::memory_order_relaxed);
+  for (int i = 0; i < n; ++i) {
+    if (head_pos_ == block_frames_) {
+      head = head->next;
+      head_.store(head, std::memory_order_release);
+      head_pos_ = 0;
+    }
+    memcpy(out + static_cast<size_t>(i) * stride,
+           head->data + static_cast<size_t>(head_pos_) * dim_,
+           sizeof(float) * dim_);
+    ++head_pos_;
+  }
+  // The producer reuses a block only after head_ leaves it, so the frames
+  // are copied out before they are released here
+  num_popped_.store(num_popped + n, std::memory_order_release);
+  return n;
+}
+
+int FrameQueue::Peek(int num_frames, int stride, float* out) const {
+  int64_t num_popped = num_popped_.load(std::memory_order_relaxed);
+  int available = num_pushed_.load(std::memory_order_acquire) - num_popped;
+  int n = std::min(num_frames, available);
+  const Block* head = head_.load(std::memory_order_relaxed);
+  int pos = head_pos_;
+  for (int i = 0; i < n; ++i) {
+    if (pos == block_frames_) {
+      head = head->next;
+      pos = 0;
+    }
+    memcpy(out + static_cast<size_t>(i) * stride,
+           head->data + static_cast<size_t>(pos) * dim_,
+           sizeof(float) * dim_);
+    ++pos;
+  }
+  return n;
+}
+
+void FrameQueue::Clear() {
+  head_.store(tail_, std::memory_order_relaxed);
+  head_pos_ = tail_pos_;
+  num_popped_.store(num_pushed_.load(std::memory_order_relaxed),
+                    std::memory_order_relaxed);
+}
+
+}  // namespace wenet
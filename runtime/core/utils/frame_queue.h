@@ -0,0 +1,97 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef UTILS_FRAME_QUEUE_H_
+#define UTILS_FRAME_QUEUE_H_
+
+#include <atomic>
+#include <cstdint>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+// Lock free single producer single consumer queue of fixed dim frames, e.g.
+// the network thread pushes the fbank frames and the decoder thread pops
+// them. Push() and Pop() never block and take no lock, a caller that wants
+// to wait for the frames brings its own condition variable, see
+// FeaturePipeline.
+//
+// The frames are stored in a circular list of fixed size blocks. The
+// producer reuses the blocks the consumer has finished, and only inserts a
+// new block when the queue is full, so the allocation stops once the list
+// is large enough for the peak backlog.
+class FrameQueue {
+ public:
+  explicit FrameQueue(int dim, int block_frames = 128);
+  ~FrameQueue();
+
+  int dim() const { return dim_; }
+
+  // Producer, push num_frames frames, the i-th starts at frames + i * stride
+  void Push(const float* frames, int num_frames, int stride);
+
+  // Consumer, pop at most num_frames frames into out, the i-th is written to
+  // out + i * stride. Return the number of popped frames.
+  int Pop(int num_frames, int stride, float* out);
+  // Consumer, same as Pop() but the frames stay in the queue
+  int Peek(int num_frames, int stride, float* out) const;
+
+  // Number of frames pushed but not popped yet
+  int Size() const {
+    return num_pushed_.load(std::memory_order_acquire) -
+           num_popped_.load(std::memory_order_acquire);
+  }
+
+  // Drop all the frames, must not run concurrently with Push() or Pop()
+  void Clear();
+
+  // Bytes of the blocks, the list never shrinks, so it's the peak backlog
+  size_t AllocatedBytes() const {
+    return static_cast<size_t>(num_blocks_.load(std::memory_order_relaxed)) *
+           block_frames_ * dim_ * sizeof(float);
+  }
+
+ private:
+  struct Block {
+    float* data;
+    Block* next;
+  };
+
+  Block* NewBlock();
+
+  const int dim_;
+  const int block_frames_;
+
+  // Producer side, tail_ is the block being written
+  Block* tail_;
+  int tail_pos_ = 0;
+  // Consumer side, head_ is the block being read, it's read by the producer
+  // to know whether the next block is free
+  std::atomic<Block*> head_;
+  int head_pos_ = 0;
+
+  std::atomic<int64_t> num_pushed_{0};
+  std::atomic<int64_t> num_popped_{0};
+  // Written by the producer, read by anyone for the accounting
+  std::atomic<int> num_blocks_{0};
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(FrameQueue);
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_FRAME_QUEUE_H_
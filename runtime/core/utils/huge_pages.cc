@@ -0,0 +1,178 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "utils/huge_pages.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+bool AdviseHugePages(const void* data, size_t size) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  uintptr_t begin = reinterpret_cast<uintptr_t>(data);
+  uintptr_t end = begin + size;
+  begin = (begin + kHugePageBytes - 1) / kHugePageBytes * kHugePageBytes;
+  end = end / kHugePageBytes * kHugePageBytes;
+  if (end <= begin) return false;
+  void* addr = reinterpret_cast<void*>(begin);
+  if (madvise(addr, end - begin, MADV_HUGEPAGE) != 0) return false;
+#ifdef MADV_COLLAPSE
+  // The pages already touched at once, rather than by khugepaged
+  madvise(addr, end - begin, MADV_COLLAPSE);
+#endif
+  return true;
+#else
+  return false;
+#endif
+}
+
+std::unique_ptr<HugePageBuffer> HugePageBuffer::Allocate(size_t size) {
+  if (size == 0) return nullptr;
+  std::unique_ptr<HugePageBuffer> buffer(new HugePageBuffer());
+  buffer->size_ = size;
+#ifdef __linux__
+  size_t mapped_size =
+      (size + kHugePageBytes - 1) / kHugePageBytes * kHugePageBytes;
+  void* data = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  data = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  buffer->hugetlb_ = data != MAP_FAILED;
+#endif
+  if (data == MAP_FAILED) {
+    // One more page, so the 2 MB aligned part of it holds the whole size
+    size_t padded_size = mapped_size + kHugePageBytes;
+    data = mmap(nullptr, padded_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) return nullptr;
+    uintptr_t begin = reinterpret_cast<uintptr_t>(data);
+    uintptr_t aligned =
+        (begin + kHugePageBytes - 1) / kHugePageBytes * kHugePageBytes;
+    // Unmap the unaligned head and tail
+    if (aligned > begin) munmap(data, aligned - begin);
+    size_t tail = begin + padded_size - (aligned + mapped_size);
+    if (tail > 0) {
+      munmap(reinterpret_cast<void*>(aligned + mapped_size), tail);
+    }
+    data = reinterpret_cast<void*>(aligned);
+    AdviseHugePages(data, mapped_size);
+  }
+  buffer->data_ = static_cast<char*>(data);
+  buffer->mapped_size_ = mapped_size;
+#else
+  buffer->buffer_.reset(new char[size]);
+  buffer->data_ = buffer->buffer_.get();
+#endif
+  return buffer;
+}
+
+HugePageBuffer::~HugePageBuffer() {
+#ifdef __linux__
+  if (mapped_size_ > 0) munmap(data_, mapped_size_);
+#endif
+}
+
+// The value of "key:   value kB" of the lines of path, in bytes
+static size_t ReadProcKb(const std::string& path, const std::string& key) {
+  std::ifstream is(path);
+  std::string line;
+  while (std::getline(is, line)) {
+    if (line.compare(0, key.size(), key) == 0 && line.size() > key.size() &&
+        line[key.size()] == ':') {
+      return strtoull(line.c_str() + key.size() + 1, nullptr, 10) << 10;
+    }
+  }
+  return 0;
+}
+
+bool ReadMemoryStats(MemoryStats* stats) {
+  *stats = MemoryStats();
+#ifdef __linux__
+  stats->rss_bytes = ReadProcKb("/proc/self/status", "VmRSS");
+  stats->hugetlb_bytes = ReadProcKb("/proc/self/status", "HugetlbPages");
+  // It's summed by the kernel since 4.14, or of the lines of each mapping
+  // in smaps
+  stats->anon_huge_bytes =
+      ReadProcKb("/proc/self/smaps_rollup", "AnonHugePages");
+  return stats->rss_bytes > 0;
+#else
+  return false;
+#endif
+}
+
+std::string MemoryStatsString(const MemoryStats& stats) {
+  std::ostringstream ss;
+  ss << "RSS " << (stats.rss_bytes >> 20) << " MB, transparent huge pages "
+     << (stats.anon_huge_bytes >> 20) << " MB, hugetlb pages "
+     << (stats.hugetlb_bytes >> 20) << " MB";
+  return ss.str();
+}
+
+TlbMissCounter::~TlbMissCounter() {
+#ifdef __linux__
+  if (fd_ >= 0) close(fd_);
+#endif
+}
+
+bool TlbMissCounter::Start() {
+#ifdef __linux__
+  if (fd_ >= 0) return true;
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  // The threads created after it are counted too
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd_ < 0) {
+    LOG(WARNING) << "Can't count the TLB misses: " << strerror(errno);
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+int64_t TlbMissCounter::Read() const {
+#ifdef __linux__
+  uint64_t count = 0;
+  if (fd_ >= 0 && read(fd_, &count, sizeof(count)) == sizeof(count)) {
+    return static_cast<int64_t>(count);
+  }
+#endif
+  return -1;
+}
+
+}  // namespace wenet
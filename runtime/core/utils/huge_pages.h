@@ -0,0 +1,99 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTILS_HUGE_PAGES_H_
+#define UTILS_HUGE_PAGES_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+const size_t kHugePageBytes = 2 << 20;
+
+// Ask the kernel to back the whole 2 MB pages of [data, data + size) by
+// the transparent huge pages, the private anonymous memory only, e.g. a
+// big heap allocation. The pages already touched are collapsed at once
+// since Linux 6.1, or by khugepaged later. Return false if it's not
+// supported, it's a no-op except on Linux.
+bool AdviseHugePages(const void* data, size_t size);
+
+// Memory of the 2 MB huge pages, of the hugetlbfs pool if the pages are
+// reserved, e.g. by vm.nr_hugepages, otherwise of the transparent huge
+// pages. The random reads of a big table, e.g. the arcs of a TLG, miss the
+// TLB much less. The memory is private, it's not shared by the processes
+// like a mapped file.
+class HugePageBuffer {
+ public:
+  // Return nullptr if the memory can't be allocated
+  static std::unique_ptr<HugePageBuffer> Allocate(size_t size);
+  ~HugePageBuffer();
+
+  char* data() const { return data_; }
+  size_t size() const { return size_; }
+  // If the pages are of the hugetlbfs pool
+  bool hugetlb() const { return hugetlb_; }
+
+ private:
+  HugePageBuffer() = default;
+
+  char* data_ = nullptr;
+  size_t size_ = 0;
+  size_t mapped_size_ = 0;
+  bool hugetlb_ = false;
+  // The buffer of the platforms without mmap
+  std::unique_ptr<char[]> buffer_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(HugePageBuffer);
+};
+
+// The memory of this process, by /proc/self, zero if not available
+struct MemoryStats {
+  size_t rss_bytes = 0;
+  // Of the transparent huge pages
+  size_t anon_huge_bytes = 0;
+  // Of the hugetlbfs pages
+  size_t hugetlb_bytes = 0;
+};
+bool ReadMemoryStats(MemoryStats* stats);
+std::string MemoryStatsString(const MemoryStats& stats);
+
+// Count the data TLB load misses of the calling thread and of the threads
+// it creates after Start() by the perf events, e.g. to compare the decoding
+// with and without the huge pages. The counter may be not permitted, see
+// kernel.perf_event_paranoid, it counts nothing then.
+class TlbMissCounter {
+ public:
+  TlbMissCounter() = default;
+  ~TlbMissCounter();
+
+  bool Start();
+  // -1 if it's not started
+  int64_t Read() const;
+
+ private:
+  int fd_ = -1;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(TlbMissCounter);
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_HUGE_PAGES_H_
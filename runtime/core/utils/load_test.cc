@@ -0,0 +1,263 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/load_test.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+#include <utility>
+
+#include "utils/log.h"
+#include "utils/metrics.h"
+
+namespace wenet {
+
+LoadTest::LoadTest(const LoadTestOptions& opts,
+                   std::vector<LoadTestWave> waves)
+    : opts_(opts), waves_(std::move(waves)) {
+  CHECK(!waves_.empty());
+  CHECK_GT(opts_.max_connections, 0);
+  CHECK_GT(opts_.stage_seconds, 0);
+}
+
+void LoadTest::Run() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    streams_.clear();
+    num_dropped_.assign(num_stages(), 0);
+    peak_active_.assign(num_stages(), 0);
+    stopped_ = false;
+  }
+  const auto start = std::chrono::steady_clock::now();
+  auto at = [start](double seconds) {
+    return start + std::chrono::microseconds(
+                       static_cast<int64_t>(seconds * 1e6));
+  };
+  if (opts_.arrival_rates.empty()) {
+    for (int i = 0; i < opts_.max_connections; ++i) {
+      TryStartStream(0);
+    }
+    std::this_thread::sleep_until(at(opts_.stage_seconds));
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  } else {
+    // The arrivals are evenly spaced, and never wait for the streams
+    for (int stage = 0; stage < num_stages(); ++stage) {
+      const double rate = opts_.arrival_rates[stage];
+      const int num_arrivals = static_cast<int>(rate * opts_.stage_seconds);
+      for (int i = 0; i < num_arrivals; ++i) {
+        std::this_thread::sleep_until(
+            at(stage * opts_.stage_seconds + i / rate));
+        TryStartStream(stage);
+      }
+    }
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cond_.wait(lock, [this]() { return num_active_ == 0; });
+}
+
+void LoadTest::TryStartStream(int stage) {
+  const LoadTestWave* wave = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (num_active_ >= opts_.max_connections) {
+      ++num_dropped_[stage];
+      return;
+    }
+    ++num_active_;
+    peak_active_[stage] = std::max(peak_active_[stage], num_active_);
+    wave = NextWave();
+  }
+  StartStream(*wave, stage);
+}
+
+void LoadTest::OnStreamDone(const LoadTestStream& stream) {
+  const LoadTestWave* next = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    streams_.push_back(stream);
+    if (opts_.arrival_rates.empty() && !stopped_) {
+      // The next closed loop stream takes over the connection, so Run() never
+      // sees it idle in between
+      next = NextWave();
+    } else if (--num_active_ == 0) {
+      done_cond_.notify_all();
+    }
+  }
+  if (next != nullptr) {
+    StartStream(*next, 0);
+  }
+}
+
+const LoadTestWave* LoadTest::NextWave() {
+  const LoadTestWave* wave = &waves_[next_wave_];
+  next_wave_ = (next_wave_ + 1) % waves_.size();
+  return wave;
+}
+
+// The nearest rank percentile of the sorted samples, 0 if there is none
+static double Percentile(const std::vector<double>& samples, double p) {
+  if (samples.empty()) return 0;
+  size_t rank = static_cast<size_t>(std::ceil(p / 100 * samples.size()));
+  return samples[std::max<size_t>(rank, 1) - 1];
+}
+
+// The samples of a stage, sorted
+struct StageStats {
+  int num_streams = 0;
+  int num_failed = 0;
+  double audio_ms = 0;
+  std::vector<double> setup_ms;
+  std::vector<double> first_partial_ms;
+  std::vector<double> partial_ms;
+  std::vector<double> final_ms;
+
+  // The latencies by their names in the reports
+  std::vector<std::pair<const char*, const std::vector<double>*>> latencies()
+      const {
+    return {{"setup", &setup_ms},
+            {"first_partial", &first_partial_ms},
+            {"partial", &partial_ms},
+            {"final", &final_ms}};
+  }
+};
+
+static std::vector<StageStats> CollectStages(
+    const std::vector<LoadTestStream>& streams, int num_stages) {
+  std::vector<StageStats> stages(num_stages);
+  for (const auto& stream : streams) {
+    StageStats& stats = stages[stream.stage];
+    ++stats.num_streams;
+    if (stream.setup_ms >= 0) stats.setup_ms.push_back(stream.setup_ms);
+    if (!stream.ok) {
+      ++stats.num_failed;
+      continue;
+    }
+    stats.audio_ms += stream.audio_ms;
+    if (stream.first_partial_ms >= 0) {
+      stats.first_partial_ms.push_back(stream.first_partial_ms);
+    }
+    stats.partial_ms.insert(stats.partial_ms.end(), stream.partial_ms.begin(),
+                            stream.partial_ms.end());
+    if (stream.final_ms >= 0) stats.final_ms.push_back(stream.final_ms);
+  }
+  for (auto& stats : stages) {
+    std::sort(stats.setup_ms.begin(), stats.setup_ms.end());
+    std::sort(stats.first_partial_ms.begin(), stats.first_partial_ms.end());
+    std::sort(stats.partial_ms.begin(), stats.partial_ms.end());
+    std::sort(stats.final_ms.begin(), stats.final_ms.end());
+  }
+  return stages;
+}
+
+std::string LoadTest::Report() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<StageStats> stages = CollectStages(streams_, num_stages());
+  std::string out;
+  char buf[256];
+  for (int i = 0; i < num_stages(); ++i) {
+    const StageStats& stats = stages[i];
+    if (opts_.arrival_rates.empty()) {
+      snprintf(buf, sizeof(buf), "Stage %d: %d closed loop connections\n", i,
+               opts_.max_connections);
+    } else {
+      snprintf(buf, sizeof(buf),
+               "Stage %d: %.2f streams/s, peak %d connections\n", i,
+               opts_.arrival_rates[i], peak_active_[i]);
+    }
+    out += buf;
+    snprintf(buf, sizeof(buf),
+             "  streams %d failed %d dropped %d, %.2f streams/s, %.2fx real "
+             "time\n",
+             stats.num_streams, stats.num_failed, num_dropped_[i],
+             (stats.num_streams - stats.num_failed) / opts_.stage_seconds,
+             stats.audio_ms / 1000 / opts_.stage_seconds);
+    out += buf;
+    for (const auto& latency : stats.latencies()) {
+      const std::vector<double>& samples = *latency.second;
+      snprintf(buf, sizeof(buf),
+               "  %-13s ms: count %zu p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+               latency.first, samples.size(), Percentile(samples, 50),
+               Percentile(samples, 90), Percentile(samples, 99),
+               samples.empty() ? 0.0 : samples.back());
+      out += buf;
+    }
+  }
+  return out;
+}
+
+std::string LoadTest::Curve() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<StageStats> stages = CollectStages(streams_, num_stages());
+  std::string out =
+      "stage,arrival_rate,peak_connections,streams,failed,dropped,"
+      "streams_per_second,realtime_factor,setup_p50_ms,setup_p99_ms,"
+      "first_partial_p50_ms,first_partial_p99_ms,partial_p50_ms,"
+      "partial_p99_ms,final_p50_ms,final_p90_ms,final_p99_ms\n";
+  char buf[512];
+  for (int i = 0; i < num_stages(); ++i) {
+    const StageStats& stats = stages[i];
+    const double rate =
+        opts_.arrival_rates.empty() ? 0 : opts_.arrival_rates[i];
+    const int peak = opts_.arrival_rates.empty() ? opts_.max_connections
+                                                 : peak_active_[i];
+    snprintf(buf, sizeof(buf),
+             "%d,%.3f,%d,%d,%d,%d,%.3f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,"
+             "%.1f,%.1f,%.1f\n",
+             i, rate, peak, stats.num_streams, stats.num_failed,
+             num_dropped_[i],
+             (stats.num_streams - stats.num_failed) / opts_.stage_seconds,
+             stats.audio_ms / 1000 / opts_.stage_seconds,
+             Percentile(stats.setup_ms, 50), Percentile(stats.setup_ms, 99),
+             Percentile(stats.first_partial_ms, 50),
+             Percentile(stats.first_partial_ms, 99),
+             Percentile(stats.partial_ms, 50),
+             Percentile(stats.partial_ms, 99), Percentile(stats.final_ms, 50),
+             Percentile(stats.final_ms, 90), Percentile(stats.final_ms, 99));
+    out += buf;
+  }
+  return out;
+}
+
+std::string LoadTest::Histograms() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<StageStats> stages = CollectStages(streams_, num_stages());
+  const std::vector<double>& bounds = LatencyBuckets();
+  std::string out = "stage,latency,le_ms,count\n";
+  char buf[128];
+  for (int i = 0; i < num_stages(); ++i) {
+    for (const auto& latency : stages[i].latencies()) {
+      const std::vector<double>& samples = *latency.second;
+      // The counts are cumulative as the ones of the servers, and the
+      // samples are sorted
+      for (double bound : bounds) {
+        size_t count = std::upper_bound(samples.begin(), samples.end(),
+                                        bound) -
+                       samples.begin();
+        snprintf(buf, sizeof(buf), "%d,%s,%g,%zu\n", i, latency.first, bound,
+                 count);
+        out += buf;
+      }
+      snprintf(buf, sizeof(buf), "%d,%s,+Inf,%zu\n", i, latency.first,
+               samples.size());
+      out += buf;
+    }
+  }
+  return out;
+}
+
+}  // namespace wenet
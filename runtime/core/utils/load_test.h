@@ -0,0 +1,128 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTILS_LOAD_TEST_H_
+#define UTILS_LOAD_TEST_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct LoadTestOptions {
+  std::string hostname = "127.0.0.1";
+  int port = 10086;
+  int nbest = 1;
+  bool continuous_decoding = false;
+  // The streams open at the same time. Without arrival_rates, the streams
+  // are closed loop, each finished one is followed by the next at once, so
+  // there are always max_connections streams. With arrival_rates, an
+  // arrival over it is dropped.
+  int max_connections = 10;
+  // The streams started per second of each stage, the stages run one after
+  // another, so an ascending list ramps the load up to the knee
+  std::vector<double> arrival_rates;
+  double stage_seconds = 60;
+  // The audio sent per message, and the pace, 1 is real time, 2 is twice
+  // as fast, 0 sends the messages as fast as the connection takes them
+  int chunk_ms = 500;
+  double speed = 1.0;
+  int num_io_threads = 1;
+};
+
+struct LoadTestWave {
+  std::string key;
+  int sample_rate = 16000;
+  std::vector<int16_t> pcm;
+};
+
+// The timing of a stream, the latencies are in milliseconds
+struct LoadTestStream {
+  int stage = 0;
+  bool ok = false;
+  double audio_ms = 0;
+  // From the start of the stream to the server taking its audio, e.g. the
+  // connection and the handshake, it's not counted in the latencies below
+  double setup_ms = -1;
+  // From the first audio sent to the first partial result
+  double first_partial_ms = -1;
+  // From the last audio sent before each partial result to the result, how
+  // far the partial results lag behind the audio
+  std::vector<double> partial_ms;
+  // From the end of the audio to the final result
+  double final_ms = -1;
+};
+
+// LoadTest drives the streams of a load test over a transport, e.g. the
+// websocket or the gRPC clients, and reports the latencies of each stage
+// the same way, so the servers are compared by the same numbers. The
+// latency histograms have the buckets of the latency metrics of the
+// servers.
+class LoadTest {
+ public:
+  LoadTest(const LoadTestOptions& opts, std::vector<LoadTestWave> waves);
+  virtual ~LoadTest() = default;
+
+  // Run all the stages and wait for their streams
+  virtual void Run();
+  // The percentiles of each stage
+  std::string Report() const;
+  // The throughput vs latency curve, one CSV row per stage
+  std::string Curve() const;
+  // The latency histograms of each stage, one CSV row per
+  // cumulative bucket
+  std::string Histograms() const;
+
+  const LoadTestOptions& options() const { return opts_; }
+
+ protected:
+  // Start a stream of wave, OnStreamDone() is called once it's done, on any
+  // thread
+  virtual void StartStream(const LoadTestWave& wave, int stage) = 0;
+  void OnStreamDone(const LoadTestStream& stream);
+
+  const LoadTestOptions opts_;
+
+ private:
+  int num_stages() const {
+    return opts_.arrival_rates.empty() ? 1 : opts_.arrival_rates.size();
+  }
+  // Start a stream of the next wave if there is room for it
+  void TryStartStream(int stage);
+  // The waves are streamed round robin, called with mutex_ held
+  const LoadTestWave* NextWave();
+
+  const std::vector<LoadTestWave> waves_;
+  mutable std::mutex mutex_;
+  std::condition_variable done_cond_;
+  int next_wave_ = 0;
+  int num_active_ = 0;
+  // Closed loop streams stop following each other after the stage
+  bool stopped_ = false;
+  std::vector<LoadTestStream> streams_;
+  std::vector<int> num_dropped_;
+  std::vector<int> peak_active_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(LoadTest);
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_LOAD_TEST_H_
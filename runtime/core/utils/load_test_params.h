@@ -0,0 +1,119 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTILS_LOAD_TEST_PARAMS_H_
+#define UTILS_LOAD_TEST_PARAMS_H_
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "frontend/wav.h"
+#include "utils/flags.h"
+#include "utils/load_test.h"
+#include "utils/log.h"
+#include "utils/string.h"
+
+// Load test flags of the clients, the waves of --wav_scp are streamed over
+// many connections
+DEFINE_string(wav_scp, "", "wav scp of the load test, instead of --wav_path");
+DEFINE_int32(num_connections, 10,
+             "max connections at the same time, they're always busy without "
+             "--arrival_rates");
+DEFINE_string(arrival_rates, "",
+              "streams started per second of each stage, comma separated, "
+              "e.g. 1,2,4,8 ramps the load up");
+DEFINE_double(stage_seconds, 60, "duration of each stage of the load test");
+DEFINE_int32(chunk_ms, 500, "audio of each message of the load test");
+DEFINE_double(speed, 1.0,
+              "pace of the audio, 1 is real time, 0 is as fast as possible");
+DEFINE_int32(io_threads, 1, "threads of the connections of the load test");
+DEFINE_string(curve_path, "",
+              "write the throughput vs latency curve of the stages as CSV");
+DEFINE_string(histogram_path, "",
+              "write the latency histograms of the stages as CSV, with the "
+              "buckets of the latency metrics of the servers");
+
+namespace wenet {
+
+// opts has the server and the decoding options of the client, the others
+// are set by the flags
+inline void InitLoadTestOptionsFromFlags(LoadTestOptions* opts) {
+  opts->max_connections = FLAGS_num_connections;
+  std::vector<std::string> rates;
+  SplitStringToVector(FLAGS_arrival_rates, ",", true, &rates);
+  opts->arrival_rates.clear();
+  for (const std::string& rate : rates) {
+    opts->arrival_rates.push_back(std::stod(rate));
+  }
+  opts->stage_seconds = FLAGS_stage_seconds;
+  opts->chunk_ms = FLAGS_chunk_ms;
+  opts->speed = FLAGS_speed;
+  opts->num_io_threads = FLAGS_io_threads;
+}
+
+inline std::vector<LoadTestWave> ReadLoadTestWaves(const std::string& path) {
+  std::vector<LoadTestWave> waves;
+  std::ifstream wav_scp(path);
+  std::string line;
+  while (getline(wav_scp, line)) {
+    std::vector<std::string> strs;
+    SplitString(line, &strs);
+    if (strs.size() < 2) continue;
+    WavReader wav_reader(strs[1]);
+    // Only support 16K
+    CHECK_EQ(wav_reader.sample_rate(), 16000);
+    LoadTestWave wave;
+    wave.key = strs[0];
+    wave.sample_rate = wav_reader.sample_rate();
+    wave.pcm.assign(wav_reader.data(),
+                    wav_reader.data() + wav_reader.num_sample());
+    waves.push_back(std::move(wave));
+  }
+  CHECK(!waves.empty()) << "No wave in " << path;
+  LOG(INFO) << "Load test of " << waves.size() << " waves";
+  return waves;
+}
+
+inline bool WriteLoadTestCsv(const std::string& path,
+                             const std::string& csv) {
+  if (path.empty()) return true;
+  std::ofstream os(path);
+  os << csv;
+  if (!os) {
+    LOG(ERROR) << "Failed to write " << path;
+    return false;
+  }
+  return true;
+}
+
+// Run the load test of --wav_scp with the generator of a transport, and
+// print or write its reports, returns the exit code of the client
+template <typename Generator>
+int RunLoadTestFromFlags(LoadTestOptions opts) {
+  InitLoadTestOptionsFromFlags(&opts);
+  Generator generator(opts, ReadLoadTestWaves(FLAGS_wav_scp));
+  generator.Run();
+  std::string curve = generator.Curve();
+  std::cout << generator.Report() << curve;
+  bool ok = WriteLoadTestCsv(FLAGS_curve_path, curve);
+  ok = WriteLoadTestCsv(FLAGS_histogram_path, generator.Histograms()) && ok;
+  return ok ? 0 : 1;
+}
+
+}  // namespace wenet
+
+#endif  // UTILS_LOAD_TEST_PARAMS_H_
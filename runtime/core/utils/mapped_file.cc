@@ -0,0 +1,101 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "utils/mapped_file.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <fstream>
+#include <iterator>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+static std::atomic<bool> g_huge_pages(false);
+
+void MappedFile::set_huge_pages(bool huge_pages) { g_huge_pages = huge_pages; }
+
+// Read the file of path of size bytes into the huge pages of buffer
+static bool ReadToHugePages(const std::string& path, size_t size,
+                            std::unique_ptr<HugePageBuffer>* buffer) {
+  *buffer = HugePageBuffer::Allocate(size);
+  if (*buffer == nullptr) return false;
+  std::ifstream is(path, std::ios::binary);
+  return is.read((*buffer)->data(), size) &&
+         static_cast<size_t>(is.gcount()) == size;
+}
+
+std::unique_ptr<MappedFile> MappedFile::Open(const std::string& path,
+                                             bool shared) {
+  std::unique_ptr<MappedFile> file(new MappedFile());
+#ifndef _WIN32
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(WARNING) << "Failed to open " << path;
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+  if (g_huge_pages && !shared) {
+    close(fd);
+    if (!ReadToHugePages(path, st.st_size, &file->huge_buffer_)) {
+      LOG(WARNING) << "Failed to read " << path << " into the huge pages";
+      return nullptr;
+    }
+    file->data_ = file->huge_buffer_->data();
+    file->size_ = st.st_size;
+    return file;
+  }
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    LOG(WARNING) << "Failed to map " << path;
+    return nullptr;
+  }
+  file->mapped_ = data;
+  file->data_ = static_cast<const char*>(data);
+  file->size_ = st.st_size;
+#else
+  std::ifstream is(path, std::ios::binary);
+  if (!is) {
+    LOG(WARNING) << "Failed to open " << path;
+    return nullptr;
+  }
+  file->buffer_.assign(std::istreambuf_iterator<char>(is),
+                       std::istreambuf_iterator<char>());
+  if (file->buffer_.empty()) return nullptr;
+  file->data_ = file->buffer_.data();
+  file->size_ = file->buffer_.size();
+#endif
+  return file;
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+  if (mapped_ != nullptr) munmap(mapped_, size_);
+#endif
+}
+
+}  // namespace wenet
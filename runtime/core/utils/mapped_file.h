@@ -0,0 +1,64 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef UTILS_MAPPED_FILE_H_
+#define UTILS_MAPPED_FILE_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utils/huge_pages.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// Read only view of a whole file. It's mapped into memory, so the processes
+// which read the same file share its pages, or read into a buffer on
+// Windows.
+class MappedFile {
+ public:
+  // Return nullptr if the file can't be read or is empty. shared: map it
+  // even with set_huge_pages(true), e.g. the weights of the models, which
+  // are shared by the processes rather than read randomly.
+  static std::unique_ptr<MappedFile> Open(const std::string& path,
+                                          bool shared = false);
+  ~MappedFile();
+
+  // Read the files opened after it into the huge pages instead of mapping
+  // them, see HugePageBuffer, for the big tables read randomly, e.g. the
+  // n-gram LMs and the symbol tables. The pages are not shared by the
+  // processes then.
+  static void set_huge_pages(bool huge_pages);
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  MappedFile() = default;
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  void* mapped_ = nullptr;
+  std::vector<char> buffer_;
+  std::unique_ptr<HugePageBuffer> huge_buffer_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(MappedFile);
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_MAPPED_FILE_H_
@@ -0,0 +1,150 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTILS_MATRIX_H_
+#define UTILS_MATRIX_H_
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+// Row-major matrix with one contiguous, aligned buffer. Every row starts at
+// a kAlignment bytes boundary, so the distance between two rows is stride()
+// elements, which may be larger than cols().
+template <typename T>
+class Matrix {
+ public:
+  static const int kAlignment = 64;
+
+  Matrix() = default;
+  Matrix(int rows, int cols) { Resize(rows, cols); }
+  explicit Matrix(const std::vector<std::vector<T>>& data) {
+    CopyFrom(data);
+  }
+  Matrix(const Matrix& other) { *this = other; }
+  Matrix(Matrix&& other) noexcept { *this = std::move(other); }
+
+  Matrix& operator=(const Matrix& other) {
+    if (this != &other) {
+      Resize(other.rows_, other.cols_);
+      if (capacity_ > 0) {
+        memcpy(data_.get(), other.data_.get(),
+               sizeof(T) * stride_ * rows_);
+      }
+    }
+    return *this;
+  }
+  Matrix& operator=(Matrix&& other) noexcept {
+    data_ = std::move(other.data_);
+    rows_ = other.rows_;
+    cols_ = other.cols_;
+    stride_ = other.stride_;
+    capacity_ = other.capacity_;
+    other.rows_ = other.cols_ = other.stride_ = other.capacity_ = 0;
+    return *this;
+  }
+
+  // Resize the matrix, the old content is not kept. The buffer is reused if
+  // it is big enough, so it's cheap to resize a matrix to the same shape.
+  void Resize(int rows, int cols) {
+    CHECK_GE(rows, 0);
+    CHECK_GE(cols, 0);
+    const int align = kAlignment / sizeof(T);
+    int stride = (cols + align - 1) / align * align;
+    size_t size = static_cast<size_t>(rows) * stride;
+    if (size > capacity_) {
+      void* ptr = nullptr;
+      CHECK_EQ(posix_memalign(&ptr, kAlignment, sizeof(T) * size), 0);
+      data_.reset(static_cast<T*>(ptr));
+      capacity_ = size;
+    }
+    rows_ = rows;
+    cols_ = cols;
+    stride_ = stride;
+  }
+
+  void SetZero() {
+    if (capacity_ > 0) {
+      memset(data_.get(), 0, sizeof(T) * stride_ * rows_);
+    }
+  }
+
+  void CopyFrom(const std::vector<std::vector<T>>& data) {
+    int cols = data.empty() ? 0 : data[0].size();
+    Resize(data.size(), cols);
+    for (int i = 0; i < rows_; ++i) {
+      CHECK_EQ(data[i].size(), cols_);
+      memcpy(Row(i), data[i].data(), sizeof(T) * cols_);
+    }
+  }
+
+  void CopyTo(std::vector<std::vector<T>>* data) const {
+    data->resize(rows_);
+    for (int i = 0; i < rows_; ++i) {
+      (*data)[i].assign(Row(i), Row(i) + cols_);
+    }
+  }
+
+  // Copy `num_rows` rows of `src` from `src_row` to the rows of this matrix
+  // from `dst_row`, they must have the same cols.
+  void CopyRows(const Matrix& src, int src_row, int num_rows, int dst_row) {
+    CHECK_EQ(src.cols_, cols_);
+    CHECK_LE(src_row + num_rows, src.rows_);
+    CHECK_LE(dst_row + num_rows, rows_);
+    for (int i = 0; i < num_rows; ++i) {
+      memcpy(Row(dst_row + i), src.Row(src_row + i), sizeof(T) * cols_);
+    }
+  }
+
+  int rows() const { return rows_; }
+  int cols() const { return cols_; }
+  int stride() const { return stride_; }
+  bool empty() const { return rows_ == 0; }
+  // Bytes of the buffer, which is kept when the matrix shrinks
+  size_t AllocatedBytes() const { return sizeof(T) * capacity_; }
+  T* data() { return data_.get(); }
+  const T* data() const { return data_.get(); }
+  T* Row(int r) { return data_.get() + static_cast<size_t>(r) * stride_; }
+  const T* Row(int r) const {
+    return data_.get() + static_cast<size_t>(r) * stride_;
+  }
+  T& operator()(int r, int c) { return Row(r)[c]; }
+  const T& operator()(int r, int c) const { return Row(r)[c]; }
+
+ private:
+  struct FreeDeleter {
+    void operator()(T* ptr) const { free(ptr); }
+  };
+
+  std::unique_ptr<T, FreeDeleter> data_;
+  int rows_ = 0;
+  int cols_ = 0;
+  int stride_ = 0;
+  size_t capacity_ = 0;
+};
+
+// (num_frames, feature_dim) fbank features
+using FeatureMatrix = Matrix<float>;
+// (num_frames, vocab_size) ctc log probabilities
+using LogProbMatrix = Matrix<float>;
+
+}  // namespace wenet
+
+#endif  // UTILS_MATRIX_H_
@@ -0,0 +1,146 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/metrics.h"
+
+#include <algorithm>
+#include <sstream>
+#include <utility>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+Histogram::Histogram(std::vector<double> bounds) : bounds_(std::move(bounds)) {
+  CHECK(std::is_sorted(bounds_.begin(), bounds_.end()));
+  for (int i = 0; i < kNumShards; ++i) {
+    shards_.emplace_back(new Shard(bounds_.size() + 1));
+  }
+}
+
+void Histogram::Observe(double value) {
+  // Each thread sticks to one shard
+  static std::atomic<int> next_shard{0};
+  thread_local int shard_index =
+      next_shard.fetch_add(1, std::memory_order_relaxed) % kNumShards;
+  Shard* shard = shards_[shard_index].get();
+  int bucket = std::lower_bound(bounds_.begin(), bounds_.end(), value) -
+               bounds_.begin();
+  shard->counts[bucket].fetch_add(1, std::memory_order_relaxed);
+  // Rarely contended, only the threads of the same shard race on it
+  double sum = shard->sum.load(std::memory_order_relaxed);
+  while (!shard->sum.compare_exchange_weak(sum, sum + value,
+                                           std::memory_order_relaxed)) {
+  }
+}
+
+void Histogram::Collect(std::vector<uint64_t>* counts, double* sum) const {
+  counts->assign(bounds_.size() + 1, 0);
+  *sum = 0;
+  for (const auto& shard : shards_) {
+    for (size_t i = 0; i < counts->size(); ++i) {
+      (*counts)[i] += shard->counts[i].load(std::memory_order_relaxed);
+    }
+    *sum += shard->sum.load(std::memory_order_relaxed);
+  }
+}
+
+const std::vector<double>& LatencyBuckets() {
+  static const std::vector<double> buckets = {
+      0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};
+  return buckets;
+}
+
+const std::vector<double>& RtfBuckets() {
+  static const std::vector<double> buckets = {0.01, 0.02, 0.05, 0.1, 0.2,
+                                              0.3,  0.5,  0.7,  1,   2};
+  return buckets;
+}
+
+MetricsRegistry* MetricsRegistry::Global() {
+  static MetricsRegistry* registry = new MetricsRegistry();
+  return registry;
+}
+
+Histogram* MetricsRegistry::GetHistogram(const std::string& name,
+                                         const std::string& help,
+                                         const std::vector<double>& bounds) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Metric& metric = metrics_[name];
+  if (metric.histogram == nullptr) {
+    CHECK(metric.gauge == nullptr && metric.callback == nullptr) << name;
+    metric.help = help;
+    metric.histogram.reset(new Histogram(bounds));
+  }
+  return metric.histogram.get();
+}
+
+Gauge* MetricsRegistry::GetGauge(const std::string& name,
+                                 const std::string& help) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Metric& metric = metrics_[name];
+  if (metric.gauge == nullptr) {
+    CHECK(metric.histogram == nullptr && metric.callback == nullptr) << name;
+    metric.help = help;
+    metric.gauge.reset(new Gauge());
+  }
+  return metric.gauge.get();
+}
+
+void MetricsRegistry::SetGaugeCallback(const std::string& name,
+                                       const std::string& help,
+                                       std::function<double()> callback) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Metric& metric = metrics_[name];
+  CHECK(metric.histogram == nullptr && metric.gauge == nullptr) << name;
+  metric.help = help;
+  metric.callback = std::move(callback);
+}
+
+std::string MetricsRegistry::Render() const {
+  std::ostringstream out;
+  std::vector<uint64_t> counts;
+  double sum = 0;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& it : metrics_) {
+    const std::string& name = it.first;
+    const Metric& metric = it.second;
+    out << "# HELP " << name << " " << metric.help << "\n";
+    if (metric.histogram != nullptr) {
+      out << "# TYPE " << name << " histogram\n";
+      metric.histogram->Collect(&counts, &sum);
+      const std::vector<double>& bounds = metric.histogram->bounds();
+      uint64_t count = 0;
+      for (size_t i = 0; i < bounds.size(); ++i) {
+        count += counts[i];
+        out << name << "_bucket{le=\"" << bounds[i] << "\"} " << count
+            << "\n";
+      }
+      count += counts.back();
+      out << name << "_bucket{le=\"+Inf\"} " << count << "\n";
+      out << name << "_sum " << sum << "\n";
+      out << name << "_count " << count << "\n";
+    } else {
+      out << "# TYPE " << name << " gauge\n";
+      if (metric.gauge != nullptr) {
+        out << name << " " << metric.gauge->value() << "\n";
+      } else {
+        out << name << " " << metric.callback() << "\n";
+      }
+    }
+  }
+  return out.str();
+}
+
+}  // namespace wenet
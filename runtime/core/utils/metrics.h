@@ -0,0 +1,121 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTILS_METRICS_H_
+#define UTILS_METRICS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+// Histogram counts the observed values in buckets, the upper bounds of the
+// buckets are ascending and the last bucket is +Inf. Observe() is lock
+// free and cheap, the counts are sharded by thread, so the decoding threads
+// don't contend for the cache lines, and they're summed when collected.
+class Histogram {
+ public:
+  explicit Histogram(std::vector<double> bounds);
+
+  void Observe(double value);
+  // The count of each bucket, not cumulative, with the +Inf one at last
+  void Collect(std::vector<uint64_t>* counts, double* sum) const;
+  const std::vector<double>& bounds() const { return bounds_; }
+
+ private:
+  static const int kNumShards = 16;
+  struct Shard {
+    explicit Shard(int num_buckets) : counts(num_buckets) {}
+    std::vector<std::atomic<uint64_t>> counts;
+    std::atomic<double> sum{0};
+    // Keep the sums of the shards off the same cache line
+    char padding[64];
+  };
+
+  const std::vector<double> bounds_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(Histogram);
+};
+
+class Gauge {
+ public:
+  Gauge() = default;
+  void Set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+  void Add(int64_t delta) {
+    value_.fetch_add(delta, std::memory_order_relaxed);
+  }
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value_{0};
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(Gauge);
+};
+
+// The bucket bounds of the latencies in milliseconds, from 0.1ms to 5s
+const std::vector<double>& LatencyBuckets();
+// The bucket bounds of the RTF, from 0.01 to 2
+const std::vector<double>& RtfBuckets();
+
+// MetricsRegistry owns the named metrics and renders them in the text
+// exposition format of Prometheus, for the /metrics endpoint of the
+// servers. The metrics live as long as the registry, so the users look
+// them up once and keep the pointers. It is thread safe.
+class MetricsRegistry {
+ public:
+  MetricsRegistry() = default;
+  // The registry of the process, which all the modules report to
+  static MetricsRegistry* Global();
+
+  // Return the registered metric of the name, or register a new one
+  Histogram* GetHistogram(const std::string& name, const std::string& help,
+                          const std::vector<double>& bounds);
+  Gauge* GetGauge(const std::string& name, const std::string& help);
+  // A gauge whose value is read by `callback` when it's rendered, e.g. the
+  // queue depth of a scheduler. The callback replaces the registered one.
+  void SetGaugeCallback(const std::string& name, const std::string& help,
+                        std::function<double()> callback);
+
+  std::string Render() const;
+
+ private:
+  struct Metric {
+    std::string help;
+    std::unique_ptr<Histogram> histogram;
+    std::unique_ptr<Gauge> gauge;
+    std::function<double()> callback;
+  };
+
+  mutable std::mutex mutex_;
+  // Rendered in the order of the names
+  std::map<std::string, Metric> metrics_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(MetricsRegistry);
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_METRICS_H_
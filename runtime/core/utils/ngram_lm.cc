@@ -0,0 +1,297 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "utils/ngram_lm.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+static const char kMagic[4] = {'W', 'N', 'L', 'M'};
+static const int32_t kVersion = 1;
+static const int kCodebookSize = 256;
+
+// Byte size of the buffer of a LM of order with num_nodes nodes
+static size_t BufferSize(int32_t order, int32_t num_nodes) {
+  return 28 + sizeof(int32_t) * (order + 2) +
+         sizeof(float) * order * kCodebookSize * 2 +
+         sizeof(int32_t) * (num_nodes * 3 + 1) +
+         sizeof(uint8_t) * num_nodes * 2;
+}
+
+static int FindChild(const int32_t* words, const int32_t* children, int node,
+                     int word) {
+  const int32_t* begin = words + children[node];
+  const int32_t* end = words + children[node + 1];
+  const int32_t* it = std::lower_bound(begin, end, word);
+  if (it == end || *it != word) return -1;
+  return it - words;
+}
+
+// Return the node of the n-gram [begin, end), or -1
+static int FindNode(const std::vector<int32_t>& words,
+                    const std::vector<int32_t>& children,
+                    std::vector<int>::const_iterator begin,
+                    std::vector<int>::const_iterator end) {
+  int node = 0;
+  for (auto it = begin; it != end && node >= 0; ++it) {
+    node = FindChild(words.data(), children.data(), node, *it);
+  }
+  return node;
+}
+
+// Quantize the values to the nearest of kCodebookSize centroids, each of
+// which is the mean of the same number of sorted values
+static void Quantize(const float* values, int size, float* codebook,
+                     uint8_t* codes) {
+  std::vector<float> sorted(values, values + size);
+  std::sort(sorted.begin(), sorted.end());
+  for (int b = 0; b < kCodebookSize; ++b) {
+    int64_t lo = static_cast<int64_t>(size) * b / kCodebookSize;
+    int64_t hi = static_cast<int64_t>(size) * (b + 1) / kCodebookSize;
+    if (hi > lo) {
+      double sum = 0;
+      for (int64_t i = lo; i < hi; ++i) sum += sorted[i];
+      codebook[b] = sum / (hi - lo);
+    } else {
+      codebook[b] = b > 0 ? codebook[b - 1] : (size > 0 ? sorted[0] : 0);
+    }
+  }
+  for (int i = 0; i < size; ++i) {
+    const float* it =
+        std::lower_bound(codebook, codebook + kCodebookSize, values[i]);
+    if (it == codebook + kCodebookSize ||
+        (it != codebook && values[i] - *(it - 1) < *it - values[i])) {
+      --it;
+    }
+    codes[i] = it - codebook;
+  }
+}
+
+std::unique_ptr<NgramLm> NgramLm::Build(const std::vector<NGram>& ngrams,
+                                        int bos, int eos, float unk_logprob) {
+  int order = 0;
+  for (const NGram& ngram : ngrams) {
+    order = std::max(order, static_cast<int>(ngram.words.size()));
+  }
+  std::vector<std::vector<const NGram*>> levels(order + 1);
+  for (const NGram& ngram : ngrams) {
+    if (!ngram.words.empty()) levels[ngram.words.size()].push_back(&ngram);
+  }
+
+  // 1. The trie, level by level. The n-grams of a level are sorted by their
+  // words, so the children of a node are consecutive and sorted by word.
+  std::vector<int32_t> level_begin = {0, 1};
+  std::vector<int32_t> words = {-1};
+  std::vector<int32_t> children;
+  std::vector<int32_t> suffix = {0};
+  std::vector<float> probs = {0};
+  std::vector<float> backoffs = {0};
+  std::vector<const NGram*> prev;
+  int num_skipped = 0;
+  for (int n = 1; n <= order; ++n) {
+    std::vector<const NGram*>& level = levels[n];
+    std::sort(level.begin(), level.end(), [](const NGram* a, const NGram* b) {
+      return a->words < b->words;
+    });
+    std::vector<const NGram*> cur;
+    std::vector<int> num_children(level_begin[n] - level_begin[n - 1], 0);
+    size_t j = 0;
+    for (const NGram* ngram : level) {
+      const std::vector<int>& w = ngram->words;
+      if (!cur.empty() && cur.back()->words == w) continue;
+      int parent = 0;
+      int suffix_node = 0;
+      if (n > 1) {
+        while (j < prev.size() &&
+               std::lexicographical_compare(prev[j]->words.begin(),
+                                            prev[j]->words.end(), w.begin(),
+                                            w.end() - 1)) {
+          ++j;
+        }
+        if (j == prev.size() ||
+            !std::equal(prev[j]->words.begin(), prev[j]->words.end(),
+                        w.begin())) {
+          ++num_skipped;
+          continue;
+        }
+        parent = level_begin[n - 1] + j;
+        suffix_node = FindNode(words, children, w.begin() + 1, w.end());
+        if (suffix_node < 0) {
+          ++num_skipped;
+          continue;
+        }
+      }
+      ++num_children[parent - level_begin[n - 1]];
+      words.push_back(w.back());
+      suffix.push_back(suffix_node);
+      probs.push_back(ngram->logprob);
+      backoffs.push_back(ngram->backoff);
+      cur.push_back(ngram);
+    }
+    level_begin.push_back(words.size());
+    // The children of level n - 1 are known now
+    children.resize(level_begin[n] + 1);
+    children[level_begin[n - 1]] = level_begin[n];
+    for (int i = level_begin[n - 1]; i < level_begin[n]; ++i) {
+      children[i + 1] = children[i] + num_children[i - level_begin[n - 1]];
+    }
+    prev.swap(cur);
+  }
+  int num_nodes = words.size();
+  if (order == 0) children = {1};
+  children.resize(num_nodes + 1, num_nodes);
+  if (num_skipped > 0) {
+    LOG(WARNING) << "Skip " << num_skipped
+                 << " n-grams whose context or suffix is not in the LM";
+  }
+
+  // 2. Fill the arrays in the buffer, and quantize the weights of each order
+  std::unique_ptr<NgramLm> lm(new NgramLm());
+  lm->buffer_.resize(BufferSize(order, num_nodes));
+  Header* header = reinterpret_cast<Header*>(lm->buffer_.data());
+  memcpy(header->magic, kMagic, sizeof(kMagic));
+  header->version = kVersion;
+  header->order = order;
+  header->num_nodes = num_nodes;
+  header->bos = bos;
+  header->eos = eos;
+  header->unk_logprob = unk_logprob;
+  CHECK(lm->Attach(lm->buffer_.data(), lm->buffer_.size()));
+  memcpy(const_cast<int32_t*>(lm->level_begin_), level_begin.data(),
+         sizeof(int32_t) * level_begin.size());
+  memcpy(const_cast<int32_t*>(lm->words_), words.data(),
+         sizeof(int32_t) * num_nodes);
+  memcpy(const_cast<int32_t*>(lm->children_), children.data(),
+         sizeof(int32_t) * (num_nodes + 1));
+  memcpy(const_cast<int32_t*>(lm->suffix_), suffix.data(),
+         sizeof(int32_t) * num_nodes);
+  uint8_t* prob = const_cast<uint8_t*>(lm->prob_);
+  uint8_t* backoff = const_cast<uint8_t*>(lm->backoff_);
+  prob[0] = backoff[0] = 0;
+  for (int n = 1; n <= order; ++n) {
+    int begin = level_begin[n];
+    int size = level_begin[n + 1] - begin;
+    float* offset = const_cast<float*>(lm->prob_codebook_);
+    Quantize(probs.data() + begin, size, offset + (n - 1) * kCodebookSize,
+             prob + begin);
+    offset = const_cast<float*>(lm->backoff_codebook_);
+    Quantize(backoffs.data() + begin, size, offset + (n - 1) * kCodebookSize,
+             backoff + begin);
+  }
+  VLOG(1) << "N-gram LM of order " << order << ", " << num_nodes - 1
+          << " n-grams";
+  return lm;
+}
+
+bool NgramLm::Attach(const char* data, size_t size) {
+  if (size < sizeof(Header)) return false;
+  header_ = reinterpret_cast<const Header*>(data);
+  if (memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header_->version != kVersion || header_->order < 0 ||
+      header_->num_nodes <= 0 ||
+      size != BufferSize(header_->order, header_->num_nodes)) {
+    return false;
+  }
+  int32_t n = header_->num_nodes;
+  const char* p = data + sizeof(Header);
+  level_begin_ = reinterpret_cast<const int32_t*>(p);
+  p += sizeof(int32_t) * (header_->order + 2);
+  prob_codebook_ = reinterpret_cast<const float*>(p);
+  p += sizeof(float) * header_->order * kCodebookSize;
+  backoff_codebook_ = reinterpret_cast<const float*>(p);
+  p += sizeof(float) * header_->order * kCodebookSize;
+  words_ = reinterpret_cast<const int32_t*>(p);
+  p += sizeof(int32_t) * n;
+  children_ = reinterpret_cast<const int32_t*>(p);
+  p += sizeof(int32_t) * (n + 1);
+  suffix_ = reinterpret_cast<const int32_t*>(p);
+  p += sizeof(int32_t) * n;
+  prob_ = reinterpret_cast<const uint8_t*>(p);
+  p += sizeof(uint8_t) * n;
+  backoff_ = reinterpret_cast<const uint8_t*>(p);
+  return true;
+}
+
+std::unique_ptr<NgramLm> NgramLm::Read(const std::string& path) {
+  std::unique_ptr<NgramLm> lm(new NgramLm());
+  lm->file_ = MappedFile::Open(path);
+  if (lm->file_ == nullptr ||
+      !lm->Attach(lm->file_->data(), lm->file_->size())) {
+    LOG(WARNING) << path << " is not a valid n-gram LM";
+    return nullptr;
+  }
+  return lm;
+}
+
+bool NgramLm::Write(const std::string& path) const {
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (fp == nullptr) return false;
+  size_t size = BufferSize(header_->order, header_->num_nodes);
+  bool ok = fwrite(header_, 1, size, fp) == size;
+  return fclose(fp) == 0 && ok;
+}
+
+int NgramLm::Child(int node, int word) const {
+  return FindChild(words_, children_, node, word);
+}
+
+int NgramLm::Order(int node) const {
+  return std::upper_bound(level_begin_, level_begin_ + header_->order + 2,
+                          node) -
+         level_begin_ - 1;
+}
+
+float NgramLm::Prob(int node) const {
+  return prob_codebook_[(Order(node) - 1) * kCodebookSize + prob_[node]];
+}
+
+float NgramLm::Backoff(int node) const {
+  return backoff_codebook_[(Order(node) - 1) * kCodebookSize +
+                           backoff_[node]];
+}
+
+int NgramLm::BeginState() const {
+  int node = Child(0, header_->bos);
+  if (node < 0) return 0;
+  return Order(node) == header_->order ? suffix_[node] : node;
+}
+
+float NgramLm::Score(int state, int word, int* next_state) const {
+  float backoff = 0;
+  for (int node = state;; node = suffix_[node]) {
+    int child = Child(node, word);
+    if (child >= 0) {
+      // The n-grams of the highest order can't be a context
+      *next_state = Order(child) == header_->order ? suffix_[child] : child;
+      return backoff + Prob(child);
+    }
+    if (node == 0) break;
+    backoff += Backoff(node);
+  }
+  *next_state = 0;
+  return backoff + header_->unk_logprob;
+}
+
+float NgramLm::FinalScore(int state) const {
+  int next_state = 0;
+  return Score(state, header_->eos, &next_state);
+}
+
+}  // namespace wenet
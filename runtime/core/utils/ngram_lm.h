@@ -0,0 +1,113 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef UTILS_NGRAM_LM_H_
+#define UTILS_NGRAM_LM_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utils/mapped_file.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// Backoff n-gram LM for the shallow fusion in CtcPrefixBeamSearch. The
+// n-grams are the nodes of a trie in BFS order, which is stored in one flat
+// buffer, and it's also the file format, so Read() just maps the file. The
+// probabilities and the backoff weights are quantized to 8 bits by the
+// codebook of each order, a n-gram takes 14 bytes.
+//
+// A state is the node of the context, the n-gram of the longest history
+// which is in the LM, so the state of a hypothesis is computed once per
+// prefix and it's all the search has to keep.
+class NgramLm {
+ public:
+  // The n-gram of ARPA, the words are in left to right order, and the
+  // probabilities are natural logs
+  struct NGram {
+    std::vector<int> words;
+    float logprob = 0;
+    float backoff = 0;
+  };
+
+  // The n-grams whose context or suffix is not in the LM are skipped.
+  // unk_logprob is the log prob of a word which is not in the LM.
+  static std::unique_ptr<NgramLm> Build(const std::vector<NGram>& ngrams,
+                                        int bos, int eos, float unk_logprob);
+  // Return nullptr if the file is not a valid LM
+  static std::unique_ptr<NgramLm> Read(const std::string& path);
+  bool Write(const std::string& path) const;
+
+  // The state after <s>
+  int BeginState() const;
+  // Return the log prob of word after state, and set the state after it
+  float Score(int state, int word, int* next_state) const;
+  // Return the log prob of </s> after state
+  float FinalScore(int state) const;
+
+  int order() const { return header_->order; }
+  int num_ngrams() const { return header_->num_nodes - 1; }
+
+ private:
+  struct Header {
+    char magic[4];
+    int32_t version;
+    int32_t order;
+    int32_t num_nodes;
+    int32_t bos;
+    int32_t eos;
+    float unk_logprob;
+  };
+
+  NgramLm() = default;
+  // Point the arrays below to the buffer of size bytes
+  bool Attach(const char* data, size_t size);
+  // Return the child of node by word, or -1
+  int Child(int node, int word) const;
+  int Order(int node) const;
+  float Prob(int node) const;
+  float Backoff(int node) const;
+
+  std::vector<char> buffer_;
+  // The mapped file, buffer_ is not used then
+  std::unique_ptr<MappedFile> file_;
+
+  const Header* header_ = nullptr;
+  // Nodes [level_begin_[n], level_begin_[n + 1]) are the n-grams, node 0 is
+  // the root
+  const int32_t* level_begin_ = nullptr;
+  // 256 centroids of each order
+  const float* prob_codebook_ = nullptr;
+  const float* backoff_codebook_ = nullptr;
+  // The last word of the n-gram
+  const int32_t* words_ = nullptr;
+  // The children of node are [children_[node], children_[node + 1]),
+  // sorted by word
+  const int32_t* children_ = nullptr;
+  // The n-gram without its first word
+  const int32_t* suffix_ = nullptr;
+  const uint8_t* prob_ = nullptr;
+  const uint8_t* backoff_ = nullptr;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(NgramLm);
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_NGRAM_LM_H_
@@ -0,0 +1,198 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/quantized_frames.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+// Round to nearest even, the values over the max half are inf
+static uint16_t FloatToHalf(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  uint32_t abs = bits & 0x7fffffff;
+  if (abs >= 0x7f800000) {  // inf or nan
+    return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+  }
+  if (abs >= 0x477ff000) {  // 65520, rounded to inf
+    return sign | 0x7c00;
+  }
+  if (abs < 0x38800000) {  // 2^-14, subnormal in half, in units of 2^-24
+    float abs_value;
+    memcpy(&abs_value, &abs, sizeof(abs_value));
+    return sign |
+           static_cast<uint16_t>(std::nearbyint(abs_value * 16777216.0f));
+  }
+  // Rebias the exponent and round the 13 dropped bits of the mantissa
+  abs += 0xc8000fff + ((abs >> 13) & 1);
+  return sign | static_cast<uint16_t>(abs >> 13);
+}
+
+static float HalfToFloat(uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  const uint32_t exponent = (half >> 10) & 0x1f;
+  const uint32_t mantissa = half & 0x3ff;
+  uint32_t bits;
+  if (exponent == 0) {
+    float value = std::ldexp(static_cast<float>(mantissa), -24);
+    return sign ? -value : value;
+  } else if (exponent == 0x1f) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+bool ParseFrameDtype(const std::string& name, FrameDtype* dtype) {
+  if (name == "float32") {
+    *dtype = FrameDtype::kFloat32;
+  } else if (name == "float16") {
+    *dtype = FrameDtype::kFloat16;
+  } else if (name == "int8") {
+    *dtype = FrameDtype::kInt8;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void QuantizedFrames::set_dtype(FrameDtype dtype) {
+  if (dtype != dtype_) {
+    float_data_ = std::vector<float>();
+    half_data_ = std::vector<uint16_t>();
+    int8_data_ = std::vector<int8_t>();
+    scales_ = std::vector<float>();
+    dtype_ = dtype;
+  }
+  Clear();
+}
+
+void QuantizedFrames::Clear() {
+  start_ = 0;
+  num_frames_ = 0;
+  float_data_.clear();
+  half_data_.clear();
+  int8_data_.clear();
+  scales_.clear();
+}
+
+void QuantizedFrames::DropFront(int num_frames) {
+  CHECK_LE(num_frames, num_frames_);
+  start_ += num_frames;
+  num_frames_ -= num_frames;
+}
+
+void QuantizedFrames::Compact() {
+  const size_t begin = static_cast<size_t>(start_) * dim_;
+  const size_t end = static_cast<size_t>(start_ + num_frames_) * dim_;
+  switch (dtype_) {
+    case FrameDtype::kFloat32:
+      std::copy(float_data_.begin() + begin, float_data_.begin() + end,
+                float_data_.begin());
+      break;
+    case FrameDtype::kFloat16:
+      std::copy(half_data_.begin() + begin, half_data_.begin() + end,
+                half_data_.begin());
+      break;
+    case FrameDtype::kInt8:
+      std::copy(int8_data_.begin() + begin, int8_data_.begin() + end,
+                int8_data_.begin());
+      std::copy(scales_.begin() + start_,
+                scales_.begin() + start_ + num_frames_, scales_.begin());
+      break;
+  }
+  start_ = 0;
+}
+
+void QuantizedFrames::Append(const float* data, int num_frames, int dim) {
+  if (num_frames_ == 0) {
+    dim_ = dim;
+    start_ = 0;
+  }
+  CHECK_EQ(dim, dim_);
+  // Reclaim the dropped frames
+  if (start_ > num_frames_) Compact();
+  const size_t kept = static_cast<size_t>(start_ + num_frames_) * dim;
+  const size_t size = static_cast<size_t>(num_frames) * dim;
+  // std::vector grows geometrically, so appending is amortized O(frames)
+  switch (dtype_) {
+    case FrameDtype::kFloat32:
+      float_data_.resize(kept);
+      float_data_.insert(float_data_.end(), data, data + size);
+      break;
+    case FrameDtype::kFloat16:
+      half_data_.resize(kept + size);
+      for (size_t i = 0; i < size; ++i) {
+        half_data_[kept + i] = FloatToHalf(data[i]);
+      }
+      break;
+    case FrameDtype::kInt8:
+      int8_data_.resize(kept + size);
+      scales_.resize(start_ + num_frames_ + num_frames);
+      for (int t = 0; t < num_frames; ++t) {
+        const float* frame = data + static_cast<size_t>(t) * dim;
+        int8_t* q = int8_data_.data() + kept + static_cast<size_t>(t) * dim;
+        float max_abs = 0.0f;
+        for (int i = 0; i < dim; ++i) {
+          max_abs = std::max(max_abs, std::fabs(frame[i]));
+        }
+        const float inv_scale = max_abs > 0.0f ? 127.0f / max_abs : 0.0f;
+        for (int i = 0; i < dim; ++i) {
+          q[i] = static_cast<int8_t>(std::lrint(frame[i] * inv_scale));
+        }
+        scales_[start_ + num_frames_ + t] = max_abs / 127.0f;
+      }
+      break;
+  }
+  num_frames_ += num_frames;
+}
+
+const float* QuantizedFrames::Data(std::vector<float>* buffer) const {
+  const size_t begin = static_cast<size_t>(start_) * dim_;
+  const size_t size = static_cast<size_t>(num_frames_) * dim_;
+  switch (dtype_) {
+    case FrameDtype::kFloat32:
+      return float_data_.data() + begin;
+    case FrameDtype::kFloat16:
+      buffer->resize(size);
+      for (size_t i = 0; i < size; ++i) {
+        (*buffer)[i] = HalfToFloat(half_data_[begin + i]);
+      }
+      break;
+    case FrameDtype::kInt8:
+      buffer->resize(size);
+      for (int t = 0; t < num_frames_; ++t) {
+        const float scale = scales_[start_ + t];
+        const int8_t* q = int8_data_.data() + begin +
+                          static_cast<size_t>(t) * dim_;
+        float* out = buffer->data() + static_cast<size_t>(t) * dim_;
+        for (int i = 0; i < dim_; ++i) {
+          out[i] = q[i] * scale;
+        }
+      }
+      break;
+  }
+  return buffer->data();
+}
+
+}  // namespace wenet
@@ -0,0 +1,89 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef UTILS_QUANTIZED_FRAMES_H_
+#define UTILS_QUANTIZED_FRAMES_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+enum class FrameDtype {
+  kFloat32,
+  // IEEE half, ~3 significant digits
+  kFloat16,
+  // Symmetric int8 of a scale per frame, the max abs of the frame over 127
+  kInt8,
+};
+
+// "float32", "float16" or "int8"
+bool ParseFrameDtype(const std::string& name, FrameDtype* dtype);
+
+// Fixed dim frames which are appended at the back and dropped at the front,
+// e.g. the encoder outputs kept for the rescoring, stored in dtype to save
+// the memory of the long lived ones. They are read back as float32 at once.
+// The dropped frames are reclaimed when they are more than the kept ones,
+// so the storage is at most about twice of the frames kept.
+class QuantizedFrames {
+ public:
+  explicit QuantizedFrames(FrameDtype dtype = FrameDtype::kFloat32)
+      : dtype_(dtype) {}
+
+  FrameDtype dtype() const { return dtype_; }
+  // Also drops all the frames
+  void set_dtype(FrameDtype dtype);
+  int dim() const { return dim_; }
+  int num_frames() const { return num_frames_; }
+
+  // Append num_frames frames of dim, the dim must be the same since Clear()
+  void Append(const float* data, int num_frames, int dim);
+  // Drop the oldest num_frames frames
+  void DropFront(int num_frames);
+  // Drop all the frames, the buffers are kept
+  void Clear();
+
+  // The frames as (num_frames, dim) float32. For kFloat32 it points to the
+  // frames directly, otherwise they are dequantized into buffer. It's valid
+  // until the next change of the frames or of buffer.
+  const float* Data(std::vector<float>* buffer) const;
+
+  size_t MemoryBytes() const {
+    return VectorBytes(float_data_) + VectorBytes(half_data_) +
+           VectorBytes(int8_data_) + VectorBytes(scales_);
+  }
+
+ private:
+  // Move the kept frames to the front of the buffers
+  void Compact();
+
+  FrameDtype dtype_;
+  int dim_ = 0;
+  // The kept frames are [start_, start_ + num_frames_) of the buffers
+  int start_ = 0;
+  int num_frames_ = 0;
+  // Only the one of dtype_ is used, with scales_ for kInt8
+  std::vector<float> float_data_;
+  std::vector<uint16_t> half_data_;
+  std::vector<int8_t> int8_data_;
+  std::vector<float> scales_;
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_QUANTIZED_FRAMES_H_
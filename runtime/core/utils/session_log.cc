@@ -0,0 +1,145 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/session_log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+static const char kMagic[] = "WNSL";
+static const size_t kMagicSize = 4;
+static const char kVersion = 1;
+
+static int64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void AppendVarint(uint64_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+// Return false if the varint runs past end
+static bool ReadVarint(const char* data, size_t end, size_t* pos,
+                       uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *pos < end; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(data[(*pos)++]);
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+bool SessionLogWriter::Open(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  os_.open(path, std::ios::binary);
+  if (!os_) return false;
+  path_ = path;
+  os_.write(kMagic, kMagicSize);
+  os_.put(kVersion);
+  start_us_ = NowUs();
+  last_us_ = start_us_;
+  return static_cast<bool>(os_);
+}
+
+void SessionLogWriter::Write(SessionEvent event, const char* data,
+                             size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!os_) return;
+  // The clock is monotonic, the max only guards the order of the records
+  // timestamped by other threads just before
+  int64_t now_us = std::max(NowUs(), last_us_);
+  std::string head;
+  head.push_back(static_cast<char>(event));
+  AppendVarint(now_us - last_us_, &head);
+  AppendVarint(size, &head);
+  last_us_ = now_us;
+  os_.write(head.data(), head.size());
+  os_.write(data, size);
+  if (!os_) {
+    LOG(WARNING) << "Failed to write the session log " << path_;
+  }
+}
+
+bool SessionLogReader::Open(const std::string& path) {
+  file_ = MappedFile::Open(path);
+  if (file_ == nullptr || file_->size() < kMagicSize + 1 ||
+      memcmp(file_->data(), kMagic, kMagicSize) != 0) {
+    LOG(WARNING) << path << " is not a session log";
+    return false;
+  }
+  if (file_->data()[kMagicSize] != kVersion) {
+    LOG(WARNING) << path << " is of an unsupported version "
+                 << static_cast<int>(file_->data()[kMagicSize]);
+    return false;
+  }
+  pos_ = kMagicSize + 1;
+  time_us_ = 0;
+  return true;
+}
+
+bool SessionLogReader::Read(SessionRecord* record) {
+  if (file_ == nullptr || pos_ >= file_->size()) return false;
+  const char* data = file_->data();
+  const size_t end = file_->size();
+  size_t pos = pos_;
+  uint8_t event = static_cast<uint8_t>(data[pos++]);
+  uint64_t delta_us = 0;
+  uint64_t size = 0;
+  if (!ReadVarint(data, end, &pos, &delta_us) ||
+      !ReadVarint(data, end, &pos, &size) || size > end - pos) {
+    LOG(WARNING) << "Truncated session log record at " << pos_;
+    pos_ = end;
+    return false;
+  }
+  time_us_ += delta_us;
+  record->event = static_cast<SessionEvent>(event);
+  record->time_us = time_us_;
+  record->data.assign(data + pos, size);
+  pos_ = pos + size;
+  return true;
+}
+
+SessionRecorder::SessionRecorder(const std::string& dir, int every_n)
+    : dir_(dir), every_n_(std::max(every_n, 1)) {}
+
+std::unique_ptr<SessionLogWriter> SessionRecorder::NewSession() {
+  int64_t n = num_sessions_.fetch_add(1);
+  if (n % every_n_ != 0) return nullptr;
+  // The files of the restarts of a server don't collide by the wall clock
+  int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count();
+  std::string path =
+      dir_ + "/" + std::to_string(now_ms) + "-" + std::to_string(n) + ".wslog";
+  std::unique_ptr<SessionLogWriter> writer(new SessionLogWriter);
+  if (!writer->Open(path)) {
+    LOG(WARNING) << "Failed to create the session log " << path;
+    return nullptr;
+  }
+  return writer;
+}
+
+}  // namespace wenet
@@ -0,0 +1,105 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTILS_SESSION_LOG_H_
+#define UTILS_SESSION_LOG_H_
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "utils/mapped_file.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+enum class SessionEvent : uint8_t {
+  // A text message of the client, e.g. the start signal with its options
+  kText = 1,
+  // A binary message of the client, one packet of the audio as it came
+  kAudio = 2,
+  // A result of the server, one byte of its ResultType and the sentence of
+  // its 1-best
+  kResult = 3,
+};
+
+struct SessionRecord {
+  SessionEvent event = SessionEvent::kText;
+  // From the start of the session
+  int64_t time_us = 0;
+  std::string data;
+};
+
+// The compact binary log of one streaming session, for the replay of its
+// exact packets and timing. After the header, "WNSL" and the version, each
+// record is the event byte, the time delta from the previous record in
+// microseconds and the size of the data as varints, then the data.
+// Write() is thread safe and timestamps the record itself.
+class SessionLogWriter {
+ public:
+  // Return false if the file can't be created
+  bool Open(const std::string& path);
+  void Write(SessionEvent event, const char* data, size_t size);
+  void Write(SessionEvent event, const std::string& data) {
+    Write(event, data.data(), data.size());
+  }
+  const std::string& path() const { return path_; }
+
+ private:
+  std::mutex mutex_;
+  std::string path_;
+  std::ofstream os_;
+  int64_t start_us_ = 0;
+  int64_t last_us_ = 0;
+};
+
+class SessionLogReader {
+ public:
+  // Return false if the file can't be read or it's not a session log
+  bool Open(const std::string& path);
+  // Return false at the end of the log, or on a truncated record, e.g. the
+  // last one of a session cut by a crash
+  bool Read(SessionRecord* record);
+
+ private:
+  std::unique_ptr<MappedFile> file_;
+  size_t pos_ = 0;
+  int64_t time_us_ = 0;
+};
+
+// The opt-in capture of the sessions of a server, each one is logged to
+// its own file in dir. One in every_n sessions is logged.
+class SessionRecorder {
+ public:
+  explicit SessionRecorder(const std::string& dir, int every_n = 1);
+
+  // Return nullptr if the session is not sampled, or its log can't be
+  // created
+  std::unique_ptr<SessionLogWriter> NewSession();
+
+ private:
+  const std::string dir_;
+  const int every_n_;
+  std::atomic<int64_t> num_sessions_{0};
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(SessionRecorder);
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_SESSION_LOG_H_
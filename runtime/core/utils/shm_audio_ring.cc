@@ -0,0 +1,289 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/shm_audio_ring.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "utils/log.h"
+
+namespace wenet {
+
+// At the start of the shared memory, the samples follow it. The positions
+// count the samples since the start, the index in the ring is the position
+// modulo the capacity. They are on their own cache lines, since the two
+// processes write them.
+struct ShmAudioRing::Header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  alignas(64) std::atomic<uint64_t> write_pos;
+  std::atomic<uint32_t> finished;
+  alignas(64) std::atomic<uint64_t> read_pos;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "The positions in the shared memory must be lock free");
+
+static const uint32_t kRingMagic = 0x67727761;  // "awrg"
+static const uint32_t kRingVersion = 1;
+static const size_t kSamplesOffset = 256;
+
+#ifdef __linux__
+
+std::unique_ptr<ShmAudioRing> ShmAudioRing::Create(size_t capacity) {
+  static_assert(sizeof(Header) <= kSamplesOffset,
+                "The samples follow the header");
+  CHECK_GT(capacity, 0);
+  std::unique_ptr<ShmAudioRing> ring(new ShmAudioRing());
+  ring->memory_fd_ = static_cast<int>(
+      syscall(SYS_memfd_create, "wenet_audio_ring", 1u /* MFD_CLOEXEC */));
+  ring->doorbell_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  const size_t bytes = kSamplesOffset + capacity * sizeof(int16_t);
+  if (ring->memory_fd_ < 0 || ring->doorbell_fd_ < 0 ||
+      ftruncate(ring->memory_fd_, bytes) != 0) {
+    LOG(ERROR) << "Failed to create the audio ring: " << strerror(errno);
+    return nullptr;
+  }
+  void* mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      ring->memory_fd_, 0);
+  if (mapped == MAP_FAILED) {
+    LOG(ERROR) << "Failed to map the audio ring: " << strerror(errno);
+    return nullptr;
+  }
+  ring->mapped_ = mapped;
+  ring->mapped_bytes_ = bytes;
+  // The memfd is zero filled
+  Header* header = new (mapped) Header();
+  header->capacity = capacity;
+  header->version = kRingVersion;
+  header->magic = kRingMagic;
+  ring->header_ = header;
+  ring->samples_ = reinterpret_cast<int16_t*>(
+      static_cast<char*>(mapped) + kSamplesOffset);
+  return ring;
+}
+
+std::unique_ptr<ShmAudioRing> ShmAudioRing::Attach(int memory_fd,
+                                                   int doorbell_fd) {
+  std::unique_ptr<ShmAudioRing> ring(new ShmAudioRing());
+  ring->memory_fd_ = memory_fd;
+  ring->doorbell_fd_ = doorbell_fd;
+  struct stat st;
+  if (fstat(memory_fd, &st) != 0 ||
+      st.st_size < static_cast<off_t>(kSamplesOffset + sizeof(int16_t))) {
+    LOG(ERROR) << "Not an audio ring";
+    return nullptr;
+  }
+  void* mapped = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, memory_fd, 0);
+  if (mapped == MAP_FAILED) {
+    LOG(ERROR) << "Failed to map the audio ring: " << strerror(errno);
+    return nullptr;
+  }
+  ring->mapped_ = mapped;
+  ring->mapped_bytes_ = st.st_size;
+  Header* header = static_cast<Header*>(mapped);
+  if (header->magic != kRingMagic || header->version != kRingVersion ||
+      kSamplesOffset + header->capacity * sizeof(int16_t) >
+          ring->mapped_bytes_) {
+    LOG(ERROR) << "Not an audio ring of version " << kRingVersion;
+    return nullptr;
+  }
+  ring->header_ = header;
+  ring->samples_ = reinterpret_cast<int16_t*>(
+      static_cast<char*>(mapped) + kSamplesOffset);
+  return ring;
+}
+
+ShmAudioRing::~ShmAudioRing() {
+  if (mapped_ != nullptr) munmap(mapped_, mapped_bytes_);
+  if (memory_fd_ >= 0) close(memory_fd_);
+  if (doorbell_fd_ >= 0) close(doorbell_fd_);
+}
+
+void ShmAudioRing::Ring() {
+  uint64_t one = 1;
+  if (write(doorbell_fd_, &one, sizeof(one)) != sizeof(one)) {
+    LOG(WARNING) << "Failed to ring the doorbell: " << strerror(errno);
+  }
+}
+
+void ShmAudioRing::ClearDoorbell() {
+  uint64_t count = 0;
+  // EAGAIN if it's not rung
+  if (read(doorbell_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    LOG(WARNING) << "Failed to read the doorbell: " << strerror(errno);
+  }
+}
+
+bool SendFds(int socket, const std::string& message,
+             const std::vector<int>& fds) {
+  CHECK(!message.empty());
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(message.data());
+  iov.iov_len = message.size();
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (!fds.empty()) {
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+  }
+  ssize_t sent;
+  do {
+    sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  return sent == static_cast<ssize_t>(message.size());
+}
+
+bool ReceiveFds(int socket, size_t max_bytes, std::string* message,
+                std::vector<int>* fds) {
+  static const int kMaxFds = 4;
+  message->resize(max_bytes);
+  struct iovec iov;
+  iov.iov_base = &(*message)[0];
+  iov.iov_len = max_bytes;
+  char control[CMSG_SPACE(sizeof(int) * kMaxFds)];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t received;
+  do {
+    received = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+  fds->clear();
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      size_t num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const unsigned char* data = CMSG_DATA(cmsg);
+      for (size_t i = 0; i < num_fds; ++i) {
+        int fd;
+        memcpy(&fd, data + i * sizeof(int), sizeof(int));
+        fds->push_back(fd);
+      }
+    }
+  }
+  if (received <= 0 || (msg.msg_flags & MSG_CTRUNC)) {
+    for (int fd : *fds) close(fd);
+    fds->clear();
+    return false;
+  }
+  message->resize(received);
+  return true;
+}
+
+#else
+
+std::unique_ptr<ShmAudioRing> ShmAudioRing::Create(size_t capacity) {
+  LOG(ERROR) << "The shared memory audio ring is only supported on Linux";
+  return nullptr;
+}
+
+std::unique_ptr<ShmAudioRing> ShmAudioRing::Attach(int memory_fd,
+                                                   int doorbell_fd) {
+  LOG(ERROR) << "The shared memory audio ring is only supported on Linux";
+  return nullptr;
+}
+
+ShmAudioRing::~ShmAudioRing() {}
+void ShmAudioRing::Ring() {}
+void ShmAudioRing::ClearDoorbell() {}
+
+bool SendFds(int socket, const std::string& message,
+             const std::vector<int>& fds) {
+  return false;
+}
+
+bool ReceiveFds(int socket, size_t max_bytes, std::string* message,
+                std::vector<int>* fds) {
+  return false;
+}
+
+#endif
+
+size_t ShmAudioRing::capacity() const { return header_->capacity; }
+
+size_t ShmAudioRing::Write(const int16_t* samples, size_t num_samples) {
+  const uint64_t capacity = header_->capacity;
+  const uint64_t write_pos = header_->write_pos.load(std::memory_order_relaxed);
+  const uint64_t read_pos = header_->read_pos.load(std::memory_order_acquire);
+  const size_t n = std::min<uint64_t>(num_samples,
+                                      capacity - (write_pos - read_pos));
+  const size_t start = write_pos % capacity;
+  const size_t first = std::min<size_t>(n, capacity - start);
+  memcpy(samples_ + start, samples, first * sizeof(int16_t));
+  memcpy(samples_, samples + first, (n - first) * sizeof(int16_t));
+  header_->write_pos.store(write_pos + n, std::memory_order_release);
+  return n;
+}
+
+void ShmAudioRing::set_input_finished() {
+  header_->finished.store(1, std::memory_order_release);
+}
+
+size_t ShmAudioRing::Peek(const int16_t** samples) const {
+  const uint64_t capacity = header_->capacity;
+  const uint64_t read_pos = header_->read_pos.load(std::memory_order_relaxed);
+  const uint64_t write_pos =
+      header_->write_pos.load(std::memory_order_acquire);
+  // The producer is another process, a broken write position is taken as
+  // the end of the input, see Finished()
+  const uint64_t available = write_pos - read_pos;
+  if (available > capacity) return 0;
+  const size_t start = read_pos % capacity;
+  *samples = samples_ + start;
+  return std::min<uint64_t>(available, capacity - start);
+}
+
+void ShmAudioRing::Consume(size_t num_samples) {
+  const uint64_t read_pos = header_->read_pos.load(std::memory_order_relaxed);
+  header_->read_pos.store(read_pos + num_samples, std::memory_order_release);
+}
+
+bool ShmAudioRing::Finished() const {
+  // The write position is final once finished is set
+  const bool finished =
+      header_->finished.load(std::memory_order_acquire) != 0;
+  const uint64_t available =
+      header_->write_pos.load(std::memory_order_acquire) -
+      header_->read_pos.load(std::memory_order_relaxed);
+  return (finished && available == 0) || available > header_->capacity;
+}
+
+}  // namespace wenet
@@ -0,0 +1,94 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTILS_SHM_AUDIO_RING_H_
+#define UTILS_SHM_AUDIO_RING_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+// A single producer single consumer ring of 16 bits PCM samples in shared
+// memory, for the audio of a process on the same host, e.g. a media
+// gateway. The producer writes the samples into the ring and rings the
+// doorbell, an eventfd, and the consumer reads them in place, so there is
+// no socket and no copy in between. The memory is a memfd, both fds are
+// passed to the other process over a Unix socket, see SendFds().
+//
+// The write and the read positions are atomics in the shared header, the
+// producer only moves the write one and the consumer only the read one.
+// Linux only, Create() and Attach() return nullptr elsewhere.
+class ShmAudioRing {
+ public:
+  // A new ring of capacity samples and its doorbell, nullptr on failure
+  static std::unique_ptr<ShmAudioRing> Create(size_t capacity);
+  // The ring of the fds of Create() in another process, it owns the fds
+  static std::unique_ptr<ShmAudioRing> Attach(int memory_fd, int doorbell_fd);
+  ~ShmAudioRing();
+
+  int memory_fd() const { return memory_fd_; }
+  int doorbell_fd() const { return doorbell_fd_; }
+  size_t capacity() const;
+
+  // Producer: write at most num_samples samples, return the number
+  // written, fewer if the ring is full
+  size_t Write(const int16_t* samples, size_t num_samples);
+  // Producer: no samples are written after it
+  void set_input_finished();
+  // Producer: wake up the consumer, after Write() or set_input_finished()
+  void Ring();
+
+  // Consumer: the readable samples up to the end of the ring, the ones
+  // after the wrap are read by the next call after Consume(). Return the
+  // number of them, 0 if the ring is empty.
+  size_t Peek(const int16_t** samples) const;
+  // Consumer: release the first num_samples samples of Peek()
+  void Consume(size_t num_samples);
+  // Consumer: true if the input is finished and all of it is consumed
+  bool Finished() const;
+  // Consumer: clear the doorbell if it's rung, nonblocking
+  void ClearDoorbell();
+
+ private:
+  struct Header;
+  ShmAudioRing() = default;
+
+  int memory_fd_ = -1;
+  int doorbell_fd_ = -1;
+  void* mapped_ = nullptr;
+  size_t mapped_bytes_ = 0;
+  Header* header_ = nullptr;
+  int16_t* samples_ = nullptr;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(ShmAudioRing);
+};
+
+// Send message with fds as SCM_RIGHTS over the Unix socket, return false on
+// failure
+bool SendFds(int socket, const std::string& message,
+             const std::vector<int>& fds);
+// Receive a message of at most max_bytes and the fds sent with it, return
+// false on failure or the end of the socket
+bool ReceiveFds(int socket, size_t max_bytes, std::string* message,
+                std::vector<int>* fds);
+
+}  // namespace wenet
+
+#endif  // UTILS_SHM_AUDIO_RING_H_
@@ -0,0 +1,136 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTILS_SPARSE_LOG_PROB_MATRIX_H_
+#define UTILS_SPARSE_LOG_PROB_MATRIX_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "utils/matrix.h"
+#include "utils/state_io.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// The ctc log probs of a chunk pruned to the blank and the top k other
+// tokens of each frame, (num_frames, k + 1) log probs and their token ids,
+// the blank is the first of each frame, the others are in descending
+// order. The pruned tokens are -inf. For a vocabulary of 10k tokens and
+// k = 16, a frame is 136 bytes instead of 40 KB, and the searches and the
+// endpoint only read those.
+class SparseLogProbMatrix {
+ public:
+  // The rows are not initialized
+  void Resize(int rows, int k, int vocab_size, int blank = 0) {
+    values_.Resize(rows, rows > 0 ? k + 1 : 0);
+    ids_.Resize(rows, rows > 0 ? k + 1 : 0);
+    vocab_size_ = vocab_size;
+    blank_ = blank;
+  }
+
+  // Keep the blank and the top k of each frame of dense, all the tokens
+  // but the blank if k <= 0 or it's over them
+  void FromDense(const LogProbMatrix& dense, int k, int blank = 0) {
+    int num_tokens = std::max(dense.cols() - 1, 0);
+    k = k > 0 ? std::min(k, num_tokens) : num_tokens;
+    Resize(dense.rows(), k, dense.cols(), blank);
+    for (int i = 0; i < dense.rows(); ++i) {
+      const float* row = dense.Row(i);
+      // One more, the blank is dropped from them if it's there
+      TopK(row, dense.cols(), std::min(k + 1, dense.cols()), &topk_values_,
+           &topk_ids_);
+      float* values = values_.Row(i);
+      int32_t* ids = ids_.Row(i);
+      values[0] = row[blank];
+      ids[0] = blank;
+      for (int j = 0, n = 1; n <= k; ++j) {
+        if (topk_ids_[j] == blank) continue;
+        values[n] = topk_values_[j];
+        ids[n++] = topk_ids_[j];
+      }
+    }
+  }
+
+  // Scatter to the (num_frames, vocab_size) log probs
+  void ToDense(LogProbMatrix* dense) const {
+    dense->Resize(rows(), vocab_size_);
+    for (int i = 0; i < rows(); ++i) {
+      float* row = dense->Row(i);
+      std::fill(row, row + vocab_size_,
+                -std::numeric_limits<float>::infinity());
+      for (int j = 0; j < cols(); ++j) {
+        row[ids_(i, j)] = values_(i, j);
+      }
+    }
+  }
+
+  int rows() const { return values_.rows(); }
+  // k + 1, the blank and the top k
+  int cols() const { return values_.cols(); }
+  int vocab_size() const { return vocab_size_; }
+  int blank() const { return blank_; }
+  bool empty() const { return values_.empty(); }
+  float* Values(int r) { return values_.Row(r); }
+  const float* Values(int r) const { return values_.Row(r); }
+  int32_t* Ids(int r) { return ids_.Row(r); }
+  const int32_t* Ids(int r) const { return ids_.Row(r); }
+  float BlankValue(int r) const { return values_(r, 0); }
+  const Matrix<float>& values() const { return values_; }
+  const Matrix<int32_t>& ids() const { return ids_; }
+  size_t AllocatedBytes() const {
+    return values_.AllocatedBytes() + ids_.AllocatedBytes();
+  }
+
+  void SaveState(StateWriter* writer) const {
+    writer->Write<int32_t>(vocab_size_);
+    writer->Write<int32_t>(blank_);
+    writer->WriteMatrix(values_);
+    writer->WriteMatrix(ids_);
+  }
+  // Return false if the state is truncated or the ids are out of the
+  // vocabulary
+  bool RestoreState(StateReader* reader) {
+    int32_t vocab_size = 0;
+    int32_t blank = 0;
+    if (!reader->Read(&vocab_size) || !reader->Read(&blank) ||
+        !reader->ReadMatrix(&values_) || !reader->ReadMatrix(&ids_) ||
+        values_.rows() != ids_.rows() || values_.cols() != ids_.cols()) {
+      return false;
+    }
+    vocab_size_ = vocab_size;
+    blank_ = blank;
+    for (int i = 0; i < ids_.rows(); ++i) {
+      for (int j = 0; j < ids_.cols(); ++j) {
+        if (ids_(i, j) < 0 || ids_(i, j) >= vocab_size_) return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  Matrix<float> values_;
+  Matrix<int32_t> ids_;
+  int vocab_size_ = 0;
+  int blank_ = 0;
+  // The buffers of FromDense()
+  std::vector<float> topk_values_;
+  std::vector<int> topk_ids_;
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_SPARSE_LOG_PROB_MATRIX_H_
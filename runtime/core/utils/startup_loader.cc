@@ -0,0 +1,109 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/startup_loader.h"
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <utility>
+
+#include "utils/log.h"
+#include "utils/thread_pool.h"
+#include "utils/timer.h"
+
+namespace wenet {
+
+void StartupLoader::Add(const std::string& name, std::function<void()> load,
+                        const std::vector<std::string>& deps) {
+  Step step;
+  step.name = name;
+  step.load = std::move(load);
+  int index = steps_.size();
+  for (const std::string& dep : deps) {
+    bool found = false;
+    for (Step& other : steps_) {
+      if (other.name == dep) {
+        other.dependents.push_back(index);
+        found = true;
+        break;
+      }
+    }
+    CHECK(found) << "Step " << name << " depends on " << dep
+                 << ", which is not added before it";
+    step.num_deps++;
+  }
+  steps_.emplace_back(std::move(step));
+}
+
+void StartupLoader::Run() {
+  Timer timer;
+  if (num_threads_ <= 1) {
+    for (Step& step : steps_) {
+      Timer step_timer;
+      step.load();
+      LOG(INFO) << "Loaded " << step.name << " in " << step_timer.Elapsed()
+                << " ms";
+    }
+  } else {
+    std::mutex mutex;
+    std::condition_variable done_cond;
+    int num_running = 0;
+    std::exception_ptr error;
+    std::vector<int> num_deps(steps_.size());
+    for (size_t i = 0; i < steps_.size(); ++i) {
+      num_deps[i] = steps_[i].num_deps;
+    }
+    ThreadPool pool(num_threads_);
+    // Called with the mutex held
+    std::function<void(int)> start = [&](int index) {
+      num_running++;
+      pool.Post([&, index]() {
+        Step& step = steps_[index];
+        Timer step_timer;
+        std::exception_ptr step_error;
+        try {
+          step.load();
+        } catch (...) {
+          step_error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (step_error != nullptr) {
+          LOG(WARNING) << "Failed to load " << step.name;
+          if (error == nullptr) error = step_error;
+        } else {
+          LOG(INFO) << "Loaded " << step.name << " in "
+                    << step_timer.Elapsed() << " ms";
+          // No more steps are started after a failure
+          for (int dependent : step.dependents) {
+            if (--num_deps[dependent] == 0 && error == nullptr) {
+              start(dependent);
+            }
+          }
+        }
+        if (--num_running == 0) done_cond.notify_one();
+      });
+    };
+    std::unique_lock<std::mutex> lock(mutex);
+    for (size_t i = 0; i < steps_.size(); ++i) {
+      if (num_deps[i] == 0) start(i);
+    }
+    done_cond.wait(lock, [&]() { return num_running == 0; });
+    if (error != nullptr) std::rethrow_exception(error);
+  }
+  LOG(INFO) << "Loaded " << steps_.size() << " steps in " << timer.Elapsed()
+            << " ms";
+}
+
+}  // namespace wenet
@@ -0,0 +1,62 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTILS_STARTUP_LOADER_H_
+#define UTILS_STARTUP_LOADER_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+// StartupLoader runs the loading steps of a process, e.g. the reads of
+// the model, the fsts and the symbol tables, on a thread pool, each one as
+// soon as the steps it depends on are done. The time of each step is
+// logged. Not thread safe, the steps are added and run by one thread.
+class StartupLoader {
+ public:
+  // num_threads <= 1 runs the steps one by one on the calling thread, in
+  // the order they are added
+  explicit StartupLoader(int num_threads) : num_threads_(num_threads) {}
+
+  // The steps of deps must be added before
+  void Add(const std::string& name, std::function<void()> load,
+           const std::vector<std::string>& deps = {});
+  // Block until all the steps are done. If a step throws, the steps which
+  // depend on it are skipped, and the first exception is rethrown once the
+  // running ones are done.
+  void Run();
+
+ private:
+  struct Step {
+    std::string name;
+    std::function<void()> load;
+    // The steps which wait for this one
+    std::vector<int> dependents;
+    int num_deps = 0;
+  };
+
+  int num_threads_;
+  std::vector<Step> steps_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(StartupLoader);
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_STARTUP_LOADER_H_
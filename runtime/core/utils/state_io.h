@@ -0,0 +1,130 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTILS_STATE_IO_H_
+#define UTILS_STATE_IO_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "utils/matrix.h"
+
+namespace wenet {
+
+// The binary state of a decoding session, see AsrDecoder::SaveState(). The
+// values are written as they are in memory, so the state is only read by
+// the builds of the same byte order, e.g. the nodes of one deployment.
+class StateWriter {
+ public:
+  explicit StateWriter(std::string* out) : out_(out) {}
+
+  template <typename T>
+  void Write(const T& value) {
+    WriteArray(&value, 1);
+  }
+  template <typename T>
+  void WriteArray(const T* data, size_t size) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only the trivially copyable values are written as is");
+    out_->append(reinterpret_cast<const char*>(data), sizeof(T) * size);
+  }
+  template <typename T>
+  void WriteVector(const std::vector<T>& values) {
+    Write<uint64_t>(values.size());
+    WriteArray(values.data(), values.size());
+  }
+  void WriteString(const std::string& value) {
+    Write<uint64_t>(value.size());
+    out_->append(value);
+  }
+  // The rows without the padding of the stride
+  template <typename T>
+  void WriteMatrix(const Matrix<T>& matrix) {
+    Write<int32_t>(matrix.rows());
+    Write<int32_t>(matrix.cols());
+    for (int i = 0; i < matrix.rows(); ++i) {
+      WriteArray(matrix.Row(i), matrix.cols());
+    }
+  }
+
+ private:
+  std::string* out_;
+};
+
+// Reads the values in the order of StateWriter, every read returns false
+// if the state is truncated, and the sizes are checked against the bytes
+// left before anything is allocated.
+class StateReader {
+ public:
+  StateReader(const char* data, size_t size) : data_(data), size_(size) {}
+  explicit StateReader(const std::string& data)
+      : StateReader(data.data(), data.size()) {}
+
+  size_t remaining() const { return size_ - pos_; }
+
+  template <typename T>
+  bool Read(T* value) {
+    return ReadArray(value, 1);
+  }
+  template <typename T>
+  bool ReadArray(T* data, size_t size) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only the trivially copyable values are read as is");
+    if (size > remaining() / sizeof(T)) return false;
+    memcpy(static_cast<void*>(data), data_ + pos_, sizeof(T) * size);
+    pos_ += sizeof(T) * size;
+    return true;
+  }
+  template <typename T>
+  bool ReadVector(std::vector<T>* values) {
+    uint64_t size = 0;
+    if (!Read(&size) || size > remaining() / sizeof(T)) return false;
+    values->resize(size);
+    return ReadArray(values->data(), size);
+  }
+  bool ReadString(std::string* value) {
+    uint64_t size = 0;
+    if (!Read(&size) || size > remaining()) return false;
+    value->assign(data_ + pos_, size);
+    pos_ += size;
+    return true;
+  }
+  template <typename T>
+  bool ReadMatrix(Matrix<T>* matrix) {
+    int32_t rows = 0;
+    int32_t cols = 0;
+    if (!Read(&rows) || !Read(&cols) || rows < 0 || cols < 0 ||
+        (cols > 0 && static_cast<uint64_t>(rows) >
+                         remaining() / sizeof(T) / cols)) {
+      return false;
+    }
+    matrix->Resize(rows, cols);
+    for (int i = 0; i < rows; ++i) {
+      if (!ReadArray(matrix->Row(i), cols)) return false;
+    }
+    return true;
+  }
+
+ private:
+  const char* data_;
+  size_t size_;
+  size_t pos_ = 0;
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_STATE_IO_H_
@@ -14,8 +14,14 @@
 
 #include "utils/string.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <fstream>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "utils/log.h"
@@ -95,10 +101,14 @@ bool CheckEnglishChar(const std::string& ch) {
 }
 
 bool CheckEnglishWord(const std::string& word) {
-  std::vector<std::string> chars;
-  SplitUTF8StringToChars(word, &chars);
-  for (size_t k = 0; k < chars.size(); k++) {
-    if (!CheckEnglishChar(chars[k])) {
+  return CheckEnglishWord(word.data(), word.data() + word.size());
+}
+
+bool CheckEnglishWord(const char* begin, const char* end) {
+  // The bytes of the other chars are all >= 0x80
+  for (const char* p = begin; p < end; ++p) {
+    unsigned char c = static_cast<unsigned char>(*p);
+    if (c >= 0x80 || !(isalpha(c) || c == '\'')) {
       return false;
     }
   }
@@ -117,10 +127,11 @@ std::string JoinString(const std::string& c,
   return result;
 }
 
-bool SplitUTF8StringToWords(
-    const std::string& str,
-    const std::shared_ptr<fst::SymbolTable>& symbol_table,
-    std::vector<std::string>* words) {
+// The longest words of symbols first, `contains` tells whether a word is
+// one of the symbols
+template <typename Contains>
+static bool SplitToWords(const std::string& str, const Contains& contains,
+                         std::vector<std::string>* words) {
   std::vector<std::string> chars;
   SplitUTF8StringToChars(Trim(str), &chars);
 
@@ -131,7 +142,7 @@ bool SplitUTF8StringToWords(
       for (size_t i = start; i < end; i++) {
         word += chars[i];
       }
-      if (symbol_table->Find(word) != -1) {
+      if (contains(word)) {
         words->emplace_back(word);
         start = end;
         continue;
@@ -146,37 +157,131 @@ bool SplitUTF8StringToWords(
   return no_oov;
 }
 
+bool SplitUTF8StringToWords(
+    const std::string& str,
+    const std::shared_ptr<fst::SymbolTable>& symbol_table,
+    std::vector<std::string>* words) {
+  return SplitToWords(
+      str,
+      [&symbol_table](const std::string& word) {
+        return symbol_table->Find(word) != -1;
+      },
+      words);
+}
+
+bool SplitUTF8StringToWords(const std::string& str,
+                            const SymbolStrings& symbols,
+                            std::vector<std::string>* words) {
+  return SplitToWords(
+      str,
+      [&symbols](const std::string& word) {
+        return symbols.Find(word) != -1;
+      },
+      words);
+}
+
 std::string ProcessBlank(const std::string& str, bool lowercase) {
   std::string result;
-  if (!str.empty()) {
-    std::vector<std::string> chars;
-    SplitUTF8StringToChars(Trim(str), &chars);
+  size_t start = str.find_first_not_of(WHITESPACE);
+  if (start == std::string::npos) return result;
+  size_t end = str.find_last_not_of(WHITESPACE) + 1;
+  result.reserve(end - start);
+  AppendBlankProcessed(str.data() + start, str.data() + end, lowercase,
+                       &result);
+  // Ignore tailing space
+  if (!result.empty() && result.back() == ' ') {
+    result.pop_back();
+  }
+  return result;
+}
 
-    for (std::string& ch : chars) {
-      if (ch != kSpaceSymbol) {
-        result.append(ch);
+// The case of the chars out of ASCII is converted by the locale of the
+// environment, see issue 745: https://github.com/wenet-e2e/wenet/issues/745
+static const std::ctype<wchar_t>& LocaleCType() {
+  static const std::locale loc("");
+  static const std::ctype<wchar_t>& ctype =
+      std::use_facet<std::ctype<wchar_t>>(loc);
+  return ctype;
+}
+
+static void AppendUTF8(uint32_t code, std::string* out) {
+  if (code < 0x80) {
+    out->push_back(code);
+  } else if (code < 0x800) {
+    out->push_back(0xC0 | (code >> 6));
+    out->push_back(0x80 | (code & 0x3F));
+  } else if (code < 0x10000) {
+    out->push_back(0xE0 | (code >> 12));
+    out->push_back(0x80 | ((code >> 6) & 0x3F));
+    out->push_back(0x80 | (code & 0x3F));
+  } else {
+    out->push_back(0xF0 | (code >> 18));
+    out->push_back(0x80 | ((code >> 12) & 0x3F));
+    out->push_back(0x80 | ((code >> 6) & 0x3F));
+    out->push_back(0x80 | (code & 0x3F));
+  }
+}
+
+void AppendBlankProcessed(const char* begin, const char* end, bool lowercase,
+                          std::string* out) {
+  const size_t space_size = sizeof(kSpaceSymbol) - 1;
+  for (const char* p = begin; p < end;) {
+    unsigned char c = static_cast<unsigned char>(*p);
+    if (c < 0x80) {
+      if (lowercase) {
+        out->push_back(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
       } else {
-        // Ignore consecutive space or located in head
-        if (!result.empty() && result.back() != ' ') {
-          result.push_back(' ');
-        }
+        out->push_back(c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c);
       }
+      ++p;
+      continue;
+    }
+    if (static_cast<size_t>(end - p) >= space_size &&
+        memcmp(p, kSpaceSymbol, space_size) == 0) {
+      // Ignore consecutive space or located in head
+      if (!out->empty() && out->back() != ' ') {
+        out->push_back(' ');
+      }
+      p += space_size;
+      continue;
+    }
+    // Decode the char, the invalid bytes are copied as they are
+    int bytes = 1;
+    uint32_t code = 0;
+    if ((c & 0xE0) == 0xC0) {
+      bytes = 2;
+      code = c & 0x1F;
+    } else if ((c & 0xF0) == 0xE0) {
+      bytes = 3;
+      code = c & 0x0F;
+    } else if ((c & 0xF8) == 0xF0) {
+      bytes = 4;
+      code = c & 0x07;
+    }
+    bool valid = bytes > 1 && end - p >= bytes;
+    for (int i = 1; valid && i < bytes; ++i) {
+      unsigned char next = static_cast<unsigned char>(p[i]);
+      valid = (next & 0xC0) == 0x80;
+      code = (code << 6) | (next & 0x3F);
+    }
+    if (!valid) {
+      out->push_back(c);
+      ++p;
+      continue;
     }
-    // Ignore tailing space
-    if (!result.empty() && result.back() == ' ') {
-      result.pop_back();
+    uint32_t converted = code;
+    if (code <= static_cast<uint32_t>(WCHAR_MAX)) {
+      const std::ctype<wchar_t>& ctype = LocaleCType();
+      wchar_t ch = static_cast<wchar_t>(code);
+      converted = lowercase ? ctype.tolower(ch) : ctype.toupper(ch);
     }
-    // NOTE: convert string to wstring
-    //       see issue 745: https://github.com/wenet-e2e/wenet/issues/745
-    std::locale loc("");
-    std::wstring_convert<std::codecvt_utf8<wchar_t>, wchar_t> converter;
-    std::wstring wsresult = converter.from_bytes(result);
-    for (auto &c : wsresult) {
-      c = lowercase ? tolower(c, loc) : toupper(c, loc);
+    if (converted == code) {
+      out->append(p, bytes);
+    } else {
+      AppendUTF8(converted, out);
     }
-    result = converter.to_bytes(wsresult);
+    p += bytes;
   }
-  return result;
 }
 
 std::string Ltrim(const std::string& str) {
@@ -201,4 +306,258 @@ std::string JoinPath(const std::string& left, const std::string& right) {
   return path;
 }
 
+std::string Base64Encode(const std::string& data) {
+  static const char kTable[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  out.reserve((data.size() + 2) / 3 * 4);
+  size_t i = 0;
+  for (; i + 2 < data.size(); i += 3) {
+    uint32_t v = static_cast<uint8_t>(data[i]) << 16 |
+                 static_cast<uint8_t>(data[i + 1]) << 8 |
+                 static_cast<uint8_t>(data[i + 2]);
+    out.push_back(kTable[v >> 18]);
+    out.push_back(kTable[(v >> 12) & 0x3f]);
+    out.push_back(kTable[(v >> 6) & 0x3f]);
+    out.push_back(kTable[v & 0x3f]);
+  }
+  if (i < data.size()) {
+    uint32_t v = static_cast<uint8_t>(data[i]) << 16;
+    if (i + 1 < data.size()) v |= static_cast<uint8_t>(data[i + 1]) << 8;
+    out.push_back(kTable[v >> 18]);
+    out.push_back(kTable[(v >> 12) & 0x3f]);
+    out.push_back(i + 1 < data.size() ? kTable[(v >> 6) & 0x3f] : '=');
+    out.push_back('=');
+  }
+  return out;
+}
+
+void SplitToScoringUnits(const std::string& str,
+                         std::vector<std::string>* units) {
+  units->clear();
+  std::vector<std::string> chars;
+  SplitUTF8StringToChars(str, &chars);
+  std::string word;
+  for (const auto& ch : chars) {
+    if (CheckEnglishChar(ch)) {
+      word.append(ch);
+      continue;
+    }
+    if (!word.empty()) units->push_back(std::move(word));
+    word.clear();
+    if (ch != " " && ch != "\t" && ch != kSpaceSymbol) units->push_back(ch);
+  }
+  if (!word.empty()) units->push_back(std::move(word));
+}
+
+int EditDistance(const std::vector<std::string>& ref,
+                 const std::vector<std::string>& hyp) {
+  // One row of the distances of the prefixes of ref and hyp
+  std::vector<int> row(hyp.size() + 1);
+  for (size_t j = 0; j <= hyp.size(); ++j) row[j] = j;
+  for (size_t i = 1; i <= ref.size(); ++i) {
+    int diagonal = row[0];
+    row[0] = i;
+    for (size_t j = 1; j <= hyp.size(); ++j) {
+      int up = row[j];
+      row[j] = std::min({up + 1, row[j - 1] + 1,
+                         diagonal + (ref[i - 1] == hyp[j - 1] ? 0 : 1)});
+      diagonal = up;
+    }
+  }
+  return row[hyp.size()];
+}
+
+static const char kSymbolsMagic[4] = {'W', 'N', 'S', 'Y'};
+static const int32_t kSymbolsVersion = 1;
+
+// Byte size of the buffer of the table
+static size_t SymbolsBufferSize(int32_t num_ids, int32_t num_buckets,
+                                int32_t num_slots, uint32_t symbols_size) {
+  return 24 + sizeof(uint32_t) * (num_ids + 1) +
+         sizeof(uint32_t) * num_buckets + sizeof(int32_t) * num_slots +
+         symbols_size;
+}
+
+// FNV-1a of the symbol, then mixed with the seed of a bucket
+static uint64_t HashSymbol(const char* data, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static uint32_t HashSlot(uint64_t hash, uint32_t seed, uint32_t n) {
+  uint64_t h = hash ^ (seed * 0x9e3779b97f4a7c15ULL);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h % n;
+}
+
+SymbolStrings::SymbolStrings(const fst::SymbolTable& table,
+                             const std::vector<std::string>& reserved) {
+  int64_t max_id = -1;
+  for (fst::SymbolTableIterator it(table); !it.Done(); it.Next()) {
+    max_id = std::max<int64_t>(max_id, it.Value());
+  }
+  CHECK_LT(max_id + static_cast<int64_t>(reserved.size()), INT32_MAX);
+  // The symbols of the ids in order, the missing ids are empty and not
+  // hashed. A symbol of several ids is found by the first one.
+  std::vector<std::string> symbols(max_id + 1);
+  std::vector<int> keys;
+  std::unordered_map<std::string, int> ids;
+  for (fst::SymbolTableIterator it(table); !it.Done(); it.Next()) {
+    if (it.Value() >= 0) symbols[it.Value()] = it.Symbol();
+  }
+  for (fst::SymbolTableIterator it(table); !it.Done(); it.Next()) {
+    if (it.Value() >= 0 && ids.emplace(it.Symbol(), it.Value()).second) {
+      keys.push_back(it.Value());
+    }
+  }
+  for (const std::string& symbol : reserved) {
+    if (ids.emplace(symbol, symbols.size()).second) {
+      keys.push_back(symbols.size());
+      symbols.push_back(symbol);
+    }
+  }
+  size_t symbols_size = 0;
+  for (const auto& symbol : symbols) symbols_size += symbol.size();
+  CHECK_LT(symbols_size, UINT32_MAX);
+
+  // Hash and displace, a bucket of about 4 symbols takes the first seed
+  // which puts them all in free slots, the bigger buckets first. The slots
+  // are 80% full.
+  int32_t num_ids = symbols.size();
+  int32_t num_buckets = std::max<int32_t>(keys.size() / 4, 1);
+  int32_t num_slots = std::max<int32_t>(keys.size() + keys.size() / 4, 1);
+  std::vector<uint64_t> hashes(num_ids, 0);
+  std::vector<std::vector<int>> buckets(num_buckets);
+  for (int id : keys) {
+    hashes[id] = HashSymbol(symbols[id].data(), symbols[id].size());
+    buckets[HashSlot(hashes[id], 0, num_buckets)].push_back(id);
+  }
+  std::vector<int> order(num_buckets);
+  for (int b = 0; b < num_buckets; ++b) order[b] = b;
+  std::stable_sort(order.begin(), order.end(), [&buckets](int a, int b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+  std::vector<uint32_t> displacements(num_buckets, 0);
+  std::vector<int32_t> slots(num_slots, -1);
+  std::vector<uint32_t> bucket_slots;
+  for (int b : order) {
+    if (buckets[b].empty()) break;
+    for (uint32_t seed = 1;; ++seed) {
+      CHECK_LT(seed, 1u << 24) << "No perfect hash of the symbols";
+      bucket_slots.clear();
+      bool ok = true;
+      for (int id : buckets[b]) {
+        uint32_t slot = HashSlot(hashes[id], seed, num_slots);
+        if (slots[slot] != -1 ||
+            std::find(bucket_slots.begin(), bucket_slots.end(), slot) !=
+                bucket_slots.end()) {
+          ok = false;
+          break;
+        }
+        bucket_slots.push_back(slot);
+      }
+      if (!ok) continue;
+      for (size_t i = 0; i < bucket_slots.size(); ++i) {
+        slots[bucket_slots[i]] = buckets[b][i];
+      }
+      displacements[b] = seed;
+      break;
+    }
+  }
+
+  buffer_.resize(
+      SymbolsBufferSize(num_ids, num_buckets, num_slots, symbols_size));
+  Header* header = reinterpret_cast<Header*>(buffer_.data());
+  memcpy(header->magic, kSymbolsMagic, sizeof(kSymbolsMagic));
+  header->version = kSymbolsVersion;
+  header->num_ids = num_ids;
+  header->num_buckets = num_buckets;
+  header->num_slots = num_slots;
+  header->symbols_size = symbols_size;
+  CHECK(Attach(buffer_.data(), buffer_.size()));
+  uint32_t* offsets = const_cast<uint32_t*>(offsets_);
+  char* data = const_cast<char*>(symbols_);
+  offsets[0] = 0;
+  for (int32_t id = 0; id < num_ids; ++id) {
+    memcpy(data + offsets[id], symbols[id].data(), symbols[id].size());
+    offsets[id + 1] = offsets[id] + symbols[id].size();
+  }
+  memcpy(const_cast<uint32_t*>(displacements_), displacements.data(),
+         sizeof(uint32_t) * num_buckets);
+  memcpy(const_cast<int32_t*>(slots_), slots.data(),
+         sizeof(int32_t) * num_slots);
+}
+
+bool SymbolStrings::Attach(const char* data, size_t size) {
+  if (size < sizeof(Header)) return false;
+  header_ = reinterpret_cast<const Header*>(data);
+  if (memcmp(header_->magic, kSymbolsMagic, sizeof(kSymbolsMagic)) != 0 ||
+      header_->version != kSymbolsVersion || header_->num_ids < 0 ||
+      header_->num_buckets <= 0 || header_->num_slots <= 0 ||
+      size != SymbolsBufferSize(header_->num_ids, header_->num_buckets,
+                                header_->num_slots, header_->symbols_size)) {
+    return false;
+  }
+  const char* p = data + sizeof(Header);
+  offsets_ = reinterpret_cast<const uint32_t*>(p);
+  p += sizeof(uint32_t) * (header_->num_ids + 1);
+  displacements_ = reinterpret_cast<const uint32_t*>(p);
+  p += sizeof(uint32_t) * header_->num_buckets;
+  slots_ = reinterpret_cast<const int32_t*>(p);
+  p += sizeof(int32_t) * header_->num_slots;
+  symbols_ = p;
+  return true;
+}
+
+std::shared_ptr<SymbolStrings> SymbolStrings::Read(const std::string& path) {
+  std::shared_ptr<SymbolStrings> strings(new SymbolStrings());
+  strings->file_ = MappedFile::Open(path);
+  if (strings->file_ == nullptr ||
+      !strings->Attach(strings->file_->data(), strings->file_->size()) ||
+      strings->offsets_[strings->header_->num_ids] !=
+          strings->header_->symbols_size) {
+    LOG(WARNING) << path << " is not a valid binary symbol table";
+    return nullptr;
+  }
+  return strings;
+}
+
+bool SymbolStrings::IsBinary(const std::string& path) {
+  char magic[sizeof(kSymbolsMagic)];
+  std::ifstream is(path, std::ios::binary);
+  return is.read(magic, sizeof(magic)) &&
+         memcmp(magic, kSymbolsMagic, sizeof(magic)) == 0;
+}
+
+bool SymbolStrings::Write(const std::string& path) const {
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (fp == nullptr) return false;
+  size_t size =
+      SymbolsBufferSize(header_->num_ids, header_->num_buckets,
+                        header_->num_slots, header_->symbols_size);
+  bool ok = fwrite(header_, 1, size, fp) == size;
+  return fclose(fp) == 0 && ok;
+}
+
+int64_t SymbolStrings::Find(const std::string& symbol) const {
+  uint64_t hash = HashSymbol(symbol.data(), symbol.size());
+  uint32_t bucket = HashSlot(hash, 0, header_->num_buckets);
+  int32_t id = slots_[HashSlot(hash, displacements_[bucket],
+                               header_->num_slots)];
+  if (!Contains(id) || static_cast<size_t>(size(id)) != symbol.size() ||
+      memcmp(data(id), symbol.data(), symbol.size()) != 0) {
+    return -1;
+  }
+  return id;
+}
+
 }  // namespace wenet
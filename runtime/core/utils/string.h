@@ -15,6 +15,7 @@
 #ifndef UTILS_STRING_H_
 #define UTILS_STRING_H_
 
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <vector>
@@ -23,6 +24,9 @@
 
 #include "fst/symbol-table.h"
 
+#include "utils/mapped_file.h"
+#include "utils/utils.h"
+
 namespace wenet {
 
 const char WHITESPACE[] = " \n\r\t\f\v";
@@ -49,6 +53,8 @@ bool CheckEnglishChar(const std::string& ch);
 
 // Check whether the UTF-8 word is only contains alphabet or '.
 bool CheckEnglishWord(const std::string& word);
+// The same of the chars of [begin, end), without copying them
+bool CheckEnglishWord(const char* begin, const char* end);
 
 std::string JoinString(const std::string& c,
                        const std::vector<std::string>& strs);
@@ -63,6 +69,11 @@ bool SplitUTF8StringToWords(
 // Replace ▁ with space, then remove head, tail and consecutive space.
 std::string ProcessBlank(const std::string& str, bool lowercase);
 
+// Append the UTF-8 chars of [begin, end) to `out` in one pass, lowercased or
+// uppercased, and ▁ as a space unless `out` is empty or ends with a space.
+void AppendBlankProcessed(const char* begin, const char* end, bool lowercase,
+                          std::string* out);
+
 std::string Ltrim(const std::string& str);
 
 std::string Rtrim(const std::string& str);
@@ -71,6 +82,97 @@ std::string Trim(const std::string& str);
 
 std::string JoinPath(const std::string& left, const std::string& right);
 
+// The standard base64 with padding, e.g. of the binary fields of the JSON
+// results
+std::string Base64Encode(const std::string& data);
+
+// The units of the error rate of a sentence, the English words and the
+// other chars one by one, e.g. the CJK chars, the spaces are dropped
+void SplitToScoringUnits(const std::string& str,
+                         std::vector<std::string>* units);
+
+// The Levenshtein distance, the substitutions, deletions and insertions to
+// turn ref into hyp
+int EditDistance(const std::vector<std::string>& ref,
+                 const std::vector<std::string>& hyp);
+
+// The symbols of a symbol table in one contiguous buffer indexed by id, so
+// a lookup is a pointer and a length instead of the std::string copy of
+// SymbolTable::Find(), e.g. for the results of every chunk, and a minimal
+// perfect hash of the symbols for the ids, e.g. of the words of the
+// contexts. It's immutable, so the decoders and the context graphs share
+// it without locks. The ids of the tables of the runtime are dense from 0.
+//
+// It's written in a binary format, the header, the offsets of the ids, the
+// displacements of the hash buckets, the slots of the ids and the symbols,
+// in the byte order of the host. Read() maps it into memory, so a big
+// table is not parsed at every start.
+class SymbolStrings {
+ public:
+  // The symbols of `reserved` which are not in the table are appended
+  // after its max id, e.g. the tags of the context graphs, which are then
+  // never added to the shared table at runtime
+  explicit SymbolStrings(const fst::SymbolTable& table,
+                         const std::vector<std::string>& reserved = {});
+  // nullptr if path is not a valid binary symbol table
+  static std::shared_ptr<SymbolStrings> Read(const std::string& path);
+  // Whether path is of the binary format rather than the text one
+  static bool IsBinary(const std::string& path);
+  bool Write(const std::string& path) const;
+
+  // An id not in the table is "", as SymbolTable::Find()
+  const char* data(int id) const {
+    return Contains(id) ? symbols_ + offsets_[id] : symbols_;
+  }
+  int size(int id) const {
+    return Contains(id) ? offsets_[id + 1] - offsets_[id] : 0;
+  }
+  std::string Find(int id) const { return std::string(data(id), size(id)); }
+  // The id of symbol, -1 if it's not in the table, as SymbolTable::Find()
+  int64_t Find(const std::string& symbol) const;
+  // Append the symbol of id to `out`
+  void Append(int id, std::string* out) const {
+    out->append(data(id), size(id));
+  }
+  // Max id + 1
+  int num_ids() const { return header_->num_ids; }
+
+ private:
+  struct Header {
+    char magic[4];
+    int32_t version;
+    int32_t num_ids;
+    int32_t num_buckets;
+    int32_t num_slots;
+    uint32_t symbols_size;
+  };
+
+  SymbolStrings() = default;
+  // Point the arrays into data, return false if it's not a valid table
+  bool Attach(const char* data, size_t size);
+  bool Contains(int id) const { return id >= 0 && id < header_->num_ids; }
+
+  std::vector<char> buffer_;
+  // The mapped file, buffer_ is not used then
+  std::unique_ptr<MappedFile> file_;
+  const Header* header_ = nullptr;
+  // The symbol of id is [offsets_[id], offsets_[id + 1]) of symbols_
+  const uint32_t* offsets_ = nullptr;
+  // The symbols of bucket b are in the slots of displacements_[b]
+  const uint32_t* displacements_ = nullptr;
+  // The id of each slot, -1 if it's empty
+  const int32_t* slots_ = nullptr;
+  const char* symbols_ = nullptr;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(SymbolStrings);
+};
+
+// SplitUTF8StringToWords() by the symbols of a SymbolStrings
+bool SplitUTF8StringToWords(const std::string& str,
+                            const SymbolStrings& symbols,
+                            std::vector<std::string>* words);
+
 }  // namespace wenet
 
 #endif  // UTILS_STRING_H_
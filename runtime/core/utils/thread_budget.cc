@@ -0,0 +1,39 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "utils/thread_budget.h"
+
+#include <algorithm>
+
+namespace wenet {
+
+ThreadBudget::ThreadBudget(int max_threads, int max_threads_per_call)
+    : max_threads_(std::max(1, max_threads)),
+      max_threads_per_call_(max_threads_per_call > 0 ?
+                            max_threads_per_call : max_threads_) {}
+
+ThreadBudget::Lease ThreadBudget::Acquire() {
+  int active = active_.fetch_add(1, std::memory_order_relaxed) + 1;
+  int threads = std::min(max_threads_per_call_, max_threads_ / active);
+  return Lease(this, std::max(1, threads));
+}
+
+ThreadBudget::Lease::~Lease() {
+  if (budget_ != nullptr) {
+    budget_->active_.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+}  // namespace wenet
@@ -0,0 +1,75 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+
+#ifndef UTILS_THREAD_BUDGET_H_
+#define UTILS_THREAD_BUDGET_H_
+
+#include <atomic>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+// ThreadBudget shares max_threads intra-op threads among the running model
+// calls by the load: each call is granted max_threads / (number of running
+// calls) threads, at least 1 and at most max_threads_per_call. A lone long
+// offline file fans out over the idle cores, while the calls of a busy host
+// run single threaded instead of oversubscribing them. The grant is fixed
+// at Acquire(), the calls started later see the higher load. It is thread
+// safe.
+class ThreadBudget {
+ public:
+  ThreadBudget(int max_threads, int max_threads_per_call);
+
+  // The threads granted to one call, released by its destructor
+  class Lease {
+   public:
+    Lease(Lease&& other) noexcept
+        : budget_(other.budget_), threads_(other.threads_) {
+      other.budget_ = nullptr;
+    }
+    ~Lease();
+    int threads() const { return threads_; }
+
+   private:
+    friend class ThreadBudget;
+    Lease(ThreadBudget* budget, int threads)
+        : budget_(budget), threads_(threads) {}
+
+    ThreadBudget* budget_;
+    int threads_;
+
+   public:
+    WENET_DISALLOW_COPY_AND_ASSIGN(Lease);
+  };
+
+  Lease Acquire();
+  // The number of running calls
+  int active() const { return active_.load(std::memory_order_relaxed); }
+  int max_threads() const { return max_threads_; }
+
+ private:
+  const int max_threads_;
+  const int max_threads_per_call_;
+  std::atomic<int> active_{0};
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(ThreadBudget);
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_THREAD_BUDGET_H_
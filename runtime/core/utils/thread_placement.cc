@@ -0,0 +1,140 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "utils/thread_placement.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <fstream>
+#include <thread>
+
+#include "utils/log.h"
+#include "utils/string.h"
+
+namespace wenet {
+
+std::vector<int> ParseCpuList(const std::string& str) {
+  std::vector<int> cpus;
+  std::vector<std::string> ranges;
+  SplitStringToVector(Trim(str), ",", true, &ranges);
+  for (const std::string& range : ranges) {
+    size_t pos = range.find('-');
+    int first = std::stoi(range.substr(0, pos));
+    int last = pos == std::string::npos ? first :
+                                          std::stoi(range.substr(pos + 1));
+    for (int i = first; i <= last; ++i) {
+      cpus.push_back(i);
+    }
+  }
+  return cpus;
+}
+
+bool PinThread(const std::vector<int>& cpus) {
+#ifdef __linux__
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &cpu_set);
+  }
+  int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+  if (ret != 0) {
+    LOG(WARNING) << "pthread_setaffinity_np error " << ret;
+    return false;
+  }
+#endif
+  return true;
+}
+
+static std::string ReadFirstLine(const std::string& path) {
+  std::ifstream is(path);
+  std::string line;
+  std::getline(is, line);
+  return line;
+}
+
+ThreadPlacement::ThreadPlacement(const ThreadPlacementOptions& opts)
+    : opts_(opts) {
+  const std::string sysfs = "/sys/devices/system/node/";
+  std::vector<int> ids = opts_.nodes;
+  if (ids.empty()) {
+    ids = ParseCpuList(ReadFirstLine(sysfs + "online"));
+  }
+  for (int id : ids) {
+    Node node;
+    node.id = id;
+    node.cpus = ParseCpuList(
+        ReadFirstLine(sysfs + "node" + std::to_string(id) + "/cpulist"));
+    if (node.cpus.empty()) {
+      LOG(WARNING) << "No cpu found for NUMA node " << id;
+      continue;
+    }
+    LOG(INFO) << "NUMA node " << id << " with " << node.cpus.size()
+              << " cpus";
+    nodes_.push_back(std::move(node));
+  }
+  if (nodes_.empty()) {
+    // No NUMA info, one node of all the cpus
+    Node node;
+    for (int i = 0; i < std::thread::hardware_concurrency(); ++i) {
+      node.cpus.push_back(i);
+    }
+    nodes_.push_back(std::move(node));
+  }
+}
+
+int ThreadPlacement::Enter() {
+  std::vector<int> cpus;
+  int index = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int i = 1; i < nodes_.size(); ++i) {
+      if (nodes_[i].num_sessions < nodes_[index].num_sessions) {
+        index = i;
+      }
+    }
+    nodes_[index].num_sessions++;
+    cpus = nodes_[index].cpus;
+  }
+  if (!PinThread(cpus)) {
+    LOG(WARNING) << "Failed to pin thread to NUMA node " << nodes_[index].id;
+  }
+  VLOG(1) << "Session placed on NUMA node " << nodes_[index].id;
+  return index;
+}
+
+void ThreadPlacement::Leave(int node, int64_t audio_ms, int64_t decode_ms) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  CHECK_GE(node, 0);
+  CHECK_LT(node, nodes_.size());
+  Node& n = nodes_[node];
+  n.num_sessions--;
+  n.num_finished++;
+  n.audio_ms += audio_ms;
+  n.decode_ms += decode_ms;
+  if (opts_.report_interval > 0 && n.num_finished % opts_.report_interval == 0
+      && n.audio_ms > 0) {
+    LOG(INFO) << "NUMA node " << n.id << ": " << n.num_finished
+              << " sessions, " << n.num_sessions << " running, RTF "
+              << static_cast<float>(n.decode_ms) / n.audio_ms;
+    n.audio_ms = 0;
+    n.decode_ms = 0;
+  }
+}
+
+}  // namespace wenet
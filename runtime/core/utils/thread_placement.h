@@ -0,0 +1,78 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef UTILS_THREAD_PLACEMENT_H_
+#define UTILS_THREAD_PLACEMENT_H_
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+struct ThreadPlacementOptions {
+  // NUMA node ids to place the sessions on, empty means all the nodes
+  std::vector<int> nodes;
+  // Log the RTF of a node every report_interval finished sessions on it
+  int report_interval = 100;
+};
+
+// Parse a cpu list of sysfs, e.g. "0-3,8,10-11"
+std::vector<int> ParseCpuList(const std::string& str);
+
+// Pin the calling thread to the cpus, it is a no-op except on Linux
+bool PinThread(const std::vector<int>& cpus);
+
+// ThreadPlacement pins each decoding session to the cpus of one NUMA node,
+// the node with the fewest running sessions. The session thread is pinned
+// before it creates the decoder, so:
+// 1. The threads it creates later, i.e. the decoding and rescoring threads,
+//    inherit the affinity, and so do their OpenMP intra-op thread teams.
+// 2. The session's features and model caches are first touched on the node,
+//    so they are allocated in its local memory.
+// It is thread safe, and it is a no-op except on Linux.
+class ThreadPlacement {
+ public:
+  explicit ThreadPlacement(const ThreadPlacementOptions& opts);
+
+  // Pin the calling thread, return the index of the node for Leave()
+  int Enter();
+  // The session on `node` is done, it decoded audio_ms audio in decode_ms
+  void Leave(int node, int64_t audio_ms, int64_t decode_ms);
+
+ private:
+  struct Node {
+    int id = 0;
+    std::vector<int> cpus;
+    int num_sessions = 0;
+    int num_finished = 0;
+    int64_t audio_ms = 0;
+    int64_t decode_ms = 0;
+  };
+
+  const ThreadPlacementOptions opts_;
+  std::mutex mutex_;
+  std::vector<Node> nodes_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(ThreadPlacement);
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_THREAD_PLACEMENT_H_
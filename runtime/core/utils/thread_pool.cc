@@ -0,0 +1,136 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/thread_pool.h"
+
+#include <algorithm>
+#include <exception>
+#include <utility>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+// The pool and the index of the worker running on this thread, the tasks
+// posted on a worker are queued on it
+static thread_local ThreadPool* current_pool = nullptr;
+static thread_local int current_worker = -1;
+
+const int ThreadPool::kNumPriorities;
+
+ThreadPool::ThreadPool(int num_threads,
+                       std::shared_ptr<ThreadPlacement> placement)
+    : placement_(std::move(placement)) {
+  if (num_threads <= 0) {
+    num_threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(new Worker);
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    workers_[i]->thread = std::thread(&ThreadPool::WorkerLoop, this, i);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  Drain();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  queue_cond_.notify_all();
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
+}
+
+void ThreadPool::Post(std::function<void()> task, TaskPriority priority) {
+  num_unfinished_.fetch_add(1);
+  Enqueue(std::move(task), static_cast<int>(priority));
+}
+
+void ThreadPool::Drain() {
+  CHECK(current_pool != this) << "Drain() is called by a task of the pool";
+  std::unique_lock<std::mutex> lock(mutex_);
+  drain_cond_.wait(lock, [this] { return num_unfinished_ == 0; });
+}
+
+void ThreadPool::Enqueue(std::function<void()> task, int priority) {
+  int index = current_worker;
+  if (current_pool != this) {
+    index = next_worker_.fetch_add(1) % workers_.size();
+  }
+  {
+    Worker* worker = workers_[index].get();
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    worker->tasks[priority].emplace_back(std::move(task));
+  }
+  num_queued_.fetch_add(1);
+  // The empty critical section orders the count before the wait of a
+  // worker which has just checked it
+  { std::lock_guard<std::mutex> lock(mutex_); }
+  queue_cond_.notify_one();
+}
+
+bool ThreadPool::Dequeue(int index, std::function<void()>* task) {
+  const int num_workers = workers_.size();
+  for (int priority = 0; priority < kNumPriorities; ++priority) {
+    for (int i = 0; i < num_workers; ++i) {
+      Worker* worker = workers_[(index + i) % num_workers].get();
+      std::lock_guard<std::mutex> lock(worker->mutex);
+      auto& tasks = worker->tasks[priority];
+      if (tasks.empty()) continue;
+      if (i == 0) {
+        *task = std::move(tasks.front());
+        tasks.pop_front();
+      } else {
+        *task = std::move(tasks.back());
+        tasks.pop_back();
+      }
+      num_queued_.fetch_sub(1);
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::WorkerLoop(int index) {
+  if (placement_ != nullptr) {
+    placement_->Enter();
+  }
+  current_pool = this;
+  current_worker = index;
+  while (true) {
+    std::function<void()> task;
+    if (Dequeue(index, &task)) {
+      try {
+        task();
+      } catch (std::exception const& e) {
+        LOG(ERROR) << e.what();
+      }
+      // Release the captures before Drain() returns
+      task = nullptr;
+      if (num_unfinished_.fetch_sub(1) == 1) {
+        { std::lock_guard<std::mutex> lock(mutex_); }
+        drain_cond_.notify_all();
+      }
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    queue_cond_.wait(lock, [this] { return stop_ || num_queued_ > 0; });
+    if (stop_ && num_queued_ == 0) return;
+  }
+}
+
+}  // namespace wenet
@@ -0,0 +1,112 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTILS_THREAD_POOL_H_
+#define UTILS_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "utils/thread_placement.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// The queued tasks of a higher priority run first, e.g. the encoder
+// forwards before the searches, and the searches before the serialization
+// of the results
+enum class TaskPriority { kHigh = 0, kNormal = 1, kLow = 2 };
+
+// ThreadPool runs the tasks of a server or a tool on a fixed number of
+// threads, so their concurrency is set in one place instead of one thread
+// per request. Each worker has its own queue of each priority, the tasks
+// posted by a worker are queued on it, the others round robin, and an idle
+// worker steals from the others, the highest priority first.
+// The tasks may post more tasks, but shouldn't wait for each other. It is
+// thread safe.
+class ThreadPool {
+ public:
+  // The threads are pinned by `placement` if it's not nullptr. num_threads
+  // 0 means one per cpu.
+  explicit ThreadPool(int num_threads,
+                      std::shared_ptr<ThreadPlacement> placement = nullptr);
+  // Drain() and stop the threads
+  ~ThreadPool();
+
+  // Run `task`, its exceptions are logged
+  void Post(std::function<void()> task,
+            TaskPriority priority = TaskPriority::kNormal);
+  // Run `func`, the future has its result or its exception
+  template <typename Func>
+  std::future<typename std::result_of<Func()>::type> Submit(
+      Func&& func, TaskPriority priority = TaskPriority::kNormal) {
+    using Result = typename std::result_of<Func()>::type;
+    // std::function needs a copyable task
+    auto task = std::make_shared<std::packaged_task<Result()>>(
+        std::forward<Func>(func));
+    std::future<Result> future = task->get_future();
+    Post([task]() { (*task)(); }, priority);
+    return future;
+  }
+  // Block until the tasks posted so far, and the ones they post, are done.
+  // It can't be called by the tasks.
+  void Drain();
+
+  int num_threads() const { return workers_.size(); }
+  // Tasks waiting for a thread
+  int num_queued() const { return num_queued_.load(); }
+
+ private:
+  static const int kNumPriorities = 3;
+
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks[kNumPriorities];
+    std::thread thread;
+  };
+
+  void Enqueue(std::function<void()> task, int priority);
+  // Pop the front of the worker's own queue, or steal the back of another,
+  // the highest priority first
+  bool Dequeue(int index, std::function<void()>* task);
+  void WorkerLoop(int index);
+
+  std::shared_ptr<ThreadPlacement> placement_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<unsigned> next_worker_{0};
+  std::atomic<int> num_queued_{0};
+  // The tasks posted but not done yet
+  std::atomic<int> num_unfinished_{0};
+  // The idle workers and Drain() sleep on them
+  std::mutex mutex_;
+  std::condition_variable queue_cond_;
+  std::condition_variable drain_cond_;
+  bool stop_ = false;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+};
+
+}  // namespace wenet
+
+#endif  // UTILS_THREAD_POOL_H_
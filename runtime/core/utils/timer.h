@@ -16,6 +16,7 @@
 #define UTILS_TIMER_H_
 
 #include <chrono>
+#include <cstdint>
 
 namespace wenet {
 
@@ -30,6 +31,13 @@ class Timer {
                                                                  time_start_)
         .count();
   }
+  // return in microseconds, for the stages much shorter than 1ms
+  int64_t ElapsedUs() const {
+    auto time_now = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(time_now -
+                                                                 time_start_)
+        .count();
+  }
 
  private:
   std::chrono::time_point<std::chrono::steady_clock> time_start_;
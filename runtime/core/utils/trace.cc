@@ -0,0 +1,130 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "utils/trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+
+#include "utils/log.h"
+
+namespace wenet {
+
+int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+const int Tracer::kCapacity;
+
+Tracer* Tracer::Get() {
+  static Tracer tracer;
+  return &tracer;
+}
+
+Tracer::ThreadBuffer* Tracer::LocalBuffer() {
+  thread_local ThreadBuffer* buffer = nullptr;
+  if (buffer == nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffers_.emplace_back(new ThreadBuffer(buffers_.size()));
+    buffer = buffers_.back().get();
+  }
+  return buffer;
+}
+
+void Tracer::Record(const char* name, int64_t start_ns, int64_t end_ns) {
+  ThreadBuffer* buffer = LocalBuffer();
+  // Only this thread writes the buffer
+  uint64_t count = buffer->count.load(std::memory_order_relaxed);
+  // Mark the overwrite of the slot before it, like a seqlock, so the export
+  // drops it
+  buffer->writing.store(count + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  Event& event = buffer->events[count % kCapacity];
+  event.name.store(name, std::memory_order_relaxed);
+  event.start_ns.store(start_ns, std::memory_order_relaxed);
+  event.end_ns.store(end_ns, std::memory_order_relaxed);
+  buffer->count.store(count + 1, std::memory_order_release);
+}
+
+void Tracer::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& buffer : buffers_) {
+    buffer->cleared.store(buffer->count.load(std::memory_order_acquire),
+                          std::memory_order_relaxed);
+  }
+}
+
+// Escape the quotes and the backslashes of the names, they have no control
+// characters
+static void AppendJsonString(const char* str, std::string* out) {
+  out->push_back('"');
+  for (const char* c = str; *c != '\0'; ++c) {
+    if (*c == '"' || *c == '\\') out->push_back('\\');
+    out->push_back(*c);
+  }
+  out->push_back('"');
+}
+
+std::string Tracer::ExportChromeTrace() const {
+  std::string out = "{\"traceEvents\":[";
+  bool first = true;
+  char buf[128];
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& buffer : buffers_) {
+    uint64_t end = buffer->count.load(std::memory_order_acquire);
+    uint64_t begin = std::max(buffer->cleared.load(std::memory_order_relaxed),
+                              end > kCapacity ? end - kCapacity : 0);
+    for (uint64_t i = begin; i < end; ++i) {
+      const Event& event = buffer->events[i % kCapacity];
+      const char* name = event.name.load(std::memory_order_relaxed);
+      int64_t start_ns = event.start_ns.load(std::memory_order_relaxed);
+      int64_t end_ns = event.end_ns.load(std::memory_order_relaxed);
+      // The event is being or has been overwritten if the thread has wrapped
+      // around to it
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (buffer->writing.load(std::memory_order_relaxed) - i > kCapacity) {
+        continue;
+      }
+      if (!first) out.push_back(',');
+      first = false;
+      out += "{\"name\":";
+      AppendJsonString(name, &out);
+      // The timestamps are in microseconds
+      snprintf(buf, sizeof(buf),
+               ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,"
+               "\"tid\":%d}",
+               start_ns / 1e3, (end_ns - start_ns) / 1e3, buffer->tid);
+      out += buf;
+    }
+  }
+  out += "]}";
+  return out;
+}
+
+bool Tracer::WriteChromeTrace(const std::string& path) const {
+  std::ofstream os(path);
+  os << ExportChromeTrace();
+  if (!os) {
+    LOG(ERROR) << "Failed to write the traces to " << path;
+    return false;
+  }
+  LOG(INFO) << "Traces written to " << path;
+  return true;
+}
+
+}  // namespace wenet
@@ -0,0 +1,122 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef UTILS_TRACE_H_
+#define UTILS_TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "utils/utils.h"
+
+namespace wenet {
+
+// Nanoseconds of the steady clock
+int64_t NowNs();
+
+// Tracer records the scopes of the hot paths, e.g. the encoder forward and
+// the search of each chunk, to see where a slow stream spends its time. The
+// events are exported in the Chrome trace event format, which is opened by
+// chrome://tracing or https://ui.perfetto.dev.
+//
+// Each thread appends to its own ring buffer of the last kCapacity events,
+// so Record() takes no lock and doesn't contend with the other threads. The
+// buffers may be exported while they are written, the events overwritten
+// meanwhile are dropped.
+class Tracer {
+ public:
+  static const int kCapacity = 1 << 16;
+
+  static Tracer* Get();
+
+  void set_enabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+  // The name must outlive the export, e.g. a string literal
+  void Record(const char* name, int64_t start_ns, int64_t end_ns);
+  // Drop the events recorded so far
+  void Clear();
+  // {"traceEvents": [...]} of the complete events, "ph": "X"
+  std::string ExportChromeTrace() const;
+  bool WriteChromeTrace(const std::string& path) const;
+
+ private:
+  Tracer() = default;
+
+  struct Event {
+    std::atomic<const char*> name{nullptr};
+    std::atomic<int64_t> start_ns{0};
+    std::atomic<int64_t> end_ns{0};
+  };
+  struct ThreadBuffer {
+    explicit ThreadBuffer(int tid) : tid(tid), events(kCapacity) {}
+    const int tid;
+    std::vector<Event> events;
+    // Events ever recorded, and the ones before cleared are dropped
+    std::atomic<uint64_t> count{0};
+    // The count including the event being written
+    std::atomic<uint64_t> writing{0};
+    std::atomic<uint64_t> cleared{0};
+  };
+  ThreadBuffer* LocalBuffer();
+
+  std::atomic<bool> enabled_{false};
+  mutable std::mutex mutex_;
+  // The buffers are never freed, the events of the exited threads are kept
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(Tracer);
+};
+
+// Record the scope from its construction to its destruction, if the tracer
+// is enabled when it's constructed
+class TraceScope {
+ public:
+  explicit TraceScope(const char* name)
+      : name_(Tracer::Get()->enabled() ? name : nullptr),
+        start_ns_(name_ != nullptr ? NowNs() : 0) {}
+  ~TraceScope() {
+    if (name_ != nullptr) {
+      Tracer::Get()->Record(name_, start_ns_, NowNs());
+    }
+  }
+
+ private:
+  const char* name_;
+  int64_t start_ns_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(TraceScope);
+};
+
+}  // namespace wenet
+
+// The scopes of the hot paths are only compiled in with -DUSE_TRACE, see the
+// TRACE option of CMake
+#ifdef USE_TRACE
+#define WENET_TRACE_CONCAT_IMPL(a, b) a##b
+#define WENET_TRACE_CONCAT(a, b) WENET_TRACE_CONCAT_IMPL(a, b)
+#define WENET_TRACE_SCOPE(name) \
+  wenet::TraceScope WENET_TRACE_CONCAT(wenet_trace_scope_, __LINE__)(name)
+#else
+#define WENET_TRACE_SCOPE(name)
+#endif
+
+#endif  // UTILS_TRACE_H_
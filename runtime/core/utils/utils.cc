@@ -17,15 +17,22 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdint>
-#include <queue>
 #include <utility>
 #include <vector>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WENET_SIMD_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define WENET_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
 #include "utils/log.h"
 
 namespace wenet {
 
-float LogAdd(float x, float y) {
+float ExactLogAdd(float x, float y) {
   static float num_min = -std::numeric_limits<float>::max();
   if (x <= num_min) return y;
   if (y <= num_min) return x;
@@ -33,6 +40,108 @@ float LogAdd(float x, float y) {
   return std::log(std::exp(x - xmax) + std::exp(y - xmax)) + xmax;
 }
 
+// log1p(exp(-d)) for d in [0, kLogAddMaxDiff) is a cubic Hermite spline of
+// kLogAddSteps intervals per unit, the error of which is below 1e-9, so the
+// float rounding dominates. Beyond it, log1p(exp(-d)) < 1.2e-7 is below the
+// float precision of the sum.
+static const int kLogAddMaxDiff = 16;
+static const int kLogAddSteps = 32;
+static const int kLogAddIntervals = kLogAddMaxDiff * kLogAddSteps;
+
+// The polynomial of interval i is c[0] + c[1] t + c[2] t^2 + c[3] t^3 of
+// t = d * kLogAddSteps - i in [0, 1]. It has one more interval for d of
+// exactly kLogAddMaxDiff in the vectorized path.
+struct LogAddSpline {
+  float c[kLogAddIntervals + 1][4];
+
+  LogAddSpline() {
+    auto f = [](double d) { return std::log1p(std::exp(-d)); };
+    // The derivative in t
+    auto df = [](double d) {
+      return -std::exp(-d) / (1 + std::exp(-d)) / kLogAddSteps;
+    };
+    for (int i = 0; i <= kLogAddIntervals; ++i) {
+      double d0 = static_cast<double>(i) / kLogAddSteps;
+      double d1 = static_cast<double>(i + 1) / kLogAddSteps;
+      double y0 = f(d0), y1 = f(d1), m0 = df(d0), m1 = df(d1);
+      c[i][0] = y0;
+      c[i][1] = m0;
+      c[i][2] = 3 * (y1 - y0) - 2 * m0 - m1;
+      c[i][3] = 2 * (y0 - y1) + m0 + m1;
+    }
+  }
+};
+
+static const LogAddSpline& GetLogAddSpline() {
+  static const LogAddSpline spline;
+  return spline;
+}
+
+float LogAdd(float x, float y) {
+  static const LogAddSpline& spline = GetLogAddSpline();
+  float xmax = std::max(x, y);
+  float d = std::abs(x - y);
+  // Also for -kFloatMax or -inf, the difference is huge or NaN then
+  if (!(d < kLogAddMaxDiff)) return xmax;
+  float pos = d * kLogAddSteps;
+  int i = static_cast<int>(pos);
+  float t = pos - i;
+  const float* c = spline.c[i];
+  return xmax + (((c[3] * t + c[2]) * t + c[1]) * t + c[0]);
+}
+
+#if defined(WENET_SIMD_X86)
+// The same arithmetic as LogAdd() for 8 pairs at once, so the results are
+// the same
+__attribute__((target("avx2"))) static int Avx2LogAdd(
+    const float* x, const float* y, int n, float* z, const float* c) {
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  const __m256 max_diff = _mm256_set1_ps(kLogAddMaxDiff);
+  const __m256 steps = _mm256_set1_ps(kLogAddSteps);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 vx = _mm256_loadu_ps(x + i);
+    __m256 vy = _mm256_loadu_ps(y + i);
+    __m256 xmax = _mm256_max_ps(vx, vy);
+    __m256 d = _mm256_andnot_ps(sign, _mm256_sub_ps(vx, vy));
+    __m256 in_range = _mm256_cmp_ps(d, max_diff, _CMP_LT_OQ);
+    // NaN is clamped too, min_ps returns the second operand then
+    __m256 pos = _mm256_mul_ps(_mm256_min_ps(d, max_diff), steps);
+    __m256i index = _mm256_cvttps_epi32(pos);
+    __m256 t = _mm256_sub_ps(pos, _mm256_cvtepi32_ps(index));
+    __m256i offset = _mm256_slli_epi32(index, 2);
+    __m256 c0 = _mm256_i32gather_ps(c, offset, 4);
+    __m256 c1 = _mm256_i32gather_ps(c + 1, offset, 4);
+    __m256 c2 = _mm256_i32gather_ps(c + 2, offset, 4);
+    __m256 c3 = _mm256_i32gather_ps(c + 3, offset, 4);
+    __m256 r = _mm256_add_ps(_mm256_mul_ps(c3, t), c2);
+    r = _mm256_add_ps(_mm256_mul_ps(r, t), c1);
+    r = _mm256_add_ps(_mm256_mul_ps(r, t), c0);
+    r = _mm256_add_ps(xmax, r);
+    _mm256_storeu_ps(z + i, _mm256_blendv_ps(xmax, r, in_range));
+  }
+  return i;
+}
+
+static bool SupportsAvx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+
+void LogAdd(const float* x, const float* y, int n, float* z) {
+  int i = 0;
+#if defined(WENET_SIMD_X86)
+  static const bool avx2 = SupportsAvx2();
+  if (avx2) {
+    i = Avx2LogAdd(x, y, n, z, &GetLogAddSpline().c[0][0]);
+  }
+#endif
+  for (; i < n; ++i) {
+    z[i] = LogAdd(x[i], y[i]);
+  }
+}
+
 
 template <typename T>
 struct ValueComp {
@@ -45,40 +154,115 @@ struct ValueComp {
 };
 
 
+// Return the first index in [begin, n) whose value may be greater than
+// threshold, or n
+template <typename T>
+using TopKFilter = int32_t (*)(const T* data, int32_t begin, int32_t n,
+                               T threshold);
+
+template <typename T>
+static int32_t NoFilter(const T* data, int32_t begin, int32_t n,
+                        T threshold) {
+  return begin;
+}
+
 // We refer the pytorch topk implementation
 // https://github.com/pytorch/pytorch/blob/master/caffe2/operators/top_k.cc
 template <typename T>
-void TopK(const std::vector<T>& data,
-          int32_t k,
-          std::vector<T>* values,
-          std::vector<int>* indices) {
-  std::vector<std::pair<T, int32_t>> heap_data;
-  int n = data.size();
+static void HeapTopK(const T* data,
+                     int32_t n,
+                     int32_t k,
+                     TopKFilter<T> filter,
+                     std::vector<T>* values,
+                     std::vector<int>* indices) {
+  // A min heap of the topk, it's kept across the calls of the thread, so
+  // the search of each frame doesn't allocate
+  thread_local std::vector<std::pair<T, int32_t>> heap;
+  const ValueComp<T> comp;
+  heap.clear();
   for (int32_t i = 0; i < k && i < n; ++i) {
-    heap_data.emplace_back(data[i], i);
+    heap.emplace_back(data[i], i);
   }
-  std::priority_queue<
-      std::pair<T, int32_t>,
-      std::vector<std::pair<T, int32_t>>,
-      ValueComp<T>>
-      pq(ValueComp<T>(), std::move(heap_data));
+  std::make_heap(heap.begin(), heap.end(), comp);
   for (int32_t i = k; i < n; ++i) {
-    if (pq.top().first < data[i]) {
-      pq.pop();
-      pq.emplace(data[i], i);
+    i = filter(data, i, n, heap.front().first);
+    if (i >= n) break;
+    if (heap.front().first < data[i]) {
+      std::pop_heap(heap.begin(), heap.end(), comp);
+      heap.back() = std::make_pair(data[i], i);
+      std::push_heap(heap.begin(), heap.end(), comp);
     }
   }
+  // In descending order
+  std::sort_heap(heap.begin(), heap.end(), comp);
+  values->resize(heap.size());
+  indices->resize(heap.size());
+  for (size_t i = 0; i < heap.size(); ++i) {
+    (*values)[i] = heap[i].first;
+    (*indices)[i] = heap[i].second;
+  }
+}
 
-  values->resize(std::min(k, n));
-  indices->resize(std::min(k, n));
-  int32_t cur = values->size() - 1;
-  while (!pq.empty()) {
-    const auto& item = pq.top();
-    (*values)[cur] = item.first;
-    (*indices)[cur] = item.second;
-    pq.pop();
-    cur -= 1;
+#if defined(WENET_SIMD_X86)
+__attribute__((target("avx2"))) static int32_t Avx2Filter(
+    const float* data, int32_t begin, int32_t n, float threshold) {
+  __m256 t = _mm256_set1_ps(threshold);
+  int32_t i = begin;
+  for (; i + 8 <= n; i += 8) {
+    __m256 gt = _mm256_cmp_ps(_mm256_loadu_ps(data + i), t, _CMP_GT_OQ);
+    int mask = _mm256_movemask_ps(gt);
+    if (mask != 0) return i + __builtin_ctz(mask);
   }
+  return i;
+}
+#elif defined(WENET_SIMD_NEON)
+static int32_t NeonFilter(const float* data, int32_t begin, int32_t n,
+                          float threshold) {
+  float32x4_t t = vdupq_n_f32(threshold);
+  int32_t i = begin;
+  for (; i + 4 <= n; i += 4) {
+    uint32x4_t gt = vcgtq_f32(vld1q_f32(data + i), t);
+    uint32x2_t any = vorr_u32(vget_low_u32(gt), vget_high_u32(gt));
+    if ((vget_lane_u32(any, 0) | vget_lane_u32(any, 1)) != 0) return i;
+  }
+  return i;
+}
+#endif
+
+static TopKFilter<float> SelectTopKFilter() {
+#if defined(WENET_SIMD_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return Avx2Filter;
+#elif defined(WENET_SIMD_NEON)
+  return NeonFilter;
+#endif
+  return NoFilter<float>;
+}
+
+template <>
+void TopK<float>(const float* data,
+                 int32_t n,
+                 int32_t k,
+                 std::vector<float>* values,
+                 std::vector<int>* indices) {
+  static const TopKFilter<float> filter = SelectTopKFilter();
+  HeapTopK<float>(data, n, k, filter, values, indices);
+}
+
+void ScalarTopK(const float* data,
+                int32_t n,
+                int32_t k,
+                std::vector<float>* values,
+                std::vector<int>* indices) {
+  HeapTopK<float>(data, n, k, NoFilter<float>, values, indices);
+}
+
+template <typename T>
+void TopK(const std::vector<T>& data,
+          int32_t k,
+          std::vector<T>* values,
+          std::vector<int>* indices) {
+  TopK(data.data(), static_cast<int32_t>(data.size()), k, values, indices);
 }
 
 template void TopK<float>(
@@ -15,6 +15,7 @@
 #ifndef UTILS_UTILS_H_
 #define UTILS_UTILS_H_
 
+#include <cstddef>
 #include <cstdint>
 #include <limits>
 #include <vector>
@@ -29,15 +30,61 @@ const float kFloatMax = std::numeric_limits<float>::max();
 // kSpaceSymbol in UTF-8 is: ▁
 const char kSpaceSymbol[] = "\xe2\x96\x81";
 
-// Return the sum of two probabilities in log scale
+// Return the sum of two probabilities in log scale. log1p(exp(-|x - y|)) is
+// evaluated by a spline, the error of which is within the float rounding,
+// and it's skipped if |x - y| is beyond the float precision.
 float LogAdd(float x, float y);
 
+// z[i] = LogAdd(x[i], y[i]) of n pairs, vectorized with AVX2, e.g. for the
+// scores of a whole beam. The results are the same as LogAdd().
+void LogAdd(const float* x, const float* y, int n, float* z);
+
+// LogAdd() by std::exp and std::log, the reference of the above
+float ExactLogAdd(float x, float y);
+
 template <typename T>
 void TopK(const std::vector<T>& data,
           int32_t k,
           std::vector<T>* values,
           std::vector<int>* indices);
 
+// Same as above, data is a raw buffer of n elements. For float, the blocks
+// of data which are not greater than the current k-th value are skipped
+// with the AVX2 or NEON compares, the result is the same as ScalarTopK().
+template <typename T>
+void TopK(const T* data,
+          int32_t n,
+          int32_t k,
+          std::vector<T>* values,
+          std::vector<int>* indices);
+
+template <>
+void TopK<float>(const float* data,
+                 int32_t n,
+                 int32_t k,
+                 std::vector<float>* values,
+                 std::vector<int>* indices);
+
+// Bytes allocated by a vector, and by the vectors it holds, for the memory
+// accounting of the sessions
+template <typename T>
+size_t VectorBytes(const std::vector<T>& v) {
+  return v.capacity() * sizeof(T);
+}
+template <typename T>
+size_t VectorBytes(const std::vector<std::vector<T>>& v) {
+  size_t bytes = v.capacity() * sizeof(std::vector<T>);
+  for (const auto& row : v) bytes += row.capacity() * sizeof(T);
+  return bytes;
+}
+
+// TopK without the SIMD pre-filter, the reference of TopK
+void ScalarTopK(const float* data,
+                int32_t n,
+                int32_t k,
+                std::vector<float>* values,
+                std::vector<int>* indices);
+
 }  // namespace wenet
 
 #endif  // UTILS_UTILS_H_
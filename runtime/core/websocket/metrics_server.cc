@@ -0,0 +1,109 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "websocket/metrics_server.h"
+
+#include <string>
+
+#include "boost/beast/core.hpp"
+#include "boost/beast/http.hpp"
+
+#include "utils/log.h"
+#include "utils/trace.h"
+
+namespace wenet {
+
+namespace beast = boost::beast;  // from <boost/beast.hpp>
+namespace http = beast::http;    // from <boost/beast/http.hpp>
+
+MetricsServer::MetricsServer(int port, MetricsRegistry* registry)
+    : port_(port), registry_(registry), acceptor_(ioc_) {}
+
+MetricsServer::~MetricsServer() {
+  if (thread_ != nullptr) {
+    beast::error_code ec;
+    acceptor_.close(ec);
+    ioc_.stop();
+    thread_->join();
+  }
+}
+
+void MetricsServer::Start() {
+  try {
+    tcp::endpoint endpoint{asio::ip::make_address("0.0.0.0"),
+                           static_cast<uint16_t>(port_)};
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(asio::socket_base::reuse_address(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+  } catch (const std::exception& e) {
+    LOG(FATAL) << e.what();
+  }
+  LOG(INFO) << "Serving metrics at port " << port_;
+  thread_.reset(new std::thread(&MetricsServer::ServeLoop, this));
+}
+
+void MetricsServer::ServeLoop() {
+  while (true) {
+    tcp::socket socket(ioc_);
+    beast::error_code ec;
+    acceptor_.accept(socket, ec);
+    if (ec) {
+      // The acceptor is closed on the destruction
+      if (!acceptor_.is_open()) return;
+      LOG(WARNING) << ec.message();
+      continue;
+    }
+    Serve(&socket);
+  }
+}
+
+void MetricsServer::Serve(tcp::socket* socket) {
+  beast::error_code ec;
+  beast::flat_buffer buffer;
+  http::request<http::string_body> request;
+  http::read(*socket, buffer, request, ec);
+  if (ec) {
+    VLOG(1) << ec.message();
+    return;
+  }
+  http::response<http::string_body> response;
+  response.version(request.version());
+  response.keep_alive(false);
+  if (request.method() == http::verb::get && request.target() == "/metrics") {
+    response.result(http::status::ok);
+    response.set(http::field::content_type, "text/plain; version=0.0.4");
+    response.body() = registry_->Render();
+  } else if (request.method() == http::verb::get &&
+             request.target() == "/trace") {
+    response.result(http::status::ok);
+    response.set(http::field::content_type, "application/json");
+    response.body() = Tracer::Get()->ExportChromeTrace();
+  } else if (request.method() == http::verb::get &&
+             request.target() == "/ready") {
+    response.result(ready_ ? http::status::ok :
+                             http::status::service_unavailable);
+    response.set(http::field::content_type, "text/plain");
+    response.body() = ready_ ? "ready\n" : "loading\n";
+  } else {
+    response.result(http::status::not_found);
+    response.set(http::field::content_type, "text/plain");
+    response.body() = "Not found\n";
+  }
+  response.prepare_payload();
+  http::write(*socket, response, ec);
+  socket->shutdown(tcp::socket::shutdown_send, ec);
+}
+
+}  // namespace wenet
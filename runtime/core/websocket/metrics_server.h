@@ -0,0 +1,66 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef WEBSOCKET_METRICS_SERVER_H_
+#define WEBSOCKET_METRICS_SERVER_H_
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "boost/asio/ip/tcp.hpp"
+
+#include "utils/metrics.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+namespace asio = boost::asio;      // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;  // from <boost/asio/ip/tcp.hpp>
+
+// MetricsServer serves GET /metrics of the registry over HTTP, for the
+// scraping of Prometheus, GET /trace of the Tracer in the Chrome trace
+// format, and GET /ready for the readiness probes, 503 until the server
+// is set ready. It's used by both the websocket and the gRPC
+// servers, the requests are served one by one on its own thread, since
+// they are rare and cheap.
+class MetricsServer {
+ public:
+  MetricsServer(int port, MetricsRegistry* registry);
+  ~MetricsServer();
+
+  // Listen on the port and serve on the background thread. It's started
+  // before the models are loaded, so the probes see the loading.
+  void Start();
+  // Once the resources are loaded and the server is about to listen
+  void set_ready(bool ready) { ready_ = ready; }
+
+ private:
+  void ServeLoop();
+  void Serve(tcp::socket* socket);
+
+  int port_;
+  MetricsRegistry* registry_;
+  asio::io_context ioc_;
+  tcp::acceptor acceptor_;
+  std::unique_ptr<std::thread> thread_;
+  std::atomic<bool> ready_{false};
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(MetricsServer);
+};
+
+}  // namespace wenet
+
+#endif  // WEBSOCKET_METRICS_SERVER_H_
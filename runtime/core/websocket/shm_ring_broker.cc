@@ -0,0 +1,133 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "websocket/shm_ring_broker.h"
+
+#include <cstdio>
+#include <istream>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "boost/asio/read_until.hpp"
+
+#include "utils/log.h"
+
+namespace wenet {
+
+namespace asio = boost::asio;
+
+std::string ShmRingBroker::Register(
+    const std::shared_ptr<ShmAudioRing>& ring) {
+  static thread_local std::mt19937_64 rng(std::random_device{}());
+  char token[33];
+  snprintf(token, sizeof(token), "%016llx%016llx",
+           static_cast<unsigned long long>(rng()),   // NOLINT
+           static_cast<unsigned long long>(rng()));  // NOLINT
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Drop the ones of the sessions gone, they are never taken
+  for (auto it = rings_.begin(); it != rings_.end();) {
+    it = it->second.expired() ? rings_.erase(it) : std::next(it);
+  }
+  rings_[token] = ring;
+  return token;
+}
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+
+using local = boost::asio::local::stream_protocol;
+
+// The token and its newline
+static const size_t kMaxTokenBytes = 64;
+
+ShmRingBroker::ShmRingBroker(asio::io_context* ioc, const std::string& path,
+                             int ring_seconds)
+    : path_(path), ring_seconds_(ring_seconds), acceptor_(*ioc) {}
+
+ShmRingBroker::~ShmRingBroker() {
+  if (acceptor_.is_open()) std::remove(path_.c_str());
+}
+
+void ShmRingBroker::Start() {
+  std::remove(path_.c_str());
+  acceptor_.open(local());
+  acceptor_.bind(local::endpoint(path_));
+  acceptor_.listen(asio::socket_base::max_listen_connections);
+  LOG(INFO) << "Shared memory audio rings at " << path_;
+  DoAccept();
+}
+
+void ShmRingBroker::DoAccept() {
+  auto socket = std::make_shared<Socket>(acceptor_.get_executor());
+  acceptor_.async_accept(
+      *socket, [this, socket](boost::system::error_code ec) {
+        if (ec) {
+          LOG(ERROR) << ec.message();
+        } else {
+          auto buffer = std::make_shared<asio::streambuf>(kMaxTokenBytes);
+          asio::async_read_until(
+              *socket, *buffer, '\n',
+              [this, socket, buffer](boost::system::error_code ec, size_t) {
+                if (ec) {
+                  LOG(INFO) << ec.message();
+                  return;
+                }
+                OnToken(socket, buffer);
+              });
+        }
+        DoAccept();
+      });
+}
+
+void ShmRingBroker::OnToken(std::shared_ptr<Socket> socket,
+                            std::shared_ptr<asio::streambuf> buffer) {
+  std::string token;
+  std::istream stream(buffer.get());
+  std::getline(stream, token);
+  std::shared_ptr<ShmAudioRing> ring;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = rings_.find(token);
+    if (it != rings_.end()) {
+      ring = it->second.lock();
+      rings_.erase(it);
+    }
+  }
+  // The fds are duplicated into the peer, the session keeps its own
+  bool sent = ring != nullptr
+                  ? SendFds(socket->native_handle(), "ok\n",
+                            {ring->memory_fd(), ring->doorbell_fd()})
+                  : SendFds(socket->native_handle(), "error\n", {});
+  if (!sent) {
+    LOG(WARNING) << "Failed to send the audio ring";
+  }
+  VLOG(1) << (ring != nullptr ? "Sent" : "No") << " audio ring of token "
+          << token;
+}
+
+#else
+
+ShmRingBroker::ShmRingBroker(asio::io_context* ioc, const std::string& path,
+                             int ring_seconds)
+    : path_(path), ring_seconds_(ring_seconds) {}
+
+ShmRingBroker::~ShmRingBroker() {}
+
+void ShmRingBroker::Start() {
+  LOG(FATAL) << "The shared memory audio rings need the Unix sockets";
+}
+
+#endif
+
+}  // namespace wenet
@@ -0,0 +1,76 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef WEBSOCKET_SHM_RING_BROKER_H_
+#define WEBSOCKET_SHM_RING_BROKER_H_
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "boost/asio/io_context.hpp"
+#include "boost/asio/local/stream_protocol.hpp"
+#include "boost/asio/streambuf.hpp"
+
+#include "utils/shm_audio_ring.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// Hands the shared memory audio rings of the websocket sessions to the
+// processes on the same host, over a Unix socket. A session with the
+// "audio_transport": "shm" option registers its ring and sends the token
+// in server_ready. The producer connects to the socket, writes the token
+// and a newline, and gets "ok\n" with the memfd and the eventfd of the ring
+// as SCM_RIGHTS, or "error\n". A token is used once, the results and the
+// control messages stay on the websocket. It needs the Unix sockets.
+class ShmRingBroker {
+ public:
+  // ring_seconds of the audio of a session fit in its ring
+  ShmRingBroker(boost::asio::io_context* ioc, const std::string& path,
+                int ring_seconds);
+  ~ShmRingBroker();
+
+  // Listen on the socket path, an old socket file of the path is removed
+  void Start();
+  // The capacity of the ring of the audio of sample_rate
+  size_t RingSamples(int sample_rate) const {
+    return static_cast<size_t>(sample_rate) * ring_seconds_;
+  }
+  // Return the token of ring, it's held until it's taken or the session
+  // is gone
+  std::string Register(const std::shared_ptr<ShmAudioRing>& ring);
+
+ private:
+  std::string path_;
+  int ring_seconds_;
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+  using Socket = boost::asio::local::stream_protocol::socket;
+  void DoAccept();
+  void OnToken(std::shared_ptr<Socket> socket,
+               std::shared_ptr<boost::asio::streambuf> buffer);
+
+  boost::asio::local::stream_protocol::acceptor acceptor_;
+#endif
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::weak_ptr<ShmAudioRing>> rings_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(ShmRingBroker);
+};
+
+}  // namespace wenet
+
+#endif  // WEBSOCKET_SHM_RING_BROKER_H_
@@ -0,0 +1,274 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "websocket/websocket_load_generator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "boost/asio/connect.hpp"
+#include "boost/asio/executor_work_guard.hpp"
+#include "boost/asio/steady_timer.hpp"
+#include "boost/asio/strand.hpp"
+#include "boost/beast/core.hpp"
+#include "boost/beast/websocket.hpp"
+#include "boost/json.hpp"
+
+#include "utils/log.h"
+
+namespace wenet {
+
+namespace beast = boost::beast;          // from <boost/beast.hpp>
+namespace websocket = beast::websocket;  // from <boost/beast/websocket.hpp>
+namespace asio = boost::asio;            // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;        // from <boost/asio/ip/tcp.hpp>
+namespace json = boost::json;
+
+static int64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// One stream over its own connection. All its handlers run on the strand of
+// the connection, and each one holds the session until it's done.
+class WebSocketLoadGenerator::Session
+    : public std::enable_shared_from_this<Session> {
+ public:
+  Session(WebSocketLoadGenerator* generator, const LoadTestWave& wave,
+          int stage)
+      : generator_(generator),
+        wave_(wave),
+        ws_(asio::make_strand(generator->ioc_)),
+        timer_(ws_.get_executor()) {
+    stream_.stage = stage;
+    stream_.audio_ms = wave.pcm.size() * 1000.0 / wave.sample_rate;
+    chunk_samples_ = std::max(
+        generator->opts_.chunk_ms * wave.sample_rate / 1000, 1);
+  }
+
+  void Start() {
+    setup_us_ = NowUs();
+    auto self = shared_from_this();
+    asio::async_connect(ws_.next_layer(), generator_->endpoints_,
+                        [self](beast::error_code ec, const tcp::endpoint&) {
+                          self->OnConnect(ec);
+                        });
+  }
+
+ private:
+  void OnConnect(beast::error_code ec) {
+    if (ec) return Fail("connect", ec);
+    const LoadTestOptions& opts = generator_->opts_;
+    std::string host = opts.hostname + ":" + std::to_string(opts.port);
+    auto self = shared_from_this();
+    ws_.async_handshake(host, "/", [self](beast::error_code ec) {
+      self->OnHandshake(ec);
+    });
+  }
+
+  void OnHandshake(beast::error_code ec) {
+    if (ec) return Fail("handshake", ec);
+    Read();
+    const LoadTestOptions& opts = generator_->opts_;
+    json::value start_tag = {{"signal", "start"},
+                             {"nbest", opts.nbest},
+                             {"continuous_decoding", opts.continuous_decoding}};
+    message_ = json::serialize(start_tag);
+    ws_.text(true);
+    auto self = shared_from_this();
+    ws_.async_write(asio::buffer(message_),
+                    [self](beast::error_code ec, size_t) {
+                      if (ec) return self->Fail("start", ec);
+                      self->start_written_ = true;
+                      self->StartAudio();
+                    });
+  }
+
+  // The audio is sent once the server is ready for it, the time before is
+  // the setup of the stream
+  void OnServerReady() {
+    if (stream_.setup_ms >= 0) return;
+    stream_.setup_ms = (NowUs() - setup_us_) / 1000.0;
+    StartAudio();
+  }
+
+  // The handler of the start signal may run after the server is ready, and
+  // the audio must not be written before it
+  void StartAudio() {
+    if (!start_written_ || stream_.setup_ms < 0 || start_us_ > 0) return;
+    start_us_ = NowUs();
+    SendAudio();
+  }
+
+  void SendAudio() {
+    if (finished_) return;
+    auto self = shared_from_this();
+    const int num_samples = wave_.pcm.size();
+    if (offset_ >= num_samples) {
+      json::value end_tag = {{"signal", "end"}};
+      message_ = json::serialize(end_tag);
+      ws_.text(true);
+      end_us_ = NowUs();
+      ws_.async_write(asio::buffer(message_),
+                      [self](beast::error_code ec, size_t) {
+                        if (ec) self->Fail("end", ec);
+                      });
+      return;
+    }
+    const int n = std::min(chunk_samples_, num_samples - offset_);
+    ws_.binary(true);
+    last_send_us_ = NowUs();
+    ws_.async_write(
+        asio::buffer(wave_.pcm.data() + offset_, n * sizeof(int16_t)),
+        [self, n](beast::error_code ec, size_t) {
+          if (ec) return self->Fail("audio", ec);
+          self->offset_ += n;
+          self->ScheduleAudio();
+        });
+  }
+
+  // Send the next chunk when the audio sent so far is due
+  void ScheduleAudio() {
+    const double speed = generator_->opts_.speed;
+    if (speed <= 0) return SendAudio();
+    int64_t due_us = start_us_ + static_cast<int64_t>(
+        offset_ * 1e6 / wave_.sample_rate / speed);
+    timer_.expires_after(std::chrono::microseconds(due_us - NowUs()));
+    auto self = shared_from_this();
+    timer_.async_wait([self](beast::error_code ec) {
+      if (!ec) self->SendAudio();
+    });
+  }
+
+  void Read() {
+    auto self = shared_from_this();
+    ws_.async_read(buffer_, [self](beast::error_code ec, size_t) {
+      self->OnRead(ec);
+    });
+  }
+
+  void OnRead(beast::error_code ec) {
+    if (ec) {
+      if (stream_.ok) return Finish();
+      return Fail("read", ec);
+    }
+    const int64_t now_us = NowUs();
+    if (!ws_.got_text()) {
+      // The binary incremental partial results
+      OnPartialResult(now_us);
+    } else {
+      std::string message = beast::buffers_to_string(buffer_.data());
+      json::object obj = json::parse(message).as_object();
+      if (obj["status"] != "ok") {
+        LOG(WARNING) << wave_.key << " failed: " << message;
+        return Fail("status", beast::error_code());
+      }
+      if (obj["type"] == "server_ready") {
+        OnServerReady();
+      } else if (obj["type"] == "partial_result") {
+        OnPartialResult(now_us);
+      } else if (obj["type"] == "final_result") {
+        // The finals before the end signal are of the endpoints
+        if (end_us_ > 0 && stream_.final_ms < 0) {
+          stream_.final_ms = (now_us - end_us_) / 1000.0;
+        }
+      } else if (obj["type"] == "speech_end") {
+        stream_.ok = true;
+        auto self = shared_from_this();
+        ws_.async_close(websocket::close_code::normal,
+                        [self](beast::error_code) { self->Finish(); });
+        return;
+      }
+    }
+    buffer_.consume(buffer_.size());
+    Read();
+  }
+
+  void OnPartialResult(int64_t now_us) {
+    if (last_send_us_ == 0) return;
+    if (stream_.first_partial_ms < 0) {
+      stream_.first_partial_ms = (now_us - start_us_) / 1000.0;
+    }
+    stream_.partial_ms.push_back((now_us - last_send_us_) / 1000.0);
+  }
+
+  void Fail(const char* what, beast::error_code ec) {
+    if (finished_) return;
+    if (ec) {
+      LOG(WARNING) << wave_.key << " " << what << ": " << ec.message();
+    }
+    stream_.ok = false;
+    // The pending handlers fail with the socket closed
+    beast::error_code ignored;
+    ws_.next_layer().close(ignored);
+    Finish();
+  }
+
+  void Finish() {
+    if (finished_) return;
+    finished_ = true;
+    timer_.cancel();
+    generator_->OnStreamDone(stream_);
+  }
+
+  WebSocketLoadGenerator* generator_;
+  const LoadTestWave& wave_;
+  websocket::stream<tcp::socket> ws_;
+  asio::steady_timer timer_;
+  beast::flat_buffer buffer_;
+  // The text message being written
+  std::string message_;
+  int chunk_samples_ = 0;
+  int offset_ = 0;
+  int64_t setup_us_ = 0;
+  bool start_written_ = false;
+  // When the first audio is sent
+  int64_t start_us_ = 0;
+  int64_t last_send_us_ = 0;
+  int64_t end_us_ = 0;
+  bool finished_ = false;
+  LoadTestStream stream_;
+};
+
+WebSocketLoadGenerator::WebSocketLoadGenerator(const LoadTestOptions& opts,
+                                               std::vector<LoadTestWave> waves)
+    : LoadTest(opts, std::move(waves)) {}
+
+void WebSocketLoadGenerator::Run() {
+  tcp::resolver resolver(ioc_);
+  endpoints_ = resolver.resolve(opts_.hostname, std::to_string(opts_.port));
+  // The threads run the connections until the streams are done
+  auto work = asio::make_work_guard(ioc_);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < std::max(opts_.num_io_threads, 1); ++i) {
+    threads.emplace_back([this]() { ioc_.run(); });
+  }
+  LoadTest::Run();
+  work.reset();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ioc_.restart();
+}
+
+void WebSocketLoadGenerator::StartStream(const LoadTestWave& wave,
+                                         int stage) {
+  std::make_shared<Session>(this, wave, stage)->Start();
+}
+
+}  // namespace wenet
@@ -0,0 +1,54 @@
+// Copyright (c) 2022 Mobvoi Inc (Binbin Zhang)
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef WEBSOCKET_WEBSOCKET_LOAD_GENERATOR_H_
+#define WEBSOCKET_WEBSOCKET_LOAD_GENERATOR_H_
+
+#include <memory>
+#include <vector>
+
+#include "boost/asio/io_context.hpp"
+#include "boost/asio/ip/tcp.hpp"
+
+#include "utils/load_test.h"
+#include "utils/utils.h"
+
+namespace wenet {
+
+// WebSocketLoadGenerator streams the waves to a websocket server over many
+// asynchronous connections, all of them run on num_io_threads threads.
+class WebSocketLoadGenerator : public LoadTest {
+ public:
+  WebSocketLoadGenerator(const LoadTestOptions& opts,
+                         std::vector<LoadTestWave> waves);
+
+  void Run() override;
+
+ protected:
+  void StartStream(const LoadTestWave& wave, int stage) override;
+
+ private:
+  class Session;
+  friend class Session;
+
+  boost::asio::io_context ioc_;
+  boost::asio::ip::tcp::resolver::results_type endpoints_;
+
+ public:
+  WENET_DISALLOW_COPY_AND_ASSIGN(WebSocketLoadGenerator);
+};
+
+}  // namespace wenet
+
+#endif  // WEBSOCKET_WEBSOCKET_LOAD_GENERATOR_H_
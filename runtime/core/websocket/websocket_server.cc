@@ -14,12 +14,21 @@
 
 #include "websocket/websocket_server.h"
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <algorithm>
 #include <thread>
 #include <utility>
 #include <vector>
 
 #include "boost/json/src.hpp"
+#include "decoder/decode_metrics.h"
+#include "utils/async_log.h"
 #include "utils/log.h"
+#include "utils/string.h"
+#include "utils/thread_placement.h"
 
 namespace wenet {
 
@@ -31,77 +40,554 @@ using tcp = boost::asio::ip::tcp;        // from <boost/asio/ip/tcp.hpp>
 namespace json = boost::json;
 
 ConnectionHandler::ConnectionHandler(
-    tcp::socket&& socket, std::shared_ptr<FeaturePipelineConfig> feature_config,
+    tcp::socket&& socket, DecodeScheduler* scheduler,
+    std::shared_ptr<FeaturePipelineConfig> feature_config,
     std::shared_ptr<DecodeOptions> decode_config,
-    std::shared_ptr<DecodeResource> decode_resource)
+    std::shared_ptr<DecodeResource> decode_resource,
+    BatchTranscriber* transcriber,
+    std::shared_ptr<AsrDecoderPool> decoder_pool,
+    std::shared_ptr<ModelRegistry> model_registry)
     : ws_(std::move(socket)),
+      transcriber_(transcriber),
       feature_config_(std::move(feature_config)),
       decode_config_(std::move(decode_config)),
-      decode_resource_(std::move(decode_resource)) {}
+      decode_resource_(std::move(decode_resource)),
+      decoder_pool_(std::move(decoder_pool)),
+      model_registry_(std::move(model_registry)),
+      scheduler_(scheduler),
+      rescoring_session_(scheduler->NewSession()) {}
+
+ConnectionHandler::~ConnectionHandler() { OnStreamEnd(); }
+
+void ConnectionHandler::Start() {
+  // Run on the strand of the socket, as all the following I/O does
+  asio::dispatch(ws_.get_executor(), [self = shared_from_this()]() {
+    // Up to one hour of 16k 16 bits audio for the offline requests
+    self->parser_.body_limit(16000 * 2 * 3600);
+    http::async_read(self->ws_.next_layer(), self->buffer_, self->parser_,
+                     beast::bind_front_handler(&ConnectionHandler::OnHttpRead,
+                                               self));
+  });
+}
+
+void ConnectionHandler::OnHttpRead(beast::error_code ec,
+                                   std::size_t bytes_transferred) {
+  if (ec) {
+    LOG(INFO) << ec.message();
+    return;
+  }
+  if (websocket::is_upgrade(parser_.get())) {
+    ws_.async_accept(parser_.get(),
+                     beast::bind_front_handler(&ConnectionHandler::OnAccept,
+                                               shared_from_this()));
+  } else {
+    OnTranscribe(parser_.release());
+  }
+}
+
+// The integer value of key in the query of target, or default_value
+static int QueryInt(beast::string_view target, const std::string& key,
+                    int default_value) {
+  size_t pos = target.find('?');
+  if (pos == beast::string_view::npos) return default_value;
+  std::vector<std::string> params;
+  SplitStringToVector(std::string(target.substr(pos + 1)), "&", true,
+                      &params);
+  for (const std::string& param : params) {
+    if (param.compare(0, key.size() + 1, key + "=") == 0) {
+      try {
+        return std::stoi(param.substr(key.size() + 1));
+      } catch (const std::exception& e) {
+        return default_value;
+      }
+    }
+  }
+  return default_value;
+}
+
+void ConnectionHandler::OnTranscribe(
+    http::request<http::string_body>&& request) {
+  beast::string_view target = request.target();
+  beast::string_view path = target.substr(0, target.find('?'));
+  if (request.method() != http::verb::post || path != "/transcribe") {
+    WriteResponse(request.version(), http::status::not_found, "Not found");
+    return;
+  }
+  if (transcriber_ == nullptr) {
+    WriteResponse(request.version(), http::status::service_unavailable,
+                  "Offline transcription is disabled");
+    return;
+  }
+  int sample_rate = QueryInt(target, "sample_rate", 0);
+  nbest_ = std::max(QueryInt(target, "nbest", 1), 1);
+  auto audios = std::make_shared<std::vector<TranscribeAudio>>(1);
+  const std::string& body = request.body();
+  (*audios)[0].sample_rate = sample_rate;
+  (*audios)[0].pcm.resize(body.size() / sizeof(int16_t));
+  std::copy_n(body.data(), (*audios)[0].pcm.size() * sizeof(int16_t),
+              reinterpret_cast<char*>((*audios)[0].pcm.data()));
+  unsigned version = request.version();
+  // The results are serialized on the pool of the transcriber
+  transcriber_->TranscribeAsync(
+      audios, [self = shared_from_this(), version](
+                  const BatchTranscriber::Results& results) {
+        json::value rv = {{"status", "ok"},
+                          {"type", "final_result"},
+                          {"nbest", self->SerializeResult(results[0], true)}};
+        std::string body = json::serialize(rv);
+        LOG(INFO) << "Offline result: " << body;
+        asio::dispatch(self->ws_.get_executor(), [self, version, body]() {
+          self->WriteResponse(version, http::status::ok, body);
+        });
+      });
+}
+
+void ConnectionHandler::WriteResponse(unsigned version, http::status status,
+                                      const std::string& body) {
+  auto response = std::make_shared<http::response<http::string_body>>(
+      status, version);
+  response->keep_alive(false);
+  response->set(http::field::content_type,
+                 status == http::status::ok ? "application/json" :
+                                              "text/plain");
+  response->body() = body;
+  response->prepare_payload();
+  http::async_write(ws_.next_layer(), *response,
+                    [self = shared_from_this(), response](
+                        beast::error_code ec, std::size_t) {
+                      if (ec) {
+                        LOG(INFO) << ec.message();
+                      }
+                      self->ws_.next_layer().socket().shutdown(
+                          tcp::socket::shutdown_send, ec);
+                    });
+}
+
+void ConnectionHandler::OnAccept(beast::error_code ec) {
+  if (ec) {
+    LOG(INFO) << ec.message();
+    return;
+  }
+  if (session_recorder_ != nullptr) {
+    session_log_ = session_recorder_->NewSession();
+  }
+  DoRead();
+}
+
+void ConnectionHandler::DoRead() {
+  ws_.async_read(buffer_, beast::bind_front_handler(&ConnectionHandler::OnRead,
+                                                    shared_from_this()));
+}
+
+void ConnectionHandler::OnRead(beast::error_code ec,
+                               std::size_t bytes_transferred) {
+  if (ec) {
+    // websocket::error::closed indicates that the session was closed
+    LOG(INFO) << ec.message();
+    OnSpeechEnd();
+    return;
+  }
+  try {
+    if (ws_.got_text()) {
+      std::string message = beast::buffers_to_string(buffer_.data());
+      LOG(INFO) << message;
+      if (session_log_ != nullptr) {
+        session_log_->Write(SessionEvent::kText, message);
+      }
+      OnText(message);
+      if (got_end_tag_) {
+        LOG(INFO) << "Read all pcm data";
+        return;
+      }
+    } else {
+      if (!got_start_tag_) {
+        OnError("Start signal is expected before binary data");
+      } else if (shm_audio_) {
+        OnError("Binary data is not expected with the shm audio transport");
+      } else {
+        if (stop_recognition_) {
+          return;
+        }
+        if (session_log_ != nullptr) {
+          session_log_->Write(
+              SessionEvent::kAudio,
+              static_cast<const char*>(buffer_.data().data()),
+              buffer_.size());
+        }
+        OnSpeechData(buffer_);
+        buffer_.consume(buffer_.size());
+        // Stop reading until the decoding catches up, the space callback
+        // reads on then
+        if (!feature_pipeline_->PollSpace()) {
+          VLOG(2) << "Pause reading, the feature queue is full";
+          return;
+        }
+      }
+    }
+  } catch (std::exception const& e) {
+    LOG(ERROR) << e.what();
+    OnSpeechEnd();
+    return;
+  }
+  buffer_.consume(buffer_.size());
+  DoRead();
+}
 
 void ConnectionHandler::OnSpeechStart() {
   LOG(INFO) << "Received speech start signal, start reading speech";
+  if (shm_audio_) {
+    int sample_rate =
+        sample_rate_ > 0 ? sample_rate_ : feature_config_->sample_rate;
+    ring_ = ShmAudioRing::Create(shm_broker_->RingSamples(sample_rate));
+    if (ring_ == nullptr) {
+      OnError("Failed to create the shared memory audio ring");
+      return;
+    }
+  }
+  DecodeOptions decode_config = *decode_config_;
+  if (decode_resource_->admission_controller != nullptr) {
+    admission_ = decode_resource_->admission_controller->Enter();
+    if (admission_ == Admission::kRejected) {
+      json::value rv = {{"status", "failed"},
+                        {"type", "server_busy"},
+                        {"message", "Server is overloaded, retry later"}};
+      WriteText(json::serialize(rv), true);
+      return;
+    } else if (admission_ == Admission::kDegraded) {
+      VLOG(1) << "Decode with the degraded profile";
+      DegradeDecodeOptions(&decode_config);
+    }
+  }
+  if (lattice_) {
+    decode_config.ctc_wfst_search_opts.output_lattice = true;
+  }
   got_start_tag_ = true;
-  json::value rv = {{"status", "ok"}, {"type", "server_ready"}};
-  ws_.text(true);
-  ws_.write(asio::buffer(json::serialize(rv)));
-  feature_pipeline_ = std::make_shared<FeaturePipeline>(*feature_config_);
-  decoder_ = std::make_shared<AsrDecoder>(
-      feature_pipeline_, decode_resource_, *decode_config_);
-  // Start decoder thread
-  decode_thread_ =
-      std::make_shared<std::thread>(&ConnectionHandler::DecodeThreadFunc, this);
+  stream_active_ = true;
+  DecodeMetrics::Get()->active_sessions->Add(1);
+  partial_filter_.reset(new PartialResultFilter(partial_opts_));
+  timer_.Reset();
+  json::object rv = {{"status", "ok"}, {"type", "server_ready"}};
+  if (ring_ != nullptr) {
+    rv.emplace("shm_token", shm_broker_->Register(ring_));
+  }
+  WriteText(json::serialize(rv));
+  // The pool is of the default model, of the version when it's created
+  if (decoder_pool_ != nullptr && admission_ != Admission::kDegraded &&
+      decoder_pool_->resource() == decode_resource_ &&
+      (!lattice_ || decode_config_->ctc_wfst_search_opts.output_lattice)) {
+    PooledDecoder pooled = decoder_pool_->Acquire();
+    feature_pipeline_ = std::move(pooled.feature_pipeline);
+    decoder_ = std::move(pooled.decoder);
+  } else {
+    feature_pipeline_ = std::make_shared<FeaturePipeline>(*feature_config_);
+    decoder_ = std::make_shared<AsrDecoder>(feature_pipeline_,
+                                            decode_resource_, decode_config);
+  }
+  // Only the N-best the client asked for are built for the partial results
+  decoder_->set_partial_nbest(nbest_);
+  // The compressed audio is decoded at the sample rate of the feature config
+  if (sample_rate_ > 0 && audio_decoder_ == nullptr) {
+    feature_pipeline_->set_input_sample_rate(sample_rate_);
+  }
+  std::weak_ptr<ConnectionHandler> handler = shared_from_this();
+  feature_pipeline_->set_space_callback([handler]() {
+    if (auto self = handler.lock()) {
+      asio::dispatch(self->ws_.get_executor(), [self]() {
+        if (self->shm_audio_) {
+          self->DrainRing();
+        } else {
+          self->DoRead();
+        }
+      });
+    }
+  });
+  // The session holds the handler until the decoding is done
+  decode_session_ = scheduler_->NewSession(
+      [self = shared_from_this()]() { return self->DecodeAvailable(); },
+      decode_class_);
+  std::weak_ptr<DecodeScheduler::Session> session = decode_session_;
+  feature_pipeline_->set_ready_callback([session]() {
+    if (auto s = session.lock()) s->Notify();
+  });
+  decode_session_->Notify();
+  if (ring_ != nullptr) {
+#ifndef _WIN32
+    doorbell_.reset(new asio::posix::stream_descriptor(
+        ws_.get_executor(), dup(ring_->doorbell_fd())));
+#endif
+    DrainRing();
+  }
 }
 
 void ConnectionHandler::OnSpeechEnd() {
   LOG(INFO) << "Received speech end signal";
-  if (feature_pipeline_ != nullptr) {
+  if (ring_ != nullptr) {
+    // After the samples in the ring
+    ring_end_ = true;
+    DrainRing();
+    return;
+  }
+  FinishInput();
+}
+
+void ConnectionHandler::FinishInput() {
+  if (feature_pipeline_ != nullptr && !got_end_tag_) {
+    end_timer_.Reset();
     feature_pipeline_->set_input_finished();
   }
   got_end_tag_ = true;
 }
 
+void ConnectionHandler::DrainRing() {
+  if (ring_ == nullptr) return;
+  if (stop_recognition_) {
+    CloseRing();
+    return;
+  }
+  const int16_t* samples = nullptr;
+  size_t num_samples = 0;
+  while ((num_samples = ring_->Peek(&samples)) > 0) {
+    if (!got_audio_) {
+      got_audio_ = true;
+      audio_timer_.Reset();
+    }
+    if (session_log_ != nullptr) {
+      session_log_->Write(SessionEvent::kAudio,
+                          reinterpret_cast<const char*>(samples),
+                          num_samples * sizeof(int16_t));
+    }
+    // Framed in place, the samples are released after it
+    feature_pipeline_->AcceptWaveform(samples, num_samples);
+    ring_->Consume(num_samples);
+    // The space callback drains on
+    if (!feature_pipeline_->PollSpace()) {
+      VLOG(2) << "Pause draining the ring, the feature queue is full";
+      return;
+    }
+  }
+  if (ring_->Finished() || ring_end_) {
+    CloseRing();
+    FinishInput();
+  } else {
+    WaitDoorbell();
+  }
+}
+
+void ConnectionHandler::WaitDoorbell() {
+#ifndef _WIN32
+  if (doorbell_waiting_) return;
+  doorbell_waiting_ = true;
+  doorbell_->async_wait(
+      asio::posix::stream_descriptor::wait_read,
+      [self = shared_from_this()](beast::error_code ec) {
+        self->doorbell_waiting_ = false;
+        // Aborted or closed by CloseRing()
+        if (ec || self->ring_ == nullptr) return;
+        self->ring_->ClearDoorbell();
+        self->DrainRing();
+      });
+#endif
+}
+
+void ConnectionHandler::CloseRing() {
+#ifndef _WIN32
+  beast::error_code ec;
+  doorbell_->close(ec);
+#endif
+  ring_ = nullptr;
+}
+
 void ConnectionHandler::OnPartialResult(const std::string& result) {
-  LOG(INFO) << "Partial result: " << result;
+  LOG_EVERY_MS(INFO, 1000) << "Partial result: " << result;
   json::value rv = {
       {"status", "ok"}, {"type", "partial_result"}, {"nbest", result}};
-  ws_.text(true);
-  ws_.write(asio::buffer(json::serialize(rv)));
+  WriteText(json::serialize(rv), false, true);
 }
 
-void ConnectionHandler::OnFinalResult(const std::string& result) {
+void ConnectionHandler::MaybePartialResult() {
+  const std::vector<DecodeResult>& results = decoder_->result();
+  const std::string& sentence = results.empty() ? "" : results[0].sentence;
+  int num_stable = 0;
+  std::string suffix;
+  if (!partial_filter_->Filter(sentence, timer_.Elapsed(), &num_stable,
+                               &suffix)) {
+    return;
+  }
+  if (!first_partial_sent_) {
+    first_partial_sent_ = true;
+    DecodeMetrics::Get()->first_partial_ms->Observe(
+        audio_timer_.ElapsedUs() / 1000.0);
+  }
+  if (partial_opts_.incremental) {
+    RecordResult(ResultType::kPartialResult, sentence);
+    // The text is the first num_stable chars of the last one plus suffix
+    VLOG(1) << "Partial result: " << num_stable << " + " << suffix;
+    if (binary_result_) {
+      std::string message;
+      EncodeIncrementalResult(num_stable, suffix, &message);
+      WriteBinary(message);
+    } else {
+      json::value rv = {{"status", "ok"},
+                        {"type", "partial_result"},
+                        {"stable", num_stable},
+                        {"suffix", suffix}};
+      WriteText(json::serialize(rv));
+    }
+  } else {
+    SendResult(ResultType::kPartialResult, false);
+  }
+}
+
+void ConnectionHandler::OnFinalResult(const std::string& result,
+                                      const std::string& lattice) {
   LOG(INFO) << "Final result: " << result;
-  json::value rv = {
+  json::object rv = {
       {"status", "ok"}, {"type", "final_result"}, {"nbest", result}};
-  ws_.text(true);
-  ws_.write(asio::buffer(json::serialize(rv)));
+  if (lattice_) {
+    rv.emplace("lattice", Base64Encode(lattice));
+  }
+  WriteText(json::serialize(rv));
+}
+
+void ConnectionHandler::OnFinalCtcResult(const std::string& result) {
+  LOG(INFO) << "Final ctc result: " << result;
+  json::value rv = {
+      {"status", "ok"}, {"type", "final_ctc"}, {"nbest", result}};
+  WriteText(json::serialize(rv));
 }
 
 void ConnectionHandler::OnFinish() {
+  if (end_of_input_) {
+    DecodeMetrics::Get()->final_ms->Observe(end_timer_.ElapsedUs() / 1000.0);
+  }
+  RecordResult(ResultType::kSpeechEnd, "");
   // Send finish tag
   json::value rv = {{"status", "ok"}, {"type", "speech_end"}};
-  ws_.text(true);
-  ws_.write(asio::buffer(json::serialize(rv)));
+  WriteText(json::serialize(rv));
 }
 
 void ConnectionHandler::OnSpeechData(const beast::flat_buffer& buffer) {
+  CHECK(feature_pipeline_ != nullptr);
+  CHECK(decoder_ != nullptr);
+  if (!got_audio_) {
+    got_audio_ = true;
+    audio_timer_.Reset();
+  }
+  if (audio_decoder_ != nullptr) {
+    // Each binary message is one compressed packet
+    pcm_.clear();
+    if (!audio_decoder_->Decode(
+            static_cast<const char*>(buffer.data().data()), buffer.size(),
+            &pcm_)) {
+      OnError("Failed to decode the " + codec_ + " packet");
+      return;
+    }
+    VLOG(2) << "Decoded " << pcm_.size() << " samples";
+    feature_pipeline_->AcceptWaveform(pcm_.data(), pcm_.size());
+    return;
+  }
   // Read binary PCM data
   int num_samples = buffer.size() / sizeof(int16_t);
-  std::vector<float> pcm_data(num_samples);
   const int16_t* pdata = static_cast<const int16_t*>(buffer.data().data());
-  for (int i = 0; i < num_samples; i++) {
-    pcm_data[i] = static_cast<float>(*pdata);
-    pdata++;
-  }
   VLOG(2) << "Received " << num_samples << " samples";
-  CHECK(feature_pipeline_ != nullptr);
-  CHECK(decoder_ != nullptr);
-  feature_pipeline_->AcceptWaveform(pcm_data);
+  feature_pipeline_->AcceptWaveform(pdata, num_samples);
+}
+
+void ConnectionHandler::WriteText(const std::string& message, bool close,
+                                  bool partial) {
+  Write(message, true, close, partial);
+}
+
+void ConnectionHandler::WriteBinary(const std::string& message,
+                                    bool partial) {
+  Write(message, false, false, partial);
+}
+
+void ConnectionHandler::Write(const std::string& message, bool text,
+                              bool close, bool partial) {
+  asio::dispatch(
+      ws_.get_executor(),
+      [self = shared_from_this(), message, text, close, partial]() {
+        auto& queue = self->write_queue_;
+        self->close_after_write_ |= close;
+        // The front one is being written, the queued one after it is not
+        if (partial && queue.size() > 1 && queue.back().partial &&
+            queue.back().text == text) {
+          queue.back().data = message;
+          DecodeMetrics::Get()->coalesced_partials->Add(1);
+          return;
+        }
+        queue.push_back({message, text, partial});
+        // Or it's written after the previous one
+        if (queue.size() == 1) self->DoWrite();
+      });
+}
+
+void ConnectionHandler::DoWrite() {
+  ws_.text(write_queue_.front().text);
+  ws_.async_write(asio::buffer(write_queue_.front().data),
+                  beast::bind_front_handler(&ConnectionHandler::OnWrite,
+                                            shared_from_this()));
+}
+
+void ConnectionHandler::OnWrite(beast::error_code ec,
+                                std::size_t bytes_transferred) {
+  if (ec) {
+    LOG(INFO) << ec.message();
+    write_queue_.clear();
+    return;
+  }
+  write_queue_.pop_front();
+  if (!write_queue_.empty()) {
+    DoWrite();
+  } else if (close_after_write_) {
+    // The pending read fails then, which ends the session
+    ws_.async_close(websocket::close_code::normal,
+                    [self = shared_from_this()](beast::error_code ec) {
+                      if (ec) LOG(INFO) << ec.message();
+                    });
+  }
+}
+
+void ConnectionHandler::SendResult(ResultType type, bool finish) {
+  SendResult(type, decoder_->result(), finish, decoder_->lattice());
+}
+
+void ConnectionHandler::SendResult(ResultType type,
+                                   const std::vector<DecodeResult>& results,
+                                   bool finish, const std::string& lattice) {
+  RecordResult(type, results.empty() ? "" : results[0].sentence);
+  if (binary_result_) {
+    std::string message;
+    EncodeResult(type, results, nbest_, finish, &message);
+    if (lattice_ && type == ResultType::kFinalResult) {
+      AppendLattice(lattice, &message);
+    }
+    WriteBinary(message, type == ResultType::kPartialResult);
+    return;
+  }
+  std::string result = SerializeResult(results, finish);
+  if (type == ResultType::kPartialResult) {
+    OnPartialResult(result);
+  } else if (type == ResultType::kFinalResult) {
+    OnFinalResult(result, lattice);
+  } else {
+    OnFinalCtcResult(result);
+  }
+}
+
+void ConnectionHandler::RecordResult(ResultType type,
+                                     const std::string& sentence) {
+  if (session_log_ == nullptr) return;
+  std::string data(1, static_cast<char>(type));
+  data += sentence;
+  session_log_->Write(SessionEvent::kResult, data);
 }
 
-std::string ConnectionHandler::SerializeResult(bool finish) {
+std::string ConnectionHandler::SerializeResult(
+    const std::vector<DecodeResult>& results, bool finish) {
   json::array nbest;
-  for (const DecodeResult& path : decoder_->result()) {
+  for (const DecodeResult& path : results) {
     json::object jpath({{"sentence", path.sentence}});
     if (finish) {
       json::array word_pieces;
@@ -109,6 +595,13 @@ std::string ConnectionHandler::SerializeResult(bool finish) {
         json::object jword_piece({{"word", word_piece.word},
                                   {"start", word_piece.start},
                                   {"end", word_piece.end}});
+        if (word_piece.confidence.max > 0) {
+          jword_piece.emplace(
+              "confidence",
+              json::object({{"max", word_piece.confidence.max},
+                            {"mean", word_piece.confidence.mean},
+                            {"min", word_piece.confidence.min}}));
+        }
         word_pieces.emplace_back(jword_piece);
       }
       jpath.emplace("word_pieces", word_pieces);
@@ -122,48 +615,116 @@ std::string ConnectionHandler::SerializeResult(bool finish) {
   return json::serialize(nbest);
 }
 
-void ConnectionHandler::DecodeThreadFunc() {
-  try {
-    while (true) {
-      DecodeState state = decoder_->Decode();
-      if (state == DecodeState::kEndFeats) {
+void ConnectionHandler::AsyncRescoring() {
+  decoder_->FinalizeFirstPass();
+  SendResult(ResultType::kFinalCtcResult, true);
+  std::shared_ptr<PendingRescoring> pending = decoder_->DetachRescoring();
+  rescoring_session_->Post([self = shared_from_this(), pending]() {
+    try {
+      self->decoder_->Rescoring(pending.get());
+      self->SendResult(ResultType::kFinalResult, pending->result, true,
+                       pending->lattice);
+    } catch (std::exception const& e) {
+      LOG(ERROR) << e.what();
+    }
+  });
+}
+
+void ConnectionHandler::Finish() {
+  if (async_rescoring_) {
+    rescoring_session_->Post(
+        [self = shared_from_this()]() { self->OnFinish(); });
+  } else {
+    OnFinish();
+  }
+}
+
+bool ConnectionHandler::DecodeAvailable() {
+  while (true) {
+    DecodeState state = decoder_->Decode(false);
+    if (state == DecodeState::kWaitFeats) {
+      return true;
+    } else if (state == DecodeState::kEndFeats) {
+      if (async_rescoring_) {
+        AsyncRescoring();
+      } else {
         decoder_->Rescoring();
-        std::string result = SerializeResult(true);
-        OnFinalResult(result);
-        OnFinish();
-        stop_recognition_ = true;
-        break;
-      } else if (state == DecodeState::kEndpoint) {
+        SendResult(ResultType::kFinalResult, true);
+      }
+      end_of_input_ = true;
+      Finish();
+      stop_recognition_ = true;
+      OnStreamEnd();
+      return false;
+    } else if (state == DecodeState::kEndpoint) {
+      if (async_rescoring_) {
+        AsyncRescoring();
+      } else {
         decoder_->Rescoring();
-        std::string result = SerializeResult(true);
-        OnFinalResult(result);
-        // If it's not continuous decoidng, continue to do next recognition
-        // otherwise stop the recognition
-        if (continuous_decoding_) {
-          decoder_->ResetContinuousDecoding();
-        } else {
-          OnFinish();
-          stop_recognition_ = true;
-          break;
-        }
+        SendResult(ResultType::kFinalResult, true);
+      }
+      // If it's not continuous decoidng, continue to do next recognition
+      // otherwise stop the recognition
+      if (continuous_decoding_) {
+        decoder_->ResetContinuousDecoding();
+        partial_filter_->Reset();
       } else {
-        if (decoder_->DecodedSomething()) {
-          std::string result = SerializeResult(false);
-          OnPartialResult(result);
-        }
+        Finish();
+        stop_recognition_ = true;
+        OnStreamEnd();
+        return false;
+      }
+    } else {
+      if (decoder_->DecodedSomething()) {
+        MaybePartialResult();
       }
     }
-  } catch (std::exception const& e) {
-    LOG(ERROR) << e.what();
   }
 }
 
+void ConnectionHandler::OnStreamEnd() {
+  if (!stream_active_) return;
+  stream_active_ = false;
+  DecodeMetrics* metrics = DecodeMetrics::Get();
+  metrics->active_sessions->Add(-1);
+  if (decoder_->decoded_audio_ms() > 0) {
+    metrics->stream_rtf->Observe(
+        static_cast<double>(decoder_->decoding_time_ms()) /
+        decoder_->decoded_audio_ms());
+  }
+  LeaveAdmission();
+}
+
+void ConnectionHandler::LeaveAdmission() {
+  if (admission_ == Admission::kRejected) return;
+  decode_resource_->admission_controller->Leave(
+      admission_, decoder_->decoded_audio_ms(), decoder_->decoding_time_ms());
+  admission_ = Admission::kRejected;
+}
+
 void ConnectionHandler::OnError(const std::string& message) {
   json::value rv = {{"status", "failed"}, {"message", message}};
-  ws_.text(true);
-  ws_.write(asio::buffer(json::serialize(rv)));
-  // Close websocket
-  ws_.close(websocket::close_code::normal);
+  // Close websocket after the message is sent
+  WriteText(json::serialize(rv), true);
+}
+
+static bool ParseContexts(const json::value& value,
+                          std::vector<std::string>* contexts) {
+  if (!value.is_array()) return false;
+  for (const json::value& context : value.as_array()) {
+    if (!context.is_string()) return false;
+    contexts->emplace_back(context.as_string().c_str());
+  }
+  return true;
+}
+
+void ConnectionHandler::OnContexts(const std::vector<std::string>& contexts) {
+  if (decode_resource_->context_graph_cache == nullptr) {
+    OnError("contexts option is not enabled, see --context_cache_size");
+    return;
+  }
+  decoder_->SetContextGraph(
+      decode_resource_->context_graph_cache->Get(contexts));
 }
 
 void ConnectionHandler::OnText(const std::string& message) {
@@ -189,9 +750,153 @@ void ConnectionHandler::OnText(const std::string& message) {
                 "continuous_decoding option");
           }
         }
+        if (obj.find("async_rescoring") != obj.end()) {
+          if (obj["async_rescoring"].is_bool()) {
+            async_rescoring_ = obj["async_rescoring"].as_bool();
+          } else {
+            OnError(
+                "boolean true or false is expected for "
+                "async_rescoring option");
+          }
+        }
+        if (obj.find("partial_interval_ms") != obj.end()) {
+          if (obj["partial_interval_ms"].is_int64() &&
+              obj["partial_interval_ms"].as_int64() >= 0) {
+            partial_opts_.min_interval_ms =
+                obj["partial_interval_ms"].as_int64();
+          } else {
+            OnError(
+                "non-negative integer is expected for "
+                "partial_interval_ms option");
+          }
+        }
+        if (obj.find("partial_changed_only") != obj.end()) {
+          if (obj["partial_changed_only"].is_bool()) {
+            partial_opts_.changed_only =
+                obj["partial_changed_only"].as_bool();
+          } else {
+            OnError(
+                "boolean true or false is expected for "
+                "partial_changed_only option");
+          }
+        }
+        if (obj.find("partial_incremental") != obj.end()) {
+          if (obj["partial_incremental"].is_bool()) {
+            partial_opts_.incremental = obj["partial_incremental"].as_bool();
+          } else {
+            OnError(
+                "boolean true or false is expected for "
+                "partial_incremental option");
+          }
+        }
+        if (obj.find("result_format") != obj.end()) {
+          if (obj["result_format"] == "json" ||
+              obj["result_format"] == "proto") {
+            binary_result_ = obj["result_format"] == "proto";
+          } else {
+            OnError("\"json\" or \"proto\" is expected for "
+                    "result_format option");
+          }
+        }
+        if (obj.find("lattice") != obj.end()) {
+          if (obj["lattice"].is_bool()) {
+            lattice_ = obj["lattice"].as_bool();
+          } else {
+            OnError("boolean true or false is expected for lattice option");
+          }
+        }
+        if (obj.find("sample_rate") != obj.end()) {
+          if (obj["sample_rate"].is_int64() &&
+              obj["sample_rate"].as_int64() > 0) {
+            sample_rate_ = obj["sample_rate"].as_int64();
+          } else {
+            OnError("positive integer is expected for sample_rate option");
+          }
+        }
+        if (obj.find("codec") != obj.end()) {
+          if (obj["codec"].is_string()) {
+            codec_ = obj["codec"].as_string().c_str();
+          } else {
+            OnError("string is expected for codec option");
+          }
+        }
+        if (obj.find("audio_transport") != obj.end()) {
+          if (obj["audio_transport"] == "websocket" ||
+              obj["audio_transport"] == "shm") {
+            shm_audio_ = obj["audio_transport"] == "shm";
+          } else {
+            OnError("\"websocket\" or \"shm\" is expected for "
+                    "audio_transport option");
+          }
+          if (shm_audio_ && (shm_broker_ == nullptr || codec_ != "pcm")) {
+            OnError("The shm audio transport needs --shm_socket and the "
+                    "pcm codec");
+            return;
+          }
+        }
+        // The decoding runs of the session are scheduled by them, with
+        // --fair_scheduling
+        if (obj.find("tenant") != obj.end()) {
+          if (obj["tenant"].is_string()) {
+            decode_class_.tenant = obj["tenant"].as_string().c_str();
+          } else {
+            OnError("string is expected for tenant option");
+          }
+        }
+        if (obj.find("priority") != obj.end()) {
+          if (obj["priority"] == "interactive" || obj["priority"] == "batch") {
+            decode_class_.priority = obj["priority"] == "batch"
+                                         ? DecodePriority::kBatch
+                                         : DecodePriority::kInteractive;
+          } else {
+            OnError("\"interactive\" or \"batch\" is expected for "
+                    "priority option");
+          }
+        }
+        if (model_registry_ != nullptr) {
+          std::string model;
+          if (obj.find("model") != obj.end()) {
+            if (!obj["model"].is_string()) {
+              OnError("string is expected for model option");
+              return;
+            }
+            model = obj["model"].as_string().c_str();
+          }
+          // The current version of the model, or the default model
+          decode_resource_ = model_registry_->Get(model);
+          if (decode_resource_ == nullptr) {
+            OnError("Unknown model " + model);
+            return;
+          }
+        }
+        if (codec_ != "pcm") {
+          audio_decoder_ =
+              CreateAudioDecoder(codec_, feature_config_->sample_rate);
+          if (audio_decoder_ == nullptr) {
+            OnError("Unsupported codec " + codec_);
+            return;
+          }
+        }
+        std::vector<std::string> contexts;
+        if (obj.find("contexts") != obj.end() &&
+            !ParseContexts(obj["contexts"], &contexts)) {
+          OnError("array of strings is expected for contexts option");
+        }
         OnSpeechStart();
+        if (got_start_tag_ && !contexts.empty()) {
+          OnContexts(contexts);
+        }
       } else if (signal == "end") {
         OnSpeechEnd();
+      } else if (signal == "contexts" && got_start_tag_) {
+        // Replace the contexts mid-stream, from the next sentence on
+        std::vector<std::string> contexts;
+        if (obj.find("contexts") == obj.end() ||
+            !ParseContexts(obj["contexts"], &contexts)) {
+          OnError("array of strings is expected for contexts option");
+        } else {
+          OnContexts(contexts);
+        }
       } else {
         OnError("Unexpected signal type");
       }
@@ -203,70 +908,120 @@ void ConnectionHandler::OnText(const std::string& message) {
   }
 }
 
-void ConnectionHandler::operator()() {
-  try {
-    // Accept the websocket handshake
-    ws_.accept();
-    for (;;) {
-      // This buffer will hold the incoming message
-      beast::flat_buffer buffer;
-      // Read a message
-      ws_.read(buffer);
-      if (ws_.got_text()) {
-        std::string message = beast::buffers_to_string(buffer.data());
-        LOG(INFO) << message;
-        OnText(message);
-        if (got_end_tag_) {
-          break;
-        }
-      } else {
-        if (!got_start_tag_) {
-          OnError("Start signal is expected before binary data");
-        } else {
-          if (stop_recognition_) {
-            break;
-          }
-          OnSpeechData(buffer);
-        }
-      }
-    }
-
-    LOG(INFO) << "Read all pcm data, wait for decoding thread";
-    if (decode_thread_ != nullptr) {
-      decode_thread_->join();
-    }
-  } catch (beast::system_error const& se) {
-    LOG(INFO) << se.code().message();
-    // This indicates that the session was closed
-    if (se.code() == websocket::error::closed) {
-      OnSpeechEnd();
-    }
-    if (decode_thread_ != nullptr) {
-      decode_thread_->join();
+WebSocketServer::WebSocketServer(
+    int port, std::shared_ptr<FeaturePipelineConfig> feature_config,
+    std::shared_ptr<DecodeOptions> decode_config,
+    std::shared_ptr<DecodeResource> decode_resource, int num_io_threads,
+    int num_decode_threads, const BatchTranscribeOptions& transcribe_opts,
+    std::shared_ptr<AsrDecoderPool> decoder_pool,
+    std::shared_ptr<ModelRegistry> model_registry,
+    const AcceptorOptions& acceptor_opts)
+    : port_(port),
+      num_io_threads_(std::max(num_io_threads, 1)),
+      num_decode_threads_(num_decode_threads),
+      transcribe_opts_(transcribe_opts),
+      feature_config_(std::move(feature_config)),
+      decode_config_(std::move(decode_config)),
+      decode_resource_(std::move(decode_resource)),
+      decoder_pool_(std::move(decoder_pool)),
+      model_registry_(std::move(model_registry)) {
+  int num_acceptors = std::max(acceptor_opts.num_acceptors, 1);
+  const std::vector<int>& cpus = acceptor_opts.cpus;
+  for (int i = 0; i < num_acceptors; ++i) {
+    shards_.emplace_back(new Shard(num_io_threads_));
+    // Acceptor i takes the cpus [begin, end), or one of them if there are
+    // fewer cpus than acceptors
+    if (!cpus.empty()) {
+      size_t begin = i * cpus.size() / num_acceptors;
+      size_t end = (i + 1) * cpus.size() / num_acceptors;
+      end = std::max(end, begin + 1);
+      shards_.back()->cpus.assign(cpus.begin() + begin, cpus.begin() + end);
     }
-  } catch (std::exception const& e) {
-    LOG(ERROR) << e.what();
   }
 }
 
 void WebSocketServer::Start() {
   try {
     auto const address = asio::ip::make_address("0.0.0.0");
-    tcp::acceptor acceptor{ioc_, {address, static_cast<uint16_t>(port_)}};
-    for (;;) {
-      // This will receive the new connection
-      tcp::socket socket{ioc_};
-      // Block until we get a connection
-      acceptor.accept(socket);
-      // Launch the session, transferring ownership of the socket
-      ConnectionHandler handler(std::move(socket), feature_config_,
-                                decode_config_, decode_resource_);
-      std::thread t(std::move(handler));
-      t.detach();
+    tcp::endpoint endpoint{address, static_cast<uint16_t>(port_)};
+    for (auto& shard : shards_) {
+      shard->acceptor.open(endpoint.protocol());
+      shard->acceptor.set_option(asio::socket_base::reuse_address(true));
+      if (shards_.size() > 1) {
+#ifdef SO_REUSEPORT
+        using reuse_port =
+            asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+        shard->acceptor.set_option(reuse_port(true));
+#else
+        LOG(FATAL) << "SO_REUSEPORT is required for multiple acceptors";
+#endif
+      }
+      shard->acceptor.bind(endpoint);
+      shard->acceptor.listen(asio::socket_base::max_listen_connections);
+    }
+    if (!shm_socket_.empty()) {
+      shm_broker_.reset(new ShmRingBroker(&shards_[0]->ioc, shm_socket_,
+                                          shm_ring_seconds_));
+      shm_broker_->Start();
     }
   } catch (const std::exception& e) {
     LOG(FATAL) << e.what();
   }
+  // The decode workers are pinned by the thread placement once, since the
+  // sessions share them
+  scheduler_.reset(new DecodeScheduler(num_decode_threads_,
+                                       decode_resource_->thread_placement));
+  if (fair_scheduling_) {
+    scheduler_->EnableFairQueueing(tenant_weights_);
+  }
+  SetQueueMetrics(scheduler_.get(), decode_resource_->encoder_scheduler);
+  if (transcribe_opts_.max_batch_size > 0) {
+    transcriber_.reset(new BatchTranscriber(feature_config_, decode_config_,
+                                            decode_resource_,
+                                            transcribe_opts_));
+  }
+  LOG(INFO) << shards_.size() << " acceptors, " << num_io_threads_
+            << " io threads each, " << scheduler_->num_workers()
+            << " decode threads";
+
+  std::vector<std::thread> threads;
+  for (auto& shard : shards_) {
+    DoAccept(shard.get());
+    Shard* s = shard.get();
+    for (int i = 0; i < num_io_threads_; ++i) {
+      threads.emplace_back([s]() {
+        if (!s->cpus.empty()) {
+          PinThread(s->cpus);
+        }
+        s->ioc.run();
+      });
+    }
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+void WebSocketServer::DoAccept(Shard* shard) {
+  // Each connection has its own strand on the io_context of the acceptor
+  shard->acceptor.async_accept(
+      asio::make_strand(shard->ioc),
+      beast::bind_front_handler(&WebSocketServer::OnAccept, this, shard));
+}
+
+void WebSocketServer::OnAccept(Shard* shard, beast::error_code ec,
+                               tcp::socket socket) {
+  if (ec) {
+    LOG(ERROR) << ec.message();
+  } else {
+    auto handler = std::make_shared<ConnectionHandler>(
+        std::move(socket), scheduler_.get(), feature_config_, decode_config_,
+        decode_resource_, transcriber_.get(), decoder_pool_, model_registry_);
+    handler->set_session_recorder(session_recorder_);
+    handler->set_shm_broker(shm_broker_.get());
+    handler->Start();
+  }
+  DoAccept(shard);
 }
 
 }  // namespace wenet
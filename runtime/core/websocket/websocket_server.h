@@ -15,20 +15,40 @@
 #ifndef WEBSOCKET_WEBSOCKET_SERVER_H_
 #define WEBSOCKET_WEBSOCKET_SERVER_H_
 
+#include <atomic>
+#include <deque>
 #include <iostream>
 #include <memory>
 #include <string>
-#include <thread>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "boost/asio/connect.hpp"
+#include "boost/asio/dispatch.hpp"
 #include "boost/asio/ip/tcp.hpp"
+#ifndef _WIN32
+#include "boost/asio/posix/stream_descriptor.hpp"
+#endif
+#include "boost/asio/strand.hpp"
 #include "boost/beast/core.hpp"
+#include "boost/beast/http.hpp"
 #include "boost/beast/websocket.hpp"
 
 #include "decoder/asr_decoder.h"
+#include "decoder/asr_decoder_pool.h"
+#include "decoder/batch_transcriber.h"
+#include "decoder/decode_scheduler.h"
+#include "decoder/model_registry.h"
+#include "decoder/partial_result_filter.h"
+#include "decoder/result_encoder.h"
+#include "frontend/audio_decoder.h"
 #include "frontend/feature_pipeline.h"
 #include "utils/log.h"
+#include "utils/session_log.h"
+#include "utils/shm_audio_ring.h"
+#include "utils/timer.h"
+#include "websocket/shm_ring_broker.h"
 
 namespace wenet {
 
@@ -38,62 +58,267 @@ namespace websocket = beast::websocket;  // from <boost/beast/websocket.hpp>
 namespace asio = boost::asio;            // from <boost/asio.hpp>
 using tcp = boost::asio::ip::tcp;        // from <boost/asio/ip/tcp.hpp>
 
-class ConnectionHandler {
+// One websocket session. All the socket I/O is asynchronous and runs on
+// the strand of the socket, the decoding runs in a session of the shared
+// DecodeScheduler by Decode(false), which returns whenever the features are
+// not enough for the next chunk, the session is notified by the feature
+// pipeline when they are.
+// A plain HTTP "POST /transcribe" instead of the websocket upgrade is an
+// offline request, the body is the raw 16 bits PCM of the whole audio, which
+// is decoded by the BatchTranscriber with full context.
+class ConnectionHandler
+    : public std::enable_shared_from_this<ConnectionHandler> {
  public:
-  ConnectionHandler(tcp::socket&& socket,
+  ConnectionHandler(tcp::socket&& socket, DecodeScheduler* scheduler,
                     std::shared_ptr<FeaturePipelineConfig> feature_config,
                     std::shared_ptr<DecodeOptions> decode_config,
-                    std::shared_ptr<DecodeResource> decode_resource_);
-  void operator()();
+                    std::shared_ptr<DecodeResource> decode_resource_,
+                    BatchTranscriber* transcriber = nullptr,
+                    std::shared_ptr<AsrDecoderPool> decoder_pool = nullptr,
+                    std::shared_ptr<ModelRegistry> model_registry = nullptr);
+  ~ConnectionHandler();
+  void Start();
+  // Optional, log the messages and the results of the websocket session by
+  // it, set before Start()
+  void set_session_recorder(std::shared_ptr<SessionRecorder> recorder) {
+    session_recorder_ = std::move(recorder);
+  }
+  // Optional, the sessions of the "audio_transport": "shm" option get
+  // their audio rings registered by it, set before Start()
+  void set_shm_broker(ShmRingBroker* broker) { shm_broker_ = broker; }
 
  private:
+  void OnHttpRead(beast::error_code ec, std::size_t bytes_transferred);
+  // Decode the offline request on the pool of the transcriber, then respond
+  void OnTranscribe(http::request<http::string_body>&& request);
+  void WriteResponse(unsigned version, http::status status,
+                     const std::string& body);
+  void OnAccept(beast::error_code ec);
+  void DoRead();
+  void OnRead(beast::error_code ec, std::size_t bytes_transferred);
   void OnSpeechStart();
   void OnSpeechEnd();
+  // Set the end of the input of the feature pipeline, once
+  void FinishInput();
+  // Feed the samples in ring_ to the feature pipeline, until the ring is
+  // empty or the feature queue is full, then wait for the doorbell or for
+  // the space of the queue. The input is finished with the ring.
+  void DrainRing();
+  void WaitDoorbell();
+  void CloseRing();
   void OnText(const std::string& message);
+  // Bias the session to the phrase list of the "contexts" option
+  void OnContexts(const std::vector<std::string>& contexts);
   void OnFinish();
   void OnSpeechData(const beast::flat_buffer& buffer);
   void OnError(const std::string& message);
   void OnPartialResult(const std::string& result);
-  void OnFinalResult(const std::string& result);
-  void DecodeThreadFunc();
-  std::string SerializeResult(bool finish);
+  // Send the partial result of the decoded chunk, if the filter passes it
+  void MaybePartialResult();
+  void OnFinalResult(const std::string& result, const std::string& lattice);
+  void OnFinalCtcResult(const std::string& result);
+  // Decode the available features, return false if the decoding is done
+  bool DecodeAvailable();
+  void AsyncRescoring();
+  // Send speech_end after the pending rescorings
+  void Finish();
+  // Report the finished stream to the metrics and the admission
+  // controller, once
+  void OnStreamEnd();
+  void LeaveAdmission();
+  // Thread safe and never blocks the decoding, the messages are queued and
+  // written in order. The websocket is closed after the queue is written if
+  // close is true. A partial result replaces the last queued one if it's
+  // not being written yet, so a slow client gets the newest partial result
+  // rather than a growing backlog, the other messages are always written.
+  // The incremental partial results are never replaced, as each of them is
+  // relative to the last one.
+  void WriteText(const std::string& message, bool close = false,
+                 bool partial = false);
+  // Send the encoded result as a binary message, see result_encoder.h
+  void WriteBinary(const std::string& message, bool partial = false);
+  void Write(const std::string& message, bool text, bool close, bool partial);
+  void DoWrite();
+  void OnWrite(beast::error_code ec, std::size_t bytes_transferred);
+  // The results are JSON text, or binary if binary_result_ is true. The
+  // lattice is sent with the final result if lattice_ is true.
+  void SendResult(ResultType type, bool finish);
+  void SendResult(ResultType type, const std::vector<DecodeResult>& results,
+                  bool finish, const std::string& lattice);
+  std::string SerializeResult(const std::vector<DecodeResult>& results,
+                              bool finish);
+  // Log the 1-best of the result if the session is logged
+  void RecordResult(ResultType type, const std::string& sentence);
 
   bool continuous_decoding_ = false;
+  // Send the first pass result as final_ctc at once on endpoint, and the
+  // rescored one as final_result when the asynchronous rescoring is done
+  bool async_rescoring_ = false;
   int nbest_ = 1;
-  websocket::stream<tcp::socket> ws_;
+  // Send the results as the binary Response of grpc/wenet.proto instead of
+  // JSON, by the "result_format": "proto" option
+  bool binary_result_ = false;
+  // Send the word lattice with the final results, by the "lattice" option,
+  // base64 encoded in the JSON results
+  bool lattice_ = false;
+  // Throttling of the partial results, by the "partial_interval_ms",
+  // "partial_changed_only" and "partial_incremental" options
+  PartialResultOptions partial_opts_;
+  std::unique_ptr<PartialResultFilter> partial_filter_;
+  // The partial results are timed from the speech start
+  Timer timer_;
+  // The first partial result is timed from the first audio, and the final
+  // one of the stream ended by the input from the end of the input
+  Timer audio_timer_;
+  bool got_audio_ = false;
+  bool first_partial_sent_ = false;
+  Timer end_timer_;
+  bool end_of_input_ = false;
+  // Sample rate of the speech data, 0 means the sample rate of the feature
+  // config, the speech is resampled otherwise
+  int sample_rate_ = 0;
+  // Codec of the speech data, "pcm" for the raw 16 bits PCM, or "opus", one
+  // packet per binary message, which is decoded in the server
+  std::string codec_ = "pcm";
+  std::unique_ptr<AudioDecoder> audio_decoder_;
+  std::vector<int16_t> pcm_;
+  // The PCM comes by ring_ in shared memory instead of the binary messages,
+  // by the "audio_transport": "shm" option, see ShmRingBroker
+  bool shm_audio_ = false;
+  ShmRingBroker* shm_broker_ = nullptr;
+  std::shared_ptr<ShmAudioRing> ring_;
+#ifndef _WIN32
+  // A dup of the eventfd of ring_, waited on the strand of the socket
+  std::unique_ptr<asio::posix::stream_descriptor> doorbell_;
+#endif
+  bool doorbell_waiting_ = false;
+  // The end signal came, the input is finished once ring_ is drained
+  bool ring_end_ = false;
+  // By the "tenant" and "priority" options
+  DecodeClass decode_class_;
+  websocket::stream<beast::tcp_stream> ws_;
+  beast::flat_buffer buffer_;
+  // The first request, the websocket upgrade or an offline request
+  http::request_parser<http::string_body> parser_;
+  BatchTranscriber* transcriber_;
+  struct OutMessage {
+    std::string data;
+    bool text;
+    // A full partial result, which a newer one can replace
+    bool partial;
+  };
+  // Messages to write, the front one is being written, on the ws_ strand
+  std::deque<OutMessage> write_queue_;
+  bool close_after_write_ = false;
   std::shared_ptr<FeaturePipelineConfig> feature_config_;
   std::shared_ptr<DecodeOptions> decode_config_;
+  // The resource of the model of the stream, which it keeps to the end
   std::shared_ptr<DecodeResource> decode_resource_;
+  // Optional, the sessions of the default decode options are taken from it
+  std::shared_ptr<AsrDecoderPool> decoder_pool_;
+  // Optional, the stream picks a model by the "model" option from it
+  std::shared_ptr<ModelRegistry> model_registry_;
+  std::shared_ptr<SessionRecorder> session_recorder_;
+  // The log of the session if it's sampled by session_recorder_
+  std::unique_ptr<SessionLogWriter> session_log_;
 
   bool got_start_tag_ = false;
   bool got_end_tag_ = false;
   // When endpoint is detected, stop recognition, and stop receiving data.
-  bool stop_recognition_ = false;
+  std::atomic<bool> stop_recognition_{false};
   std::shared_ptr<FeaturePipeline> feature_pipeline_ = nullptr;
   std::shared_ptr<AsrDecoder> decoder_ = nullptr;
-  std::shared_ptr<std::thread> decode_thread_ = nullptr;
+  // From the speech start to OnStreamEnd()
+  bool stream_active_ = false;
+  // kRejected if the stream is not admitted, or it's already left
+  Admission admission_ = Admission::kRejected;
+  DecodeScheduler* scheduler_;
+  std::shared_ptr<DecodeScheduler::Session> decode_session_;
+  // The rescorings run one by one in their own session, so the final
+  // results are sent in order, and the decoding of the next sentence goes
+  // on meanwhile
+  std::shared_ptr<DecodeScheduler::Session> rescoring_session_;
+};
+
+struct AcceptorOptions {
+  // Number of acceptors, each has its own io_context and io threads, and
+  // they listen on the same port with SO_REUSEPORT, so the kernel spreads
+  // the connections over them
+  int num_acceptors = 1;
+  // Cpus to pin the io threads to, split evenly over the acceptors, empty
+  // means no pinning
+  std::vector<int> cpus;
 };
 
 class WebSocketServer {
  public:
+  // num_io_threads threads serve the I/O of the connections of each
+  // acceptor, and num_decode_threads threads decode all of them, 0 means one
+  // per cpu. The acceptors share the decode threads and the models.
   WebSocketServer(int port,
                   std::shared_ptr<FeaturePipelineConfig> feature_config,
                   std::shared_ptr<DecodeOptions> decode_config,
-                  std::shared_ptr<DecodeResource> decode_resource)
-      : port_(port),
-        feature_config_(std::move(feature_config)),
-        decode_config_(std::move(decode_config)),
-        decode_resource_(std::move(decode_resource)) {}
+                  std::shared_ptr<DecodeResource> decode_resource,
+                  int num_io_threads = 1, int num_decode_threads = 0,
+                  const BatchTranscribeOptions& transcribe_opts = {},
+                  std::shared_ptr<AsrDecoderPool> decoder_pool = nullptr,
+                  std::shared_ptr<ModelRegistry> model_registry = nullptr,
+                  const AcceptorOptions& acceptor_opts = {});
 
   void Start();
+  // Optional, capture the websocket sessions for the replay, set before
+  // Start()
+  void set_session_recorder(std::shared_ptr<SessionRecorder> recorder) {
+    session_recorder_ = std::move(recorder);
+  }
+  // Optional, the processes on the host put the audio of their sessions in
+  // shared memory rings of ring_seconds, which are handed to them over the
+  // Unix socket of path, see ShmRingBroker. Set before Start().
+  void set_shm_socket(const std::string& path, int ring_seconds) {
+    shm_socket_ = path;
+    shm_ring_seconds_ = ring_seconds;
+  }
+  // Optional, the decoding runs are queued by the "priority" and the
+  // "tenant" of the sessions, the tenants share the decode threads by the
+  // weights, see DecodeScheduler::EnableFairQueueing(). Set before Start().
+  void set_fair_scheduling(std::unordered_map<std::string, float> weights) {
+    fair_scheduling_ = true;
+    tenant_weights_ = std::move(weights);
+  }
 
  private:
+  // An acceptor and the io_context of its connections
+  struct Shard {
+    explicit Shard(int num_threads)
+        : ioc(num_threads), acceptor(asio::make_strand(ioc)) {}
+    asio::io_context ioc;
+    tcp::acceptor acceptor;
+    // Cpus of the io threads, empty means no pinning
+    std::vector<int> cpus;
+  };
+
+  void DoAccept(Shard* shard);
+  void OnAccept(Shard* shard, beast::error_code ec, tcp::socket socket);
+
   int port_;
-  // The io_context is required for all I/O
-  asio::io_context ioc_{1};
+  int num_io_threads_;
+  int num_decode_threads_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::unique_ptr<DecodeScheduler> scheduler_;
+  BatchTranscribeOptions transcribe_opts_;
+  // Decoder of the offline requests
+  std::unique_ptr<BatchTranscriber> transcriber_;
   std::shared_ptr<FeaturePipelineConfig> feature_config_;
   std::shared_ptr<DecodeOptions> decode_config_;
   std::shared_ptr<DecodeResource> decode_resource_;
+  std::shared_ptr<AsrDecoderPool> decoder_pool_;
+  std::shared_ptr<ModelRegistry> model_registry_;
+  std::shared_ptr<SessionRecorder> session_recorder_;
+  std::string shm_socket_;
+  int shm_ring_seconds_ = 0;
+  std::unique_ptr<ShmRingBroker> shm_broker_;
+  bool fair_scheduling_ = false;
+  std::unordered_map<std::string, float> tenant_weights_;
   WENET_DISALLOW_COPY_AND_ASSIGN(WebSocketServer);
 };
 
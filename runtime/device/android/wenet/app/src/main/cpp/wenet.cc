@@ -13,10 +13,20 @@
 // limitations under the License.
 #include <jni.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
 #include "torch/script.h"
 #include "torch/torch.h"
 
 #include "decoder/asr_decoder.h"
+#ifdef USE_ONNX
+#include "decoder/onnx_asr_model.h"
+#endif
 #include "decoder/torch_asr_model.h"
 #include "frontend/feature_pipeline.h"
 #include "frontend/wav.h"
@@ -26,20 +36,120 @@
 
 namespace wenet {
 
+// The single decoding thread. It sleeps until the pipeline has the frames
+// of one chunk, wakes up by the ready callback of the pipeline, and then
+// decodes all the available chunks by the non-blocking Decode(false).
+class DecodeWorker {
+ public:
+  ~DecodeWorker() { Stop(); }
+
+  void Start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!thread_.joinable()) {
+      thread_ = std::thread(&DecodeWorker::Run, this);
+    }
+    decoding_ = true;
+    ready_ = true;
+    cond_.notify_one();
+  }
+
+  // The ready callback of the pipeline
+  void Notify() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ready_ = true;
+    cond_.notify_one();
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+      cond_.notify_one();
+    }
+    if (thread_.joinable()) thread_.join();
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = false;
+    decoding_ = false;
+  }
+
+  // Held by the worker while it decodes, reset() takes it
+  std::mutex& decode_mutex() { return decode_mutex_; }
+
+ private:
+  void Run();
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool ready_ = false;
+  bool decoding_ = false;
+  bool stop_ = false;
+  std::mutex decode_mutex_;
+  std::thread thread_;
+};
+
 std::shared_ptr<DecodeOptions> decode_config;
 std::shared_ptr<FeaturePipelineConfig> feature_config;
 std::shared_ptr<FeaturePipeline> feature_pipeline;
 std::shared_ptr<AsrDecoder> decoder;
 std::shared_ptr<DecodeResource> resource;
-DecodeState state = kEndBatch;
+DecodeWorker worker;
+std::atomic<bool> finished{false};
+// The final results of the sentences so far, under the decode mutex
 std::string total_result;  // NOLINT
+// The text of the results, published by the worker and read by
+// getResult() by atomic swaps of the pointer, so neither waits for the other
+std::shared_ptr<const std::string> published_result =
+    std::make_shared<const std::string>();
+
+void publish_result(const std::string& result) {
+  std::shared_ptr<const std::string> snapshot =
+      std::make_shared<std::string>(result);
+  std::atomic_store(&published_result, snapshot);
+}
+
+#ifdef USE_ONNX
+// Set by setOnnxOptions() before init()
+OnnxSessionOptions onnx_options;
+#endif
 
+void set_onnx_options(JNIEnv *env, jobject, jboolean quantized,
+                      jstring jProviders, jint num_threads) {
+#ifdef USE_ONNX
+  const char *pProviders = env->GetStringUTFChars(jProviders, nullptr);
+  onnx_options.providers.clear();
+  SplitStringToVector(pProviders, ",", true, &onnx_options.providers);
+  env->ReleaseStringUTFChars(jProviders, pProviders);
+  onnx_options.quantized = quantized == JNI_TRUE;
+  onnx_options.num_threads = num_threads;
+#else
+  LOG(WARNING) << "Built without onnx, the onnx options are ignored";
+#endif
+}
+
+jstring get_backend(JNIEnv *env, jobject) {
+#ifdef USE_ONNX
+  return env->NewStringUTF("onnx");
+#else
+  return env->NewStringUTF("torch");
+#endif
+}
+
+// modelPath is the torch script model, or the directory of the onnx models
+// of the onnx builds
 void init(JNIEnv *env, jobject, jstring jModelPath, jstring jDictPath) {
-  auto model = std::make_shared<TorchAsrModel>();
   const char *pModelPath = (env)->GetStringUTFChars(jModelPath, nullptr);
   std::string modelPath = std::string(pModelPath);
   LOG(INFO) << "model path: " << modelPath;
+#ifdef USE_ONNX
+  auto model = std::make_shared<OnnxAsrModel>();
+  model->Read(modelPath, onnx_options);
+#else
+  auto model = std::make_shared<TorchAsrModel>();
   model->Read(modelPath);
+#endif
+  // The worker may decode by the old decoder, e.g. init() again by the
+  // benchmark, it's restarted by startDecode()
+  worker.Stop();
   resource = std::make_shared<DecodeResource>();
   resource->model = model;
 
@@ -55,6 +165,7 @@ void init(JNIEnv *env, jobject, jstring jModelPath, jstring jDictPath) {
 
   feature_config = std::make_shared<FeaturePipelineConfig>(80, 16000);
   feature_pipeline = std::make_shared<FeaturePipeline>(*feature_config);
+  feature_pipeline->set_ready_callback([]() { worker.Notify(); });
 
   decode_config = std::make_shared<DecodeOptions>();
   decode_config->chunk_size = 16;
@@ -65,19 +176,32 @@ void init(JNIEnv *env, jobject, jstring jModelPath, jstring jDictPath) {
 
 void reset(JNIEnv *env, jobject) {
   LOG(INFO) << "wenet reset";
+  std::lock_guard<std::mutex> lock(worker.decode_mutex());
+  feature_pipeline->Reset();
   decoder->Reset();
-  state = kEndBatch;
+  finished = false;
   total_result = "";
+  publish_result(total_result);
 }
 
 void accept_waveform(JNIEnv *env, jobject, jshortArray jWaveform) {
   jsize size = env->GetArrayLength(jWaveform);
-  std::vector<int16_t> waveform(size);
-  env->GetShortArrayRegion(jWaveform, 0, size, &waveform[0]);
-  std::vector<float> floatWaveform(waveform.begin(), waveform.end());
-  feature_pipeline->AcceptWaveform(floatWaveform);
-  LOG(INFO) << "wenet accept waveform in ms: "
-            << int(floatWaveform.size() / 16);
+  // Not copied, the feature extraction is quick and calls nothing of JNI
+  auto* waveform = static_cast<int16_t*>(
+      env->GetPrimitiveArrayCritical(jWaveform, nullptr));
+  feature_pipeline->AcceptWaveform(waveform, size);
+  env->ReleasePrimitiveArrayCritical(jWaveform, waveform, JNI_ABORT);
+}
+
+// num_samples int16 samples of a direct ByteBuffer, in native byte order,
+// they are read in place
+void accept_waveform_buffer(JNIEnv *env, jobject, jobject jBuffer,
+                            jint num_samples) {
+  auto* waveform =
+      static_cast<const int16_t*>(env->GetDirectBufferAddress(jBuffer));
+  CHECK(waveform != nullptr) << "Expect a direct ByteBuffer";
+  CHECK_LE(num_samples * 2, env->GetDirectBufferCapacity(jBuffer));
+  feature_pipeline->AcceptWaveform(waveform, num_samples);
 }
 
 void set_input_finished() {
@@ -85,54 +209,57 @@ void set_input_finished() {
   feature_pipeline->set_input_finished();
 }
 
-void decode_thread_func() {
+void DecodeWorker::Run() {
   while (true) {
-    state = decoder->Decode();
-    if (state == kEndFeats || state == kEndpoint) {
-      decoder->Rescoring();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this]() { return stop_ || (ready_ && decoding_); });
+      if (stop_) return;
+      ready_ = false;
     }
-
-    std::string result;
-    if (decoder->DecodedSomething()) {
-      result = decoder->result()[0].sentence;
-    }
-
-    if (state == kEndFeats) {
-      LOG(INFO) << "wenet endfeats final result: " << result;
-      total_result += result;
-      break;
-    } else if (state == kEndpoint) {
-      LOG(INFO) << "wenet endpoint final result: " << result;
-      total_result += result + "，";
-      decoder->ResetContinuousDecoding();
-    } else {
+    std::lock_guard<std::mutex> decode_lock(decode_mutex_);
+    while (true) {
+      DecodeState state = decoder->Decode(false);
+      if (state == kWaitFeats) break;
+      if (state == kEndFeats || state == kEndpoint) {
+        decoder->Rescoring();
+      }
+      std::string result;
       if (decoder->DecodedSomething()) {
-        LOG(INFO) << "wenet partial result: " << result;
+        result = decoder->result()[0].sentence;
+      }
+      if (state == kEndFeats) {
+        LOG(INFO) << "wenet endfeats final result: " << result;
+        total_result += result;
+        publish_result(total_result);
+        finished = true;
+        std::lock_guard<std::mutex> state_lock(mutex_);
+        decoding_ = false;
+        break;
+      } else if (state == kEndpoint) {
+        VLOG(1) << "wenet endpoint final result: " << result;
+        total_result += result + "，";
+        publish_result(total_result);
+        decoder->ResetContinuousDecoding();
+      } else {
+        publish_result(total_result + result);
       }
     }
   }
 }
 
 void start_decode() {
-  std::thread decode_thread(decode_thread_func);
-  decode_thread.detach();
+  worker.Start();
 }
 
 jboolean get_finished(JNIEnv *env, jobject) {
-  if (state == kEndFeats) {
-    LOG(INFO) << "wenet recognize finished";
-    return JNI_TRUE;
-  }
-  return JNI_FALSE;
+  return finished ? JNI_TRUE : JNI_FALSE;
 }
 
 jstring get_result(JNIEnv *env, jobject) {
-  std::string result;
-  if (decoder->DecodedSomething()) {
-    result = decoder->result()[0].sentence;
-  }
-  LOG(INFO) << "wenet ui result: " << total_result + result;
-  return env->NewStringUTF((total_result + result).c_str());
+  std::shared_ptr<const std::string> result =
+      std::atomic_load(&published_result);
+  return env->NewStringUTF(result->c_str());
 }
 }  // namespace wenet
 
@@ -150,9 +277,15 @@ JNIEXPORT jint JNI_OnLoad(JavaVM *vm, void *) {
   static const JNINativeMethod methods[] = {
     {"init", "(Ljava/lang/String;Ljava/lang/String;)V",
      reinterpret_cast<void *>(wenet::init)},
+    {"setOnnxOptions", "(ZLjava/lang/String;I)V",
+     reinterpret_cast<void *>(wenet::set_onnx_options)},
+    {"getBackend", "()Ljava/lang/String;",
+     reinterpret_cast<void *>(wenet::get_backend)},
     {"reset", "()V", reinterpret_cast<void *>(wenet::reset)},
     {"acceptWaveform", "([S)V",
      reinterpret_cast<void *>(wenet::accept_waveform)},
+    {"acceptWaveformBuffer", "(Ljava/nio/ByteBuffer;I)V",
+     reinterpret_cast<void *>(wenet::accept_waveform_buffer)},
     {"setInputFinished", "()V",
      reinterpret_cast<void *>(wenet::set_input_finished)},
     {"getFinished", "()Z", reinterpret_cast<void *>(wenet::get_finished)},
@@ -0,0 +1,203 @@
+package com.mobvoi.wenet;
+
+import android.os.Bundle;
+import android.os.SystemClock;
+import android.util.Log;
+import android.widget.ScrollView;
+import android.widget.TextView;
+import androidx.appcompat.app.AppCompatActivity;
+import java.io.BufferedReader;
+import java.io.ByteArrayOutputStream;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.InputStreamReader;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayList;
+import java.util.List;
+
+/**
+ * Decodes the test set of assets by the model settings of the build, and
+ * reports the real time factor and the character error rate of each, e.g. the
+ * float and the int8 quantized onnx models on the cpu, XNNPACK and NNAPI.
+ *
+ * The test set is assets/benchmark/text, of the lines "name transcript", and
+ * the 16k 16 bits mono assets/benchmark/name.wav. Started by
+ *   adb shell am start -n com.mobvoi.wenet/.BenchmarkActivity
+ */
+public class BenchmarkActivity extends AppCompatActivity {
+
+  private static final String LOG_TAG = "WENET";
+  private static final int SAMPLE_RATE = 16000;
+  private static final int NUM_THREADS = 1;
+
+  private TextView textView;
+
+  private static class Utterance {
+    String name;
+    String text;
+    short[] samples;
+  }
+
+  // The model settings to compare, {quantized, providers} of the onnx builds
+  private static final Object[][] ONNX_SETTINGS = {
+    {false, "cpu"},
+    {true, "cpu"},
+    {true, "xnnpack,cpu"},
+    {true, "nnapi,cpu"},
+  };
+
+  @Override
+  protected void onCreate(Bundle savedInstanceState) {
+    super.onCreate(savedInstanceState);
+    textView = new TextView(this);
+    textView.setTextSize(14);
+    ScrollView scrollView = new ScrollView(this);
+    scrollView.addView(textView);
+    setContentView(scrollView);
+    new Thread(this::runBenchmark).start();
+  }
+
+  private void report(String line) {
+    Log.i(LOG_TAG, line);
+    runOnUiThread(() -> textView.append(line + "\n"));
+  }
+
+  private void runBenchmark() {
+    List<Utterance> utterances;
+    try {
+      utterances = readTestSet();
+    } catch (IOException e) {
+      report("Error read the test set of assets/benchmark: " + e.getMessage());
+      return;
+    }
+    String modelPath = MainActivity.modelPath(this);
+    String dictPath = MainActivity.assetFilePath(this, "words.txt");
+    String backend = Recognize.getBackend();
+    report(backend + " backend, " + utterances.size() + " utterances");
+    if (!backend.equals("onnx")) {
+      Recognize.init(modelPath, dictPath);
+      benchmark("torch", utterances);
+      return;
+    }
+    for (Object[] setting : ONNX_SETTINGS) {
+      boolean quantized = (Boolean) setting[0];
+      String providers = (String) setting[1];
+      Recognize.setOnnxOptions(quantized, providers, NUM_THREADS);
+      Recognize.init(modelPath, dictPath);
+      benchmark((quantized ? "int8 " : "float ") + providers, utterances);
+    }
+  }
+
+  private void benchmark(String setting, List<Utterance> utterances) {
+    long decodeMs = 0;
+    long numSamples = 0;
+    int numErrors = 0;
+    int numChars = 0;
+    // Warm up, the first forward of the providers compiles the graphs
+    if (!utterances.isEmpty()) {
+      decode(utterances.get(0).samples);
+    }
+    for (Utterance utt : utterances) {
+      long start = SystemClock.elapsedRealtime();
+      String result = decode(utt.samples);
+      decodeMs += SystemClock.elapsedRealtime() - start;
+      numSamples += utt.samples.length;
+      String ref = normalize(utt.text);
+      numErrors += editDistance(ref, normalize(result));
+      numChars += ref.length();
+      Log.d(LOG_TAG, utt.name + " " + result);
+    }
+    double rtf = decodeMs / 1000.0 / Math.max(numSamples / (double) SAMPLE_RATE, 1e-6);
+    double cer = 100.0 * numErrors / Math.max(numChars, 1);
+    report(String.format("%s: RTF %.4f, CER %.2f%%", setting, rtf, cer));
+  }
+
+  private String decode(short[] samples) {
+    Recognize.reset();
+    Recognize.startDecode();
+    Recognize.acceptWaveform(samples);
+    Recognize.setInputFinished();
+    while (!Recognize.getFinished()) {
+      try {
+        Thread.sleep(1);
+      } catch (InterruptedException e) {
+        Log.e(LOG_TAG, e.getMessage());
+      }
+    }
+    return Recognize.getResult();
+  }
+
+  // The characters without the spaces and the punctuations of the endpoints
+  private static String normalize(String text) {
+    return text.replaceAll("[\\s，,]", "");
+  }
+
+  private static int editDistance(String ref, String hyp) {
+    int[] prev = new int[hyp.length() + 1];
+    int[] cur = new int[hyp.length() + 1];
+    for (int j = 0; j <= hyp.length(); j++) {
+      prev[j] = j;
+    }
+    for (int i = 1; i <= ref.length(); i++) {
+      cur[0] = i;
+      for (int j = 1; j <= hyp.length(); j++) {
+        int sub = prev[j - 1] + (ref.charAt(i - 1) == hyp.charAt(j - 1) ? 0 : 1);
+        cur[j] = Math.min(sub, Math.min(prev[j], cur[j - 1]) + 1);
+      }
+      int[] tmp = prev;
+      prev = cur;
+      cur = tmp;
+    }
+    return prev[hyp.length()];
+  }
+
+  private List<Utterance> readTestSet() throws IOException {
+    List<Utterance> utterances = new ArrayList<>();
+    try (BufferedReader reader = new BufferedReader(
+        new InputStreamReader(getAssets().open("benchmark/text"), "UTF-8"))) {
+      String line;
+      while ((line = reader.readLine()) != null) {
+        String[] fields = line.trim().split("\\s+", 2);
+        if (fields[0].isEmpty()) {
+          continue;
+        }
+        Utterance utt = new Utterance();
+        utt.name = fields[0];
+        utt.text = fields.length > 1 ? fields[1] : "";
+        utt.samples = readWav("benchmark/" + utt.name + ".wav");
+        utterances.add(utt);
+      }
+    }
+    return utterances;
+  }
+
+  // The samples of the data chunk of a 16 bits mono wav
+  private short[] readWav(String assetName) throws IOException {
+    byte[] bytes;
+    try (InputStream is = getAssets().open(assetName)) {
+      ByteArrayOutputStream os = new ByteArrayOutputStream();
+      byte[] buffer = new byte[4 * 1024];
+      int read;
+      while ((read = is.read(buffer)) != -1) {
+        os.write(buffer, 0, read);
+      }
+      bytes = os.toByteArray();
+    }
+    ByteBuffer wav = ByteBuffer.wrap(bytes).order(ByteOrder.LITTLE_ENDIAN);
+    int pos = 12;  // RIFF, size, WAVE
+    while (pos + 8 <= bytes.length) {
+      String id = new String(bytes, pos, 4, "US-ASCII");
+      int size = wav.getInt(pos + 4);
+      if (id.equals("data")) {
+        size = Math.min(size, bytes.length - pos - 8);
+        short[] samples = new short[size / 2];
+        wav.position(pos + 8);
+        wav.asShortBuffer().get(samples);
+        return samples;
+      }
+      pos += 8 + size + (size & 1);
+    }
+    throw new IOException("No data chunk in " + assetName);
+  }
+}
@@ -20,6 +20,9 @@ import java.io.FileOutputStream;
 import java.io.IOException;
 import java.io.InputStream;
 import java.io.OutputStream;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.ShortBuffer;
 import java.util.concurrent.ArrayBlockingQueue;
 import java.util.concurrent.BlockingQueue;
 
@@ -33,7 +36,8 @@ public class MainActivity extends AppCompatActivity {
   private boolean startRecord = false;
   private AudioRecord record = null;
   private int miniBufferSize = 0;  // 1280 bytes 648 byte 40ms, 0.04s
-  private final BlockingQueue<short[]> bufferQueue = new ArrayBlockingQueue<>(MAX_QUEUE_SIZE);
+  // Direct buffers of the 16 bits samples, which are passed to C++ without copying
+  private final BlockingQueue<ByteBuffer> bufferQueue = new ArrayBlockingQueue<>(MAX_QUEUE_SIZE);
 
   public static String assetFilePath(Context context, String assetName) {
     File file = new File(context.getFilesDir(), assetName);
@@ -57,6 +61,24 @@ public class MainActivity extends AppCompatActivity {
     return null;
   }
 
+  // The torch script model, or the directory of the onnx models of the onnx
+  // builds, all the *.onnx assets are copied to it
+  public static String modelPath(Context context) {
+    if (!Recognize.getBackend().equals("onnx")) {
+      return new File(assetFilePath(context, "final.zip")).getAbsolutePath();
+    }
+    try {
+      for (String name : context.getAssets().list("")) {
+        if (name.endsWith(".onnx")) {
+          assetFilePath(context, name);
+        }
+      }
+    } catch (IOException e) {
+      Log.e(LOG_TAG, "Error list the onnx models of assets");
+    }
+    return context.getFilesDir().getAbsolutePath();
+  }
+
   @Override
   public void onRequestPermissionsResult(int requestCode,
       String[] permissions, int[] grantResults) {
@@ -79,10 +101,16 @@ public class MainActivity extends AppCompatActivity {
 
     requestAudioPermissions();
 
-    final String modelPath = new File(assetFilePath(this, "final.zip")).getAbsolutePath();
+    final String modelPath = modelPath(this);
     final String dictPath = new File(assetFilePath(this, "words.txt")).getAbsolutePath();
     TextView textView = findViewById(R.id.textView);
     textView.setText("");
+    if (Recognize.getBackend().equals("onnx")) {
+      // The int8 quantized models if they are shipped, see BenchmarkActivity
+      // for the accuracy and the speed of the providers
+      boolean quantized = new File(getFilesDir(), "encoder.quant.onnx").exists();
+      Recognize.setOnnxOptions(quantized, "cpu", 1);
+    }
     Recognize.init(modelPath, dictPath);
 
     Button button = findViewById(R.id.button);
@@ -142,11 +170,13 @@ public class MainActivity extends AppCompatActivity {
       record.startRecording();
       Process.setThreadPriority(Process.THREAD_PRIORITY_AUDIO);
       while (startRecord) {
-        short[] buffer = new short[miniBufferSize / 2];
-        int read = record.read(buffer, 0, buffer.length);
-        voiceView.add(calculateDb(buffer));
+        ByteBuffer buffer =
+            ByteBuffer.allocateDirect(miniBufferSize).order(ByteOrder.nativeOrder());
+        int read = record.read(buffer, miniBufferSize);
         try {
-          if (AudioRecord.ERROR_INVALID_OPERATION != read) {
+          if (read > 0) {
+            buffer.limit(read);
+            voiceView.add(calculateDb(buffer.asShortBuffer()));
             bufferQueue.put(buffer);
           }
         } catch (InterruptedException e) {
@@ -162,12 +192,14 @@ public class MainActivity extends AppCompatActivity {
     }).start();
   }
 
-  private double calculateDb(short[] buffer) {
+  private double calculateDb(ShortBuffer buffer) {
     double energy = 0.0;
-    for (short value : buffer) {
+    int length = buffer.remaining();
+    for (int i = 0; i < length; i++) {
+      short value = buffer.get(i);
       energy += value * value;
     }
-    energy /= buffer.length;
+    energy /= Math.max(length, 1);
     energy = (10 * Math.log10(1 + energy)) / 100;
     energy = Math.min(energy, 1.0);
     return energy;
@@ -178,9 +210,9 @@ public class MainActivity extends AppCompatActivity {
       // Send all data
       while (startRecord || bufferQueue.size() > 0) {
         try {
-          short[] data = bufferQueue.take();
+          ByteBuffer data = bufferQueue.take();
           // 1. add data to C++ interface
-          Recognize.acceptWaveform(data);
+          Recognize.acceptWaveformBuffer(data, data.limit() / 2);
           // 2. get partial result
           runOnUiThread(() -> {
             TextView textView = findViewById(R.id.textView);
@@ -199,8 +231,16 @@ public class MainActivity extends AppCompatActivity {
             TextView textView = findViewById(R.id.textView);
             textView.setText(Recognize.getResult());
           });
+          try {
+            // The result changes once per chunk at most
+            Thread.sleep(40);
+          } catch (InterruptedException e) {
+            Log.e(LOG_TAG, e.getMessage());
+          }
         } else {
           runOnUiThread(() -> {
+            TextView textView = findViewById(R.id.textView);
+            textView.setText(Recognize.getResult());
             Button button = findViewById(R.id.button);
             button.setEnabled(true);
           });
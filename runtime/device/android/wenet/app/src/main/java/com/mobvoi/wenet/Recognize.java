@@ -1,14 +1,25 @@
 package com.mobvoi.wenet;
 
+import java.nio.ByteBuffer;
+
 public class Recognize {
 
   static {
     System.loadLibrary("wenet");
   }
 
+  // The options of the onnx builds, set before init(). The providers are
+  // comma separated in priority order, of nnapi, xnnpack and cpu
+  public static native void setOnnxOptions(boolean quantized, String providers, int numThreads);
+  // "torch" or "onnx", which is chosen at build time by -PwenetBackend
+  public static native String getBackend();
+  // modelPath is the torch script model, or the directory of the onnx models
   public static native void init(String modelPath, String dictPath);
   public static native void reset();
   public static native void acceptWaveform(short[] waveform);
+  // numSamples 16 bits samples of a direct buffer in the native byte order,
+  // which are read in place
+  public static native void acceptWaveformBuffer(ByteBuffer waveform, int numSamples);
   public static native void setInputFinished();
   public static native boolean getFinished();
   public static native void startDecode();
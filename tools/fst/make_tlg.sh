@@ -32,7 +32,8 @@ fstisstochastic $tgt_lang/G.fst
 # Compose the token, lexicon and language-model FST into the final decoding graph
 fsttablecompose $tgt_lang/L.fst $tgt_lang/G.fst | fstdeterminizestar --use-log=true | \
     fstminimizeencoded | fstarcsort --sort_type=ilabel > $tgt_lang/LG.fst || exit 1;
-fsttablecompose $tgt_lang/T.fst $tgt_lang/LG.fst > $tgt_lang/TLG.fst || exit 1;
+fstcomposetlg --num-threads=$(nproc) $tgt_lang/T.fst $tgt_lang/LG.fst | \
+    fstoptimizetlg - $tgt_lang/TLG.fst || exit 1;
 
 echo "Composing decoding graph TLG.fst succeeded"
 #rm -r $tgt_lang/LG.fst   # We don't need to keep this intermediate FST
@@ -48,6 +48,12 @@ def get_args():
                         type=int, help='beam wigth')
     parser.add_argument('--reverse_weight', default=0.0,
                         type=float, help='reverse_weight in attention_rescoing')
+    parser.add_argument('--fuse_ctc', action='store_true',
+                        help='also export a fused encoder and ctc graph')
+    parser.add_argument('--conv_cache', action='store_true',
+                        help='take the caches of the subsampling conv '
+                             'layers, so the chunks after the first one '
+                             'are not spliced with the last frames')
     args = parser.parse_args()
     return args
 
@@ -72,10 +78,29 @@ def print_input_output_info(onnx_model, name, prefix="\t\t"):
     print("{}{} output shapes : {}".format(prefix, name, output_shapes))
 
 
+def conv_cache_inputs(encoder, chunk, args):
+    """ The first chunk and the chunks after it of the conv cache graphs,
+        and the empty and the real conv caches, see
+        BaseSubsampling.splice_conv_cache
+    """
+    stride = args['chunk_size'] * args['subsampling_rate']
+    next_chunk = chunk[:, :stride, :]
+    empty_cache = torch.zeros((args['batch'], 0, 0))
+    x = chunk
+    if encoder.global_cmvn is not None:
+        x = encoder.global_cmvn(x)
+    _, _, conv_cache = encoder.embed.forward_chunk(x, 0, empty_cache)
+    empty_cache = conv_cache[:, :0, :]
+    return next_chunk, empty_cache, conv_cache
+
+
 def export_encoder(asr_model, args):
     print("Stage-1: export encoder")
     encoder = asr_model.encoder
-    encoder.forward = encoder.forward_chunk
+    if args['conv_cache']:
+        encoder.forward = encoder.forward_chunk_conv_cache
+    else:
+        encoder.forward = encoder.forward_chunk
     encoder_outpath = os.path.join(args['output_dir'], 'encoder.onnx')
 
     print("\tStage-1.1: prepare inputs for encoder")
@@ -117,8 +142,20 @@ def export_encoder(asr_model, args):
     cnn_cache = torch.zeros(
         (args['num_blocks'], args['batch'],
          args['output_size'], args['cnn_module_kernel'] - 1))
+    input_names = ['chunk', 'offset', 'required_cache_size',
+                   'att_cache', 'cnn_cache', 'att_mask']
+    output_names = ['output', 'r_att_cache', 'r_cnn_cache']
     inputs = (chunk, offset, required_cache_size,
               att_cache, cnn_cache, att_mask)
+    if args['conv_cache']:
+        # Traced by a chunk after the first one, the size of dim 1 of the
+        # conv cache is 0 for the first chunk and 1 for the others
+        next_chunk, empty_conv_cache, conv_cache = conv_cache_inputs(
+            encoder, chunk, args)
+        input_names.insert(5, 'conv_cache')
+        output_names.append('r_conv_cache')
+        inputs = (next_chunk, offset, required_cache_size,
+                  att_cache, cnn_cache, conv_cache, att_mask)
     print("\t\tchunk.size(): {}\n".format(chunk.size()),
           "\t\toffset: {}\n".format(offset),
           "\t\trequired_cache: {}\n".format(required_cache_size),
@@ -134,6 +171,8 @@ def export_encoder(asr_model, args):
         'output': {1: 'T'},
         'r_att_cache': {2: 'T_CACHE'},
     }
+    if args['conv_cache']:
+        dynamic_axes['conv_cache'] = {1: 'T_CONV_CACHE'}
     # NOTE(xcsong): We keep dynamic axes even if in 16/4 mode, this is
     #   to avoid padding the last chunk (which usually contains less
     #   frames than required). For users who want static axes, just pop
@@ -150,11 +189,7 @@ def export_encoder(asr_model, args):
     torch.onnx.export(
         encoder, inputs, encoder_outpath, opset_version=13,
         export_params=True, do_constant_folding=True,
-        input_names=[
-            'chunk', 'offset', 'required_cache_size',
-            'att_cache', 'cnn_cache', 'att_mask'
-        ],
-        output_names=['output', 'r_att_cache', 'r_cnn_cache'],
+        input_names=input_names, output_names=output_names,
         dynamic_axes=dynamic_axes, verbose=False)
     onnx_encoder = onnx.load(encoder_outpath)
     for (k, v) in args.items():
@@ -176,6 +211,8 @@ def export_encoder(asr_model, args):
     torch_att_cache = copy.deepcopy(att_cache)
     torch_cnn_cache = copy.deepcopy(cnn_cache)
     torch_att_mask = copy.deepcopy(att_mask)
+    if args['conv_cache']:
+        torch_conv_cache = copy.deepcopy(empty_conv_cache)
     for i in range(10):
         print("\t\ttorch chunk-{}: {}, offset: {}, att_cache: {},"
               " cnn_cache: {}, att_mask: {}".format(
@@ -186,9 +223,15 @@ def export_encoder(asr_model, args):
         #   we use 16/4 mode.
         if args['left_chunks'] > 0:  # 16/4
             torch_att_mask[:, :, -(args['chunk_size'] * (i + 1)):] = 1
-        out, torch_att_cache, torch_cnn_cache = encoder(
-            torch_chunk, torch_offset, torch_required_cache_size,
-            torch_att_cache, torch_cnn_cache, torch_att_mask)
+        if args['conv_cache']:
+            out, torch_att_cache, torch_cnn_cache, torch_conv_cache = \
+                encoder(torch_chunk if i == 0 else next_chunk, torch_offset,
+                        torch_required_cache_size, torch_att_cache,
+                        torch_cnn_cache, torch_conv_cache, torch_att_mask)
+        else:
+            out, torch_att_cache, torch_cnn_cache = encoder(
+                torch_chunk, torch_offset, torch_required_cache_size,
+                torch_att_cache, torch_cnn_cache, torch_att_mask)
         torch_output.append(out)
         torch_offset += out.size(1)
     torch_output = torch.cat(torch_output, dim=1)
@@ -200,6 +243,8 @@ def export_encoder(asr_model, args):
     onnx_att_cache = to_numpy(att_cache)
     onnx_cnn_cache = to_numpy(cnn_cache)
     onnx_att_mask = to_numpy(att_mask)
+    if args['conv_cache']:
+        onnx_conv_cache = to_numpy(empty_conv_cache)
     ort_session = onnxruntime.InferenceSession(encoder_outpath)
     input_names = [node.name for node in onnx_encoder.graph.input]
     for i in range(10):
@@ -217,6 +262,10 @@ def export_encoder(asr_model, args):
             'att_cache': onnx_att_cache, 'cnn_cache': onnx_cnn_cache,
             'att_mask': onnx_att_mask
         }
+        if args['conv_cache']:
+            ort_inputs['conv_cache'] = onnx_conv_cache
+            if i > 0:
+                ort_inputs['chunk'] = to_numpy(next_chunk)
         # NOTE(xcsong): If we use 16/-1, -1/-1 or 16/0 mode, `next_cache_start`
         #   will be hardcoded to 0 or chunk_size by ONNX, thus
         #   required_cache_size and att_mask are no more needed and they will
@@ -226,6 +275,8 @@ def export_encoder(asr_model, args):
                 ort_inputs.pop(k)
         ort_outs = ort_session.run(None, ort_inputs)
         onnx_att_cache, onnx_cnn_cache = ort_outs[1], ort_outs[2]
+        if args['conv_cache']:
+            onnx_conv_cache = ort_outs[3]
         onnx_output.append(ort_outs[0])
         onnx_offset += ort_outs[0].shape[1]
     onnx_output = np.concatenate(onnx_output, axis=1)
@@ -275,6 +326,136 @@ def export_ctc(asr_model, args):
     print("\t\tCheck onnx_ctc, pass!")
 
 
+class EncoderCtc(torch.nn.Module):
+    """ Encoder chunk forward and ctc activation in one graph, so the
+        runtime runs one session per chunk. The encoder output is the
+        last output, and it's only fetched when rescoring is needed.
+    """
+    def __init__(self, encoder, ctc):
+        super().__init__()
+        self.encoder = encoder
+        self.ctc = ctc
+
+    def forward(self, chunk, offset, required_cache_size,
+                att_cache, cnn_cache, att_mask):
+        output, r_att_cache, r_cnn_cache = self.encoder.forward_chunk(
+            chunk, offset, required_cache_size, att_cache, cnn_cache,
+            att_mask)
+        probs = self.ctc.log_softmax(output)
+        return probs, r_att_cache, r_cnn_cache, output
+
+
+class EncoderCtcConvCache(EncoderCtc):
+    """ EncoderCtc with the conv cache of the subsampling, the new conv
+        cache is output before the encoder output.
+    """
+    def forward(self, chunk, offset, required_cache_size,
+                att_cache, cnn_cache, conv_cache, att_mask):
+        output, r_att_cache, r_cnn_cache, r_conv_cache = \
+            self.encoder.forward_chunk_conv_cache(
+                chunk, offset, required_cache_size, att_cache, cnn_cache,
+                conv_cache, att_mask)
+        probs = self.ctc.log_softmax(output)
+        return probs, r_att_cache, r_cnn_cache, r_conv_cache, output
+
+
+def export_encoder_ctc(asr_model, args):
+    print("Stage-4: export fused encoder and ctc")
+    if args['conv_cache']:
+        model = EncoderCtcConvCache(asr_model.encoder, asr_model.ctc)
+    else:
+        model = EncoderCtc(asr_model.encoder, asr_model.ctc)
+    model.eval()
+    outpath = os.path.join(args['output_dir'], 'encoder_ctc.onnx')
+
+    print("\tStage-4.1: prepare inputs for encoder_ctc")
+    chunk = torch.randn(
+        (args['batch'], args['decoding_window'], args['feature_size']))
+    # Same first chunk inputs as export_encoder, see the NOTE there
+    if args['left_chunks'] > 0:
+        required_cache_size = args['chunk_size'] * args['left_chunks']
+        offset = required_cache_size
+        att_cache = torch.zeros(
+            (args['num_blocks'], args['head'], required_cache_size,
+             args['output_size'] // args['head'] * 2))
+        att_mask = torch.ones(
+            (args['batch'], 1, required_cache_size + args['chunk_size']),
+            dtype=torch.bool)
+        att_mask[:, :, :required_cache_size] = 0
+    else:
+        offset = 0
+        required_cache_size = -1 if args['left_chunks'] < 0 else 0
+        att_cache = torch.zeros(
+            (args['num_blocks'], args['head'], 0,
+             args['output_size'] // args['head'] * 2))
+        att_mask = torch.ones((0, 0, 0), dtype=torch.bool)
+    cnn_cache = torch.zeros(
+        (args['num_blocks'], args['batch'],
+         args['output_size'], args['cnn_module_kernel'] - 1))
+    input_names = ['chunk', 'offset', 'required_cache_size',
+                   'att_cache', 'cnn_cache', 'att_mask']
+    output_names = ['probs', 'r_att_cache', 'r_cnn_cache', 'output']
+    inputs = (chunk, offset, required_cache_size,
+              att_cache, cnn_cache, att_mask)
+    if args['conv_cache']:
+        # Same as export_encoder
+        next_chunk, _, conv_cache = conv_cache_inputs(
+            asr_model.encoder, chunk, args)
+        input_names.insert(5, 'conv_cache')
+        output_names.insert(3, 'r_conv_cache')
+        chunk = next_chunk
+        inputs = (chunk, offset, required_cache_size,
+                  att_cache, cnn_cache, conv_cache, att_mask)
+
+    print("\tStage-4.2: torch.onnx.export")
+    dynamic_axes = {
+        'chunk': {1: 'T'},
+        'att_cache': {2: 'T_CACHE'},
+        'att_mask': {2: 'T_ADD_T_CACHE'},
+        'probs': {1: 'T'},
+        'r_att_cache': {2: 'T_CACHE'},
+        'output': {1: 'T'},
+    }
+    if args['conv_cache']:
+        dynamic_axes['conv_cache'] = {1: 'T_CONV_CACHE'}
+    torch.onnx.export(
+        model, inputs, outpath, opset_version=13,
+        export_params=True, do_constant_folding=True,
+        input_names=input_names, output_names=output_names,
+        dynamic_axes=dynamic_axes, verbose=False)
+    onnx_model = onnx.load(outpath)
+    for (k, v) in args.items():
+        meta = onnx_model.metadata_props.add()
+        meta.key, meta.value = str(k), str(v)
+    onnx.checker.check_model(onnx_model)
+    onnx.save(onnx_model, outpath)
+    print_input_output_info(onnx_model, "onnx_encoder_ctc")
+    print('\t\tExport onnx_encoder_ctc, done! see {}'.format(outpath))
+
+    print("\tStage-4.3: check onnx_encoder_ctc and torch_encoder_ctc")
+    torch_probs = model(*inputs)[0]
+    ort_session = onnxruntime.InferenceSession(outpath)
+    input_names = [node.name for node in onnx_model.graph.input]
+    ort_inputs = {
+        'chunk': to_numpy(chunk),
+        'offset': np.array((offset)).astype(np.int64),
+        'required_cache_size': np.array(
+            (required_cache_size)).astype(np.int64),
+        'att_cache': to_numpy(att_cache),
+        'cnn_cache': to_numpy(cnn_cache),
+        'att_mask': to_numpy(att_mask),
+    }
+    if args['conv_cache']:
+        ort_inputs['conv_cache'] = to_numpy(conv_cache)
+    for k in list(ort_inputs):
+        if k not in input_names:
+            ort_inputs.pop(k)
+    onnx_probs = ort_session.run(['probs'], ort_inputs)[0]
+    np.testing.assert_allclose(to_numpy(torch_probs), onnx_probs,
+                               rtol=1e-03, atol=1e-05)
+    print("\t\tCheck onnx_encoder_ctc, pass!")
+
+
 def export_decoder(asr_model, args):
     print("Stage-3: export decoder")
     decoder = asr_model
@@ -361,6 +542,7 @@ def main():
     arguments['left_chunks'] = args.num_decoding_left_chunks
     arguments['beam'] = args.beam
     arguments['reverse_weight'] = args.reverse_weight
+    arguments['conv_cache'] = 1 if args.conv_cache else 0
     arguments['output_size'] = configs['encoder_conf']['output_size']
     arguments['num_blocks'] = configs['encoder_conf']['num_blocks']
     arguments['cnn_module_kernel'] = configs['encoder_conf']['cnn_module_kernel']
@@ -382,10 +564,14 @@ def main():
 
     if arguments['left_chunks'] > 0:
         assert arguments['chunk_size'] > 0  # -1/4 not supported
+    if arguments['conv_cache']:
+        assert arguments['chunk_size'] > 0  # Only for the streaming chunks
 
     export_encoder(model, arguments)
     export_ctc(model, arguments)
     export_decoder(model, arguments)
+    if args.fuse_ctc:
+        export_encoder_ctc(model, arguments)
 
 if __name__ == '__main__':
     main()
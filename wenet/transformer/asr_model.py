@@ -610,6 +610,90 @@ class ASRModel(torch.nn.Module):
         return self.encoder.forward_chunk(xs, offset, required_cache_size,
                                           att_cache, cnn_cache)
 
+    @torch.jit.export
+    def forward_encoder_chunk_conv_cache(
+        self,
+        xs: torch.Tensor,
+        offset: int,
+        required_cache_size: int,
+        att_cache: torch.Tensor = torch.zeros(0, 0, 0, 0),
+        cnn_cache: torch.Tensor = torch.zeros(0, 0, 0, 0),
+        conv_cache: torch.Tensor = torch.zeros(0, 0, 0),
+    ) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor, torch.Tensor]:
+        """ Export interface for c++ call, `forward_encoder_chunk` with the
+            caches of the conv layers of the subsampling, so a chunk
+            after the first one is only its own `chunk_size * subsample_rate`
+            frames, the overlap with the last chunk is not recomputed.
+
+        Args:
+            conv_cache (torch.Tensor): cache tensor of the conv layers of
+                the subsampling, (b=1, 1, size), empty for the first chunk.
+            Others are the same as `forward_encoder_chunk`.
+
+        Returns:
+            The same as `forward_encoder_chunk`, and
+            torch.Tensor: new conv cache required for next chunk.
+
+        """
+        return self.encoder.forward_chunk_conv_cache(xs, offset,
+                                                     required_cache_size,
+                                                     att_cache, cnn_cache,
+                                                     conv_cache)
+
+    @torch.jit.export
+    def forward_encoder_chunk_batch(
+        self,
+        xs: torch.Tensor,
+        offset: int,
+        required_cache_size: int,
+        att_cache: torch.Tensor = torch.zeros(0, 0, 0, 0, 0),
+        cnn_cache: torch.Tensor = torch.zeros(0, 0, 0, 0),
+    ) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+        """ Export interface for c++ call, batched version of
+            `forward_encoder_chunk` for streams sharing the same offset.
+
+        Args:
+            xs (torch.Tensor): chunk input, with shape (b, time, mel-dim)
+            offset (int): current offset in encoder output time stamp
+            required_cache_size (int): cache size required for next chunk
+            att_cache (torch.Tensor): (elayers, b, head, cache_t1, d_k * 2)
+            cnn_cache (torch.Tensor): (elayers, b, hidden-dim, cache_t2)
+
+        Returns:
+            torch.Tensor: output with shape (b, chunk_size, hidden-dim).
+            torch.Tensor: new attention cache (elayers, b, head, ?, d_k * 2)
+            torch.Tensor: new conformer cnn cache, same shape as cnn_cache.
+
+        """
+        return self.encoder.forward_chunk_batch(xs, offset,
+                                                required_cache_size,
+                                                att_cache, cnn_cache)
+
+    @torch.jit.export
+    def forward_encoder_batch(
+        self,
+        xs: torch.Tensor,
+        xs_lens: torch.Tensor,
+    ) -> Tuple[torch.Tensor, torch.Tensor]:
+        """ Export interface for c++ call, full context (non-streaming)
+            forward of a batch of whole utterances, padded to the longest.
+
+        Args:
+            xs (torch.Tensor): padded input, with shape (b, time, mel-dim)
+            xs_lens (torch.Tensor): length of each input, with shape (b,)
+
+        Returns:
+            torch.Tensor: padded output, with shape (b, time', hidden-dim)
+            torch.Tensor: length of each output, with shape (b,)
+
+        """
+        encoder_out, encoder_mask = self.encoder(
+            xs,
+            xs_lens,
+            decoding_chunk_size=-1,
+            num_decoding_left_chunks=-1)
+        return encoder_out, encoder_mask.squeeze(1).sum(1)
+
     @torch.jit.export
     def ctc_activation(self, xs: torch.Tensor) -> torch.Tensor:
         """ Export interface for c++ call, apply linear transform and log
@@ -693,6 +777,87 @@ class ASRModel(torch.nn.Module):
         r_decoder_out = torch.nn.functional.log_softmax(r_decoder_out, dim=-1)
         return decoder_out, r_decoder_out
 
+    @torch.jit.export
+    def forward_attention_decoder_batch(
+        self,
+        hyps: torch.Tensor,
+        hyps_lens: torch.Tensor,
+        encoder_out: torch.Tensor,
+        encoder_lens: torch.Tensor,
+        reverse_weight: float = 0,
+    ) -> Tuple[torch.Tensor, torch.Tensor]:
+        """ Export interface for c++ call, forward decoder with hypothesis
+            from several utterances in one batch, it's the batched version
+            of `forward_attention_decoder`
+        Args:
+            hyps (torch.Tensor): hyps of all utterances, already pad sos at
+                the begining, (num_hyps, max_hyps_len)
+            hyps_lens (torch.Tensor): length of each hyp in hyps
+            encoder_out (torch.Tensor): padded encoder output of the
+                utterance each hyp belongs to, (num_hyps, max_time, dim)
+            encoder_lens (torch.Tensor): valid length of each encoder_out
+            reverse_weight: used for verfing whether used right to left
+                decoder, > 0 will use.
+
+        Returns:
+            torch.Tensor: decoder output
+        """
+        num_hyps = hyps.size(0)
+        assert hyps_lens.size(0) == num_hyps
+        assert encoder_out.size(0) == num_hyps
+        encoder_mask = ~make_pad_mask(encoder_lens,
+                                      encoder_out.size(1)).unsqueeze(1)
+        r_hyps = torch.cat([
+            torch.cat((y.int()[0:1], torch.flip(y.int()[1:i], [0]),
+                       y.int()[i:].fill_(self.eos)), dim=-1).unsqueeze(0)
+            for y, i in zip(hyps, hyps_lens)
+        ], dim=0)
+        decoder_out, r_decoder_out, _ = self.decoder(
+            encoder_out, encoder_mask, hyps, hyps_lens, r_hyps,
+            reverse_weight)  # (num_hyps, max_hyps_len, vocab_size)
+        decoder_out = torch.nn.functional.log_softmax(decoder_out, dim=-1)
+        r_decoder_out = torch.nn.functional.log_softmax(r_decoder_out, dim=-1)
+        return decoder_out, r_decoder_out
+
+    @torch.jit.export
+    def forward_attention_decoder_prefix(
+        self,
+        hyps: torch.Tensor,
+        encoder_out: torch.Tensor,
+        cache: torch.Tensor,
+    ) -> Tuple[torch.Tensor, torch.Tensor]:
+        """ Export interface for c++ call, forward the left to right
+            decoder with hyps which share a cached prefix, so the rescoring
+            of a long utterance could be done incrementally
+        Args:
+            hyps (torch.Tensor): hyps of the same length, already pad sos at
+                the begining, (num_hyps, hyps_len)
+            encoder_out (torch.Tensor): corresponding encoder output,
+                (1, time, dim)
+            cache (torch.Tensor): decoder states of the first cached_len
+                tokens of hyps, returned by the previous call,
+                (num_blocks, num_hyps, cached_len, dim), cached_len is 0 if
+                there is no cache
+
+        Returns:
+            torch.Tensor: decoder output of the tokens after the cached ones,
+                (num_hyps, hyps_len - cached_len, vocab_size)
+            torch.Tensor: decoder states of all tokens of hyps,
+                (num_blocks, num_hyps, hyps_len, dim)
+        """
+        assert encoder_out.size(0) == 1
+        num_hyps = hyps.size(0)
+        encoder_out = encoder_out.repeat(num_hyps, 1, 1)
+        encoder_mask = torch.ones(num_hyps,
+                                  1,
+                                  encoder_out.size(1),
+                                  dtype=torch.bool,
+                                  device=encoder_out.device)
+        decoder_out, new_cache = self.decoder.forward_prefix(
+            encoder_out, encoder_mask, hyps, cache)
+        decoder_out = torch.nn.functional.log_softmax(decoder_out, dim=-1)
+        return decoder_out, new_cache
+
 
 def init_asr_model(configs):
     if configs['cmvn_file'] is not None:
@@ -172,6 +172,50 @@ class TransformerDecoder(torch.nn.Module):
             y = torch.log_softmax(self.output_layer(y), dim=-1)
         return y, new_cache
 
+    def forward_prefix(
+        self,
+        memory: torch.Tensor,
+        memory_mask: torch.Tensor,
+        tgt: torch.Tensor,
+        cache: torch.Tensor,
+    ) -> Tuple[torch.Tensor, torch.Tensor]:
+        """Forward the tokens after a cached prefix.
+            This is only used for the incremental rescoring of the runtime.
+        Args:
+            memory: encoded memory, float32  (batch, maxlen_in, feat)
+            memory_mask: encoded memory mask, (batch, 1, maxlen_in)
+            tgt: input token ids of the whole hyps, int64 (batch, maxlen_out)
+            cache: output of each block for the first maxlen_cached tokens,
+                (num_blocks, batch, maxlen_cached, size), maxlen_cached is 0
+                if there is no cache
+        Returns:
+            x: decoded token score before softmax of the tokens after the
+                cached ones (batch, maxlen_out - maxlen_cached, vocab_size)
+                if use_output_layer is True
+            new_cache: (num_blocks, batch, maxlen_out, size)
+        """
+        num_cached = cache.size(2)
+        # tgt_mask: (1, L, L), the hyps are not padded
+        tgt_mask = subsequent_mask(tgt.size(1), device=tgt.device).unsqueeze(0)
+        x, _ = self.embed(tgt)
+        new_cache = []
+        for i, decoder in enumerate(self.decoders):
+            c: Optional[torch.Tensor] = None
+            if num_cached > 0:
+                c = cache[i]
+            x, tgt_mask, memory, memory_mask = decoder(x,
+                                                       tgt_mask,
+                                                       memory,
+                                                       memory_mask,
+                                                       cache=c)
+            new_cache.append(x)
+        x = x[:, num_cached:]
+        if self.normalize_before:
+            x = self.after_norm(x)
+        if self.use_output_layer:
+            x = self.output_layer(x)
+        return x, torch.stack(new_cache, dim=0)
+
 
 class BiTransformerDecoder(torch.nn.Module):
     """Base class of Transfomer decoder module.
@@ -285,3 +329,16 @@ class BiTransformerDecoder(torch.nn.Module):
         """
         return self.left_decoder.forward_one_step(memory, memory_mask, tgt,
                                                   tgt_mask, cache)
+
+    def forward_prefix(
+        self,
+        memory: torch.Tensor,
+        memory_mask: torch.Tensor,
+        tgt: torch.Tensor,
+        cache: torch.Tensor,
+    ) -> Tuple[torch.Tensor, torch.Tensor]:
+        """Forward the tokens after a cached prefix by the left to right
+            decoder, see TransformerDecoder.forward_prefix
+        """
+        return self.left_decoder.forward_prefix(memory, memory_mask, tgt,
+                                                cache)
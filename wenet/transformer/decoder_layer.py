@@ -73,8 +73,9 @@ class DecoderLayer(nn.Module):
                 (#batch, maxlen_in, size).
             memory_mask (torch.Tensor): Encoded memory mask
                 (#batch, maxlen_in).
-            cache (torch.Tensor): cached tensors.
-                (#batch, maxlen_out - 1, size).
+            cache (torch.Tensor): cached tensors of the first tokens,
+                usually all but the last one.
+                (#batch, maxlen_cached < maxlen_out, size).
 
         Returns:
             torch.Tensor: Output tensor (#batch, maxlen_out, size).
@@ -91,15 +92,15 @@ class DecoderLayer(nn.Module):
             tgt_q = tgt
             tgt_q_mask = tgt_mask
         else:
-            # compute only the last frame query keeping dim: max_time_out -> 1
-            assert cache.shape == (
-                tgt.shape[0],
-                tgt.shape[1] - 1,
-                self.size,
-            ), "{cache.shape} == {(tgt.shape[0], tgt.shape[1] - 1, self.size)}"
-            tgt_q = tgt[:, -1:, :]
-            residual = residual[:, -1:, :]
-            tgt_q_mask = tgt_mask[:, -1:, :]
+            # compute only the query of the frames after the cached ones
+            # keeping dim: max_time_out -> max_time_out - maxlen_cached
+            num_cached = cache.size(1)
+            assert cache.size(0) == tgt.size(0) and \
+                num_cached < tgt.size(1) and cache.size(2) == self.size, \
+                "{cache.shape} < {(tgt.shape[0], tgt.shape[1], self.size)}"
+            tgt_q = tgt[:, num_cached:, :]
+            residual = residual[:, num_cached:, :]
+            tgt_q_mask = tgt_mask[:, num_cached:, :]
 
         if self.concat_after:
             tgt_concat = torch.cat(
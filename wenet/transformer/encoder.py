@@ -218,6 +218,58 @@ class BaseEncoder(torch.nn.Module):
         # NOTE(xcsong): Before embed, shape(xs) is (b=1, time, mel-dim)
         xs, pos_emb, _ = self.embed(xs, tmp_masks, offset)
         # NOTE(xcsong): After  embed, shape(xs) is (b=1, chunk_size, hidden-dim)
+        return self._forward_chunk_layers(xs, offset, required_cache_size,
+                                          att_cache, cnn_cache, att_mask)
+
+    def forward_chunk_conv_cache(
+        self,
+        xs: torch.Tensor,
+        offset: int,
+        required_cache_size: int,
+        att_cache: torch.Tensor = torch.zeros(0, 0, 0, 0),
+        cnn_cache: torch.Tensor = torch.zeros(0, 0, 0, 0),
+        conv_cache: torch.Tensor = torch.zeros(0, 0, 0),
+        att_mask: torch.Tensor = torch.ones((0, 0, 0), dtype=torch.bool),
+    ) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor, torch.Tensor]:
+        """ Forward just one chunk like `forward_chunk`, but the overlap
+            with the last chunk is spliced from the caches of the conv
+            layers of the subsampling instead of being recomputed.
+
+        Args:
+            xs (torch.Tensor): chunk input, with shape (b=1, time, mel-dim),
+                where `time == chunk_size * subsample_rate`, the first chunk
+                has `subsample.right_context + 1 - subsample_rate` more.
+            conv_cache (torch.Tensor): cache tensor of the conv layers of
+                the subsampling, (b=1, 1, size), it's empty or
+                (b=1, 0, size) for the first chunk.
+            Others are the same as `forward_chunk`.
+
+        Returns:
+            The same as `forward_chunk`, and
+            torch.Tensor: new conv cache required for next chunk,
+                (b=1, 1, size).
+
+        """
+        assert xs.size(0) == 1
+        if self.global_cmvn is not None:
+            xs = self.global_cmvn(xs)
+        xs, _, r_conv_cache = self.embed.forward_chunk(xs, offset, conv_cache)
+        xs, r_att_cache, r_cnn_cache = self._forward_chunk_layers(
+            xs, offset, required_cache_size, att_cache, cnn_cache, att_mask)
+        return (xs, r_att_cache, r_cnn_cache, r_conv_cache)
+
+    def _forward_chunk_layers(
+        self,
+        xs: torch.Tensor,
+        offset: int,
+        required_cache_size: int,
+        att_cache: torch.Tensor,
+        cnn_cache: torch.Tensor,
+        att_mask: torch.Tensor,
+    ) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+        """ The encoder layers of `forward_chunk`, xs is the output of
+            the subsampling, (b=1, chunk_size, hidden-dim)
+        """
         elayers, cache_t1 = att_cache.size(0), att_cache.size(2)
         chunk_size = xs.size(1)
         attention_key_size = cache_t1 + chunk_size
@@ -256,6 +308,82 @@ class BaseEncoder(torch.nn.Module):
 
         return (xs, r_att_cache, r_cnn_cache)
 
+    def forward_chunk_batch(
+        self,
+        xs: torch.Tensor,
+        offset: int,
+        required_cache_size: int,
+        att_cache: torch.Tensor = torch.zeros(0, 0, 0, 0, 0),
+        cnn_cache: torch.Tensor = torch.zeros(0, 0, 0, 0),
+    ) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+        """ Forward one chunk for a batch of streams sharing the same offset
+
+        It's the batched version of `forward_chunk`, used by the runtime to
+        run chunks from several decoding sessions in one call. All the streams
+        in the batch must have the same offset and the same cache size.
+
+        Args:
+            xs (torch.Tensor): chunk input, with shape (b, time, mel-dim)
+            offset (int): current offset in encoder output time stamp
+            required_cache_size (int): cache size required for next chunk
+                compuation, same as `forward_chunk`
+            att_cache (torch.Tensor): cache tensor for KEY & VALUE in
+                transformer/conformer attention, with shape
+                (elayers, b, head, cache_t1, d_k * 2)
+            cnn_cache (torch.Tensor): cache tensor for cnn_module in conformer,
+                (elayers, b, hidden-dim, cache_t2)
+
+        Returns:
+            torch.Tensor: output of current input xs,
+                with shape (b, chunk_size, hidden-dim).
+            torch.Tensor: new attention cache required for next chunk, with
+                dynamic shape (elayers, b, head, ?, d_k * 2)
+            torch.Tensor: new conformer cnn cache required for next chunk, with
+                same shape as the original cnn_cache.
+
+        """
+        tmp_masks = torch.ones(xs.size(0),
+                               xs.size(1),
+                               device=xs.device,
+                               dtype=torch.bool)
+        tmp_masks = tmp_masks.unsqueeze(1)
+        if self.global_cmvn is not None:
+            xs = self.global_cmvn(xs)
+        xs, pos_emb, _ = self.embed(xs, tmp_masks, offset)
+        elayers, cache_t1 = att_cache.size(0), att_cache.size(3)
+        chunk_size = xs.size(1)
+        attention_key_size = cache_t1 + chunk_size
+        pos_emb = self.embed.position_encoding(
+            offset=offset - cache_t1, size=attention_key_size)
+        if required_cache_size < 0:
+            next_cache_start = 0
+        elif required_cache_size == 0:
+            next_cache_start = attention_key_size
+        else:
+            next_cache_start = max(attention_key_size - required_cache_size, 0)
+        att_mask = torch.ones((0, 0, 0), dtype=torch.bool)
+        r_att_cache = []
+        r_cnn_cache = []
+        for i, layer in enumerate(self.encoders):
+            # NOTE: shape(att_cache[i]) is (b, head, cache_t1, d_k * 2),
+            #   shape(cnn_cache[i]) is (b, hidden-dim, cache_t2)
+            xs, _, new_att_cache, new_cnn_cache = layer(
+                xs, att_mask, pos_emb,
+                att_cache=att_cache[i] if elayers > 0 else
+                torch.zeros((0, 0, 0, 0)),
+                cnn_cache=cnn_cache[i] if cnn_cache.size(0) > 0 else cnn_cache
+            )
+            r_att_cache.append(
+                new_att_cache[:, :, next_cache_start:, :].unsqueeze(0))
+            r_cnn_cache.append(new_cnn_cache.unsqueeze(0))
+        if self.normalize_before:
+            xs = self.after_norm(xs)
+
+        r_att_cache = torch.cat(r_att_cache, dim=0)
+        r_cnn_cache = torch.cat(r_cnn_cache, dim=0)
+
+        return (xs, r_att_cache, r_cnn_cache)
+
     def forward_chunk_by_chunk(
         self,
         xs: torch.Tensor,
@@ -19,6 +19,36 @@ class BaseSubsampling(torch.nn.Module):
     def position_encoding(self, offset: int, size: int) -> torch.Tensor:
         return self.pos_enc.position_encoding(offset, size)
 
+    def splice_conv_cache(
+            self, x: torch.Tensor, conv_cache: torch.Tensor, start: int,
+            context: int) -> Tuple[torch.Tensor, torch.Tensor]:
+        """Prepend the cached input frames of one conv layer to x.
+
+        When the chunks are multiples of the subsampling rate, the last
+        `kernel_size - stride` input frames of a conv layer are not consumed
+        by its last output, they are the whole overlap with the next chunk.
+
+        Args:
+            x (torch.Tensor): Input of the conv layer (#batch, c, time, f).
+            conv_cache (torch.Tensor): Caches of all the conv layers,
+                (#batch, 1, size), or (#batch, 0, size) for the first chunk.
+            start (int): Where the cache of this layer is in conv_cache.
+            context (int): kernel_size - stride of this layer.
+
+        Returns:
+            torch.Tensor: Spliced input (#batch, c, time + context, f), or x
+                for the first chunk.
+            torch.Tensor: New cache of this layer (#batch, 1, c*context*f).
+        """
+        b, c, _, f = x.size()
+        size = c * context * f
+        # Reshaped by the size of dim 1, so it's traced for the ONNX export
+        cache = conv_cache[:, :, start:start + size].reshape(
+            b, c, conv_cache.size(1) * context, f)
+        x = torch.cat((cache, x), dim=2)
+        new_cache = x[:, :, x.size(2) - context:, :].reshape(b, 1, size)
+        return x, new_cache
+
 
 class LinearNoSubsampling(BaseSubsampling):
     """Linear transform the input without subsampling
@@ -65,6 +95,20 @@ class LinearNoSubsampling(BaseSubsampling):
         x, pos_emb = self.pos_enc(x, offset)
         return x, pos_emb, x_mask
 
+    def forward_chunk(
+            self, x: torch.Tensor, offset: int, conv_cache: torch.Tensor
+    ) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+        """Input one chunk x, there is nothing to cache.
+
+        Returns:
+            torch.Tensor: linear input tensor (#batch, time, odim).
+            torch.Tensor: positional encoding.
+            torch.Tensor: empty conv cache (#batch, 1, 0).
+        """
+        x = self.out(x)
+        x, pos_emb = self.pos_enc(x, offset)
+        return x, pos_emb, torch.zeros((x.size(0), 1, 0), device=x.device)
+
 
 class Conv2dSubsampling4(BaseSubsampling):
     """Convolutional 2D subsampling (to 1/4 length).
@@ -121,6 +165,35 @@ class Conv2dSubsampling4(BaseSubsampling):
         x, pos_emb = self.pos_enc(x, offset)
         return x, pos_emb, x_mask[:, :, :-2:2][:, :, :-2:2]
 
+    def forward_chunk(
+            self, x: torch.Tensor, offset: int, conv_cache: torch.Tensor
+    ) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+        """Subsample one chunk x of a stream, the overlap with the last
+        chunk is spliced from conv_cache instead of being computed again.
+
+        Args:
+            x (torch.Tensor): Input tensor (#batch, time, idim), the first
+                chunk has right_context + 1 - subsampling_rate more frames.
+            offset (int): Offset of the output in the stream.
+            conv_cache (torch.Tensor): See splice_conv_cache().
+
+        Returns:
+            torch.Tensor: Subsampled tensor (#batch, time', odim),
+                where time' = time // 4.
+            torch.Tensor: positional encoding
+            torch.Tensor: New conv cache, (#batch, 1, size).
+        """
+        x = x.unsqueeze(1)  # (b, c=1, t, f)
+        # 1 = 3 - 2 for both of the conv layers
+        x, cache1 = self.splice_conv_cache(x, conv_cache, 0, 1)
+        x = self.conv[1](self.conv[0](x))
+        x, cache2 = self.splice_conv_cache(x, conv_cache, cache1.size(2), 1)
+        x = self.conv[3](self.conv[2](x))
+        b, c, t, f = x.size()
+        x = self.out(x.transpose(1, 2).contiguous().view(b, t, c * f))
+        x, pos_emb = self.pos_enc(x, offset)
+        return x, pos_emb, torch.cat((cache1, cache2), dim=2)
+
 
 class Conv2dSubsampling6(BaseSubsampling):
     """Convolutional 2D subsampling (to 1/6 length).
@@ -172,6 +245,35 @@ class Conv2dSubsampling6(BaseSubsampling):
         x, pos_emb = self.pos_enc(x, offset)
         return x, pos_emb, x_mask[:, :, :-2:2][:, :, :-4:3]
 
+    def forward_chunk(
+            self, x: torch.Tensor, offset: int, conv_cache: torch.Tensor
+    ) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+        """Subsample one chunk x of a stream, the overlap with the last
+        chunk is spliced from conv_cache instead of being computed again.
+
+        Args:
+            x (torch.Tensor): Input tensor (#batch, time, idim), the first
+                chunk has right_context + 1 - subsampling_rate more frames.
+            offset (int): Offset of the output in the stream.
+            conv_cache (torch.Tensor): See splice_conv_cache().
+
+        Returns:
+            torch.Tensor: Subsampled tensor (#batch, time', odim),
+                where time' = time // 6.
+            torch.Tensor: positional encoding
+            torch.Tensor: New conv cache, (#batch, 1, size).
+        """
+        x = x.unsqueeze(1)  # (b, c, t, f)
+        # 1 = 3 - 2, 2 = 5 - 3
+        x, cache1 = self.splice_conv_cache(x, conv_cache, 0, 1)
+        x = self.conv[1](self.conv[0](x))
+        x, cache2 = self.splice_conv_cache(x, conv_cache, cache1.size(2), 2)
+        x = self.conv[3](self.conv[2](x))
+        b, c, t, f = x.size()
+        x = self.linear(x.transpose(1, 2).contiguous().view(b, t, c * f))
+        x, pos_emb = self.pos_enc(x, offset)
+        return x, pos_emb, torch.cat((cache1, cache2), dim=2)
+
 
 class Conv2dSubsampling8(BaseSubsampling):
     """Convolutional 2D subsampling (to 1/8 length).
@@ -226,3 +328,36 @@ class Conv2dSubsampling8(BaseSubsampling):
         x = self.linear(x.transpose(1, 2).contiguous().view(b, t, c * f))
         x, pos_emb = self.pos_enc(x, offset)
         return x, pos_emb, x_mask[:, :, :-2:2][:, :, :-2:2][:, :, :-2:2]
+
+    def forward_chunk(
+            self, x: torch.Tensor, offset: int, conv_cache: torch.Tensor
+    ) -> Tuple[torch.Tensor, torch.Tensor, torch.Tensor]:
+        """Subsample one chunk x of a stream, the overlap with the last
+        chunk is spliced from conv_cache instead of being computed again.
+
+        Args:
+            x (torch.Tensor): Input tensor (#batch, time, idim), the first
+                chunk has right_context + 1 - subsampling_rate more frames.
+            offset (int): Offset of the output in the stream.
+            conv_cache (torch.Tensor): See splice_conv_cache().
+
+        Returns:
+            torch.Tensor: Subsampled tensor (#batch, time', odim),
+                where time' = time // 8.
+            torch.Tensor: positional encoding
+            torch.Tensor: New conv cache, (#batch, 1, size).
+        """
+        x = x.unsqueeze(1)  # (b, c, t, f)
+        # 1 = 3 - 2 for all the conv layers
+        x, cache1 = self.splice_conv_cache(x, conv_cache, 0, 1)
+        x = self.conv[1](self.conv[0](x))
+        start = cache1.size(2)
+        x, cache2 = self.splice_conv_cache(x, conv_cache, start, 1)
+        x = self.conv[3](self.conv[2](x))
+        start += cache2.size(2)
+        x, cache3 = self.splice_conv_cache(x, conv_cache, start, 1)
+        x = self.conv[5](self.conv[4](x))
+        b, c, t, f = x.size()
+        x = self.linear(x.transpose(1, 2).contiguous().view(b, t, c * f))
+        x, pos_emb = self.pos_enc(x, offset)
+        return x, pos_emb, torch.cat((cache1, cache2, cache3), dim=2)